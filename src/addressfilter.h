@@ -0,0 +1,89 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - AddressFilter Class Definition
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#ifndef VLDBUILD
+#error \
+"This header should only be included by Visual Leak Detector when building it from source. \
+Applications should never include this header."
+#endif
+
+#include <windows.h>
+#include "shardmap.h" // Provides ShardIndex.
+
+#define ADDRESSFILTER_COUNTERS 65536 // Number of counters (power of two).
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The AddressFilter Class
+//
+//  Tells, without any lock, that an address certainly isn't the address of a
+//  tracked block. Each address hashes to one of ADDRESSFILTER_COUNTERS
+//  counters, which counts the tracked blocks hashing to it: a counting Bloom
+//  filter with a single hash. A zero counter rules the address out; any other
+//  value only means the block maps (and pending buffers) have to be searched.
+//
+//  Every Add must be matched by exactly one Remove, or the counters drift:
+//  an extra Remove could rule out a tracked block.
+//
+//  Until the filter is enabled it rules nothing out, and it must be enabled
+//  before the first block is tracked, if at all. The counters are allocated
+//  with VirtualAlloc and never freed, since the heap hooks may consult them
+//  while VLD unloads.
+//
+class AddressFilter
+{
+public:
+    AddressFilter () : m_counters(NULL) { }
+
+    BOOL Enable ()
+    {
+        m_counters = (LONG volatile*)VirtualAlloc(NULL, ADDRESSFILTER_COUNTERS * sizeof(LONG),
+            MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        return m_counters != NULL;
+    }
+    bool IsEnabled () const { return m_counters != NULL; }
+
+    VOID Add (LPCVOID address)
+    {
+        if (m_counters != NULL)
+            InterlockedIncrement(&m_counters[ShardIndex(address, ADDRESSFILTER_COUNTERS)]);
+    }
+    VOID Remove (LPCVOID address)
+    {
+        if (m_counters != NULL)
+            InterlockedDecrement(&m_counters[ShardIndex(address, ADDRESSFILTER_COUNTERS)]);
+    }
+    bool MayContain (LPCVOID address) const
+    {
+        return (m_counters == NULL) || (m_counters[ShardIndex(address, ADDRESSFILTER_COUNTERS)] != 0);
+    }
+
+private:
+    // Don't allow this!!
+    AddressFilter (const AddressFilter &other);
+    AddressFilter& operator = (const AddressFilter &other);
+
+    LONG volatile *m_counters; // Tracked blocks by address hash, or NULL if the filter is disabled.
+};
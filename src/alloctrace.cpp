@@ -0,0 +1,352 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Allocation Trace Recorder
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#define VLDBUILD
+#include "vldheap.h"    // Provides internal new and delete operators.
+#include "vldint.h"     // Provides access to VLD internals.
+
+// Imported global variables.
+extern CallStackTable g_callStackTable;
+
+// startAllocTrace - Creates the allocation trace file, maps its first window
+//   and creates the thread which drains the threads' event rings into it. If
+//   the file can't be created, VLD runs without recording.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::startAllocTrace ()
+{
+    m_allocTraceFile = CreateFileW(m_allocTraceFilePath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+        CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m_allocTraceFile == INVALID_HANDLE_VALUE) {
+        Report(L"WARNING: Visual Leak Detector: Couldn't create the allocation trace file %s.\n", m_allocTraceFilePath);
+        return;
+    }
+    if (!mapAllocTraceWindow(0)) {
+        if (m_allocTraceMapping != NULL)
+            CloseHandle(m_allocTraceMapping);
+        m_allocTraceMapping = NULL;
+        CloseHandle(m_allocTraceFile);
+        m_allocTraceFile = INVALID_HANDLE_VALUE;
+        return;
+    }
+
+    // The header is only filled in once the trace is stopped; its room is
+    // kept at the start of the file.
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    vldatrace_header_t &header = m_allocTraceHeader;
+    ZeroMemory(&header, sizeof(header));
+    header.magic            = VLDATRACE_MAGIC;
+    header.version          = VLDATRACE_VERSION;
+    header.pointerSize      = sizeof(LPVOID);
+    header.processId        = GetCurrentProcessId();
+    header.eventOffset      = sizeof(vldatrace_header_t);
+    header.startTicks       = __rdtsc();
+    header.startCounter     = (UINT64)counter.QuadPart;
+    header.counterFrequency = (UINT64)frequency.QuadPart;
+    m_allocTraceOffset = sizeof(vldatrace_header_t);
+    m_allocTraceEvents = 0;
+
+    m_allocTraceWake = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (m_allocTraceWake != NULL)
+        m_allocTraceThread = CreateThread(NULL, 0, allocTraceProc, this, 0, &m_allocTraceThreadId);
+    // Without the thread, the rings are only drained when they fill up and
+    // when the trace stops.
+    m_allocTracing = TRUE;
+}
+
+// stopAllocTrace - Stops recording, drains every ring, then writes the table
+//   of the call stacks the events refer to and the header, and closes the
+//   allocation trace file.
+//
+//   Note: Like stopTelemetry, this never waits for the thread to exit, only
+//     for it to finish the drain it may be making.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::stopAllocTrace ()
+{
+    if (m_allocTraceFile == INVALID_HANDLE_VALUE)
+        return;
+
+    m_allocTracing = FALSE;
+    if (m_allocTraceThread != NULL) {
+        SetEvent(m_allocTraceWake);
+        if (WaitForSingleObject(m_allocTraceThread, 0) == WAIT_OBJECT_0) {
+            CloseHandle(m_allocTraceWake);
+            m_allocTraceWake = NULL;
+        }
+        CloseHandle(m_allocTraceThread);
+        m_allocTraceThread = NULL;
+        m_allocTraceThreadId = 0;
+    }
+    else if (m_allocTraceWake != NULL) {
+        CloseHandle(m_allocTraceWake);
+        m_allocTraceWake = NULL;
+    }
+    drainAllocRings();
+
+    CriticalSectionLocker<> cs(m_allocTraceLock);
+    vldatrace_header_t &header = m_allocTraceHeader;
+    header.eventCount  = m_allocTraceEvents;
+    header.stackOffset = m_allocTraceOffset;
+
+    // The events refer to call stacks by address. Site statistics keep every
+    // interned stack, so each address names one stack for the whole run.
+    UINT32 capacity = g_callStackTable.Count();
+    CallStack **stacks = new CallStack* [capacity + 1];
+    UINT32 stackCount = g_callStackTable.Collect(stacks, capacity);
+    for (UINT32 index = 0; index < stackCount; index++) {
+        const CallStack *stack = stacks[index];
+        vldatrace_stack_t record;
+        record.id         = (UINT64)(UINT_PTR)stack;
+        record.hash       = stack->getHashValue();
+        record.frameCount = stack->size();
+        appendAllocTrace(&record, sizeof(record));
+        for (UINT32 frame = 0; frame < record.frameCount; frame++) {
+            UINT64 pc = (*stack)[frame];
+            appendAllocTrace(&pc, sizeof(pc));
+        }
+        g_callStackTable.Release(stacks[index]);
+    }
+    delete [] stacks;
+    header.stackCount = stackCount;
+
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    header.endTicks   = __rdtsc();
+    header.endCounter = (UINT64)counter.QuadPart;
+
+    if (m_allocTraceView != NULL)
+        UnmapViewOfFile(m_allocTraceView);
+    if (m_allocTraceMapping != NULL)
+        CloseHandle(m_allocTraceMapping);
+    m_allocTraceView = NULL;
+    m_allocTraceMapping = NULL;
+
+    // Cut the file at the end of the data, since the last window was mapped
+    // whole, then write the header over the room kept for it.
+    LARGE_INTEGER end;
+    end.QuadPart = (LONGLONG)m_allocTraceOffset;
+    SetFilePointerEx(m_allocTraceFile, end, NULL, FILE_BEGIN);
+    SetEndOfFile(m_allocTraceFile);
+    end.QuadPart = 0;
+    SetFilePointerEx(m_allocTraceFile, end, NULL, FILE_BEGIN);
+    DWORD written;
+    WriteFile(m_allocTraceFile, &header, sizeof(header), &written, NULL);
+    CloseHandle(m_allocTraceFile);
+    m_allocTraceFile = INVALID_HANDLE_VALUE;
+}
+
+// allocTraceProc - Drains the threads' event rings every
+//   VLD_ALLOCTRACE_INTERVAL milliseconds until the trace is stopped.
+//
+//  - param (IN): The VisualLeakDetector.
+//
+//  Return Value:
+//
+//    Always returns 0.
+//
+DWORD WINAPI VisualLeakDetector::allocTraceProc (LPVOID param)
+{
+    VisualLeakDetector *vld = (VisualLeakDetector*)param;
+    while (WaitForSingleObject(vld->m_allocTraceWake, VLD_ALLOCTRACE_INTERVAL) == WAIT_TIMEOUT) {
+        if (!vld->m_allocTracing)
+            break;
+        vld->drainAllocRings();
+    }
+    return 0;
+}
+
+// recordAllocTrace - Appends an event to the calling thread's ring. Only the
+//   owning thread ever appends to a ring, so this takes no lock unless the
+//   ring is full, in which case the thread drains it itself. Nothing is taken
+//   after m_allocTraceLock, so the caller may hold any other lock.
+//
+//  - tls (IN/OUT): The calling thread's TLS.
+//
+//  - op (IN): One of the VLDATRACE_* operations.
+//
+//  - heap (IN): Handle of the heap.
+//
+//  - mem (IN): Address of the block, or NULL for a heap event.
+//
+//  - size (IN): Size, in bytes, of the block.
+//
+//  - stack (IN): The block's interned call stack, or NULL.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::recordAllocTrace (tls_t *tls, UINT8 op, HANDLE heap, LPCVOID mem, SIZE_T size,
+    const CallStack *stack)
+{
+    allocring_t *ring = tls->allocTrace;
+    if (ring == NULL) {
+        ring = new allocring_t;
+        ring->head = 0;
+        ring->tail = 0;
+        InterlockedExchangePointer((PVOID volatile*)&tls->allocTrace, ring);
+    }
+
+    UINT32 head = ring->head;
+    if (head - ring->tail == VLD_ALLOCTRACE_RING) {
+        CriticalSectionLocker<> cs(m_allocTraceLock);
+        drainAllocRing(ring);
+    }
+    vldatrace_event_t &event = ring->events[head & (VLD_ALLOCTRACE_RING - 1)];
+    event.op          = op;
+    event.reserved[0] = 0;
+    event.reserved[1] = 0;
+    event.reserved[2] = 0;
+    event.threadId    = tls->threadId;
+    event.timestamp   = __rdtsc();
+    event.heap        = (UINT64)(UINT_PTR)heap;
+    event.address     = (UINT64)(UINT_PTR)mem;
+    event.size        = size;
+    event.stack       = (UINT64)(UINT_PTR)stack;
+    // The event must be complete before the drain can see it.
+    MemoryBarrier();
+    ring->head = head + 1;
+}
+
+// drainAllocRing - Writes the events of a thread's ring to the allocation
+//   trace file. Events drained after the file is closed, or which don't fit
+//   in it, are dropped. The caller must hold m_allocTraceLock.
+//
+//  - ring (IN/OUT): The ring. This may be another thread's.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::drainAllocRing (allocring_t *ring)
+{
+    UINT32 tail = ring->tail;
+    UINT32 head = ring->head;
+    MemoryBarrier();
+    while (tail != head) {
+        // Write the events up to the end of the ring at once.
+        UINT32 first = tail & (VLD_ALLOCTRACE_RING - 1);
+        UINT32 count = min(head - tail, VLD_ALLOCTRACE_RING - first);
+        if ((m_allocTraceFile != INVALID_HANDLE_VALUE) &&
+            appendAllocTrace(&ring->events[first], count * sizeof(vldatrace_event_t)))
+            m_allocTraceEvents += count;
+        tail += count;
+    }
+    // The events must be copied before the owner can overwrite them.
+    MemoryBarrier();
+    ring->tail = tail;
+}
+
+// drainAllocRings - Drains the rings of every running thread. The rings of
+//   exited threads were drained by retireTls.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::drainAllocRings ()
+{
+    CriticalSectionLocker<> cs(m_tlsLock);
+    CriticalSectionLocker<> tl(m_allocTraceLock);
+    for (TlsMap::Iterator tlsit = m_tlsMap->begin(); tlsit != m_tlsMap->end(); ++tlsit) {
+        allocring_t *ring = (*tlsit).second->allocTrace;
+        if (ring != NULL)
+            drainAllocRing(ring);
+    }
+}
+
+// appendAllocTrace - Copies bytes to the end of the allocation trace file,
+//   mapping its next windows as needed. The caller must hold
+//   m_allocTraceLock.
+//
+//  - data (IN): The bytes.
+//
+//  - size (IN): Number of bytes.
+//
+//  Return Value:
+//
+//    Returns true if the bytes were written, or false if the file couldn't
+//    be mapped any further.
+//
+bool VisualLeakDetector::appendAllocTrace (const VOID *data, SIZE_T size)
+{
+    const BYTE *bytes = (const BYTE*)data;
+    while (size != 0) {
+        if ((m_allocTraceView == NULL) ||
+            ((m_allocTraceOffset == m_allocTraceWindow + VLD_ALLOCTRACE_WINDOW) &&
+            !mapAllocTraceWindow(m_allocTraceOffset)))
+            return false;
+        SIZE_T room = (SIZE_T)(m_allocTraceWindow + VLD_ALLOCTRACE_WINDOW - m_allocTraceOffset);
+        SIZE_T count = min(size, room);
+        memcpy(m_allocTraceView + (SIZE_T)(m_allocTraceOffset - m_allocTraceWindow), bytes, count);
+        m_allocTraceOffset += count;
+        bytes += count;
+        size -= count;
+    }
+    return true;
+}
+
+// mapAllocTraceWindow - Grows the allocation trace file by a window and maps
+//   that window in place of the current one. If it can't be mapped, the
+//   trace is cut short there.
+//
+//  - offset (IN): File offset of the window. A multiple of
+//      VLD_ALLOCTRACE_WINDOW.
+//
+//  Return Value:
+//
+//    Returns true if the window was mapped.
+//
+bool VisualLeakDetector::mapAllocTraceWindow (UINT64 offset)
+{
+    if (m_allocTraceView != NULL)
+        UnmapViewOfFile(m_allocTraceView);
+    if (m_allocTraceMapping != NULL)
+        CloseHandle(m_allocTraceMapping);
+    m_allocTraceView = NULL;
+
+    UINT64 end = offset + VLD_ALLOCTRACE_WINDOW;
+    m_allocTraceMapping = CreateFileMappingW(m_allocTraceFile, NULL, PAGE_READWRITE,
+        (DWORD)(end >> 32), (DWORD)end, NULL);
+    if (m_allocTraceMapping != NULL) {
+        m_allocTraceView = (BYTE*)MapViewOfFile(m_allocTraceMapping, FILE_MAP_WRITE,
+            (DWORD)(offset >> 32), (DWORD)offset, VLD_ALLOCTRACE_WINDOW);
+    }
+    if (m_allocTraceView == NULL) {
+        Report(L"WARNING: Visual Leak Detector: Couldn't map the allocation trace file %s;"
+            L" the trace ends here.\n", m_allocTraceFilePath);
+        return false;
+    }
+    m_allocTraceWindow = offset;
+    return true;
+}
@@ -0,0 +1,95 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Allocation Trace File Format
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// This header only describes the on-disk layout of the file named by the
+// "RecordTrace" option, in which every allocation, free and reallocation seen
+// by VLD is recorded for replay or offline analysis.
+//
+// A trace file is a vldatrace_header_t followed by:
+//
+//   - eventCount vldatrace_event_t records, starting at offset eventOffset;
+//   - stackCount vldatrace_stack_t records, starting at offset stackOffset,
+//     each followed by frameCount UINT64 program counters.
+//
+// All values are little-endian, and addresses are always stored as 64 bits.
+// The events of each thread are in the order they happened, but the threads'
+// events are interleaved in the order they were flushed, so a tool which
+// needs a single sequence sorts them by timestamp. Timestamps are time stamp
+// counter ticks; the header holds the counter and the performance counter at
+// both ends of the trace, so that ticks can be converted to time.
+//
+// An event's stack is the ID of a vldatrace_stack_t record, or zero if the
+// block has no call stack. A reallocation in place is recorded before VLD
+// looks the block up, so it may name a block the trace has no allocation of;
+// such a block is then recorded as allocated right after.
+
+#include <windows.h>
+
+#define VLDATRACE_MAGIC     0x41444C56 // "VLDA"
+#define VLDATRACE_VERSION   1
+
+// Event operations.
+#define VLDATRACE_ALLOC         1 // A block was allocated.
+#define VLDATRACE_FREE          2 // A block was freed. The size is zero.
+#define VLDATRACE_REALLOC       3 // A block was reallocated in place to the new size.
+#define VLDATRACE_HEAPDESTROY   4 // A heap was destroyed, with every block left in it. Only the heap is set.
+
+#pragma pack(push, 1)
+
+struct vldatrace_header_t {
+    UINT32 magic;            // VLDATRACE_MAGIC.
+    UINT32 version;          // VLDATRACE_VERSION.
+    UINT32 pointerSize;      // Pointer size of the process, in bytes (4 or 8).
+    UINT32 processId;        // ID of the process that wrote the trace.
+    UINT64 eventOffset;      // File offset of the first vldatrace_event_t.
+    UINT64 eventCount;       // Number of vldatrace_event_t records.
+    UINT64 stackOffset;      // File offset of the first vldatrace_stack_t.
+    UINT32 stackCount;       // Number of vldatrace_stack_t records.
+    UINT32 reserved;         // Zero.
+    UINT64 startTicks;       // Time stamp counter when the trace started.
+    UINT64 endTicks;         // Time stamp counter when the trace ended.
+    UINT64 startCounter;     // QueryPerformanceCounter when the trace started.
+    UINT64 endCounter;       // QueryPerformanceCounter when the trace ended.
+    UINT64 counterFrequency; // QueryPerformanceFrequency.
+};
+
+struct vldatrace_event_t {
+    UINT8  op;               // One of the VLDATRACE_* operations.
+    UINT8  reserved [3];     // Zero.
+    UINT32 threadId;         // ID of the thread which made the call.
+    UINT64 timestamp;        // Time stamp counter when the call was made.
+    UINT64 heap;             // Handle of the heap.
+    UINT64 address;          // Address of the block.
+    UINT64 size;             // Size, in bytes, of the block.
+    UINT64 stack;            // ID of the block's call stack, or zero.
+};
+
+struct vldatrace_stack_t {
+    UINT64 id;               // ID the events refer to the stack by.
+    UINT32 hash;             // Hash of the stack, as in the "Leak Hash" line of the report.
+    UINT32 frameCount;       // Number of program counters following the record.
+};
+
+#pragma pack(pop)
@@ -0,0 +1,286 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Leak Baseline Comparison
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#define VLDBUILD
+#include "baseline.h"   // Provides the baseline file format.
+#include "vldheap.h"    // Provides internal new and delete operators.
+#include "vldint.h"     // Provides access to VLD internals.
+
+// Imported global variables.
+extern HeapMapLock g_heapMapLock;
+
+#define VLDBASE_WRITE_BATCH 256 // Records written at once.
+
+// The leaks of one leak site, as tallied for the baseline.
+struct basetally_t {
+    UINT64 count;            // Number of leaked blocks.
+    UINT64 bytes;            // Total size of those blocks, in bytes.
+};
+
+// The leak sites found by tallyBaselineSites, by their baseline key plus 2
+// (0 and 1 are reserved keys of the HashMap).
+class BaselineTally
+{
+public:
+    DWORD Key (const blockinfo_t *info);
+
+    HashMap<SIZE_T, basetally_t> sites;
+
+private:
+    HashMap<CallStack*, DWORD> m_stackKeys; // Keys of the call stacks met so far, before the size is added.
+};
+
+// moduleOffsetHash - Hashes the frames of a call stack as the names of their
+//   modules and their offsets from the modules' bases, which don't change when
+//   the modules are relocated. Stacks stored as raw program counters keep the
+//   hash of their addresses.
+//
+//  - stack (IN): The call stack.
+//
+//  Return Value:
+//
+//    Returns the hash of the call stack.
+//
+static DWORD moduleOffsetHash (const CallStack *stack)
+{
+    LPCWSTR imagePath;
+    UINT32 rva;
+    if ((stack->size() == 0) || !stack->frameLocation(0, imagePath, rva))
+        return stack->getHashValue();
+
+    DWORD hash = CalculateCRC32(stack->size());
+    for (UINT32 frame = 0; frame < stack->size(); frame++) {
+        stack->frameLocation(frame, imagePath, rva);
+        LPCWSTR module = wcsrchr(imagePath, L'\\');
+        module = (module != NULL) ? module + 1 : imagePath;
+        for (LPCWSTR c = module; *c != L'\0'; c++)
+            hash = CalculateCRC32((UINT_PTR)towlower(*c), hash);
+        hash = CalculateCRC32(rva, hash);
+    }
+    return hash;
+}
+
+// Key - Obtains the baseline key of a leaked block: the CRC of its size and
+//   its call stack's moduleOffsetHash, computed the same way as the "Leak
+//   Hash" of the report. Each call stack is only hashed once.
+//
+//  - info (IN): The block's information.
+//
+//  Return Value:
+//
+//    Returns the key of the block's leak site.
+//
+DWORD BaselineTally::Key (const blockinfo_t *info)
+{
+    CallStack *stack = info->callStack.get();
+    if (stack == NULL)
+        return 0;
+
+    bool inserted;
+    HashMap<CallStack*, DWORD>::Iterator stackit = m_stackKeys.insert(stack, 0, inserted);
+    if (inserted) {
+        m_stackKeys.replace(stackit, moduleOffsetHash(stack));
+        stackit = m_stackKeys.find(stack);
+    }
+    return CalculateCRC32(info->size, (*stackit).second);
+}
+
+// loadBaseline - Reads the baseline file. If there is none yet, or it is
+//   invalid, no leak is left out of the reports, and the file is written at
+//   shutdown instead.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::loadBaseline ()
+{
+    HANDLE file = CreateFileW(m_baselineFilePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        // This is the first run; it sets the baseline.
+        return;
+    }
+
+    vldbase_header_t header;
+    DWORD read = 0;
+    LARGE_INTEGER size;
+    bool valid = GetFileSizeEx(file, &size) && (size.QuadPart >= (LONGLONG)sizeof(header)) &&
+        ReadFile(file, &header, sizeof(header), &read, NULL) && (read == sizeof(header)) &&
+        (header.magic == VLDBASE_MAGIC) && (header.version == VLDBASE_VERSION) &&
+        ((UINT64)size.QuadPart == sizeof(header) + (UINT64)header.siteCount * sizeof(vldbase_site_t));
+    vldbase_site_t *records = NULL;
+    if (valid) {
+        records = new vldbase_site_t [header.siteCount + 1];
+        DWORD bytes = header.siteCount * sizeof(vldbase_site_t);
+        valid = (bytes == 0) || (ReadFile(file, records, bytes, &read, NULL) && (read == bytes));
+    }
+    CloseHandle(file);
+    if (!valid) {
+        Report(L"WARNING: Visual Leak Detector: The baseline file %s is invalid; it will be replaced.\n",
+            m_baselineFilePath);
+        delete [] records;
+        return;
+    }
+
+    m_baselineRecords = records;
+    m_baselineSites = new HashMap<SIZE_T, UINT32>;
+    for (UINT32 index = 0; index < header.siteCount; index++)
+        m_baselineSites->insert((SIZE_T)records[index].key + 2, index);
+}
+
+// tallyBaselineSites - Sums up the leaked blocks by leak site. The blocks left
+//   out of the report for other reasons (suppressed, or allocated by CRT
+//   startup code) aren't counted. Nothing is resolved. Must be called with
+//   the whole heap map lock held.
+//
+//  - tally (OUT): Receives the leak sites.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::tallyBaselineSites (BaselineTally &tally)
+{
+    for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
+        BlockMap *blockmap = &(*heapit).second->blockMap;
+        for (BlockMap::Iterator blockit = blockmap->begin(); blockit != blockmap->end(); ++blockit) {
+            LPCVOID address;
+            SIZE_T  size;
+            blockinfo_t *info = (*blockit).second;
+            if (!getLeakedBlock((*blockit).first, info, address, size) || isSuppressed(info))
+                continue;
+            if ((m_options & VLD_OPT_SKIP_CRTSTARTUP_LEAKS) && info->callStack && info->callStack->isCrtStartupAlloc())
+                continue;
+
+            basetally_t site = { 1, size };
+            bool inserted;
+            HashMap<SIZE_T, basetally_t>::Iterator siteit = tally.sites.insert((SIZE_T)tally.Key(info) + 2, site, inserted);
+            if (!inserted) {
+                site = (*siteit).second;
+                site.count++;
+                site.bytes += size;
+                tally.sites.replace(siteit, site);
+            }
+        }
+    }
+}
+
+// compareWithBaseline - Marks the leaks of the sites which haven't grown since
+//   the baseline as reported, so that the report that follows only shows the
+//   sites which are new, or whose leaks grew by more than BaselineThreshold
+//   bytes (or by any block, if it is 0). Must be called with the whole heap
+//   map lock held.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::compareWithBaseline ()
+{
+    TickCounter ticks(m_reportStats.aggregationTicks);
+    BaselineTally tally;
+    tallyBaselineSites(tally);
+
+    HashMap<SIZE_T, bool> unchanged;
+    SIZE_T blockCount = 0;
+    for (HashMap<SIZE_T, basetally_t>::Iterator siteit = tally.sites.begin(); siteit != tally.sites.end(); ++siteit) {
+        HashMap<SIZE_T, UINT32>::Iterator baseit = m_baselineSites->find((*siteit).first);
+        if (baseit == m_baselineSites->end())
+            continue;
+        const vldbase_site_t &base = m_baselineRecords[(*baseit).second];
+        const basetally_t &site = (*siteit).second;
+        if (site.bytes > base.bytes + m_baselineThreshold)
+            continue;
+        if ((m_baselineThreshold == 0) && (site.count > base.count))
+            continue;
+        unchanged.insert((*siteit).first, true);
+        blockCount += (SIZE_T)site.count;
+    }
+    if (unchanged.size() == 0)
+        return;
+
+    for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
+        BlockMap *blockmap = &(*heapit).second->blockMap;
+        for (BlockMap::Iterator blockit = blockmap->begin(); blockit != blockmap->end(); ++blockit) {
+            LPCVOID address;
+            SIZE_T  size;
+            blockinfo_t *info = (*blockit).second;
+            if (!getLeakedBlock((*blockit).first, info, address, size))
+                continue;
+            if (unchanged.find((SIZE_T)tally.Key(info) + 2) != unchanged.end())
+                markReported(info);
+        }
+    }
+    Report(L"Visual Leak Detector: %Iu leaks from %Iu call stacks haven't grown since the baseline %s, "
+        L"and aren't reported.\n", blockCount, unchanged.size(), m_baselineFilePath);
+}
+
+// writeBaseline - Writes the leak sites left at shutdown to the baseline
+//   file, for the next runs to be compared with.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::writeBaseline ()
+{
+    BaselineTally tally;
+    flushAllPendingBlocks();
+    {
+        CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+        tallyBaselineSites(tally);
+    }
+
+    HANDLE file = CreateFileW(m_baselineFilePath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    bool succeeded = (file != INVALID_HANDLE_VALUE);
+    if (succeeded) {
+        vldbase_header_t header = { VLDBASE_MAGIC, VLDBASE_VERSION, (UINT32)tally.sites.size(), 0 };
+        DWORD written = 0;
+        succeeded = (WriteFile(file, &header, sizeof(header), &written, NULL) != FALSE);
+
+        vldbase_site_t batch [VLDBASE_WRITE_BATCH];
+        UINT32 batched = 0;
+        for (HashMap<SIZE_T, basetally_t>::Iterator siteit = tally.sites.begin();
+            succeeded && (siteit != tally.sites.end()); ++siteit) {
+            vldbase_site_t &record = batch[batched++];
+            record.key = (UINT32)((*siteit).first - 2);
+            record.reserved = 0;
+            record.count = (*siteit).second.count;
+            record.bytes = (*siteit).second.bytes;
+            if (batched == VLDBASE_WRITE_BATCH) {
+                succeeded = (WriteFile(file, batch, batched * sizeof(vldbase_site_t), &written, NULL) != FALSE);
+                batched = 0;
+            }
+        }
+        if (succeeded && (batched != 0))
+            succeeded = (WriteFile(file, batch, batched * sizeof(vldbase_site_t), &written, NULL) != FALSE);
+        CloseHandle(file);
+    }
+    if (!succeeded) {
+        Report(L"WARNING: Visual Leak Detector: Couldn't write the baseline file %s.\n", m_baselineFilePath);
+        return;
+    }
+    Report(L"Visual Leak Detector wrote a baseline of %Iu leak sites to %s\n", tally.sites.size(), m_baselineFilePath);
+}
@@ -0,0 +1,60 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Leak Baseline File Format
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// This header only describes the on-disk layout of the file named by the
+// "BaselineFile" option, in which the leaks left at the exit of one run are
+// summed up for comparison with the next ones.
+//
+// A baseline file is a vldbase_header_t followed by siteCount vldbase_site_t
+// records, one for each leak site, in no particular order.
+//
+// All values are little-endian. A leak site is identified by the same CRC as
+// the "Leak Hash" line of the report, except that each frame is hashed as the
+// name of its module and its offset from the module's base, so the keys stay
+// valid whatever address the modules are loaded at. Call stacks stored as raw
+// program counters keep their report hash.
+
+#include <windows.h>
+
+#define VLDBASE_MAGIC       0x42444C56 // "VLDB"
+#define VLDBASE_VERSION     1
+
+#pragma pack(push, 1)
+
+struct vldbase_header_t {
+    UINT32 magic;            // VLDBASE_MAGIC.
+    UINT32 version;          // VLDBASE_VERSION.
+    UINT32 siteCount;        // Number of vldbase_site_t records.
+    UINT32 reserved;         // Zero.
+};
+
+struct vldbase_site_t {
+    UINT32 key;              // Leak hash of the site, computed from module offsets.
+    UINT32 reserved;         // Zero.
+    UINT64 count;            // Number of blocks leaked from the site.
+    UINT64 bytes;            // Total size of those blocks, in bytes.
+};
+
+#pragma pack(pop)
@@ -0,0 +1,196 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Binary Leak Report Writer
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#define VLDBUILD
+#include "binreport.h"  // Provides the binary report format.
+#include "vldheap.h"    // Provides internal new and delete operators.
+#include "vldint.h"     // Provides access to VLD internals.
+
+// Imported global variables.
+extern HeapMapLock g_heapMapLock;
+
+#define VLDBIN_FRAME_BATCH 64 // Frames converted to 64 bits and written at once.
+
+// getLeakedBlock - Determines whether a block still in a BlockMap belongs in
+//   the binary report, and where its user data starts.
+//
+//  - block (IN): Address of the block, as tracked by the BlockMap.
+//
+//  - info (IN): The block's information.
+//
+//  - address (OUT): Receives the address of the block's user data.
+//
+//  - size (OUT): Receives the size of the block's user data.
+//
+//  Return Value:
+//
+//    Returns true if the block is a leak which should be reported.
+//
+bool VisualLeakDetector::getLeakedBlock (LPCVOID block, blockinfo_t* info, LPCVOID &address, SIZE_T &size)
+{
+    if (isReported(info) || (info->serialNumber >= m_reportBefore))
+        return false;
+
+    address = block;
+    size = info->size;
+    if (isDebugCrtAlloc(block, info)) {
+        // Same rules as the text report: blocks used internally by the CRT
+        // are freed after VLD is destroyed, and the CRT header is skipped.
+        int blockUse = getCrtBlockUse(block, info);
+        if (CRT_USE_TYPE(blockUse) == CRT_USE_FREE ||
+            CRT_USE_TYPE(blockUse) == CRT_USE_INTERNAL)
+            return false;
+        address = CRTDBGBLOCKDATA(block);
+        size = getCrtBlockSize(block, info);
+    }
+    return true;
+}
+
+// writeBinaryReport - Writes every leak to the report file in the binary
+//   format described in binreport.h. Nothing is symbolized: the report holds
+//   raw program counters plus the module table needed to symbolize them
+//   offline, and the data bytes to dump, so writing it is one sequential pass
+//   over the block maps.
+//
+//  Return Value:
+//
+//    Returns the number of leaks written, or 0 if the file couldn't be
+//    written.
+//
+SIZE_T VisualLeakDetector::writeBinaryReport ()
+{
+    FILE *file = NULL;
+    if ((_wfopen_s(&file, m_reportFilePath, L"wb") != 0) || (file == NULL)) {
+        Report(L"WARNING: Visual Leak Detector: Couldn't open binary report file for writing: %s\n", m_reportFilePath);
+        return 0;
+    }
+
+    flushAllPendingBlocks();
+    CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+    CriticalSectionLocker<> ml(m_modulesLock);
+
+    // Number the distinct call stacks of the leaked blocks. Stacks are
+    // interned, so each distinct stack is a distinct CallStack.
+    HashMap<CallStack*, UINT32> stackIndices;
+    UINT32 blockCount = 0;
+    for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
+        BlockMap *blockmap = &(*heapit).second->blockMap;
+        for (BlockMap::Iterator blockit = blockmap->begin(); blockit != blockmap->end(); ++blockit) {
+            LPCVOID address;
+            SIZE_T  size;
+            blockinfo_t *info = (*blockit).second;
+            if (!getLeakedBlock((*blockit).first, info, address, size))
+                continue;
+            blockCount++;
+            if (info->callStack != NULL)
+                stackIndices.insert(info->callStack, (UINT32)stackIndices.size());
+        }
+    }
+    UINT32 stackCount = (UINT32)stackIndices.size();
+    CallStack **stacks = new CallStack* [stackCount + 1];
+    for (HashMap<CallStack*, UINT32>::Iterator it = stackIndices.begin(); it != stackIndices.end(); ++it) {
+        stacks[(*it).second] = (*it).first;
+    }
+
+    UINT32 moduleCount = 0;
+    for (ModuleSet::Iterator moduleit = m_loadedModules->begin(); moduleit != m_loadedModules->end(); ++moduleit) {
+        moduleCount++;
+    }
+
+    vldbin_header_t header = { 0 };
+    header.magic       = VLDBIN_MAGIC;
+    header.version     = VLDBIN_VERSION;
+    header.pointerSize = sizeof(LPVOID);
+    header.processId   = GetCurrentProcessId();
+    GetSystemTimeAsFileTime(&header.timestamp);
+    header.moduleCount = moduleCount;
+    header.stackCount  = stackCount;
+    header.blockCount  = blockCount;
+    fwrite(&header, sizeof(header), 1, file);
+
+    for (ModuleSet::Iterator moduleit = m_loadedModules->begin(); moduleit != m_loadedModules->end(); ++moduleit) {
+        const moduleinfo_t &moduleinfo = *moduleit;
+        vldbin_module_t module = { 0 };
+        module.base       = moduleinfo.addrLow;
+        module.size       = moduleinfo.addrHigh - moduleinfo.addrLow + 1;
+        module.pdbGuid    = moduleinfo.pdbGuid;
+        module.pdbAge     = moduleinfo.pdbAge;
+        module.pathLength = moduleinfo.pathLength;
+        fwrite(&module, sizeof(module), 1, file);
+        fwrite(moduleinfo.path, sizeof(WCHAR), module.pathLength, file);
+    }
+
+    for (UINT32 index = 0; index < stackCount; index++) {
+        CallStack *callstack = stacks[index];
+        vldbin_stack_t stack;
+        stack.hash       = callstack->getHashValue();
+        stack.frameCount = callstack->size();
+        fwrite(&stack, sizeof(stack), 1, file);
+
+        UINT64 frames [VLDBIN_FRAME_BATCH];
+        for (UINT32 frame = 0; frame < stack.frameCount; ) {
+            UINT32 count = 0;
+            while ((count < VLDBIN_FRAME_BATCH) && (frame < stack.frameCount))
+                frames[count++] = (*callstack)[frame++];
+            fwrite(frames, sizeof(UINT64), count, file);
+        }
+    }
+    delete [] stacks;
+
+    for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
+        BlockMap *blockmap = &(*heapit).second->blockMap;
+        for (BlockMap::Iterator blockit = blockmap->begin(); blockit != blockmap->end(); ++blockit) {
+            LPCVOID address;
+            SIZE_T  size;
+            blockinfo_t *info = (*blockit).second;
+            if (!getLeakedBlock((*blockit).first, info, address, size))
+                continue;
+
+            vldbin_block_t block = { 0 };
+            block.serialNumber = info->serialNumber;
+            block.address      = (UINT_PTR)address;
+            block.size         = size;
+            block.heap         = (UINT_PTR)(*heapit).first;
+            block.threadId     = getThreadId(info);
+            block.stackIndex   = VLDBIN_NO_STACK;
+            if (info->callStack != NULL)
+                block.stackIndex = (*stackIndices.find(info->callStack)).second;
+            if (info->crtHeader != crtheader_none)
+                block.flags |= VLDBIN_BLOCK_CRT;
+            if (info->crtHeader == crtheader_ucrt)
+                block.flags |= VLDBIN_BLOCK_UCRT;
+            block.dataSize     = (UINT32)((m_maxDataDump < size) ? m_maxDataDump : size);
+            fwrite(&block, sizeof(block), 1, file);
+            fwrite(address, 1, block.dataSize, file);
+        }
+    }
+
+    BOOL failed = ferror(file);
+    fclose(file);
+    if (failed) {
+        Report(L"WARNING: Visual Leak Detector: Failed to write the binary report file: %s\n", m_reportFilePath);
+        return 0;
+    }
+    return blockCount;
+}
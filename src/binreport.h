@@ -0,0 +1,93 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Binary Leak Report Format
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// This header only describes the on-disk layout written with
+// "ReportTo = binary", so that tools which symbolize the report offline can
+// include it on its own.
+//
+// A binary report is a vldbin_header_t followed by:
+//
+//   - moduleCount vldbin_module_t records, each followed by pathLength
+//     UTF-16 characters (not NUL-terminated);
+//   - stackCount vldbin_stack_t records, each followed by frameCount UINT64
+//     program counters;
+//   - blockCount vldbin_block_t records, each followed by dataSize bytes:
+//     the first bytes of the block's user data (at most MaxDataDump).
+//
+// All values are little-endian. Addresses are always stored as 64 bits, even
+// for 32-bit processes. Nothing in the file is symbolized: the offline tool
+// maps each program counter to a module through the module table and looks
+// the symbols up with the module's PDB signature. With the data bytes, it
+// can produce the whole text report, hex dumps included, so the process only
+// ever copies raw tables and bytes.
+
+#include <windows.h>
+
+#define VLDBIN_MAGIC        0x42444C56 // "VLDB"
+#define VLDBIN_VERSION      2
+#define VLDBIN_NO_STACK     0xFFFFFFFF // Stack index of blocks without a call stack.
+
+#pragma pack(push, 1)
+
+struct vldbin_header_t {
+    UINT32   magic;        // VLDBIN_MAGIC.
+    UINT32   version;      // VLDBIN_VERSION.
+    UINT32   pointerSize;  // Pointer size of the process, in bytes (4 or 8).
+    UINT32   processId;    // ID of the process that wrote the report.
+    FILETIME timestamp;    // UTC time at which the report was written.
+    UINT32   moduleCount;  // Number of vldbin_module_t records.
+    UINT32   stackCount;   // Number of vldbin_stack_t records.
+    UINT32   blockCount;   // Number of vldbin_block_t records.
+    UINT32   flags;        // Report flags:
+#define VLDBIN_HEADER_SNAPSHOT 0x1 //   A crash snapshot: every live block is listed, without data bytes.
+};
+
+struct vldbin_module_t {
+    UINT64   base;         // Base address of the module.
+    UINT64   size;         // Size of the module's image, in bytes.
+    GUID     pdbGuid;      // PDB signature from the module's CodeView record (zero if unknown).
+    UINT32   pdbAge;       // PDB age from the module's CodeView record (zero if unknown).
+    UINT32   pathLength;   // Length, in characters, of the module path that follows.
+};
+
+struct vldbin_stack_t {
+    UINT32   hash;         // Hash of the frames, as shown in the text report's "Leak Hash".
+    UINT32   frameCount;   // Number of program counters that follow.
+};
+
+struct vldbin_block_t {
+    UINT64   serialNumber; // Allocation serial number.
+    UINT64   address;      // Address of the leaked block (the user data, for CRT blocks).
+    UINT64   size;         // Size of the leaked block, in bytes.
+    UINT64   heap;         // Heap the block was allocated from.
+    UINT32   threadId;     // Thread that allocated the block.
+    UINT32   stackIndex;   // Index into the stack records, or VLDBIN_NO_STACK.
+    UINT32   flags;        // Block flags:
+#define VLDBIN_BLOCK_CRT    0x1 //   The block was allocated by the debug CRT.
+#define VLDBIN_BLOCK_UCRT   0x2 //   The block was allocated by the Universal CRT.
+    UINT32   dataSize;     // Number of data bytes that follow.
+};
+
+#pragma pack(pop)
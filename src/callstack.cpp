@@ -23,6 +23,9 @@
 
 #include "stdafx.h"
 #define VLDBUILD
+#if defined(_M_IX86) || defined(_M_X64)
+#include <immintrin.h>  // Provides the SSE2 and AVX2 intrinsics.
+#endif
 #include "callstack.h"  // This class' header.
 #include "utility.h"    // Provides various utility functions.
 #include "vldheap.h"    // Provides internal new and delete operators.
@@ -32,7 +35,14 @@
 // Imported global variables.
 extern HANDLE             g_currentProcess;
 extern HANDLE             g_currentThread;
-extern CriticalSection    g_heapMapLock;
+extern CallStackTable     g_callStackTable;
+extern StackPrefixTable   g_stackPrefixes;
+extern SymbolCache        g_symbolCache;
+extern CrtStartupRanges   g_crtStartupRanges;
+extern ResolvedTextArena  g_resolvedText;
+extern ModuleImages       g_moduleImages;
+extern ContextTree        g_contextTree;
+extern SymbolStore        g_symbolStore;
 extern VisualLeakDetector g_vld;
 extern DbgHelp g_DbgHelp;
 
@@ -54,756 +64,3795 @@ bool endWith(const LPCWSTR filename, size_t len, wchar_t const (&substr)[N])
     return ((len >= count) && wcsncmp(filename + len - count, substr, count) == 0);
 }
 
-// Constructor - Initializes the CallStack with an initial size of zero and one
-//   Chunk of capacity.
+// Constructor - Copies the captured frames into the CallStack, if they are
+//   kept raw; otherwise Create encodes them. Only called by Create, which
+//   allocates room for all of the frames with the object.
 //
-CallStack::CallStack ()
+CallStack::CallStack (const UINT_PTR* frames, UINT32 count, DWORD hashValue, UINT32 status)
 {
-    m_capacity   = CALLSTACK_CHUNK_SIZE;
-    m_size       = 0;
-    m_status     = 0x0;
-    m_store.next = NULL;
-    m_topChunk   = &m_store;
-    m_topIndex   = 0;
+    m_status     = status;
+    m_size       = count;
+    m_hashValue  = hashValue;
+    m_liveBlocks = 0;
+    m_liveBytes  = 0;
+    m_allocations = 0;
+    m_peakBytes  = 0;
+    m_allocatedBytes = 0;
+    m_reallocs   = 0;
+    m_smallReallocs = 0;
+    m_reallocFromBytes = 0;
+    m_reallocToBytes = 0;
+    ZeroMemory((PVOID)m_lifetimes, sizeof(m_lifetimes));
+    m_sameThreadFrees = 0;
+    m_crossThreadFrees = 0;
+    m_refs       = 0;
+    m_internNext = NULL;
     m_resolved   = NULL;
-    m_resolvedCapacity   = 0;
-    m_resolvedLength = 0;
+    if ((count > 0) && (status & CALLSTACK_STATUS_RAWFRAMES)) {
+        memcpy(m_frames, frames, count * sizeof(UINT_PTR));
+    }
 }
 
-// Destructor - Frees all memory allocated to the CallStack.
+// Destructor - Frees the resolved text, if any.
 //
 CallStack::~CallStack ()
 {
-    CallStack::chunk_t *chunk = m_store.next;
-    CallStack::chunk_t *temp;
-
-    while (chunk) {
-        temp = chunk;
-        chunk = temp->next;
-        delete temp;
-    }
-
-    delete [] m_resolved;
-
+    if (m_resolved != NULL)
+        g_resolvedText.Free(m_resolved);
     m_resolved = NULL;
-    m_resolvedCapacity = 0;
-    m_resolvedLength = 0;
 }
 
-CallStack* CallStack::Create()
+// Capture - Traces the stack as far back as possible, or until 'maxdepth'
+//   frames have been traced, and stores the frames in a new CallStack. The
+//   frames are collected in a scratch buffer first, so that the CallStack can
+//   be allocated in one shot with its exact size.
+//
+//  - maxdepth (IN): Maximum number of frames to trace back.
+//
+//  - context (IN): The thread context at which this allocation first entered
+//      VLD's code. Determines the starting point of the stack trace.
+//
+//  - method (IN): The stack walk method, as a VLD_OPT_*_STACK_WALK bit (0 for
+//      fast), or CALLSTACK_WALK_CONFIGURED for the one StackWalkMethod selects.
+//
+//  Return Value:
+//
+//    Returns the new CallStack. Free it with Destroy (or hand it to the
+//    CallStackTable, which takes ownership).
+//
+CallStack* CallStack::Capture (UINT32 maxdepth, const context_t& context, UINT32 method)
 {
-    CallStack* result = NULL;
-    if (g_vld.GetOptions() & VLD_OPT_SAFE_STACK_WALK) {
-        result = new SafeCallStack();
-    }
-    else {
-        result = new FastCallStack();
+    UINT_PTR  scratch [max(CALLSTACK_MAX_CAPTURE + 1, CALLSTACK_SAFE_SCRATCH)];
+    UINT_PTR* frames = scratch;
+    UINT32    capacity = _countof(scratch);
+    DWORD     hashValue = 0;
+
+    UINT32 count = walk(maxdepth, context, method, frames, capacity, hashValue);
+    CallStack* stack = Create(frames, count, hashValue);
+    if (frames != scratch) {
+        delete [] frames;
     }
-    return result;
+    return stack;
 }
 
-// operator == - Equality operator. Compares the CallStack to another CallStack
-//   for equality. Two CallStacks are equal if they are the same size and if
-//   every frame in each is identical to the corresponding frame in the other.
+// CaptureInterned - Traces the stack like Capture, and interns it. The stack
+//   is looked up in the calling thread's front cache first, so that on a hit
+//   no CallStack is created and no lock is taken.
 //
-//  other (IN) - Reference to the CallStack to compare the current CallStack
-//    against for equality.
+//  - maxdepth (IN): Maximum number of frames to trace back.
+//
+//  - context (IN): The thread context at which this allocation first entered
+//      VLD's code.
+//
+//  - method (IN): The stack walk method, as for Capture.
+//
+//  - cache (IN/OUT): The calling thread's front cache, CALLSTACK_CACHE_SLOTS
+//      slots.
 //
 //  Return Value:
 //
-//    Returns true if the two CallStacks are equal. Otherwise returns false.
+//    Returns the interned CallStack, with one reference added for the caller.
 //
-BOOL CallStack::operator == (const CallStack &other) const
+CallStack* CallStack::CaptureInterned (UINT32 maxdepth, const context_t& context, UINT32 method,
+    stackcacheslot_t* cache)
 {
-    if (m_size != other.m_size) {
-        // They can't be equal if the sizes are different.
-        return FALSE;
+    UINT_PTR  scratch [max(CALLSTACK_MAX_CAPTURE + 1, CALLSTACK_SAFE_SCRATCH)];
+    UINT_PTR* frames = scratch;
+    UINT32    capacity = _countof(scratch);
+    DWORD     hashValue = 0;
+
+    UINT32 count = walk(maxdepth, context, method, frames, capacity, hashValue);
+    CallStack* stack = g_callStackTable.InternFrames(cache, frames, count, hashValue);
+    if (frames != scratch) {
+        delete [] frames;
     }
+    return stack;
+}
 
-    // Walk the chunk list and within each chunk walk the frames array until we
-    // either find a mismatch, or until we reach the end of the call stacks.
-    const CallStack::chunk_t *prevChunk = NULL;
-    const CallStack::chunk_t *chunk = &m_store;
-    const CallStack::chunk_t *otherChunk = &other.m_store;
-    while (prevChunk != m_topChunk) {
-        UINT32 size = (chunk == m_topChunk) ? m_topIndex : CALLSTACK_CHUNK_SIZE;
-        for (UINT32 index = 0; index < size; index++) {
-            if (chunk->frames[index] != otherChunk->frames[index]) {
-                // Found a mismatch. They are not equal.
-                return FALSE;
+// CaptureAdaptive - Traces the "prefix" innermost frames of the stack, and
+//   looks them up in the StackPrefixTable. If the stacks with that prefix
+//   have all been the same so far, the one seen is returned without walking
+//   any further; otherwise the stack is traced with "maxdepth" frames, like
+//   CaptureInterned. The full-depth captures teach the table which prefixes
+//   are divergent.
+//
+//  - prefix (IN): Number of frames traced first. Less than "maxdepth".
+//
+//  - maxdepth (IN): Maximum number of frames to trace back.
+//
+//  - context (IN): The thread context at which this allocation first entered
+//      VLD's code.
+//
+//  - method (IN): The stack walk method, as for Capture.
+//
+//  - cache (IN/OUT): The calling thread's front cache, CALLSTACK_CACHE_SLOTS
+//      slots.
+//
+//  Return Value:
+//
+//    Returns the interned CallStack, with one reference added for the caller.
+//
+CallStack* CallStack::CaptureAdaptive (UINT32 prefix, UINT32 maxdepth, const context_t& context, UINT32 method,
+    stackcacheslot_t* cache)
+{
+    UINT_PTR  scratch [max(CALLSTACK_MAX_CAPTURE + 1, CALLSTACK_SAFE_SCRATCH)];
+    UINT_PTR* frames = scratch;
+    UINT32    capacity = _countof(scratch);
+    DWORD     hashValue = 0;
+
+    UINT32 count = walk(prefix, context, method, frames, capacity, hashValue);
+    stackprefix_t* entry = NULL;
+    CallStack* stack = NULL;
+    if (count < prefix) {
+        // The whole stack was traced.
+        stack = g_callStackTable.InternFrames(cache, frames, count, hashValue);
+    }
+    else {
+        entry = g_stackPrefixes.Find(hashValue);
+        if ((entry != NULL) && !entry->divergent) {
+            LONG captures = InterlockedIncrement(&entry->captures);
+            CallStack* full = entry->full;
+            // A different prefix with the same hash is walked in full, which
+            // soon makes the entry divergent.
+            if ((full != NULL) && ((captures & (CALLSTACK_PREFIX_SAMPLE - 1)) != 0) &&
+                full->matchesPrefix(frames, count)) {
+                // The entry's reference keeps the stack alive meanwhile.
+                InterlockedIncrement(&full->m_refs);
+                stack = full;
             }
         }
-        prevChunk = chunk;
-        chunk = chunk->next;
-        otherChunk = otherChunk->next;
     }
-
-    // Reached the end of the call stacks. They are equal.
-    return TRUE;
+    if (stack == NULL) {
+        hashValue = 0;
+        count = walk(maxdepth, context, method, frames, capacity, hashValue);
+        stack = g_callStackTable.InternFrames(cache, frames, count, hashValue);
+        if ((entry != NULL) && !entry->divergent) {
+            CallStack* full = entry->full;
+            if (full == NULL) {
+                g_callStackTable.AddRef(stack);
+                if (InterlockedCompareExchangePointer((PVOID*)&entry->full, stack, NULL) != NULL)
+                    g_callStackTable.Release(stack);
+            }
+            else if (full != stack) {
+                entry->divergent = TRUE;
+            }
+        }
+    }
+    if (frames != scratch) {
+        delete [] frames;
+    }
+    return stack;
 }
 
-// operator [] - Random access operator. Retrieves the frame at the specified
-//   index.
+// walk - Traces the stack with the configured stack walk method, or with
+//   "method", into a scratch buffer.
 //
-//   Note: We give up a bit of efficiency here, in favor of efficiency of push
-//     operations. This is because walking of a CallStack is done infrequently
-//     (only if a leak is found), whereas pushing is done very frequently (for
-//     each frame in the program's call stack when the program allocates some
-//     memory).
+//  - maxdepth (IN): Maximum number of frames to trace back.
+//
+//  - context (IN): The thread context at which this allocation first entered
+//      VLD's code.
+//
+//  - method (IN): The stack walk method, as for Capture.
+//
+//  - frames (IN/OUT): The scratch buffer, at least
+//      CALLSTACK_MAX_CAPTURE + 1 frames. The safe walker replaces it with a
+//      bigger one from the heap if it runs out of room; delete that one when
+//      done.
 //
-//  - index (IN): Specifies the index of the frame to retrieve.
+//  - capacity (IN/OUT): Number of entries in "frames".
+//
+//  - hashValue (OUT): Receives the hash of the frames.
 //
 //  Return Value:
 //
-//    Returns the program counter for the frame at the specified index. If the
-//    specified index is out of range for the CallStack, the return value is
-//    undefined.
+//    Returns the number of frames stored in "frames".
 //
-UINT_PTR CallStack::operator [] (UINT32 index) const
+UINT32 CallStack::walk (UINT32 maxdepth, const context_t& context, UINT32 method, UINT_PTR*& frames,
+    UINT32& capacity, DWORD& hashValue)
 {
-    UINT32                    chunknumber = index / CALLSTACK_CHUNK_SIZE;
-    const CallStack::chunk_t *chunk = &m_store;
-
-    for (UINT32 count = 0; count < chunknumber; count++) {
-        chunk = chunk->next;
+    UINT32 count;
+    UINT32 options = (method == CALLSTACK_WALK_CONFIGURED) ? g_vld.m_capturePolicy->walkMethod : method;
+    if ((options & VLD_OPT_SHADOW_STACK_WALK) == VLD_OPT_SHADOW_STACK_WALK) {
+#if defined(_M_X64)
+        count = captureShadow(maxdepth, context, frames, capacity, hashValue);
+#else
+        count = captureFast(maxdepth, context, frames, hashValue);
+#endif
     }
-
-    return chunk->frames[index % CALLSTACK_CHUNK_SIZE];
+    else if (options & VLD_OPT_SAFE_STACK_WALK) {
+        count = captureSafe(maxdepth, context, frames, capacity);
+        hashValue = hashFrames(frames, count);
+    }
+#if defined(_M_X64) || defined(_M_ARM64)
+    else if (options & VLD_OPT_UNWIND_STACK_WALK) {
+        count = captureUnwind(maxdepth, context, frames, capacity);
+        hashValue = hashFrames(frames, count);
+    }
+#endif
+#if defined(_M_IX86) || defined(_M_ARM64)
+    else if (options & VLD_OPT_FRAME_STACK_WALK) {
+        count = captureFrame(maxdepth, context, frames, capacity);
+        hashValue = hashFrames(frames, count);
+    }
+#endif
+    else {
+        count = captureFast(maxdepth, context, frames, hashValue);
+    }
+    return stripInternal(frames, count, hashValue);
 }
 
-// clear - Resets the CallStack, returning it to a state where no frames have
-//   been pushed onto it, readying it for reuse.
+// CaptureFrames - Captures the frames of the current call stack, without
+//   creating a CallStack. Used when the CallStack may never be needed (see
+//   DeferStackCapture), so it only supports the walk methods which need no
+//   scratch space beyond the caller's buffer: "fast", "unwind" (x64 and
+//   ARM64), "shadow" (x64) and "frame" (x86 and ARM64).
+//
+//  - maxdepth (IN): Maximum number of frames to trace back.
+//
+//  - context (IN): The thread context at which this allocation first entered
+//      VLD's code.
 //
-//   Note: Calling this function does not release any memory allocated to the
-//     CallStack. We give up a bit of memory-usage efficiency here in favor of
-//     performance of push operations.
+//  - frames (OUT): Receives the frames; room is needed for
+//      CALLSTACK_MAX_CAPTURE + 1 of them.
+//
+//  - hashValue (OUT): Receives the hash of the frames.
+//
+//  - method (IN): The stack walk method, as for Capture. The safe method is
+//      treated as fast.
 //
 //  Return Value:
 //
-//    None.
+//    Returns the number of frames captured.
 //
-VOID CallStack::clear ()
+UINT32 CallStack::CaptureFrames (UINT32 maxdepth, const context_t& context, UINT_PTR* frames, DWORD& hashValue,
+    UINT32 method)
 {
-    m_size     = 0;
-    m_topChunk = &m_store;
-    m_topIndex = 0;
-    if (m_resolved)
-    {
-        delete [] m_resolved;
-        m_resolved = NULL;
+    UINT32 options = (method == CALLSTACK_WALK_CONFIGURED) ? g_vld.m_capturePolicy->walkMethod : method;
+    UINT32 count;
+#if defined(_M_X64)
+    if ((options & VLD_OPT_SHADOW_STACK_WALK) == VLD_OPT_SHADOW_STACK_WALK) {
+        count = captureShadow(maxdepth, context, frames, CALLSTACK_MAX_CAPTURE + 1, hashValue);
+        return stripInternal(frames, count, hashValue);
+    }
+#else
+    if ((options & VLD_OPT_SHADOW_STACK_WALK) == VLD_OPT_SHADOW_STACK_WALK) {
+        count = captureFast(maxdepth, context, frames, hashValue);
+        return stripInternal(frames, count, hashValue);
+    }
+#endif
+#if defined(_M_X64) || defined(_M_ARM64)
+    if (options & VLD_OPT_UNWIND_STACK_WALK) {
+        count = captureUnwind(maxdepth, context, frames, CALLSTACK_MAX_CAPTURE + 1);
+        hashValue = hashFrames(frames, count);
+        return stripInternal(frames, count, hashValue);
+    }
+#endif
+#if defined(_M_IX86) || defined(_M_ARM64)
+    if (options & VLD_OPT_FRAME_STACK_WALK) {
+        count = captureFrame(maxdepth, context, frames, CALLSTACK_MAX_CAPTURE + 1);
+        hashValue = hashFrames(frames, count);
+        return stripInternal(frames, count, hashValue);
     }
-    m_resolvedCapacity = 0;
-    m_resolvedLength = 0;
+#endif
+    count = captureFast(maxdepth, context, frames, hashValue);
+    return stripInternal(frames, count, hashValue);
 }
 
-LPCWSTR CallStack::getFunctionName(SIZE_T programCounter, DWORD64& displacement64,
-    SYMBOL_INFO* functionInfo, CriticalSectionLocker<DbgHelp>& locker) const
+// CaptureCaller - Creates a CallStack of just one frame: the return address,
+//   recorded in the context when the allocation entered VLD's code, of the
+//   call to the allocating function. Nothing is walked.
+//
+//  - context (IN): The thread context at which this allocation first entered
+//      VLD's code.
+//
+//  Return Value:
+//
+//    Returns the new CallStack. It must be destroyed with Destroy.
+//
+CallStack* CallStack::CaptureCaller (const context_t& context)
 {
-    // Initialize structures passed to the symbol handler.
-    functionInfo->SizeOfStruct = sizeof(SYMBOL_INFO);
-    functionInfo->MaxNameLen = MAX_SYMBOL_NAME_LENGTH;
-
-    // Try to get the name of the function containing this program
-    // counter address.
-    displacement64 = 0;
-    LPCWSTR functionName;
-    DbgTrace(L"dbghelp32.dll %i: SymFromAddrW\n", GetCurrentThreadId());
-    if (g_DbgHelp.SymFromAddrW(g_currentProcess, programCounter, &displacement64, functionInfo, locker)) {
-        functionName = functionInfo->Name;
-    }
-    else {
-        // GetFormattedMessage( GetLastError() );
-        fmt::WArrayWriter wf(functionInfo->Name, MAX_SYMBOL_NAME_LENGTH);
-        wf.write(L"" ADDRESSCPPFORMAT, programCounter);
-        functionName = wf.c_str();
-        displacement64 = 0;
-    }
-    return functionName;
+    UINT_PTR frame = GET_RETURN_ADDRESS(context);
+    return Create(&frame, 1, hashFrames(&frame, 1));
 }
 
-DWORD CallStack::resolveFunction(SIZE_T programCounter, IMAGEHLP_LINEW64* sourceInfo, DWORD displacement,
-    LPCWSTR functionName, LPWSTR stack_line, DWORD stackLineSize) const
+// Create - Creates a CallStack from frames that were captured earlier, with
+//   CaptureFrames.
+//
+//  - frames (IN): The frames, innermost first.
+//
+//  - count (IN): Number of frames.
+//
+//  - hashValue (IN): Hash of the frames, as computed when they were captured.
+//
+//  Return Value:
+//
+//    Returns the new CallStack. It must be destroyed with Destroy.
+//
+CallStack* CallStack::Create (const UINT_PTR* frames, UINT32 count, DWORD hashValue)
 {
-    WCHAR callingModuleName[260];
-    HMODULE hCallingModule = GetCallingModule(programCounter);
-    LPWSTR moduleName = L"(Module name unavailable)";
-    if (hCallingModule &&
-        GetModuleFileName(hCallingModule, callingModuleName, _countof(callingModuleName)) > 0)
-    {
-        moduleName = wcsrchr(callingModuleName, L'\\');
-        if (moduleName == NULL)
-            moduleName = wcsrchr(callingModuleName, L'/');
-        if (moduleName != NULL)
-            moduleName++;
-        else
-            moduleName = callingModuleName;
+    // The frames are stored relative to their modules, unless one of them
+    // isn't within a module VLD knows about. With the CallingContextTree
+    // option, they are only stored once in the ContextTree, and the stack
+    // keeps its leaf node.
+    ModuleRangesReader reader(g_vld, g_vld.getTls());
+    const moduleranges_t *table = reader.Table();
+    UINT32 status = isEncodable(table, frames, count) ? 0x0 : CALLSTACK_STATUS_RAWFRAMES;
+    UINT32 leaf = CONTEXTTREE_NONE;
+    if ((status == 0x0) && (g_vld.m_options & VLD_OPT_CONTEXT_TREE)) {
+        leaf = g_contextTree.Insert(table, frames, count);
+        if (leaf != CONTEXTTREE_NONE)
+            status = CALLSTACK_STATUS_CONTEXTTREE;
     }
-
-    fmt::WArrayWriter w(stack_line, stackLineSize);
-    // Display the current stack frame's information.
-    if (sourceInfo)
-    {
-        if (displacement == 0)
-        {
-            w.write(L"    {} ({}): {}!{}()\n",
-                sourceInfo->FileName, sourceInfo->LineNumber, moduleName,
-                functionName);
-        }
-        else
-        {
-            w.write(L"    {} ({}): {}!{}() + 0x{:X} bytes\n",
-                sourceInfo->FileName, sourceInfo->LineNumber, moduleName,
-                functionName, displacement);
-        }
+    size_t packed = 0;
+    if ((status == 0x0) && g_vld.m_packStacks) {
+        // Packing is deterministic, so equal stacks are packed alike.
+        packed = pack(table, frames, count, NULL);
+        if (sizeof(UINT32) + packed < framesSize(count, 0x0))
+            status = CALLSTACK_STATUS_PACKED;
     }
-    else
-    {
-        if (displacement == 0)
-        {
-            w.write(L"    {}!{}()\n",
-                moduleName, functionName);
-        }
-        else
-        {
-            w.write(L"    {}!{}() + 0x{:X} bytes\n",
-                moduleName, functionName, displacement);
-        }
+    size_t framebytes = (status == CALLSTACK_STATUS_PACKED) ? sizeof(UINT32) + packed : framesSize(count, status);
+    size_t bytes = sizeof(CallStack) + ((framebytes > sizeof(UINT32)) ? framebytes - sizeof(UINT32) : 0);
+    BYTE* memory = new BYTE [bytes];
+#pragma push_macro("new")
+#undef new
+    CallStack* stack = ::new (memory) CallStack(frames, count, hashValue, status);
+#pragma pop_macro("new")
+    if (status == CALLSTACK_STATUS_CONTEXTTREE) {
+        stack->m_frames[0] = leaf;
     }
-    DWORD NumChars = (DWORD)w.size();
-    stack_line[NumChars] = '\0';
-    return NumChars;
+    else if (status == CALLSTACK_STATUS_PACKED) {
+        stack->m_frames[0] = (UINT32)packed;
+        pack(table, frames, count, reinterpret_cast<BYTE*>(stack->m_frames + 1));
+    }
+    else if (status == 0x0) {
+        stack->encode(table, frames);
+    }
+    return stack;
 }
 
-
-// isCrtStartupAlloc - Determines whether the memory leak was generated from crt startup code.
-// This is not an actual memory leaks as it is freed by crt after the VLD object has been destroyed.
+// isEncodable - Checks whether every frame is within a module of a module
+//   range table, so that it can be stored relative to the module's image.
+//
+//  - table (IN): The module range table, or NULL.
+//
+//  - frames (IN): The frames.
+//
+//  - count (IN): Number of frames.
 //
 //  Return Value:
 //
-//    true if isCrtStartupModule for any callstack frame returns true.
+//    Returns true if the frames can be stored module-relative.
 //
-bool CallStack::isCrtStartupAlloc()
+bool CallStack::isEncodable (const moduleranges_t* table, const UINT_PTR* frames, UINT32 count)
 {
-    if (m_status & CALLSTACK_STATUS_STARTUPCRT) {
-        return true;
-    } else if (m_status & CALLSTACK_STATUS_NOTSTARTUPCRT) {
-        return false;
+    // Neighbouring frames are usually within the same module.
+    const modulerange_t *range = NULL;
+    for (UINT32 frame = 0; frame < count; frame++) {
+        UINT_PTR programCounter = frames[frame];
+        if ((range == NULL) || (programCounter < range->addrLow) || (programCounter > range->addrHigh)) {
+            range = FindModuleRange(table, programCounter);
+            if ((range == NULL) || (range->image == MODULEIMAGE_NONE))
+                return false;
+        }
     }
+    return true;
+}
 
-    IMAGEHLP_LINE64  sourceInfo = { 0 };
-    sourceInfo.SizeOfStruct = sizeof(IMAGEHLP_LINE64);
-
-    BYTE symbolBuffer[sizeof(SYMBOL_INFO) + MAX_SYMBOL_NAME_SIZE] = { 0 };
-    CriticalSectionLocker<DbgHelp> locker(g_DbgHelp);
-
-    // Iterate through each frame in the call stack.
+// encode - Stores the frames as image indexes and RVAs. The frames must have
+//   passed isEncodable with the same table.
+//
+//  - table (IN): The module range table.
+//
+//  - frames (IN): The frames, m_size of them.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID CallStack::encode (const moduleranges_t* table, const UINT_PTR* frames)
+{
+    UINT16 *images = reinterpret_cast<UINT16*>(m_frames + m_size);
+    const modulerange_t *range = NULL;
     for (UINT32 frame = 0; frame < m_size; frame++) {
-        // Try to get the source file and line number associated with
-        // this program counter address.
-        SIZE_T programCounter = (*this)[frame];
-        DWORD64 displacement64;
-        LPCWSTR functionName = getFunctionName(programCounter, displacement64, (SYMBOL_INFO*)&symbolBuffer, locker);
-
-        m_status |= isCrtStartupFunction(functionName);
-        if (m_status & CALLSTACK_STATUS_STARTUPCRT) {
-            return true;
-        } else if (m_status & CALLSTACK_STATUS_NOTSTARTUPCRT) {
-            return false;
-        }
+        UINT_PTR programCounter = frames[frame];
+        if ((range == NULL) || (programCounter < range->addrLow) || (programCounter > range->addrHigh))
+            range = FindModuleRange(table, programCounter);
+        m_frames[frame] = (UINT32)(programCounter - range->addrLow);
+        images[frame]   = (UINT16)range->image;
     }
+}
 
-    m_status |= CALLSTACK_STATUS_NOTSTARTUPCRT;
-    return false;
+// putVarint - Stores a value in as many bytes as it needs, seven bits at a
+//   time, lowest first. The top bit of every byte but the last is set.
+//
+//  - packed (OUT): Receives the bytes. May be NULL, to only count them.
+//
+//  - value (IN): The value.
+//
+//  Return Value:
+//
+//    Returns the number of bytes the value takes.
+//
+static UINT32 putVarint (BYTE* packed, UINT64 value)
+{
+    UINT32 bytes = 0;
+    do {
+        BYTE byte = (BYTE)(value & 0x7f);
+        value >>= 7;
+        if (value != 0)
+            byte |= 0x80;
+        if (packed != NULL)
+            packed[bytes] = byte;
+        bytes++;
+    } while (value != 0);
+    return bytes;
 }
 
+// getVarint - Reads a value stored by putVarint.
+static const BYTE* getVarint (const BYTE* packed, UINT64& value)
+{
+    value = 0;
+    UINT32 shift = 0;
+    BYTE byte;
+    do {
+        byte = *packed++;
+        value |= (UINT64)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return packed;
+}
 
-// dump - Dumps a nicely formatted rendition of the CallStack, including
-//   symbolic information (function names and line numbers) if available.
+// unpackFrame - Decodes the frame which follows another one in a packed
+//   CallStack (see pack).
 //
-//   Note: The symbol handler must be initialized prior to calling this
-//     function.
+//  - packed (IN): The frame's bytes.
 //
-//  - showinternalframes (IN): If true, then all frames in the CallStack will be
-//      dumped. Otherwise, frames internal to the heap will not be dumped.
+//  - image (IN/OUT): The image index of the previous frame, MODULEIMAGE_NONE
+//      before the first one; receives that of this frame.
+//
+//  - rva (IN/OUT): The RVA of the previous frame, 0 before the first one;
+//      receives that of this frame.
 //
 //  Return Value:
 //
-//    None.
+//    Returns the bytes of the next frame.
 //
-void CallStack::dump(BOOL showInternalFrames)
+static const BYTE* unpackFrame (const BYTE* packed, UINT16& image, UINT32& rva)
 {
-    if (!m_resolved) {
-        resolve(showInternalFrames);
-    }
-
-    // The stack was reoslved already
-    if (m_resolved) {
-        return Print(m_resolved);
+    UINT64 value;
+    packed = getVarint(packed, value);
+    UINT32 zigzag = (UINT32)(value >> 1);
+    rva += (zigzag >> 1) ^ (UINT32)(0 - (zigzag & 1));
+    if (value & 1) {
+        packed = getVarint(packed, value);
+        image = (UINT16)value;
     }
+    return packed;
 }
 
-// Resolve - Creates a nicely formatted rendition of the CallStack, including
-//   symbolic information (function names and line numbers) if available. and
-//   saves it for later retrieval.
+// pack - Stores frames as varint deltas. The RVA of each frame is stored as
+//   its difference from that of the previous frame, zig-zag encoded so that
+//   small negative differences stay small, shifted left by one bit. The low
+//   bit is set if the frame isn't in the same image as the previous one; the
+//   image index follows then. Frames of the same image are usually close to
+//   each other, so most frames take two or three bytes. The frames must have
+//   passed isEncodable with the same table.
 //
-//   Note: The symbol handler must be initialized prior to calling this
-//     function.
+//  - table (IN): The module range table.
 //
-//  - showInternalFrames (IN): If true, then all frames in the CallStack will be
-//      dumped. Otherwise, frames internal to the heap will not be dumped.
+//  - frames (IN): The frames.
+//
+//  - count (IN): Number of frames.
+//
+//  - packed (OUT): Receives the packed frames. May be NULL, to only measure
+//      them.
 //
 //  Return Value:
 //
-//    None.
+//    Returns the size of the packed frames, in bytes.
 //
-int CallStack::resolve(BOOL showInternalFrames)
+SIZE_T CallStack::pack (const moduleranges_t* table, const UINT_PTR* frames, UINT32 count, BYTE* packed)
 {
-    if (m_resolved)
-    {
-        // already resolved, no need to do it again
-        // resolving twice may report an incorrect module for the stack frames
-        // if the memory was leaked in a dynamic library that was already unloaded.
-        return 0;
+    SIZE_T bytes = 0;
+    UINT16 previousImage = MODULEIMAGE_NONE;
+    UINT32 previousRva = 0;
+    const modulerange_t *range = NULL;
+    for (UINT32 frame = 0; frame < count; frame++) {
+        UINT_PTR programCounter = frames[frame];
+        if ((range == NULL) || (programCounter < range->addrLow) || (programCounter > range->addrHigh))
+            range = FindModuleRange(table, programCounter);
+        UINT32 rva = (UINT32)(programCounter - range->addrLow);
+        UINT16 image = (UINT16)range->image;
+        UINT32 delta = rva - previousRva;
+        UINT32 zigzag = (delta << 1) ^ (UINT32)((INT32)delta >> 31);
+        UINT64 value = ((UINT64)zigzag << 1) | ((image != previousImage) ? 1 : 0);
+        bytes += putVarint((packed != NULL) ? packed + bytes : NULL, value);
+        if (image != previousImage)
+            bytes += putVarint((packed != NULL) ? packed + bytes : NULL, image);
+        previousImage = image;
+        previousRva = rva;
     }
+    return bytes;
+}
 
-    if (m_status & CALLSTACK_STATUS_STARTUPCRT) {
-        // there is no need to resolve a leak that will not be reported
-        return 0;
-    }
+// framesSize - Obtains the number of bytes taken by a CallStack's frames.
+//
+//  - count (IN): Number of frames.
+//
+//  - status (IN): The CallStack's status; only CALLSTACK_STATUS_RAWFRAMES and
+//      CALLSTACK_STATUS_CONTEXTTREE matter. The size of packed frames is
+//      kept with them instead.
+//
+//  Return Value:
+//
+//    Returns the size of the frames, in bytes.
+//
+SIZE_T CallStack::framesSize (UINT32 count, UINT32 status)
+{
+    if (status & CALLSTACK_STATUS_RAWFRAMES)
+        return count * sizeof(UINT_PTR);
+    if (status & CALLSTACK_STATUS_CONTEXTTREE)
+        return sizeof(UINT32);
+    return count * (sizeof(UINT32) + sizeof(UINT16));
+}
 
-    if (m_status & CALLSTACK_STATUS_INCOMPLETE) {
-        // This call stack appears to be incomplete. Using StackWalk64 may be
-        // more reliable.
-        Report(L"    HINT: The following call stack may be incomplete. Setting \"StackWalkMethod\"\n"
-            L"      in the vld.ini file to \"safe\" instead of \"fast\" may result in a more\n"
-            L"      complete stack trace.\n");
-    }
+// operator [] - Obtains the program counter of a frame, as it was when the
+//   stack was captured.
+//
+//  - index (IN): The frame, 0 being the innermost one.
+//
+//  Return Value:
+//
+//    Returns the program counter.
+//
+UINT_PTR CallStack::operator [] (UINT32 index) const
+{
+    if (m_status & CALLSTACK_STATUS_RAWFRAMES)
+        return reinterpret_cast<const UINT_PTR*>(m_frames)[index];
 
-    int unresolvedFunctionsCount = 0;
-    IMAGEHLP_LINE64  sourceInfo = { 0 };
-    sourceInfo.SizeOfStruct = sizeof(IMAGEHLP_LINE64);
+    UINT16 image;
+    UINT32 rva;
+    frameImage(index, image, rva);
+    return g_moduleImages.Get(image)->base + rva;
+}
 
-    bool skipStartupLeaks = !!(g_vld.GetOptions() & VLD_OPT_SKIP_CRTSTARTUP_LEAKS);
+// symbolAddress - Obtains the address at which a frame's symbols are looked
+//   up. That is its program counter, unless its module was unloaded and
+//   another image has been loaded over it since; the frame is then resolved
+//   against the old image's symbols, wherever ModuleImages loaded them. The
+//   symbols of an unloaded image are loaded here if need be.
+//
+//  - index (IN): The frame, 0 being the innermost one.
+//
+//  - locker (IN): Proof that the caller holds the DbgHelp lock.
+//
+//  Return Value:
+//
+//    Returns the address to resolve.
+//
+SIZE_T CallStack::symbolAddress (UINT32 index, CriticalSectionLocker<DbgHelp>& locker) const
+{
+    if (m_status & CALLSTACK_STATUS_RAWFRAMES)
+        return reinterpret_cast<const UINT_PTR*>(m_frames)[index];
+
+    UINT16 imageindex;
+    UINT32 rva;
+    frameImage(index, imageindex, rva);
+    const moduleimage_t *image = g_moduleImages.Get(imageindex);
+    if (image->state & MODULEIMAGE_UNLOADED) {
+        UINT_PTR base = g_moduleImages.SymbolBase(imageindex, locker);
+        if (base != 0)
+            return base + rva;
+    }
+    return image->base + rva;
+}
 
-    // Use static here to increase performance, and avoid heap allocs.
-    // It's thread safe because of g_heapMapLock lock.
+// imagePath - Obtains the path of the module image a frame is within.
+//
+//  - index (IN): The frame, 0 being the innermost one.
+//
+//  Return Value:
+//
+//    Returns the path, or NULL if the frame is stored raw.
+//
+LPCWSTR CallStack::imagePath (UINT32 index) const
+{
+    if (m_status & CALLSTACK_STATUS_RAWFRAMES)
+        return NULL;
+
+    UINT16 image;
+    UINT32 rva;
+    frameImage(index, image, rva);
+    return g_moduleImages.Get(image)->path;
+}
+
+// frameLocation - Obtains the module image and offset of a frame, without
+//   resolving it.
+//
+//  - index (IN): The frame, 0 being the innermost one.
+//
+//  - imagePath (OUT): Receives the path of the frame's image.
+//
+//  - rva (OUT): Receives the frame's offset within the image.
+//
+//  Return Value:
+//
+//    Returns false if the frame is stored raw, in which case neither is
+//    known.
+//
+bool CallStack::frameLocation (UINT32 index, LPCWSTR &imagePath, UINT32 &rva) const
+{
+    if (m_status & CALLSTACK_STATUS_RAWFRAMES)
+        return false;
+
+    UINT16 image;
+    frameImage(index, image, rva);
+    imagePath = g_moduleImages.Get(image)->path;
+    return true;
+}
+
+// frameImage - Obtains the image index and RVA of a frame which isn't stored
+//   raw. With CALLSTACK_STATUS_CONTEXTTREE, the frame is found by walking up
+//   the ContextTree from the stack's leaf node.
+//
+//  - index (IN): The frame, 0 being the innermost one.
+//
+//  - image (OUT): Receives the index of the frame's image.
+//
+//  - rva (OUT): Receives the frame's offset within the image.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID CallStack::frameImage (UINT32 index, UINT16 &image, UINT32 &rva) const
+{
+    if (m_status & CALLSTACK_STATUS_CONTEXTTREE) {
+        UINT32 node = m_frames[0];
+        for (UINT32 frame = 0; frame < index; frame++)
+            node = g_contextTree.Parent(node);
+        g_contextTree.Frame(node, image, rva);
+        return;
+    }
+    if (m_status & CALLSTACK_STATUS_PACKED) {
+        const BYTE *packed = reinterpret_cast<const BYTE*>(m_frames + 1);
+        image = MODULEIMAGE_NONE;
+        rva   = 0;
+        for (UINT32 frame = 0; frame <= index; frame++)
+            packed = unpackFrame(packed, image, rva);
+        return;
+    }
+
+    const UINT16 *images = reinterpret_cast<const UINT16*>(m_frames + m_size);
+    image = images[index];
+    rva   = m_frames[index];
+}
+
+// bytes - Obtains the memory taken by the CallStack, frames included. Its
+//   resolved text is kept apart, in g_resolvedText.
+//
+//  Return Value:
+//
+//    Returns the number of bytes allocated for the CallStack.
+//
+SIZE_T CallStack::bytes () const
+{
+    SIZE_T framebytes = (m_status & CALLSTACK_STATUS_PACKED) ? sizeof(UINT32) + m_frames[0] :
+        framesSize(m_size, m_status);
+    return sizeof(CallStack) + ((framebytes > sizeof(UINT32)) ? framebytes - sizeof(UINT32) : 0);
+}
+
+// Destroy - Destroys a CallStack obtained from Capture or Create.
+//
+//  - stack (IN): The CallStack to destroy. May be NULL.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID CallStack::Destroy (CallStack* stack)
+{
+    if (stack == NULL)
+        return;
+    stack->~CallStack();
+    delete [] (BYTE*)stack;
+}
+
+// equalFrames - Compares two CallStacks' frames, 32 bytes at a time. Stacks
+//   which share a hash nearly always are equal, so there's seldom an early
+//   difference for memcmp to stop at, and its byte-wise setup dominates the
+//   short compares of the interning and aggregation lookups.
+//
+//  - first (IN): The first frames.
+//
+//  - second (IN): The second frames.
+//
+//  - size (IN): Size of the frames, in bytes.
+//
+//  Return Value:
+//
+//    Returns true if the frames are identical.
+//
+static bool equalFrames (const BYTE *first, const BYTE *second, SIZE_T size)
+{
+#if !defined(_M_IX86) && !defined(_M_X64)
+    return (memcmp(first, second, size) == 0);
+#else
+    static LONG s_avx2 = -1;
+    if (s_avx2 < 0)
+        s_avx2 = HasAvx2() ? 1 : 0;
+
+    const BYTE *last = first + (size & ~(SIZE_T)31);
+    if (s_avx2) {
+        for (; first < last; first += 32, second += 32) {
+            __m256i diff = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)first),
+                _mm256_loadu_si256((const __m256i*)second));
+            if (!_mm256_testz_si256(diff, diff))
+                return false;
+        }
+    }
+    else {
+        for (; first < last; first += 32, second += 32) {
+            __m128i low = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)first),
+                _mm_loadu_si128((const __m128i*)second));
+            __m128i high = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(first + 16)),
+                _mm_loadu_si128((const __m128i*)(second + 16)));
+            if (_mm_movemask_epi8(_mm_and_si128(low, high)) != 0xffff)
+                return false;
+        }
+    }
+    size &= 31;
+    if (size >= 16) {
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)first),
+            _mm_loadu_si128((const __m128i*)second));
+        if (_mm_movemask_epi8(eq) != 0xffff)
+            return false;
+        first += 16;
+        second += 16;
+        size -= 16;
+    }
+    for (; size >= sizeof(UINT32); size -= sizeof(UINT32), first += sizeof(UINT32), second += sizeof(UINT32)) {
+        if (*(const UINT32*)first != *(const UINT32*)second)
+            return false;
+    }
+    for (; size > 0; size--) {
+        if (*first++ != *second++)
+            return false;
+    }
+    return true;
+#endif
+}
+
+// operator == - Equality operator. Compares the CallStack to another CallStack
+//   for equality. Two CallStacks are equal if they are the same size and if
+//   every frame in each is identical to the corresponding frame in the other.
+//   Stacks with different hashes are told apart without looking at a frame.
+//
+//  other (IN) - Reference to the CallStack to compare the current CallStack
+//    against for equality.
+//
+//  Return Value:
+//
+//    Returns true if the two CallStacks are equal. Otherwise returns false.
+//
+BOOL CallStack::operator == (const CallStack &other) const
+{
+    if (this == &other) {
+        // Interned stacks are shared, so this is the common case.
+        return TRUE;
+    }
+
+    if ((m_size != other.m_size) || (m_hashValue != other.m_hashValue)) {
+        // They can't be equal if the sizes or the hashes are different.
+        return FALSE;
+    }
+
+    const UINT32 encodings = CALLSTACK_STATUS_RAWFRAMES | CALLSTACK_STATUS_CONTEXTTREE | CALLSTACK_STATUS_PACKED;
+    UINT32 encoding = m_status & encodings;
+    if (encoding != (other.m_status & encodings)) {
+        // A raw stack had a frame outside of every image known at the time.
+        // It's kept apart from stacks stored module-relative, and those stored
+        // in the ContextTree are kept apart from those that didn't fit.
+        return FALSE;
+    }
+
+    // In the ContextTree, equal stacks share their leaf node.
+    if (encoding & CALLSTACK_STATUS_CONTEXTTREE)
+        return (m_frames[0] == other.m_frames[0]);
+    if (encoding & CALLSTACK_STATUS_PACKED) {
+        // Equal frames are packed into the same bytes.
+        return (m_frames[0] == other.m_frames[0]) &&
+            equalFrames((const BYTE*)(m_frames + 1), (const BYTE*)(other.m_frames + 1), m_frames[0]);
+    }
+    return equalFrames((const BYTE*)m_frames, (const BYTE*)other.m_frames, framesSize(m_size, encoding));
+}
+
+// matches - Compares the CallStack to frames which haven't been made into a
+//   CallStack. Only meaningful if the module range table hasn't changed
+//   since the CallStack was created, since the same program counter may be
+//   in another image by now.
+//
+//  - frames (IN): The frames, as captured.
+//
+//  - count (IN): Number of frames.
+//
+//  Return Value:
+//
+//    Returns true if the CallStack holds those frames.
+//
+bool CallStack::matches (const UINT_PTR* frames, UINT32 count) const
+{
+    return (m_size == count) && matchesPrefix(frames, count);
+}
+
+// matchesPrefix - Compares the innermost frames of the CallStack to frames
+//   which haven't been made into a CallStack, like matches.
+//
+//  - frames (IN): The frames, as captured.
+//
+//  - count (IN): Number of frames.
+//
+//  Return Value:
+//
+//    Returns true if the CallStack starts with those frames.
+//
+bool CallStack::matchesPrefix (const UINT_PTR* frames, UINT32 count) const
+{
+    if (m_size < count)
+        return false;
+    if (m_status & CALLSTACK_STATUS_RAWFRAMES)
+        return equalFrames((const BYTE*)m_frames, (const BYTE*)frames, count * sizeof(UINT_PTR));
+
+    if (m_status & CALLSTACK_STATUS_CONTEXTTREE) {
+        UINT32 node = m_frames[0];
+        for (UINT32 frame = 0; frame < count; frame++) {
+            UINT16 image;
+            UINT32 rva;
+            g_contextTree.Frame(node, image, rva);
+            if (g_moduleImages.Get(image)->base + rva != frames[frame])
+                return false;
+            node = g_contextTree.Parent(node);
+        }
+        return true;
+    }
+    if (m_status & CALLSTACK_STATUS_PACKED) {
+        const BYTE *packed = reinterpret_cast<const BYTE*>(m_frames + 1);
+        UINT16 image = MODULEIMAGE_NONE;
+        UINT32 rva = 0;
+        for (UINT32 frame = 0; frame < count; frame++) {
+            packed = unpackFrame(packed, image, rva);
+            if (g_moduleImages.Get(image)->base + rva != frames[frame])
+                return false;
+        }
+        return true;
+    }
+
+    const UINT16 *images = reinterpret_cast<const UINT16*>(m_frames + m_size);
+    for (UINT32 frame = 0; frame < count; frame++) {
+        if (g_moduleImages.Get(images[frame])->base + m_frames[frame] != frames[frame])
+            return false;
+    }
+    return true;
+}
+
+
+DWORD CallStack::resolveFunction(SIZE_T programCounter, LPCWSTR imagePath, const symbolinfo_t* symbol,
+    LPWSTR stack_line, DWORD stackLineSize) const
+{
+    LPCWSTR functionName = symbol->functionName;
+    DWORD displacement = (symbol->fileName != NULL) ? symbol->lineDisplacement : (DWORD)symbol->displacement;
+
+    // The image the frame was captured in is known, even if it's unloaded.
+    WCHAR callingModuleName[260];
+    LPCWSTR modulePath = imagePath;
+    if (modulePath == NULL) {
+        HMODULE hCallingModule = GetCallingModule(programCounter);
+        if (hCallingModule &&
+            GetModuleFileName(hCallingModule, callingModuleName, _countof(callingModuleName)) > 0)
+            modulePath = callingModuleName;
+    }
+    LPCWSTR moduleName = L"(Module name unavailable)";
+    if (modulePath != NULL)
+    {
+        moduleName = wcsrchr(modulePath, L'\\');
+        if (moduleName == NULL)
+            moduleName = wcsrchr(modulePath, L'/');
+        if (moduleName != NULL)
+            moduleName++;
+        else
+            moduleName = modulePath;
+    }
+
+    fmt::WArrayWriter w(stack_line, stackLineSize);
+    // Display the current stack frame's information.
+    if (symbol->fileName)
+    {
+        if (displacement == 0)
+        {
+            w.write(L"    {} ({}): {}!{}()\n",
+                symbol->fileName, symbol->lineNumber, moduleName,
+                functionName);
+        }
+        else
+        {
+            w.write(L"    {} ({}): {}!{}() + 0x{:X} bytes\n",
+                symbol->fileName, symbol->lineNumber, moduleName,
+                functionName, displacement);
+        }
+    }
+    else
+    {
+        if (displacement == 0)
+        {
+            w.write(L"    {}!{}()\n",
+                moduleName, functionName);
+        }
+        else
+        {
+            w.write(L"    {}!{}() + 0x{:X} bytes\n",
+                moduleName, functionName, displacement);
+        }
+    }
+    DWORD NumChars = (DWORD)w.size();
+    stack_line[NumChars] = '\0';
+    return NumChars;
+}
+
+// recordAlloc - Counts a block allocated from this call stack in the site's
+//   statistics. The statistics are shared by every thread allocating from
+//   the site, so they are updated with interlocked operations.
+//
+//  - size (IN): Size, in bytes, of the block.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID CallStack::recordAlloc (SIZE_T size)
+{
+    InterlockedIncrement64(&m_allocations);
+    InterlockedIncrement64(&m_liveBlocks);
+    InterlockedExchangeAdd64(&m_allocatedBytes, (LONG64)size);
+    LONG64 live = InterlockedExchangeAdd64(&m_liveBytes, (LONG64)size) + (LONG64)size;
+    LONG64 peak = m_peakBytes;
+    while (live > peak) {
+        LONG64 prev = InterlockedCompareExchange64(&m_peakBytes, live, peak);
+        if (prev == peak)
+            break;
+        peak = prev;
+    }
+}
+
+// recordResize - Changes the size of a block allocated from this call stack
+//   in the site's live statistics, for a block which keeps this call stack
+//   when it's reallocated in place (see ReallocStackPolicy).
+//
+//  - oldsize (IN): Size, in bytes, the block was counted with.
+//
+//  - newsize (IN): Size, in bytes, of the block after the reallocation.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID CallStack::recordResize (SIZE_T oldsize, SIZE_T newsize)
+{
+    LONG64 delta = (LONG64)newsize - (LONG64)oldsize;
+    if (delta > 0)
+        InterlockedExchangeAdd64(&m_allocatedBytes, delta);
+    LONG64 live = InterlockedExchangeAdd64(&m_liveBytes, delta) + delta;
+    LONG64 peak = m_peakBytes;
+    while (live > peak) {
+        LONG64 prev = InterlockedCompareExchange64(&m_peakBytes, live, peak);
+        if (prev == peak)
+            break;
+        peak = prev;
+    }
+}
+
+// recordFree - Removes a block allocated from this call stack from the site's
+//   live statistics.
+//
+//  - size (IN): Size, in bytes, the block had when it was counted by
+//      recordAlloc.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID CallStack::recordFree (SIZE_T size)
+{
+    InterlockedDecrement64(&m_liveBlocks);
+    InterlockedExchangeAdd64(&m_liveBytes, -(LONG64)size);
+}
+
+// recordRealloc - Adds a reallocation which grew a block to this call
+//   stack's statistics. A buffer grown geometrically is reallocated a few
+//   times; one grown by small increments, as by repeated appends, is
+//   reallocated over and over and copied each time.
+//
+//  - oldsize (IN): Size, in bytes, of the block before the reallocation.
+//
+//  - newsize (IN): Size, in bytes, of the block after the reallocation.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID CallStack::recordRealloc (SIZE_T oldsize, SIZE_T newsize)
+{
+    InterlockedIncrement64(&m_reallocs);
+    if ((newsize - oldsize) < oldsize / 2)
+        InterlockedIncrement64(&m_smallReallocs);
+    InterlockedExchangeAdd64(&m_reallocFromBytes, (LONG64)oldsize);
+    InterlockedExchangeAdd64(&m_reallocToBytes, (LONG64)newsize);
+}
+
+// recordLifetime - Adds a freed block to this call stack's lifetime
+//   histogram, in the log2 bucket of its lifetime.
+//
+//  - lifetime (IN): Number of allocations made while the block was
+//      allocated.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID CallStack::recordLifetime (SIZE_T lifetime)
+{
+    DWORD bucket = 0;
+#ifdef _WIN64
+    _BitScanReverse64(&bucket, lifetime | 1);
+#else
+    _BitScanReverse(&bucket, lifetime | 1);
+#endif
+    if (bucket >= VLD_LIFETIME_BUCKETS)
+        bucket = VLD_LIFETIME_BUCKETS - 1;
+    InterlockedIncrement(&m_lifetimes[bucket]);
+}
+
+// recordFreeThread - Counts a freed block by whether the thread which freed it
+//   is the one which allocated it. Blocks handed from a producer thread to a
+//   consumer which frees them show up as cross-thread frees; for most heaps
+//   they are the slow ones, since they go back to another thread's cache.
+//
+//  - crossThread (IN): Whether another thread freed the block.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID CallStack::recordFreeThread (bool crossThread)
+{
+    InterlockedIncrement64(crossThread ? &m_crossThreadFrees : &m_sameThreadFrees);
+}
+
+// getSiteStatistics - Obtains the site's statistics and its innermost frames.
+//
+//  - site (OUT): Receives the statistics.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID CallStack::getSiteStatistics (VLD_SITE_STATISTICS &site) const
+{
+    site.hash        = m_hashValue;
+    site.frameCount  = m_size;
+    site.liveBlocks  = m_liveBlocks;
+    site.liveBytes   = m_liveBytes;
+    site.allocations = m_allocations;
+    site.peakBytes   = m_peakBytes;
+    site.allocatedBytes = m_allocatedBytes;
+    // Every block counted by recordAlloc is either still live or was freed.
+    site.frees       = site.allocations - site.liveBlocks;
+    site.reallocs    = m_reallocs;
+    site.smallReallocs = m_smallReallocs;
+    site.reallocFromBytes = m_reallocFromBytes;
+    site.reallocToBytes = m_reallocToBytes;
+    site.sameThreadFrees = m_sameThreadFrees;
+    site.crossThreadFrees = m_crossThreadFrees;
+    for (UINT32 bucket = 0; bucket < VLD_LIFETIME_BUCKETS; bucket++)
+        site.lifetimes[bucket] = (unsigned int)m_lifetimes[bucket];
+    UINT32 frame = 0;
+    for (; (frame < m_size) && (frame < VLD_SITE_FRAMES); frame++)
+        site.frames[frame] = (const void*)(*this)[frame];
+    for (; frame < VLD_SITE_FRAMES; frame++)
+        site.frames[frame] = NULL;
+}
+
+
+// isCrtStartupAlloc - Determines whether the memory leak was generated from crt startup code.
+// This is not an actual memory leaks as it is freed by crt after the VLD object has been destroyed.
+//
+//  Return Value:
+//
+//    true if isCrtStartupModule for any callstack frame returns true.
+//
+bool CallStack::isCrtStartupAlloc()
+{
+    if (m_status & CALLSTACK_STATUS_STARTUPCRT) {
+        return true;
+    } else if (m_status & CALLSTACK_STATUS_NOTSTARTUPCRT) {
+        return false;
+    }
+
+    if (g_vld.GetSymbolLevel() < VLD_SYMBOLS_FUNCTION) {
+        // Without function names, startup code can't be told apart.
+        m_status |= CALLSTACK_STATUS_NOTSTARTUPCRT;
+        return false;
+    }
+
+    CriticalSectionLocker<DbgHelp> locker(g_DbgHelp);
+
+    // Iterate through each frame in the call stack.
+    for (UINT32 frame = 0; frame < m_size; frame++) {
+        // Try to get the source file and line number associated with
+        // this program counter address.
+        SIZE_T programCounter = symbolAddress(frame, locker);
+        UINT status;
+        if (!g_crtStartupRanges.Classify(programCounter, status, locker)) {
+            // The module's ranges are incomplete; go by the name.
+            const symbolinfo_t* symbol = g_symbolCache.Lookup(programCounter, locker);
+            status = isCrtStartupFunction(symbol->functionName);
+        }
+
+        m_status |= status;
+        if (m_status & CALLSTACK_STATUS_STARTUPCRT) {
+            return true;
+        } else if (m_status & CALLSTACK_STATUS_NOTSTARTUPCRT) {
+            return false;
+        }
+    }
+
+    m_status |= CALLSTACK_STATUS_NOTSTARTUPCRT;
+    return false;
+}
+
+
+// dump - Dumps a nicely formatted rendition of the CallStack, including
+//   symbolic information (function names and line numbers) if available.
+//
+//   Note: The symbol handler must be initialized prior to calling this
+//     function.
+//
+//  - showinternalframes (IN): If true, then all frames in the CallStack will be
+//      dumped. Otherwise, frames internal to the heap will not be dumped.
+//
+//  Return Value:
+//
+//    None.
+//
+void CallStack::dump(BOOL showInternalFrames)
+{
+    if (!m_resolved) {
+        resolve(showInternalFrames);
+    }
+
+    // The stack was reoslved already
+    if (m_resolved) {
+        return Print(m_resolved);
+    }
+}
+
+// Resolve - Creates a nicely formatted rendition of the CallStack, including
+//   symbolic information (function names and line numbers) if available. and
+//   saves it for later retrieval.
+//
+//   Note: The symbol handler must be initialized prior to calling this
+//     function.
+//
+//  - showInternalFrames (IN): If true, then all frames in the CallStack will be
+//      dumped. Otherwise, frames internal to the heap will not be dumped.
+//
+//  Return Value:
+//
+//    None.
+//
+int CallStack::resolve(BOOL showInternalFrames)
+{
+    if (m_resolved)
+    {
+        // already resolved, no need to do it again
+        // resolving twice may report an incorrect module for the stack frames
+        // if the memory was leaked in a dynamic library that was already unloaded.
+        return 0;
+    }
+
+    if (m_status & CALLSTACK_STATUS_STARTUPCRT) {
+        // there is no need to resolve a leak that will not be reported
+        return 0;
+    }
+
+    if (m_status & CALLSTACK_STATUS_INCOMPLETE) {
+        // This call stack appears to be incomplete. Using StackWalk64 may be
+        // more reliable.
+        Report(L"    HINT: The following call stack may be incomplete. Setting \"StackWalkMethod\"\n"
+            L"      in the vld.ini file to \"safe\" instead of \"fast\" may result in a more\n"
+            L"      complete stack trace.\n");
+    }
+
+    int unresolvedFunctionsCount = 0;
+
+    bool skipStartupLeaks = !!(g_vld.GetOptions() & VLD_OPT_SKIP_CRTSTARTUP_LEAKS);
+
+    // Use static here to increase performance, and avoid heap allocs.
+    // It's thread safe because of the g_DbgHelp lock.
     static WCHAR stack_line[MAXREPORTLENGTH + 1] = L"";
     bool isPrevFrameInternal = false;
     DWORD NumChars = 0;
     CriticalSectionLocker<DbgHelp> locker(g_DbgHelp);
+    if (m_resolved || (m_status & CALLSTACK_STATUS_STARTUPCRT)) {
+        // Another thread resolved this stack while we waited for the lock.
+        return 0;
+    }
+
+    // The text is appended in place to the arena, which leaves room for
+    // every frame's line to be as long as possible, plus the terminator.
+    size_t resolvedLength = 0;
+    LPWSTR resolved = g_resolvedText.Reserve(m_size * MAXREPORTLENGTH, locker);
+
+    // Iterate through each frame in the call stack.
+    for (UINT32 frame = 0; frame < m_size; frame++)
+    {
+        // Try to get the source file and line number associated with
+        // this program counter address.
+        if (g_vld.isVldAddress((*this)[frame]))
+            continue;
+
+        SIZE_T programCounter = symbolAddress(frame, locker);
+        const symbolinfo_t* symbol = g_symbolCache.Lookup(programCounter, locker);
+
+        if (skipStartupLeaks) {
+            if (!(m_status & (CALLSTACK_STATUS_STARTUPCRT | CALLSTACK_STATUS_NOTSTARTUPCRT))) {
+                m_status |= isCrtStartupFunction(symbol->functionName);
+            }
+            if (m_status & CALLSTACK_STATUS_STARTUPCRT) {
+                // Nothing was committed, so the reserved room is simply reused.
+                return 0;
+            }
+        }
+
+        bool isFrameInternal = false;
+        if ((symbol->fileName != NULL) && !showInternalFrames) {
+            if (symbol->internalFile) {
+                // Don't show frames in files internal to the heap.
+                isFrameInternal = true;
+            }
+        }
+
+        // show one allocation function for context
+        if (NumChars > 0 && !isFrameInternal && isPrevFrameInternal) {
+            memcpy(resolved + resolvedLength, stack_line, NumChars * sizeof(WCHAR));
+            resolvedLength += NumChars;
+        }
+        isPrevFrameInternal = isFrameInternal;
+
+        NumChars = resolveFunction( programCounter, imagePath(frame), symbol, stack_line, _countof( stack_line ));
+
+        if (NumChars > 0 && !isFrameInternal) {
+            memcpy(resolved + resolvedLength, stack_line, NumChars * sizeof(WCHAR));
+            resolvedLength += NumChars;
+        }
+    } // end for loop
+
+    // The room was reserved for the worst case; keep only what was used.
+    resolved[resolvedLength] = L'\0';
+    g_resolvedText.Commit(resolvedLength, locker);
+    m_resolved = resolved;
+
+    m_status |= CALLSTACK_STATUS_NOTSTARTUPCRT;
+    return unresolvedFunctionsCount;
+}
+
+const WCHAR* CallStack::getResolvedCallstack( BOOL showinternalframes )
+{
+    resolve(showinternalframes);
+    return m_resolved;
+}
+// The functions which tell whether a call stack is CRT startup code, as
+// masks: a leading or trailing '*' matches any suffix or prefix. The first
+// frame, from the innermost outwards, whose function matches decides.
+static const struct {
+    LPCWSTR mask;
+    UINT    status;
+} s_crtStartupFunctions [] = {
+    { L"_malloc_crt*",                          CALLSTACK_STATUS_STARTUPCRT },
+    { L"_calloc_crt*",                          CALLSTACK_STATUS_STARTUPCRT },
+    { L"*CRT_INIT",                             CALLSTACK_STATUS_STARTUPCRT },
+    { L"*initterm_e",                           CALLSTACK_STATUS_STARTUPCRT },
+    { L"_cinit*",                               CALLSTACK_STATUS_STARTUPCRT },
+    { L"std::`dynamic initializer for '*",      CALLSTACK_STATUS_STARTUPCRT },
+    // VS2008 Release
+    { L"std::locale::facet::facet_Register",    CALLSTACK_STATUS_STARTUPCRT },
+    // VS2010 Release
+    { L"std::locale::facet::_Facet_Register",   CALLSTACK_STATUS_STARTUPCRT },
+    // VS2012 Release
+    { L"std::locale::_Init()*",                 CALLSTACK_STATUS_STARTUPCRT },
+    { L"std::basic_streambuf<*",                CALLSTACK_STATUS_STARTUPCRT },
+    // VS2015
+    { L"common_initialize_environment_nolock<*", CALLSTACK_STATUS_STARTUPCRT },
+    { L"common_configure_argv<*",               CALLSTACK_STATUS_STARTUPCRT },
+    { L"__acrt_initialize*",                    CALLSTACK_STATUS_STARTUPCRT },
+    { L"__acrt_allocate_buffer_for_argv*",      CALLSTACK_STATUS_STARTUPCRT },
+    { L"_register_onexit_function*",            CALLSTACK_STATUS_STARTUPCRT },
+    // VS2015 Release
+    { L"setlocale",                             CALLSTACK_STATUS_STARTUPCRT },
+    { L"_wsetlocale",                           CALLSTACK_STATUS_STARTUPCRT },
+    { L"_Getctype",                             CALLSTACK_STATUS_STARTUPCRT },
+    { L"std::_Facet_Register",                  CALLSTACK_STATUS_STARTUPCRT },
+    { L"*>::_Getcat",                           CALLSTACK_STATUS_STARTUPCRT },
+    // Added fixes
+    { L"*initterm",                             CALLSTACK_STATUS_STARTUPCRT },
+
+    // When we reach one of these there is no reason going further down the stack
+    { L"*DllMainCRTStartup",                    CALLSTACK_STATUS_NOTSTARTUPCRT },
+    { L"*mainCRTStartup",                       CALLSTACK_STATUS_NOTSTARTUPCRT },
+
+    // NOTE: This is tricky...
+    //   This happens for c++ static initialization
+    //   In some cases, we will see
+    //       "namespace::`dynamic initializer for 'symbol'"
+    //   In other cases, there is no namespace prepended, even if the symbol is in a namespace:
+    //       "`dynamic initializer for 'namespace::symbol'"
+    // This happens above initterm in the stack, which means these statics can be ignored by the code above if they have the namespace
+
+    // Ideally, we would ignore dynamic initializers if we (somehow) know there is also a matching "`dynamic atexit destructor for 'symbol'"
+    // It's possible to use some kind of heuristic to detect this (the stack will have ..., classname::classname, dynamic initializer for, initterm, ...)
+    // That means that the caller really needs a state machine as we are doing some context-sensitive parsing
+
+    // For now, we just make the (possibly wrong) assumption that all dynamic initializations will be cleaned up
+    // Therefore, the following entry is commented out.
+    //     Clearly wrong when we have a global written as "static void* foo = malloc(1);"
+    //     But we can look at a more complex fix if we need to handle that
+    //{ L"`dynamic initializer for '*",         CALLSTACK_STATUS_NOTSTARTUPCRT },
+};
+
+// matchMask - Matches a function name against one of the masks above.
+static bool matchMask (LPCWSTR name, size_t len, LPCWSTR mask)
+{
+    size_t count = wcslen(mask);
+    if (mask[0] == L'*')
+        return (len >= count - 1) && (wcsncmp(name + len - (count - 1), mask + 1, count - 1) == 0);
+    if (mask[count - 1] == L'*')
+        return (len >= count - 1) && (wcsncmp(name, mask, count - 1) == 0);
+    return (len == count) && (wcsncmp(name, mask, count) == 0);
+}
+
+// crtStartupStatus - Classifies a function by its name.
+//
+//  Return Value:
+//
+//    Returns CALLSTACK_STATUS_STARTUPCRT if the function is CRT startup code,
+//    CALLSTACK_STATUS_NOTSTARTUPCRT if it's known not to be called from CRT
+//    startup code, or 0 if it tells neither.
+//
+static UINT crtStartupStatus (LPCWSTR functionName, size_t len)
+{
+    for (UINT index = 0; index < _countof(s_crtStartupFunctions); index++) {
+        if (matchMask(functionName, len, s_crtStartupFunctions[index].mask))
+            return s_crtStartupFunctions[index].status;
+    }
+    return 0;
+}
+
+UINT CallStack::isCrtStartupFunction( LPCWSTR functionName ) const
+{
+    return crtStartupStatus(functionName, wcslen(functionName));
+}
+
+// isInternalFile - Determines whether a source file is internal to the heap,
+//   so that its frames are left out of the leak report. Only called once per
+//   program counter, when the SymbolCache looks it up.
+static bool isInternalFile (LPCWSTR filename)
+{
+    size_t len = wcslen(filename);
+    return
+        // VS2015
+        endWith(filename, len, L"\\atlmfc\\include\\atlsimpstr.h") ||
+        endWith(filename, len, L"\\atlmfc\\include\\cstringt.h") ||
+        endWith(filename, len, L"\\atlmfc\\src\\mfc\\afxmem.cpp") ||
+        endWith(filename, len, L"\\atlmfc\\src\\mfc\\strcore.cpp") ||
+        endWith(filename, len, L"\\vcstartup\\src\\heap\\new_scalar.cpp") ||
+        endWith(filename, len, L"\\vcstartup\\src\\heap\\new_array.cpp") ||
+        endWith(filename, len, L"\\vcstartup\\src\\heap\\new_debug.cpp") ||
+        endWith(filename, len, L"\\ucrt\\src\\appcrt\\heap\\align.cpp") ||
+        endWith(filename, len, L"\\ucrt\\src\\appcrt\\heap\\malloc.cpp") ||
+        endWith(filename, len, L"\\ucrt\\src\\appcrt\\heap\\debug_heap.cpp") ||
+        // VS2013
+        beginWith(filename, len, L"f:\\dd\\vctools\\crt\\crtw32\\") ||
+        //endWith(filename, len, L"\\crt\\crtw32\\misc\\dbgheap.c") ||
+        //endWith(filename, len, L"\\crt\\crtw32\\misc\\dbgnew.cpp") ||
+        //endWith(filename, len, L"\\crt\\crtw32\\misc\\dbgmalloc.c") ||
+        //endWith(filename, len, L"\\crt\\crtw32\\misc\\dbgrealloc.c") ||
+        //endWith(filename, len, L"\\crt\\crtw32\\heap\\new.cpp") ||
+        //endWith(filename, len, L"\\crt\\crtw32\\heap\\new2.cpp") ||
+        //endWith(filename, len, L"\\crt\\crtw32\\heap\\malloc.c") ||
+        //endWith(filename, len, L"\\crt\\crtw32\\heap\\realloc.c") ||
+        //endWith(filename, len, L"\\crt\\crtw32\\heap\\calloc.c") ||
+        //endWith(filename, len, L"\\crt\\crtw32\\heap\\calloc_impl.c") ||
+        //endWith(filename, len, L"\\crt\\crtw32\\string\\strdup.c") ||
+        //endWith(filename, len, L"\\crt\\crtw32\\string\\wcsdup.c") ||
+        // VS2010
+        endWith(filename, len, L"\\crt\\src\\afxmem.cpp") ||
+        endWith(filename, len, L"\\crt\\src\\dbgheap.c") ||
+        endWith(filename, len, L"\\crt\\src\\dbgnew.cpp") ||
+        endWith(filename, len, L"\\crt\\src\\dbgmalloc.c") ||
+        endWith(filename, len, L"\\crt\\src\\dbgcalloc.c") ||
+        endWith(filename, len, L"\\crt\\src\\dbgrealloc.c") ||
+        endWith(filename, len, L"\\crt\\src\\dbgdel.cp") ||
+        endWith(filename, len, L"\\crt\\src\\new.cpp") ||
+        endWith(filename, len, L"\\crt\\src\\newaop.cpp") ||
+        endWith(filename, len, L"\\crt\\src\\malloc.c") ||
+        endWith(filename, len, L"\\crt\\src\\realloc.c") ||
+        endWith(filename, len, L"\\crt\\src\\free.c") ||
+        endWith(filename, len, L"\\crt\\src\\strdup.c") ||
+        endWith(filename, len, L"\\crt\\src\\wcsdup.c") ||
+        endWith(filename, len, L"\\vc\\include\\xmemory0") ||
+        // default
+        (false);
+}
+
+// isInternalModule - Determines whether a module is part of the heap or of the
+//   runtime libraries, whose frames often have no line information to tell
+//   them apart with (see isInternalFile).
+static bool isInternalModule (LPCWSTR imagePath)
+{
+    if (imagePath == NULL)
+        return false;
+
+    LPCWSTR name = wcsrchr(imagePath, L'\\');
+    name = (name != NULL) ? name + 1 : imagePath;
+    return
+        (_wcsicmp(name, L"ntdll.dll") == 0) ||
+        (_wcsicmp(name, L"kernel32.dll") == 0) ||
+        (_wcsicmp(name, L"kernelbase.dll") == 0) ||
+        (_wcsicmp(name, L"ucrtbase.dll") == 0) ||
+        (_wcsicmp(name, L"ucrtbased.dll") == 0) ||
+        (_wcsnicmp(name, L"msvcr", 5) == 0) ||
+        (_wcsnicmp(name, L"vcruntime", 9) == 0);
+}
+
+// userFrame - Finds the innermost frame of the call stack which is outside of
+//   VLD, of the source files internal to the heap and of the heap and runtime
+//   library modules: the program's own code which allocated the block. Frames
+//   are looked up innermost first, and the innermost ones are shared by most
+//   call stacks, so their symbols are usually cached already.
+//
+//  - index (OUT): Receives the frame's index, 0 being the innermost one.
+//
+//  - locker (IN): Proof that the caller holds the DbgHelp lock.
+//
+//  Return Value:
+//
+//    Returns false if every frame is internal.
+//
+bool CallStack::userFrame (UINT32 &index, CriticalSectionLocker<DbgHelp>& locker) const
+{
+    for (UINT32 frame = 0; frame < m_size; frame++) {
+        if (g_vld.isVldAddress((*this)[frame]))
+            continue;
+        if (isInternalModule(imagePath(frame)))
+            continue;
+        const symbolinfo_t* symbol = g_symbolCache.Lookup(symbolAddress(frame, locker), locker);
+        if (symbol->internalFile)
+            continue;
+        index = frame;
+        return true;
+    }
+    return false;
+}
+
+// The number of VLD frames between captureFast and the frame that entered
+// VLD's code (context.fp) is the same for every call through the same hook
+// and the same capture path. It is learned on the first capture and then
+// passed to RtlCaptureStackBackTrace as FramesToSkip, so that only the frames
+// that are kept get captured. A slot may be overwritten by another hook, or
+// read while being written; captureFast verifies the frame it lands on, so
+// that only costs a second capture.
+#define CALLSTACK_SKIP_SLOTS 64 // Number of learned skip counts (a power of two).
+
+struct skipslot_t {
+    UINT_PTR key;  // context.func combined with the return address of captureFast.
+    UINT32   skip; // Frames to skip to land on context.fp.
+};
+
+static skipslot_t s_fastSkip [CALLSTACK_SKIP_SLOTS];
+
+// captureFast - Traces the stack with RtlCaptureStackBackTrace.
+//
+//   Note: This function uses a very efficient method to walk the stack from
+//     frame to frame, so it is quite fast. However, unconventional stack frames
+//     (such as those created when frame pointer omission optimization is used)
+//     will not be successfully walked by this function and will cause the
+//     stack trace to terminate prematurely.
+//
+//  - maxdepth (IN): Maximum number of frames to trace back.
+//
+//  - context (IN): Context at which to begin the stack trace.
+//
+//  - frames (OUT): Receives the frames. Must have room for
+//      CALLSTACK_MAX_CAPTURE + 1 entries.
+//
+//  - hashValue (OUT): Receives the hash of the frames that were kept.
+//
+//  Return Value:
+//
+//    Returns the number of frames stored in "frames".
+//
+__declspec(noinline)
+UINT32 CallStack::captureFast (UINT32 maxdepth, const context_t& context, UINT_PTR* frames, DWORD& hashValue)
+{
+    UINT32  count = 0;
+    UINT_PTR function = context.func;
+    if (function != NULL)
+    {
+        frames[count++] = function;
+    }
+
+    // Capture right behind the function frame. This runs for every tracked
+    // allocation, so it must not touch the heap. The return address tells the
+    // Capture and CaptureFrames paths apart; they are not equally deep.
+    UINT_PTR* captured = frames + count;
+    UINT_PTR key = function ^ (UINT_PTR)_ReturnAddress();
+    skipslot_t& slot = s_fastSkip[(key ^ (key >> 12)) & (CALLSTACK_SKIP_SLOTS - 1)];
+    UINT32 maxframes = min(CALLSTACK_MAX_CAPTURE, maxdepth);
+    UINT32 index = 0;
+    if (slot.key == key) {
+        // Frames are counted from our caller; this function's own frame is
+        // the one RtlCaptureStackBackTrace already leaves out.
+        UINT32 skip = slot.skip;
+        index = RtlCaptureStackBackTrace(skip, maxframes, reinterpret_cast<PVOID*>(captured), NULL);
+        if ((index == 0) || (captured[0] != context.fp)) {
+            index = 0;
+        }
+    }
+
+    if (index == 0) {
+        // Unknown or stale skip count: capture from our caller and look for
+        // the frame that entered VLD's code.
+        UINT32 captureframes = min(CALLSTACK_MAX_CAPTURE, maxdepth + 10);
+        captureframes = RtlCaptureStackBackTrace(0, captureframes, reinterpret_cast<PVOID*>(captured), NULL);
+        UINT32 startIndex = 0;
+        while (index < captureframes) {
+            if (captured[index] == 0)
+                break;
+            if (captured[index] == context.fp)
+                startIndex = index;
+            index++;
+        }
+        if (startIndex > 0) {
+            slot.skip = startIndex;
+            slot.key = key;
+        }
+
+        // Drop the frames above the one that entered VLD's code.
+        index = min(index - startIndex, maxframes);
+        if (startIndex > 0) {
+            memmove(captured, captured + startIndex, index * sizeof(UINT_PTR));
+        }
+    }
+
+    // Drop any frames past the first NULL.
+    UINT32 kept = 0;
+    while ((kept < index) && (captured[kept] != 0)) {
+        kept++;
+    }
+    count += kept;
+    hashValue = hashFrames(frames, count);
+    return count;
+}
+
+// captureSafe - Traces the stack with StackWalk64.
+//
+//   Note: This function uses a documented Windows API to walk the stack. This
+//     API is supposed to be the most reliable way to walk the stack. It claims
+//     to be able to walk stack frames that do not follow the conventional stack
+//     frame layout. However, this robustness comes at a cost: it is *extremely*
+//     slow compared to walking frames by following frame (base) pointers.
+//
+//  - maxdepth (IN): Maximum number of frames to trace back.
+//
+//  - context (IN): Context at which to begin the stack trace.
+//
+//  - frames (IN/OUT): Scratch buffer receiving the frames. If it fills up, a
+//      bigger buffer is allocated and returned here; the caller must free it.
+//
+//  - capacity (IN/OUT): Number of entries in "frames".
+//
+//  Return Value:
+//
+//    Returns the number of frames stored in "frames".
+//
+UINT32 CallStack::captureSafe (UINT32 maxdepth, const context_t& context, UINT_PTR*& frames, UINT32& capacity)
+{
+    UINT32 count = 0;
+    UINT32 size = 0;
+    UINT_PTR* const scratch = frames;
+
+    UINT_PTR function = context.func;
+    if (function != NULL)
+    {
+        count++;
+        frames[size++] = function;
+    }
+
+    // Get the required values for initialization of the STACKFRAME64 structure
+    // to be passed to StackWalk64(). Required fields are AddrPC and AddrFrame.
+    CONTEXT currentContext;
+    if (!materializeContext(context, currentContext))
+    {
+        return size;
+    }
+
+    count++;
+    frames[size++] = (UINT_PTR)currentContext.IPREG;
+
+    DWORD   architecture   = X86X64ARCHITECTURE;
+
+    // Initialize the STACKFRAME64 structure.
+    STACKFRAME64 frame;
+    memset(&frame, 0x0, sizeof(frame));
+    frame.AddrPC.Offset       = currentContext.IPREG;
+    frame.AddrPC.Mode         = AddrModeFlat;
+    frame.AddrStack.Offset    = currentContext.SPREG;
+    frame.AddrStack.Mode      = AddrModeFlat;
+    frame.AddrFrame.Offset    = currentContext.BPREG;
+    frame.AddrFrame.Mode      = AddrModeFlat;
+    frame.Virtual             = TRUE;
+
+    // Only dbghelp needs to be serialized. The heap hooks skip calls made
+    // while the DbgHelp lock is held, so the walk can't enter the heap map
+    // lock, and no part of the heap map is held while the stack is walked.
+    CriticalSectionLocker<DbgHelp> locker(g_DbgHelp);
+
+    // Walk the stack.
+    while (count < maxdepth) {
+        count++;
+        DbgTrace(L"dbghelp32.dll %i: StackWalk64\n", GetCurrentThreadId());
+        if (!g_DbgHelp.StackWalk64(architecture, g_currentProcess, g_currentThread, &frame, &currentContext, NULL,
+            SymFunctionTableAccess64, SymGetModuleBase64, NULL, locker)) {
+                // Couldn't trace back through any more frames.
+                break;
+        }
+        if (frame.AddrFrame.Offset == 0) {
+            // End of stack.
+            break;
+        }
+
+        if (size == capacity) {
+            // Out of scratch space; double it.
+            UINT_PTR* bigger = new UINT_PTR [capacity * 2];
+            memcpy(bigger, frames, size * sizeof(UINT_PTR));
+            if (frames != scratch) {
+                delete [] frames;
+            }
+            frames = bigger;
+            capacity *= 2;
+        }
+
+        // Store this frame's program counter.
+        frames[size++] = (UINT_PTR)frame.AddrPC.Offset;
+    }
+    return size;
+}
+
+// materializeContext - Rebuilds the registers of the code which called the
+//   hook at which the allocation entered VLD's code, for the walkers which
+//   need more than its return address. The hooks only record that return
+//   address and its location, since capturing a full CONTEXT on every
+//   allocation and free costs more than most walks. On x64, the current
+//   context is captured and VLD's own frames are unwound until the one which
+//   returns to the caller is popped, which restores the caller's nonvolatile
+//   registers as well. On x86, the hook's frame (every VLD function has one)
+//   holds the caller's frame pointer right below the return address.
+//
+//  - context (IN): The context recorded by the hook.
+//
+//  - registers (OUT): Receives the caller's registers.
+//
+//  Return Value:
+//
+//    Returns true if the registers could be rebuilt.
+//
+bool CallStack::materializeContext (const context_t& context, CONTEXT& registers)
+{
+    memset(&registers, 0, sizeof(registers));
+    if ((context.stack == NULL) || (context.fp == NULL))
+        return false;
+
+#if defined(_M_X64) || defined(_M_ARM64)
+    RtlCaptureContext(&registers);
+    UNWIND_HISTORY_TABLE history;
+    memset(&history, 0, sizeof(history));
+    for (UINT32 frame = 0; registers.SPREG <= context.stack; frame++) {
+        if (frame == CALLSTACK_MAX_CAPTURE)
+            return false;
+        DWORD64 imageBase;
+        PRUNTIME_FUNCTION entry = RtlLookupFunctionEntry(registers.IPREG, &imageBase, &history);
+        if (entry == NULL) {
+#if defined(_M_X64)
+            registers.Rip = *(DWORD64*)registers.Rsp;
+            registers.Rsp += sizeof(DWORD64);
+#else
+            // A leaf function; it returns through the link register.
+            if (registers.Pc == registers.Lr)
+                return false;
+            registers.Pc = registers.Lr;
+#endif
+        }
+        else {
+            PVOID   handlerData;
+            DWORD64 establisherFrame;
+            RtlVirtualUnwind(UNW_FLAG_NHANDLER, imageBase, registers.IPREG, entry, &registers,
+                &handlerData, &establisherFrame, NULL);
+        }
+        if (registers.IPREG == 0)
+            return false;
+    }
+    return (registers.IPREG == context.fp);
+#elif defined(_M_IX86)
+    registers.Eip = (DWORD)context.fp;
+    registers.Esp = (DWORD)(context.stack + sizeof(UINT_PTR));
+    registers.Ebp = *(DWORD*)(context.stack - sizeof(UINT_PTR));
+    return true;
+#endif
+}
+
+#if defined(_M_X64) || defined(_M_ARM64)
+// captureUnwind - Traces the stack by unwinding it with the x64 or ARM64
+//   unwind data, the same data exception dispatching relies on.
+//   RtlLookupFunctionEntry finds each function's unwind information without
+//   taking the loader lock or the DbgHelp lock, so unlike captureSafe this
+//   can be used at any allocation rate, and from any number of threads at
+//   once.
+//
+//   Note: A function without unwind information is a leaf function, which
+//     on x64 leaves the stack pointer pointing at its return address. Every
+//     address read off the stack is checked against the thread's stack
+//     limits first. On ARM64, only the innermost frame can be a leaf, and
+//     VLD's own functions all have unwind data, so the walk stops at one.
+//
+//  - maxdepth (IN): Maximum number of frames to trace back.
+//
+//  - context (IN): Context at which to begin the stack trace.
+//
+//  - frames (OUT): Receives the frames.
+//
+//  - capacity (IN): Room in "frames", in frames.
+//
+//  Return Value:
+//
+//    Returns the number of frames captured.
+//
+UINT32 CallStack::captureUnwind (UINT32 maxdepth, const context_t& context, UINT_PTR* frames, UINT32 capacity)
+{
+    UINT32 size = 0;
+    UINT32 limit = min(maxdepth, capacity);
+
+    UINT_PTR function = context.func;
+    if ((function != NULL) && (size < limit))
+        frames[size++] = function;
+    CONTEXT currentContext;
+    if ((size == limit) || !materializeContext(context, currentContext))
+        return size;
+    frames[size++] = (UINT_PTR)currentContext.IPREG;
+
+    NT_TIB *tib = (NT_TIB*)NtCurrentTeb();
+    DWORD64 stackLow  = (DWORD64)tib->StackLimit;
+    DWORD64 stackHigh = (DWORD64)tib->StackBase;
+
+    // Caches the function entries looked up during this walk.
+    UNWIND_HISTORY_TABLE history;
+    memset(&history, 0, sizeof(history));
+
+    while (size < limit) {
+        DWORD64 stackPointer = currentContext.SPREG;
+        DWORD64 imageBase;
+        PRUNTIME_FUNCTION entry = RtlLookupFunctionEntry(currentContext.IPREG, &imageBase, &history);
+        if (entry == NULL) {
+#if defined(_M_X64)
+            // A leaf function; its return address is at the top of the stack.
+            if ((stackPointer < stackLow) || (stackPointer + sizeof(DWORD64) > stackHigh))
+                break;
+            currentContext.Rip = *(DWORD64*)stackPointer;
+            currentContext.Rsp = stackPointer + sizeof(DWORD64);
+#else
+            UNREFERENCED_PARAMETER(stackLow);
+            break;
+#endif
+        }
+        else {
+            PVOID   handlerData;
+            DWORD64 establisherFrame;
+            RtlVirtualUnwind(UNW_FLAG_NHANDLER, imageBase, currentContext.IPREG, entry, &currentContext,
+                &handlerData, &establisherFrame, NULL);
+        }
+
+        if (currentContext.IPREG == 0) {
+            // End of stack.
+            break;
+        }
+        if ((currentContext.SPREG <= stackPointer) || (currentContext.SPREG > stackHigh)) {
+            // The unwind went astray; the stack only ever unwinds upwards.
+            break;
+        }
+
+        // Store this frame's program counter.
+        frames[size++] = (UINT_PTR)currentContext.IPREG;
+    }
+    return size;
+}
+#endif // _M_X64 || _M_ARM64
+
+#if defined(_M_X64)
+// captureShadow - Reads the frames off the thread's CET shadow stack, which
+//   holds exactly the return addresses of the calls in progress, whether or
+//   not the functions making them have frame pointers or unwind data. The
+//   entries below the one which returns to the code that entered VLD's code
+//   (context.fp) are VLD's own, and are skipped. Falls back to captureFast
+//   when the process doesn't run with a shadow stack, or that entry isn't
+//   found.
+//
+//   Note: Every entry is read within the shadow stack's region, as
+//     VirtualQuery found it; the region is remembered per thread. A value
+//     pointing into the shadow stack itself is a restore token, which ends
+//     the walk.
+//
+//  - maxdepth (IN): Maximum number of frames to trace back.
+//
+//  - context (IN): Context at which to begin the stack trace.
+//
+//  - frames (OUT): Receives the frames. Must have room for
+//      CALLSTACK_MAX_CAPTURE + 1 entries.
+//
+//  - capacity (IN): Room in "frames", in frames.
+//
+//  - hashValue (OUT): Receives the hash of the frames.
+//
+//  Return Value:
+//
+//    Returns the number of frames captured.
+//
+UINT32 CallStack::captureShadow (UINT32 maxdepth, const context_t& context, UINT_PTR* frames, UINT32 capacity,
+    DWORD& hashValue)
+{
+    // Without a shadow stack, rdssp does nothing and leaves the value at 0.
+    UINT_PTR ssp = (UINT_PTR)_rdsspq();
+    if ((ssp == 0) || (context.fp == NULL))
+        return captureFast(maxdepth, context, frames, hashValue);
+
+    tls_t *tls = g_vld.getTls();
+    if ((ssp < tls->shadowStackLow) || (ssp >= tls->shadowStackHigh)) {
+        MEMORY_BASIC_INFORMATION info;
+        if (VirtualQuery((LPCVOID)ssp, &info, sizeof(info)) != sizeof(info))
+            return captureFast(maxdepth, context, frames, hashValue);
+        tls->shadowStackLow = (UINT_PTR)info.BaseAddress;
+        tls->shadowStackHigh = (UINT_PTR)info.BaseAddress + info.RegionSize;
+    }
+    const UINT_PTR *entry = (const UINT_PTR*)ssp;
+    const UINT_PTR *end = (const UINT_PTR*)tls->shadowStackHigh;
+
+    // VLD's own frames are few; the hook's return address is among the first.
+    const UINT_PTR *last = (end - entry > CALLSTACK_MAX_CAPTURE) ? entry + CALLSTACK_MAX_CAPTURE : end;
+    while ((entry < last) && (*entry != context.fp))
+        entry++;
+    if (entry == last)
+        return captureFast(maxdepth, context, frames, hashValue);
+
+    UINT32 count = 0;
+    UINT_PTR function = context.func;
+    if ((function != NULL) && (count < capacity))
+        frames[count++] = function;
+    UINT32 limit = count + min(maxdepth, capacity - count);
+    for (; (count < limit) && (entry < end); entry++) {
+        UINT_PTR returnAddress = *entry;
+        if ((returnAddress == 0) ||
+            ((returnAddress >= tls->shadowStackLow) && (returnAddress < tls->shadowStackHigh)))
+            break;
+        frames[count++] = returnAddress;
+    }
+    hashValue = hashFrames(frames, count);
+    return count;
+}
+#endif // _M_X64
+
+#if defined(_M_IX86) || defined(_M_ARM64)
+// captureFrame - Traces the stack by following the chain of saved frame
+//   pointers, starting at the frame of the function which entered VLD's code.
+//   Unlike captureFast, no frames above that one are captured only to be
+//   thrown away, and the walk stops as soon as "maxdepth" frames are found.
+//   An ARM64 frame record (the saved frame pointer and link register) has
+//   the same layout as an x86 frame.
+//
+//   Note: On x86, this requires every function on the stack to set up a
+//     frame pointer (/Oy-). A function which doesn't cuts the trace short, or
+//     makes it skip frames. The ARM64 ABI requires frame records of every
+//     function that has a frame. Rather than probing with IsBadReadPtr, each
+//     frame is checked against the thread's stack limits before it's read.
+//
+//  - maxdepth (IN): Maximum number of frames to trace back.
+//
+//  - context (IN): Context at which to begin the stack trace.
+//
+//  - frames (OUT): Receives the frames.
+//
+//  - capacity (IN): Room in "frames", in frames.
+//
+//  Return Value:
+//
+//    Returns the number of frames captured.
+//
+UINT32 CallStack::captureFrame (UINT32 maxdepth, const context_t& context, UINT_PTR* frames, UINT32 capacity)
+{
+    UINT32 size = 0;
+    UINT32 limit = min(maxdepth, capacity);
+
+    UINT_PTR function = context.func;
+    if ((function != NULL) && (size < limit))
+        frames[size++] = function;
+
+    NT_TIB *tib = (NT_TIB*)NtCurrentTeb();
+    UINT_PTR stackLow  = (UINT_PTR)tib->StackLimit;
+    UINT_PTR stackHigh = (UINT_PTR)tib->StackBase;
+
+    // Each frame starts with the caller's frame pointer, followed by the
+    // return address into the caller. The hook's frame pointer is right
+    // below the return address recorded in the context.
+    if (context.stack == NULL)
+        return size;
+    UINT_PTR framePointer = context.stack - sizeof(UINT_PTR);
+    while (size < limit) {
+        if ((framePointer < stackLow) || (framePointer + 2 * sizeof(UINT_PTR) > stackHigh) ||
+            (framePointer & (sizeof(UINT_PTR) - 1))) {
+            // Not a frame of this thread's stack.
+            break;
+        }
+        UINT_PTR *frame = (UINT_PTR*)framePointer;
+        UINT_PTR returnAddress = frame[1];
+        if (returnAddress == 0) {
+            // End of stack.
+            break;
+        }
+
+        // Store this frame's program counter.
+        frames[size++] = returnAddress;
+        if (frame[0] <= framePointer) {
+            // Frames only ever chain towards the stack base.
+            break;
+        }
+        framePointer = frame[0];
+    }
+    return size;
+}
+#endif // _M_IX86 || _M_ARM64
+
+// hashFrames - Computes the hash of a call stack's frames. Every stack walk
+//   method hashes the frames it keeps the same way, so equal call stacks get
+//   equal hashes.
+//
+//  - frames (IN): The frames.
+//
+//  - count (IN): Number of frames.
+//
+//  Return Value:
+//
+//    Returns the hash.
+//
+DWORD CallStack::hashFrames (const UINT_PTR* frames, UINT32 count)
+{
+    return CalculateCRC32(frames, count);
+}
+
+// stripInternal - Removes the frames within VLD's own image from captured
+//   frames. No report shows them, so they are neither stored nor looked at
+//   again when the stack is resolved. VLD's image range is cached, so this
+//   is a comparison per frame, not a system call. The hash is recomputed if
+//   any frame was removed.
+//
+//  - frames (IN/OUT): The frames.
+//
+//  - count (IN): Number of frames.
+//
+//  - hashValue (IN/OUT): Hash of the frames.
+//
+//  Return Value:
+//
+//    Returns the number of frames kept.
+//
+UINT32 CallStack::stripInternal (UINT_PTR* frames, UINT32 count, DWORD& hashValue)
+{
+    UINT32 kept = 0;
+    for (UINT32 frame = 0; frame < count; frame++) {
+        if (!g_vld.isVldAddress(frames[frame]))
+            frames[kept++] = frames[frame];
+    }
+    if (kept != count)
+        hashValue = hashFrames(frames, kept);
+    return kept;
+}
+
+// Constructor - Initializes every shard of the CallStackTable with an empty
+//   bucket array. Buckets are allocated on first use.
+//
+CallStackTable::CallStackTable ()
+{
+    for (UINT32 index = 0; index < CALLSTACKTABLE_SHARDS; index++) {
+        m_shards[index].lock.Initialize();
+        m_shards[index].buckets = NULL;
+        m_shards[index].bucketCount = 0;
+        m_shards[index].count = 0;
+    }
+}
+
+// Destructor - Frees the bucket arrays. By now every reference should have
+//   been released.
+//
+CallStackTable::~CallStackTable ()
+{
+    Clear();
+    for (UINT32 index = 0; index < CALLSTACKTABLE_SHARDS; index++) {
+        m_shards[index].lock.Delete();
+    }
+}
+
+// Intern - Looks up a freshly captured CallStack in the table. If an identical
+//   stack is already interned, the captured one is deleted and the interned
+//   one is returned instead. Otherwise the captured stack is added to the
+//   table.
+//
+//  - stack (IN): The captured CallStack. The table takes ownership of it.
+//
+//  - refs (IN): Number of references to add for the caller.
+//
+//  Return Value:
+//
+//    Returns the interned CallStack, with "refs" references added for the
+//    caller.
+//
+CallStack* CallStackTable::Intern (CallStack* stack, UINT32 refs)
+{
+    DWORD hash = stack->getHashValue();
+    shard_t& shard = shardFor(m_shards, hash);
+
+    CriticalSectionLocker<> cs(shard.lock);
+    if (shard.buckets != NULL) {
+        for (CallStack* cur = shard.buckets[bucketFor(shard, hash)]; cur != NULL; cur = cur->m_internNext) {
+            if ((cur->m_hashValue == hash) && (*cur == *stack)) {
+                InterlockedExchangeAdd(&cur->m_refs, (LONG)refs);
+                cs.Leave();
+                CallStack::Destroy(stack);
+                return cur;
+            }
+        }
+    }
+
+    if (shard.count >= shard.bucketCount) {
+        grow(shard);
+    }
+    UINT32 bucket = bucketFor(shard, hash);
+    // The table keeps sites alive, along with their statistics.
+    stack->m_refs = (LONG)refs + ((g_vld.GetOptions() & VLD_OPT_SITE_STATISTICS) ? 1 : 0);
+    stack->m_internNext = shard.buckets[bucket];
+    shard.buckets[bucket] = stack;
+    shard.count++;
+    return stack;
+}
+
+// InternFrames - Interns frames which haven't been made into a CallStack
+//   yet, through a thread's front cache. On a hit, no CallStack is created
+//   and no lock is taken. On a miss, the frames are interned as usual and
+//   replace the slot's stack.
+//
+//   Note: The cache must belong to the calling thread.
+//
+//  - cache (IN/OUT): The thread's front cache, CALLSTACK_CACHE_SLOTS slots.
+//
+//  - frames (IN): The frames, innermost first.
+//
+//  - count (IN): Number of frames.
+//
+//  - hashValue (IN): Hash of the frames, as computed when they were captured.
+//
+//  Return Value:
+//
+//    Returns the interned CallStack, with one reference added for the caller.
+//
+CallStack* CallStackTable::InternFrames (stackcacheslot_t* cache, const UINT_PTR* frames, UINT32 count,
+    DWORD hashValue)
+{
+    // A hit is only good for the module range table it was found with, since
+    // an image may have been loaded over an unloaded one since. The epoch is
+    // read before the frames are encoded, so that at worst a slot is missed.
+    LONG epoch = 0;
+    {
+        ModuleRangesReader reader(g_vld, g_vld.getTls());
+        if (reader.Table() != NULL)
+            epoch = reader.Table()->epoch;
+    }
+
+    stackcacheslot_t& slot = cache[(hashValue ^ (hashValue >> 16)) & (CALLSTACK_CACHE_SLOTS - 1)];
+    CallStack* cached = slot.stack;
+    if ((cached != NULL) && (slot.epoch == epoch) && (cached->m_hashValue == hashValue) &&
+        cached->matches(frames, count)) {
+        // The slot's reference keeps the stack alive meanwhile.
+        InterlockedIncrement(&cached->m_refs);
+        return cached;
+    }
+
+    // One reference for the caller, one for the slot.
+    CallStack* stack = Intern(CallStack::Create(frames, count, hashValue), 2);
+    if (cached != NULL)
+        Release(cached);
+    slot.stack = stack;
+    slot.epoch = epoch;
+    return stack;
+}
+
+// ReleaseCache - Drops the references held by a thread's front cache, and
+//   empties it.
+//
+//  - cache (IN/OUT): The front cache, CALLSTACK_CACHE_SLOTS slots.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID CallStackTable::ReleaseCache (stackcacheslot_t* cache)
+{
+    for (UINT32 index = 0; index < CALLSTACK_CACHE_SLOTS; index++) {
+        if (cache[index].stack != NULL) {
+            Release(cache[index].stack);
+            cache[index].stack = NULL;
+        }
+        cache[index].epoch = 0;
+    }
+}
+
+// AddRef - Takes an additional reference on an interned CallStack, keeping it
+//   alive after the blocks which refer to it are freed.
+//
+//  - stack (IN): The interned CallStack.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID CallStackTable::AddRef (CallStack* stack)
+{
+    shard_t& shard = shardFor(m_shards, stack->m_hashValue);
+
+    CriticalSectionLocker<> cs(shard.lock);
+    assert(stack->m_refs > 0);
+    InterlockedIncrement(&stack->m_refs);
+}
+
+// Release - Drops references on an interned CallStack. The stack is removed
+//   from the table and deleted when its last reference goes away.
+//
+//  - stack (IN): The interned CallStack.
+//
+//  - refs (IN): Number of references to drop, so that many blocks going away
+//      at once cost one trip through the shard lock.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID CallStackTable::Release (CallStack* stack, UINT32 refs)
+{
+    shard_t& shard = shardFor(m_shards, stack->m_hashValue);
+
+    CriticalSectionLocker<> cs(shard.lock);
+    assert(stack->m_refs >= (LONG)refs);
+    if (InterlockedExchangeAdd(&stack->m_refs, -(LONG)refs) > (LONG)refs) {
+        return;
+    }
+
+    CallStack** link = &shard.buckets[bucketFor(shard, stack->m_hashValue)];
+    while (*link != stack) {
+        assert(*link != NULL);
+        link = &(*link)->m_internNext;
+    }
+    *link = stack->m_internNext;
+    shard.count--;
+    cs.Leave();
+
+    CallStack::Destroy(stack);
+}
+
+// Count - Obtains the number of interned stacks.
+//
+//  Return Value:
+//
+//    Returns the number of stacks in the table. Other threads may intern or
+//    release stacks at any time, so it's only a hint.
+//
+UINT32 CallStackTable::Count ()
+{
+    UINT32 count = 0;
+    for (UINT32 index = 0; index < CALLSTACKTABLE_SHARDS; index++) {
+        CriticalSectionLocker<> cs(m_shards[index].lock);
+        count += m_shards[index].count;
+    }
+    return count;
+}
+
+// Capacity - Obtains the number of stacks the table holds before its buckets
+//   grow, which is as many as it ever held at once, give or take a factor of
+//   two: buckets never shrink.
+//
+//  Return Value:
+//
+//    Returns the number of buckets of all the shards. Like Count, it's only a
+//    hint.
+//
+UINT32 CallStackTable::Capacity ()
+{
+    UINT32 capacity = 0;
+    for (UINT32 index = 0; index < CALLSTACKTABLE_SHARDS; index++) {
+        CriticalSectionLocker<> cs(m_shards[index].lock);
+        capacity += m_shards[index].bucketCount;
+    }
+    return capacity;
+}
+
+// Bytes - Obtains the memory taken by the interned stacks and the table's
+//   buckets.
+//
+//  Return Value:
+//
+//    Returns the number of bytes. Like Count, it's only a hint.
+//
+SIZE_T CallStackTable::Bytes ()
+{
+    SIZE_T bytes = 0;
+    for (UINT32 index = 0; index < CALLSTACKTABLE_SHARDS; index++) {
+        shard_t &shard = m_shards[index];
+        CriticalSectionLocker<> cs(shard.lock);
+        bytes += shard.bucketCount * sizeof(CallStack*);
+        for (UINT32 bucket = 0; bucket < shard.bucketCount; bucket++) {
+            for (const CallStack *stack = shard.buckets[bucket]; stack != NULL; stack = stack->m_internNext)
+                bytes += stack->bytes();
+        }
+    }
+    return bytes;
+}
+
+// Collect - Takes a reference on interned stacks.
+//
+//  - stacks (OUT): Receives the stacks. Release each of them when done.
+//
+//  - capacity (IN): Size of the "stacks" array.
+//
+//  Return Value:
+//
+//    Returns the number of stacks stored in "stacks".
+//
+UINT32 CallStackTable::Collect (CallStack** stacks, UINT32 capacity)
+{
+    UINT32 count = 0;
+    for (UINT32 index = 0; index < CALLSTACKTABLE_SHARDS; index++) {
+        shard_t& shard = m_shards[index];
+        CriticalSectionLocker<> cs(shard.lock);
+        for (UINT32 bucket = 0; bucket < shard.bucketCount; bucket++) {
+            for (CallStack* cur = shard.buckets[bucket]; cur != NULL; cur = cur->m_internNext) {
+                if (count == capacity)
+                    return count;
+                InterlockedIncrement(&cur->m_refs);
+                stacks[count++] = cur;
+            }
+        }
+    }
+    return count;
+}
+
+// Reserve - Grows the buckets ahead of time, so that the table holds at least
+//   this many stacks before it grows again (see SizingProfile).
+//
+//  - count (IN): Number of stacks to make room for.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID CallStackTable::Reserve (UINT32 count)
+{
+    UINT32 perShard = (count + CALLSTACKTABLE_SHARDS - 1) / CALLSTACKTABLE_SHARDS;
+    for (UINT32 index = 0; index < CALLSTACKTABLE_SHARDS; index++) {
+        shard_t& shard = m_shards[index];
+        CriticalSectionLocker<> cs(shard.lock);
+        while (shard.bucketCount < perShard)
+            grow(shard);
+    }
+}
+
+// Unpin - Drops the references the table holds on its stacks with the
+//   SiteStatistics option, deleting the stacks no block refers to anymore.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID CallStackTable::Unpin ()
+{
+    for (UINT32 index = 0; index < CALLSTACKTABLE_SHARDS; index++) {
+        shard_t& shard = m_shards[index];
+        CallStack* unpinned = NULL;
+        {
+            CriticalSectionLocker<> cs(shard.lock);
+            for (UINT32 bucket = 0; bucket < shard.bucketCount; bucket++) {
+                CallStack** link = &shard.buckets[bucket];
+                while (*link != NULL) {
+                    CallStack* cur = *link;
+                    if (InterlockedDecrement(&cur->m_refs) > 0) {
+                        link = &cur->m_internNext;
+                        continue;
+                    }
+                    *link = cur->m_internNext;
+                    shard.count--;
+                    cur->m_internNext = unpinned;
+                    unpinned = cur;
+                }
+            }
+        }
+        while (unpinned != NULL) {
+            CallStack* next = unpinned->m_internNext;
+            CallStack::Destroy(unpinned);
+            unpinned = next;
+        }
+    }
+}
+
+// StackPrefixTable - Constructor for the StackPrefixTable: every entry is
+//   unused.
+//
+StackPrefixTable::StackPrefixTable ()
+{
+    ZeroMemory((PVOID)m_entries, sizeof(m_entries));
+}
+
+// Find - Finds the entry of a prefix, or claims an unused one for it.
+//
+//  - hash (IN): Hash of the prefix frames.
+//
+//  Return Value:
+//
+//    Returns the prefix's entry, or NULL if none of the entries probed for
+//    it is free.
+//
+stackprefix_t* StackPrefixTable::Find (DWORD hash)
+{
+    LONG key = (hash != 0) ? (LONG)hash : 1;
+    for (UINT32 probe = 0; probe < CALLSTACK_PREFIX_PROBES; probe++) {
+        stackprefix_t& entry = m_entries[(hash + probe) & (CALLSTACK_PREFIX_SLOTS - 1)];
+        LONG current = entry.key;
+        if (current == 0)
+            current = InterlockedCompareExchange(&entry.key, key, 0);
+        if ((current == 0) || (current == key))
+            return &entry;
+    }
+    return NULL;
+}
+
+// Clear - Drops the references held on the stacks of the entries, and makes
+//   every entry unused. Called at shutdown, before the CallStackTable is
+//   cleared.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID StackPrefixTable::Clear ()
+{
+    for (UINT32 index = 0; index < CALLSTACK_PREFIX_SLOTS; index++) {
+        if (m_entries[index].full != NULL)
+            g_callStackTable.Release(m_entries[index].full);
+    }
+    ZeroMemory((PVOID)m_entries, sizeof(m_entries));
+}
+
+// Clear - Frees the bucket arrays of empty shards. Called at shutdown, after
+//   every block has been unmapped, so that the arrays are not reported as
+//   internal leaks.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID CallStackTable::Clear ()
+{
+    for (UINT32 index = 0; index < CALLSTACKTABLE_SHARDS; index++) {
+        shard_t& shard = m_shards[index];
+        CriticalSectionLocker<> cs(shard.lock);
+        assert(shard.count == 0);
+        if (shard.count == 0) {
+            delete [] shard.buckets;
+            shard.buckets = NULL;
+            shard.bucketCount = 0;
+        }
+    }
+}
+
+// grow - Doubles the number of buckets in a shard and redistributes the
+//   interned stacks. Must be called with the shard's lock held.
+//
+VOID CallStackTable::grow (shard_t& shard)
+{
+    UINT32 bucketCount = (shard.bucketCount == 0) ? CALLSTACKTABLE_BUCKETS : shard.bucketCount * 2;
+    CallStack** buckets = new CallStack* [bucketCount];
+    ZeroMemory(buckets, bucketCount * sizeof(CallStack*));
+
+    CallStack** oldBuckets = shard.buckets;
+    UINT32 oldCount = shard.bucketCount;
+    shard.buckets = buckets;
+    shard.bucketCount = bucketCount;
+    for (UINT32 index = 0; index < oldCount; index++) {
+        CallStack* cur = oldBuckets[index];
+        while (cur != NULL) {
+            CallStack* next = cur->m_internNext;
+            UINT32 bucket = bucketFor(shard, cur->m_hashValue);
+            cur->m_internNext = buckets[bucket];
+            buckets[bucket] = cur;
+            cur = next;
+        }
+    }
+    delete [] oldBuckets;
+}
+
+// reset - Releases the referenced CallStack, if any, and then refers to the
+//   specified stack.
+//
+//  - stack (IN): An interned CallStack whose reference is handed over to this
+//      CallStackRef, or NULL.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID CallStackRef::reset (CallStack* stack)
+{
+    CallStack* old = m_stack;
+    m_stack = stack;
+    if (old != NULL) {
+        g_callStackTable.Release(old);
+    }
+}
+
+ModulePaths::ModulePaths ()
+{
+    ZeroMemory(m_buckets, sizeof(m_buckets));
+    m_current = NULL;
+    m_bytes = 0;
+    m_lock.Initialize();
+}
+
+ModulePaths::~ModulePaths ()
+{
+    Clear();
+    m_lock.Delete();
+}
+
+// Intern - Obtains the interned copy of a module path, interning it if it
+//   hasn't been seen yet. Only then is the module's file name split from the
+//   path and lowercased.
+//
+//  - path (IN): The fully qualified path the module was loaded from.
+//
+//  Return Value:
+//
+//    Returns the interned path, which stays valid until Clear is called.
+//
+const modulepath_t* ModulePaths::Intern (LPCWSTR path)
+{
+    SIZE_T length = wcslen(path);
+    UINT32 hash = 2166136261u;
+    for (SIZE_T index = 0; index < length; index++) {
+        hash ^= (UINT32)path[index];
+        hash *= 16777619u;
+    }
+
+    CriticalSectionLocker<> cs(m_lock);
+    modulepath_t *&bucket = m_buckets[hash & (MODULEPATHS_BUCKETS - 1)];
+    for (modulepath_t *entry = bucket; entry != NULL; entry = entry->next) {
+        if ((entry->hash == hash) && (entry->length == length) && (wmemcmp(entry->path, path, length) == 0))
+            return entry;
+    }
+
+    // Extract just the filename and extension from the module path.
+    WCHAR filename [_MAX_FNAME];
+    WCHAR extension [_MAX_EXT];
+    _wsplitpath_s(path, NULL, 0, NULL, 0, filename, _MAX_FNAME, extension, _MAX_EXT);
+    SIZE_T namelength = wcslen(filename) + wcslen(extension);
+
+    // Keep the next entry's pointers aligned.
+    SIZE_T needed = offsetof(modulepath_t, path) + (length + 1 + namelength + 1) * sizeof(WCHAR);
+    needed = (needed + sizeof(modulepath_t*) - 1) & ~(sizeof(modulepath_t*) - 1);
+    if ((m_current == NULL) || (m_current->capacity - m_current->used < needed)) {
+        SIZE_T capacity = max(needed, (SIZE_T)MODULEPATHS_CHUNK_SIZE);
+        chunk_t *chunk = (chunk_t*)new BYTE [offsetof(chunk_t, data) + capacity];
+        chunk->next     = m_current;
+        chunk->used     = 0;
+        chunk->capacity = capacity;
+        m_current = chunk;
+        m_bytes += offsetof(chunk_t, data) + capacity;
+    }
+
+    modulepath_t *entry = (modulepath_t*)(m_current->data + m_current->used);
+    m_current->used += needed;
+    wmemcpy(entry->path, path, length + 1);
+    LPWSTR name = entry->path + length + 1;
+    wcscpy_s(name, namelength + 1, filename);
+    wcscat_s(name, namelength + 1, extension);
+    _wcslwr_s(name, namelength + 1);
+    entry->name   = name;
+    entry->hash   = hash;
+    entry->length = (UINT32)length;
+    entry->next   = bucket;
+    bucket = entry;
+    return entry;
+}
+
+// Clear - Frees every interned path.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID ModulePaths::Clear ()
+{
+    CriticalSectionLocker<> cs(m_lock);
+    while (m_current != NULL) {
+        chunk_t *chunk = m_current;
+        m_current = chunk->next;
+        delete [] (BYTE*)chunk;
+    }
+    ZeroMemory(m_buckets, sizeof(m_buckets));
+    m_bytes = 0;
+}
+
+// Bytes - Obtains the memory taken by the chunks, whether their room is used
+//   or not.
+//
+//  Return Value:
+//
+//    Returns the number of bytes.
+//
+SIZE_T ModulePaths::Bytes ()
+{
+    CriticalSectionLocker<> cs(m_lock);
+    return m_bytes;
+}
+
+ModuleImages::ModuleImages ()
+{
+    ZeroMemory(m_pages, sizeof(m_pages));
+    m_count = 0;
+    m_lock.Initialize();
+}
+
+ModuleImages::~ModuleImages ()
+{
+    Clear();
+    m_lock.Delete();
+}
+
+// Register - Records a module image which has been loaded, unless the same
+//   image is already recorded at the same address. Older images the new one
+//   overlaps are superseded.
+//
+//  - base (IN): The image's base address.
+//
+//  - size (IN): The image's size, in bytes.
+//
+//  - path (IN): The fully qualified path the image was loaded from, as
+//      interned by ModulePaths. The entry refers to it, rather than to a copy.
+//
+//  - pdbGuid (IN): Signature of the image's PDB (zero if unknown).
+//
+//  - pdbAge (IN): Age of the image's PDB (zero if unknown).
+//
+//  Return Value:
+//
+//    Returns the image's index, or MODULEIMAGE_NONE if the table is full.
+//
+UINT32 ModuleImages::Register (UINT_PTR base, UINT_PTR size, LPCWSTR path, const GUID &pdbGuid, DWORD pdbAge)
+{
+    CriticalSectionLocker<> cs(m_lock);
+
+    // Modules are enumerated again and again; most are already known.
+    ImageMap::Iterator latestit = m_latest.find(base);
+    if (latestit != m_latest.end()) {
+        UINT32 index = (*latestit).second;
+        moduleimage_t &image = m_pages[index / MODULEIMAGES_PAGE_SIZE][index % MODULEIMAGES_PAGE_SIZE];
+        if ((image.size == size) && ((image.state & MODULEIMAGE_SUPERSEDED) == 0) &&
+            IsEqualGUID(image.pdbGuid, pdbGuid) && (image.pdbAge == pdbAge) &&
+            ((image.path == path) || (_wcsicmp(image.path, path) == 0))) {
+            // Unloaded and then reloaded at the same address.
+            InterlockedAnd(&image.state, ~MODULEIMAGE_UNLOADED);
+            return index;
+        }
+        m_latest.erase(latestit);
+    }
+
+    if (m_count == MODULEIMAGES_PAGES * MODULEIMAGES_PAGE_SIZE)
+        return MODULEIMAGE_NONE;
+
+    // The addresses of any older image this one overlaps now belong to this
+    // one. Only genuinely new images get here, so a linear search will do.
+    for (UINT32 index = 0; index < m_count; index++) {
+        moduleimage_t &image = m_pages[index / MODULEIMAGES_PAGE_SIZE][index % MODULEIMAGES_PAGE_SIZE];
+        if ((image.base < base + size) && (base < image.base + image.size))
+            InterlockedOr(&image.state, MODULEIMAGE_UNLOADED | MODULEIMAGE_SUPERSEDED);
+    }
+
+    UINT32 index = m_count;
+    moduleimage_t *&page = m_pages[index / MODULEIMAGES_PAGE_SIZE];
+    if (page == NULL)
+        page = new moduleimage_t [MODULEIMAGES_PAGE_SIZE];
+    moduleimage_t &image = page[index % MODULEIMAGES_PAGE_SIZE];
+    image.base       = base;
+    image.size       = size;
+    image.path       = path;
+    image.pdbGuid    = pdbGuid;
+    image.pdbAge     = pdbAge;
+    image.state      = 0x0;
+    image.symbolBase = 0;
+    m_latest.insert(base, index);
+    m_count++;
+    return index;
+}
+
+// Unload - Records that a module image has been unloaded. Its entry is kept.
+//
+//  - index (IN): The image's index. MODULEIMAGE_NONE is ignored.
+//
+//  - symbolsLoaded (IN): Whether dbghelp already has the image's symbols, at
+//      its base address.
+//
+//  - locker (IN): Proof that the caller holds the DbgHelp lock.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID ModuleImages::Unload (UINT32 index, bool symbolsLoaded, CriticalSectionLocker<DbgHelp>& /*locker*/)
+{
+    if (index == MODULEIMAGE_NONE)
+        return;
+    moduleimage_t &image = m_pages[index / MODULEIMAGES_PAGE_SIZE][index % MODULEIMAGES_PAGE_SIZE];
+    if (symbolsLoaded && (image.symbolBase == 0))
+        image.symbolBase = image.base;
+    InterlockedOr(&image.state, MODULEIMAGE_UNLOADED);
+}
+
+// Discard - Unloads the symbols of superseded images from dbghelp, where they
+//   are still loaded at their original addresses, within a range a new module
+//   has been loaded at. They will be loaded elsewhere if they're needed again.
+//
+//  - addrLow (IN): Lowest address of the new module.
+//
+//  - addrHigh (IN): Highest address of the new module.
+//
+//  - locker (IN): Proof that the caller holds the DbgHelp lock.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID ModuleImages::Discard (UINT_PTR addrLow, UINT_PTR addrHigh, CriticalSectionLocker<DbgHelp>& locker)
+{
+    CriticalSectionLocker<> cs(m_lock);
+    for (UINT32 index = 0; index < m_count; index++) {
+        moduleimage_t &image = m_pages[index / MODULEIMAGES_PAGE_SIZE][index % MODULEIMAGES_PAGE_SIZE];
+        if (((image.state & MODULEIMAGE_SUPERSEDED) == 0) || (image.symbolBase != image.base))
+            continue;
+        if ((image.base <= addrHigh) && (addrLow < image.base + image.size)) {
+            g_DbgHelp.SymUnloadModule64(g_currentProcess, (DWORD64)image.base, locker);
+            image.symbolBase = 0;
+        }
+    }
+}
+
+// SymbolBase - Obtains the address at which an unloaded image's symbols are
+//   loaded, loading them the first time. That's the image's own base address,
+//   unless the image is superseded. A range of address space is reserved for
+//   the symbols of a superseded image, so that no module can end up loaded
+//   there. Either way, dbghelp reads the symbols from the image file, which
+//   doesn't need to be mapped.
+//
+//  - index (IN): The image's index.
+//
+//  - locker (IN): Proof that the caller holds the DbgHelp lock.
+//
+//  Return Value:
+//
+//    Returns the base address of the image's symbols, or 0 if no address
+//    space could be reserved for them.
+//
+UINT_PTR ModuleImages::SymbolBase (UINT32 index, CriticalSectionLocker<DbgHelp>& locker)
+{
+    moduleimage_t &image = m_pages[index / MODULEIMAGES_PAGE_SIZE][index % MODULEIMAGES_PAGE_SIZE];
+    if (image.symbolBase != 0)
+        return image.symbolBase;
+
+    if (image.state & MODULEIMAGE_SUPERSEDED) {
+        LPVOID reserved = VirtualAlloc(NULL, image.size, MEM_RESERVE, PAGE_NOACCESS);
+        if (reserved == NULL)
+            return 0;
+        image.symbolBase = (UINT_PTR)reserved;
+    }
+    else {
+        image.symbolBase = image.base;
+    }
 
-    const size_t max_line_length = MAXREPORTLENGTH + 1;
-    m_resolvedCapacity = m_size * max_line_length;
-    const size_t allocedBytes = m_resolvedCapacity * sizeof(WCHAR);
-    m_resolved = new WCHAR[m_resolvedCapacity];
-    if (m_resolved) {
-        ZeroMemory(m_resolved, allocedBytes);
+    // The file may have been replaced since; its symbols are only used if it
+    // still has the same PDB.
+    DWORD64 symbolbase = (DWORD64)image.symbolBase;
+    IMAGEHLP_MODULE64 moduleimageinfo;
+    moduleimageinfo.SizeOfStruct = sizeof(IMAGEHLP_MODULE64);
+    DbgTrace(L"dbghelp32.dll %i: SymLoadModuleEx\n", GetCurrentThreadId());
+    bool loaded = (g_DbgHelp.SymLoadModuleExW(g_currentProcess, NULL, image.path, NULL, symbolbase, (DWORD)image.size, NULL, 0, locker) == symbolbase);
+    bool matched = loaded && g_DbgHelp.SymGetModuleInfoW64(g_currentProcess, symbolbase, &moduleimageinfo, locker) &&
+        IsEqualGUID(moduleimageinfo.PdbSig70, image.pdbGuid) && (moduleimageinfo.PdbAge == image.pdbAge);
+    if (!matched) {
+        if (loaded)
+            g_DbgHelp.SymUnloadModule64(g_currentProcess, symbolbase, locker);
+        Report(L"WARNING: Visual Leak Detector: The symbols for %s, which has been unloaded, could not be loaded again.\n"
+            L"  Function names and line numbers from it won't be shown in the memory leak report.\n", image.path);
     }
+    return image.symbolBase;
+}
 
-    // Iterate through each frame in the call stack.
-    for (UINT32 frame = 0; frame < m_size; frame++)
-    {
-        // Try to get the source file and line number associated with
-        // this program counter address.
-        SIZE_T programCounter = (*this)[frame];
-        if (GetCallingModule(programCounter) == g_vld.m_vldBase)
-            continue;
+// Find - Finds the image whose symbols cover an address: a loaded image at
+//   its base, or an unloaded one wherever its symbols have been loaded again.
+//   Later images are looked at first, as they supersede earlier ones.
+//
+//  - address (IN): The address, as passed to dbghelp.
+//
+//  - rva (OUT): Receives the offset of the address from the image's base.
+//
+//  Return Value:
+//
+//    Returns the index of the image, or MODULEIMAGE_NONE if there is none.
+//
+UINT32 ModuleImages::Find (UINT_PTR address, UINT32 &rva)
+{
+    CriticalSectionLocker<> cs(m_lock);
+    for (UINT32 index = m_count; index-- > 0; ) {
+        const moduleimage_t &image = m_pages[index / MODULEIMAGES_PAGE_SIZE][index % MODULEIMAGES_PAGE_SIZE];
+        UINT_PTR base = (image.state & MODULEIMAGE_UNLOADED) ? image.symbolBase : image.base;
+        if ((base != 0) && (address >= base) && (address - base < image.size)) {
+            rva = (UINT32)(address - base);
+            return index;
+        }
+    }
+    return MODULEIMAGE_NONE;
+}
+
+// Clear - Forgets every image, and releases the address space reserved for
+//   the symbols of superseded ones.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID ModuleImages::Clear ()
+{
+    CriticalSectionLocker<> cs(m_lock);
+    for (UINT32 index = 0; index < m_count; index++) {
+        moduleimage_t &image = m_pages[index / MODULEIMAGES_PAGE_SIZE][index % MODULEIMAGES_PAGE_SIZE];
+        if ((image.symbolBase != 0) && (image.symbolBase != image.base))
+            VirtualFree((LPVOID)image.symbolBase, 0, MEM_RELEASE);
+    }
+    for (UINT page = 0; page < MODULEIMAGES_PAGES; page++) {
+        delete [] m_pages[page];
+        m_pages[page] = NULL;
+    }
+    for (ImageMap::Iterator latestit = m_latest.begin(); latestit != m_latest.end(); latestit++)
+        m_latest.erase(latestit);
+    m_count = 0;
+}
+
+// Bytes - Obtains the memory taken by the images' pages and index. Their
+//   paths belong to ModulePaths.
+//
+//  Return Value:
+//
+//    Returns the number of bytes.
+//
+SIZE_T ModuleImages::Bytes ()
+{
+    CriticalSectionLocker<> cs(m_lock);
+    SIZE_T bytes = m_latest.bytes();
+    for (UINT page = 0; page < MODULEIMAGES_PAGES; page++) {
+        if (m_pages[page] != NULL)
+            bytes += MODULEIMAGES_PAGE_SIZE * sizeof(moduleimage_t);
+    }
+    return bytes;
+}
 
-        DWORD64 displacement64;
-        BYTE symbolBuffer[sizeof(SYMBOL_INFO) + MAX_SYMBOL_NAME_SIZE];
-        LPCWSTR functionName = getFunctionName(programCounter, displacement64, (SYMBOL_INFO*)&symbolBuffer, locker);
+ContextTree::ContextTree ()
+{
+    ZeroMemory(m_pages, sizeof(m_pages));
+    m_buckets = NULL;
+    m_count   = 0;
+    m_lock.Initialize();
+}
 
-        if (skipStartupLeaks) {
-            if (!(m_status & (CALLSTACK_STATUS_STARTUPCRT | CALLSTACK_STATUS_NOTSTARTUPCRT))) {
-                m_status |= isCrtStartupFunction(functionName);
+ContextTree::~ContextTree ()
+{
+    Clear();
+    m_lock.Delete();
+}
+
+// Insert - Finds the node of a call stack, adding any nodes it's missing.
+//
+//  - table (IN): The module range table the frames were checked against
+//      with CallStack::isEncodable.
+//
+//  - frames (IN): The frames, innermost first.
+//
+//  - count (IN): Number of frames.
+//
+//  Return Value:
+//
+//    Returns the node of the innermost frame, or CONTEXTTREE_NONE if the
+//    tree is full.
+//
+UINT32 ContextTree::Insert (const moduleranges_t* table, const UINT_PTR* frames, UINT32 count)
+{
+    if (m_buckets == NULL) {
+        CriticalSectionLocker<> cs(m_lock);
+        if (m_buckets == NULL) {
+            m_pages[0] = new node_t [CONTEXTTREE_PAGE_SIZE];
+            ZeroMemory(&m_pages[0][0], sizeof(node_t));
+            m_count = 1;
+            UINT32 *buckets = new UINT32 [CONTEXTTREE_BUCKETS];
+            ZeroMemory(buckets, CONTEXTTREE_BUCKETS * sizeof(UINT32));
+            InterlockedExchangePointer((PVOID volatile*)&m_buckets, buckets);
+        }
+    }
+
+    // Walk down from the outermost frame. Once a node is missing, so are all
+    // of the nodes below it, so the lock is kept until the end.
+    UINT32 node = 0;
+    bool locked = false;
+    const modulerange_t *range = NULL;
+    for (UINT32 frame = count; frame-- > 0; ) {
+        UINT_PTR programCounter = frames[frame];
+        if ((range == NULL) || (programCounter < range->addrLow) || (programCounter > range->addrHigh))
+            range = FindModuleRange(table, programCounter);
+        UINT16 image = (UINT16)range->image;
+        UINT32 rva = (UINT32)(programCounter - range->addrLow);
+
+        UINT32 child = find(node, image, rva);
+        if ((child == 0) && !locked) {
+            m_lock.Enter();
+            locked = true;
+            child = find(node, image, rva);
+        }
+        if (child == 0) {
+            child = append(node, image, rva);
+            if (child == 0) {
+                node = CONTEXTTREE_NONE;
+                break;
             }
-            if (m_status & CALLSTACK_STATUS_STARTUPCRT) {
-                delete[] m_resolved;
-                m_resolved = NULL;
-                m_resolvedCapacity = 0;
-                m_resolvedLength = 0;
-                return 0;
+        }
+        node = child;
+    }
+    if (locked)
+        m_lock.Leave();
+    return node;
+}
+
+// find - Looks up the child of a node for a frame.
+//
+//  Return Value:
+//
+//    Returns the child node, or 0 if the node has no child for the frame.
+//
+UINT32 ContextTree::find (UINT32 parent, UINT16 image, UINT32 rva) const
+{
+    for (UINT32 node = m_buckets[bucketFor(parent, image, rva)]; node != 0; ) {
+        const node_t &child = get(node);
+        if ((child.parent == parent) && (child.rva == rva) && (child.image == image))
+            return node;
+        node = child.next;
+    }
+    return 0;
+}
+
+// append - Adds a child to a node, for a frame. The node is filled in before
+//   it's linked into its bucket, where lookups can find it. The caller must
+//   hold m_lock.
+//
+//  Return Value:
+//
+//    Returns the new node, or 0 if the tree is full.
+//
+UINT32 ContextTree::append (UINT32 parent, UINT16 image, UINT32 rva)
+{
+    if (m_count == CONTEXTTREE_PAGES * CONTEXTTREE_PAGE_SIZE)
+        return 0;
+
+    UINT32 index = m_count;
+    node_t *&page = m_pages[index / CONTEXTTREE_PAGE_SIZE];
+    if (page == NULL)
+        page = new node_t [CONTEXTTREE_PAGE_SIZE];
+    UINT32 bucket = bucketFor(parent, image, rva);
+    node_t &node = page[index % CONTEXTTREE_PAGE_SIZE];
+    node.parent = parent;
+    node.rva    = rva;
+    node.image  = image;
+    node.next   = m_buckets[bucket];
+    InterlockedExchange((LONG volatile*)&m_buckets[bucket], (LONG)index);
+    m_count++;
+    return index;
+}
+
+// Clear - Frees every node. No CallStack may refer to the tree anymore.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID ContextTree::Clear ()
+{
+    CriticalSectionLocker<> cs(m_lock);
+    for (UINT page = 0; page < CONTEXTTREE_PAGES; page++) {
+        delete [] m_pages[page];
+        m_pages[page] = NULL;
+    }
+    delete [] (UINT32*)m_buckets;
+    m_buckets = NULL;
+    m_count   = 0;
+}
+
+SymbolCache::SymbolCache ()
+{
+    m_lookups     = 0;
+    m_lookupTicks = 0;
+}
+
+SymbolCache::~SymbolCache ()
+{
+    Clear();
+}
+
+// Lookup - Obtains the symbolic information for a program counter address,
+//   asking dbghelp for it only if the address hasn't been looked up before.
+//
+//   Note: The symbol handler must be initialized prior to calling this
+//     function.
+//
+//  - programCounter (IN): The address to look up.
+//
+//  - locker (IN): Proof that the caller holds the DbgHelp lock.
+//
+//  Return Value:
+//
+//    Returns the cached symbol information. It stays valid for as long as
+//    the caller holds the DbgHelp lock.
+//
+const symbolinfo_t* SymbolCache::Lookup (SIZE_T programCounter, CriticalSectionLocker<DbgHelp>& locker)
+{
+    SymbolMap::Iterator it = m_symbols.find(programCounter);
+    if (it != m_symbols.end()) {
+        return (*it).second;
+    }
+
+    // SymbolLevel stops resolution at the tier asked for; below function
+    // names, no symbols are loaded at all.
+    UINT32 level = g_vld.GetSymbolLevel();
+    if (level < VLD_SYMBOLS_FUNCTION)
+        return createOffset(programCounter, level == VLD_SYMBOLS_MODULE);
+    bool lines = (level == VLD_SYMBOLS_LINE);
+
+    // An earlier run may have resolved this program counter already, in
+    // which case the module's symbols needn't even be loaded.
+    UINT32 image = MODULEIMAGE_NONE;
+    UINT32 rva = 0;
+    if (g_symbolStore.IsOpen()) {
+        image = g_moduleImages.Find(programCounter, rva);
+        if ((image != MODULEIMAGE_NONE) && (g_moduleImages.Get(image)->pdbAge == 0))
+            image = MODULEIMAGE_NONE;
+        if (image != MODULEIMAGE_NONE) {
+            const moduleimage_t *moduleimage = g_moduleImages.Get(image);
+            const vldsym_record_t *record = g_symbolStore.Find(moduleimage->pdbGuid, moduleimage->pdbAge, rva, locker);
+            if (record != NULL) {
+                bool foundline = lines && (record->fileName != VLDSYM_NO_STRING);
+                symbolinfo_t* symbol = create(g_symbolStore.String(record->functionName), record->displacement,
+                    foundline ? g_symbolStore.String(record->fileName) : NULL, record->lineNumber, record->lineDisplacement);
+                m_symbols.insert(programCounter, symbol);
+                return symbol;
             }
         }
+    }
+
+    // Initialize structures passed to the symbol handler.
+    BYTE symbolBuffer[sizeof(SYMBOL_INFO) + MAX_SYMBOL_NAME_SIZE] = { 0 };
+    SYMBOL_INFO* functionInfo = (SYMBOL_INFO*)&symbolBuffer;
+    functionInfo->SizeOfStruct = sizeof(SYMBOL_INFO);
+    functionInfo->MaxNameLen = MAX_SYMBOL_NAME_LENGTH;
+
+    UINT64 start = __rdtsc();
+
+    // The symbols of the module containing this address may not have been
+    // loaded yet, or may still be on their way from a symbol server.
+    if (!g_vld.loadSymbolsForAddress(programCounter, locker))
+        return createOffset(programCounter, true);
+
+    // Try to get the name of the function containing this program
+    // counter address.
+    DWORD64 displacement64 = 0;
+    DbgTrace(L"dbghelp32.dll %i: SymFromAddrW\n", GetCurrentThreadId());
+    BOOL foundfunction = g_DbgHelp.SymFromAddrW(g_currentProcess, programCounter, &displacement64, functionInfo, locker);
+    if (!foundfunction) {
+        fmt::WArrayWriter wf(functionInfo->Name, MAX_SYMBOL_NAME_LENGTH);
+        wf.write(L"" ADDRESSCPPFORMAT, programCounter);
+        displacement64 = 0;
+    }
 
-        // It turns out that calls to SymGetLineFromAddrW64 may free the very memory we are scrutinizing here
-        // in this method. If this is the case, m_Resolved will be null after SymGetLineFromAddrW64 returns.
-        // When that happens there is nothing we can do except crash.
-        DWORD            displacement = 0;
+    // Try to get the source file and line number associated with this
+    // program counter address, unless SymbolLevel leaves lines out: they
+    // take longest to look up.
+    IMAGEHLP_LINE64 sourceInfo = { 0 };
+    sourceInfo.SizeOfStruct = sizeof(IMAGEHLP_LINE64);
+    DWORD displacement = 0;
+    BOOL foundline = FALSE;
+    if (lines) {
         DbgTrace(L"dbghelp32.dll %i: SymGetLineFromAddrW64\n", GetCurrentThreadId());
-        BOOL foundline = g_DbgHelp.SymGetLineFromAddrW64(g_currentProcess, programCounter, &displacement, &sourceInfo, locker);
+        foundline = g_DbgHelp.SymGetLineFromAddrW64(g_currentProcess, programCounter, &displacement, &sourceInfo, locker);
+    }
+
+    m_lookups++;
+    m_lookupTicks += __rdtsc() - start;
+
+    if (g_vld.symbolLoadTimedOut(locker))
+        return createOffset(programCounter, true);
+
+    symbolinfo_t* symbol = create(functionInfo->Name, displacement64, foundline ? sourceInfo.FileName : NULL,
+        foundline ? sourceInfo.LineNumber : 0, foundline ? displacement : 0);
+    m_symbols.insert(programCounter, symbol);
+    // Without lines, the records would be incomplete for later runs.
+    if (foundfunction && lines && (image != MODULEIMAGE_NONE))
+        g_symbolStore.Add(image, programCounter - rva, rva, *symbol, locker);
+    return symbol;
+}
+
+// Contains - Checks whether the symbolic information of a program counter is
+//   cached already.
+//
+//  - programCounter (IN): The address to look up.
+//
+//  - locker (IN): Proof that the caller holds the DbgHelp lock.
+//
+//  Return Value:
+//
+//    Returns true if Lookup wouldn't have to resolve the address.
+//
+bool SymbolCache::Contains (SIZE_T programCounter, CriticalSectionLocker<DbgHelp>& /*locker*/) const
+{
+    return (m_symbols.find(programCounter) != m_symbols.end());
+}
+
+// Insert - Caches the symbolic information of a program counter resolved
+//   without dbghelp (see DiaSymbolizer), as if Lookup had resolved it.
+//
+//  - programCounter (IN): The address resolved.
+//
+//  - image (IN): The module image the address is within.
+//
+//  - rva (IN): The address' offset within the image.
+//
+//  - functionName (IN): Name of the function containing the address.
+//
+//  - displacement (IN): Offset of the address from the start of the function.
+//
+//  - fileName (IN): Source file containing the address, or NULL if unknown.
+//
+//  - lineNumber (IN): Source line containing the address.
+//
+//  - lineDisplacement (IN): Offset of the address from the start of the line.
+//
+//  - locker (IN): Proof that the caller holds the DbgHelp lock.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID SymbolCache::Insert (SIZE_T programCounter, UINT32 image, UINT32 rva, LPCWSTR functionName, DWORD64 displacement,
+    LPCWSTR fileName, DWORD lineNumber, DWORD lineDisplacement, CriticalSectionLocker<DbgHelp>& locker)
+{
+    if (m_symbols.find(programCounter) != m_symbols.end())
+        return;
+    symbolinfo_t* symbol = create(functionName, displacement, fileName, lineNumber, lineDisplacement);
+    m_symbols.insert(programCounter, symbol);
+    if (g_symbolStore.IsOpen() && (g_moduleImages.Get(image)->pdbAge != 0))
+        g_symbolStore.Add(image, programCounter - rva, rva, *symbol, locker);
+}
+
+// Invalidate - Forgets the symbolic information cached for every address in
+//   the specified range. Called when a module's symbols are (re)loaded.
+//
+//  - addrLow (IN): Lowest address of the range.
+//
+//  - addrHigh (IN): Highest address of the range.
+//
+//  - locker (IN): Proof that the caller holds the DbgHelp lock.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID SymbolCache::Invalidate (SIZE_T addrLow, SIZE_T addrHigh, CriticalSectionLocker<DbgHelp>& /*locker*/)
+{
+    if (m_symbols.size() == 0)
+        return;
+
+    for (SymbolMap::Iterator it = m_symbols.begin(); it != m_symbols.end(); ++it) {
+        SIZE_T programCounter = (*it).first;
+        if ((programCounter >= addrLow) && (programCounter <= addrHigh)) {
+            destroy((*it).second);
+            m_symbols.erase(it);
+        }
+    }
+}
+
+// Clear - Frees every cached entry. Called at shutdown, before VLD checks its
+//   own heap for internal leaks.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID SymbolCache::Clear ()
+{
+    CriticalSectionLocker<DbgHelp> locker(g_DbgHelp);
+    Invalidate(0, (SIZE_T)-1, locker);
+}
+
+// GetStatistics - Obtains the number of program counters resolved by dbghelp
+//   so far, and the time spent resolving them.
+//
+//  - lookups (OUT): Receives the number of program counters resolved.
+//
+//  - ticks (OUT): Receives the time spent, in time stamp counter ticks.
+//
+//  - locker (IN): Proof that the caller holds the DbgHelp lock.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID SymbolCache::GetStatistics (UINT64 &lookups, UINT64 &ticks, CriticalSectionLocker<DbgHelp>& /*locker*/) const
+{
+    lookups = m_lookups;
+    ticks   = m_lookupTicks;
+}
+
+// Capacity - Obtains the number of program counters the cache holds before
+//   it grows. Entries which are invalidated leave their room behind, so this
+//   is as many as it ever held at once.
+//
+//  - locker (IN): Proof that the caller holds the DbgHelp lock.
+//
+//  Return Value:
+//
+//    Returns the number of entries.
+//
+SIZE_T SymbolCache::Capacity (CriticalSectionLocker<DbgHelp>& /*locker*/) const
+{
+    return m_symbols.capacity();
+}
+
+// Reserve - Makes room ahead of time for this many program counters (see
+//   SizingProfile).
+//
+//  - count (IN): Number of entries to make room for.
+//
+//  - locker (IN): Proof that the caller holds the DbgHelp lock.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID SymbolCache::Reserve (SIZE_T count, CriticalSectionLocker<DbgHelp>& /*locker*/)
+{
+    m_symbols.reserve(count);
+}
+
+// create - Allocates a cached entry holding copies of the specified strings.
+//
+//  - functionName (IN): Name of the function containing the address.
+//
+//  - displacement (IN): Offset of the address from the start of the function.
+//
+//  - fileName (IN): Source file containing the address, or NULL if unknown.
+//
+//  - lineNumber (IN): Source line containing the address.
+//
+//  - lineDisplacement (IN): Offset of the address from the start of the line.
+//
+//  Return Value:
+//
+//    Returns the new entry.
+//
+symbolinfo_t* SymbolCache::create (LPCWSTR functionName, DWORD64 displacement, LPCWSTR fileName, DWORD lineNumber,
+    DWORD lineDisplacement)
+{
+    symbolinfo_t* symbol = new symbolinfo_t;
+    size_t length = wcslen(functionName) + 1;
+    symbol->functionName = new WCHAR [length];
+    wcscpy_s(symbol->functionName, length, functionName);
+    symbol->displacement = displacement;
+    symbol->fileName = NULL;
+    symbol->lineNumber = 0;
+    symbol->lineDisplacement = 0;
+    symbol->internalFile = false;
+    if (fileName != NULL) {
+        length = wcslen(fileName) + 1;
+        symbol->fileName = new WCHAR [length];
+        wcscpy_s(symbol->fileName, length, fileName);
+        symbol->lineNumber = lineNumber;
+        symbol->lineDisplacement = lineDisplacement;
+        symbol->internalFile = isInternalFile(symbol->fileName);
+    }
+    return symbol;
+}
+
+// createOffset - Caches an entry naming a program counter by its offset
+//   within its module, for the modules whose symbols are still being
+//   fetched (see VisualLeakDetector::symbolLoadTimedOut), or for
+//   "SymbolLevel = module". The entry is dropped once the symbols have been
+//   fetched.
+//
+//  - programCounter (IN): The address to name.
+//
+//  - relative (IN): If false, the address itself names the program counter,
+//      for "SymbolLevel = none".
+//
+//  Return Value:
+//
+//    Returns the new entry.
+//
+const symbolinfo_t* SymbolCache::createOffset (SIZE_T programCounter, bool relative)
+{
+    WCHAR name [MAX_SYMBOL_NAME_LENGTH] = { 0 };
+    fmt::WArrayWriter wf(name, MAX_SYMBOL_NAME_LENGTH);
+    UINT32 rva = 0;
+    if (relative && (g_moduleImages.Find(programCounter, rva) != MODULEIMAGE_NONE))
+        wf.write(L"0x{:X}", rva);
+    else
+        wf.write(L"" ADDRESSCPPFORMAT, programCounter);
+
+    symbolinfo_t* symbol = create(name, 0, NULL, 0, 0);
+    m_symbols.insert(programCounter, symbol);
+    return symbol;
+}
+
+// destroy - Frees a single cached entry.
+VOID SymbolCache::destroy (symbolinfo_t* symbol)
+{
+    delete [] symbol->functionName;
+    delete [] symbol->fileName;
+    delete symbol;
+}
+
+CrtStartupRanges::CrtStartupRanges ()
+{
+}
+
+CrtStartupRanges::~CrtStartupRanges ()
+{
+    Clear();
+}
+
+// Classify - Classifies a frame by the function its program counter is in,
+//   without resolving the program counter to a name. The ranges of the
+//   module containing it are found first, if they haven't been yet.
+//
+//  - programCounter (IN): The frame's program counter.
+//
+//  - status (OUT): Receives CALLSTACK_STATUS_STARTUPCRT or
+//      CALLSTACK_STATUS_NOTSTARTUPCRT if the function tells whether the call
+//      stack is CRT startup code, or 0 if it tells neither.
+//
+//  - locker (IN): Proof that the caller holds the DbgHelp lock.
+//
+//  Return Value:
+//
+//    Returns false if the module's ranges are incomplete, in which case the
+//    frame must be classified by name instead.
+//
+bool CrtStartupRanges::Classify (SIZE_T programCounter, UINT &status, CriticalSectionLocker<DbgHelp>& locker)
+{
+    status = 0;
+    SIZE_T moduleBase = (SIZE_T)GetCallingModule(programCounter);
+    if (moduleBase == 0) {
+        // Not within any module, so there is no name to go by either.
+        return true;
+    }
 
-        bool isFrameInternal = false;
-        if (foundline && !showInternalFrames) {
-            if (isInternalModule(sourceInfo.FileName)) {
-                // Don't show frames in files internal to the heap.
-                isFrameInternal = true;
-            }
-        }
+    module_t *module;
+    ModuleMap::Iterator it = m_modules.find(moduleBase);
+    if (it != m_modules.end()) {
+        module = (*it).second;
+    }
+    else {
+        module = build(moduleBase, locker);
+        m_modules.insert(moduleBase, module);
+    }
+    if (!module->exact)
+        return false;
 
-        // show one allocation function for context
-        if (NumChars > 0 && !isFrameInternal && isPrevFrameInternal) {
-            m_resolvedLength += NumChars;
-            if (m_resolved) {
-                wcsncat_s(m_resolved, m_resolvedCapacity, stack_line, NumChars);
-            }
-        }
-        isPrevFrameInternal = isFrameInternal;
+    // Binary search for the last range starting at or below the address.
+    SIZE_T low = 0;
+    SIZE_T high = module->count;
+    while (low < high) {
+        SIZE_T mid = low + (high - low) / 2;
+        if (module->ranges[mid].addrLow <= programCounter)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if ((low > 0) && (programCounter <= module->ranges[low - 1].addrHigh))
+        status = module->ranges[low - 1].status;
+    return true;
+}
 
-        if (!foundline)
-            displacement = (DWORD)displacement64;
-        NumChars = resolveFunction( programCounter, foundline ? &sourceInfo : NULL,
-            displacement, functionName, stack_line, _countof( stack_line ));
+// Invalidate - Forgets the ranges of every module based in the specified
+//   address range. Called when a module's symbols are (re)loaded.
+//
+//  - addrLow (IN): Lowest address of the range.
+//
+//  - addrHigh (IN): Highest address of the range.
+//
+//  - locker (IN): Proof that the caller holds the DbgHelp lock.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID CrtStartupRanges::Invalidate (SIZE_T addrLow, SIZE_T addrHigh, CriticalSectionLocker<DbgHelp>& /*locker*/)
+{
+    if (m_modules.size() == 0)
+        return;
 
-        if (NumChars > 0 && !isFrameInternal) {
-            m_resolvedLength += NumChars;
-            if (m_resolved) {
-                wcsncat_s(m_resolved, m_resolvedCapacity, stack_line, NumChars);
-            }
+    for (ModuleMap::Iterator it = m_modules.begin(); it != m_modules.end(); ++it) {
+        SIZE_T moduleBase = (*it).first;
+        if ((moduleBase >= addrLow) && (moduleBase <= addrHigh)) {
+            destroy((*it).second);
+            m_modules.erase(it);
         }
-    } // end for loop
-
-    m_status |= CALLSTACK_STATUS_NOTSTARTUPCRT;
-    return unresolvedFunctionsCount;
+    }
 }
 
-const WCHAR* CallStack::getResolvedCallstack( BOOL showinternalframes )
+// Clear - Frees the ranges of every module. Called at shutdown, before VLD
+//   checks its own heap for internal leaks.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID CrtStartupRanges::Clear ()
 {
-    resolve(showinternalframes);
-    return m_resolved;
+    CriticalSectionLocker<DbgHelp> locker(g_DbgHelp);
+    Invalidate(0, (SIZE_T)-1, locker);
 }
 
-// push_back - Pushes a frame's program counter onto the CallStack. Pushes are
-//   always appended to the back of the chunk list (aka the "top" chunk).
+// Ranges collected while a module's symbols are enumerated.
+struct crtrangebuilder_t {
+    bool    exact;
+    SIZE_T  count;
+    SIZE_T  capacity;
+    LPVOID  ranges;
+};
+
+// build - Enumerates a module's symbols, loading them first if need be, and
+//   collects the ranges of the functions which classify call stacks.
 //
-//   Note: This function will allocate additional memory as necessary to make
-//     room for new program counter addresses.
+//  - moduleBase (IN): Base address of the module.
 //
-//  - programcounter (IN): The program counter address of the frame to be pushed
-//      onto the CallStack.
+//  - locker (IN): Proof that the caller holds the DbgHelp lock.
 //
 //  Return Value:
 //
-//    None.
+//    Returns the module's ranges.
 //
-VOID CallStack::push_back (const UINT_PTR programcounter)
+CrtStartupRanges::module_t* CrtStartupRanges::build (SIZE_T moduleBase, CriticalSectionLocker<DbgHelp>& locker)
 {
-    if (m_size == m_capacity) {
-        // At current capacity. Allocate additional storage.
-        CallStack::chunk_t *chunk = new CallStack::chunk_t;
-        chunk->next = NULL;
-        m_topChunk->next = chunk;
-        m_topChunk = chunk;
-        m_topIndex = 0;
-        m_capacity += CALLSTACK_CHUNK_SIZE;
+    bool loaded = g_vld.loadSymbolsForAddress(moduleBase, locker);
+
+    module_t *module = new module_t;
+    module->exact  = false;
+    module->count  = 0;
+    module->ranges = NULL;
+    if (!loaded) {
+        // The symbols are still being fetched.
+        return module;
     }
-    else if (m_topIndex >= CALLSTACK_CHUNK_SIZE) {
-        // There is more capacity, but not in this chunk. Go to the next chunk.
-        // Note that this only happens if this CallStack has previously been
-        // cleared (clearing resets the data, but doesn't give up any allocated
-        // space).
-        m_topChunk = m_topChunk->next;
-        m_topIndex = 0;
+
+    IMAGEHLP_MODULE64 moduleimageinfo;
+    moduleimageinfo.SizeOfStruct = sizeof(IMAGEHLP_MODULE64);
+    if (!g_DbgHelp.SymGetModuleInfoW64(g_currentProcess, moduleBase, &moduleimageinfo, locker) ||
+        g_vld.symbolLoadTimedOut(locker) ||
+        (moduleimageinfo.SymType == SymNone) || (moduleimageinfo.SymType == SymExport)) {
+        // Without real symbols, names are all there is to go by.
+        return module;
     }
 
-    m_topChunk->frames[m_topIndex++] = programcounter;
-    m_size++;
+    crtrangebuilder_t builder = { true, 0, 0, NULL };
+    DbgTrace(L"dbghelp32.dll %i: SymEnumSymbolsW\n", GetCurrentThreadId());
+    if (!g_DbgHelp.SymEnumSymbolsW(g_currentProcess, moduleBase, L"*", addSymbol, &builder, locker))
+        builder.exact = false;
+    if (g_vld.symbolLoadTimedOut(locker))
+        builder.exact = false;
+
+    range_t *ranges = (range_t*)builder.ranges;
+    // Insertion sort; only a handful of functions match in any module.
+    for (SIZE_T index = 1; index < builder.count; index++) {
+        range_t range = ranges[index];
+        SIZE_T slot = index;
+        while ((slot > 0) && (ranges[slot - 1].addrLow > range.addrLow)) {
+            ranges[slot] = ranges[slot - 1];
+            slot--;
+        }
+        ranges[slot] = range;
+    }
+    module->exact  = builder.exact;
+    module->count  = builder.count;
+    module->ranges = ranges;
+    return module;
 }
 
-UINT CallStack::isCrtStartupFunction( LPCWSTR functionName ) const
+// addSymbol - SymEnumSymbolsW callback, which keeps the range of a function
+//   matching one of the classifying names.
+BOOL CALLBACK CrtStartupRanges::addSymbol (PSYMBOL_INFOW symbol, ULONG /*symbolSize*/, PVOID context)
 {
-    size_t len = wcslen(functionName);
-
-    if (beginWith(functionName, len, L"_malloc_crt")
-        || beginWith(functionName, len, L"_calloc_crt")
-        || endWith(functionName, len, L"CRT_INIT")
-        || endWith(functionName, len, L"initterm_e")
-        || beginWith(functionName, len, L"_cinit")
-        || beginWith(functionName, len, L"std::`dynamic initializer for '")
-        // VS2008 Release
-        || (wcscmp(functionName, L"std::locale::facet::facet_Register") == 0)
-        // VS2010 Release
-        || (wcscmp(functionName, L"std::locale::facet::_Facet_Register") == 0)
-        // VS2012 Release
-        || beginWith(functionName, len, L"std::locale::_Init()")
-        || beginWith(functionName, len, L"std::basic_streambuf<")
-        // VS2015
-        || beginWith(functionName, len, L"common_initialize_environment_nolock<")
-        || beginWith(functionName, len, L"common_configure_argv<")
-        || beginWith(functionName, len, L"__acrt_initialize")
-        || beginWith(functionName, len, L"__acrt_allocate_buffer_for_argv")
-        || beginWith(functionName, len, L"_register_onexit_function")
-        // VS2015 Release
-        || (wcscmp(functionName, L"setlocale") == 0)
-        || (wcscmp(functionName, L"_wsetlocale") == 0)
-        || (wcscmp(functionName, L"_Getctype") == 0)
-        || (wcscmp(functionName, L"std::_Facet_Register") == 0)
-        || endWith(functionName, len, L">::_Getcat")
-        // Added fixes
-        || endWith(functionName, len, L"initterm")
-        ) {
-        return CALLSTACK_STATUS_STARTUPCRT;
-    }
-
-    if (endWith(functionName, len, L"DllMainCRTStartup")
-        || endWith(functionName, len, L"mainCRTStartup")
-
-        // NOTE: This is tricky...
-        //   This happens for c++ static initialization
-        //   In some cases, we will see
-        //       "namespace::`dynamic initializer for 'symbol'"
-        //   In other cases, there is no namespace prepended, even if the symbol is in a namespace:
-        //       "`dynamic initializer for 'namespace::symbol'"
-        // This happens above initterm in the stack, which means these statics can be ignored by the code above if they have the namespace
-
-        // Ideally, we would ignore dynamic initializers if we (somehow) know there is also a matching "`dynamic atexit destructor for 'symbol'"
-        // It's possible to use some kind of heuristic to detect this (the stack will have ..., classname::classname, dynamic initializer for, initterm, ...)
-        // That means that the caller really needs a state machine as we are doing some context-sensitive parsing
-
-        // For now, we just make the (possibly wrong) assumption that all dynamic initializations will be cleaned up
-        // Therefore, the following line is commented out.
-        //     Clearly wrong when we have a global written as "static void* foo = malloc(1);"
-        //     But we can look at a more complex fix if we need to handle that
-        //|| beginWith(functionName, len, L"`dynamic initializer for '")
-        ) {
-        // When we reach this point there is no reason going further down the stack
-        return CALLSTACK_STATUS_NOTSTARTUPCRT;
+    crtrangebuilder_t *builder = (crtrangebuilder_t*)context;
+    UINT status = crtStartupStatus(symbol->Name, wcsnlen(symbol->Name, symbol->NameLen));
+    if (status == 0)
+        return TRUE;
+    if (symbol->Size == 0) {
+        // The function's extent is unknown, so its range can't be told.
+        builder->exact = false;
+        return FALSE;
     }
 
-    return NULL;
+    if (builder->count == builder->capacity) {
+        SIZE_T capacity = (builder->capacity == 0) ? 16 : builder->capacity * 2;
+        range_t *ranges = new range_t [capacity];
+        if (builder->count > 0)
+            memcpy(ranges, builder->ranges, builder->count * sizeof(range_t));
+        delete [] (range_t*)builder->ranges;
+        builder->ranges   = ranges;
+        builder->capacity = capacity;
+    }
+    range_t &range = ((range_t*)builder->ranges)[builder->count++];
+    range.addrLow  = (SIZE_T)symbol->Address;
+    range.addrHigh = (SIZE_T)(symbol->Address + symbol->Size - 1);
+    range.status   = status;
+    return TRUE;
 }
 
-bool CallStack::isInternalModule( const PWSTR filename ) const
+// destroy - Frees a module's ranges.
+VOID CrtStartupRanges::destroy (module_t* module)
 {
-    size_t len = wcslen(filename);
-    return
-        // VS2015
-        endWith(filename, len, L"\\atlmfc\\include\\atlsimpstr.h") ||
-        endWith(filename, len, L"\\atlmfc\\include\\cstringt.h") ||
-        endWith(filename, len, L"\\atlmfc\\src\\mfc\\afxmem.cpp") ||
-        endWith(filename, len, L"\\atlmfc\\src\\mfc\\strcore.cpp") ||
-        endWith(filename, len, L"\\vcstartup\\src\\heap\\new_scalar.cpp") ||
-        endWith(filename, len, L"\\vcstartup\\src\\heap\\new_array.cpp") ||
-        endWith(filename, len, L"\\vcstartup\\src\\heap\\new_debug.cpp") ||
-        endWith(filename, len, L"\\ucrt\\src\\appcrt\\heap\\align.cpp") ||
-        endWith(filename, len, L"\\ucrt\\src\\appcrt\\heap\\malloc.cpp") ||
-        endWith(filename, len, L"\\ucrt\\src\\appcrt\\heap\\debug_heap.cpp") ||
-        // VS2013
-        beginWith(filename, len, L"f:\\dd\\vctools\\crt\\crtw32\\") ||
-        //endWith(filename, len, L"\\crt\\crtw32\\misc\\dbgheap.c") ||
-        //endWith(filename, len, L"\\crt\\crtw32\\misc\\dbgnew.cpp") ||
-        //endWith(filename, len, L"\\crt\\crtw32\\misc\\dbgmalloc.c") ||
-        //endWith(filename, len, L"\\crt\\crtw32\\misc\\dbgrealloc.c") ||
-        //endWith(filename, len, L"\\crt\\crtw32\\heap\\new.cpp") ||
-        //endWith(filename, len, L"\\crt\\crtw32\\heap\\new2.cpp") ||
-        //endWith(filename, len, L"\\crt\\crtw32\\heap\\malloc.c") ||
-        //endWith(filename, len, L"\\crt\\crtw32\\heap\\realloc.c") ||
-        //endWith(filename, len, L"\\crt\\crtw32\\heap\\calloc.c") ||
-        //endWith(filename, len, L"\\crt\\crtw32\\heap\\calloc_impl.c") ||
-        //endWith(filename, len, L"\\crt\\crtw32\\string\\strdup.c") ||
-        //endWith(filename, len, L"\\crt\\crtw32\\string\\wcsdup.c") ||
-        // VS2010
-        endWith(filename, len, L"\\crt\\src\\afxmem.cpp") ||
-        endWith(filename, len, L"\\crt\\src\\dbgheap.c") ||
-        endWith(filename, len, L"\\crt\\src\\dbgnew.cpp") ||
-        endWith(filename, len, L"\\crt\\src\\dbgmalloc.c") ||
-        endWith(filename, len, L"\\crt\\src\\dbgcalloc.c") ||
-        endWith(filename, len, L"\\crt\\src\\dbgrealloc.c") ||
-        endWith(filename, len, L"\\crt\\src\\dbgdel.cp") ||
-        endWith(filename, len, L"\\crt\\src\\new.cpp") ||
-        endWith(filename, len, L"\\crt\\src\\newaop.cpp") ||
-        endWith(filename, len, L"\\crt\\src\\malloc.c") ||
-        endWith(filename, len, L"\\crt\\src\\realloc.c") ||
-        endWith(filename, len, L"\\crt\\src\\free.c") ||
-        endWith(filename, len, L"\\crt\\src\\strdup.c") ||
-        endWith(filename, len, L"\\crt\\src\\wcsdup.c") ||
-        endWith(filename, len, L"\\vc\\include\\xmemory0") ||
-        // default
-        (false);
+    delete [] module->ranges;
+    delete module;
 }
 
-// getStackTrace - Traces the stack as far back as possible, or until 'maxdepth'
-//   frames have been traced. Populates the CallStack with one entry for each
-//   stack frame traced.
+Suppressions::Suppressions ()
+{
+    m_hashes        = NULL;
+    m_ranges        = NULL;
+    m_rangeCount    = 0;
+    m_rangeCapacity = 0;
+}
+
+Suppressions::~Suppressions ()
+{
+    Clear();
+}
+
+// Load - Reads the rules of a suppression file. Each line holds one rule:
 //
-//   Note: This function uses a very efficient method to walk the stack from
-//     frame to frame, so it is quite fast. However, unconventional stack frames
-//     (such as those created when frame pointer omission optimization is used)
-//     will not be successfully walked by this function and will cause the
-//     stack trace to terminate prematurely.
+//     0x1A2B3C4D                  A leak hash.
+//     module.dll!0x1000-0x1FFF    A range of offsets within a module.
+//     module.dll!0x1234           A single offset within a module.
 //
-//  - maxdepth (IN): Maximum number of frames to trace back.
+//   Numbers are hexadecimal, with or without "0x". Anything after a ';' is a
+//   comment. Lines which are neither are reported and skipped.
 //
-//  - framepointer (IN): Frame (base) pointer at which to begin the stack trace.
-//      If NULL, then the stack trace will begin at this function.
+//  - path (IN): Full path of the file.
 //
 //  Return Value:
 //
-//    None.
+//    Returns the number of rules read.
 //
-VOID FastCallStack::getStackTrace (UINT32 maxdepth, const context_t& context)
+UINT32 Suppressions::Load (LPCWSTR path)
 {
-    UINT32  count = 0;
-    UINT_PTR function = context.func;
-    if (function != NULL)
-    {
-        count++;
-        push_back(function);
+    FILE *file;
+    if ((_wfopen_s(&file, path, L"rt, ccs=UTF-8") != 0) || (file == NULL)) {
+        Report(L"WARNING: Visual Leak Detector: Couldn't open the suppression file %s.\n", path);
+        return 0;
     }
 
-/*#if defined(_M_IX86)
-    UINT_PTR* framePointer = (UINT_PTR*)context.BPREG;
-    while (count < maxdepth) {
-        if (*framePointer < (UINT_PTR)framePointer) {
-            if (*framePointer == NULL) {
-                // Looks like we reached the end of the stack.
-                break;
-            }
-            else {
-                // Invalid frame pointer. Frame pointer addresses should always
-                // increase as we move up the stack.
-                m_status |= CALLSTACK_STATUS_INCOMPLETE;
-                break;
-            }
-        }
-        if (*framePointer & (sizeof(UINT_PTR*) - 1)) {
-            // Invalid frame pointer. Frame pointer addresses should always
-            // be aligned to the size of a pointer. This probably means that
-            // we've encountered a frame that was created by a module built with
-            // frame pointer omission (FPO) optimization turned on.
-            m_status |= CALLSTACK_STATUS_INCOMPLETE;
-            break;
-        }
-        if (IsBadReadPtr((UINT*)*framePointer, sizeof(UINT_PTR*))) {
-            // Bogus frame pointer. Again, this probably means that we've
-            // encountered a frame built with FPO optimization.
-            m_status |= CALLSTACK_STATUS_INCOMPLETE;
-            break;
-        }
-        count++;
-        push_back(*(framePointer + 1));
-        framePointer = (UINT_PTR*)*framePointer;
-    }
-#elif defined(_M_X64)*/
-    UINT32 maxframes = min(62, maxdepth + 10);
-    UINT_PTR* myFrames = new UINT_PTR[maxframes];
-    ZeroMemory(myFrames, sizeof(UINT_PTR) * maxframes);
-    ULONG BackTraceHash;
-    maxframes = RtlCaptureStackBackTrace(0, maxframes, reinterpret_cast<PVOID*>(myFrames), &BackTraceHash);
-    m_hashValue = BackTraceHash;
-    UINT32  startIndex = 0;
-    while (count < maxframes) {
-        if (myFrames[count] == 0)
-            break;
-        if (myFrames[count] == context.fp)
-            startIndex = count;
-        count++;
+    UINT32 rules = 0;
+    UINT32 lineNumber = 0;
+    WCHAR line [MAX_PATH + 64];
+    while (fgetws(line, _countof(line), file) != NULL) {
+        lineNumber++;
+        LPWSTR comment = wcschr(line, L';');
+        if (comment != NULL)
+            *comment = L'\0';
+        LPWSTR rule = line;
+        while (iswspace(*rule))
+            rule++;
+        size_t length = wcslen(rule);
+        while ((length > 0) && iswspace(rule[length - 1]))
+            rule[--length] = L'\0';
+        if (length == 0)
+            continue;
+
+        if (addRule(rule))
+            rules++;
+        else
+            Report(L"WARNING: Visual Leak Detector: Ignoring line %u of the suppression file: %s\n", lineNumber, rule);
     }
-    count = startIndex;
-    while (count < maxframes) {
-        if (myFrames[count] == 0)
-            break;
-        push_back(myFrames[count]);
-        count++;
+    fclose(file);
+    return rules;
+}
+
+// addRule - Adds one rule of a suppression file (see Load).
+//
+//  - rule (IN): The rule, without surrounding blanks. It may be modified.
+//
+//  Return Value:
+//
+//    Returns false if the rule can't be parsed.
+//
+bool Suppressions::addRule (LPWSTR rule)
+{
+    LPWSTR end;
+    LPWSTR bang = wcsrchr(rule, L'!');
+    if (bang == NULL) {
+        DWORD hash = wcstoul(rule, &end, 16);
+        if ((end == rule) || (*end != L'\0'))
+            return false;
+        if (m_hashes == NULL)
+            m_hashes = new HashSet;
+        m_hashes->insert((SIZE_T)hash + 2, true);
+        return true;
+    }
+
+    *bang = L'\0';
+    LPWSTR offsets = bang + 1;
+    UINT32 rvaLow = wcstoul(offsets, &end, 16);
+    if ((end == offsets) || (bang == rule))
+        return false;
+    UINT32 rvaHigh = rvaLow;
+    if (*end == L'-') {
+        offsets = end + 1;
+        rvaHigh = wcstoul(offsets, &end, 16);
+        if (end == offsets)
+            return false;
+    }
+    if ((*end != L'\0') || (rvaHigh < rvaLow))
+        return false;
+
+    if (m_rangeCount == m_rangeCapacity) {
+        m_rangeCapacity = (m_rangeCapacity == 0) ? 16 : m_rangeCapacity * 2;
+        range_t *ranges = new range_t [m_rangeCapacity];
+        if (m_rangeCount != 0)
+            memcpy(ranges, m_ranges, m_rangeCount * sizeof(range_t));
+        delete [] m_ranges;
+        m_ranges = ranges;
     }
-    delete [] myFrames;
-//#endif
+    range_t &range = m_ranges[m_rangeCount++];
+    size_t length = wcslen(rule) + 1;
+    range.module = new WCHAR [length];
+    wcsncpy_s(range.module, length, rule, _TRUNCATE);
+    range.rvaLow = rvaLow;
+    range.rvaHigh = rvaHigh;
+    return true;
 }
 
-// getStackTrace - Traces the stack as far back as possible, or until 'maxdepth'
-//   frames have been traced. Populates the CallStack with one entry for each
-//   stack frame traced.
+// IsSuppressed - Checks a leak against the rules, from its hash and the
+//   frames of its call stack as they were captured.
 //
-//   Note: This function uses a documented Windows API to walk the stack. This
-//     API is supposed to be the most reliable way to walk the stack. It claims
-//     to be able to walk stack frames that do not follow the conventional stack
-//     frame layout. However, this robustness comes at a cost: it is *extremely*
-//     slow compared to walking frames by following frame (base) pointers.
+//  - leakHash (IN): The leak hash, as printed by the report.
 //
-//  - maxdepth (IN): Maximum number of frames to trace back.
+//  - stack (IN): The leak's call stack, or NULL.
 //
-//  - framepointer (IN): Frame (base) pointer at which to begin the stack trace.
-//      If NULL, then the stack trace will begin at this function.
+//  Return Value:
+//
+//    Returns true if the leak is to be left out of the report.
+//
+bool Suppressions::IsSuppressed (DWORD leakHash, const CallStack* stack) const
+{
+    if ((m_hashes != NULL) && (m_hashes->find((SIZE_T)leakHash + 2) != m_hashes->end()))
+        return true;
+    if ((m_rangeCount == 0) || (stack == NULL))
+        return false;
+
+    for (UINT32 frame = 0; frame < stack->size(); frame++) {
+        LPCWSTR imagePath;
+        UINT32 rva;
+        if (!stack->frameLocation(frame, imagePath, rva))
+            return false;
+        LPCWSTR module = wcsrchr(imagePath, L'\\');
+        module = (module != NULL) ? module + 1 : imagePath;
+        for (UINT32 index = 0; index < m_rangeCount; index++) {
+            const range_t &range = m_ranges[index];
+            if ((rva >= range.rvaLow) && (rva <= range.rvaHigh) && (_wcsicmp(module, range.module) == 0))
+                return true;
+        }
+    }
+    return false;
+}
+
+// Clear - Forgets every rule. Called at shutdown, before VLD checks its own
+//   heap for internal leaks.
 //
 //  Return Value:
 //
 //    None.
 //
-VOID SafeCallStack::getStackTrace (UINT32 maxdepth, const context_t& context)
+VOID Suppressions::Clear ()
 {
-    UINT32 count = 0;
-    UINT_PTR function = context.func;
-    if (function != NULL)
-    {
-        count++;
-        push_back(function);
-    }
+    for (UINT32 index = 0; index < m_rangeCount; index++)
+        delete [] m_ranges[index].module;
+    delete [] m_ranges;
+    m_ranges = NULL;
+    m_rangeCount = 0;
+    m_rangeCapacity = 0;
+    delete m_hashes;
+    m_hashes = NULL;
+}
 
-    if (context.IPREG == NULL)
-    {
-        return;
-    }
+ResolvedTextArena::ResolvedTextArena ()
+{
+    m_current = NULL;
+    m_bytes = 0;
+    m_lock.Initialize();
+}
 
-    count++;
-    push_back(context.IPREG);
+ResolvedTextArena::~ResolvedTextArena ()
+{
+    Clear();
+    m_lock.Delete();
+}
 
-    DWORD   architecture   = X86X64ARCHITECTURE;
+// Reserve - Obtains room for a text at the end of the current chunk, starting
+//   a new chunk if there isn't enough room left. The room is only taken by
+//   Commit; until then the next Reserve returns the same room.
+//
+//  - length (IN): Maximum length of the text, in characters, not counting
+//      the terminator.
+//
+//  - locker (IN): Proof that the caller holds the DbgHelp lock.
+//
+//  Return Value:
+//
+//    Returns the room for the text.
+//
+LPWSTR ResolvedTextArena::Reserve (SIZE_T length, CriticalSectionLocker<DbgHelp>& /*locker*/)
+{
+    SIZE_T needed = sizeof(chunk_t*) + (length + 1) * sizeof(WCHAR);
+    if ((m_current == NULL) || (m_current->capacity - m_current->used < needed)) {
+        SIZE_T capacity = max(needed, (SIZE_T)TEXTARENA_CHUNK_SIZE);
+        chunk_t *chunk = (chunk_t*)new BYTE [offsetof(chunk_t, data) + capacity];
+        chunk->texts    = 0;
+        chunk->used     = 0;
+        chunk->capacity = capacity;
+
+        CriticalSectionLocker<> cs(m_lock);
+        chunk_t *old = m_current;
+        m_current = chunk;
+        m_bytes += offsetof(chunk_t, data) + capacity;
+        if ((old != NULL) && (old->texts == 0)) {
+            m_bytes -= offsetof(chunk_t, data) + old->capacity;
+            delete [] (BYTE*)old;
+        }
+    }
 
-    // Get the required values for initialization of the STACKFRAME64 structure
-    // to be passed to StackWalk64(). Required fields are AddrPC and AddrFrame.
-    CONTEXT currentContext;
-    memset(&currentContext, 0, sizeof(currentContext));
-    currentContext.SPREG = context.SPREG;
-    currentContext.BPREG = context.BPREG;
-    currentContext.IPREG = context.IPREG;
+    BYTE *room = m_current->data + m_current->used;
+    *(chunk_t**)room = m_current;
+    return (LPWSTR)(room + sizeof(chunk_t*));
+}
 
-    // Initialize the STACKFRAME64 structure.
-    STACKFRAME64 frame;
-    memset(&frame, 0x0, sizeof(frame));
-    frame.AddrPC.Offset       = currentContext.IPREG;
-    frame.AddrPC.Mode         = AddrModeFlat;
-    frame.AddrStack.Offset    = currentContext.SPREG;
-    frame.AddrStack.Mode      = AddrModeFlat;
-    frame.AddrFrame.Offset    = currentContext.BPREG;
-    frame.AddrFrame.Mode      = AddrModeFlat;
-    frame.Virtual             = TRUE;
+// Commit - Keeps a text written to the room returned by the last Reserve.
+//
+//  - length (IN): Length of the text, in characters, not counting the
+//      terminator.
+//
+//  - locker (IN): Proof that the caller holds the DbgHelp lock.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID ResolvedTextArena::Commit (SIZE_T length, CriticalSectionLocker<DbgHelp>& /*locker*/)
+{
+    // Keep the next text's chunk pointer aligned.
+    SIZE_T used = sizeof(chunk_t*) + (length + 1) * sizeof(WCHAR);
+    used = (used + sizeof(chunk_t*) - 1) & ~(sizeof(chunk_t*) - 1);
 
-    CriticalSectionLocker<> cs(g_heapMapLock);
-    CriticalSectionLocker<DbgHelp> locker(g_DbgHelp);
+    CriticalSectionLocker<> cs(m_lock);
+    m_current->used = min(m_current->used + used, m_current->capacity);
+    m_current->texts++;
+}
 
-    // Walk the stack.
-    while (count < maxdepth) {
-        count++;
-        DbgTrace(L"dbghelp32.dll %i: StackWalk64\n", GetCurrentThreadId());
-        if (!g_DbgHelp.StackWalk64(architecture, g_currentProcess, g_currentThread, &frame, &currentContext, NULL,
-            SymFunctionTableAccess64, SymGetModuleBase64, NULL, locker)) {
-                // Couldn't trace back through any more frames.
-                break;
-        }
-        if (frame.AddrFrame.Offset == 0) {
-            // End of stack.
-            break;
-        }
+// Free - Frees a committed text. Its chunk is returned to the heap along with
+//   the last of its texts, unless texts are still appended to it.
+//
+//  - text (IN): The text, as returned by Reserve.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID ResolvedTextArena::Free (LPCWSTR text)
+{
+    chunk_t *chunk = *((chunk_t* const*)text - 1);
 
-        // Push this frame's program counter onto the CallStack.
-        push_back((UINT_PTR)frame.AddrPC.Offset);
+    CriticalSectionLocker<> cs(m_lock);
+    assert(chunk->texts > 0);
+    if ((--chunk->texts == 0) && (chunk != m_current)) {
+        m_bytes -= offsetof(chunk_t, data) + chunk->capacity;
+        delete [] (BYTE*)chunk;
     }
 }
 
-// getHashValue - Generate callstack hash value.
+// Clear - Lets go of the current chunk, freeing it if it holds no texts.
+//   Chunks still holding texts are freed along with their last text.
 //
 //  Return Value:
 //
 //    None.
 //
-DWORD SafeCallStack::getHashValue() const
+VOID ResolvedTextArena::Clear ()
 {
-    DWORD       hashcode = 0xD202EF8D;
-
-    // Iterate through each frame in the call stack.
-    for (UINT32 frame = 0; frame < m_size; frame++) {
-        UINT_PTR programcounter = (*this)[frame];
-        hashcode = CalculateCRC32(programcounter, hashcode);
+    CriticalSectionLocker<> cs(m_lock);
+    if ((m_current != NULL) && (m_current->texts == 0)) {
+        m_bytes -= offsetof(chunk_t, data) + m_current->capacity;
+        delete [] (BYTE*)m_current;
     }
-    return hashcode;
+    m_current = NULL;
+}
+
+// Bytes - Obtains the memory taken by the chunks, whether their room is used
+//   or not.
+//
+//  Return Value:
+//
+//    Returns the number of bytes.
+//
+SIZE_T ResolvedTextArena::Bytes ()
+{
+    CriticalSectionLocker<> cs(m_lock);
+    return m_bytes;
 }
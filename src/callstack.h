@@ -30,11 +30,63 @@
 #endif
 
 #include <windows.h>
+#include "criticalsection.h"
+#include "hashmap.h"
+#include "symbolstore.h"
 #include "utility.h"
+#include "vld_def.h"
 
-#define CALLSTACK_CHUNK_SIZE    32	// Number of frame slots in each CallStack chunk.
+#define CALLSTACK_MAX_CAPTURE   62  // Most frames RtlCaptureStackBackTrace can capture in one call on every supported Windows version.
+#define CALLSTACK_SAFE_SCRATCH  64  // Frames the safe stack walker collects on the stack before it needs heap scratch space.
+#define CALLSTACK_WALK_CONFIGURED 0xFFFFFFFF // Stack walk method: the one StackWalkMethod selects (otherwise a VLD_OPT_*_STACK_WALK bit, or 0 for fast).
 #define MAX_SYMBOL_NAME_LENGTH  256 // Maximum symbol name length that we will allow. Longer names will be truncated.
 #define MAX_SYMBOL_NAME_SIZE    ((MAX_SYMBOL_NAME_LENGTH * sizeof(WCHAR)) - 1)
+#define CALLSTACKTABLE_SHARDS   16  // Number of independently locked shards in the CallStackTable (power of two).
+#define CALLSTACKTABLE_BUCKETS  64  // Initial number of hash buckets in each CallStackTable shard (power of two).
+#define CALLSTACK_CACHE_SLOTS   16  // Slots of each thread's front cache of interned stacks (power of two).
+#define CALLSTACK_PREFIX_SLOTS  4096 // Entries of the StackPrefixTable (power of two).
+#define CALLSTACK_PREFIX_PROBES 8    // Entries probed for a prefix before its stack is captured in full.
+#define CALLSTACK_PREFIX_SAMPLE 64   // Captures of a prefix per full-depth sample of its stack (power of two).
+#define TEXTARENA_CHUNK_SIZE    0x20000 // Bytes per ResolvedTextArena chunk (bigger texts get a chunk of their own).
+#define MODULEIMAGES_PAGE_SIZE  256     // Module images per ModuleImages page.
+#define MODULEIMAGES_PAGES      255     // Pages of module images (keeps every index below MODULEIMAGE_NONE).
+#define MODULEIMAGE_NONE        0xFFFF  // Image index of addresses outside of any known module.
+#define MODULEPATHS_CHUNK_SIZE  0x4000  // Bytes per ModulePaths chunk (longer paths get a chunk of their own).
+#define MODULEPATHS_BUCKETS     1024    // Hash buckets of the ModulePaths pool (a power of two).
+#define CONTEXTTREE_PAGE_SIZE   4096    // Nodes per ContextTree page.
+#define CONTEXTTREE_PAGES       4096    // Pages of ContextTree nodes.
+#define CONTEXTTREE_BUCKETS     0x40000 // Hash buckets of the ContextTree (a power of two).
+#define CONTEXTTREE_NONE        0xFFFFFFFF // Node returned when the ContextTree is full.
+
+struct moduleranges_t;
+class CallStack;
+
+// One entry of the StackPrefixTable: what full-depth samples taught about the
+// stacks which start with a given prefix (see CallStack::CaptureAdaptive).
+struct stackprefix_t {
+    volatile LONG      key;       // Hash of the prefix frames (never 0), or 0 if the entry is unused.
+    volatile LONG      captures;  // Stacks captured with the prefix so far.
+    volatile LONG      divergent; // Set once two different full-depth stacks were seen with the prefix.
+    CallStack* volatile full;     // The first full-depth stack seen with it (the table holds a reference), or NULL.
+};
+
+// A slot of a thread's front cache of interned CallStacks (see
+// CallStackTable::InternFrames). The slot holds a reference on its stack.
+struct stackcacheslot_t {
+    CallStack* stack; // The interned stack, or NULL.
+    LONG       epoch; // Epoch of the module range table the stack was found with.
+};
+
+// Symbolic information for a single program counter address, as obtained
+// from dbghelp.
+struct symbolinfo_t {
+    LPWSTR  functionName;     // Name of the function containing the address, or the address itself if unknown.
+    DWORD64 displacement;     // Offset of the address from the start of the function.
+    LPWSTR  fileName;         // Source file containing the address, or NULL if there is no line information.
+    DWORD   lineNumber;       // Source line containing the address. Only valid if fileName isn't NULL.
+    DWORD   lineDisplacement; // Offset of the address from the start of the source line.
+    bool    internalFile;     // The source file is internal to the heap (see isInternalFile), so the frame is hidden.
+};
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -43,17 +95,29 @@
 //    CallStack objects can be used for obtaining, storing, and displaying the
 //    call stack at a given point during program execution.
 //
-//    The primary data structure used by the CallStack is similar in concept to
-//    a STL vector, but is specifically tailored for use by VLD, making it more
-//    efficient than a standard STL vector.
+//    A CallStack is captured once and never modified afterwards, so its frames
+//    (program counter addresses) are stored in an array of exactly the right
+//    size, allocated together with the object itself. Capture uses a scratch
+//    buffer and only then allocates the CallStack, in one shot. The resolved
+//    text of a stack is kept in the ResolvedTextArena, and only if the stack
+//    is actually resolved.
 //
-//    Inside the CallStack are a number of "chunks" which are arranged in a
-//    linked list. Each chunk contains an array of frames (each frame is
-//    represented by a program counter address). If we run out of space when
-//    pushing new frames onto an existing chunk in the CallStack chunk list,
-//    then a new chunk is allocated and appended to the end of the list. In this
-//    way, the CallStack can grow dynamically as needed. New frames are always
-//    pushed onto the chunk at the end of the list known as the "top" chunk.
+//    Each frame is stored as the index of its module in the ModuleImages
+//    table and its 32-bit offset (RVA) within that module: six bytes rather
+//    than eight on x64, and still meaningful after the module is unloaded.
+//    Stacks with a frame outside of every known module (e.g. generated code)
+//    keep their raw program counters instead. With the CallingContextTree
+//    option, the module-relative frames are stored in the ContextTree rather
+//    than with the stack, which only keeps its leaf node. With the
+//    PackCallStacks option, they are stored as varint deltas instead, which
+//    are decoded from the first frame on whenever a frame is read.
+//
+//    Four capture methods are available, selected by the StackWalkMethod
+//    option: "fast" uses RtlCaptureStackBackTrace, "safe" uses StackWalk64,
+//    which is more robust but quite slow, "unwind" (x64 only) follows the x64
+//    unwind data itself, which is about as robust as StackWalk64 without
+//    taking any lock, and "frame" (x86 only) follows the frame pointer chain,
+//    for code built with frame pointers (/Oy-).
 //
 //    IMPORTANT NOTE: This class as originally written makes two fatal assumptions:
 //    First: That the application will never load modules (call LoadLibrary) during the
@@ -74,15 +138,36 @@
 //    and it is wasteful, as some of the 'converted' memory is not a true leak, but will get
 //    properly de-allocated at a later time. However there is no other way to work around the
 //    fact that the call stacks can only get formatted when the binary is loaded in the process.
+//    Since frames are stored relative to their module images (see ModuleImages), which
+//    are remembered after they are unloaded, this is no longer required.
 //
 class CallStack
 {
 public:
-    CallStack ();
-    virtual ~CallStack ();
-    static CallStack* Create();
+    // Captures the current call stack with the configured stack walk method,
+    // or with "method".
+    static CallStack* Capture (UINT32 maxdepth, const context_t& context, UINT32 method = CALLSTACK_WALK_CONFIGURED);
+    // Captures the current call stack like Capture, and interns it through
+    // the calling thread's front cache.
+    static CallStack* CaptureInterned (UINT32 maxdepth, const context_t& context, UINT32 method,
+        stackcacheslot_t* cache);
+    // Captures the "prefix" innermost frames of the current call stack, and
+    // the rest only if stacks with that prefix are known to differ deeper.
+    static CallStack* CaptureAdaptive (UINT32 prefix, UINT32 maxdepth, const context_t& context, UINT32 method,
+        stackcacheslot_t* cache);
+    // Captures the current call stack's frames with the fast, unwind or frame
+    // stack walk method, without creating a CallStack. Room is needed for
+    // CALLSTACK_MAX_CAPTURE + 1 frames.
+    static UINT32 CaptureFrames (UINT32 maxdepth, const context_t& context, UINT_PTR* frames, DWORD& hashValue,
+        UINT32 method = CALLSTACK_WALK_CONFIGURED);
+    // Creates a one-frame CallStack of the caller recorded in the context.
+    static CallStack* CaptureCaller (const context_t& context);
+    // Creates a CallStack from frames captured earlier.
+    static CallStack* Create (const UINT_PTR* frames, UINT32 count, DWORD hashValue);
+    // Destroys a CallStack obtained from Capture or Create.
+    static VOID Destroy (CallStack* stack);
+
     // Public APIs - see each function definition for details.
-    VOID clear ();
     // Prints the call stack to one of either / or the debug output window and or
     // a log file.
     VOID dump (BOOL showinternalframes);
@@ -90,89 +175,690 @@ public:
     int resolve(BOOL showinternalframes);
     // Formats the stack frame into a human readable format, and saves it for later retrieval.
     CONST WCHAR* getResolvedCallstack(BOOL showinternalframes);
-    virtual DWORD getHashValue() const = 0;
-    virtual VOID getStackTrace (UINT32 maxdepth, const context_t& context) = 0;
+    DWORD getHashValue() const { return m_hashValue; }
+    // The site's live statistics (see recordAlloc).
+    SIZE_T getLiveBlocks() const { return (SIZE_T)m_liveBlocks; }
+    SIZE_T getLiveBytes() const { return (SIZE_T)m_liveBytes; }
+    UINT32 size() const { return m_size; }
+    SIZE_T bytes() const;
+    bool isResolved() const { return m_resolved != NULL; }
+    // Whether the stack appears to be incomplete (resolving it prints a hint).
+    bool isIncomplete() const { return (m_status & CALLSTACK_STATUS_INCOMPLETE) != 0; }
     bool isCrtStartupAlloc();
+    // Whether the stack is already known not to be CRT startup code, without resolving it.
+    bool isNotCrtStartupAlloc() const;
+    // Allocation site statistics, kept with the SiteStatistics option.
+    VOID recordAlloc (SIZE_T size);
+    VOID recordFree (SIZE_T size);
+    VOID recordRealloc (SIZE_T oldsize, SIZE_T newsize);
+    VOID recordResize (SIZE_T oldsize, SIZE_T newsize);
+    VOID recordLifetime (SIZE_T lifetime);
+    VOID recordFreeThread (bool crossThread);
+    VOID getSiteStatistics (VLD_SITE_STATISTICS &site) const;
 
     BOOL operator == (const CallStack &other) const;
+    // The program counter of a frame, as it was when the stack was captured.
     UINT_PTR operator [] (UINT32 index) const;
-    VOID push_back (const UINT_PTR programcounter);
+    // The address to resolve a frame's symbols at; it differs from the
+    // program counter if the frame's module was unloaded and replaced.
+    SIZE_T symbolAddress (UINT32 index, CriticalSectionLocker<DbgHelp>& locker) const;
+    // The path of the module image a frame is within (NULL if stored raw).
+    LPCWSTR imagePath (UINT32 index) const;
+    // The module image path and offset of a frame (false if stored raw).
+    bool frameLocation (UINT32 index, LPCWSTR &imagePath, UINT32 &rva) const;
+    // The innermost frame outside of VLD and of the heap and runtime
+    // libraries (false if there is none).
+    bool userFrame (UINT32 &index, CriticalSectionLocker<DbgHelp>& locker) const;
+
+private:
+    CallStack (const UINT_PTR* frames, UINT32 count, DWORD hashValue, UINT32 status);
+    ~CallStack ();
+
+    static UINT32 walk (UINT32 maxdepth, const context_t& context, UINT32 method, UINT_PTR*& frames,
+        UINT32& capacity, DWORD& hashValue);
+    static UINT32 captureFast (UINT32 maxdepth, const context_t& context, UINT_PTR* frames, DWORD& hashValue);
+    static UINT32 captureSafe (UINT32 maxdepth, const context_t& context, UINT_PTR*& frames, UINT32& capacity);
+    static bool   materializeContext (const context_t& context, CONTEXT& registers);
+#if defined(_M_X64) || defined(_M_ARM64)
+    static UINT32 captureUnwind (UINT32 maxdepth, const context_t& context, UINT_PTR* frames, UINT32 capacity);
+#endif
+#if defined(_M_X64)
+    static UINT32 captureShadow (UINT32 maxdepth, const context_t& context, UINT_PTR* frames, UINT32 capacity,
+        DWORD& hashValue);
+#endif
+#if defined(_M_IX86) || defined(_M_ARM64)
+    static UINT32 captureFrame (UINT32 maxdepth, const context_t& context, UINT_PTR* frames, UINT32 capacity);
+#endif
+    static DWORD  hashFrames (const UINT_PTR* frames, UINT32 count);
+    static UINT32 stripInternal (UINT_PTR* frames, UINT32 count, DWORD& hashValue);
+    static bool   isEncodable (const moduleranges_t* table, const UINT_PTR* frames, UINT32 count);
+    static SIZE_T framesSize (UINT32 count, UINT32 status);
+    static SIZE_T pack (const moduleranges_t* table, const UINT_PTR* frames, UINT32 count, BYTE* packed);
+    bool matches (const UINT_PTR* frames, UINT32 count) const;
+    bool matchesPrefix (const UINT_PTR* frames, UINT32 count) const;
+    VOID    encode (const moduleranges_t* table, const UINT_PTR* frames);
+    VOID    frameImage (UINT32 index, UINT16 &image, UINT32 &rva) const;
+
+    UINT isCrtStartupFunction( LPCWSTR functionName ) const;
+    DWORD resolveFunction(SIZE_T programCounter, LPCWSTR imagePath, const symbolinfo_t* symbol,
+        LPWSTR stack_line, DWORD stackLineSize) const;
 
-protected:
-    // Protected data.
+    // Don't allow this!!
+    CallStack(const CallStack &other);
+    // Don't allow this!!
+    CallStack& operator = (const CallStack &other);
+
+    // Private data.
     UINT32 m_status;                       // Status flags:
 #define CALLSTACK_STATUS_INCOMPLETE    0x1 //   If set, the stack trace stored in this CallStack appears to be incomplete.
 #define CALLSTACK_STATUS_STARTUPCRT    0x2 //   If set, the stack trace is startup CRT.
 #define CALLSTACK_STATUS_NOTSTARTUPCRT 0x4 //   If set, the stack trace is not startup CRT.
+#define CALLSTACK_STATUS_RAWFRAMES     0x8 //   If set, the frames are raw program counters rather than module-relative.
+#define CALLSTACK_STATUS_CONTEXTTREE  0x10 //   If set, the frames are in the ContextTree; m_frames[0] is the leaf node.
+#define CALLSTACK_STATUS_PACKED       0x20 //   If set, the frames are varint deltas; m_frames[0] is their size in bytes.
+    UINT32              m_size;         // Number of frames.
+    DWORD               m_hashValue;    // Hash of the frames, computed at capture time.
 
-    // The chunk list is made of a linked list of Chunks.
-    struct chunk_t {
-        chunk_t*    next;					    // Pointer to the next chunk in the chunk list.
-        UINT_PTR    frames[CALLSTACK_CHUNK_SIZE]; // Pushed frames (program counter addresses) are stored in this array.
-    };
+    // Allocation site statistics (see recordAlloc).
+    volatile LONG64     m_liveBlocks;   // Blocks allocated from this stack which are still allocated.
+    volatile LONG64     m_liveBytes;    // Total size of those blocks.
+    volatile LONG64     m_allocations;  // Blocks allocated from this stack so far.
+    volatile LONG64     m_peakBytes;    // Largest m_liveBytes so far.
+    volatile LONG64     m_allocatedBytes; // Total size of every block allocated from this stack so far.
+    volatile LONG64     m_reallocs;     // Blocks grown by reallocating them from this stack.
+    volatile LONG64     m_smallReallocs; // Those reallocations which grew the block by less than half.
+    volatile LONG64     m_reallocFromBytes; // Total size of the blocks before those reallocations.
+    volatile LONG64     m_reallocToBytes; // Total size of the blocks after them.
+    volatile LONG       m_lifetimes [VLD_LIFETIME_BUCKETS]; // Freed blocks by lifetime (see recordLifetime).
+    volatile LONG64     m_sameThreadFrees;  // Blocks freed by the thread which allocated them (see recordFreeThread).
+    volatile LONG64     m_crossThreadFrees; // Blocks freed by another thread.
 
-    // Private data.
-    UINT32              m_capacity; // Current capacity limit (in frames)
-    UINT32              m_size;     // Current size (in frames)
-    CallStack::chunk_t  m_store;    // Pointer to the underlying data store (i.e. head of the chunk list)
-    CallStack::chunk_t* m_topChunk; // Pointer to the chunk at the top of the stack
-    UINT32              m_topIndex; // Index, within the top chunk, of the top of the stack
+    // Interning data, owned by the CallStackTable.
+    volatile LONG       m_refs;         // Number of references held on this interned CallStack.
+    CallStack*          m_internNext;   // Next CallStack in the same CallStackTable bucket.
 
     // The string that contains the stack converted into a human readable format.
     // This is always NULL if the callstack has not been 'converted'.
     WCHAR*              m_resolved;
-    int                 m_resolvedCapacity;
-    int                 m_resolvedLength;
 
-    bool isInternalModule( const PWSTR filename ) const;
-    UINT isCrtStartupFunction( LPCWSTR functionName ) const;
-    LPCWSTR getFunctionName(SIZE_T programCounter, DWORD64& displacement64,
-        SYMBOL_INFO* functionInfo, CriticalSectionLocker<DbgHelp>& locker) const;
-    DWORD resolveFunction(SIZE_T programCounter, IMAGEHLP_LINEW64* sourceInfo, DWORD displacement,
-        LPCWSTR functionName, LPWSTR stack_line, DWORD stackLineSize) const;
+    // The frames, allocated with the object: m_size RVAs followed by m_size
+    // UINT16 image indexes, m_size raw program counters with
+    // CALLSTACK_STATUS_RAWFRAMES, the leaf node with
+    // CALLSTACK_STATUS_CONTEXTTREE, or the size of the packed frames followed
+    // by the packed frames with CALLSTACK_STATUS_PACKED (see pack).
+    UINT32              m_frames [1];
+
+    friend class CallStackTable;
+};
+
+inline bool CallStack::isNotCrtStartupAlloc() const
+{
+    return (m_status & CALLSTACK_STATUS_NOTSTARTUPCRT) != 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The CallStackTable Class
+//
+//    Hot allocation sites produce the same call stack over and over again. The
+//    CallStackTable interns captured CallStacks so that every distinct stack is
+//    stored (and resolved) only once, no matter how many blocks refer to it.
+//
+//    Stacks are found by their hash value and then compared frame by frame.
+//    Interned stacks are reference counted; the last Release deletes the
+//    stack. The table is split into shards by hash value, each with its own
+//    lock.
+//
+//    With the SiteStatistics option, the table holds a reference of its own on
+//    every stack, so that a site's statistics outlive its blocks. Unpin drops
+//    those references at shutdown.
+//
+//    Threads allocate from a few sites over and over, so each one keeps a
+//    small direct-mapped cache of the stacks it interned last, which
+//    InternFrames consults before the shared table. A slot's reference keeps
+//    its stack alive, so a hit takes another reference without any lock;
+//    every other change to a reference count is made atomically, too, and
+//    counts only drop with the shard lock held.
+//
+class CallStackTable
+{
+public:
+    CallStackTable ();
+    ~CallStackTable ();
+
+    CallStack* Intern (CallStack* stack, UINT32 refs = 1);
+    CallStack* InternFrames (stackcacheslot_t* cache, const UINT_PTR* frames, UINT32 count, DWORD hashValue);
+    VOID ReleaseCache (stackcacheslot_t* cache);
+    VOID AddRef (CallStack* stack);
+    VOID Release (CallStack* stack, UINT32 refs = 1);
+    UINT32 Count ();
+    UINT32 Capacity ();
+    SIZE_T Bytes ();
+    UINT32 Collect (CallStack** stacks, UINT32 capacity);
+    VOID Reserve (UINT32 count);
+    VOID Unpin ();
+    VOID Clear ();
 
 private:
+    struct shard_t {
+        CriticalSection lock;
+        CallStack**     buckets;     // Array of bucket chains (linked through m_internNext).
+        UINT32          bucketCount; // Number of buckets, a power of two.
+        UINT32          count;       // Number of stacks interned in this shard.
+    };
+
+    static shard_t& shardFor (shard_t* shards, DWORD hash)
+    {
+        return shards[hash & (CALLSTACKTABLE_SHARDS - 1)];
+    }
+    static UINT32 bucketFor (const shard_t& shard, DWORD hash)
+    {
+        return (hash >> 4) & (shard.bucketCount - 1);
+    }
+    VOID grow (shard_t& shard);
+
     // Don't allow this!!
-    CallStack(const CallStack &other);
+    CallStackTable (const CallStackTable &other);
+    CallStackTable& operator = (const CallStackTable &other);
+
+    shard_t m_shards [CALLSTACKTABLE_SHARDS];
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The StackPrefixTable Class
+//
+//    With the AdaptiveTraceFrames option, most stacks are told apart by their
+//    innermost few frames, so only those are walked at first. The table maps
+//    the hash of such a prefix to the full-depth stack first seen with it,
+//    which any later capture with the same prefix reuses without walking
+//    further. Every CALLSTACK_PREFIX_SAMPLE captures, the stack is walked in
+//    full again; once that finds a different stack, the prefix is divergent
+//    and its stacks are always walked in full from then on.
+//
+//    The table is a fixed array, open-addressed by hash. Entries are claimed
+//    and updated with interlocked operations, and never freed until Clear, so
+//    it's consulted without any lock. A prefix which finds no free entry is
+//    walked in full.
+//
+class StackPrefixTable
+{
+public:
+    StackPrefixTable ();
+
+    stackprefix_t* Find (DWORD hash);
+    VOID Clear ();
+
+private:
     // Don't allow this!!
-    CallStack& operator = (const CallStack &other);
+    StackPrefixTable (const StackPrefixTable &other);
+    StackPrefixTable& operator = (const StackPrefixTable &other);
+
+    stackprefix_t m_entries [CALLSTACK_PREFIX_SLOTS];
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The CallStackRef Class
+//
+//    A reference to an interned CallStack. Releases its reference when it is
+//    reset or destroyed. Behaves like a pointer to the CallStack otherwise.
+//
+class CallStackRef
+{
+public:
+    CallStackRef () : m_stack(NULL) {}
+    ~CallStackRef () { reset(); }
+
+    // reset - Releases the current reference, if any, and takes over the
+    //   reference held on "stack" (as returned by CallStackTable::Intern).
+    VOID reset (CallStack* stack = NULL);
+    // detach - Hands the reference over to the caller, without releasing it.
+    CallStack* detach () { CallStack* stack = m_stack; m_stack = NULL; return stack; }
+
+    CallStack* get () const { return m_stack; }
+    CallStack* operator -> () const { return m_stack; }
+    CallStack& operator * () const { return *m_stack; }
+    operator CallStack* () const { return m_stack; }
+
+private:
+    // Don't allow this!!
+    CallStackRef (const CallStackRef &other);
+    CallStackRef& operator = (const CallStackRef &other);
+
+    CallStack* m_stack;
 };
 
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The ModulePaths Class
+//
+//    Interns the paths of the modules VLD has seen loaded, along with each
+//    one's lowercased file name. The pool is append-only: a path is split and
+//    copied the first time it's seen, to the end of a chunk, and then handed
+//    out again on every refresh of the loaded modules, so a ModuleSet only
+//    holds pointers into the pool. Nothing is freed before Clear.
+//
+//    Paths are matched exactly; the same path spelled in another case is
+//    interned once more, which is harmless.
+//
+struct modulepath_t {
+    modulepath_t *next;     // Next path in the same hash bucket.
+    UINT32        hash;     // Hash of the path.
+    UINT32        length;   // Length of the path, in characters.
+    LPCWSTR       name;     // The module's file name, lowercased (e.g. "kernel32.dll"), after the path.
+    WCHAR         path [1]; // The fully qualified path the module was loaded from.
+};
+
+class ModulePaths
+{
+public:
+    ModulePaths ();
+    ~ModulePaths ();
+
+    const modulepath_t* Intern (LPCWSTR path);
+    VOID Clear ();
+    SIZE_T Bytes ();
+
+private:
+    struct chunk_t {
+        chunk_t *next;     // The chunk filled before this one.
+        SIZE_T   used;     // Bytes of data taken by paths.
+        SIZE_T   capacity; // Bytes of data.
+        BYTE     data [1];
+    };
+
+    // Don't allow this!!
+    ModulePaths (const ModulePaths &other);
+    ModulePaths& operator = (const ModulePaths &other);
+
+    modulepath_t   *m_buckets [MODULEPATHS_BUCKETS];
+    chunk_t        *m_current; // Chunk paths are appended to; it links to the older ones.
+    SIZE_T          m_bytes;   // Bytes taken by the chunks.
+    CriticalSection m_lock;    // Serializes Intern.
+};
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-//  The FastCallStack Class
+//  The ModuleImages Class
+//
+//    Every module image VLD has seen loaded, in the order they were loaded.
+//    The table is append-only and an image's entry is kept after the module
+//    is unloaded, with its path and PDB identity, so that call stack frames
+//    stored relative to it (see CallStack) can still be resolved later on.
 //
-//    This class is a specialization of the CallStack class which provides a
-//    very fast stack tracing function.
+//    Entries never move, so they are read without a lock. An image is only
+//    added again if it's reloaded with a different identity, or at another
+//    address; the older entry then becomes superseded.
 //
-class FastCallStack : public CallStack
+//    Nothing is done for the call stacks of a module when it's unloaded. The
+//    symbols of an unloaded image are only loaded the first time one of its
+//    frames is resolved, so only the stacks which are actually reported pay
+//    for them: at the image's original addresses, or, if it's superseded and
+//    those belong to another image, at a range of address space reserved for
+//    the purpose.
+//
+struct moduleimage_t {
+    UINT_PTR      base;       // Address the image was loaded at.
+    UINT_PTR      size;       // Size of the image, in bytes.
+    LPCWSTR       path;       // The fully qualified path the image was loaded from (interned by ModulePaths).
+    GUID          pdbGuid;    // Signature of the image's PDB (zero if unknown).
+    DWORD         pdbAge;     // Age of the image's PDB (zero if unknown).
+    volatile LONG state;      // Image state:
+#define MODULEIMAGE_UNLOADED   0x1 //   If set, the image has been unloaded.
+#define MODULEIMAGE_SUPERSEDED 0x2 //   If set, a later image overlaps this one, so its symbols can't stay at its base.
+    UINT_PTR      symbolBase; // Where an unloaded image's symbols are loaded (0 if not yet). Guarded by DbgHelp.
+};
+
+class ModuleImages
 {
 public:
-    FastCallStack()
-        : m_hashValue(0)
+    ModuleImages ();
+    ~ModuleImages ();
+
+    UINT32 Register (UINT_PTR base, UINT_PTR size, LPCWSTR path, const GUID &pdbGuid, DWORD pdbAge);
+    VOID Unload (UINT32 index, bool symbolsLoaded, CriticalSectionLocker<DbgHelp>& locker);
+    VOID Discard (UINT_PTR addrLow, UINT_PTR addrHigh, CriticalSectionLocker<DbgHelp>& locker);
+    const moduleimage_t* Get (UINT32 index) const
     {
+        return &m_pages[index / MODULEIMAGES_PAGE_SIZE][index % MODULEIMAGES_PAGE_SIZE];
     }
-    virtual VOID getStackTrace (UINT32 maxdepth, const context_t& context);
-    virtual DWORD getHashValue() const
+    UINT_PTR SymbolBase (UINT32 index, CriticalSectionLocker<DbgHelp>& locker);
+    UINT32 Find (UINT_PTR address, UINT32 &rva);
+    VOID Clear ();
+    SIZE_T Bytes ();
+
+private:
+    // Don't allow this!!
+    ModuleImages (const ModuleImages &other);
+    ModuleImages& operator = (const ModuleImages &other);
+
+    typedef HashMap<SIZE_T, UINT32> ImageMap;
+
+    moduleimage_t  *m_pages [MODULEIMAGES_PAGES];
+    UINT32          m_count;  // Number of images.
+    ImageMap        m_latest; // Maps base addresses to the latest image loaded there.
+    CriticalSection m_lock;   // Serializes Register and Unload.
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The ContextTree Class
+//
+//    A calling context tree, used with the CallingContextTree option. Call
+//    stacks from the same program share long runs of frames on the caller's
+//    side (thread entry, dispatch loop, request handler...), so the frames
+//    are stored in a tree whose root stands for the outermost frame's caller:
+//    a node is a frame, and its parent is the frame that called it. A stack
+//    is then just its innermost frame's node, and two equal stacks have the
+//    same node.
+//
+//    Nodes are never removed; they are found by (parent, frame) in a hash
+//    table, whose chains are only ever extended, so lookups take no lock.
+//    Nodes are only added while holding the tree's lock.
+//
+class ContextTree
+{
+public:
+    ContextTree ();
+    ~ContextTree ();
+
+    UINT32 Insert (const moduleranges_t* table, const UINT_PTR* frames, UINT32 count);
+    UINT32 Parent (UINT32 node) const { return get(node).parent; }
+    VOID Frame (UINT32 node, UINT16 &image, UINT32 &rva) const
     {
-        return m_hashValue;
+        const node_t &frame = get(node);
+        image = frame.image;
+        rva   = frame.rva;
     }
+    VOID Clear ();
+
+private:
+    struct node_t {
+        UINT32 parent; // The calling frame's node (0, the root, for the outermost frame).
+        UINT32 rva;    // The frame's offset within its module image.
+        UINT32 next;   // Next node in the same hash bucket (0 if none).
+        UINT16 image;  // Index of the frame's module image.
+    };
+
+    const node_t& get (UINT32 node) const
+    {
+        return m_pages[node / CONTEXTTREE_PAGE_SIZE][node % CONTEXTTREE_PAGE_SIZE];
+    }
+    static UINT32 bucketFor (UINT32 parent, UINT16 image, UINT32 rva)
+    {
+        UINT32 hash = (parent * 0x9E3779B1) ^ (rva * 0x85EBCA6B) ^ image;
+        return (hash ^ (hash >> 15)) & (CONTEXTTREE_BUCKETS - 1);
+    }
+    UINT32 find (UINT32 parent, UINT16 image, UINT32 rva) const;
+    UINT32 append (UINT32 parent, UINT16 image, UINT32 rva);
+
+    // Don't allow this!!
+    ContextTree (const ContextTree &other);
+    ContextTree& operator = (const ContextTree &other);
+
+    node_t                 *m_pages [CONTEXTTREE_PAGES];
+    UINT32 volatile * volatile m_buckets; // First node of each bucket (allocated with the root node).
+    UINT32                  m_count;   // Number of nodes, including the root.
+    CriticalSection         m_lock;    // Serializes adding nodes.
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The SymbolCache Class
+//
+//    Leaks from the same allocation sites share most of their frames, so the
+//    same program counters are resolved over and over while a report is
+//    generated. The SymbolCache remembers, per program counter, what
+//    SymFromAddrW and SymGetLineFromAddrW64 returned, so dbghelp is asked
+//    about each address only once.
+//
+//    The cache is protected by the DbgHelp lock, which every caller already
+//    holds while resolving symbols. With "Symbolizer = dia", the report
+//    threads resolve program counters without that lock (see DiaSymbolizer),
+//    and their results are inserted ahead of the lookups. Entries for a module are dropped whenever
+//    its symbols are (re)loaded, since a different image may now live at
+//    those addresses.
+//
+class SymbolCache
+{
+public:
+    SymbolCache ();
+    ~SymbolCache ();
+
+    const symbolinfo_t* Lookup (SIZE_T programCounter, CriticalSectionLocker<DbgHelp>& locker);
+    bool Contains (SIZE_T programCounter, CriticalSectionLocker<DbgHelp>& locker) const;
+    VOID Insert (SIZE_T programCounter, UINT32 image, UINT32 rva, LPCWSTR functionName, DWORD64 displacement,
+        LPCWSTR fileName, DWORD lineNumber, DWORD lineDisplacement, CriticalSectionLocker<DbgHelp>& locker);
+    VOID Invalidate (SIZE_T addrLow, SIZE_T addrHigh, CriticalSectionLocker<DbgHelp>& locker);
+    VOID Clear ();
+    VOID GetStatistics (UINT64 &lookups, UINT64 &ticks, CriticalSectionLocker<DbgHelp>& locker) const;
+    SIZE_T Capacity (CriticalSectionLocker<DbgHelp>& locker) const;
+    VOID Reserve (SIZE_T count, CriticalSectionLocker<DbgHelp>& locker);
 
 private:
-    UINT32 m_hashValue;
+    static symbolinfo_t* create (LPCWSTR functionName, DWORD64 displacement, LPCWSTR fileName, DWORD lineNumber,
+        DWORD lineDisplacement);
+    const symbolinfo_t* createOffset (SIZE_T programCounter, bool relative);
+    VOID destroy (symbolinfo_t* symbol);
+
+    // Don't allow this!!
+    SymbolCache (const SymbolCache &other);
+    SymbolCache& operator = (const SymbolCache &other);
+
+    typedef HashMap<SIZE_T, symbolinfo_t*> SymbolMap;
+
+    SymbolMap m_symbols;     // Maps program counters to their symbolic information.
+    UINT64    m_lookups;     // Number of program counters resolved by dbghelp.
+    UINT64    m_lookupTicks; // Time spent in dbghelp resolving them, in time stamp counter ticks.
 };
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-//  The SafeCallStack Class
+//  The SymbolStore Class
+//
+//    With the SymbolCacheFile option, what the SymbolCache learns outlives the
+//    process: program counters resolved by earlier runs are kept in a file
+//    (see symbolstore.h), keyed by their module's PDB signature and their
+//    RVA, so a CI run that leaks from the same places as the last one doesn't
+//    load the PDBs of its modules again, let alone search them.
 //
-//    This class is a specialization of the CallStack class which provides a
-//    more robust, but quite slow, stack tracing function.
+//    The file is mapped read-only when VLD starts and searched in place.
+//    Program counters resolved by dbghelp during the run are added in memory,
+//    and at shutdown the file is replaced by a merge of both. Only answers
+//    taken from the module's own PDB are added: exports, or a PDB which has
+//    since been found, would give a different answer next time.
 //
-class SafeCallStack : public CallStack
+//    Like the SymbolCache, this is protected by the DbgHelp lock.
+//
+class SymbolStore
 {
 public:
-    virtual VOID getStackTrace (UINT32 maxdepth, const context_t& context);
-    virtual DWORD getHashValue() const;
+    SymbolStore ();
+    ~SymbolStore ();
+
+    VOID Open (LPCWSTR path);
+    bool IsOpen () const { return (m_path != NULL); }
+    const vldsym_record_t* Find (const GUID &pdbGuid, DWORD pdbAge, UINT32 rva, CriticalSectionLocker<DbgHelp>& locker) const;
+    LPCWSTR String (UINT32 offset) const;
+    VOID Add (UINT32 image, UINT_PTR symbolBase, UINT32 rva, const symbolinfo_t &symbol, CriticalSectionLocker<DbgHelp>& locker);
+    VOID Close ();
+
+private:
+    UINT32 addString (LPCWSTR string);
+    bool fromPdb (UINT32 image, UINT_PTR symbolBase, CriticalSectionLocker<DbgHelp>& locker);
+    VOID unmap ();
+    bool write (LPCWSTR path) const;
+
+    // Don't allow this!!
+    SymbolStore (const SymbolStore &other);
+    SymbolStore& operator = (const SymbolStore &other);
+
+    typedef HashMap<SIZE_T, UINT32> StringMap;
+    typedef HashMap<SIZE_T, bool>   ImageMap;
+
+    LPWSTR                 m_path;          // Full path of the file, or NULL if the option is off.
+    HANDLE                 m_file;          // The file, while it is mapped.
+    HANDLE                 m_mapping;
+    const BYTE            *m_view;          // The mapped file, or NULL if there was none (or it was invalid).
+    const vldsym_record_t *m_records;       // The file's records.
+    UINT32                 m_recordCount;
+    const WCHAR           *m_strings;       // The file's strings.
+    UINT32                 m_stringBytes;
+    vldsym_record_t       *m_added;         // Records added during this run, in no particular order.
+    UINT32                 m_addedCount;
+    UINT32                 m_addedCapacity;
+    WCHAR                 *m_addedStrings;  // Their strings, which follow the file's ones when written.
+    UINT32                 m_addedChars;
+    UINT32                 m_addedCharsCapacity;
+    StringMap              m_stringOffsets; // Maps hashes of the added strings to their offsets.
+    ImageMap               m_fromPdb;       // Maps image indexes (plus 2) to whether their symbols come from their PDB.
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The CrtStartupRanges Class
+//
+//    SkipCrtStartupLeaks tells CRT startup allocations apart by the names of
+//    the functions on their call stacks (see CallStack::isCrtStartupAlloc).
+//    Rather than resolving every frame of every leak to a name, the address
+//    ranges of the functions which matter are found once per module, by
+//    enumerating the module's symbols the first time one of its addresses is
+//    classified. A frame is then classified by looking its raw program
+//    counter up in those ranges.
+//
+//    Some symbols come without a size (e.g. exports and public symbols). If
+//    any function which matters is one of them, its range is unknown, so the
+//    module's frames are classified by name after all.
+//
+//    Like the SymbolCache, this is protected by the DbgHelp lock, and a
+//    module's ranges are dropped whenever its symbols are (re)loaded.
+//
+class CrtStartupRanges
+{
+public:
+    CrtStartupRanges ();
+    ~CrtStartupRanges ();
+
+    bool Classify (SIZE_T programCounter, UINT &status, CriticalSectionLocker<DbgHelp>& locker);
+    VOID Invalidate (SIZE_T addrLow, SIZE_T addrHigh, CriticalSectionLocker<DbgHelp>& locker);
+    VOID Clear ();
+
+private:
+    // The address range of a function which classifies a call stack.
+    struct range_t {
+        SIZE_T addrLow;
+        SIZE_T addrHigh;
+        UINT   status;   // CALLSTACK_STATUS_STARTUPCRT or CALLSTACK_STATUS_NOTSTARTUPCRT.
+    };
+
+    struct module_t {
+        bool     exact;  // If false, the ranges are incomplete and mustn't be used.
+        SIZE_T   count;  // Number of ranges.
+        range_t *ranges; // The ranges, sorted by address.
+    };
+
+    module_t* build (SIZE_T moduleBase, CriticalSectionLocker<DbgHelp>& locker);
+    static BOOL CALLBACK addSymbol (PSYMBOL_INFOW symbol, ULONG symbolSize, PVOID context);
+    static VOID destroy (module_t* module);
+
+    // Don't allow this!!
+    CrtStartupRanges (const CrtStartupRanges &other);
+    CrtStartupRanges& operator = (const CrtStartupRanges &other);
+
+    typedef HashMap<SIZE_T, module_t*> ModuleMap;
+
+    ModuleMap m_modules; // Maps module base addresses to their ranges.
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The Suppressions Class
+//
+//    The leaks matching the rules of the SuppressionFile are left out of the
+//    leak reports. A rule is either a leak hash, as printed on the "Leak
+//    Hash" line of the report, or a range of offsets within a module, which
+//    matches every leak with a frame in it. Both are checked against the
+//    frames as they were captured, so a suppressed leak is never resolved,
+//    and its data is never dumped.
+//
+//    The rules are read once at startup and never change afterwards, so they
+//    are checked without a lock.
+//
+class Suppressions
+{
+public:
+    Suppressions ();
+    ~Suppressions ();
+
+    UINT32 Load (LPCWSTR path);
+    bool IsEmpty () const { return (m_hashes == NULL) && (m_rangeCount == 0); }
+    bool IsSuppressed (DWORD leakHash, const CallStack* stack) const;
+    VOID Clear ();
+
+private:
+    // A range of offsets within a module.
+    struct range_t {
+        LPWSTR module;   // File name of the module, without its directory.
+        UINT32 rvaLow;
+        UINT32 rvaHigh;
+    };
+
+    bool addRule (LPWSTR rule);
+
+    // Don't allow this!!
+    Suppressions (const Suppressions &other);
+    Suppressions& operator = (const Suppressions &other);
+
+    typedef HashMap<SIZE_T, bool> HashSet;
+
+    HashSet *m_hashes;     // Suppressed leak hashes (plus 2, as 0 and 1 can't be keys), or NULL if none.
+    range_t *m_ranges;     // Suppressed module ranges.
+    UINT32   m_rangeCount;
+    UINT32   m_rangeCapacity;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The ResolvedTextArena Class
+//
+//    Holds the resolved text of every CallStack. Texts are appended one after
+//    the other to large chunks obtained from VLD's private heap, so each one
+//    takes only as much room as its actual length, with no heap block header
+//    of its own.
+//
+//    A text is built in place: Reserve returns room for the longest text the
+//    stack could produce at the end of the current chunk, and Commit keeps
+//    only the part that was used. Reserve and Commit are only called while
+//    holding the DbgHelp lock, like everything else that resolves symbols.
+//    Each chunk counts the texts it holds, and is returned to the heap once
+//    the last of them is freed, unless it's still being appended to.
+//
+class ResolvedTextArena
+{
+public:
+    ResolvedTextArena ();
+    ~ResolvedTextArena ();
+
+    LPWSTR Reserve (SIZE_T length, CriticalSectionLocker<DbgHelp>& locker);
+    VOID Commit (SIZE_T length, CriticalSectionLocker<DbgHelp>& locker);
+    VOID Free (LPCWSTR text);
+    VOID Clear ();
+    SIZE_T Bytes ();
+
+private:
+    struct chunk_t {
+        LONG   texts;    // Committed texts not freed yet.
+        SIZE_T used;     // Bytes of data taken by committed texts.
+        SIZE_T capacity; // Bytes of data.
+        BYTE   data [1]; // Each text is preceded by a pointer to its chunk.
+    };
+
+    // Don't allow this!!
+    ResolvedTextArena (const ResolvedTextArena &other);
+    ResolvedTextArena& operator = (const ResolvedTextArena &other);
+
+    chunk_t        *m_current; // Chunk texts are appended to.
+    SIZE_T          m_bytes;   // Bytes taken by the chunks not freed yet.
+    CriticalSection m_lock;    // Protects the text counts, and m_current against Free.
 };
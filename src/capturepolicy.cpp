@@ -0,0 +1,302 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Runtime Capture Policy
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#define VLDBUILD
+#include "vldheap.h"    // Provides internal new and delete operators.
+#include "vldint.h"     // Provides access to VLD internals.
+#include "loaderlock.h"
+
+// validWalkMethod - Tells whether a caller passed one of the stack walk
+//   methods a capture policy may have.
+static bool validWalkMethod (UINT32 method)
+{
+    switch (method) {
+    case 0x0:
+    case VLD_OPT_SAFE_STACK_WALK:
+    case VLD_OPT_UNWIND_STACK_WALK:
+    case VLD_OPT_FRAME_STACK_WALK:
+    case VLD_OPT_SHADOW_STACK_WALK:
+    case VLD_OPT_NO_STACK_WALK:
+    case VLD_OPT_CALLER_STACK_WALK:
+    case VLD_OPT_NTDB_STACK_WALK:
+        return true;
+    }
+    return false;
+}
+
+// publishCapturePolicy - Replaces the capture policy with a copy of
+//   "policy". The hooks read the policy through a single pointer, so each one
+//   sees either the old policy or the new one, never a mix. The options'
+//   stack walk bits are updated to match, for VLDGetOptions.
+//
+//   Note: Once the metadata budget has forced sampling, every policy
+//     published is sampled.
+//
+//  - policy (IN): The new capture policy.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::publishCapturePolicy (const capturepolicy_t &policy)
+{
+    capturepolicy_t *published = new capturepolicy_t(policy);
+    bool flush;
+    {
+        CriticalSectionLocker<> cs(m_policyLock);
+        if ((m_degradation >= VLD_DEGRADED_SAMPLING) && (published->sampleRate <= 1) &&
+            (published->sampleBytes == 0))
+            published->sampleBytes = VLD_DEGRADED_SAMPLE_BYTES;
+        bool wasSampling = sampling();
+        published->retired = m_capturePolicy;
+        InterlockedExchangePointer((PVOID*)&m_capturePolicy, published);
+        flush = !wasSampling && sampling();
+
+        CriticalSectionLocker<> options(m_optionsLock);
+        m_options = (m_options & ~VLD_STACK_WALK_OPTIONS) | published->walkMethod;
+    }
+    if (flush) {
+        // Sampled blocks don't go through the pending buffers, and frees no
+        // longer look there, so empty them.
+        flushAllPendingBlocks();
+    }
+}
+
+// releaseCapturePolicies - Frees the published capture policies, when VLD is
+//   destroyed. Only the initial policy is left.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::releaseCapturePolicies ()
+{
+    while (m_capturePolicy != &m_initialPolicy) {
+        const capturepolicy_t *retired = m_capturePolicy->retired;
+        delete m_capturePolicy;
+        m_capturePolicy = retired;
+    }
+}
+
+// applyTracePolicies - Replaces the per-module stack trace policies, and
+//   republishes the module range table they take effect through.
+//
+//  - policies (IN/OUT): The policies, with the syntax of ModuleTracePolicy.
+//      They are tokenized in place.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::applyTracePolicies (LPWSTR policies)
+{
+    CriticalSectionLocker<> cs(m_modulesLock);
+    loadTracePolicies(policies);
+    publishModuleRanges();
+}
+
+// GetCapturePolicy - Obtains the capture policy in effect.
+//
+//  - policy (OUT): Receives the capture policy. The moduleTracePolicy field
+//      is set to NULL.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::GetCapturePolicy (VLD_CAPTURE_POLICY *policy)
+{
+    if (policy == NULL)
+        return;
+
+    const capturepolicy_t *current = m_capturePolicy;
+    policy->stackWalkMethod = current->walkMethod;
+    policy->maxTraceFrames = current->maxTraceFrames;
+    policy->adaptiveTraceFrames = current->adaptiveFrames;
+    policy->sampleRate = current->sampleRate;
+    policy->sampleBytes = current->sampleBytes;
+    policy->minTrackedSize = current->minTrackedSize;
+    policy->maxTrackedSize = current->maxTrackedSize;
+    policy->smallSampleRate = current->smallSampleRate;
+    policy->moduleTracePolicy = NULL;
+}
+
+// SetCapturePolicy - Publishes a new capture policy, and replaces the
+//   per-module stack trace policies if it has any.
+//
+//  - policy (IN): The new capture policy. An unknown stack walk method keeps
+//      the current one.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::SetCapturePolicy (const VLD_CAPTURE_POLICY *policy)
+{
+    if ((m_options & VLD_OPT_VLDOFF) || (policy == NULL)) {
+        // VLD has been turned off.
+        return;
+    }
+
+    capturepolicy_t published;
+    ZeroMemory(&published, sizeof(capturepolicy_t));
+    published.walkMethod = validWalkMethod(policy->stackWalkMethod) ? policy->stackWalkMethod :
+        m_capturePolicy->walkMethod;
+    published.maxTraceFrames = (policy->maxTraceFrames != 0) ? policy->maxTraceFrames : VLD_DEFAULT_MAX_TRACE_FRAMES;
+    published.adaptiveFrames = min(policy->adaptiveTraceFrames, (UINT)CALLSTACK_MAX_CAPTURE);
+    published.sampleRate = policy->sampleRate;
+    published.sampleBytes = policy->sampleBytes;
+    published.minTrackedSize = policy->minTrackedSize;
+    published.maxTrackedSize = policy->maxTrackedSize;
+    published.smallSampleRate = policy->smallSampleRate;
+    publishCapturePolicy(published);
+
+    if (policy->moduleTracePolicy != NULL) {
+        WCHAR policies [MAXMODULELISTLENGTH];
+        wcsncpy_s(policies, _countof(policies), policy->moduleTracePolicy, _TRUNCATE);
+        applyTracePolicies(policies);
+    }
+}
+
+// reloadCapturePolicy - Reads the capture options from vld.ini again, and
+//   publishes them, along with the per-module stack trace policies.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::reloadCapturePolicy ()
+{
+    capturepolicy_t policy;
+    loadCapturePolicy(m_iniFilePath, policy);
+    publishCapturePolicy(policy);
+
+    WCHAR policies [MAXMODULELISTLENGTH] = {0};
+    LoadStringOption(L"ModuleTracePolicy", policies, MAXMODULELISTLENGTH, m_iniFilePath);
+    applyTracePolicies(policies);
+    Report(L"Visual Leak Detector: Reloaded the capture options from %s.\n", m_iniFilePath);
+}
+
+// startIniWatch - Starts the thread which reloads the capture options
+//   whenever vld.ini changes (see WatchIniFile). If the file's directory
+//   can't be watched, or the thread can't be started, the options are only
+//   read once.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::startIniWatch ()
+{
+    // Directories are watched, not files.
+    WCHAR directory [MAX_PATH];
+    wcsncpy_s(directory, _countof(directory), m_iniFilePath, _TRUNCATE);
+    LPWSTR name = wcsrchr(directory, L'\\');
+    if (name != NULL)
+        *name = L'\0';
+    else
+        wcsncpy_s(directory, _countof(directory), L".", _TRUNCATE);
+    m_iniWatchChange = FindFirstChangeNotificationW(directory, FALSE,
+        FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+    if (m_iniWatchChange == INVALID_HANDLE_VALUE) {
+        Report(L"WARNING: Visual Leak Detector: Couldn't watch %s for changes.\n", m_iniFilePath);
+        m_iniWatchChange = NULL;
+        return;
+    }
+
+    m_iniWatchWake = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (m_iniWatchWake != NULL)
+        m_iniWatchThread = CreateThread(NULL, 0, iniWatchProc, this, CREATE_SUSPENDED, &m_iniWatchThreadId);
+    if (m_iniWatchThread == NULL) {
+        if (m_iniWatchWake != NULL)
+            CloseHandle(m_iniWatchWake);
+        m_iniWatchWake = NULL;
+        FindCloseChangeNotification(m_iniWatchChange);
+        m_iniWatchChange = NULL;
+        m_iniWatchThreadId = 0;
+        return;
+    }
+    SetThreadPriority(m_iniWatchThread, THREAD_PRIORITY_BELOW_NORMAL);
+    ResumeThread(m_iniWatchThread);
+}
+
+// stopIniWatch - Stops reloading the capture options. Like
+//   stopGrowthWatchdog, this never waits for the thread to exit. The thread
+//   closes the change notification itself.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::stopIniWatch ()
+{
+    if (m_iniWatchThread == NULL)
+        return;
+
+    m_iniWatchStop = TRUE;
+    SetEvent(m_iniWatchWake);
+    if (WaitForSingleObject(m_iniWatchThread, 0) == WAIT_OBJECT_0) {
+        CloseHandle(m_iniWatchWake);
+        m_iniWatchWake = NULL;
+    }
+    CloseHandle(m_iniWatchThread);
+    m_iniWatchThread = NULL;
+    m_iniWatchThreadId = 0;
+}
+
+// iniWatchProc - Reloads the capture options whenever the last write time of
+//   vld.ini changes, until the watch is stopped. Editors often write a file
+//   in several steps, so the file is only read once it has been left alone
+//   for VLD_INI_WATCH_SETTLE milliseconds.
+//
+//  - param (IN): The VisualLeakDetector.
+//
+//  Return Value:
+//
+//    Always returns 0.
+//
+DWORD WINAPI VisualLeakDetector::iniWatchProc (LPVOID param)
+{
+    VisualLeakDetector *vld = (VisualLeakDetector*)param;
+    HANDLE handles [2] = { vld->m_iniWatchWake, vld->m_iniWatchChange };
+    while (WaitForMultipleObjects(_countof(handles), handles, FALSE, INFINITE) == WAIT_OBJECT_0 + 1) {
+        if (WaitForSingleObject(handles[0], VLD_INI_WATCH_SETTLE) != WAIT_TIMEOUT)
+            break;
+        FindNextChangeNotification(handles[1]);
+
+        // Any file in the directory may have changed.
+        WIN32_FILE_ATTRIBUTE_DATA attributes;
+        if (!GetFileAttributesExW(vld->m_iniFilePath, GetFileExInfoStandard, &attributes) ||
+            (CompareFileTime(&attributes.ftLastWriteTime, &vld->m_iniWriteTime) == 0))
+            continue;
+
+        LoaderLock ll;
+        if (vld->m_iniWatchStop)
+            break;
+        vld->m_iniWriteTime = attributes.ftLastWriteTime;
+        vld->reloadCapturePolicy();
+    }
+    FindCloseChangeNotification(handles[1]);
+    return 0;
+}
@@ -0,0 +1,355 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Crash-Time Heap Snapshot
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#define VLDBUILD
+#include "binreport.h"  // Provides the binary report format.
+#include "vldheap.h"    // Provides internal new and delete operators.
+#include "vldint.h"     // Provides access to VLD internals.
+
+// Imported global variables.
+extern VisualLeakDetector g_vld;
+
+#define VLD_STATUS_HEAP_CORRUPTION 0xC0000374 // Raised by the heap when it finds itself corrupted.
+
+// The snapshot is written while the process is crashing: the crashing thread
+// may hold any lock, VLD's included, and the heap may be exhausted or
+// corrupted. So everything the writer needs is set up by startCrashSnapshot
+// (the file, its write buffer and the stack index), and the writer takes no
+// lock and allocates nothing. Other threads keep running meanwhile, so the
+// block maps are read as they are, under __try: a snapshot cut short by a
+// map changing underneath it is still written up to that point.
+
+// crashwriter_t - Buffers the snapshot's writes in the preallocated buffer.
+struct crashwriter_t {
+    HANDLE  file;
+    BYTE   *buffer;
+    SIZE_T  used;
+    bool    failed;
+};
+
+// flushCrashWriter - Writes the buffered bytes to the snapshot file.
+static VOID flushCrashWriter (crashwriter_t &writer)
+{
+    if ((writer.used != 0) && !writer.failed) {
+        DWORD written = 0;
+        if (!WriteFile(writer.file, writer.buffer, (DWORD)writer.used, &written, NULL) ||
+            (written != writer.used))
+            writer.failed = true;
+    }
+    writer.used = 0;
+}
+
+// appendCrashWriter - Buffers bytes for the snapshot file.
+static VOID appendCrashWriter (crashwriter_t &writer, const VOID *data, SIZE_T size)
+{
+    const BYTE *bytes = (const BYTE*)data;
+    while (size != 0) {
+        if (writer.used == VLD_CRASH_SNAPSHOT_BUFFER)
+            flushCrashWriter(writer);
+        SIZE_T count = VLD_CRASH_SNAPSHOT_BUFFER - writer.used;
+        if (count > size)
+            count = size;
+        memcpy(writer.buffer + writer.used, bytes, count);
+        writer.used += count;
+        bytes += count;
+        size -= count;
+    }
+}
+
+// startCrashSnapshot - Opens the crash snapshot file and installs the
+//   exception handlers which write it. The file is created now, while the
+//   process is healthy, and deleted again at a clean exit if no crash wrote
+//   it. If the file or the buffers can't be created, VLD runs without crash
+//   snapshots.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::startCrashSnapshot ()
+{
+    m_crashFile = CreateFileW(m_crashSnapshotPath, GENERIC_WRITE | DELETE, FILE_SHARE_READ | FILE_SHARE_DELETE,
+        NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m_crashFile == INVALID_HANDLE_VALUE) {
+        Report(L"WARNING: Visual Leak Detector: Couldn't create the crash snapshot file %s.\n", m_crashSnapshotPath);
+        return;
+    }
+    m_crashBuffer = (BYTE*)VirtualAlloc(NULL, VLD_CRASH_SNAPSHOT_BUFFER, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    m_crashStacks = (crashstack_t*)VirtualAlloc(NULL, VLD_CRASH_SNAPSHOT_STACKS * sizeof(crashstack_t),
+        MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if ((m_crashBuffer == NULL) || (m_crashStacks == NULL)) {
+        stopCrashSnapshot();
+        return;
+    }
+
+    // The vectored handler sees out of memory, heap corruption and stack
+    // overflows before any frame handler can swallow them (a stack overflow
+    // may leave too little stack for the unhandled exception filter to run at
+    // all). Anything else, access violations included, is left to the
+    // program's own handlers and only snapshotted if none of them handles it.
+    m_crashHandler = AddVectoredExceptionHandler(0, crashVectoredHandler);
+    m_crashPrevFilter = SetUnhandledExceptionFilter(crashUnhandledFilter);
+}
+
+// stopCrashSnapshot - Removes the exception handlers and closes the crash
+//   snapshot file, deleting it if no crash wrote it.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::stopCrashSnapshot ()
+{
+    if (m_crashFile == INVALID_HANDLE_VALUE)
+        return;
+
+    if (m_crashHandler != NULL) {
+        RemoveVectoredExceptionHandler(m_crashHandler);
+        m_crashHandler = NULL;
+        // Only restore the previous filter if nobody has replaced ours since.
+        LPTOP_LEVEL_EXCEPTION_FILTER current = SetUnhandledExceptionFilter(m_crashPrevFilter);
+        if (current != crashUnhandledFilter)
+            SetUnhandledExceptionFilter(current);
+        m_crashPrevFilter = NULL;
+    }
+
+    // The handlers are gone, but one may still be writing on another thread
+    // (the process is then about to die), in which case the file and the
+    // buffers are left to it. Claiming an unwritten snapshot makes sure no
+    // writer starts now.
+    LONG state = InterlockedCompareExchange(&m_crashState, VLD_CRASH_WRITTEN, VLD_CRASH_IDLE);
+    if (state == VLD_CRASH_WRITING)
+        return;
+    if (state == VLD_CRASH_IDLE) {
+        FILE_DISPOSITION_INFO disposition = { TRUE };
+        SetFileInformationByHandle(m_crashFile, FileDispositionInfo, &disposition, sizeof(disposition));
+    }
+    CloseHandle(m_crashFile);
+    m_crashFile = INVALID_HANDLE_VALUE;
+    if (m_crashBuffer != NULL) {
+        VirtualFree(m_crashBuffer, 0, MEM_RELEASE);
+        m_crashBuffer = NULL;
+    }
+    if (m_crashStacks != NULL) {
+        VirtualFree(m_crashStacks, 0, MEM_RELEASE);
+        m_crashStacks = NULL;
+    }
+}
+
+// crashVectoredHandler - Writes the crash snapshot when the process runs out
+//   of memory, corrupts its heap, or overflows a stack.
+//
+//  - exceptioninfo (IN): The exception being dispatched.
+//
+//  Return Value:
+//
+//    Always returns EXCEPTION_CONTINUE_SEARCH.
+//
+LONG CALLBACK VisualLeakDetector::crashVectoredHandler (PEXCEPTION_POINTERS exceptioninfo)
+{
+    DWORD code = exceptioninfo->ExceptionRecord->ExceptionCode;
+    if ((code == STATUS_NO_MEMORY) || (code == VLD_STATUS_HEAP_CORRUPTION) || (code == EXCEPTION_STACK_OVERFLOW))
+        g_vld.writeCrashSnapshot();
+    return EXCEPTION_CONTINUE_SEARCH;
+}
+
+// crashUnhandledFilter - Writes the crash snapshot when an exception isn't
+//   handled by the program, then passes the exception on to the filter which
+//   was installed before VLD's.
+//
+//  - exceptioninfo (IN): The unhandled exception.
+//
+//  Return Value:
+//
+//    Returns whatever the previous filter returns, or
+//    EXCEPTION_CONTINUE_SEARCH if there was none.
+//
+LONG WINAPI VisualLeakDetector::crashUnhandledFilter (PEXCEPTION_POINTERS exceptioninfo)
+{
+    g_vld.writeCrashSnapshot();
+    LPTOP_LEVEL_EXCEPTION_FILTER previous = g_vld.m_crashPrevFilter;
+    if (previous != NULL)
+        return previous(exceptioninfo);
+    return EXCEPTION_CONTINUE_SEARCH;
+}
+
+// writeCrashSnapshot - Writes the crash snapshot, unless one has been
+//   written already. Whatever goes wrong while the block maps are read, the
+//   exception never leaves this function.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::writeCrashSnapshot ()
+{
+    if (InterlockedCompareExchange(&m_crashState, VLD_CRASH_WRITING, VLD_CRASH_IDLE) != VLD_CRASH_IDLE)
+        return;
+
+    crashwriter_t writer = { m_crashFile, m_crashBuffer, 0, false };
+    vldbin_header_t header = { 0 };
+    __try {
+        collectCrashSnapshot(writer, header);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        // Keep what was written so far; the header says how much of it there is.
+    }
+    flushCrashWriter(writer);
+
+    // The header was written as a placeholder and is rewritten with the
+    // final counts.
+    if (SetFilePointer(m_crashFile, 0, NULL, FILE_BEGIN) == 0) {
+        DWORD written = 0;
+        WriteFile(m_crashFile, &header, sizeof(header), &written, NULL);
+    }
+    FlushFileBuffers(m_crashFile);
+    InterlockedExchange(&m_crashState, VLD_CRASH_WRITTEN);
+}
+
+// crashStackIndex - Looks a call stack up in the crash snapshot's stack index.
+//
+//  - stack (IN): The interned call stack.
+//
+//  - stackCount (IN): Number of stacks in the index, which a new stack's
+//      index is.
+//
+//  - add (IN): If the stack isn't in the index, whether to add it.
+//
+//  - added (OUT): Set to true if the stack was added.
+//
+//  Return Value:
+//
+//    Returns the stack's index in the snapshot, or VLDBIN_NO_STACK if it
+//    isn't in the index (or doesn't fit in it).
+//
+UINT32 VisualLeakDetector::crashStackIndex (const CallStack *stack, UINT32 stackCount, bool add, bool &added)
+{
+    added = false;
+    UINT32 slot = (UINT32)(((UINT_PTR)stack >> 4) * 2654435761u) & (VLD_CRASH_SNAPSHOT_STACKS - 1);
+    for (UINT32 probe = 0; probe < VLD_CRASH_SNAPSHOT_STACKS; probe++) {
+        crashstack_t &entry = m_crashStacks[slot];
+        if (entry.stack == stack)
+            return entry.index;
+        if (entry.stack == NULL) {
+            if (!add)
+                return VLDBIN_NO_STACK;
+            entry.stack = stack;
+            entry.index = stackCount;
+            added = true;
+            return stackCount;
+        }
+        slot = (slot + 1) & (VLD_CRASH_SNAPSHOT_STACKS - 1);
+    }
+    return VLDBIN_NO_STACK;
+}
+
+// collectCrashSnapshot - Writes the module table, the call stacks and the
+//   records of every live block to the crash snapshot, in the binary report
+//   format. Unlike a binary report, the snapshot lists every block, not only
+//   the leaks, and holds no data bytes. Blocks still waiting in the threads'
+//   pending buffers aren't included.
+//
+//   Note: This runs under writeCrashSnapshot's __try, so it must not need
+//     unwinding; the header is kept up to date as records are written.
+//
+//  - writer (IN/OUT): The snapshot file's writer.
+//
+//  - header (OUT): Receives the snapshot's header.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::collectCrashSnapshot (crashwriter_t &writer, vldbin_header_t &header)
+{
+    header.magic       = VLDBIN_MAGIC;
+    header.version     = VLDBIN_VERSION;
+    header.pointerSize = sizeof(LPVOID);
+    header.processId   = GetCurrentProcessId();
+    header.flags       = VLDBIN_HEADER_SNAPSHOT;
+    GetSystemTimeAsFileTime(&header.timestamp);
+    appendCrashWriter(writer, &header, sizeof(header));
+
+    for (ModuleSet::Iterator moduleit = m_loadedModules->begin(); moduleit != m_loadedModules->end(); ++moduleit) {
+        const moduleinfo_t &moduleinfo = *moduleit;
+        vldbin_module_t module = { 0 };
+        module.base       = moduleinfo.addrLow;
+        module.size       = moduleinfo.addrHigh - moduleinfo.addrLow + 1;
+        module.pdbGuid    = moduleinfo.pdbGuid;
+        module.pdbAge     = moduleinfo.pdbAge;
+        module.pathLength = moduleinfo.pathLength;
+        appendCrashWriter(writer, &module, sizeof(module));
+        appendCrashWriter(writer, moduleinfo.path, module.pathLength * sizeof(WCHAR));
+        header.moduleCount++;
+    }
+
+    // Each distinct stack is written the first time a block refers to it, so
+    // the stack records all come before the block records.
+    for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
+        BlockMap *blockmap = &(*heapit).second->blockMap;
+        for (BlockMap::Iterator blockit = blockmap->begin(); blockit != blockmap->end(); ++blockit) {
+            const CallStack *callstack = (*blockit).second->callStack;
+            if (callstack == NULL)
+                continue;
+            bool added;
+            crashStackIndex(callstack, header.stackCount, true, added);
+            if (!added)
+                continue;
+
+            vldbin_stack_t stack;
+            stack.hash       = callstack->getHashValue();
+            stack.frameCount = callstack->size();
+            appendCrashWriter(writer, &stack, sizeof(stack));
+            for (UINT32 frame = 0; frame < stack.frameCount; frame++) {
+                UINT64 pc = (*callstack)[frame];
+                appendCrashWriter(writer, &pc, sizeof(pc));
+            }
+            header.stackCount++;
+        }
+    }
+
+    for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
+        BlockMap *blockmap = &(*heapit).second->blockMap;
+        for (BlockMap::Iterator blockit = blockmap->begin(); blockit != blockmap->end(); ++blockit) {
+            const blockinfo_t *info = (*blockit).second;
+            vldbin_block_t block = { 0 };
+            block.serialNumber = info->serialNumber;
+            block.address      = (UINT_PTR)(*blockit).first;
+            block.size         = info->size;
+            block.heap         = (UINT_PTR)(*heapit).first;
+            block.threadId     = getThreadId(info);
+            block.stackIndex   = VLDBIN_NO_STACK;
+            if (info->callStack != NULL) {
+                bool added;
+                block.stackIndex = crashStackIndex(info->callStack, header.stackCount, false, added);
+            }
+            if (info->crtHeader != crtheader_none)
+                block.flags |= VLDBIN_BLOCK_CRT;
+            if (info->crtHeader == crtheader_ucrt)
+                block.flags |= VLDBIN_BLOCK_UCRT;
+            appendCrashWriter(writer, &block, sizeof(block));
+            header.blockCount++;
+        }
+    }
+}
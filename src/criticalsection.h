@@ -3,6 +3,23 @@
 #define WIN32_LEAN_AND_MEAN
 #define NOMINMAX
 #include <windows.h>
+#include <intrin.h>
+
+#if defined(_M_ARM64)
+// ARM64 has no time stamp counter. The virtual counter, which ticks at a
+// fixed (if lower) rate, serves the same purpose for VLD's timing.
+#define __rdtsc() ((unsigned __int64)_ReadStatusReg(ARM64_CNTVCT))
+#endif // _M_ARM64
+
+// Acquisition counters of one lock, or of a family of locks, kept when the
+// LockProfiling option is on. A CriticalSection counts into its profile only
+// once one is attached with Profile.
+struct lockprofile_t
+{
+	volatile LONG64 acquisitions;	// Times the lock was entered.
+	volatile LONG64 contentions;	// Times it was held by another thread and had to be waited for.
+	volatile LONG64 waitTicks;		// Time spent waiting, in time stamp counter ticks.
+};
 
 // you should consider CriticalSectionLocker<> whenever possible instead of
 // directly working with CriticalSection class - it is safer
@@ -11,6 +28,7 @@ class CriticalSection
 public:
 	void Initialize()
 	{
+		m_profile = NULL;
 		m_critRegion.OwningThread = 0;
 		__try {
 			InitializeCriticalSection(&m_critRegion);
@@ -25,7 +43,19 @@ public:
 	{
 		ULONG_PTR ownerThreadId = (ULONG_PTR)m_critRegion.OwningThread;
 		UNREFERENCED_PARAMETER(ownerThreadId);
+		lockprofile_t *profile = m_profile;
+		if (profile == NULL) {
+			EnterCriticalSection(&m_critRegion);
+			return;
+		}
+		// Only an entry which can't be had right away is timed.
+		InterlockedIncrement64(&profile->acquisitions);
+		if (TryEnterCriticalSection(&m_critRegion))
+			return;
+		unsigned long long start = __rdtsc();
 		EnterCriticalSection(&m_critRegion);
+		InterlockedIncrement64(&profile->contentions);
+		InterlockedExchangeAdd64(&profile->waitTicks, (LONG64)(__rdtsc() - start));
 	}
 
 	bool IsLocked()
@@ -42,13 +72,37 @@ public:
 	}
 
 	// try enter the section
-	bool TryEnter()		{ return (TryEnterCriticalSection(&m_critRegion) != 0); }
+	bool TryEnter()
+	{
+		if (TryEnterCriticalSection(&m_critRegion) == 0)
+			return false;
+		if (m_profile != NULL)
+			InterlockedIncrement64(&m_profile->acquisitions);
+		return true;
+	}
 
 	// leave the critical section
 	void Leave()		{ LeaveCriticalSection(&m_critRegion); }
 
+	// count acquisitions into the profile from now on (NULL stops counting)
+	void Profile(lockprofile_t *profile)	{ m_profile = profile; }
+
 private:
 	CRITICAL_SECTION m_critRegion;
+	lockprofile_t   *m_profile;
+};
+
+// A lock which does nothing, for containers whose every access is already
+// serialized by some other lock. It can stand in for CriticalSection wherever
+// a lock type is a template parameter.
+class NoLock
+{
+public:
+	void Initialize()	{}
+	void Delete()		{}
+	void Enter()		{}
+	void Leave()		{}
+	void Profile(lockprofile_t *)	{}
 };
 
 template<typename T = CriticalSection>
@@ -31,9 +31,11 @@ Applications should never include this header."
 
 #include "vldint.h"
 extern __declspec(dllexport) VisualLeakDetector g_vld;
+extern DbgHelp g_DbgHelp;
 
 //#define PRINTHOOKCALLS
 //#define PRINTHOOKCALLS2
+#include <malloc.h>
 #include <tchar.h>
 
 #ifdef PRINTHOOKCALLS
@@ -85,9 +87,14 @@ public:
     static void* __cdecl crtd__aligned_recalloc (void *memblock, size_t num, size_t size, size_t alignment);
     static void* __cdecl crtd__aligned_offset_recalloc (void *memblock, size_t num, size_t size, size_t alignment, size_t offset);
 
+    // Only the release UCRT has these (see below).
+    static void* __cdecl crtd__malloc_base (size_t size);
+    static void  __cdecl crtd__free_base (void *mem);
+    static void* __cdecl crtd__realloc_base (void *mem, size_t size);
+
     union
     {
-        void* function[28];
+        void* function[32];
         struct
         {
             void* pcrtd__calloc_dbg;
@@ -118,6 +125,10 @@ public:
             void* pcrtd__vector_new_dbg;
             void* pcrtd_scalar_new;
             void* pcrtd_vector_new;
+            void* pcrtd_free;
+            void* pcrtd__malloc_base;
+            void* pcrtd__free_base;
+            void* pcrtd__realloc_base;
         };
     };
 };
@@ -198,8 +209,12 @@ void* CrtPatch<CRTVersion, debug>::crtd__calloc_dbg (size_t      num,
     _calloc_dbg_t pcrtxxd__calloc_dbg = (_calloc_dbg_t)data.pcrtd__calloc_dbg;
     assert(pcrtxxd__calloc_dbg);
 
+    if (!g_vld.trackingAllocs())
+        return pcrtxxd__calloc_dbg(num, size, type, file, line);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pcrtxxd__calloc_dbg, context_, debug, (CRTVersion >= 140));
+    cc.SetBlockType(type);
 
     return pcrtxxd__calloc_dbg(num, size, type, file, line);
 }
@@ -230,8 +245,12 @@ void* CrtPatch<CRTVersion, debug>::crtd__malloc_dbg (size_t      size,
     _malloc_dbg_t pcrtxxd__malloc_dbg = (_malloc_dbg_t)data.pcrtd__malloc_dbg;
     assert(pcrtxxd__malloc_dbg);
 
+    if (!g_vld.trackingAllocs())
+        return pcrtxxd__malloc_dbg(size, type, file, line);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pcrtxxd__malloc_dbg, context_, debug, (CRTVersion >= 140));
+    cc.SetBlockType(type);
     return pcrtxxd__malloc_dbg(size, type, file, line);
 }
 
@@ -264,8 +283,12 @@ void* CrtPatch<CRTVersion, debug>::crtd__realloc_dbg (void       *mem,
     _realloc_dbg_t pcrtxxd__realloc_dbg = (_realloc_dbg_t)data.pcrtd__realloc_dbg;
     assert(pcrtxxd__realloc_dbg);
 
+    if (!g_vld.trackingAllocs())
+        return pcrtxxd__realloc_dbg(mem, size, type, file, line);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pcrtxxd__realloc_dbg, context_, debug, (CRTVersion >= 140));
+    cc.SetBlockType(type);
     return pcrtxxd__realloc_dbg(mem, size, type, file, line);
 }
 
@@ -299,8 +322,12 @@ void* CrtPatch<CRTVersion, debug>::crtd__recalloc_dbg (void       *mem,
     _recalloc_dbg_t pcrtxxd__recalloc_dbg = (_recalloc_dbg_t)data.pcrtd__recalloc_dbg;
     assert(pcrtxxd__recalloc_dbg);
 
+    if (!g_vld.trackingAllocs())
+        return pcrtxxd__recalloc_dbg(mem, num, size, type, file, line);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pcrtxxd__recalloc_dbg, context_, debug, (CRTVersion >= 140));
+    cc.SetBlockType(type);
     return pcrtxxd__recalloc_dbg(mem, num, size, type, file, line);
 }
 
@@ -315,8 +342,12 @@ char* CrtPatch<CRTVersion, debug>::crtd__strdup_dbg (const char* src,
     _strdup_dbg_t pcrtxxd__strdup_dbg = (_strdup_dbg_t)data.pcrtd__strdup_dbg;
     assert(pcrtxxd__strdup_dbg);
 
+    if (!g_vld.trackingAllocs())
+        return pcrtxxd__strdup_dbg(src, type, file, line);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pcrtxxd__strdup_dbg, context_, debug, (CRTVersion >= 140));
+    cc.SetBlockType(type);
     return pcrtxxd__strdup_dbg(src, type, file, line);
 }
 
@@ -331,8 +362,12 @@ wchar_t* CrtPatch<CRTVersion, debug>::crtd__wcsdup_dbg (const wchar_t* src,
     _wcsdup_dbg_t pcrtxxd__wcsdup_dbg = (_wcsdup_dbg_t)data.pcrtd__wcsdup_dbg;
     assert(pcrtxxd__wcsdup_dbg);
 
+    if (!g_vld.trackingAllocs())
+        return pcrtxxd__wcsdup_dbg(src, type, file, line);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pcrtxxd__wcsdup_dbg, context_, debug, (CRTVersion >= 140));
+    cc.SetBlockType(type);
     return pcrtxxd__wcsdup_dbg(src, type, file, line);
 }
 
@@ -362,8 +397,12 @@ void* CrtPatch<CRTVersion, debug>::crtd__scalar_new_dbg (size_t      size,
     new_dbg_crt_t pcrtxxd_new_dbg = (new_dbg_crt_t)data.pcrtd__scalar_new_dbg;
     assert(pcrtxxd_new_dbg);
 
+    if (!g_vld.trackingAllocs())
+        return pcrtxxd_new_dbg(size, type, file, line);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pcrtxxd_new_dbg, context_, debug, (CRTVersion >= 140));
+    cc.SetBlockType(type);
     return pcrtxxd_new_dbg(size, type, file, line);
 }
 
@@ -393,8 +432,12 @@ void* CrtPatch<CRTVersion, debug>::crtd__vector_new_dbg (size_t      size,
     new_dbg_crt_t pcrtxxd_new_dbg = (new_dbg_crt_t)data.pcrtd__vector_new_dbg;
     assert(pcrtxxd_new_dbg);
 
+    if (!g_vld.trackingAllocs())
+        return pcrtxxd_new_dbg(size, type, file, line);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pcrtxxd_new_dbg, context_, debug, (CRTVersion >= 140));
+    cc.SetBlockType(type);
     return pcrtxxd_new_dbg(size, type, file, line);
 }
 
@@ -418,6 +461,9 @@ void* CrtPatch<CRTVersion, debug>::crtd_calloc (size_t num, size_t size)
     calloc_t pcrtxxd_calloc = (calloc_t)data.pcrtd_calloc;
     assert(pcrtxxd_calloc);
 
+    if (!g_vld.trackingAllocs())
+        return pcrtxxd_calloc(num, size);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pcrtxxd_calloc, context_, debug, (CRTVersion >= 140));
     return pcrtxxd_calloc(num, size);
@@ -441,6 +487,9 @@ void* CrtPatch<CRTVersion, debug>::crtd_malloc (size_t size)
     malloc_t pcrtxxd_malloc = (malloc_t)data.pcrtd_malloc;
     assert(pcrtxxd_malloc);
 
+    if (!g_vld.trackingAllocs())
+        return pcrtxxd_malloc(size);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pcrtxxd_malloc, context_, debug, (CRTVersion >= 140));
     return pcrtxxd_malloc(size);
@@ -466,6 +515,9 @@ void* CrtPatch<CRTVersion, debug>::crtd_realloc (void *mem, size_t size)
     realloc_t pcrtxxd_realloc = (realloc_t)data.pcrtd_realloc;
     assert(pcrtxxd_realloc);
 
+    if (!g_vld.trackingAllocs())
+        return pcrtxxd_realloc(mem, size);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pcrtxxd_realloc, context_, debug, (CRTVersion >= 140));
     return pcrtxxd_realloc(mem, size);
@@ -491,6 +543,9 @@ void* CrtPatch<CRTVersion, debug>::crtd__recalloc (void *mem, size_t num, size_t
     _recalloc_t pcrtxxd_recalloc = (_recalloc_t)data.pcrtd_recalloc;
     assert(pcrtxxd_recalloc);
 
+    if (!g_vld.trackingAllocs())
+        return pcrtxxd_recalloc(mem, num, size);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pcrtxxd_recalloc, context_, debug, (CRTVersion >= 140));
     return pcrtxxd_recalloc(mem, num, size);
@@ -504,6 +559,9 @@ char* CrtPatch<CRTVersion, debug>::crtd__strdup (const char* src)
     _strdup_t pcrtxxd_strdup = (_strdup_t)data.pcrtd__strdup;
     assert(pcrtxxd_strdup);
 
+    if (!g_vld.trackingAllocs())
+        return pcrtxxd_strdup(src);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pcrtxxd_strdup, context_, debug, (CRTVersion >= 140));
     return pcrtxxd_strdup(src);
@@ -516,6 +574,9 @@ wchar_t* CrtPatch<CRTVersion, debug>::crtd__wcsdup (const wchar_t* src)
     _wcsdup_t pcrtxxd_wcsdup = (_wcsdup_t)data.pcrtd__wcsdup;
     assert(pcrtxxd_wcsdup);
 
+    if (!g_vld.trackingAllocs())
+        return pcrtxxd_wcsdup(src);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pcrtxxd_wcsdup, context_, debug, (CRTVersion >= 140));
     return pcrtxxd_wcsdup(src);
@@ -548,8 +609,12 @@ void* CrtPatch<CRTVersion, debug>::crtd__aligned_malloc_dbg (size_t      size,
     _aligned_malloc_dbg_t pcrtxxd__aligned_malloc_dbg = (_aligned_malloc_dbg_t)data.pcrtd__aligned_malloc_dbg;
     assert(pcrtxxd__aligned_malloc_dbg);
 
+    if (!g_vld.trackingAllocs())
+        return pcrtxxd__aligned_malloc_dbg(size, alignment, type, file, line);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pcrtxxd__aligned_malloc_dbg, context_, debug, (CRTVersion >= 140));
+    cc.SetBlockType(type);
     return pcrtxxd__aligned_malloc_dbg(size, alignment, type, file, line);
 }
 
@@ -581,8 +646,12 @@ void* CrtPatch<CRTVersion, debug>::crtd__aligned_offset_malloc_dbg (size_t
     _aligned_offset_malloc_dbg_t pcrtxxd__malloc_dbg = (_aligned_offset_malloc_dbg_t)data.pcrtd__aligned_offset_malloc_dbg;
     assert(pcrtxxd__malloc_dbg);
 
+    if (!g_vld.trackingAllocs())
+        return pcrtxxd__malloc_dbg(size, alignment, offset, type, file, line);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pcrtxxd__malloc_dbg, context_, debug, (CRTVersion >= 140));
+    cc.SetBlockType(type);
     return pcrtxxd__malloc_dbg(size, alignment, offset, type, file, line);
 }
 
@@ -616,8 +685,12 @@ void* CrtPatch<CRTVersion, debug>::crtd__aligned_realloc_dbg (void       *mem,
     _aligned_realloc_dbg_t pcrtxxd__realloc_dbg = (_aligned_realloc_dbg_t)data.pcrtd__aligned_realloc_dbg;
     assert(pcrtxxd__realloc_dbg);
 
+    if (!g_vld.trackingAllocs())
+        return pcrtxxd__realloc_dbg(mem, size, alignment, type, file, line);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pcrtxxd__realloc_dbg, context_, debug, (CRTVersion >= 140));
+    cc.SetBlockType(type);
     return pcrtxxd__realloc_dbg(mem, size, alignment, type, file, line);
 }
 
@@ -652,8 +725,12 @@ void* CrtPatch<CRTVersion, debug>::crtd__aligned_offset_realloc_dbg (void
     _aligned_offset_realloc_dbg_t pcrtxxd__realloc_dbg = (_aligned_offset_realloc_dbg_t)data.pcrtd__aligned_offset_realloc_dbg;
     assert(pcrtxxd__realloc_dbg);
 
+    if (!g_vld.trackingAllocs())
+        return pcrtxxd__realloc_dbg(mem, size, alignment, offset, type, file, line);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pcrtxxd__realloc_dbg, context_, debug, (CRTVersion >= 140));
+    cc.SetBlockType(type);
     return pcrtxxd__realloc_dbg(mem, size, alignment, offset, type, file, line);
 }
 
@@ -690,8 +767,12 @@ void* CrtPatch<CRTVersion, debug>::crtd__aligned_recalloc_dbg (void       *mem,
     _aligned_recalloc_dbg_t pcrtxxd__recalloc_dbg = (_aligned_recalloc_dbg_t)data.pcrtd__aligned_recalloc_dbg;
     assert(pcrtxxd__recalloc_dbg);
 
+    if (!g_vld.trackingAllocs())
+        return pcrtxxd__recalloc_dbg(mem, num, size, alignment, type, file, line);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pcrtxxd__recalloc_dbg, context_, debug, (CRTVersion >= 140));
+    cc.SetBlockType(type);
     return pcrtxxd__recalloc_dbg(mem, num, size, alignment, type, file, line);
 }
 
@@ -729,8 +810,12 @@ void* CrtPatch<CRTVersion, debug>::crtd__aligned_offset_recalloc_dbg (void
     _aligned_offset_recalloc_dbg_t pcrtxxd__recalloc_dbg = (_aligned_offset_recalloc_dbg_t)data.pcrtd__aligned_offset_recalloc_dbg;
     assert(pcrtxxd__recalloc_dbg);
 
+    if (!g_vld.trackingAllocs())
+        return pcrtxxd__recalloc_dbg(mem, num, size, alignment, offset, type, file, line);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pcrtxxd__recalloc_dbg, context_, debug, (CRTVersion >= 140));
+    cc.SetBlockType(type);
     return pcrtxxd__recalloc_dbg(mem, num, size, alignment, offset, type, file, line);
 }
 
@@ -752,6 +837,9 @@ void* CrtPatch<CRTVersion, debug>::crtd__aligned_malloc (size_t size, size_t ali
     _aligned_malloc_t pcrtxxd_malloc = (_aligned_malloc_t)data.pcrtd_aligned_malloc;
     assert(pcrtxxd_malloc);
 
+    if (!g_vld.trackingAllocs())
+        return pcrtxxd_malloc(size, alignment);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pcrtxxd_malloc, context_, debug, (CRTVersion >= 140));
     return pcrtxxd_malloc(size, alignment);
@@ -775,6 +863,9 @@ void* CrtPatch<CRTVersion, debug>::crtd__aligned_offset_malloc (size_t size, siz
     _aligned_offset_malloc_t pcrtxxd_malloc = (_aligned_offset_malloc_t)data.pcrtd_aligned_offset_malloc;
     assert(pcrtxxd_malloc);
 
+    if (!g_vld.trackingAllocs())
+        return pcrtxxd_malloc(size, alignment, offset);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pcrtxxd_malloc, context_, debug, (CRTVersion >= 140));
     return pcrtxxd_malloc(size, alignment, offset);
@@ -800,6 +891,9 @@ void* CrtPatch<CRTVersion, debug>::crtd__aligned_realloc (void *mem, size_t size
     _aligned_realloc_t pcrtxxd_realloc = (_aligned_realloc_t)data.pcrtd_aligned_realloc;
     assert(pcrtxxd_realloc);
 
+    if (!g_vld.trackingAllocs())
+        return pcrtxxd_realloc(mem, size, alignment);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pcrtxxd_realloc, context_, debug, (CRTVersion >= 140));
     return pcrtxxd_realloc(mem, size, alignment);
@@ -825,6 +919,9 @@ void* CrtPatch<CRTVersion, debug>::crtd__aligned_offset_realloc (void *mem, size
     _aligned_offset_realloc_t pcrtxxd_realloc = (_aligned_offset_realloc_t)data.pcrtd_aligned_offset_realloc;
     assert(pcrtxxd_realloc);
 
+    if (!g_vld.trackingAllocs())
+        return pcrtxxd_realloc(mem, size, alignment, offset);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pcrtxxd_realloc, context_, debug, (CRTVersion >= 140));
     return pcrtxxd_realloc(mem, size, alignment, offset);
@@ -852,6 +949,9 @@ void* CrtPatch<CRTVersion, debug>::crtd__aligned_recalloc (void *mem, size_t num
     _aligned_recalloc_t pcrtxxd_recalloc = (_aligned_recalloc_t)data.pcrtd_aligned_recalloc;
     assert(pcrtxxd_recalloc);
 
+    if (!g_vld.trackingAllocs())
+        return pcrtxxd_recalloc(mem, num, size, alignment);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pcrtxxd_recalloc, context_, debug, (CRTVersion >= 140));
     return pcrtxxd_recalloc(mem, num, size, alignment);
@@ -879,6 +979,9 @@ void* CrtPatch<CRTVersion, debug>::crtd__aligned_offset_recalloc (void *mem, siz
     _aligned_offset_recalloc_t pcrtxxd_recalloc = (_aligned_offset_recalloc_t)data.pcrtd_aligned_offset_recalloc;
     assert(pcrtxxd_recalloc);
 
+    if (!g_vld.trackingAllocs())
+        return pcrtxxd_recalloc(mem, num, size, alignment, offset);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pcrtxxd_recalloc, context_, debug, (CRTVersion >= 140));
     return pcrtxxd_recalloc(mem, num, size, alignment, offset);
@@ -900,6 +1003,9 @@ void* CrtPatch<CRTVersion, debug>::crtd_scalar_new (size_t size)
     new_t pcrtxxd_scalar_new = (new_t)data.pcrtd_scalar_new;
     assert(pcrtxxd_scalar_new);
 
+    if (!g_vld.trackingAllocs())
+        return pcrtxxd_scalar_new(size);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pcrtxxd_scalar_new, context_, debug, (CRTVersion >= 140));
     return pcrtxxd_scalar_new(size);
@@ -921,6 +1027,9 @@ void* CrtPatch<CRTVersion, debug>::crtd_vector_new (size_t size)
     new_t pcrtxxd_vector_new = (new_t)data.pcrtd_vector_new;
     assert(pcrtxxd_vector_new);
 
+    if (!g_vld.trackingAllocs())
+        return pcrtxxd_vector_new(size);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pcrtxxd_vector_new, context_, debug, (CRTVersion >= 140));
     return pcrtxxd_vector_new(size);
@@ -958,8 +1067,12 @@ void* MfcPatch<CRTVersion, debug>::mfcd__scalar_new_dbg_4p (size_t       size,
     new_dbg_crt_t pmfcxxd__new_dbg = (new_dbg_crt_t)data.pmfcd__scalar_new_dbg_4p;
     assert(pmfcxxd__new_dbg);
 
+    if (!g_vld.trackingAllocs())
+        return pmfcxxd__new_dbg(size, type, file, line);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pmfcxxd__new_dbg, context_, debug, (CRTVersion >= 140));
+    cc.SetBlockType(type);
     return pmfcxxd__new_dbg(size, type, file, line);
 }
 
@@ -986,6 +1099,9 @@ void* MfcPatch<CRTVersion, debug>::mfcd__scalar_new_dbg_3p (size_t       size,
     new_dbg_mfc_t pmfcxxd__new_dbg = (new_dbg_mfc_t)data.pmfcd__scalar_new_dbg_3p;
     assert(pmfcxxd__new_dbg);
 
+    if (!g_vld.trackingAllocs())
+        return pmfcxxd__new_dbg(size, file, line);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pmfcxxd__new_dbg, context_, debug, (CRTVersion >= 140));
     return pmfcxxd__new_dbg(size, file, line);
@@ -1017,8 +1133,12 @@ void* MfcPatch<CRTVersion, debug>::mfcd__vector_new_dbg_4p (size_t       size,
     new_dbg_crt_t pmfcxxd__new_dbg = (new_dbg_crt_t)data.pmfcd__vector_new_dbg_4p;
     assert(pmfcxxd__new_dbg);
 
+    if (!g_vld.trackingAllocs())
+        return pmfcxxd__new_dbg(size, type, file, line);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pmfcxxd__new_dbg, context_, debug, (CRTVersion >= 140));
+    cc.SetBlockType(type);
     return pmfcxxd__new_dbg(size, type, file, line);
 }
 
@@ -1045,6 +1165,9 @@ void* MfcPatch<CRTVersion, debug>::mfcd__vector_new_dbg_3p (size_t       size,
     new_dbg_mfc_t pmfcxxd__new_dbg = (new_dbg_mfc_t)data.pmfcd__vector_new_dbg_3p;
     assert(pmfcxxd__new_dbg);
 
+    if (!g_vld.trackingAllocs())
+        return pmfcxxd__new_dbg(size, file, line);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pmfcxxd__new_dbg, context_, debug, (CRTVersion >= 140));
     return pmfcxxd__new_dbg(size, file, line);
@@ -1066,6 +1189,9 @@ void* MfcPatch<CRTVersion, debug>::mfcd_scalar_new (size_t size)
     new_t pmfcxxd_new = (new_t)data.pmfcd_scalar_new;
     assert(pmfcxxd_new);
 
+    if (!g_vld.trackingAllocs())
+        return pmfcxxd_new(size);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pmfcxxd_new, context_, debug, (CRTVersion >= 140));
     return pmfcxxd_new(size);
@@ -1087,6 +1213,9 @@ void* MfcPatch<CRTVersion, debug>::mfcd_vector_new (size_t size)
     new_t pmfcxxd_new = (new_t)data.pmfcd_vector_new;
     assert(pmfcxxd_new);
 
+    if (!g_vld.trackingAllocs())
+        return pmfcxxd_new(size);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pmfcxxd_new, context_, debug, (CRTVersion >= 140));
     return pmfcxxd_new(size);
@@ -1118,8 +1247,12 @@ void* MfcPatch<CRTVersion, debug>::mfcud__scalar_new_dbg_4p (size_t      size,
     new_dbg_crt_t pmfcxxd__new_dbg = (new_dbg_crt_t)data.pmfcud__scalar_new_dbg_4p;
     assert(pmfcxxd__new_dbg);
 
+    if (!g_vld.trackingAllocs())
+        return pmfcxxd__new_dbg(size, type, file, line);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pmfcxxd__new_dbg, context_, debug, (CRTVersion >= 140));
+    cc.SetBlockType(type);
     return pmfcxxd__new_dbg(size, type, file, line);
 }
 
@@ -1146,6 +1279,9 @@ void* MfcPatch<CRTVersion, debug>::mfcud__scalar_new_dbg_3p (size_t      size,
     new_dbg_mfc_t pmfcxxd__new_dbg = (new_dbg_mfc_t)data.pmfcud__scalar_new_dbg_3p;
     assert(pmfcxxd__new_dbg);
 
+    if (!g_vld.trackingAllocs())
+        return pmfcxxd__new_dbg(size, file, line);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pmfcxxd__new_dbg, context_, debug, (CRTVersion >= 140));
     return pmfcxxd__new_dbg(size, file, line);
@@ -1177,8 +1313,12 @@ void* MfcPatch<CRTVersion, debug>::mfcud__vector_new_dbg_4p (size_t      size,
     new_dbg_crt_t pmfcxxd__new_dbg = (new_dbg_crt_t)data.pmfcud__vector_new_dbg_4p;
     assert(pmfcxxd__new_dbg);
 
+    if (!g_vld.trackingAllocs())
+        return pmfcxxd__new_dbg(size, type, file, line);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pmfcxxd__new_dbg, context_, debug, (CRTVersion >= 140));
+    cc.SetBlockType(type);
 
     return pmfcxxd__new_dbg(size, type, file, line);
 }
@@ -1206,6 +1346,9 @@ void* MfcPatch<CRTVersion, debug>::mfcud__vector_new_dbg_3p (size_t      size,
     new_dbg_mfc_t pmfcxxd__new_dbg = (new_dbg_mfc_t)data.pmfcud__vector_new_dbg_3p;
     assert(pmfcxxd__new_dbg);
 
+    if (!g_vld.trackingAllocs())
+        return pmfcxxd__new_dbg(size, file, line);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pmfcxxd__new_dbg, context_, debug, (CRTVersion >= 140));
     return pmfcxxd__new_dbg(size, file, line);
@@ -1227,6 +1370,9 @@ void* MfcPatch<CRTVersion, debug>::mfcud_scalar_new (size_t size)
     new_t pmfcxxd_new = (new_t)data.pmfcud_scalar_new;
     assert(pmfcxxd_new);
 
+    if (!g_vld.trackingAllocs())
+        return pmfcxxd_new(size);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pmfcxxd_new, context_, debug, (CRTVersion >= 140));
     return pmfcxxd_new(size);
@@ -1248,6 +1394,9 @@ void* MfcPatch<CRTVersion, debug>::mfcud_vector_new (size_t size)
     new_t pmfcxxd_new = (new_t)data.pmfcud_vector_new;
     assert(pmfcxxd_new);
 
+    if (!g_vld.trackingAllocs())
+        return pmfcxxd_new(size);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pmfcxxd_new, context_, debug, (CRTVersion >= 140));
     return pmfcxxd_new(size);
@@ -1300,6 +1449,174 @@ VS120d  VS120d::data;
 UCRT   UCRT::data;
 UCRTd  UCRTd::data;
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Release UCRT base heap functions
+//
+//   In the release UCRT, malloc, free and realloc are _malloc_base, _free_base
+//   and _realloc_base, which call HeapAlloc, HeapFree and HeapReAlloc on the
+//   CRT heap. Patched through to the generic CrtPatch functions, each call
+//   sets up a CaptureContext, and the heap hook in ucrtbase.dll then checks
+//   the TLS again to hand the block over to it. These functions make the heap
+//   call themselves instead, and record the block in one step. Whatever is
+//   out of the ordinary, such as a failure the new handler is to be called
+//   for, is left to the UCRT's own function.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// ucrtHeap - Obtains the heap the release UCRT allocates from.
+//
+//  - function (IN): Any function exported by ucrtbase.dll.
+//
+//  Return Value:
+//
+//    Returns the CRT heap, or NULL if it can't be obtained yet.
+//
+inline HANDLE ucrtHeap (LPCVOID function)
+{
+    static HANDLE heap = NULL;
+    if (heap == NULL) {
+        HMODULE ucrtbase = GetCallingModule((UINT_PTR)function);
+        _get_heap_handle_t pucrt_get_heap_handle = (ucrtbase == NULL) ? NULL :
+            (_get_heap_handle_t)GetProcAddress(ucrtbase, "_get_heap_handle");
+        if (pucrt_get_heap_handle != NULL)
+            heap = (HANDLE)pucrt_get_heap_handle();
+    }
+    return heap;
+}
+
+// crtd__malloc_base - Calls to malloc and _malloc_base from ucrtbase.dll are
+//   patched through to this function.
+//
+//  - size (IN): The size, in bytes, of the memory block to be allocated.
+//
+//  Return Value:
+//
+//    Returns the value returned by _malloc_base.
+//
+template<>
+inline void* UCRT::crtd__malloc_base (size_t size)
+{
+    PRINT_HOOKED_FUNCTION();
+    malloc_t pucrt_malloc_base = (malloc_t)((data.pcrtd__malloc_base != NULL) ? data.pcrtd__malloc_base : data.pcrtd_malloc);
+    assert(pucrt_malloc_base);
+
+    HANDLE heap = ucrtHeap(pucrt_malloc_base);
+    SIZE_T actualsize = (size != 0) ? size : 1;
+    LPVOID block = NULL;
+    if ((heap != NULL) && (size <= _HEAP_MAXREQUEST))
+        block = HeapAlloc(heap, 0, actualsize);
+    if (block == NULL) {
+        // The UCRT calls the new handler, or sets errno.
+        CAPTURE_CONTEXT();
+        CaptureContext cc((void*)pucrt_malloc_base, context_, FALSE, TRUE);
+        return pucrt_malloc_base(size);
+    }
+
+    if (!g_vld.trackingAllocs() || g_vld.untrackedSize(actualsize) || g_vld.isIgnoredHeap(heap))
+        return block;
+    tls_t* tls = g_vld.enabledTls();
+    if (tls == NULL)
+        return block;
+
+    if (!g_DbgHelp.IsLockedByCurrentThread() && // skip dbghelp.dll calls
+        !CaptureContext::RecordNested(tls, heap, block, NULL, actualsize)) {
+        CAPTURE_CONTEXT();
+        CaptureContext cc((void*)pucrt_malloc_base, context_, tls, FALSE, TRUE);
+        cc.Set(heap, block, NULL, actualsize);
+    }
+    return block;
+}
+
+// crtd__free_base - Calls to free and _free_base from ucrtbase.dll are patched
+//   through to this function.
+//
+//  - mem (IN): Pointer to the memory block to be freed.
+//
+//  Return Value:
+//
+//    None.
+//
+template<>
+inline void UCRT::crtd__free_base (void *mem)
+{
+    PRINT_HOOKED_FUNCTION();
+    free_t pucrt_free_base = (free_t)((data.pcrtd__free_base != NULL) ? data.pcrtd__free_base : data.pcrtd_free);
+    assert(pucrt_free_base);
+
+    HANDLE heap = ucrtHeap(pucrt_free_base);
+    if ((heap == NULL) || (mem == NULL)) {
+        pucrt_free_base(mem);
+        return;
+    }
+
+    if (g_vld.trackingFrees() &&
+        !g_DbgHelp.IsLockedByCurrentThread() && // skip dbghelp.dll calls
+        !g_vld.isIgnoredHeap(heap)) // nothing from ignored heaps is mapped
+    {
+        // Record the current frame pointer.
+        CAPTURE_CONTEXT();
+        context_.func = reinterpret_cast<UINT_PTR>(pucrt_free_base);
+
+        // Unmap the block from the CRT heap.
+        g_vld.unmapBlock(heap, mem, context_);
+    }
+
+    if (!HeapFree(heap, 0, mem)) {
+        // Like _free_base, set errno from the heap's error.
+        DWORD error = GetLastError();
+        _dosmaperr_t pucrt_dosmaperr = (_dosmaperr_t)GetProcAddress(GetCallingModule((UINT_PTR)pucrt_free_base),
+            "_dosmaperr");
+        if (pucrt_dosmaperr != NULL)
+            pucrt_dosmaperr(error);
+    }
+}
+
+// crtd__realloc_base - Calls to realloc and _realloc_base from ucrtbase.dll
+//   are patched through to this function.
+//
+//  - mem (IN): Pointer to the memory block to be reallocated.
+//
+//  - size (IN): The new size, in bytes, of the memory block.
+//
+//  Return Value:
+//
+//    Returns the value returned by _realloc_base.
+//
+template<>
+inline void* UCRT::crtd__realloc_base (void *mem, size_t size)
+{
+    PRINT_HOOKED_FUNCTION();
+    realloc_t pucrt_realloc_base = (realloc_t)((data.pcrtd__realloc_base != NULL) ? data.pcrtd__realloc_base : data.pcrtd_realloc);
+    assert(pucrt_realloc_base);
+
+    // Reallocating nothing allocates, and reallocating to nothing frees; both
+    // are left to the UCRT, as are requests it's to fail.
+    HANDLE heap = ucrtHeap(pucrt_realloc_base);
+    LPVOID newmem = NULL;
+    if ((heap != NULL) && (mem != NULL) && (size != 0) && (size <= _HEAP_MAXREQUEST))
+        newmem = HeapReAlloc(heap, 0, mem, size);
+    if (newmem == NULL) {
+        CAPTURE_CONTEXT();
+        CaptureContext cc((void*)pucrt_realloc_base, context_, FALSE, TRUE);
+        return pucrt_realloc_base(mem, size);
+    }
+
+    if (!g_vld.trackingAllocs() || g_vld.isIgnoredHeap(heap))
+        return newmem;
+    tls_t* tls = g_vld.enabledTls();
+    if (tls == NULL)
+        return newmem;
+
+    if (!g_DbgHelp.IsLockedByCurrentThread() && // skip dbghelp.dll calls
+        !CaptureContext::RecordNested(tls, heap, mem, newmem, size)) {
+        CAPTURE_CONTEXT();
+        CaptureContext cc((void*)pucrt_realloc_base, context_, tls, FALSE, TRUE);
+        cc.Set(heap, mem, newmem, size);
+    }
+    return newmem;
+}
+
 
 // Visual Studio 6.0
 typedef MfcPatch<60>        Mfc60;
@@ -9,6 +9,7 @@ class DbgHelp
 {
 public:
     DbgHelp() {
+        m_initializer = NULL;
         m_lock.Initialize();
     }
     ~DbgHelp() {
@@ -26,6 +27,18 @@ public:
         return
             m_lock.IsLockedByCurrentThread();
     }
+    void Profile(lockprofile_t *profile)
+    {
+        m_lock.Profile(profile);
+    }
+    // Defers the symbol handler's initialization to the first call which
+    // needs symbols. The initializer is called once, with the lock held, and
+    // initializes it with the lock-taking SymSetOptions and SymInitializeW.
+    void DeferInitialize(void (*initializer)())
+    {
+        CriticalSectionLocker<CriticalSection> cs(m_lock);
+        m_initializer = initializer;
+    }
     BOOL SymInitializeW(_In_ HANDLE hProcess, _In_opt_ PCWSTR UserSearchPath, _In_ BOOL fInvadeProcess, CriticalSectionLocker<DbgHelp>&) {
         return ::SymInitializeW(hProcess, UserSearchPath, fInvadeProcess);
     }
@@ -34,12 +47,28 @@ public:
         return ::SymInitializeW(hProcess, UserSearchPath, fInvadeProcess);
     }
     BOOL SymCleanup(_In_ HANDLE hProcess, CriticalSectionLocker<DbgHelp>&) {
+        if (m_initializer != NULL) {
+            // Never initialized, and now it never will be.
+            m_initializer = NULL;
+            return TRUE;
+        }
         return ::SymCleanup(hProcess);
     }
     BOOL SymCleanup(_In_ HANDLE hProcess) {
         CriticalSectionLocker<CriticalSection> cs(m_lock);
+        if (m_initializer != NULL) {
+            m_initializer = NULL;
+            return TRUE;
+        }
         return ::SymCleanup(hProcess);
     }
+    BOOL SymRegisterCallbackW64(_In_ HANDLE hProcess, _In_ PSYMBOL_REGISTERED_CALLBACK64 CallbackFunction, _In_ ULONG64 UserContext, CriticalSectionLocker<DbgHelp>&) {
+        return ::SymRegisterCallbackW64(hProcess, CallbackFunction, UserContext);
+    }
+    BOOL SymRegisterCallbackW64(_In_ HANDLE hProcess, _In_ PSYMBOL_REGISTERED_CALLBACK64 CallbackFunction, _In_ ULONG64 UserContext) {
+        CriticalSectionLocker<CriticalSection> cs(m_lock);
+        return ::SymRegisterCallbackW64(hProcess, CallbackFunction, UserContext);
+    }
     DWORD SymSetOptions(__in DWORD SymOptions, CriticalSectionLocker<DbgHelp>&) {
         return ::SymSetOptions(SymOptions);
     }
@@ -48,31 +77,39 @@ public:
         return ::SymSetOptions(SymOptions);
     }
     BOOL SymFromAddrW(_In_ HANDLE hProcess, _In_ DWORD64 Address, _Out_opt_ PDWORD64 Displacement, _Inout_ PSYMBOL_INFOW Symbol, CriticalSectionLocker<DbgHelp>&) {
+        initialize();
         return ::SymFromAddrW(hProcess, Address, Displacement, Symbol);
     }
     BOOL SymFromAddrW(_In_ HANDLE hProcess, _In_ DWORD64 Address, _Out_opt_ PDWORD64 Displacement, _Inout_ PSYMBOL_INFOW Symbol) {
         CriticalSectionLocker<CriticalSection> cs(m_lock);
+        initialize();
         return ::SymFromAddrW(hProcess, Address, Displacement, Symbol);
     }
     BOOL SymGetLineFromAddrW64(_In_ HANDLE hProcess, _In_ DWORD64 dwAddr, _Out_ PDWORD pdwDisplacement, _Out_ PIMAGEHLP_LINEW64 Line, CriticalSectionLocker<DbgHelp>&) {
+        initialize();
         return ::SymGetLineFromAddrW64(hProcess, dwAddr, pdwDisplacement, Line);
     }
     BOOL SymGetLineFromAddrW64(_In_ HANDLE hProcess, _In_ DWORD64 dwAddr, _Out_ PDWORD pdwDisplacement, _Out_ PIMAGEHLP_LINEW64 Line) {
         CriticalSectionLocker<CriticalSection> cs(m_lock);
+        initialize();
         return ::SymGetLineFromAddrW64(hProcess, dwAddr, pdwDisplacement, Line);
     }
     BOOL SymGetModuleInfoW64(_In_ HANDLE hProcess, _In_ DWORD64 qwAddr, _Out_ PIMAGEHLP_MODULEW64 ModuleInfo, CriticalSectionLocker<DbgHelp>&) {
+        initialize();
         return ::SymGetModuleInfoW64(hProcess, qwAddr, ModuleInfo);
     }
     BOOL SymGetModuleInfoW64(_In_ HANDLE hProcess, _In_ DWORD64 qwAddr, _Out_ PIMAGEHLP_MODULEW64 ModuleInfo) {
         CriticalSectionLocker<CriticalSection> cs(m_lock);
+        initialize();
         return ::SymGetModuleInfoW64(hProcess, qwAddr, ModuleInfo);
     }
     DWORD64 SymLoadModuleExW(_In_ HANDLE hProcess, _In_opt_ HANDLE hFile, _In_opt_ PCWSTR ImageName, _In_opt_ PCWSTR ModuleName, _In_ DWORD64 BaseOfDll, _In_ DWORD DllSize, _In_opt_ PMODLOAD_DATA Data, _In_opt_ DWORD Flags, CriticalSectionLocker<DbgHelp>&) {
+        initialize();
         return ::SymLoadModuleExW(hProcess, hFile, ImageName, ModuleName, BaseOfDll, DllSize, Data, Flags);
     }
     DWORD64 SymLoadModuleExW(_In_ HANDLE hProcess, _In_opt_ HANDLE hFile, _In_opt_ PCWSTR ImageName, _In_opt_ PCWSTR ModuleName, _In_ DWORD64 BaseOfDll, _In_ DWORD DllSize, _In_opt_ PMODLOAD_DATA Data, _In_opt_ DWORD Flags) {
         CriticalSectionLocker<CriticalSection> cs(m_lock);
+        initialize();
         return ::SymLoadModuleExW(hProcess, hFile, ImageName, ModuleName, BaseOfDll, DllSize, Data, Flags);
     }
     BOOL SymUnloadModule64(_In_ HANDLE hProcess, _In_ DWORD64 BaseOfDll, CriticalSectionLocker<DbgHelp>&) {
@@ -82,6 +119,15 @@ public:
         CriticalSectionLocker<CriticalSection> cs(m_lock);
         return ::SymUnloadModule64(hProcess, BaseOfDll);
     }
+    BOOL SymEnumSymbolsW(_In_ HANDLE hProcess, _In_ ULONG64 BaseOfDll, _In_opt_ PCWSTR Mask, _In_ PSYM_ENUMERATESYMBOLS_CALLBACKW EnumSymbolsCallback, _In_opt_ PVOID UserContext, CriticalSectionLocker<DbgHelp>&) {
+        initialize();
+        return ::SymEnumSymbolsW(hProcess, BaseOfDll, Mask, EnumSymbolsCallback, UserContext);
+    }
+    BOOL SymEnumSymbolsW(_In_ HANDLE hProcess, _In_ ULONG64 BaseOfDll, _In_opt_ PCWSTR Mask, _In_ PSYM_ENUMERATESYMBOLS_CALLBACKW EnumSymbolsCallback, _In_opt_ PVOID UserContext) {
+        CriticalSectionLocker<CriticalSection> cs(m_lock);
+        initialize();
+        return ::SymEnumSymbolsW(hProcess, BaseOfDll, Mask, EnumSymbolsCallback, UserContext);
+    }
     BOOL StackWalk64(__in DWORD MachineType, __in HANDLE hProcess, __in HANDLE hThread,
         __inout LPSTACKFRAME64 StackFrame, __inout PVOID ContextRecord,
         __in_opt PREAD_PROCESS_MEMORY_ROUTINE64 ReadMemoryRoutine,
@@ -89,6 +135,7 @@ public:
         __in_opt PGET_MODULE_BASE_ROUTINE64 GetModuleBaseRoutine,
         __in_opt PTRANSLATE_ADDRESS_ROUTINE64 TranslateAddress, CriticalSectionLocker<DbgHelp>&)
     {
+        initialize();
         return ::StackWalk64(MachineType, hProcess, hThread, StackFrame, ContextRecord, ReadMemoryRoutine,
             FunctionTableAccessRoutine, GetModuleBaseRoutine, TranslateAddress);
     }
@@ -100,16 +147,36 @@ public:
         __in_opt PTRANSLATE_ADDRESS_ROUTINE64 TranslateAddress)
     {
         CriticalSectionLocker<CriticalSection> cs(m_lock);
+        initialize();
         return ::StackWalk64(MachineType, hProcess, hThread, StackFrame, ContextRecord, ReadMemoryRoutine,
             FunctionTableAccessRoutine, GetModuleBaseRoutine, TranslateAddress);
     }
+    BOOL MiniDumpWriteDump(_In_ HANDLE hProcess, _In_ DWORD ProcessId, _In_ HANDLE hFile, _In_ MINIDUMP_TYPE DumpType,
+        _In_opt_ PMINIDUMP_EXCEPTION_INFORMATION ExceptionParam, _In_opt_ PMINIDUMP_USER_STREAM_INFORMATION UserStreamParam,
+        _In_opt_ PMINIDUMP_CALLBACK_INFORMATION CallbackParam)
+    {
+        CriticalSectionLocker<CriticalSection> cs(m_lock);
+        return ::MiniDumpWriteDump(hProcess, ProcessId, hFile, DumpType, ExceptionParam, UserStreamParam, CallbackParam);
+    }
 private:
     // Disallow certain operations
     DbgHelp(const DbgHelp&);
     DbgHelp& operator=(const DbgHelp&);
 
+    // Runs the deferred initialization, if it hasn't run yet. The caller
+    // holds the lock.
+    void initialize()
+    {
+        if (m_initializer == NULL)
+            return;
+        void (*initializer)() = m_initializer;
+        m_initializer = NULL;
+        initializer();
+    }
+
 private:
     CriticalSection m_lock;
+    void          (*m_initializer)(); // The deferred initialization, until it runs.
 };
 
 class ImageDirectoryEntries
@@ -133,6 +200,10 @@ public:
         return
             m_lock.IsLockedByCurrentThread();
     }
+    void Profile(lockprofile_t *profile)
+    {
+        m_lock.Profile(profile);
+    }
     PVOID ImageDirectoryEntryToDataEx(__in PVOID Base, __in BOOLEAN MappedAsImage, __in USHORT DirectoryEntry, __out PULONG Size, __out_opt PIMAGE_SECTION_HEADER *FoundHeader) {
         CriticalSectionLocker<CriticalSection> cs(m_lock);
         return ::ImageDirectoryEntryToDataEx(Base, MappedAsImage, DirectoryEntry, Size, FoundHeader);
@@ -167,6 +238,10 @@ public:
         return
             m_lock.IsLockedByCurrentThread();
     }
+    void Profile(lockprofile_t *profile)
+    {
+        m_lock.Profile(profile);
+    }
     BOOL EnumerateLoadedModulesW64(__in HANDLE hProcess, __in PENUMLOADED_MODULES_CALLBACKW64 EnumLoadedModulesCallback, __in_opt PVOID UserContext) {
         CriticalSectionLocker<CriticalSection> cs(m_lock);
         return ::EnumerateLoadedModulesW64(hProcess, EnumLoadedModulesCallback, UserContext);
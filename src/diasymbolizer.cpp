@@ -0,0 +1,227 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - DiaSymbolizer Class Implementation
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+
+#include "stdafx.h"
+#define VLDBUILD
+#include <dia2.h>           // Provides the Debug Interface Access SDK.
+#include "diasymbolizer.h"  // This class' header.
+#include "vldheap.h"        // Provides internal new and delete operators.
+
+static IClassFactory *s_diaFactory = NULL; // Creates DIA data sources, or NULL if msdia140.dll wasn't loaded.
+static bool           s_diaLoaded = false; // Set once loading msdia140.dll has been attempted.
+
+// copyString - Copies a string returned by DIA, and frees it.
+//
+//  - string (IN): The string, or NULL.
+//
+//  Return Value:
+//
+//    Returns the copy, allocated with new [], or NULL.
+//
+static LPWSTR copyString (BSTR string)
+{
+    if (string == NULL)
+        return NULL;
+    size_t length = wcslen(string) + 1;
+    LPWSTR copy = new WCHAR [length];
+    wcscpy_s(copy, length, string);
+    SysFreeString(string);
+    return copy;
+}
+
+// Constructor - Initializes a DiaSymbolizer which hasn't opened any session
+//   yet.
+//
+//  - searchPath (IN): Where the PDBs are looked for, as dbghelp's symbol
+//      search path. It must outlive the DiaSymbolizer.
+//
+DiaSymbolizer::DiaSymbolizer (LPCWSTR searchPath)
+    : m_searchPath(searchPath), m_sessionCount(0)
+{
+}
+
+// Destructor - Closes the sessions.
+//
+DiaSymbolizer::~DiaSymbolizer ()
+{
+    for (UINT32 index = 0; index < m_sessionCount; index++) {
+        if (m_sessions[index].session != NULL)
+            m_sessions[index].session->Release();
+        if (m_sessions[index].source != NULL)
+            m_sessions[index].source->Release();
+    }
+}
+
+// Load - Loads msdia140.dll, the first time it is called. Called by the
+//   reporting thread, before any DiaSymbolizer is used.
+//
+//  Return Value:
+//
+//    Returns true if DIA is available.
+//
+bool DiaSymbolizer::Load ()
+{
+    if (s_diaLoaded)
+        return (s_diaFactory != NULL);
+    s_diaLoaded = true;
+
+    // Prefer the copy next to VLD.
+    HMODULE msdia = NULL;
+    HMODULE vld = NULL;
+    WCHAR   path [MAX_PATH] = {0};
+    if (GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+            (LPCWSTR)&s_diaFactory, &vld) && (GetModuleFileNameW(vld, path, MAX_PATH) != 0)) {
+        LPWSTR name = wcsrchr(path, L'\\');
+        if (name != NULL) {
+            wcsncpy_s(name + 1, MAX_PATH - (name + 1 - path), L"msdia140.dll", _TRUNCATE);
+            msdia = LoadLibraryW(path);
+        }
+    }
+    if (msdia == NULL)
+        msdia = LoadLibraryW(L"msdia140.dll");
+    if (msdia == NULL)
+        return false;
+
+    LPFNGETCLASSOBJECT getclassobject = (LPFNGETCLASSOBJECT)GetProcAddress(msdia, "DllGetClassObject");
+    if ((getclassobject == NULL) ||
+        FAILED(getclassobject(__uuidof(DiaSource), __uuidof(IClassFactory), (LPVOID*)&s_diaFactory))) {
+        s_diaFactory = NULL;
+        FreeLibrary(msdia);
+        return false;
+    }
+    return true;
+}
+
+// Resolve - Resolves a program counter.
+//
+//  - imagePath (IN): The image the program counter is within.
+//
+//  - rva (IN): The program counter's offset within the image.
+//
+//  - symbol (OUT): Receives what is known about the program counter.
+//
+//  Return Value:
+//
+//    Returns false if neither a function nor a public symbol was found, in
+//    which case the program counter is left to dbghelp.
+//
+bool DiaSymbolizer::Resolve (LPCWSTR imagePath, UINT32 rva, diasymbol_t &symbol)
+{
+    IDiaSession *diasession = session(imagePath);
+    if (diasession == NULL)
+        return false;
+
+    BSTR name = NULL;
+    DWORD start = 0;
+    IDiaSymbol *function = NULL;
+    if ((diasession->findSymbolByRVA(rva, SymTagFunction, &function) == S_OK) && (function != NULL)) {
+        if ((function->get_name(&name) != S_OK) || (function->get_relativeVirtualAddress(&start) != S_OK)) {
+            SysFreeString(name);
+            name = NULL;
+        }
+        function->Release();
+    }
+    if (name == NULL) {
+        // Without private symbols, the nearest public symbol will do, as it
+        // does for dbghelp.
+        function = NULL;
+        LONG displacement = 0;
+        if ((diasession->findSymbolByRVAEx(rva, SymTagPublicSymbol, &function, &displacement) == S_OK) &&
+            (function != NULL)) {
+            if ((function->get_undecoratedNameEx(UNDNAME_NAME_ONLY, &name) != S_OK) || (name == NULL))
+                function->get_name(&name);
+            start = rva - displacement;
+            function->Release();
+        }
+    }
+    if (name == NULL)
+        return false;
+
+    symbol.functionName = copyString(name);
+    symbol.displacement = rva - start;
+    symbol.fileName = NULL;
+    symbol.lineNumber = 0;
+    symbol.lineDisplacement = 0;
+
+    IDiaEnumLineNumbers *lines = NULL;
+    if ((diasession->findLinesByRVA(rva, 1, &lines) == S_OK) && (lines != NULL)) {
+        IDiaLineNumber *line = NULL;
+        ULONG fetched = 0;
+        if ((lines->Next(1, &line, &fetched) == S_OK) && (fetched == 1)) {
+            IDiaSourceFile *file = NULL;
+            DWORD linenumber = 0;
+            DWORD linestart = 0;
+            BSTR filename = NULL;
+            if ((line->get_lineNumber(&linenumber) == S_OK) && (line->get_relativeVirtualAddress(&linestart) == S_OK) &&
+                (line->get_sourceFile(&file) == S_OK) && (file != NULL) && (file->get_fileName(&filename) == S_OK)) {
+                symbol.fileName = copyString(filename);
+                symbol.lineNumber = linenumber;
+                symbol.lineDisplacement = rva - linestart;
+            }
+            if (file != NULL)
+                file->Release();
+            line->Release();
+        }
+        lines->Release();
+    }
+    return true;
+}
+
+// session - Obtains the session of a module, opening it the first time the
+//   module is looked up.
+//
+//  - imagePath (IN): The module's image.
+//
+//  Return Value:
+//
+//    Returns the session, or NULL if the module's PDB couldn't be loaded.
+//
+IDiaSession* DiaSymbolizer::session (LPCWSTR imagePath)
+{
+    for (UINT32 index = 0; index < m_sessionCount; index++) {
+        if (m_sessions[index].imagePath == imagePath)
+            return m_sessions[index].session;
+    }
+    if ((m_sessionCount == DIASYMBOLIZER_SESSIONS) || (s_diaFactory == NULL))
+        return NULL;
+
+    // Modules whose PDB can't be loaded are remembered as such too, so that
+    // it isn't looked for again.
+    session_t &entry = m_sessions[m_sessionCount++];
+    entry.imagePath = imagePath;
+    entry.source = NULL;
+    entry.session = NULL;
+    if (FAILED(s_diaFactory->CreateInstance(NULL, __uuidof(IDiaDataSource), (LPVOID*)&entry.source))) {
+        entry.source = NULL;
+        return NULL;
+    }
+    if (FAILED(entry.source->loadDataForExe(imagePath, m_searchPath, NULL)) ||
+        FAILED(entry.source->openSession(&entry.session))) {
+        entry.session = NULL;
+        entry.source->Release();
+        entry.source = NULL;
+        return NULL;
+    }
+    return entry.session;
+}
@@ -0,0 +1,95 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - DiaSymbolizer Class Definition
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+
+#pragma once
+
+#ifndef VLDBUILD
+#error \
+    "This header should only be included by Visual Leak Detector when building it from source. \
+    Applications should never include this header."
+#endif
+
+#include <windows.h>
+
+struct IDiaDataSource;
+struct IDiaSession;
+
+#define DIASYMBOLIZER_SESSIONS 64 // Most modules a DiaSymbolizer keeps a session open for.
+
+// What a DiaSymbolizer found out about a program counter. The strings are
+// allocated with new [], and are the caller's to free.
+struct diasymbol_t {
+    LPWSTR  functionName;     // Name of the function containing the address.
+    DWORD64 displacement;     // Offset of the address from the start of the function.
+    LPWSTR  fileName;         // Source file containing the address, or NULL if unknown.
+    DWORD   lineNumber;       // Source line containing the address.
+    DWORD   lineDisplacement; // Offset of the address from the start of the line.
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The DiaSymbolizer Class
+//
+//    dbghelp is single-threaded, so everything VLD asks it is serialized by
+//    the DbgHelp lock, and resolving the call stacks of a large report uses
+//    one core however many report threads there are. A DiaSymbolizer
+//    resolves program counters with the Debug Interface Access SDK instead
+//    (msdia140.dll, which ships with Visual Studio): each thread has its own
+//    DiaSymbolizer, with its own DIA session per module, so threads resolve
+//    side by side without any lock. The results go into the SymbolCache,
+//    where the reporting thread finds them (see symbolizeInParallel).
+//
+//    msdia140.dll is created from directly, through DllGetClassObject, so it
+//    needn't be registered. It is looked for next to VLD first.
+//
+//    Only what dbghelp would say is asked for: the function containing the
+//    address, or the public symbol preceding it, and the line. Addresses DIA
+//    can't resolve are left to dbghelp.
+//
+class DiaSymbolizer
+{
+public:
+    DiaSymbolizer (LPCWSTR searchPath);
+    ~DiaSymbolizer ();
+
+    static bool Load ();
+    bool Resolve (LPCWSTR imagePath, UINT32 rva, diasymbol_t &symbol);
+
+private:
+    // Don't allow this!!
+    DiaSymbolizer (const DiaSymbolizer &other);
+    DiaSymbolizer& operator = (const DiaSymbolizer &other);
+
+    struct session_t {
+        LPCWSTR         imagePath; // The module's image, as ModuleImages has it.
+        IDiaDataSource *source;    // The module's PDB, or NULL if it couldn't be loaded.
+        IDiaSession    *session;
+    };
+
+    IDiaSession* session (LPCWSTR imagePath);
+
+    LPCWSTR   m_searchPath;                         // Where the PDBs are looked for.
+    session_t m_sessions [DIASYMBOLIZER_SESSIONS];  // The modules looked up so far.
+    UINT32    m_sessionCount;
+};
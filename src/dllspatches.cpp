@@ -73,7 +73,7 @@ patchentry_t VisualLeakDetector::m_kernel32Patch [] = {
 };
 
 #define ORDINAL(x)          (LPCSTR)x
-#if !defined(_M_X64)
+#if !defined(_WIN64)
 #define ORDINAL2(x86, x64)  (LPCSTR)x86
 #else
 #define ORDINAL2(x86, x64)  (LPCSTR)x64
@@ -81,6 +81,8 @@ patchentry_t VisualLeakDetector::m_kernel32Patch [] = {
 
 GetProcAddress_t VisualLeakDetector::m_GetProcAddress = NULL;
 GetProcAddressForCaller_t VisualLeakDetector::m_GetProcAddressForCaller = NULL;
+GetThreadDescription_t VisualLeakDetector::m_GetThreadDescription = NULL;
+NtQueryInformationThread_t VisualLeakDetector::m_NtQueryInformationThread = NULL;
 GetProcessHeap_t VisualLeakDetector::m_GetProcessHeap = NULL;
 HeapCreate_t VisualLeakDetector::m_HeapCreate = NULL;
 HeapFree_t VisualLeakDetector::m_HeapFree = NULL;
@@ -714,8 +716,12 @@ static patchentry_t ucrtbasePatch[] = {
     scalar_new_dbg_name,  &UCRT::data.pcrtd__scalar_new_dbg,   UCRT::crtd__scalar_new_dbg,
     vector_new_dbg_name,  &UCRT::data.pcrtd__vector_new_dbg,   UCRT::crtd__vector_new_dbg,
     "calloc",             &UCRT::data.pcrtd_calloc,            UCRT::crtd_calloc,
-    "malloc",             &UCRT::data.pcrtd_malloc,            UCRT::crtd_malloc,
-    "realloc",            &UCRT::data.pcrtd_realloc,           UCRT::crtd_realloc,
+    "free",               &UCRT::data.pcrtd_free,              UCRT::crtd__free_base,
+    "malloc",             &UCRT::data.pcrtd_malloc,            UCRT::crtd__malloc_base,
+    "realloc",            &UCRT::data.pcrtd_realloc,           UCRT::crtd__realloc_base,
+    "_free_base",         &UCRT::data.pcrtd__free_base,        UCRT::crtd__free_base,
+    "_malloc_base",       &UCRT::data.pcrtd__malloc_base,      UCRT::crtd__malloc_base,
+    "_realloc_base",      &UCRT::data.pcrtd__realloc_base,     UCRT::crtd__realloc_base,
     "_recalloc",          &UCRT::data.pcrtd_recalloc,          UCRT::crtd__recalloc,
     "_strdup",            &UCRT::data.pcrtd__strdup,           UCRT::crtd__strdup,
     "_wcsdup",            &UCRT::data.pcrtd__wcsdup,           UCRT::crtd__wcsdup,
@@ -776,6 +782,14 @@ patchentry_t VisualLeakDetector::m_ole32Patch [] = {
     NULL,                 NULL, NULL
 };
 
+// Every patch table is a constant initializer: the compiler lays them out, so
+// nothing is filled in at startup but the module base addresses, which are
+// only known once the modules are loaded. For the same reason, the index
+// _GetProcAddress looks imports up in can't be hashed at compile time: it is
+// keyed by module base and rebuilt when the loaded modules change (see
+// publishPatchIndex). The hooks call the original functions through the
+// named slots of the CrtPatch and MfcPatch "data" objects, which are loads at
+// offsets fixed at compile time.
 moduleentry_t VisualLeakDetector::m_patchTable [] = {
     // Win32 heap APIs.
     "kernel32.dll", FALSE,  0x0, m_kernelbasePatch, // we patch this record on Win7 and higher
@@ -0,0 +1,489 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - EtwHeapSession Class Implementation
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#define VLDBUILD
+#include "etwsession.h" // This class' header.
+#include "callstack.h"  // Provides the CallStack and CallStackTable classes.
+#include "vldheap.h"    // Provides internal new and delete operators.
+#include "vldint.h"     // Provides access to the Visual Leak Detector internals.
+
+// Imported global variables.
+extern CallStackTable     g_callStackTable;
+extern HANDLE             g_vldHeap;
+extern VisualLeakDetector g_vld;
+
+// The heap trace provider, which is also the class of its (MOF) events.
+static const GUID HeapProviderGuid =
+    { 0x222962ab, 0x6180, 0x4b88, { 0xa8, 0x25, 0x34, 0x6b, 0x75, 0xf2, 0xa2, 0x4a } };
+
+// Event types (opcodes) of the heap trace provider.
+#define HEAPEVENT_CREATE  32 // HeapHandle, Flags, ...
+#define HEAPEVENT_ALLOC   33 // HeapHandle, AllocSize, AllocAddress, SourceId
+#define HEAPEVENT_REALLOC 34 // HeapHandle, NewAllocAddress, OldAllocAddress, NewAllocSize, OldAllocSize, SourceId
+#define HEAPEVENT_DESTROY 35 // HeapHandle
+#define HEAPEVENT_FREE    36 // HeapHandle, FreeAddress, SourceId
+
+// TraceSetInformation (Windows 8 and later), which asks for the call stacks of
+// classic events.
+typedef ULONG (WINAPI *TraceSetInformation_t) (TRACEHANDLE, TRACE_INFO_CLASS, PVOID, ULONG);
+
+// readFields - Reads the leading pointer-sized fields of a heap event. They are
+//   as wide as pointers are in the process that logged the event.
+//
+//  - record (IN): The event.
+//
+//  - fields (OUT): Receives the fields.
+//
+//  - count (IN): Number of fields to read.
+//
+//  Return Value:
+//
+//    Returns TRUE if the event holds that many fields; otherwise FALSE.
+//
+static BOOL readFields (const EVENT_RECORD *record, UINT_PTR fields [], UINT count)
+{
+    UINT width = (record->EventHeader.Flags & EVENT_HEADER_FLAG_32_BIT_HEADER) ? sizeof(ULONG) : sizeof(ULONG64);
+    if (record->UserDataLength < count * width)
+        return FALSE;
+
+    const BYTE *data = (const BYTE*)record->UserData;
+    for (UINT index = 0; index < count; index++) {
+        fields[index] = (width == sizeof(ULONG)) ? (UINT_PTR)((const ULONG*)data)[index] :
+            (UINT_PTR)((const ULONG64*)data)[index];
+    }
+    return TRUE;
+}
+
+// Constructor - Initializes a session which isn't started.
+//
+EtwHeapSession::EtwHeapSession ()
+{
+    m_properties = NULL;
+    m_session    = 0;
+    m_trace      = INVALID_PROCESSTRACE_HANDLE;
+    m_consumer   = NULL;
+    m_consumerId = 0;
+    m_finished   = NULL;
+    m_discard    = FALSE;
+    m_error      = ERROR_SUCCESS;
+    m_highestAddress = 0;
+    m_threads    = NULL;
+}
+
+// Destructor - Nothing is freed here: the session lives on VLD's private heap,
+//   which is gone by the time this runs, so VLD stops it before that.
+//
+EtwHeapSession::~EtwHeapSession ()
+{
+}
+
+// Start - Starts the session, enables the heap trace provider for this
+//   process and starts the consumer thread. The consumer thread only starts
+//   consuming once the caller releases the loader lock; by then VLD is
+//   attached to the loaded modules.
+//
+//  Return Value:
+//
+//    Returns TRUE if the session has been started. Otherwise returns FALSE,
+//    and LastError tells why.
+//
+BOOL EtwHeapSession::Start ()
+{
+    SYSTEM_INFO systeminfo;
+    GetSystemInfo(&systeminfo);
+    m_highestAddress = (UINT_PTR)systeminfo.lpMaximumApplicationAddress;
+
+    m_properties = (EVENT_TRACE_PROPERTIES*)new BYTE [sizeof(EVENT_TRACE_PROPERTIES) + ETWSESSION_NAME_LENGTH * sizeof(WCHAR)];
+    LPWSTR name = (LPWSTR)((BYTE*)m_properties + sizeof(EVENT_TRACE_PROPERTIES));
+    swprintf_s(name, ETWSESSION_NAME_LENGTH, L"Visual Leak Detector %lu", GetCurrentProcessId());
+
+    resetProperties();
+    ULONG status = StartTraceW(&m_session, name, m_properties);
+    if (status == ERROR_ALREADY_EXISTS) {
+        // Left over by an earlier process with the same ID, which crashed.
+        resetProperties();
+        ControlTraceW(0, name, m_properties, EVENT_TRACE_CONTROL_STOP);
+        resetProperties();
+        status = StartTraceW(&m_session, name, m_properties);
+    }
+    if (status != ERROR_SUCCESS) {
+        m_error = status;
+        m_session = 0;
+        delete [] (BYTE*)m_properties;
+        m_properties = NULL;
+        return FALSE;
+    }
+
+    // Classic events only come with call stacks when they are asked for by
+    // type; those of allocations are all that is needed.
+    TraceSetInformation_t TraceSetInformation =
+        (TraceSetInformation_t)GetProcAddress(GetModuleHandleW(L"advapi32.dll"), "TraceSetInformation");
+    if (TraceSetInformation != NULL) {
+        CLASSIC_EVENT_ID stackevents [2];
+        ZeroMemory(stackevents, sizeof(stackevents));
+        stackevents[0].EventGuid = HeapProviderGuid;
+        stackevents[0].Type = HEAPEVENT_ALLOC;
+        stackevents[1].EventGuid = HeapProviderGuid;
+        stackevents[1].Type = HEAPEVENT_REALLOC;
+        TraceSetInformation(m_session, TraceStackTracingInfo, stackevents, sizeof(stackevents));
+    }
+
+    // Only this process's heap events are wanted. Windows versions which
+    // can't filter by process ID ignore the whole filter, so the events of
+    // other processes are dropped by the consumer as well.
+    DWORD processid = GetCurrentProcessId();
+    EVENT_FILTER_DESCRIPTOR filter;
+    filter.Ptr  = (ULONGLONG)&processid;
+    filter.Size = sizeof(processid);
+    filter.Type = EVENT_FILTER_TYPE_PID;
+    ENABLE_TRACE_PARAMETERS parameters;
+    ZeroMemory(&parameters, sizeof(parameters));
+    parameters.Version = ENABLE_TRACE_PARAMETERS_VERSION_2;
+    parameters.EnableProperty = EVENT_ENABLE_PROPERTY_STACK_TRACE;
+    parameters.EnableFilterDesc = &filter;
+    parameters.FilterDescCount = 1;
+    status = EnableTraceEx2(m_session, &HeapProviderGuid, EVENT_CONTROL_CODE_ENABLE_PROVIDER,
+        TRACE_LEVEL_VERBOSE, 0, 0, 0, &parameters);
+    if (status == ERROR_INVALID_PARAMETER) {
+        parameters.EnableFilterDesc = NULL;
+        parameters.FilterDescCount = 0;
+        status = EnableTraceEx2(m_session, &HeapProviderGuid, EVENT_CONTROL_CODE_ENABLE_PROVIDER,
+            TRACE_LEVEL_VERBOSE, 0, 0, 0, &parameters);
+    }
+
+    if (status == ERROR_SUCCESS) {
+        EVENT_TRACE_LOGFILEW logfile;
+        ZeroMemory(&logfile, sizeof(logfile));
+        logfile.LoggerName = name;
+        logfile.ProcessTraceMode = PROCESS_TRACE_MODE_REAL_TIME | PROCESS_TRACE_MODE_EVENT_RECORD;
+        logfile.EventRecordCallback = eventCallback;
+        logfile.Context = this;
+        m_trace = OpenTraceW(&logfile);
+        if (m_trace == INVALID_PROCESSTRACE_HANDLE)
+            status = GetLastError();
+    }
+    if (status == ERROR_SUCCESS) {
+        m_threads = new HashMap<UINT_PTR, WORD>;
+        m_finished = CreateEventW(NULL, TRUE, FALSE, NULL);
+        if (m_finished != NULL)
+            m_consumer = CreateThread(NULL, 0, consumerProc, this, 0, &m_consumerId);
+        if (m_consumer == NULL)
+            status = GetLastError();
+    }
+
+    if (status != ERROR_SUCCESS) {
+        m_error = status;
+        if (m_trace != INVALID_PROCESSTRACE_HANDLE) {
+            CloseTrace(m_trace);
+            m_trace = INVALID_PROCESSTRACE_HANDLE;
+        }
+        if (m_finished != NULL) {
+            CloseHandle(m_finished);
+            m_finished = NULL;
+        }
+        delete m_threads;
+        m_threads = NULL;
+        m_consumerId = 0;
+        ControlTraceW(m_session, NULL, m_properties, EVENT_TRACE_CONTROL_STOP);
+        m_session = 0;
+        delete [] (BYTE*)m_properties;
+        m_properties = NULL;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// Stop - Stops the session, once the consumer thread has consumed every event
+//   still buffered, so that the block maps are up to date. Like the other
+//   threads VLD stops from its destructor, the consumer thread isn't waited
+//   for itself, since it may need the loader lock to exit; it sets an event
+//   once it has consumed the last event. If it doesn't within
+//   ETWSESSION_STOP_TIMEOUT, whatever it hasn't consumed is discarded.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID EtwHeapSession::Stop ()
+{
+    if (m_session == 0)
+        return;
+
+    // Stopping the session flushes its buffers; ProcessTrace returns once
+    // their events have been delivered.
+    ControlTraceW(m_session, NULL, m_properties, EVENT_TRACE_CONTROL_FLUSH);
+    ControlTraceW(m_session, NULL, m_properties, EVENT_TRACE_CONTROL_STOP);
+    m_session = 0;
+
+    BOOL finished = (WaitForSingleObject(m_finished, ETWSESSION_STOP_TIMEOUT) == WAIT_OBJECT_0);
+    if (!finished)
+        m_discard = TRUE;
+    CloseTrace(m_trace);
+    m_trace = INVALID_PROCESSTRACE_HANDLE;
+    CloseHandle(m_consumer);
+    m_consumer = NULL;
+    if (finished) {
+        CloseHandle(m_finished);
+        m_finished = NULL;
+        delete m_threads;
+        m_threads = NULL;
+    }
+    delete [] (BYTE*)m_properties;
+    m_properties = NULL;
+}
+
+// resetProperties - Fills in the session's properties, which each call to
+//   StartTrace or ControlTrace overwrites.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID EtwHeapSession::resetProperties ()
+{
+    ZeroMemory(m_properties, sizeof(EVENT_TRACE_PROPERTIES));
+    m_properties->Wnode.BufferSize    = sizeof(EVENT_TRACE_PROPERTIES) + ETWSESSION_NAME_LENGTH * sizeof(WCHAR);
+    m_properties->Wnode.Flags         = WNODE_FLAG_TRACED_GUID;
+    m_properties->Wnode.ClientContext = 1; // Query performance counter time stamps.
+    m_properties->BufferSize          = ETWSESSION_BUFFER_KB;
+    m_properties->MinimumBuffers      = ETWSESSION_MIN_BUFFERS;
+    m_properties->MaximumBuffers      = ETWSESSION_MAX_BUFFERS;
+    m_properties->FlushTimer          = 1;
+    m_properties->LogFileMode         = EVENT_TRACE_REAL_TIME_MODE;
+    m_properties->LoggerNameOffset    = sizeof(EVENT_TRACE_PROPERTIES);
+}
+
+// consumerProc - Consumes the session's events until it is stopped.
+//
+//  - param (IN): The EtwHeapSession.
+//
+//  Return Value:
+//
+//    Always returns 0.
+//
+DWORD WINAPI EtwHeapSession::consumerProc (LPVOID param)
+{
+    EtwHeapSession *session = (EtwHeapSession*)param;
+    TRACEHANDLE trace = session->m_trace;
+    ProcessTrace(&trace, 1, NULL, NULL);
+    SetEvent(session->m_finished);
+    return 0;
+}
+
+// eventCallback - Called by ProcessTrace, on the consumer thread, for each
+//   event.
+//
+//  - record (IN): The event.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID WINAPI EtwHeapSession::eventCallback (PEVENT_RECORD record)
+{
+    ((EtwHeapSession*)record->UserContext)->onEvent(record);
+}
+
+// onEvent - Maps, remaps or unmaps the block, or unmaps the heap, an event of
+//   the heap trace provider is about, just as the heap hooks would. The
+//   consumer thread's own heap calls and those on VLD's private heap are
+//   ignored. Neither can the threads' enabled state (see VLDDisable) be
+//   told from the events, so only the global one is honored.
+//
+//  - record (IN): The event.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID EtwHeapSession::onEvent (const EVENT_RECORD *record)
+{
+    const EVENT_HEADER &header = record->EventHeader;
+    if (m_discard || (header.ProcessId != GetCurrentProcessId()) || (header.ThreadId == m_consumerId) ||
+        !IsEqualGUID(header.ProviderId, HeapProviderGuid))
+        return;
+
+    UINT_PTR fields [5];
+    switch (header.EventDescriptor.Opcode) {
+    case HEAPEVENT_ALLOC:
+        if (!readFields(record, fields, 3) || ((HANDLE)fields[0] == g_vldHeap) || (fields[2] == 0))
+            return;
+        if (!(g_vld.m_status & VLD_STATUS_INSTALLED) || (g_vld.m_options & VLD_OPT_START_DISABLED) ||
+            !g_vld.sampleAllocation(g_vld.getTls(), fields[1]))
+            return;
+        {
+            capturedstack_t stack;
+            if (captureStack(record, stack))
+                g_vld.mapBlock((HANDLE)fields[0], (LPCVOID)fields[2], fields[1], false, false,
+                    threadIndex(header.ThreadId), MODULEIMAGE_NONE, stack);
+        }
+        return;
+
+    case HEAPEVENT_REALLOC:
+        if (!readFields(record, fields, 4) || ((HANDLE)fields[0] == g_vldHeap) || (fields[1] == 0))
+            return;
+        if (!(g_vld.m_status & VLD_STATUS_INSTALLED) || (g_vld.m_options & VLD_OPT_START_DISABLED))
+            return;
+        {
+            CAPTURE_CONTEXT();
+            capturedstack_t stack;
+            if (!captureStack(record, stack)) {
+                // Not to be tracked.
+            }
+            else if (!g_vld.sampleAllocation(g_vld.getTls(), fields[3])) {
+                // Not sampled: the block stops being tracked, as with the hooks.
+                g_vld.unmapBlock((HANDLE)fields[0], (LPCVOID)fields[2], context_);
+            }
+            else {
+                stack.keep = (fields[1] == fields[2]) && (g_vld.m_reallocStackPolicy != VLD_REALLOC_STACK_LATEST);
+                g_vld.remapBlock((HANDLE)fields[0], (LPCVOID)fields[2], (LPCVOID)fields[1], fields[3], false, false,
+                    threadIndex(header.ThreadId), MODULEIMAGE_NONE, stack, context_);
+            }
+        }
+        return;
+
+    case HEAPEVENT_FREE:
+        if (!readFields(record, fields, 2) || ((HANDLE)fields[0] == g_vldHeap))
+            return;
+        {
+            CAPTURE_CONTEXT();
+            g_vld.unmapBlock((HANDLE)fields[0], (LPCVOID)fields[1], context_);
+        }
+        return;
+
+    case HEAPEVENT_DESTROY:
+        if (!readFields(record, fields, 1) || ((HANDLE)fields[0] == g_vldHeap))
+            return;
+        g_vld.unmapHeap((HANDLE)fields[0]);
+        return;
+
+    default:
+        return;
+    }
+}
+
+// captureStack - Obtains the call stack an allocation event came with, and
+//   decides whether the block is tracked. That is decided by the first frame,
+//   past the kernel's and those in the heap and CRT modules (see the patch
+//   table), which is in a known module: the block is tracked unless that
+//   module is excluded from leak detection. The call stack starts at that
+//   frame too, unless internal frames are traced.
+//
+//  - record (IN): The event.
+//
+//  - stack (OUT): Receives the block's call stack.
+//
+//  Return Value:
+//
+//    Returns TRUE if the block is to be tracked; otherwise FALSE.
+//
+BOOL EtwHeapSession::captureStack (const EVENT_RECORD *record, capturedstack_t &stack) const
+{
+    // The extended data holds the call stack, with 32 or 64-bit addresses.
+    const BYTE *addresses = NULL;
+    UINT32 width = 0;
+    UINT32 count = 0;
+    for (USHORT index = 0; index < record->ExtendedDataCount; index++) {
+        const EVENT_HEADER_EXTENDED_DATA_ITEM &item = record->ExtendedData[index];
+        if (item.ExtType == EVENT_HEADER_EXT_TYPE_STACK_TRACE64) {
+            addresses = (const BYTE*)item.DataPtr + FIELD_OFFSET(EVENT_EXTENDED_ITEM_STACK_TRACE64, Address);
+            width = sizeof(ULONG64);
+            count = (item.DataSize - FIELD_OFFSET(EVENT_EXTENDED_ITEM_STACK_TRACE64, Address)) / width;
+        }
+        else if (item.ExtType == EVENT_HEADER_EXT_TYPE_STACK_TRACE32) {
+            addresses = (const BYTE*)item.DataPtr + FIELD_OFFSET(EVENT_EXTENDED_ITEM_STACK_TRACE32, Address);
+            width = sizeof(ULONG);
+            count = (item.DataSize - FIELD_OFFSET(EVENT_EXTENDED_ITEM_STACK_TRACE32, Address)) / width;
+        }
+    }
+
+    ModuleRangesReader reader(g_vld, g_vld.getTls());
+    const moduleranges_t *table = reader.Table();
+    UINT32 first = count;  // The first user mode frame.
+    UINT32 caller = count; // The frame which decides.
+    for (UINT32 index = 0; index < count; index++) {
+        ULONG64 address = (width == sizeof(ULONG)) ? ((const ULONG*)addresses)[index] : ((const ULONG64*)addresses)[index];
+        if (address > m_highestAddress)
+            continue;
+        if (first == count)
+            first = index;
+        const modulerange_t *range = FindModuleRange(table, (UINT_PTR)address);
+        if ((range == NULL) || range->allocator)
+            continue;
+        if (range->excluded)
+            return FALSE;
+        caller = index;
+        break;
+    }
+    if (caller == count)
+        return FALSE;
+
+    stack.skipped = (g_vld.m_degradation >= VLD_DEGRADED_SIZE_ONLY);
+    stack.keep = false;
+    if (stack.skipped)
+        return TRUE;
+
+    UINT32 maxdepth = min(g_vld.m_capturePolicy->maxTraceFrames, (UINT32)CALLSTACK_MAX_CAPTURE);
+    UINT32 depth = 0;
+    UINT32 start = (g_vld.m_options & VLD_OPT_TRACE_INTERNAL_FRAMES) ? first : caller;
+    for (UINT32 index = start; (index < count) && (depth < maxdepth); index++) {
+        ULONG64 address = (width == sizeof(ULONG)) ? ((const ULONG*)addresses)[index] : ((const ULONG64*)addresses)[index];
+        if (address <= m_highestAddress)
+            stack.frames.frames[depth++] = (UINT_PTR)address;
+    }
+    // Hashed as CallStack hashes the frames it captures itself.
+    stack.frames.count = depth;
+    stack.frames.hashValue = CalculateCRC32(stack.frames.frames, depth);
+    if (!g_vld.deferStackCapture()) {
+        CallStack* callstack = CallStack::Create(stack.frames.frames, depth, stack.frames.hashValue);
+        stack.callStack.reset(g_callStackTable.Intern(callstack));
+    }
+    return TRUE;
+}
+
+// threadIndex - Obtains the thread table index of the thread which logged an
+//   event. A thread which has entered VLD keeps the index it got then; the
+//   others are registered on their first allocation.
+//
+//  - threadId (IN): The thread ID.
+//
+//  Return Value:
+//
+//    Returns the thread table index.
+//
+WORD EtwHeapSession::threadIndex (DWORD threadId)
+{
+    HashMap<UINT_PTR, WORD>::Iterator threadit = m_threads->find(threadId);
+    if (threadit != m_threads->end())
+        return (*threadit).second;
+
+    WORD index;
+    {
+        CriticalSectionLocker<> cs(g_vld.m_tlsLock);
+        TlsMap::Iterator tlsit = g_vld.m_tlsMap->find(threadId);
+        index = (tlsit != g_vld.m_tlsMap->end()) ? (*tlsit).second->threadIndex : g_vld.registerThread(threadId);
+    }
+    m_threads->insert(threadId, index);
+    return index;
+}
@@ -0,0 +1,105 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - EtwHeapSession Class Definition
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#ifndef VLDBUILD
+#error \
+    "This header should only be included by Visual Leak Detector when building it from source. \
+    Applications should never include this header."
+#endif
+
+#include <windows.h>
+#include <evntrace.h>
+#include <evntcons.h>
+#include "hashmap.h" // Provides an open-addressing hash map template.
+
+#define ETWSESSION_BUFFER_KB     256   // Size of each of the session's buffers, in KB.
+#define ETWSESSION_MIN_BUFFERS   64    // Buffers the session starts with.
+#define ETWSESSION_MAX_BUFFERS   1024  // Most buffers the session may grow to before events are lost.
+#define ETWSESSION_NAME_LENGTH   64    // Room for the session's name, in characters.
+#define ETWSESSION_STOP_TIMEOUT  10000 // Milliseconds Stop waits for the events still buffered.
+
+struct capturedstack_t;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The EtwHeapSession Class
+//
+//    With the EtwHeapTracking option, an EtwHeapSession tracks the process's
+//    heap blocks from the events of the Windows heap trace provider, instead
+//    of from patched imports: the application's allocations then run no VLD
+//    code at all. The session is a real-time ETW session of the process's own,
+//    with the provider enabled for this process only, and with a call stack
+//    walked by the system for each allocation. A consumer thread maps the
+//    blocks from the events, into the same block maps the hooks use, so
+//    leaks are reported as usual.
+//
+//    Whether a block is tracked is decided from its call stack: by the first
+//    frame, past those in the heap and CRT modules, that is in a known module.
+//    Since events arrive with a delay, the block maps lag a little behind the
+//    application until the session is stopped, which flushes every event
+//    still buffered.
+//
+//    Starting a session needs administrator rights, or membership in the
+//    Performance Log Users group. If it can't be started, VLD patches the
+//    imports as usual.
+//
+class EtwHeapSession
+{
+public:
+    EtwHeapSession ();
+    ~EtwHeapSession ();
+
+    BOOL  IsActive () const { return m_consumer != NULL; }
+    ULONG LastError () const { return m_error; }
+    BOOL  Start ();
+    VOID  Stop ();
+    DWORD ThreadId () const { return m_consumerId; }
+
+private:
+    // Don't allow this!!
+    EtwHeapSession (const EtwHeapSession &other);
+    EtwHeapSession& operator = (const EtwHeapSession &other);
+
+    BOOL  captureStack (const EVENT_RECORD *record, capturedstack_t &stack) const;
+    VOID  onEvent (const EVENT_RECORD *record);
+    VOID  resetProperties ();
+    WORD  threadIndex (DWORD threadId);
+    static DWORD WINAPI consumerProc (LPVOID param);
+    static VOID WINAPI eventCallback (PEVENT_RECORD record);
+
+    EVENT_TRACE_PROPERTIES *m_properties; // The session's properties, followed by its name.
+    TRACEHANDLE    m_session;    // The session, or 0 if it isn't started.
+    TRACEHANDLE    m_trace;      // The consumer's handle of the session.
+    HANDLE         m_consumer;   // Thread which consumes the events, or NULL if none.
+    DWORD          m_consumerId;
+    HANDLE         m_finished;   // Set by the consumer thread once every event has been consumed.
+    volatile BOOL  m_discard;    // Events are ignored; the session was stopped without them.
+    ULONG          m_error;      // Why the session couldn't be started.
+    UINT_PTR       m_highestAddress; // Highest user mode address; call stack frames above it are the kernel's.
+    HashMap<UINT_PTR, WORD> *m_threads; // Thread table indices by thread ID (only used by the consumer thread).
+};
+
+// The heap ETW session, defined along with the other globals in vld.cpp.
+extern EtwHeapSession g_etwSession;
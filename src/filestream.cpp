@@ -0,0 +1,223 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - FileStream Class Implementation
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+
+#include "stdafx.h"
+#define VLDBUILD
+#include "filestream.h" // This class' header.
+
+// Constructor - Initializes a stream which isn't open.
+//
+FileStream::FileStream ()
+    : m_file(INVALID_HANDLE_VALUE), m_active(0), m_used(0), m_offset(0), m_text(FALSE), m_failed(FALSE)
+{
+    m_buffers[0] = m_buffers[1] = NULL;
+    memset(m_overlapped, 0, sizeof(m_overlapped));
+    m_pending[0] = m_pending[1] = FALSE;
+}
+
+// Destructor - Writes out and closes a file that was never closed.
+//
+FileStream::~FileStream ()
+{
+    Close();
+}
+
+// Open - Creates a file, or truncates it if it exists, for writing through
+//   the stream.
+//
+//  - path (IN): Path of the file.
+//
+//  - text (IN): If TRUE, each "\n" is written as "\r\n".
+//
+//  Return Value:
+//
+//    Returns TRUE if the file could be opened, or FALSE if it couldn't be or
+//    the buffers couldn't be allocated.
+//
+BOOL FileStream::Open (LPCWSTR path, BOOL text)
+{
+    Close();
+
+    // Allocate both buffers at once; they are page aligned.
+    BYTE *memory = (BYTE*)VirtualAlloc(NULL, 2 * FILESTREAM_BUFFERSIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (memory == NULL)
+        return FALSE;
+    for (UINT index = 0; index < 2; index++) {
+        memset(&m_overlapped[index], 0, sizeof(OVERLAPPED));
+        m_overlapped[index].hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    }
+    if ((m_overlapped[0].hEvent != NULL) && (m_overlapped[1].hEvent != NULL)) {
+        m_file = CreateFileW(path, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    }
+    if (m_file == INVALID_HANDLE_VALUE) {
+        for (UINT index = 0; index < 2; index++) {
+            if (m_overlapped[index].hEvent != NULL)
+                CloseHandle(m_overlapped[index].hEvent);
+            m_overlapped[index].hEvent = NULL;
+        }
+        VirtualFree(memory, 0, MEM_RELEASE);
+        return FALSE;
+    }
+
+    m_buffers[0] = memory;
+    m_buffers[1] = memory + FILESTREAM_BUFFERSIZE;
+    m_pending[0] = m_pending[1] = FALSE;
+    m_active = 0;
+    m_used = 0;
+    m_offset = 0;
+    m_text = text;
+    m_failed = FALSE;
+    return TRUE;
+}
+
+// Write - Writes data to the file. The data is buffered; it is written out
+//   once a buffer is full, or by Flush.
+//
+//  - data (IN): The data.
+//
+//  - size (IN): Size of the data, in bytes.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID FileStream::Write (LPCVOID data, size_t size)
+{
+    if (m_file == INVALID_HANDLE_VALUE)
+        return;
+
+    const BYTE *bytes = (const BYTE*)data;
+    if (!m_text) {
+        append(bytes, size);
+        return;
+    }
+
+    // Copy the lines, each followed by "\r\n" instead of its "\n".
+    static const BYTE newline [2] = { '\r', '\n' };
+    while (size > 0) {
+        const BYTE *end = (const BYTE*)memchr(bytes, '\n', size);
+        if (end == NULL) {
+            append(bytes, size);
+            return;
+        }
+        append(bytes, end - bytes);
+        append(newline, sizeof(newline));
+        size -= end - bytes + 1;
+        bytes = end + 1;
+    }
+}
+
+// Flush - Writes out whatever has been buffered, and waits for all writes to
+//   complete.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID FileStream::Flush ()
+{
+    if (m_file == INVALID_HANDLE_VALUE)
+        return;
+
+    submit();
+    wait(0);
+    wait(1);
+}
+
+// Close - Writes out whatever has been buffered and closes the file.
+//
+//  Return Value:
+//
+//    Returns FALSE if any write to the file failed. Returns TRUE if the file
+//    wasn't open.
+//
+BOOL FileStream::Close ()
+{
+    if (m_file == INVALID_HANDLE_VALUE)
+        return TRUE;
+
+    Flush();
+    CloseHandle(m_file);
+    m_file = INVALID_HANDLE_VALUE;
+    for (UINT index = 0; index < 2; index++) {
+        CloseHandle(m_overlapped[index].hEvent);
+        m_overlapped[index].hEvent = NULL;
+    }
+    VirtualFree(m_buffers[0], 0, MEM_RELEASE);
+    m_buffers[0] = m_buffers[1] = NULL;
+    return !m_failed;
+}
+
+// append - Copies data into the active buffer, writing the buffer out each
+//   time it fills up.
+VOID FileStream::append (const BYTE *data, size_t size)
+{
+    while (size > 0) {
+        size_t chunk = min(size, (size_t)FILESTREAM_BUFFERSIZE - m_used);
+        memcpy(m_buffers[m_active] + m_used, data, chunk);
+        m_used += chunk;
+        data += chunk;
+        size -= chunk;
+        if (m_used == FILESTREAM_BUFFERSIZE)
+            submit();
+    }
+}
+
+// submit - Starts writing the active buffer out, and switches to the other
+//   buffer once its own write has completed.
+VOID FileStream::submit ()
+{
+    if (m_used == 0)
+        return;
+
+    OVERLAPPED &overlapped = m_overlapped[m_active];
+    HANDLE event = overlapped.hEvent;
+    memset(&overlapped, 0, sizeof(OVERLAPPED));
+    overlapped.hEvent = event;
+    overlapped.Offset = (DWORD)m_offset;
+    overlapped.OffsetHigh = (DWORD)(m_offset >> 32);
+    if (WriteFile(m_file, m_buffers[m_active], (DWORD)m_used, NULL, &overlapped) ||
+        (GetLastError() == ERROR_IO_PENDING))
+        m_pending[m_active] = TRUE;
+    else
+        m_failed = TRUE;
+
+    m_offset += m_used;
+    m_used = 0;
+    m_active ^= 1;
+    wait(m_active);
+}
+
+// wait - Waits for the write of a buffer, if one is pending, to complete.
+VOID FileStream::wait (UINT index)
+{
+    if (!m_pending[index])
+        return;
+
+    DWORD written = 0;
+    if (!GetOverlappedResult(m_file, &m_overlapped[index], &written, TRUE))
+        m_failed = TRUE;
+    m_pending[index] = FALSE;
+}
@@ -0,0 +1,89 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - FileStream Class Definition
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+
+#pragma once
+
+#ifndef VLDBUILD
+#error \
+    "This header should only be included by Visual Leak Detector when building it from source. \
+    Applications should never include this header."
+#endif
+
+#include <windows.h>
+
+#define FILESTREAM_BUFFERSIZE (1024 * 1024) // Bytes of each of the two buffers written to the file at once.
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The FileStream Class
+//
+//    A FileStream writes a file sequentially through two large buffers. When
+//    one is full it is written to the file with an overlapped WriteFile, and
+//    the other one is filled meanwhile; a buffer is only waited for when it
+//    is needed again. So the file is written a megabyte per system call, and
+//    the writer hardly ever waits for the disk. The CRT's stdio isn't
+//    involved, nor its locking.
+//
+//    The file isn't opened with FILE_FLAG_NO_BUFFERING: that would require
+//    every write, the last one included, to be a whole number of sectors.
+//    Writes which extend the file may still complete synchronously (NTFS
+//    does that), which only matters as much as their number does.
+//
+//    A file opened in text mode has each "\n" written as "\r\n", as a CRT
+//    text-mode file would. Its buffers are allocated with VirtualAlloc, since
+//    the report file may be finished after VLD's private heap has been
+//    destroyed. A FileStream isn't synchronized; the report writer only uses
+//    it under its own lock.
+//
+class FileStream
+{
+public:
+    FileStream ();
+    ~FileStream ();
+
+    BOOL Open (LPCWSTR path, BOOL text);
+    BOOL IsOpen () const { return m_file != INVALID_HANDLE_VALUE; }
+    VOID Write (LPCVOID data, size_t size);
+    VOID Flush ();
+    BOOL Close ();
+
+private:
+    // Don't allow this!!
+    FileStream (const FileStream &other);
+    FileStream& operator = (const FileStream &other);
+
+    VOID append (const BYTE *data, size_t size);
+    VOID submit ();
+    VOID wait (UINT index);
+
+    HANDLE      m_file;           // The file, or INVALID_HANDLE_VALUE if not open.
+    BYTE       *m_buffers [2];    // The buffers, one being filled while the other may be written.
+    OVERLAPPED  m_overlapped [2]; // The write of each buffer.
+    BOOL        m_pending [2];    // If TRUE, the buffer's write hasn't been waited for yet.
+    UINT        m_active;         // Index of the buffer being filled.
+    size_t      m_used;           // Bytes stored in the buffer being filled.
+    UINT64      m_offset;         // File offset of the buffer being filled.
+    BOOL        m_text;           // If TRUE, "\n" is written as "\r\n".
+    BOOL        m_failed;         // If TRUE, a write has failed since the file was opened.
+};
@@ -0,0 +1,398 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - GzipStream Class Implementation
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#define VLDBUILD
+#include "gzipstream.h" // This class' header.
+
+#define GZIP_MASK       (GZIP_WINDOWSIZE - 1)
+#define GZIP_NIL        (-1)
+#define GZIP_ENDOFBLOCK 256
+
+// Deflate's length codes 257-285: the shortest length of each, and the
+// number of extra bits that follow it.
+static const UINT16 s_lengthBase [29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const BYTE s_lengthExtra [29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+// Deflate's distance codes 0-29, likewise.
+static const UINT16 s_distanceBase [30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const BYTE s_distanceExtra [30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// Tables built by buildTables.
+static BOOL   s_tablesBuilt = FALSE;
+static UINT16 s_literalCodes [288];   // Fixed Huffman code of each literal/length symbol, bit-reversed.
+static BYTE   s_literalLengths [288]; // Length of each of those codes, in bits.
+static BYTE   s_lengthCodes [GZIP_MAXMATCH + 1]; // Length code (minus 257) of each match length.
+static DWORD  s_crcTable [256];       // CRC-32 (as in gzip, not the CRC-32C of CalculateCRC32) of each byte.
+
+// reverseBits - Reverses the order of the lowest bits of a value. Huffman
+//   codes are written starting from their most significant bit, whereas
+//   everything else in deflate starts from the least significant one.
+static UINT32 reverseBits (UINT32 value, UINT32 count)
+{
+    UINT32 reversed = 0;
+    for (UINT32 bit = 0; bit < count; bit++) {
+        reversed = (reversed << 1) | (value & 1);
+        value >>= 1;
+    }
+    return reversed;
+}
+
+// buildTables - Builds the tables of fixed Huffman codes, length codes and
+//   CRCs, the first time a stream is opened.
+static VOID buildTables ()
+{
+    if (s_tablesBuilt)
+        return;
+
+    for (UINT32 symbol = 0; symbol < 288; symbol++) {
+        UINT32 code, length;
+        if (symbol < 144) {
+            code = 0x30 + symbol;
+            length = 8;
+        }
+        else if (symbol < 256) {
+            code = 0x190 + (symbol - 144);
+            length = 9;
+        }
+        else if (symbol < 280) {
+            code = symbol - 256;
+            length = 7;
+        }
+        else {
+            code = 0xC0 + (symbol - 280);
+            length = 8;
+        }
+        s_literalCodes[symbol] = (UINT16)reverseBits(code, length);
+        s_literalLengths[symbol] = (BYTE)length;
+    }
+
+    for (UINT32 code = 0; code < 29; code++) {
+        UINT32 last = (code == 28) ? GZIP_MAXMATCH : s_lengthBase[code + 1] - 1;
+        for (UINT32 length = s_lengthBase[code]; length <= last; length++)
+            s_lengthCodes[length] = (BYTE)code;
+    }
+
+    for (UINT32 byte = 0; byte < 256; byte++) {
+        DWORD crc = byte;
+        for (UINT32 bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (0xEDB88320 ^ (crc >> 1)) : (crc >> 1);
+        s_crcTable[byte] = crc;
+    }
+    s_tablesBuilt = TRUE;
+}
+
+// hashBytes - Hashes the GZIP_MINMATCH bytes a match would start with.
+static inline UINT32 hashBytes (const BYTE *bytes)
+{
+    return ((bytes[0] << 10) ^ (bytes[1] << 5) ^ bytes[2]) & (GZIP_HASHSIZE - 1);
+}
+
+// Constructor - Initializes a stream which isn't open.
+//
+GzipStream::GzipStream ()
+    : m_file(NULL), m_window(NULL), m_head(NULL), m_prev(NULL), m_output(NULL), m_outputUsed(0), m_position(0),
+      m_end(0), m_bits(0), m_bitCount(0), m_crc(0), m_size(0)
+{
+}
+
+// Destructor - Releases the buffers of a stream that was never closed. The
+//   stream isn't finished, as the file may be gone already.
+//
+GzipStream::~GzipStream ()
+{
+    if (m_window != NULL)
+        VirtualFree(m_window, 0, MEM_RELEASE);
+}
+
+// Open - Starts a gzip stream at the current position of a file. The file
+//   must have been opened in binary mode (not in text mode).
+//
+//  - file (IN): The file.
+//
+//  Return Value:
+//
+//    Returns TRUE if the stream could be started, or FALSE if its buffers
+//    couldn't be allocated.
+//
+BOOL GzipStream::Open (FileStream *file)
+{
+    if (m_file != NULL)
+        Close();
+
+    // Allocate all buffers at once.
+    SIZE_T windowBytes = 2 * GZIP_WINDOWSIZE;
+    SIZE_T headBytes = GZIP_HASHSIZE * sizeof(INT32);
+    SIZE_T prevBytes = GZIP_WINDOWSIZE * sizeof(INT32);
+    BYTE *memory = (BYTE*)VirtualAlloc(NULL, windowBytes + headBytes + prevBytes + GZIP_OUTPUTSIZE,
+        MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (memory == NULL)
+        return FALSE;
+    m_window = memory;
+    m_head = (INT32*)(memory + windowBytes);
+    m_prev = (INT32*)(memory + windowBytes + headBytes);
+    m_output = memory + windowBytes + headBytes + prevBytes;
+    for (UINT32 index = 0; index < GZIP_HASHSIZE; index++)
+        m_head[index] = GZIP_NIL;
+
+    buildTables();
+    m_file = file;
+    m_outputUsed = 0;
+    m_position = m_end = 0;
+    m_bits = m_bitCount = 0;
+    m_crc = 0xFFFFFFFF;
+    m_size = 0;
+
+    // The gzip header: deflate, no flags, no time stamp, written on NTFS.
+    static const BYTE header [10] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 11 };
+    for (UINT32 index = 0; index < sizeof(header); index++)
+        putByte(header[index]);
+
+    // The whole stream is a single deflate block with the fixed Huffman codes;
+    // it isn't the final block (BFINAL is 0), which Close adds.
+    putBits(0, 1);
+    putBits(1, 2);
+    return TRUE;
+}
+
+// Write - Compresses data into the stream. Data is buffered until enough
+//   follows to find the longest match, so compressed output lags behind.
+//
+//  - data (IN): The data.
+//
+//  - size (IN): Size of the data, in bytes.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID GzipStream::Write (LPCVOID data, size_t size)
+{
+    if (m_file == NULL)
+        return;
+
+    const BYTE *bytes = (const BYTE*)data;
+    while (size > 0) {
+        if (m_end == 2 * GZIP_WINDOWSIZE)
+            slide();
+        UINT32 chunk = (UINT32)min(size, (size_t)(2 * GZIP_WINDOWSIZE - m_end));
+        memcpy(m_window + m_end, bytes, chunk);
+        for (UINT32 index = 0; index < chunk; index++)
+            m_crc = s_crcTable[(m_crc ^ bytes[index]) & 0xFF] ^ (m_crc >> 8);
+        m_end += chunk;
+        m_size += chunk;
+        bytes += chunk;
+        size -= chunk;
+
+        // Keep the longest possible match in the window.
+        if (m_end - m_position > GZIP_MAXMATCH)
+            compress(m_end - GZIP_MAXMATCH);
+    }
+}
+
+// Close - Compresses what remains of the data, finishes the stream and
+//   writes it out, and flushes the file. The file itself is left open.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID GzipStream::Close ()
+{
+    if (m_file == NULL)
+        return;
+
+    compress(m_end);
+    putLiteral(GZIP_ENDOFBLOCK);
+
+    // An empty final block.
+    putBits(1, 1);
+    putBits(1, 2);
+    putLiteral(GZIP_ENDOFBLOCK);
+    if (m_bitCount > 0)
+        putBits(0, 8 - m_bitCount);
+
+    // The gzip trailer: the CRC-32 and the size of the data.
+    DWORD crc = ~m_crc;
+    for (UINT32 shift = 0; shift < 32; shift += 8)
+        putByte((BYTE)(crc >> shift));
+    for (UINT32 shift = 0; shift < 32; shift += 8)
+        putByte((BYTE)(m_size >> shift));
+    flushOutput();
+    m_file->Flush();
+
+    VirtualFree(m_window, 0, MEM_RELEASE);
+    m_window = m_output = NULL;
+    m_head = m_prev = NULL;
+    m_file = NULL;
+}
+
+// compress - Encodes the data of the window up to a given position, as
+//   literals and matches. The last match may extend past it.
+//
+//  - limit (IN): Window position up to which the data is encoded.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID GzipStream::compress (UINT32 limit)
+{
+    while (m_position < limit) {
+        UINT32 available = m_end - m_position;
+        UINT32 bestLength = 0;
+        UINT32 bestDistance = 0;
+        if (available >= GZIP_MINMATCH) {
+            // Walk the hash chain, newest candidates first.
+            const BYTE *current = m_window + m_position;
+            UINT32 maxLength = min(available, (UINT32)GZIP_MAXMATCH);
+            INT32 candidate = m_head[hashBytes(current)];
+            for (UINT32 tries = 0; (candidate != GZIP_NIL) && (tries < GZIP_MAXCHAIN); tries++) {
+                UINT32 distance = m_position - candidate;
+                if (distance > GZIP_WINDOWSIZE)
+                    break;
+                const BYTE *match = m_window + candidate;
+                if (match[bestLength] == current[bestLength]) {
+                    UINT32 length = 0;
+                    while ((length < maxLength) && (match[length] == current[length]))
+                        length++;
+                    if (length > bestLength) {
+                        bestLength = length;
+                        bestDistance = distance;
+                        if (length == maxLength)
+                            break;
+                    }
+                }
+                INT32 next = m_prev[candidate & GZIP_MASK];
+                if (next >= candidate) {
+                    // The chain has been overwritten by newer positions.
+                    break;
+                }
+                candidate = next;
+            }
+            insert(m_position);
+        }
+
+        if (bestLength >= GZIP_MINMATCH) {
+            putLength(bestLength);
+            putDistance(bestDistance);
+            // Make the positions the match covers available to later matches.
+            for (UINT32 offset = 1; offset < bestLength; offset++) {
+                if (m_position + offset + GZIP_MINMATCH <= m_end)
+                    insert(m_position + offset);
+            }
+            m_position += bestLength;
+        }
+        else {
+            putLiteral(m_window[m_position]);
+            m_position++;
+        }
+    }
+}
+
+// flushOutput - Writes the buffered compressed bytes to the file.
+VOID GzipStream::flushOutput ()
+{
+    if (m_outputUsed > 0)
+        m_file->Write(m_output, m_outputUsed);
+    m_outputUsed = 0;
+}
+
+// insert - Adds a window position to its hash chain. There must be at least
+//   GZIP_MINMATCH bytes from the position on.
+VOID GzipStream::insert (UINT32 position)
+{
+    UINT32 hash = hashBytes(m_window + position);
+    m_prev[position & GZIP_MASK] = m_head[hash];
+    m_head[hash] = (INT32)position;
+}
+
+// putBits - Appends bits to the compressed output, least significant first.
+VOID GzipStream::putBits (UINT32 value, UINT32 count)
+{
+    m_bits |= value << m_bitCount;
+    m_bitCount += count;
+    while (m_bitCount >= 8) {
+        putByte((BYTE)m_bits);
+        m_bits >>= 8;
+        m_bitCount -= 8;
+    }
+}
+
+// putByte - Appends a byte to the compressed output. Only called when the
+//   output is byte aligned.
+VOID GzipStream::putByte (BYTE value)
+{
+    if (m_outputUsed == GZIP_OUTPUTSIZE)
+        flushOutput();
+    m_output[m_outputUsed++] = value;
+}
+
+// putDistance - Appends the distance of a match.
+VOID GzipStream::putDistance (UINT32 distance)
+{
+    UINT32 code = 29;
+    while (s_distanceBase[code] > distance)
+        code--;
+    putBits(reverseBits(code, 5), 5);
+    putBits(distance - s_distanceBase[code], s_distanceExtra[code]);
+}
+
+// putLength - Appends the length of a match.
+VOID GzipStream::putLength (UINT32 length)
+{
+    UINT32 code = s_lengthCodes[length];
+    putLiteral(257 + code);
+    putBits(length - s_lengthBase[code], s_lengthExtra[code]);
+}
+
+// putLiteral - Appends a literal/length symbol.
+VOID GzipStream::putLiteral (UINT32 literal)
+{
+    putBits(s_literalCodes[literal], s_literalLengths[literal]);
+}
+
+// slide - Discards the older half of the window, once it is full, to make
+//   room for more data. Positions in the hash chains move down with it.
+VOID GzipStream::slide ()
+{
+    memmove(m_window, m_window + GZIP_WINDOWSIZE, GZIP_WINDOWSIZE);
+    m_position -= GZIP_WINDOWSIZE;
+    m_end -= GZIP_WINDOWSIZE;
+    for (UINT32 index = 0; index < GZIP_HASHSIZE; index++)
+        m_head[index] = (m_head[index] >= GZIP_WINDOWSIZE) ? m_head[index] - GZIP_WINDOWSIZE : GZIP_NIL;
+    for (UINT32 index = 0; index < GZIP_WINDOWSIZE; index++)
+        m_prev[index] = (m_prev[index] >= GZIP_WINDOWSIZE) ? m_prev[index] - GZIP_WINDOWSIZE : GZIP_NIL;
+}
@@ -0,0 +1,97 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - GzipStream Class Definition
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#ifndef VLDBUILD
+#error \
+    "This header should only be included by Visual Leak Detector when building it from source. \
+    Applications should never include this header."
+#endif
+
+#include <windows.h>
+#include "filestream.h" // Provides the file the stream is written to.
+
+#define GZIP_WINDOWSIZE  32768 // Size of the deflate window (the largest match distance).
+#define GZIP_HASHSIZE    32768 // Number of hash chains used to find matches.
+#define GZIP_MINMATCH    3     // Shortest match deflate can encode.
+#define GZIP_MAXMATCH    258   // Longest match deflate can encode.
+#define GZIP_MAXCHAIN    32    // Candidates tried per match search.
+#define GZIP_OUTPUTSIZE  16384 // Bytes of compressed output buffered before they are written.
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The GzipStream Class
+//
+//    A GzipStream compresses whatever is written to it into a gzip (RFC 1952)
+//    file, so that any gzip tool can decompress it. It is used for report
+//    files named *.gz.
+//
+//    The data is compressed as it is written, with LZ77 matches found through
+//    hash chains and encoded as one stream of fixed Huffman deflate codes.
+//    That is a fraction of what dynamic Huffman tables would achieve, but leak
+//    reports are so repetitive that most of the gain comes from the matches.
+//
+//    Its buffers are allocated with VirtualAlloc, since the report file may be
+//    finished after VLD's private heap has been destroyed. A GzipStream isn't
+//    synchronized; the report writer only uses it under its own lock.
+//
+class GzipStream
+{
+public:
+    GzipStream ();
+    ~GzipStream ();
+
+    BOOL Open (FileStream *file);
+    BOOL IsOpen () const { return m_file != NULL; }
+    VOID Write (LPCVOID data, size_t size);
+    VOID Close ();
+
+private:
+    // Don't allow this!!
+    GzipStream (const GzipStream &other);
+    GzipStream& operator = (const GzipStream &other);
+
+    VOID compress (UINT32 limit);
+    VOID flushOutput ();
+    VOID insert (UINT32 position);
+    VOID putBits (UINT32 value, UINT32 count);
+    VOID putByte (BYTE value);
+    VOID putDistance (UINT32 distance);
+    VOID putLength (UINT32 length);
+    VOID putLiteral (UINT32 literal);
+    VOID slide ();
+
+    FileStream *m_file;   // The file the compressed stream is written to, or NULL if not open.
+    BYTE   *m_window;     // The last GZIP_WINDOWSIZE bytes compressed, followed by those still to be.
+    INT32  *m_head;       // Most recent window position of each hash chain, or -1.
+    INT32  *m_prev;       // Previous window position of the same hash chain, by position modulo GZIP_WINDOWSIZE.
+    BYTE   *m_output;     // Compressed bytes not written to the file yet.
+    UINT32  m_outputUsed;
+    UINT32  m_position;   // Window position of the next byte to compress.
+    UINT32  m_end;        // Window position after the last byte written.
+    UINT32  m_bits;       // Bits of compressed output which don't make up a byte yet.
+    UINT32  m_bitCount;
+    DWORD   m_crc;        // CRC-32 of the data written so far.
+    DWORD   m_size;       // Size of the data written so far, modulo 2^32.
+};
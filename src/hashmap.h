@@ -0,0 +1,417 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Open-Addressing Hash Map Template
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#ifndef VLDBUILD
+#error \
+"This header should only be included by Visual Leak Detector when building it from source. \
+Applications should never include this header."
+#endif
+
+#include "map.h" // Provides the Pair template class.
+
+#define HASHMAP_MIN_CAPACITY 16 // Smallest table allocated, in slots (power of two).
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The HashMap Template Class
+//
+//  An open-addressing (linear probing) hash map keyed on pointers. The
+//  key/value pairs are stored inline in a single array, so a lookup usually
+//  touches one or two cache lines instead of chasing tree nodes.
+//
+//  The interface mirrors Map, so it can be used as a drop-in BlockMap
+//  backend. Unlike Map, iteration order is unspecified and a HashMap is not
+//  internally synchronized: callers must provide their own locking (block
+//  maps are always accessed under their g_heapMapLock shard).
+//
+//  Keys must be pointer-sized values. The key values 0 and 1 are reserved to
+//  mark empty and erased slots. Erasing never moves other entries, so the
+//  current Iterator stays valid while erasing; inserting may grow the table
+//  and invalidates all Iterators.
+//
+template <typename Tk, typename Tv>
+class HashMap {
+public:
+    class Iterator {
+    public:
+        // Constructor
+        Iterator ()
+        {
+            // Plainly constructed iterators don't reference anything.
+            m_map   = NULL;
+            m_index = 0;
+        }
+
+        // operator != - Inequality operator for HashMap Iterators.
+        BOOL operator != (const Iterator &other) const
+        {
+            return ((m_map != other.m_map) || (m_index != other.m_index));
+        }
+
+        // operator == - Equality operator for HashMap Iterators. Two
+        //   Iterators are equal if they reference the same slot of the same
+        //   HashMap.
+        BOOL operator == (const Iterator &other) const
+        {
+            return ((m_map == other.m_map) && (m_index == other.m_index));
+        }
+
+        // operator * - Dereference operator for HashMap Iterators.
+        const Pair<Tk, Tv>& operator * () const
+        {
+            return m_map->m_slots[m_index];
+        }
+
+        // operator ++ - Prefix increment operator for HashMap Iterators.
+        //   Moves to the next occupied slot, or to the end of the HashMap.
+        Iterator& operator ++ (int)
+        {
+            m_index = m_map->nextOccupied(m_index + 1);
+            return *this;
+        }
+
+        // operator ++ - Postfix increment operator for HashMap Iterators.
+        Iterator operator ++ ()
+        {
+            Iterator cur = *this;
+
+            m_index = m_map->nextOccupied(m_index + 1);
+            return cur;
+        }
+
+    private:
+        // Private constructor. Only the HashMap class itself may use this
+        //   constructor.
+        Iterator (const HashMap *map, size_t index)
+        {
+            m_map   = map;
+            m_index = index;
+        }
+
+        const HashMap *m_map;   // The HashMap containing the referenced slot.
+        size_t         m_index; // Index of the referenced slot.
+
+        friend class HashMap<Tk, Tv>;
+    };
+
+    // Constructor
+    HashMap ()
+    {
+        m_slots    = NULL;
+        m_capacity = 0;
+        m_count    = 0;
+        m_erased   = 0;
+    }
+
+    // Destructor
+    ~HashMap ()
+    {
+        delete [] m_slots;
+    }
+
+    // begin - Obtains an Iterator referencing the first occupied slot.
+    Iterator begin () const
+    {
+        return Iterator(this, nextOccupied(0));
+    }
+
+    // end - Obtains the "NULL" Iterator, signifying the end of the HashMap.
+    Iterator end () const
+    {
+        return Iterator(this, m_capacity);
+    }
+
+    // position - Obtains the index of the slot an Iterator references, for
+    //   walks which let go of the HashMap between batches (see resume).
+    size_t position (const Iterator &it) const
+    {
+        return it.m_index;
+    }
+
+    // resume - Obtains an Iterator referencing the first occupied slot after
+    //   the one where a walk stopped. If the key it stopped at has been erased
+    //   since, the walk resumes after the slot it was in: erasing doesn't move
+    //   the other keys, so only a rehash can make the walk miss a key or see
+    //   one again.
+    //
+    //  - key (IN): The key the walk stopped at.
+    //
+    //  - position (IN): The position of its slot (see position).
+    //
+    Iterator resume (const Tk &key, size_t position) const
+    {
+        Iterator it = find(key);
+        if (it != end())
+            return Iterator(this, nextOccupied(it.m_index + 1));
+        return Iterator(this, nextOccupied((position < m_capacity) ? position + 1 : m_capacity));
+    }
+
+    // erase - Erases the key/value pair referenced by the Iterator. The slot
+    //   is marked as erased so that probe sequences passing through it are
+    //   not broken.
+    VOID erase (Iterator &it)
+    {
+        assert(it.m_map == this && it.m_index < m_capacity);
+        Pair<Tk, Tv> &slot = m_slots[it.m_index];
+        slot.first  = erasedKey();
+        slot.second = Tv();
+        m_count--;
+        m_erased++;
+    }
+
+    // erase - Erases the key/value pair with the specified key, if present.
+    VOID erase (const Tk &key)
+    {
+        Iterator it = find(key);
+        if (it != end())
+            erase(it);
+    }
+
+    // find - Finds a key/value pair in the map. Returns end() if not found.
+    Iterator find (const Tk &key) const
+    {
+        if (m_count == 0)
+            return end();
+
+        size_t mask = m_capacity - 1;
+        for (size_t index = hash(key) & mask; ; index = (index + 1) & mask) {
+            const Tk &slotkey = m_slots[index].first;
+            if (slotkey == key)
+                return Iterator(this, index);
+            if (slotkey == emptyKey())
+                return end();
+        }
+    }
+
+    // insert - Inserts a key/value pair into the map. Returns end() if the key
+    //   is already present, in which case the map is not modified.
+    Iterator insert (const Tk &key, const Tv &data)
+    {
+        assert((key != emptyKey()) && (key != erasedKey()));
+
+        // Keep the load factor, counting erased slots, below 3/4.
+        if ((m_count + m_erased + 1) * 4 > m_capacity * 3)
+            rehash(m_count + 1);
+
+        size_t mask = m_capacity - 1;
+        size_t target = m_capacity;
+        size_t index;
+        for (index = hash(key) & mask; ; index = (index + 1) & mask) {
+            const Tk &slotkey = m_slots[index].first;
+            if (slotkey == key)
+                return end();
+            if (slotkey == emptyKey())
+                break;
+            if ((slotkey == erasedKey()) && (target == m_capacity))
+                target = index;
+        }
+        if (target == m_capacity) {
+            target = index;
+        }
+        else {
+            // Reusing an erased slot.
+            m_erased--;
+        }
+        m_slots[target].first  = key;
+        m_slots[target].second = data;
+        m_count++;
+        return Iterator(this, target);
+    }
+
+    // insert - Inserts a key/value pair into the map, unless the key is
+    //   already present. Either way, the key is only probed for once.
+    //   "inserted" tells which; the Iterator references the pair inserted or
+    //   found.
+    Iterator insert (const Tk &key, const Tv &data, bool &inserted)
+    {
+        assert((key != emptyKey()) && (key != erasedKey()));
+
+        if ((m_count + m_erased + 1) * 4 > m_capacity * 3)
+            rehash(m_count + 1);
+
+        size_t mask = m_capacity - 1;
+        size_t target = m_capacity;
+        size_t index;
+        for (index = hash(key) & mask; ; index = (index + 1) & mask) {
+            const Tk &slotkey = m_slots[index].first;
+            if (slotkey == key) {
+                inserted = false;
+                return Iterator(this, index);
+            }
+            if (slotkey == emptyKey())
+                break;
+            if ((slotkey == erasedKey()) && (target == m_capacity))
+                target = index;
+        }
+        if (target == m_capacity) {
+            target = index;
+        }
+        else {
+            m_erased--;
+        }
+        m_slots[target].first  = key;
+        m_slots[target].second = data;
+        m_count++;
+        inserted = true;
+        return Iterator(this, target);
+    }
+
+    // replace - Replaces the value of the key/value pair referenced by the
+    //   Iterator, and returns the previous value.
+    Tv replace (Iterator &it, const Tv &data)
+    {
+        assert(it.m_map == this && it.m_index < m_capacity);
+        Tv previous = m_slots[it.m_index].second;
+        m_slots[it.m_index].second = data;
+        return previous;
+    }
+
+    // reserve - Makes room for at least "count" key/value pairs without
+    //   growing the table.
+    //
+    //  Return Value:
+    //
+    //    Returns the number of key/value pairs that fit before the call.
+    //
+    size_t reserve (size_t count)
+    {
+        size_t oldreserve = m_capacity * 3 / 4;
+        if (count > oldreserve)
+            rehash(count);
+        return oldreserve;
+    }
+
+    // compact - Shrinks the table to the smallest capacity which holds the
+    //   key/value pairs below the maximum load factor, dropping erased slots.
+    //   An empty map frees its table. Invalidates all Iterators.
+    //
+    //  Return Value:
+    //
+    //    Returns the number of slots freed.
+    //
+    size_t compact ()
+    {
+        size_t oldcapacity = m_capacity;
+        if (m_count == 0) {
+            delete [] m_slots;
+            m_slots    = NULL;
+            m_capacity = 0;
+            m_erased   = 0;
+        }
+        else if ((m_erased != 0) || (m_capacity > HASHMAP_MIN_CAPACITY)) {
+            rehash(m_count, true);
+        }
+        return oldcapacity - m_capacity;
+    }
+
+    // size - Returns the number of key/value pairs stored in the map.
+    size_t size () const
+    {
+        return m_count;
+    }
+
+    // capacity - Returns the number of key/value pairs that fit without
+    //   growing the table.
+    size_t capacity () const
+    {
+        return m_capacity * 3 / 4;
+    }
+
+    // bytes - Returns the bytes taken by the slot table.
+    size_t bytes () const
+    {
+        return m_capacity * sizeof(Pair<Tk, Tv>);
+    }
+
+private:
+    static Tk emptyKey ()  { return (Tk)(UINT_PTR)0; }
+    static Tk erasedKey () { return (Tk)(UINT_PTR)1; }
+
+    // hash - Fibonacci hashing of the key. Heap blocks are at least 8-byte
+    //   aligned, so the low bits carry no information and are mixed away.
+    static size_t hash (const Tk &key)
+    {
+        UINT_PTR k = (UINT_PTR)key;
+#ifdef _WIN64
+        return (size_t)((k * 0x9E3779B97F4A7C15ull) >> 24);
+#else
+        return (size_t)((k * 0x9E3779B9u) >> 8);
+#endif
+    }
+
+    // nextOccupied - Returns the index of the first occupied slot at or after
+    //   "index", or the capacity if there is none.
+    size_t nextOccupied (size_t index) const
+    {
+        while (index < m_capacity) {
+            const Tk &slotkey = m_slots[index].first;
+            if ((slotkey != emptyKey()) && (slotkey != erasedKey()))
+                break;
+            index++;
+        }
+        return index;
+    }
+
+    // rehash - Reallocates the table so that it holds at least "count"
+    //   key/value pairs below the maximum load factor, and drops erased slots.
+    //   The table only gets smaller if "shrink" is true.
+    VOID rehash (size_t count, bool shrink = false)
+    {
+        size_t capacity = HASHMAP_MIN_CAPACITY;
+        while (capacity * 3 < count * 4 + 4)
+            capacity *= 2;
+        if ((capacity < m_capacity) && !shrink)
+            capacity = m_capacity;
+        if ((capacity == m_capacity) && (m_erased == 0))
+            return;
+
+        Pair<Tk, Tv> *oldslots = m_slots;
+        size_t        oldcapacity = m_capacity;
+        m_slots    = new Pair<Tk, Tv> [capacity];
+        m_capacity = capacity;
+        m_erased   = 0;
+
+        size_t mask = m_capacity - 1;
+        for (size_t old = 0; old < oldcapacity; old++) {
+            const Tk &key = oldslots[old].first;
+            if ((key == emptyKey()) || (key == erasedKey()))
+                continue;
+            size_t index = hash(key) & mask;
+            while (m_slots[index].first != emptyKey())
+                index = (index + 1) & mask;
+            m_slots[index] = oldslots[old];
+        }
+        delete [] oldslots;
+    }
+
+    HashMap (const HashMap&);             // Don't make copies of HashMaps!
+    HashMap& operator = (const HashMap&);
+
+    // Private data
+    Pair<Tk, Tv> *m_slots;    // The slot table; m_capacity is a power of two.
+    size_t        m_capacity; // Number of slots in the table.
+    size_t        m_count;    // Number of occupied slots.
+    size_t        m_erased;   // Number of slots marked as erased.
+};
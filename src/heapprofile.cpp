@@ -0,0 +1,576 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - pprof Heap Profile
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// VLDWriteHeapProfile writes the live blocks as a heap profile in the format
+// of pprof (github.com/google/pprof, proto/profile.proto): a gzip'd Profile
+// protobuf message. Each distinct call stack is a sample with two values, the
+// number of blocks it allocated and their bytes (sample types inuse_objects/
+// count and inuse_space/bytes). Its locations are the program counters of
+// its frames, innermost first; each distinct program counter is one location,
+// in the mapping of the module it's within. The mappings are the loaded
+// modules, with the PDB signature and age as their build ID, so that pprof
+// can symbolize an unsymbolized profile later. A symbolized profile also has
+// the functions and source lines of the locations.
+//
+// The messages are encoded by hand; only the fields listed below are written.
+
+#include "stdafx.h"
+#define VLDBUILD
+#include "gzipstream.h" // Provides the gzip compression of the profile.
+#include "vldheap.h"    // Provides internal new and delete operators.
+#include "vldint.h"     // Provides access to VLD internals.
+
+// Imported global variables.
+extern HeapMapLock g_heapMapLock;
+extern DbgHelp     g_DbgHelp;
+extern SymbolCache g_symbolCache;
+
+#define PROTO_WIRE_VARINT 0 // Wire type of integer fields.
+#define PROTO_WIRE_BYTES  2 // Wire type of length-delimited fields (strings, messages and packed integers).
+
+// Fields of the Profile message.
+#define PPROF_PROFILE_SAMPLE_TYPE         1
+#define PPROF_PROFILE_SAMPLE              2
+#define PPROF_PROFILE_MAPPING             3
+#define PPROF_PROFILE_LOCATION            4
+#define PPROF_PROFILE_FUNCTION            5
+#define PPROF_PROFILE_STRING_TABLE        6
+#define PPROF_PROFILE_TIME_NANOS          9
+#define PPROF_PROFILE_DEFAULT_SAMPLE_TYPE 14
+
+#define PPROF_FLUSH_SIZE 0x10000 // Bytes of encoded messages buffered before they are compressed.
+
+// Offset of the Unix epoch from the FILETIME epoch, in 100 ns units.
+#define PPROF_UNIX_EPOCH 116444736000000000ull
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The ProfileMessage Class
+//
+//    A ProfileMessage is a growable buffer a protobuf message is encoded into.
+//    Nested messages are encoded into a ProfileMessage of their own first,
+//    since their size precedes them. Integer fields which are 0 are left out,
+//    as with any proto3 message.
+//
+class ProfileMessage
+{
+public:
+    ProfileMessage () : m_data(NULL), m_size(0), m_capacity(0) {}
+    ~ProfileMessage () { delete [] m_data; }
+
+    const BYTE* Data () const { return m_data; }
+    size_t Size () const { return m_size; }
+    VOID Clear () { m_size = 0; }
+
+    // Append - Appends fields which are already encoded.
+    VOID Append (const ProfileMessage &fields) { append(fields.m_data, fields.m_size); }
+
+    // Bytes - Encodes a length-delimited field.
+    VOID Bytes (UINT32 field, LPCVOID data, size_t size)
+    {
+        putVarint(((UINT64)field << 3) | PROTO_WIRE_BYTES);
+        putVarint(size);
+        append(data, size);
+    }
+
+    // Message - Encodes a nested message.
+    VOID Message (UINT32 field, const ProfileMessage &message) { Bytes(field, message.m_data, message.m_size); }
+
+    // Packed - Encodes a repeated integer field, packed.
+    VOID Packed (UINT32 field, const UINT64 *values, UINT32 count)
+    {
+        size_t size = 0;
+        for (UINT32 index = 0; index < count; index++)
+            size += varintSize(values[index]);
+        putVarint(((UINT64)field << 3) | PROTO_WIRE_BYTES);
+        putVarint(size);
+        for (UINT32 index = 0; index < count; index++)
+            putVarint(values[index]);
+    }
+
+    // Varint - Encodes an integer field.
+    VOID Varint (UINT32 field, UINT64 value)
+    {
+        if (value == 0)
+            return;
+        putVarint(((UINT64)field << 3) | PROTO_WIRE_VARINT);
+        putVarint(value);
+    }
+
+private:
+    // Don't allow this!!
+    ProfileMessage (const ProfileMessage &other);
+    ProfileMessage& operator = (const ProfileMessage &other);
+
+    VOID append (LPCVOID data, size_t size)
+    {
+        if (m_size + size > m_capacity) {
+            size_t capacity = max(m_capacity * 2, max(m_size + size, (size_t)256));
+            BYTE *buffer = new BYTE [capacity];
+            if (m_size > 0)
+                memcpy(buffer, m_data, m_size);
+            delete [] m_data;
+            m_data = buffer;
+            m_capacity = capacity;
+        }
+        if (size > 0)
+            memcpy(m_data + m_size, data, size);
+        m_size += size;
+    }
+
+    VOID putVarint (UINT64 value)
+    {
+        BYTE bytes [10];
+        UINT32 count = 0;
+        do {
+            bytes[count] = (BYTE)(value & 0x7F);
+            value >>= 7;
+            if (value != 0)
+                bytes[count] |= 0x80;
+            count++;
+        } while (value != 0);
+        append(bytes, count);
+    }
+
+    static size_t varintSize (UINT64 value)
+    {
+        size_t size = 1;
+        while (value >= 0x80) {
+            value >>= 7;
+            size++;
+        }
+        return size;
+    }
+
+    BYTE   *m_data;
+    size_t  m_size;
+    size_t  m_capacity;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The HeapProfileWriter Class
+//
+//    Writes the messages of a profile to its gzip stream, numbering the
+//    strings, mappings, locations and functions as they are first referred
+//    to. Strings are told apart by address, which is enough since the symbol
+//    cache and the module table hold one copy of each.
+//
+class HeapProfileWriter
+{
+public:
+    HeapProfileWriter (GzipStream &gzip, ModuleSet *modules);
+    ~HeapProfileWriter () { delete [] m_buffer; }
+
+    VOID Finish (UINT64 defaultType);
+    UINT64 Location (UINT_PTR programCounter, const symbolinfo_t *symbol);
+    VOID Mappings (BOOL symbolized);
+    VOID Sample (const UINT64 *locations, UINT32 count, const UINT64 *values);
+    UINT64 ValueType (UINT32 field, LPCSTR type, LPCSTR unit);
+
+private:
+    // Don't allow this!!
+    HeapProfileWriter (const HeapProfileWriter &other);
+    HeapProfileWriter& operator = (const HeapProfileWriter &other);
+
+    VOID flush (bool force);
+    UINT64 function (const symbolinfo_t *symbol);
+    UINT64 literal (LPCSTR string);
+    UINT64 string (LPCWSTR string);
+
+    GzipStream                 &m_gzip;
+    ModuleSet                  *m_modules;
+    ProfileMessage              m_profile;     // Fields of the Profile message not compressed yet.
+    ProfileMessage              m_message;     // The message being encoded.
+    ProfileMessage              m_line;        // The Line message of the location being encoded.
+    ProfileMessage              m_strings;     // The string_table fields, written last.
+    UINT64                      m_stringCount;
+    HashMap<LPCWSTR, UINT64>    m_stringIds;
+    HashMap<LPCVOID, UINT64>    m_mappingIds;  // Mapping IDs, by module base address.
+    HashMap<UINT_PTR, UINT64>   m_locationIds; // Location IDs, by program counter.
+    UINT64                      m_locationCount;
+    HashMap<LPCWSTR, UINT64>    m_functionIds; // Function IDs, by function name.
+    UINT64                      m_functionCount;
+    char                       *m_buffer;      // Holds the UTF-8 conversion of a string.
+    int                         m_capacity;    // Size of the buffer, in bytes.
+};
+
+// Constructor - Starts the string table with the empty string, string 0.
+HeapProfileWriter::HeapProfileWriter (GzipStream &gzip, ModuleSet *modules)
+    : m_gzip(gzip), m_modules(modules), m_stringCount(0), m_locationCount(0),
+      m_functionCount(0), m_buffer(NULL), m_capacity(0)
+{
+    literal("");
+}
+
+// flush - Compresses the fields of the Profile message encoded so far, once
+//   there are enough of them, or if forced to.
+VOID HeapProfileWriter::flush (bool force)
+{
+    if (force || (m_profile.Size() >= PPROF_FLUSH_SIZE)) {
+        m_gzip.Write(m_profile.Data(), m_profile.Size());
+        m_profile.Clear();
+    }
+}
+
+// literal - Adds a string to the string table.
+//
+//  - string (IN): The string, in UTF-8.
+//
+//  Return Value:
+//
+//    Returns the string's index in the string table.
+//
+UINT64 HeapProfileWriter::literal (LPCSTR string)
+{
+    m_strings.Bytes(PPROF_PROFILE_STRING_TABLE, string, strlen(string));
+    return m_stringCount++;
+}
+
+// string - Adds a string to the string table, unless it's in it already.
+//
+//  - string (IN): The string, or NULL for the empty string.
+//
+//  Return Value:
+//
+//    Returns the string's index in the string table.
+//
+UINT64 HeapProfileWriter::string (LPCWSTR string)
+{
+    if ((string == NULL) || (*string == L'\0'))
+        return 0;
+    HashMap<LPCWSTR, UINT64>::Iterator it = m_stringIds.find(string);
+    if (it != m_stringIds.end())
+        return (*it).second;
+
+    int length = WideCharToMultiByte(CP_UTF8, 0, string, -1, NULL, 0, NULL, NULL);
+    if (length > m_capacity) {
+        delete [] m_buffer;
+        m_capacity = max(length, 256);
+        m_buffer = new char [m_capacity];
+    }
+    if ((length <= 0) || (WideCharToMultiByte(CP_UTF8, 0, string, -1, m_buffer, m_capacity, NULL, NULL) <= 0))
+        return 0;
+    UINT64 index = literal(m_buffer);
+    m_stringIds.insert(string, index);
+    return index;
+}
+
+// ValueType - Writes a ValueType message: a sample type.
+//
+//  - field (IN): The field of the Profile message it is.
+//
+//  - type (IN): The type of the values.
+//
+//  - unit (IN): The unit of the values.
+//
+//  Return Value:
+//
+//    Returns the index of the type in the string table.
+//
+UINT64 HeapProfileWriter::ValueType (UINT32 field, LPCSTR type, LPCSTR unit)
+{
+    UINT64 typeindex = literal(type);
+    m_message.Clear();
+    m_message.Varint(1, typeindex);      // type
+    m_message.Varint(2, literal(unit));  // unit
+    m_profile.Message(field, m_message);
+    return typeindex;
+}
+
+// Mappings - Writes a Mapping message for each loaded module. The build ID
+//   is the key symbol servers file the module's PDB under: the signature and
+//   the age, in hex.
+//
+//  - symbolized (IN): If TRUE, the locations of the profile will have their
+//      functions.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID HeapProfileWriter::Mappings (BOOL symbolized)
+{
+    UINT64 id = 0;
+    for (ModuleSet::Iterator moduleit = m_modules->begin(); moduleit != m_modules->end(); ++moduleit) {
+        const moduleinfo_t &moduleinfo = *moduleit;
+        m_message.Clear();
+        m_message.Varint(1, ++id);                               // id
+        m_message.Varint(2, moduleinfo.addrLow);                 // memory_start
+        m_message.Varint(3, moduleinfo.addrHigh + 1);            // memory_limit
+        m_message.Varint(5, string(moduleinfo.path));    // filename
+        if (moduleinfo.pdbAge != 0) {
+            const GUID &guid = moduleinfo.pdbGuid;
+            char buildid [64];
+            sprintf_s(buildid, _countof(buildid), "%08lX%04X%04X%02X%02X%02X%02X%02X%02X%02X%02X%lX",
+                guid.Data1, guid.Data2, guid.Data3, guid.Data4[0], guid.Data4[1], guid.Data4[2], guid.Data4[3],
+                guid.Data4[4], guid.Data4[5], guid.Data4[6], guid.Data4[7], moduleinfo.pdbAge);
+            m_message.Varint(6, literal(buildid));               // build_id
+        }
+        m_message.Varint(7, symbolized ? 1 : 0);                 // has_functions
+        m_message.Varint(8, symbolized ? 1 : 0);                 // has_filenames
+        m_message.Varint(9, symbolized ? 1 : 0);                 // has_line_numbers
+        m_profile.Message(PPROF_PROFILE_MAPPING, m_message);
+        m_mappingIds.insert((LPCVOID)moduleinfo.addrLow, id);
+    }
+    flush(false);
+}
+
+// function - Writes the Function message of a symbol, unless it was written
+//   already.
+//
+//  - symbol (IN): The symbol.
+//
+//  Return Value:
+//
+//    Returns the function's ID.
+//
+UINT64 HeapProfileWriter::function (const symbolinfo_t *symbol)
+{
+    bool inserted = false;
+    HashMap<LPCWSTR, UINT64>::Iterator it = m_functionIds.insert(symbol->functionName, m_functionCount + 1,
+        inserted);
+    if (!inserted)
+        return (*it).second;
+
+    UINT64 id = ++m_functionCount;
+    UINT64 name = string(symbol->functionName);
+    ProfileMessage function;
+    function.Varint(1, id);                         // id
+    function.Varint(2, name);                       // name
+    function.Varint(3, name);                       // system_name
+    function.Varint(4, string(symbol->fileName));   // filename
+    m_profile.Message(PPROF_PROFILE_FUNCTION, function);
+    return id;
+}
+
+// Location - Writes the Location message of a program counter, unless it was
+//   written already.
+//
+//  - programCounter (IN): The program counter.
+//
+//  - symbol (IN): The symbol of the program counter, or NULL if the profile
+//      isn't symbolized.
+//
+//  Return Value:
+//
+//    Returns the location's ID.
+//
+UINT64 HeapProfileWriter::Location (UINT_PTR programCounter, const symbolinfo_t *symbol)
+{
+    // The HashMap reserves keys 0 and 1, which can't be code anyway.
+    if (programCounter <= 1)
+        programCounter = 2;
+    bool inserted = false;
+    HashMap<UINT_PTR, UINT64>::Iterator it = m_locationIds.insert(programCounter, m_locationCount + 1, inserted);
+    if (!inserted)
+        return (*it).second;
+
+    UINT64 id = ++m_locationCount;
+    UINT64 functionid = 0;
+    if (symbol != NULL)
+        functionid = function(symbol);
+
+    moduleinfo_t moduleinfo;
+    moduleinfo.addrLow  = programCounter;
+    moduleinfo.addrHigh = programCounter;
+    moduleinfo.flags    = 0;
+    ModuleSet::Iterator moduleit = m_modules->find(moduleinfo);
+
+    m_message.Clear();
+    m_message.Varint(1, id);                                                // id
+    if (moduleit != m_modules->end())
+        m_message.Varint(2, (*m_mappingIds.find((LPCVOID)(*moduleit).addrLow)).second); // mapping_id
+    m_message.Varint(3, programCounter);                                    // address
+    if (symbol != NULL) {
+        m_line.Clear();
+        m_line.Varint(1, functionid);                                       // function_id
+        if (symbol->fileName != NULL)
+            m_line.Varint(2, symbol->lineNumber);                           // line
+        m_message.Message(4, m_line);                                       // line
+    }
+    m_profile.Message(PPROF_PROFILE_LOCATION, m_message);
+    return id;
+}
+
+// Sample - Writes a Sample message.
+//
+//  - locations (IN): The IDs of the locations of the sample's call stack,
+//      innermost first.
+//
+//  - count (IN): The number of locations.
+//
+//  - values (IN): The number of blocks and their bytes.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID HeapProfileWriter::Sample (const UINT64 *locations, UINT32 count, const UINT64 *values)
+{
+    m_message.Clear();
+    m_message.Packed(1, locations, count);  // location_id
+    m_message.Packed(2, values, 2);         // value
+    m_profile.Message(PPROF_PROFILE_SAMPLE, m_message);
+    flush(false);
+}
+
+// Finish - Writes the last fields of the Profile message: the string table,
+//   the time the profile was written and the sample type pprof shows.
+//
+//  - defaultType (IN): The string index of the type of the sample type shown.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID HeapProfileWriter::Finish (UINT64 defaultType)
+{
+    FILETIME time;
+    GetSystemTimeAsFileTime(&time);
+    UINT64 ticks = ((UINT64)time.dwHighDateTime << 32) | time.dwLowDateTime;
+    m_profile.Varint(PPROF_PROFILE_TIME_NANOS, (ticks - PPROF_UNIX_EPOCH) * 100);
+    m_profile.Varint(PPROF_PROFILE_DEFAULT_SAMPLE_TYPE, defaultType);
+    m_profile.Append(m_strings);
+    flush(true);
+}
+
+// WriteHeapProfile - Writes the live blocks to a file, as a pprof heap
+//   profile (see above). Blocks the CRT uses internally aren't in it.
+//
+//  - path (IN): The file to write the profile to.
+//
+//  - symbolize (IN): If TRUE, the profile has the functions and source lines
+//      of the frames, as the leak report shows them. Otherwise it only has
+//      the program counters and the modules, and writing it doesn't touch
+//      dbghelp at all.
+//
+//  Return Value:
+//
+//    Returns TRUE if the profile was written.
+//
+BOOL VisualLeakDetector::WriteHeapProfile (LPCWSTR path, BOOL symbolize)
+{
+    FileStream file;
+    if (!file.Open(path, FALSE)) {
+        Report(L"WARNING: Visual Leak Detector: Couldn't open heap profile for writing: %s\n", path);
+        return FALSE;
+    }
+    GzipStream gzip;
+    if (!gzip.Open(&file)) {
+        file.Close();
+        return FALSE;
+    }
+
+    flushAllPendingBlocks();
+    CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+    CriticalSectionLocker<> ml(m_modulesLock);
+
+    // Number the distinct call stacks of the live blocks, then add up the
+    // blocks and bytes of each. The last pair of values is for the blocks
+    // without a call stack.
+    HashMap<CallStack*, UINT32> stackIndices;
+    for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
+        BlockMap *blockmap = &(*heapit).second->blockMap;
+        for (BlockMap::Iterator blockit = blockmap->begin(); blockit != blockmap->end(); ++blockit) {
+            CallStack *callstack = (*blockit).second->callStack;
+            if (callstack != NULL)
+                stackIndices.insert(callstack, (UINT32)stackIndices.size());
+        }
+    }
+    UINT32 stackCount = (UINT32)stackIndices.size();
+    UINT64 *values = new UINT64 [2 * (stackCount + 1)];
+    memset(values, 0, 2 * (stackCount + 1) * sizeof(UINT64));
+    for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
+        BlockMap *blockmap = &(*heapit).second->blockMap;
+        for (BlockMap::Iterator blockit = blockmap->begin(); blockit != blockmap->end(); ++blockit) {
+            LPCVOID block = (*blockit).first;
+            blockinfo_t *info = (*blockit).second;
+            SIZE_T size = info->size;
+            if (isDebugCrtAlloc(block, info)) {
+                int blockUse = getCrtBlockUse(block, info);
+                if (CRT_USE_TYPE(blockUse) == CRT_USE_FREE ||
+                    CRT_USE_TYPE(blockUse) == CRT_USE_INTERNAL)
+                    continue;
+                size = getCrtBlockSize(block, info);
+            }
+            UINT32 index = stackCount;
+            if (info->callStack != NULL)
+                index = (*stackIndices.find(info->callStack)).second;
+            values[2 * index]++;
+            values[2 * index + 1] += size;
+        }
+    }
+
+    CallStack **stacks = new CallStack* [stackCount + 1];
+    UINT32 maxFrames = 0;
+    for (HashMap<CallStack*, UINT32>::Iterator it = stackIndices.begin(); it != stackIndices.end(); ++it) {
+        stacks[(*it).second] = (*it).first;
+        maxFrames = max(maxFrames, (*it).first->size());
+    }
+    UINT64 *locations = new UINT64 [maxFrames + 1];
+    UINT32 *frames = new UINT32 [maxFrames + 1];
+    const symbolinfo_t **symbols = new const symbolinfo_t* [maxFrames + 1];
+
+    HeapProfileWriter writer(gzip, m_loadedModules);
+    writer.ValueType(PPROF_PROFILE_SAMPLE_TYPE, "inuse_objects", "count");
+    UINT64 space = writer.ValueType(PPROF_PROFILE_SAMPLE_TYPE, "inuse_space", "bytes");
+    writer.Mappings(symbolize);
+    for (UINT32 index = 0; index < stackCount; index++) {
+        if (values[2 * index] == 0)
+            continue;
+        CallStack *stack = stacks[index];
+        UINT32 count = 0;
+        if (symbolize) {
+            // Same frames as the structured reports show.
+            CriticalSectionLocker<DbgHelp> locker(g_DbgHelp);
+            count = selectStructuredFrames(stack, locker, frames, symbols);
+            for (UINT32 frame = 0; frame < count; frame++) {
+                locations[frame] = writer.Location((*stack)[frames[frame]], symbols[frame]);
+            }
+        }
+        else {
+            for (UINT32 frame = 0; frame < stack->size(); frame++) {
+                if (!isVldAddress((*stack)[frame]))
+                    locations[count++] = writer.Location((*stack)[frame], NULL);
+            }
+        }
+        writer.Sample(locations, count, &values[2 * index]);
+    }
+    if (values[2 * stackCount] != 0)
+        writer.Sample(locations, 0, &values[2 * stackCount]);
+    writer.Finish(space);
+
+    delete [] symbols;
+    delete [] frames;
+    delete [] locations;
+    delete [] stacks;
+    delete [] values;
+
+    gzip.Close();
+    if (!file.Close()) {
+        Report(L"WARNING: Visual Leak Detector: Failed to write the heap profile: %s\n", path);
+        return FALSE;
+    }
+    return TRUE;
+}
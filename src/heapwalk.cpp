@@ -0,0 +1,140 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Heap Walk Tracking
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// With the HeapWalkTracking option, nothing is hooked: the allocations run no
+// VLD code at all. Instead, the heaps of the process are walked with HeapWalk
+// when VLD starts, and the blocks found are mapped and marked as reported.
+// Each later walk (at VLDTakeSnapshot, VLDReportLeaks and exit) brings the
+// block maps up to date: blocks which are gone are unmapped, and blocks which
+// are new, or were freed and reallocated with another size, are mapped, with
+// no call stack. So the leak report shows the blocks allocated since VLD
+// started, with their size and contents, like any other leaks.
+
+#include "stdafx.h"
+#define VLDBUILD
+#include "vldheap.h"    // Provides internal new and delete operators.
+#include "vldint.h"     // Provides access to VLD internals.
+
+// Imported global variables.
+extern HANDLE      g_vldHeap;
+extern HeapMapLock g_heapMapLock;
+
+// walkHeaps - Walks every heap of the process, but VLD's own, and updates the
+//   block maps with the blocks found (see above). Heaps which no longer exist
+//   are unmapped.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::walkHeaps ()
+{
+    // Heaps may be created while the handles are obtained.
+    DWORD capacity = 0;
+    HANDLE *heaps = NULL;
+    DWORD count = GetProcessHeaps(0, NULL);
+    while (count > capacity) {
+        delete [] heaps;
+        capacity = count + 16;
+        heaps = new HANDLE [capacity];
+        count = GetProcessHeaps(capacity, heaps);
+    }
+
+    // Unmap the heaps destroyed since the last walk, with their blocks.
+    HashMap<HANDLE, HANDLE> current;
+    for (DWORD index = 0; index < count; index++)
+        current.insert(heaps[index], heaps[index]);
+    HashMap<HANDLE, HANDLE> destroyed;
+    {
+        CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+        for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
+            // Pools (see TrackAlloc) are never among the heaps.
+            if (!VLD_IS_POOL_HEAP((*heapit).first) && (current.find((*heapit).first) == current.end()))
+                destroyed.insert((*heapit).first, (*heapit).first);
+        }
+    }
+    for (HashMap<HANDLE, HANDLE>::Iterator it = destroyed.begin(); it != destroyed.end(); ++it)
+        unmapHeap((*it).first);
+
+    for (DWORD index = 0; index < count; index++) {
+        if (heaps[index] != g_vldHeap)
+            walkHeap(heaps[index]);
+    }
+    delete [] heaps;
+    flushAllPendingBlocks();
+}
+
+// walkHeap - Walks one heap and updates its block map with the blocks found
+//   (see above). The heap is only locked while it's walked; its busy blocks
+//   are copied to a table on VLD's own heap, which is then compared with the
+//   block map.
+//
+//  - heap (IN): Handle to the heap.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::walkHeap (HANDLE heap)
+{
+    HashMap<LPCVOID, SIZE_T> live;
+    if (!HeapLock(heap))
+        return;
+    PROCESS_HEAP_ENTRY entry;
+    entry.lpData = NULL;
+    while (HeapWalk(heap, &entry)) {
+        if ((entry.wFlags & PROCESS_HEAP_ENTRY_BUSY) && (entry.lpData != NULL))
+            live.insert(entry.lpData, entry.cbData);
+    }
+    HeapUnlock(heap);
+
+    // Blocks which are mapped already, with the same size, are left alone.
+    // The others are gone, or were freed and reallocated since.
+    HashMap<LPCVOID, SIZE_T> stale;
+    {
+        CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+        HeapMap::Iterator heapit = m_heapMap->find(heap);
+        if (heapit != m_heapMap->end()) {
+            BlockMap *blockmap = &(*heapit).second->blockMap;
+            for (BlockMap::Iterator blockit = blockmap->begin(); blockit != blockmap->end(); ++blockit) {
+                HashMap<LPCVOID, SIZE_T>::Iterator liveit = live.find((*blockit).first);
+                if ((liveit != live.end()) && ((*liveit).second == (*blockit).second->size))
+                    live.erase(liveit);
+                else
+                    stale.insert((*blockit).first, (*blockit).second->size);
+            }
+        }
+    }
+
+    const context_t context = { 0 };
+    for (HashMap<LPCVOID, SIZE_T>::Iterator it = stale.begin(); it != stale.end(); ++it)
+        unmapBlock(heap, (*it).first, context);
+
+    // The blocks found are attributed to thread index 0, the unknown thread,
+    // and to no module.
+    capturedstack_t stack;
+    stack.skipped = true;
+    stack.keep = false;
+    for (HashMap<LPCVOID, SIZE_T>::Iterator it = live.begin(); it != live.end(); ++it)
+        mapBlock(heap, (*it).first, (*it).second, false, false, 0, MODULEIMAGE_NONE, stack);
+}
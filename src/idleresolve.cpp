@@ -0,0 +1,169 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Idle-Time Call Stack Resolver
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#define VLDBUILD
+#include "vldheap.h"    // Provides internal new and delete operators.
+#include "vldint.h"     // Provides access to VLD internals.
+#include "loaderlock.h"
+
+// Imported global variables.
+extern CallStackTable g_callStackTable;
+
+// startIdleResolve - Starts the thread which resolves the call stacks of
+//   long-lived blocks in the background, for the IdleResolve option. If the
+//   thread can't be started, call stacks are only resolved when they are
+//   reported.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::startIdleResolve ()
+{
+    m_idleResolveWake = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (m_idleResolveWake == NULL)
+        return;
+    m_idleResolveThread = CreateThread(NULL, 0, idleResolveProc, this, CREATE_SUSPENDED, &m_idleResolveThreadId);
+    if (m_idleResolveThread == NULL) {
+        CloseHandle(m_idleResolveWake);
+        m_idleResolveWake = NULL;
+        m_idleResolveThreadId = 0;
+        return;
+    }
+    // Resolving reads PDBs; the program comes first.
+    SetThreadPriority(m_idleResolveThread, THREAD_PRIORITY_LOWEST);
+    ResumeThread(m_idleResolveThread);
+}
+
+// stopIdleResolve - Stops resolving call stacks in the background. Like
+//   stopSymbolPrefetch, this never waits for the thread, which may be waiting
+//   for the loader lock held by the caller; it resolves nothing more once it
+//   sees that it has been stopped.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::stopIdleResolve ()
+{
+    if (m_idleResolveThread == NULL)
+        return;
+
+    m_idleResolveStop = TRUE;
+    SetEvent(m_idleResolveWake);
+    if (WaitForSingleObject(m_idleResolveThread, 0) == WAIT_OBJECT_0) {
+        CloseHandle(m_idleResolveWake);
+        m_idleResolveWake = NULL;
+    }
+    CloseHandle(m_idleResolveThread);
+    m_idleResolveThread = NULL;
+    m_idleResolveThreadId = 0;
+}
+
+// idleResolveProc - Resolves call stacks every IdleResolveInterval
+//   milliseconds until idle-time resolving is stopped. The stacks interned at
+//   one pass are remembered (by address only, without a reference) so that
+//   the next pass can tell which of them are still in use.
+//
+//  - param (IN): The VisualLeakDetector.
+//
+//  Return Value:
+//
+//    Always returns 0.
+//
+DWORD WINAPI VisualLeakDetector::idleResolveProc (LPVOID param)
+{
+    VisualLeakDetector *vld = (VisualLeakDetector*)param;
+    HANDLE wake = vld->m_idleResolveWake;
+    StackSet *seen = new StackSet;
+    while (WaitForSingleObject(wake, vld->m_idleResolveInterval) == WAIT_TIMEOUT) {
+        if (vld->m_idleResolveStop)
+            break;
+        seen = vld->resolveIdleStacks(seen);
+    }
+    delete seen;
+    return 0;
+}
+
+// resolveIdleStacks - Makes one pass of the idle-time resolver. The stacks
+//   which were already interned at the previous pass, still belong to a live
+//   block and aren't resolved yet are resolved, one at a time, each under the
+//   same locks, taken in the same order, as in ResolveCallstacks. The locks
+//   are handed back between stacks, and after every VLD_IDLE_RESOLVE_SLICE
+//   milliseconds of work the thread pauses for VLD_IDLE_RESOLVE_PAUSE
+//   milliseconds, so that the program's own symbol lookups and reports don't
+//   wait behind it for long.
+//
+//   Stacks which appear to be incomplete are left to the report, which
+//   prints a hint with them when it resolves them.
+//
+//  - seen (IN): The stacks interned at the previous pass. It's deleted.
+//
+//  Return Value:
+//
+//    Returns the stacks interned at this pass, to be passed to the next one.
+//
+StackSet* VisualLeakDetector::resolveIdleStacks (StackSet *seen)
+{
+    UINT32 capacity = g_callStackTable.Count();
+    CallStack **stacks = new CallStack* [capacity + 1];
+    UINT32 stackCount = g_callStackTable.Collect(stacks, capacity);
+
+    // With site statistics, the table keeps every stack interned, even the
+    // ones no block refers to anymore.
+    bool sitestats = (m_options & VLD_OPT_SITE_STATISTICS) != 0;
+    StackSet *interned = new StackSet;
+    interned->reserve(stackCount);
+    UINT32 candidates = 0;
+    for (UINT32 index = 0; index < stackCount; index++) {
+        CallStack *stack = stacks[index];
+        interned->insert(stack, true);
+        if (stack->isResolved() || stack->isIncomplete() || (seen->find(stack) == seen->end()) ||
+            (sitestats && (stack->getLiveBlocks() == 0))) {
+            g_callStackTable.Release(stack);
+            continue;
+        }
+        stacks[candidates++] = stack;
+    }
+    delete seen;
+
+    BOOL showinternalframes = m_options & VLD_OPT_TRACE_INTERNAL_FRAMES;
+    ULONGLONG sliceStart = GetTickCount64();
+    UINT32 index = 0;
+    for (; index < candidates; index++) {
+        if (GetTickCount64() - sliceStart >= VLD_IDLE_RESOLVE_SLICE) {
+            if (WaitForSingleObject(m_idleResolveWake, VLD_IDLE_RESOLVE_PAUSE) != WAIT_TIMEOUT)
+                break;
+            sliceStart = GetTickCount64();
+        }
+        LoaderLock ll;
+        if (m_idleResolveStop)
+            break;
+        stacks[index]->resolve(showinternalframes);
+    }
+    for (index = 0; index < candidates; index++)
+        g_callStackTable.Release(stacks[index]);
+    delete [] stacks;
+    return interned;
+}
@@ -0,0 +1,915 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - ImportPlans Class Implementation
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#define VLDBUILD
+#include "importplan.h" // This class' header.
+#include "vldheap.h"    // Provides internal new and delete operators.
+#include "vldint.h"     // Provides access to the real GetProcAddress.
+
+// Imported global variables.
+extern ImageDirectoryEntries g_Ide;
+
+// An IAT entry found by a scan, to be patched by commit.
+struct pendingslot_t {
+    DWORD_PTR     *slot;   // The IAT entry.
+    DWORD_PTR      saved;  // What it is to be restored to.
+    patchtarget_t *target; // The import it holds.
+    LPVOID         func;   // The import's real code, or NULL if the entry is patched already.
+};
+
+// What scanning one importing module found.
+struct importscan_t {
+    HMODULE                  module;   // The importing module.
+    IMAGE_IMPORT_DESCRIPTOR *imports;  // Its import directory, or NULL if it imports nothing.
+    pendingslot_t           *slots;    // The IAT entries found.
+    SIZE_T                   count;
+    SIZE_T                   capacity;
+    BOOL                     keyed;    // The key and path identify the module's image in the patch plan cache.
+    BOOL                     cached;   // The entries were found from the cache rather than by scanning.
+    vldplan_record_t         key;
+    WCHAR                    path [MAX_PATH];
+};
+
+// The modules being patched by PatchAll, shared with its helper threads. It is
+// freed by whoever drops the last reference, since a helper may only start
+// after PatchAll has returned.
+struct scanbatch_t {
+    const ImportPlans *plans;
+    importscan_t      *scans;      // The modules.
+    LONG               count;
+    volatile LONG      next;       // Index of the next module to be claimed.
+    volatile LONG      finished;   // Number of modules scanned.
+    volatile LONG      references; // One for PatchAll, and one for each helper thread.
+};
+
+// hashBytes - Adds bytes to an FNV-1a hash.
+//
+//  - hash (IN): The hash so far.
+//
+//  - bytes (IN): The bytes.
+//
+//  - size (IN): Number of bytes.
+//
+//  Return Value:
+//
+//    Returns the hash, bytes included.
+//
+static UINT32 hashBytes (UINT32 hash, LPCVOID bytes, SIZE_T size)
+{
+    const BYTE *byte = (const BYTE*)bytes;
+    for (SIZE_T index = 0; index < size; index++)
+        hash = (hash ^ byte[index]) * 16777619;
+    return hash;
+}
+
+// planPath - Obtains the image path which follows a cached plan's record.
+//
+//  - record (IN): The record.
+//
+//  Return Value:
+//
+//    Returns the path, which isn't NUL-terminated.
+//
+static WCHAR* planPath (vldplan_record_t &record)
+{
+    return (WCHAR*)(&record + 1);
+}
+
+// planSlots - Obtains the slots which follow a cached plan's path.
+//
+//  - record (IN): The record.
+//
+//  Return Value:
+//
+//    Returns the slots.
+//
+static vldplan_slot_t* planSlots (vldplan_record_t &record)
+{
+    return (vldplan_slot_t*)(planPath(record) + record.pathLength);
+}
+
+// Constructor - Initializes the plans as empty.
+//
+ImportPlans::ImportPlans ()
+{
+    m_targets       = NULL;
+    m_plans         = NULL;
+    m_resolved      = NULL;
+    m_resolvedCount = 0;
+    m_bases         = NULL;
+    m_baseCount     = 0;
+    m_signature     = 0;
+    m_cache         = NULL;
+    m_cachePath     = NULL;
+    m_cacheChanged  = FALSE;
+}
+
+// Destructor - Nothing is freed here: the plans live on VLD's private heap,
+//   which is gone by the time this runs, so VLD clears them before that.
+//
+ImportPlans::~ImportPlans ()
+{
+}
+
+// addPending - Adds an IAT entry to those found for a module.
+//
+//  - scan (IN/OUT): The module.
+//
+//  - pending (IN): The entry.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID ImportPlans::addPending (importscan_t &scan, const pendingslot_t &pending)
+{
+    if (scan.count == scan.capacity) {
+        SIZE_T capacity = max(scan.capacity * 2, (SIZE_T)16);
+        pendingslot_t *grown = new pendingslot_t [capacity];
+        if (scan.count > 0)
+            memcpy(grown, scan.slots, scan.count * sizeof(pendingslot_t));
+        delete [] scan.slots;
+        scan.slots = grown;
+        scan.capacity = capacity;
+    }
+    scan.slots[scan.count++] = pending;
+}
+
+// addTarget - Adds a patched import to the address lookup, unless an earlier
+//   patch table entry already claimed the address.
+//
+//  - address (IN): The address to look the import up by.
+//
+//  - target (IN): The patched import.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID ImportPlans::addTarget (LPVOID address, patchtarget_t *target)
+{
+    if (address != NULL)
+        m_targets->insert((UINT_PTR)address, target);
+}
+
+// Clear - Frees the resolved imports and every patch plan, without restoring
+//   anything.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID ImportPlans::Clear ()
+{
+    if (m_plans != NULL) {
+        for (HashMap<UINT_PTR, importplan_t*>::Iterator it = m_plans->begin(); it != m_plans->end(); ++it)
+            delete [] (BYTE*)(*it).second;
+        delete m_plans;
+        m_plans = NULL;
+    }
+    delete m_targets;
+    m_targets = NULL;
+    delete [] m_resolved;
+    m_resolved = NULL;
+    m_resolvedCount = 0;
+    delete [] m_bases;
+    m_bases = NULL;
+    m_baseCount = 0;
+}
+
+// Close - Replaces the patch plan cache file with one holding the plans made
+//   or used during this run, followed by those of the file which other runs
+//   made, if any plan was made. Called at shutdown, while the private heap is
+//   still there.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID ImportPlans::Close ()
+{
+    if (m_cachePath == NULL)
+        return;
+
+    if (m_cacheChanged) {
+        // Other processes may have replaced the file since it was read: the
+        // plans they made are merged in, and the new file is written next to
+        // it and then moved over it.
+        read(TRUE);
+        size_t length = wcslen(m_cachePath) + 16;
+        WCHAR *temppath = new WCHAR [length];
+        _snwprintf_s(temppath, length, _TRUNCATE, L"%s.%lu.tmp", m_cachePath, GetCurrentProcessId());
+        if (!write(temppath) || !MoveFileExW(temppath, m_cachePath, MOVEFILE_REPLACE_EXISTING)) {
+            Report(L"WARNING: Visual Leak Detector: The patch plan cache file %s could not be written (error=%lu).\n",
+                m_cachePath, GetLastError());
+            DeleteFileW(temppath);
+        }
+        delete [] temppath;
+    }
+
+    for (HashMap<UINT_PTR, cachedplan_t*>::Iterator it = m_cache->begin(); it != m_cache->end(); ++it)
+        delete [] (BYTE*)(*it).second;
+    delete m_cache;
+    m_cache = NULL;
+    delete [] m_cachePath;
+    m_cachePath = NULL;
+    m_cacheChanged = FALSE;
+}
+
+// Forget - Drops the patch plan of a module which is being unloaded.
+//
+//  - importmodule (IN): Handle (base address) of the module.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID ImportPlans::Forget (HMODULE importmodule)
+{
+    if (m_plans == NULL)
+        return;
+
+    HashMap<UINT_PTR, importplan_t*>::Iterator it = m_plans->find((UINT_PTR)importmodule);
+    if (it == m_plans->end())
+        return;
+    delete [] (BYTE*)(*it).second;
+    m_plans->erase(it);
+}
+
+// Open - Reads the patch plan cache file, if it exists, so that the modules
+//   whose images it holds plans for aren't scanned. From then on, the plans
+//   made by PatchAll are added to it too, to be written by Close.
+//
+//  - path (IN): Full path of the file.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID ImportPlans::Open (LPCWSTR path)
+{
+    size_t length = wcslen(path) + 1;
+    m_cachePath = new WCHAR [length];
+    wcscpy_s(m_cachePath, length, path);
+    m_cache = new HashMap<UINT_PTR, cachedplan_t*>;
+    read(FALSE);
+}
+
+// PatchAll - Patches all imports resolved by Resolve, which are imported by
+//   the specified modules, through to their respective replacements, and
+//   records each module's patch plan.
+//
+//   Every IAT entry is compared with the real addresses of all patched
+//   imports at once. Entries are matched by address rather than by the name
+//   of the export module they're imported from, so that imports through API
+//   sets, and forwarded exports, are patched as well.
+//
+//   Finding the entries to patch only reads the modules, so with many modules
+//   it is shared with helper threads. The caller holds the loader lock, which
+//   threads need in order to start, so helpers may well not get to run at
+//   all: the calling thread scans every module nobody else has claimed, and
+//   only waits for modules which a running helper is scanning. The entries
+//   are then patched by the calling thread alone.
+//
+//   Modules with a plan in the patch plan cache aren't scanned at all: the
+//   calling thread checks the planned entries instead.
+//
+//  - importmodules (IN): Handles (base addresses) of the modules which are to
+//      have their imports patched.
+//
+//  - count (IN): Number of modules.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID ImportPlans::PatchAll (HMODULE importmodules [], SIZE_T count)
+{
+    if ((m_targets == NULL) || (m_targets->size() == 0) || (count == 0))
+        return;
+
+    scanbatch_t *batch = new scanbatch_t;
+    batch->plans      = this;
+    batch->scans      = new importscan_t [count];
+    batch->count      = (LONG)count;
+    batch->next       = 0;
+    batch->finished   = 0;
+    batch->references = 1;
+    for (SIZE_T index = 0; index < count; index++) {
+        importscan_t &scan = batch->scans[index];
+        scan.module   = importmodules[index];
+        scan.slots    = NULL;
+        scan.count    = 0;
+        scan.capacity = 0;
+
+        // Whatever was planned for this address before belonged to a previous
+        // image of the module.
+        Forget(scan.module);
+
+        IMAGE_SECTION_HEADER *section = NULL;
+        ULONG                 size = 0;
+        scan.imports = (IMAGE_IMPORT_DESCRIPTOR*)g_Ide.ImageDirectoryEntryToDataEx(
+            (PVOID)GetCallingModule((UINT_PTR)scan.module), TRUE, IMAGE_DIRECTORY_ENTRY_IMPORT, &size, &section);
+
+        scan.keyed  = FALSE;
+        scan.cached = FALSE;
+        if ((m_cache != NULL) && (scan.imports != NULL) && imageKey(scan.module, scan.key)) {
+            DWORD length = GetModuleFileNameW(scan.module, scan.path, MAX_PATH);
+            if ((length != 0) && (length < MAX_PATH)) {
+                scan.key.signature  = m_signature;
+                scan.key.pathLength = length;
+                scan.keyed  = TRUE;
+                scan.cached = planFromCache(scan);
+            }
+        }
+    }
+
+    SYSTEM_INFO systeminfo;
+    GetSystemInfo(&systeminfo);
+    SIZE_T helpers = min(count / IMPORTPLAN_MODULES_PER_HELPER, (SIZE_T)IMPORTPLAN_MAX_HELPERS);
+    helpers = min(helpers, (SIZE_T)systeminfo.dwNumberOfProcessors - 1);
+    for (SIZE_T helper = 0; helper < helpers; helper++) {
+        InterlockedIncrement(&batch->references);
+        HANDLE thread = CreateThread(NULL, 0, scanProc, batch, 0, NULL);
+        if (thread == NULL) {
+            InterlockedDecrement(&batch->references);
+            break;
+        }
+        CloseHandle(thread);
+    }
+
+    runScans(batch);
+    while (batch->finished < batch->count) {
+        // A helper is still scanning a module it claimed.
+        SwitchToThread();
+    }
+
+    for (SIZE_T index = 0; index < count; index++) {
+        importscan_t &scan = batch->scans[index];
+        if (scan.keyed && !scan.cached)
+            remember(scan);
+        commit(scan);
+    }
+    releaseBatch(batch);
+}
+
+// Resolve - Resolves the real address of every import in the patch table,
+//   in its export module. Nothing is done unless an export module's base
+//   address changed since the last call.
+//
+//  - patchtable (IN): An array of moduleentry_t structures specifying all of
+//      the imports to patch.
+//
+//  - tablesize (IN): Size, in entries, of the patch table.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID ImportPlans::Resolve (moduleentry_t patchtable [], UINT tablesize)
+{
+    BOOL unchanged = (m_targets != NULL) && (m_baseCount == tablesize);
+    for (UINT index = 0; unchanged && (index < tablesize); index++)
+        unchanged = (m_bases[index] == patchtable[index].moduleBase);
+    if (unchanged)
+        return;
+
+    delete [] m_bases;
+    m_bases = new UINT_PTR [tablesize];
+    m_baseCount = tablesize;
+    SIZE_T count = 0;
+    for (UINT index = 0; index < tablesize; index++) {
+        m_bases[index] = patchtable[index].moduleBase;
+        for (patchentry_t *patchentry = patchtable[index].patchTable; patchentry->importName; patchentry++)
+            count++;
+    }
+
+    delete m_targets;
+    m_targets = new HashMap<UINT_PTR, patchtarget_t*>;
+    m_targets->reserve(count * 2);
+    delete [] m_resolved;
+    m_resolved = new patchtarget_t [max(count, (SIZE_T)1)];
+    m_resolvedCount = 0;
+
+    // Patch table order decides which entry patches an import that is listed
+    // more than once.
+    for (UINT index = 0; index < tablesize; index++) {
+        HMODULE exportmodule = (HMODULE)patchtable[index].moduleBase;
+        if (exportmodule == NULL)
+            continue;
+        for (patchentry_t *patchentry = patchtable[index].patchTable; patchentry->importName; patchentry++) {
+            // Get the *real* address of the import. If we find this address in
+            // an IAT, then we've found an entry that needs to be patched.
+            LPVOID import = VisualLeakDetector::_RGetProcAddress(exportmodule, patchentry->importName);
+            if (!import)
+                import = GetProcAddress(exportmodule, patchentry->importName);
+            LPVOID func = FindRealCode(import);
+            if (func == NULL)
+                continue;
+
+            patchtarget_t *target = &m_resolved[m_resolvedCount++];
+            target->patch   = patchentry;
+            target->address = import;
+            addTarget(func, target);
+            addTarget((LPVOID)patchentry->replacement, target);
+        }
+    }
+
+    // The cached plans refer to the imports by index, so they only apply to
+    // the same imports, resolved in the same export module images.
+    UINT32 signature = 2166136261;
+    for (UINT index = 0; index < tablesize; index++) {
+        vldplan_record_t exportkey = { 0 };
+        if (patchtable[index].moduleBase != NULL)
+            imageKey((HMODULE)patchtable[index].moduleBase, exportkey);
+        signature = hashBytes(signature, &exportkey, sizeof(exportkey));
+        for (patchentry_t *patchentry = patchtable[index].patchTable; patchentry->importName; patchentry++) {
+            if (IS_INTRESOURCE(patchentry->importName))
+                signature = hashBytes(signature, &patchentry->importName, sizeof(patchentry->importName));
+            else
+                signature = hashBytes(signature, patchentry->importName, strlen(patchentry->importName) + 1);
+        }
+    }
+    m_signature = hashBytes(signature, &m_resolvedCount, sizeof(m_resolvedCount));
+}
+
+// Restore - Restores the IAT entries patched by Patch to what they held before,
+//   and drops the module's patch plan.
+//
+//  - importmodule (IN): Handle (base address) of the module which is to have
+//      its imports restored.
+//
+//  Return Value:
+//
+//    Returns TRUE if the module's imports were restored. FALSE is returned if
+//    there is no plan for the module, or if the module at its address isn't the
+//    one the plan was made for; the caller should then restore the imports by
+//    walking them.
+//
+BOOL ImportPlans::Restore (HMODULE importmodule)
+{
+    if (m_plans == NULL)
+        return FALSE;
+
+    HashMap<UINT_PTR, importplan_t*>::Iterator it = m_plans->find((UINT_PTR)importmodule);
+    if (it == m_plans->end())
+        return FALSE;
+    importplan_t *plan = (*it).second;
+    m_plans->erase(it);
+
+    IMAGE_SECTION_HEADER *section = NULL;
+    ULONG                 size = 0;
+    IMAGE_IMPORT_DESCRIPTOR *imports = (IMAGE_IMPORT_DESCRIPTOR*)g_Ide.ImageDirectoryEntryToDataEx(
+        (PVOID)GetCallingModule((UINT_PTR)importmodule), TRUE, IMAGE_DIRECTORY_ENTRY_IMPORT, &size, &section);
+    if (imports != plan->imports) {
+        delete [] (BYTE*)plan;
+        return FALSE;
+    }
+
+    for (SIZE_T index = 0; index < plan->count; index++) {
+        patchslot_t &slot = plan->slots[index];
+        if (*slot.slot != (DWORD_PTR)slot.replacement)
+            continue;
+        DWORD protect;
+        if (VirtualProtect(slot.slot, sizeof(*slot.slot), PAGE_EXECUTE_READWRITE, &protect)) {
+            *slot.slot = slot.saved;
+            VirtualProtect(slot.slot, sizeof(*slot.slot), protect, &protect);
+        }
+    }
+    delete [] (BYTE*)plan;
+    return TRUE;
+}
+
+// commit - Patches the IAT entries found by scan, and records them as the
+//   module's patch plan.
+//
+//  - scan (IN): The module, as scanned.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID ImportPlans::commit (importscan_t &scan)
+{
+    SIZE_T planned = 0;
+    for (SIZE_T index = 0; index < scan.count; index++) {
+        pendingslot_t &pending = scan.slots[index];
+        if (pending.func != NULL) {
+            // Overwrite the address stored in the IAT entry with the address
+            // of the replacement. Note that the IAT entry may be
+            // write-protected, so we must first ensure that it is writable.
+            patchentry_t *patch = pending.target->patch;
+            if (patch->original != NULL)
+                *patch->original = pending.func;
+            DWORD protect;
+            if (!VirtualProtect(pending.slot, sizeof(*pending.slot), PAGE_EXECUTE_READWRITE, &protect))
+                continue;
+            *pending.slot = (DWORD_PTR)patch->replacement;
+            VirtualProtect(pending.slot, sizeof(*pending.slot), protect, &protect);
+        }
+        scan.slots[planned++] = pending;
+    }
+
+    if (planned > 0) {
+        importplan_t *plan = (importplan_t*)new BYTE [sizeof(importplan_t) + (planned - 1) * sizeof(patchslot_t)];
+        plan->imports = scan.imports;
+        plan->count = planned;
+        for (SIZE_T index = 0; index < planned; index++) {
+            plan->slots[index].slot        = scan.slots[index].slot;
+            plan->slots[index].saved       = scan.slots[index].saved;
+            plan->slots[index].replacement = scan.slots[index].target->patch->replacement;
+        }
+        if (m_plans == NULL)
+            m_plans = new HashMap<UINT_PTR, importplan_t*>;
+        m_plans->insert((UINT_PTR)scan.module, plan);
+    }
+    delete [] scan.slots;
+    scan.slots = NULL;
+}
+
+// hashKey - Hashes the identity of an image, for looking its plan up in the
+//   patch plan cache. Paths are compared regardless of case.
+//
+//  - key (IN): The image's key.
+//
+//  - path (IN): The image's path, of key.pathLength characters.
+//
+//  Return Value:
+//
+//    Returns the hash, which is never a reserved key of the HashMap.
+//
+UINT_PTR ImportPlans::hashKey (const vldplan_record_t &key, LPCWSTR path)
+{
+    UINT32 hash = 2166136261;
+    hash = hashBytes(hash, &key.signature, sizeof(key.signature));
+    hash = hashBytes(hash, &key.timeDateStamp, sizeof(key.timeDateStamp));
+    hash = hashBytes(hash, &key.checkSum, sizeof(key.checkSum));
+    hash = hashBytes(hash, &key.sizeOfImage, sizeof(key.sizeOfImage));
+    for (UINT32 index = 0; index < key.pathLength; index++) {
+        WCHAR character = towlower(path[index]);
+        hash = hashBytes(hash, &character, sizeof(character));
+    }
+    return (hash < 2) ? hash + 2 : hash;
+}
+
+// imageKey - Reads what identifies a module's image from its headers.
+//
+//  - module (IN): Handle (base address) of the module.
+//
+//  - key (OUT): Receives the image's time stamp, checksum and size. The other
+//      members are left alone.
+//
+//  Return Value:
+//
+//    Returns FALSE if the module's headers aren't valid.
+//
+BOOL ImportPlans::imageKey (HMODULE module, vldplan_record_t &key)
+{
+    const IMAGE_DOS_HEADER *dos = (const IMAGE_DOS_HEADER*)module;
+    if (dos->e_magic != IMAGE_DOS_SIGNATURE)
+        return FALSE;
+    const IMAGE_NT_HEADERS *nt = (const IMAGE_NT_HEADERS*)R2VA(module, dos->e_lfanew);
+    if (nt->Signature != IMAGE_NT_SIGNATURE)
+        return FALSE;
+    key.timeDateStamp = nt->FileHeader.TimeDateStamp;
+    key.checkSum      = nt->OptionalHeader.CheckSum;
+    key.sizeOfImage   = nt->OptionalHeader.SizeOfImage;
+    return TRUE;
+}
+
+// match - Finds out whether an IAT entry is to be patched, as scan does for
+//   every entry.
+//
+//  - slot (IN): The IAT entry.
+//
+//  - pending (OUT): Receives the entry, to be patched by commit.
+//
+//  Return Value:
+//
+//    Returns TRUE if the entry holds a patched import.
+//
+BOOL ImportPlans::match (DWORD_PTR *slot, pendingslot_t &pending) const
+{
+    DWORD_PTR raw = *slot;
+    LPVOID    func = NULL;
+    HashMap<UINT_PTR, patchtarget_t*>::Iterator it = m_targets->find(raw);
+    patchtarget_t *target = (it != m_targets->end()) ? (*it).second : NULL;
+    if ((target == NULL) || ((LPCVOID)raw != target->patch->replacement)) {
+        // Not patched yet. Match the import's real code, past any jump
+        // thunks, as VLD always has.
+        func = FindRealCode((LPVOID)raw);
+        it = m_targets->find((UINT_PTR)func);
+        if (it == m_targets->end())
+            return FALSE;
+        target = (*it).second;
+        if ((LPCVOID)func == target->patch->replacement)
+            return FALSE;
+    }
+    else {
+        // Patched already (the module is being attached again). It is
+        // restored to the import's real address.
+        raw = (DWORD_PTR)target->address;
+    }
+
+    pending.slot   = slot;
+    pending.saved  = raw;
+    pending.target = target;
+    pending.func   = func;
+    return TRUE;
+}
+
+// planFromCache - Finds the IAT entries of a module from its plan in the patch
+//   plan cache. The image is the same one, and its imports are resolved in
+//   the same export module images, so the same entries hold patched imports;
+//   each is still checked, in case it has been changed since the module was
+//   loaded.
+//
+//  - scan (IN/OUT): The module, with its key. The entries are stored in it.
+//
+//  Return Value:
+//
+//    Returns TRUE if the entries were found. FALSE is returned if the cache
+//    holds no plan for the image, or if an entry doesn't hold the import it
+//    was planned for; the module must then be scanned.
+//
+BOOL ImportPlans::planFromCache (importscan_t &scan)
+{
+    HashMap<UINT_PTR, cachedplan_t*>::Iterator it = m_cache->find(hashKey(scan.key, scan.path));
+    if (it == m_cache->end())
+        return FALSE;
+    cachedplan_t     *cached = (*it).second;
+    vldplan_record_t &record = cached->record;
+    if ((record.signature != scan.key.signature) || (record.timeDateStamp != scan.key.timeDateStamp) ||
+        (record.checkSum != scan.key.checkSum) || (record.sizeOfImage != scan.key.sizeOfImage) ||
+        (record.pathLength != scan.key.pathLength) || (_wcsnicmp(planPath(record), scan.path, record.pathLength) != 0))
+        return FALSE;
+
+    IMAGE_SECTION_HEADER *section = NULL;
+    ULONG                 size = 0;
+    BYTE *iat = (BYTE*)g_Ide.ImageDirectoryEntryToDataEx(
+        (PVOID)GetCallingModule((UINT_PTR)scan.module), TRUE, IMAGE_DIRECTORY_ENTRY_IAT, &size, &section);
+    if (iat == NULL)
+        return FALSE;
+
+    const vldplan_slot_t *slots = planSlots(record);
+    BOOL matched = TRUE;
+    for (UINT32 index = 0; matched && (index < record.slotCount); index++) {
+        DWORD_PTR *slot = (DWORD_PTR*)R2VA(scan.module, slots[index].rva);
+        pendingslot_t pending;
+        matched = ((BYTE*)slot >= iat) && ((BYTE*)(slot + 1) <= iat + size) &&
+            (slots[index].rva % sizeof(DWORD_PTR) == 0) && (slots[index].target < m_resolvedCount) &&
+            match(slot, pending) && (pending.target == &m_resolved[slots[index].target]);
+        if (matched)
+            addPending(scan, pending);
+    }
+    if (!matched) {
+        delete [] scan.slots;
+        scan.slots = NULL;
+        scan.count = scan.capacity = 0;
+        return FALSE;
+    }
+    cached->used = TRUE;
+    return TRUE;
+}
+
+// read - Reads the plans of the patch plan cache file. A file which isn't what
+//   it should be is ignored, and replaced by Close.
+//
+//  - merge (IN): If TRUE, only the plans for images which no plan is kept for
+//      already are added; otherwise, the file is read for the first time.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID ImportPlans::read (BOOL merge)
+{
+    HANDLE file = CreateFileW(m_cachePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        // Nothing planned yet.
+        return;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || (size.QuadPart < (LONGLONG)sizeof(vldplan_header_t)) ||
+        (size.QuadPart > IMPORTPLAN_CACHE_MAX_BYTES)) {
+        CloseHandle(file);
+        return;
+    }
+    BYTE *contents = new BYTE [size.LowPart];
+    DWORD bytesread = 0;
+    BOOL succeeded = ReadFile(file, contents, size.LowPart, &bytesread, NULL) && (bytesread == size.LowPart);
+    CloseHandle(file);
+
+    const vldplan_header_t *header = (const vldplan_header_t*)contents;
+    succeeded = succeeded && (header->magic == VLDPLAN_MAGIC) && (header->version == VLDPLAN_VERSION);
+    SIZE_T offset = sizeof(vldplan_header_t);
+    for (UINT32 index = 0; succeeded && (index < header->recordCount); index++) {
+        vldplan_record_t *record = (vldplan_record_t*)(contents + offset);
+        succeeded = (offset + sizeof(vldplan_record_t) <= bytesread) && (record->pathLength < MAX_PATH) &&
+            (record->slotCount <= IMPORTPLAN_CACHE_MAX_BYTES / sizeof(vldplan_slot_t));
+        if (!succeeded)
+            break;
+        SIZE_T recordsize = sizeof(vldplan_record_t) + record->pathLength * sizeof(WCHAR) +
+            record->slotCount * sizeof(vldplan_slot_t);
+        succeeded = (offset + recordsize <= bytesread);
+        if (!succeeded)
+            break;
+        offset += recordsize;
+
+        UINT_PTR hash = hashKey(*record, planPath(*record));
+        HashMap<UINT_PTR, cachedplan_t*>::Iterator it = m_cache->find(hash);
+        if (it != m_cache->end()) {
+            if (merge)
+                continue;
+            delete [] (BYTE*)(*it).second;
+            m_cache->erase(it);
+        }
+        if (m_cache->size() >= IMPORTPLAN_CACHE_MAX_PLANS)
+            continue;
+        cachedplan_t *cached = (cachedplan_t*)new BYTE [sizeof(cachedplan_t) - sizeof(vldplan_record_t) + recordsize];
+        cached->used = FALSE;
+        memcpy(&cached->record, record, recordsize);
+        m_cache->insert(hash, cached);
+    }
+    if (!succeeded || (offset != bytesread))
+        Report(L"WARNING: Visual Leak Detector: The patch plan cache file %s is invalid; it will be replaced.\n",
+            m_cachePath);
+    delete [] contents;
+}
+
+// releaseBatch - Drops a reference to a batch of scans, freeing it with the
+//   last one.
+//
+//  - batch (IN): The batch.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID ImportPlans::releaseBatch (scanbatch_t *batch)
+{
+    if (InterlockedDecrement(&batch->references) == 0) {
+        delete [] batch->scans;
+        delete batch;
+    }
+}
+
+// remember - Adds the plan found by scanning a module to the patch plan cache,
+//   in place of any plan kept for the module's image.
+//
+//  - scan (IN): The module, as scanned, with its key.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID ImportPlans::remember (const importscan_t &scan)
+{
+    SIZE_T recordsize = sizeof(vldplan_record_t) + scan.key.pathLength * sizeof(WCHAR) +
+        scan.count * sizeof(vldplan_slot_t);
+    cachedplan_t *cached = (cachedplan_t*)new BYTE [sizeof(cachedplan_t) - sizeof(vldplan_record_t) + recordsize];
+    cached->used = TRUE;
+    cached->record = scan.key;
+    cached->record.slotCount = (UINT32)scan.count;
+    memcpy(planPath(cached->record), scan.path, scan.key.pathLength * sizeof(WCHAR));
+    vldplan_slot_t *slots = planSlots(cached->record);
+    for (SIZE_T index = 0; index < scan.count; index++) {
+        slots[index].rva    = (UINT32)((BYTE*)scan.slots[index].slot - (BYTE*)scan.module);
+        slots[index].target = (UINT32)(scan.slots[index].target - m_resolved);
+    }
+
+    UINT_PTR hash = hashKey(scan.key, scan.path);
+    HashMap<UINT_PTR, cachedplan_t*>::Iterator it = m_cache->find(hash);
+    if (it != m_cache->end()) {
+        delete [] (BYTE*)(*it).second;
+        m_cache->erase(it);
+    }
+    m_cache->insert(hash, cached);
+    m_cacheChanged = TRUE;
+}
+
+// runScans - Scans modules of a batch until every module has been claimed.
+//
+//  - batch (IN): The batch.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID ImportPlans::runScans (scanbatch_t *batch)
+{
+    LONG index;
+    while ((index = InterlockedIncrement(&batch->next) - 1) < batch->count) {
+        batch->plans->scan(batch->scans[index]);
+        InterlockedIncrement(&batch->finished);
+    }
+}
+
+// scan - Finds the IAT entries of a module which are to be patched, without
+//   changing anything, so that several modules can be scanned at once.
+//
+//  - scan (IN/OUT): The module to scan. The entries found are stored in it.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID ImportPlans::scan (importscan_t &scan) const
+{
+    if (scan.imports == NULL) {
+        // This module has no IDT (i.e. it imports nothing).
+        return;
+    }
+    if (scan.cached) {
+        // The entries were found from the patch plan cache.
+        return;
+    }
+
+    for (IMAGE_IMPORT_DESCRIPTOR *idte = scan.imports; idte->FirstThunk != 0x0; idte++) {
+        IMAGE_THUNK_DATA *thunk = (IMAGE_THUNK_DATA*)R2VA(scan.module, idte->FirstThunk);
+        for (; thunk->u1.Function != 0x0; thunk++) {
+            pendingslot_t pending;
+            if (match(&thunk->u1.Function, pending))
+                addPending(scan, pending);
+        }
+    }
+}
+
+// scanProc - Helper thread procedure for PatchAll: scans modules of a batch
+//   which nobody has claimed yet.
+//
+//  - param (IN): The batch, with a reference held for this thread.
+//
+//  Return Value:
+//
+//    Returns 0.
+//
+DWORD WINAPI ImportPlans::scanProc (LPVOID param)
+{
+    scanbatch_t *batch = (scanbatch_t*)param;
+    runScans(batch);
+    releaseBatch(batch);
+    return 0;
+}
+
+// write - Writes the cached plans: those made or used during this run first,
+//   so that the plans of images no longer used are the ones dropped once the
+//   file holds IMPORTPLAN_CACHE_MAX_PLANS.
+//
+//  - path (IN): Full path of the file to write.
+//
+//  Return Value:
+//
+//    Returns true if the file has been written.
+//
+bool ImportPlans::write (LPCWSTR path) const
+{
+    HANDLE file = CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    // The header is written again once the number of records is known.
+    vldplan_header_t header = { VLDPLAN_MAGIC, VLDPLAN_VERSION, 0 };
+    DWORD written = 0;
+    bool succeeded = (WriteFile(file, &header, sizeof(header), &written, NULL) != FALSE);
+    for (int pass = 0; pass < 2; pass++) {
+        BOOL used = (pass == 0);
+        for (HashMap<UINT_PTR, cachedplan_t*>::Iterator it = m_cache->begin(); succeeded && (it != m_cache->end()); ++it) {
+            cachedplan_t *cached = (*it).second;
+            if ((cached->used != used) || (header.recordCount == IMPORTPLAN_CACHE_MAX_PLANS))
+                continue;
+            DWORD recordsize = (DWORD)(sizeof(vldplan_record_t) + cached->record.pathLength * sizeof(WCHAR) +
+                cached->record.slotCount * sizeof(vldplan_slot_t));
+            succeeded = (WriteFile(file, &cached->record, recordsize, &written, NULL) != FALSE);
+            header.recordCount++;
+        }
+    }
+    if (succeeded) {
+        succeeded = (SetFilePointer(file, 0, NULL, FILE_BEGIN) != INVALID_SET_FILE_POINTER) &&
+            (WriteFile(file, &header, sizeof(header), &written, NULL) != FALSE);
+    }
+    CloseHandle(file);
+    return succeeded;
+}
@@ -0,0 +1,188 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - ImportPlans Class Definition
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#ifndef VLDBUILD
+#error \
+    "This header should only be included by Visual Leak Detector when building it from source. \
+    Applications should never include this header."
+#endif
+
+#include <windows.h>
+#include "hashmap.h" // Provides an open-addressing hash map template.
+#include "utility.h" // Provides the patch table structures.
+
+#define IMPORTPLAN_MAX_HELPERS        7  // Most helper threads scanning modules for PatchAll.
+#define IMPORTPLAN_MODULES_PER_HELPER 16 // Modules to be scanned for each helper thread started.
+#define IMPORTPLAN_CACHE_MAX_PLANS    4096             // Most plans kept in the patch plan cache file.
+#define IMPORTPLAN_CACHE_MAX_BYTES    (32 * 1024 * 1024) // Larger patch plan cache files are ignored.
+
+// The on-disk layout of the file named by the "PatchPlanCache" option, in
+// which the patch plans made by one run are kept for the next ones.
+//
+// A patch plan cache file is a vldplan_header_t followed by recordCount
+// records, each a vldplan_record_t followed by the image path (pathLength
+// UTF-16 characters, without a NUL) and slotCount vldplan_slot_t. All values
+// are little-endian.
+//
+// A plan is identified by the path, time stamp, checksum and size of its
+// image, and by the signature of the patch table it was made against, which
+// covers the export modules the imports were resolved in. The slots are kept
+// as offsets from the image base and as indices of the resolved imports, so
+// that they stay valid whatever addresses the modules are loaded at.
+#define VLDPLAN_MAGIC   0x50444C56 // "VLDP"
+#define VLDPLAN_VERSION 1
+
+#pragma pack(push, 1)
+
+struct vldplan_header_t {
+    UINT32 magic;         // VLDPLAN_MAGIC.
+    UINT32 version;       // VLDPLAN_VERSION.
+    UINT32 recordCount;   // Number of records.
+};
+
+struct vldplan_record_t {
+    UINT32 signature;     // Signature of the resolved patch table (see Resolve).
+    UINT32 timeDateStamp; // From the image's file header.
+    UINT32 checkSum;      // From the image's optional header.
+    UINT32 sizeOfImage;   // From the image's optional header.
+    UINT32 pathLength;    // Characters in the image path.
+    UINT32 slotCount;     // Number of vldplan_slot_t following the path.
+};
+
+struct vldplan_slot_t {
+    UINT32 rva;           // Offset of the IAT entry from the image base.
+    UINT32 target;        // Index of the import it holds, in patch table order.
+};
+
+#pragma pack(pop)
+
+// An IAT entry of an importing module which has been patched.
+struct patchslot_t {
+    DWORD_PTR *slot;        // The IAT entry.
+    DWORD_PTR  saved;       // What the entry held before it was patched.
+    LPCVOID    replacement; // What it has been patched to.
+};
+
+// The patch plan of an importing module: every IAT entry which was patched
+// when VLD attached to it.
+struct importplan_t {
+    IMAGE_IMPORT_DESCRIPTOR *imports; // The module's import directory, which identifies the image planned for.
+    SIZE_T      count;     // Number of patched entries.
+    patchslot_t slots [1]; // The entries ("count" of them, allocated as needed).
+};
+
+// A patched import, as resolved in its export module.
+struct patchtarget_t {
+    patchentry_t *patch;   // The patch entry.
+    LPVOID        address; // The real address of the import.
+};
+
+// A plan of the patch plan cache, as kept in memory.
+struct cachedplan_t {
+    BOOL             used;   // Made or used by this process, so kept first when the file is written.
+    vldplan_record_t record; // Followed by the path and the slots, as in the file.
+};
+
+struct importscan_t;
+struct pendingslot_t;
+struct scanbatch_t;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The ImportPlans Class
+//
+//    ImportPlans patch the imports listed in the patch table into importing
+//    modules with a single pass over each module's Import Address Table (IAT).
+//    The real addresses of all patched imports are resolved once, whenever the
+//    export modules change, and each IAT entry is then looked up among them as
+//    a whole, instead of the IAT being walked again for every export module in
+//    the patch table.
+//
+//    Many modules are patched at once (see PatchAll): their IATs can then be
+//    scanned in parallel, and only be patched one after another.
+//
+//    The IAT entries patched in a module are kept as its plan, so that they
+//    can be restored without walking the imports again. A module which is
+//    unloaded must be forgotten, since a different module could be loaded at
+//    the same address.
+//
+//    With a patch plan cache (see Open), the plan of each module is also kept
+//    on disk for the next runs. A module whose image is found there has only
+//    the planned entries checked, instead of its whole IAT scanned: each must
+//    still hold the import it was planned for, or the module is scanned.
+//
+//    ImportPlans aren't synchronized; they're only used with the loader lock
+//    held.
+//
+class ImportPlans
+{
+public:
+    ImportPlans ();
+    ~ImportPlans ();
+
+    VOID Clear ();
+    VOID Close ();
+    VOID Forget (HMODULE importmodule);
+    BOOL IsOpen () const { return (m_cachePath != NULL); }
+    VOID Open (LPCWSTR path);
+    VOID PatchAll (HMODULE importmodules [], SIZE_T count);
+    VOID Resolve (moduleentry_t patchtable [], UINT tablesize);
+    BOOL Restore (HMODULE importmodule);
+
+private:
+    // Don't allow this!!
+    ImportPlans (const ImportPlans &other);
+    ImportPlans& operator = (const ImportPlans &other);
+
+    VOID addTarget (LPVOID address, patchtarget_t *target);
+    static VOID addPending (importscan_t &scan, const pendingslot_t &pending);
+    VOID commit (importscan_t &scan);
+    static UINT_PTR hashKey (const vldplan_record_t &key, LPCWSTR path);
+    static BOOL imageKey (HMODULE module, vldplan_record_t &key);
+    BOOL match (DWORD_PTR *slot, pendingslot_t &pending) const;
+    BOOL planFromCache (importscan_t &scan);
+    VOID read (BOOL merge);
+    VOID remember (const importscan_t &scan);
+    VOID scan (importscan_t &scan) const;
+    bool write (LPCWSTR path) const;
+    static VOID releaseBatch (scanbatch_t *batch);
+    static VOID runScans (scanbatch_t *batch);
+    static DWORD WINAPI scanProc (LPVOID param);
+
+    HashMap<UINT_PTR, patchtarget_t*> *m_targets; // Patched imports by real address (and by replacement), or NULL.
+    HashMap<UINT_PTR, importplan_t*>  *m_plans;   // Patch plans by importing module base address, or NULL.
+    patchtarget_t                    *m_resolved; // The patched imports, resolved by Resolve.
+    SIZE_T                            m_resolvedCount;
+    UINT_PTR                         *m_bases;    // The export module base addresses they were resolved for.
+    UINT                              m_baseCount;
+    UINT32                            m_signature; // Identifies the resolved imports and their export module images.
+    HashMap<UINT_PTR, cachedplan_t*> *m_cache;     // Cached plans by hashKey, or NULL without a cache file.
+    LPWSTR                            m_cachePath; // Full path of the patch plan cache file, or NULL.
+    BOOL                              m_cacheChanged; // Plans were made which the file doesn't hold.
+};
+
+// The patch plans of the modules VLD is attached to, defined along with the
+// other globals in vld.cpp.
+extern ImportPlans g_importPlans;
@@ -0,0 +1,300 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - InlineHook Class Implementation
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#define VLDBUILD
+#include "inlinehook.h" // This class' header.
+
+#define JMP_REL32_SIZE 5  // jmp rel32
+#define JMP_ABS64_SIZE 14 // jmp qword ptr [rip + 0], followed by the address
+
+// modRmSize - Returns the length of a ModRM operand (the ModRM byte, any SIB
+//   byte and any displacement), or 0 if the operand is RIP-relative.
+//
+//  - code (IN): The ModRM byte.
+//
+static SIZE_T modRmSize (const BYTE *code)
+{
+    BYTE mod = code[0] >> 6;
+    BYTE rm = code[0] & 0x07;
+    SIZE_T size = 1;
+    if (mod == 3)
+        return size;
+    if (rm == 4) {
+        // SIB byte; a base of 5 without mod means a 32-bit displacement.
+        size++;
+        if ((mod == 0) && ((code[1] & 0x07) == 5))
+            size += 4;
+    }
+    else if ((mod == 0) && (rm == 5)) {
+#ifdef _WIN64
+        // RIP-relative; it would have to be rewritten.
+        return 0;
+#else
+        size += 4;
+#endif
+    }
+    if (mod == 1)
+        size += 1;
+    else if (mod == 2)
+        size += 4;
+    return size;
+}
+
+// instructionSize - Decodes the length of one instruction of the simple kind
+//   found in function prologues.
+//
+//  - code (IN): The instruction.
+//
+//  Return Value:
+//
+//    Returns the length, in bytes, of the instruction, or 0 if it isn't one
+//    which can be moved as it is.
+//
+static SIZE_T instructionSize (const BYTE *code)
+{
+    SIZE_T prefixes = 0;
+    BOOL   operand16 = FALSE;
+    BOOL   rexw = FALSE;
+    if (code[0] == 0x66) {
+        operand16 = TRUE;
+        prefixes++;
+    }
+#ifdef _WIN64
+    if ((code[prefixes] & 0xF0) == 0x40) {
+        rexw = (code[prefixes] & 0x08) != 0;
+        prefixes++;
+    }
+#endif
+    const BYTE *op = code + prefixes;
+    SIZE_T immediate = operand16 ? 2 : 4;
+    SIZE_T modrm;
+
+    switch (op[0]) {
+    case 0x50: case 0x51: case 0x52: case 0x53: // push reg
+    case 0x54: case 0x55: case 0x56: case 0x57:
+    case 0x58: case 0x59: case 0x5A: case 0x5B: // pop reg
+    case 0x5C: case 0x5D: case 0x5E: case 0x5F:
+    case 0x90:                                  // nop
+    case 0xCC:                                  // int 3
+        return prefixes + 1;
+
+    case 0x6A:                                  // push imm8
+        return prefixes + 2;
+    case 0x68:                                  // push imm32
+        return prefixes + 1 + immediate;
+
+    case 0xB8: case 0xB9: case 0xBA: case 0xBB: // mov reg, imm
+    case 0xBC: case 0xBD: case 0xBE: case 0xBF:
+        return prefixes + 1 + (rexw ? 8 : immediate);
+
+    case 0x01: case 0x03: case 0x09: case 0x0B: // add, or
+    case 0x21: case 0x23: case 0x29: case 0x2B: // and, sub
+    case 0x31: case 0x33: case 0x39: case 0x3B: // xor, cmp
+    case 0x85: case 0x88: case 0x89: case 0x8A: // test, mov
+    case 0x8B: case 0x8D:                       // mov, lea
+        modrm = modRmSize(op + 1);
+        return (modrm != 0) ? prefixes + 1 + modrm : 0;
+
+    case 0x83:                                  // arithmetic r/m, imm8
+        modrm = modRmSize(op + 1);
+        return (modrm != 0) ? prefixes + 1 + modrm + 1 : 0;
+    case 0x81:                                  // arithmetic r/m, imm32
+        modrm = modRmSize(op + 1);
+        return (modrm != 0) ? prefixes + 1 + modrm + immediate : 0;
+    case 0xC7:                                  // mov r/m, imm32
+        if (((op[1] >> 3) & 0x07) != 0)
+            return 0;
+        modrm = modRmSize(op + 1);
+        return (modrm != 0) ? prefixes + 1 + modrm + immediate : 0;
+    case 0xFF:                                  // push r/m
+        if (((op[1] >> 3) & 0x07) != 6)
+            return 0;
+        modrm = modRmSize(op + 1);
+        return (modrm != 0) ? prefixes + 1 + modrm : 0;
+
+    case 0x0F:
+        if (op[1] == 0x1F) {                    // nop r/m
+            modrm = modRmSize(op + 2);
+            return (modrm != 0) ? prefixes + 2 + modrm : 0;
+        }
+        return 0;
+
+    default:
+        // Relative branches, and everything not known to be harmless.
+        return 0;
+    }
+}
+
+// allocateNear - Allocates executable memory within reach of a rel32 jump
+//   from an address.
+//
+//  - address (IN): The address.
+//
+//  Return Value:
+//
+//    Returns the memory, INLINEHOOK_REGION bytes of it, or NULL if none could
+//    be allocated.
+//
+static BYTE* allocateNear (const BYTE *address)
+{
+#ifdef _WIN64
+    // Try allocation granules below the address, then above it, up to 1 GB
+    // away.
+    UINT_PTR base = (UINT_PTR)address & ~(UINT_PTR)(INLINEHOOK_REGION - 1);
+    for (UINT_PTR distance = INLINEHOOK_REGION; distance < 0x40000000; distance += INLINEHOOK_REGION) {
+        if (base > distance) {
+            LPVOID memory = VirtualAlloc((LPVOID)(base - distance), INLINEHOOK_REGION, MEM_RESERVE | MEM_COMMIT,
+                PAGE_EXECUTE_READWRITE);
+            if (memory != NULL)
+                return (BYTE*)memory;
+        }
+        LPVOID memory = VirtualAlloc((LPVOID)(base + distance), INLINEHOOK_REGION, MEM_RESERVE | MEM_COMMIT,
+            PAGE_EXECUTE_READWRITE);
+        if (memory != NULL)
+            return (BYTE*)memory;
+    }
+    return NULL;
+#else
+    UNREFERENCED_PARAMETER(address);
+    return (BYTE*)VirtualAlloc(NULL, INLINEHOOK_REGION, MEM_RESERVE | MEM_COMMIT, PAGE_EXECUTE_READWRITE);
+#endif
+}
+
+// writeJump - Writes a rel32 jump.
+//
+//  - from (IN): Where the jump goes.
+//
+//  - to (IN): Where it jumps to, within 2 GB.
+//
+static VOID writeJump (BYTE *from, const BYTE *to)
+{
+    from[0] = 0xE9;
+    *(INT32*)(from + 1) = (INT32)(to - (from + JMP_REL32_SIZE));
+}
+
+// Constructor - Initializes the hook as not installed.
+//
+InlineHook::InlineHook ()
+{
+    m_target     = NULL;
+    m_trampoline = NULL;
+    m_patchSize  = 0;
+}
+
+// Install - Redirects a function to a detour. Afterwards, the original
+//   function is called through Trampoline().
+//
+//  - target (IN): The function to hook.
+//
+//  - detour (IN): The function calls are redirected to. It takes the same
+//      arguments, and calling convention, as the target.
+//
+//  Return Value:
+//
+//    Returns TRUE if the hook is installed. FALSE is returned if the target's
+//    prologue can't be moved, or no memory could be allocated near it, and
+//    always on ARM64, whose prologues the decoder can't read; the import
+//    patches are used there instead.
+//
+BOOL InlineHook::Install (LPVOID target, LPCVOID detour)
+{
+    if (IsInstalled() || (target == NULL))
+        return FALSE;
+#if defined(_M_ARM64)
+    UNREFERENCED_PARAMETER(detour);
+    return FALSE;
+#else
+
+    BYTE *code = (BYTE*)target;
+    SIZE_T patchsize = 0;
+    while (patchsize < JMP_REL32_SIZE) {
+        SIZE_T size = instructionSize(code + patchsize);
+        if ((size == 0) || (patchsize + size > INLINEHOOK_MAXPATCH))
+            return FALSE;
+        patchsize += size;
+    }
+
+    if (m_trampoline == NULL) {
+        // Memory from an earlier installation is reused.
+        m_trampoline = allocateNear(code);
+        if (m_trampoline == NULL)
+            return FALSE;
+    }
+
+    // The region begins with the trampoline: the moved prologue, and a jump
+    // back to the rest of the function.
+    BYTE *trampoline = m_trampoline;
+    memcpy(trampoline, code, patchsize);
+    writeJump(trampoline + patchsize, code + patchsize);
+
+    // The function jumps to the detour, which may be out of a rel32 jump's
+    // reach, through a stub after the trampoline.
+    BYTE *stub = trampoline + patchsize + JMP_REL32_SIZE;
+#ifdef _WIN64
+    stub[0] = 0xFF;
+    stub[1] = 0x25;
+    *(INT32*)(stub + 2) = 0;
+    *(LPCVOID*)(stub + 6) = detour;
+    FlushInstructionCache(GetCurrentProcess(), trampoline, patchsize + JMP_REL32_SIZE + JMP_ABS64_SIZE);
+#else
+    writeJump(stub, (const BYTE*)detour);
+    FlushInstructionCache(GetCurrentProcess(), trampoline, patchsize + JMP_REL32_SIZE * 2);
+#endif
+
+    DWORD protect;
+    if (!VirtualProtect(code, patchsize, PAGE_EXECUTE_READWRITE, &protect))
+        return FALSE;
+    memcpy(m_backup, code, patchsize);
+    // Pad with int 3, so nothing runs the remains of a moved instruction.
+    memset(code + JMP_REL32_SIZE, 0xCC, patchsize - JMP_REL32_SIZE);
+    writeJump(code, stub);
+    VirtualProtect(code, patchsize, protect, &protect);
+    FlushInstructionCache(GetCurrentProcess(), code, patchsize);
+
+    m_target = code;
+    m_patchSize = patchsize;
+    return TRUE;
+#endif
+}
+
+// Remove - Puts the hooked function's prologue back. The trampoline stays
+//   usable, for any thread still in it.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID InlineHook::Remove ()
+{
+    if (!IsInstalled())
+        return;
+
+    DWORD protect;
+    if (VirtualProtect(m_target, m_patchSize, PAGE_EXECUTE_READWRITE, &protect)) {
+        memcpy(m_target, m_backup, m_patchSize);
+        VirtualProtect(m_target, m_patchSize, protect, &protect);
+        FlushInstructionCache(GetCurrentProcess(), m_target, m_patchSize);
+    }
+    m_patchSize = 0;
+}
@@ -0,0 +1,75 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - InlineHook Class Definition
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#ifndef VLDBUILD
+#error \
+    "This header should only be included by Visual Leak Detector when building it from source. \
+    Applications should never include this header."
+#endif
+
+#include <windows.h>
+
+#define INLINEHOOK_MAXPATCH  32      // Most prologue bytes moved to a trampoline.
+#define INLINEHOOK_REGION    0x10000 // Size of the memory holding a hook's stub and trampoline.
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The InlineHook Class
+//
+//    An InlineHook redirects a function itself, rather than the imports of
+//    it, to a detour: the first instructions of the function are replaced by
+//    a jump. The instructions replaced are moved to a trampoline, followed by
+//    a jump back to the rest of the function, so that calling the trampoline
+//    calls the original function.
+//
+//    Only prologues made of simple instructions are moved; anything whose
+//    meaning depends on where it is (relative branches, RIP-relative
+//    operands), or which isn't known, makes Install fail, and the function is
+//    left alone.
+//
+//    The jump, and the trampoline, are within 2 GB of the function, in memory
+//    allocated for the hook. The memory is never freed, since a thread may
+//    still be running the trampoline after the hook is removed.
+//
+class InlineHook
+{
+public:
+    InlineHook ();
+
+    BOOL Install (LPVOID target, LPCVOID detour);
+    BOOL IsInstalled () const { return m_patchSize != 0; }
+    VOID Remove ();
+    LPVOID Trampoline () const { return m_trampoline; }
+
+private:
+    // Don't allow this!!
+    InlineHook (const InlineHook &other);
+    InlineHook& operator = (const InlineHook &other);
+
+    BYTE   *m_target;      // The hooked function.
+    BYTE   *m_trampoline;  // Calls the original function, or NULL if not installed.
+    SIZE_T  m_patchSize;   // Prologue bytes replaced, or 0 if not installed.
+    BYTE    m_backup [INLINEHOOK_MAXPATCH]; // The bytes replaced.
+};
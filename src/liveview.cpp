@@ -0,0 +1,290 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Live View Publisher
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#define VLDBUILD
+#include "liveview.h"   // Provides the live view layout.
+#include "vldheap.h"    // Provides internal new and delete operators.
+#include "vldint.h"     // Provides access to VLD internals.
+
+// Imported global variables.
+extern HeapMapLock    g_heapMapLock;
+extern CallStackTable g_callStackTable;
+
+// Live allocations of one call stack, gathered by publishLiveView.
+struct livestack_t {
+    CallStack *callStack; // The call stack, referenced until the update is written.
+    UINT64     blocks;
+    UINT64     bytes;
+};
+
+// compareHeapBytes, compareStackBytes - qsort callbacks ordering heaps and
+//   call stacks by decreasing live bytes.
+static int __cdecl compareHeapBytes (const void *first, const void *second)
+{
+    const vldlive_heap_t *a = *(const vldlive_heap_t* const*)first;
+    const vldlive_heap_t *b = *(const vldlive_heap_t* const*)second;
+    return (a->bytes > b->bytes) ? -1 : (a->bytes < b->bytes) ? 1 : 0;
+}
+
+static int __cdecl compareStackBytes (const void *first, const void *second)
+{
+    const livestack_t *a = *(const livestack_t* const*)first;
+    const livestack_t *b = *(const livestack_t* const*)second;
+    return (a->bytes > b->bytes) ? -1 : (a->bytes < b->bytes) ? 1 : 0;
+}
+
+// startLiveView - Creates the live view's shared memory section and the
+//   thread which keeps it up to date. If either can't be created, VLD runs
+//   without a live view.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::startLiveView ()
+{
+    swprintf_s(m_liveViewName, _countof(m_liveViewName), VLDLIVE_NAME_FORMAT, GetCurrentProcessId());
+    m_liveViewMapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(vldlive_t), m_liveViewName);
+    if (m_liveViewMapping == NULL) {
+        Report(L"WARNING: Visual Leak Detector: Couldn't create the live view %s (error %u).\n", m_liveViewName, GetLastError());
+        return;
+    }
+    m_liveView = (vldlive_t*)MapViewOfFile(m_liveViewMapping, FILE_MAP_WRITE, 0, 0, sizeof(vldlive_t));
+    m_liveViewWake = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if ((m_liveView == NULL) || (m_liveViewWake == NULL)) {
+        stopLiveView();
+        return;
+    }
+
+    ZeroMemory(m_liveView, sizeof(vldlive_t));
+    m_liveView->magic       = VLDLIVE_MAGIC;
+    m_liveView->version     = VLDLIVE_VERSION;
+    m_liveView->pointerSize = sizeof(LPVOID);
+    m_liveView->processId   = GetCurrentProcessId();
+    m_liveView->interval    = m_liveViewInterval;
+
+    m_liveViewThread = CreateThread(NULL, 0, liveViewProc, this, 0, &m_liveViewThreadId);
+    if (m_liveViewThread == NULL)
+        stopLiveView();
+}
+
+// stopLiveView - Stops updating the live view and releases it. Monitors
+//   which still have the section open keep the last update.
+//
+//   Note: This is called while the process shuts down, when the live view
+//     thread may already have been terminated. It never waits for the thread
+//     to exit, only for it to finish the update it may be writing. The lock
+//     is kept, since the thread may still be about to enter it.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::stopLiveView ()
+{
+    if (m_liveViewMapping == NULL)
+        return;
+
+    {
+        CriticalSectionLocker<> cs(m_liveViewLock);
+        m_liveViewStop = TRUE;
+    }
+    if (m_liveViewThread != NULL) {
+        SetEvent(m_liveViewWake);
+        if (WaitForSingleObject(m_liveViewThread, 0) == WAIT_OBJECT_0) {
+            CloseHandle(m_liveViewWake);
+            m_liveViewWake = NULL;
+        }
+        CloseHandle(m_liveViewThread);
+        m_liveViewThread = NULL;
+        m_liveViewThreadId = 0;
+    }
+    else if (m_liveViewWake != NULL) {
+        CloseHandle(m_liveViewWake);
+        m_liveViewWake = NULL;
+    }
+
+    if (m_liveView != NULL) {
+        UnmapViewOfFile(m_liveView);
+        m_liveView = NULL;
+    }
+    CloseHandle(m_liveViewMapping);
+    m_liveViewMapping = NULL;
+}
+
+// liveViewProc - Updates the live view every LiveViewInterval milliseconds
+//   until the live view is stopped.
+//
+//  - param (IN): The VisualLeakDetector.
+//
+//  Return Value:
+//
+//    Always returns 0.
+//
+DWORD WINAPI VisualLeakDetector::liveViewProc (LPVOID param)
+{
+    VisualLeakDetector *vld = (VisualLeakDetector*)param;
+    while (WaitForSingleObject(vld->m_liveViewWake, vld->m_liveViewInterval) == WAIT_TIMEOUT) {
+        CriticalSectionLocker<> cs(vld->m_liveViewLock);
+        if (vld->m_liveViewStop)
+            break;
+        vld->publishLiveView();
+    }
+    return 0;
+}
+
+// publishLiveView - Tallies the tracked blocks by heap and by call stack and
+//   writes the result to the live view. The heap map is walked one shard at a
+//   time, following each heap's serial number list, so allocating threads
+//   are only held up while their own shard is being counted. That also keeps
+//   the heap map itself from changing, since mapping or unmapping a heap
+//   needs every shard.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::publishLiveView ()
+{
+    LARGE_INTEGER frequency, begin, end;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&begin);
+
+    flushAllPendingBlocks();
+
+    HashMap<HANDLE, vldlive_heap_t*> heaps;
+    HashMap<CallStack*, livestack_t*> stacks;
+    for (UINT shard = 0; shard < BLOCKMAPSHARDS; shard++) {
+        CriticalSectionLocker<> cs(g_heapMapLock.ShardAt(shard));
+        for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
+            blockinfo_t *newest = (*heapit).second->newest[shard];
+            if (newest == NULL)
+                continue;
+
+            HANDLE heap = (*heapit).first;
+            HashMap<HANDLE, vldlive_heap_t*>::Iterator tallyit = heaps.find(heap);
+            vldlive_heap_t *heaptally;
+            if (tallyit == heaps.end()) {
+                heaptally = new vldlive_heap_t;
+                heaptally->heap = (UINT_PTR)heap;
+                heaptally->blocks = 0;
+                heaptally->bytes = 0;
+                heaps.insert(heap, heaptally);
+            }
+            else {
+                heaptally = (*tallyit).second;
+            }
+
+            for (blockinfo_t *info = newest; info != NULL; info = info->older) {
+                heaptally->blocks++;
+                heaptally->bytes += info->size;
+                if (!info->callStack)
+                    continue;
+
+                CallStack *callStack = info->callStack.get();
+                HashMap<CallStack*, livestack_t*>::Iterator stackit = stacks.find(callStack);
+                livestack_t *stacktally;
+                if (stackit == stacks.end()) {
+                    // Keep the stack alive once the shard is released, in
+                    // case its blocks are freed in the meantime.
+                    g_callStackTable.AddRef(callStack);
+                    stacktally = new livestack_t;
+                    stacktally->callStack = callStack;
+                    stacktally->blocks = 0;
+                    stacktally->bytes = 0;
+                    stacks.insert(callStack, stacktally);
+                }
+                else {
+                    stacktally = (*stackit).second;
+                }
+                stacktally->blocks++;
+                stacktally->bytes += info->size;
+            }
+        }
+    }
+
+    UINT64 blocks = 0;
+    UINT64 bytes = 0;
+    for (HashMap<HANDLE, vldlive_heap_t*>::Iterator it = heaps.begin(); it != heaps.end(); ++it) {
+        blocks += (*it).second->blocks;
+        bytes += (*it).second->bytes;
+    }
+
+    vldlive_heap_t **sortedheaps = new vldlive_heap_t* [heaps.size() + 1];
+    size_t heapCount = 0;
+    for (HashMap<HANDLE, vldlive_heap_t*>::Iterator it = heaps.begin(); it != heaps.end(); ++it)
+        sortedheaps[heapCount++] = (*it).second;
+    qsort(sortedheaps, heapCount, sizeof(vldlive_heap_t*), compareHeapBytes);
+
+    livestack_t **sortedstacks = new livestack_t* [stacks.size() + 1];
+    size_t stackCount = 0;
+    for (HashMap<CallStack*, livestack_t*>::Iterator it = stacks.begin(); it != stacks.end(); ++it)
+        sortedstacks[stackCount++] = (*it).second;
+    qsort(sortedstacks, stackCount, sizeof(livestack_t*), compareStackBytes);
+
+    SIZE_T allocations, current, peak, total;
+    readAllocTotals(allocations, current, peak, total);
+    vldlive_t *view = m_liveView;
+    InterlockedIncrement(&view->sequence);
+    MemoryBarrier();
+    GetSystemTimeAsFileTime(&view->timestamp);
+    view->allocations  = allocations;
+    view->currentBytes = current;
+    view->peakBytes    = peak;
+    view->totalBytes   = total;
+    view->blocks       = blocks;
+    view->bytes        = bytes;
+    view->heapCount    = (UINT32)heapCount;
+    view->stackCount   = (UINT32)stackCount;
+    view->heapsListed  = (UINT32)min(heapCount, (size_t)VLDLIVE_HEAPS);
+    view->stacksListed = (UINT32)min(stackCount, (size_t)VLDLIVE_STACKS);
+    for (UINT32 index = 0; index < view->heapsListed; index++)
+        view->heaps[index] = *sortedheaps[index];
+    for (UINT32 index = 0; index < view->stacksListed; index++) {
+        const livestack_t *tally = sortedstacks[index];
+        vldlive_stack_t &stack = view->stacks[index];
+        stack.hash       = tally->callStack->getHashValue();
+        stack.frameCount = tally->callStack->size();
+        stack.blocks     = tally->blocks;
+        stack.bytes      = tally->bytes;
+        UINT32 frame = 0;
+        for (; (frame < stack.frameCount) && (frame < VLDLIVE_FRAMES); frame++)
+            stack.frames[frame] = (*tally->callStack)[frame];
+        for (; frame < VLDLIVE_FRAMES; frame++)
+            stack.frames[frame] = 0;
+    }
+    QueryPerformanceCounter(&end);
+    view->updateTime = (UINT64)((end.QuadPart - begin.QuadPart) * 1000000 / frequency.QuadPart);
+    MemoryBarrier();
+    InterlockedIncrement(&view->sequence);
+
+    for (size_t index = 0; index < heapCount; index++)
+        delete sortedheaps[index];
+    delete [] sortedheaps;
+    for (size_t index = 0; index < stackCount; index++) {
+        g_callStackTable.Release(sortedstacks[index]->callStack);
+        delete sortedstacks[index];
+    }
+    delete [] sortedstacks;
+}
@@ -0,0 +1,95 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Live View Shared Memory Layout
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#pragma once
+
+// This header only describes the shared memory section published with
+// "LiveView = yes", so that monitors running in another process can include
+// it on its own.
+//
+// The section is named VLDLIVE_NAME_FORMAT, formatted with the ID of the
+// process being monitored, and holds a single vldlive_t. Visual Leak Detector
+// rewrites it every LiveViewInterval milliseconds. Each update increments
+// "sequence" before and after writing, so a reader takes a consistent copy
+// like this:
+//
+//   do {
+//       start = view->sequence;
+//       MemoryBarrier();
+//       memcpy(&copy, view, sizeof(copy));
+//       MemoryBarrier();
+//   } while ((start & 1) || (view->sequence != start));
+//
+// Addresses and sizes are always stored as 64 bits, even for 32-bit
+// processes, and every field is naturally aligned, so 32-bit and 64-bit
+// monitors see the same layout. Call stacks are identified by the hash shown
+// in the text report's "Leak Hash", and carry their innermost program
+// counters, unsymbolized.
+
+#include <windows.h>
+
+#define VLDLIVE_MAGIC       0x4C444C56 // "VLDL"
+#define VLDLIVE_VERSION     1
+#define VLDLIVE_NAME_FORMAT L"Local\\VisualLeakDetector_LiveView_%u"
+#define VLDLIVE_HEAPS       64         // Heaps listed, by decreasing live bytes.
+#define VLDLIVE_STACKS      64         // Call stacks listed, by decreasing live bytes.
+#define VLDLIVE_FRAMES      16         // Program counters kept per listed call stack.
+
+struct vldlive_heap_t {
+    UINT64   heap;         // Handle of the heap.
+    UINT64   blocks;       // Number of tracked blocks currently allocated from the heap.
+    UINT64   bytes;        // Total size of those blocks, in bytes.
+};
+
+struct vldlive_stack_t {
+    UINT32   hash;         // Hash of the call stack's frames.
+    UINT32   frameCount;   // Number of frames of the call stack (at most VLDLIVE_FRAMES are listed).
+    UINT64   blocks;       // Number of tracked blocks currently allocated from the call stack.
+    UINT64   bytes;        // Total size of those blocks, in bytes.
+    UINT64   frames [VLDLIVE_FRAMES]; // Program counters, innermost first.
+};
+
+struct vldlive_t {
+    UINT32   magic;        // VLDLIVE_MAGIC.
+    UINT32   version;      // VLDLIVE_VERSION.
+    UINT32   pointerSize;  // Pointer size of the process, in bytes (4 or 8).
+    UINT32   processId;    // ID of the process being monitored.
+    volatile LONG sequence; // Odd while an update is being written.
+    UINT32   interval;     // Milliseconds between updates.
+    FILETIME timestamp;    // UTC time of the last update.
+    UINT64   updateTime;   // Time the last update took, in microseconds.
+    UINT64   allocations;  // Number of allocations tracked so far.
+    UINT64   currentBytes; // Size of all tracked blocks, in bytes.
+    UINT64   peakBytes;    // Largest size ever held by the tracked blocks at once, in bytes.
+    UINT64   totalBytes;   // Total size of all tracked allocations so far, in bytes.
+    UINT64   blocks;       // Number of tracked blocks currently allocated.
+    UINT64   bytes;        // Total size of those blocks, as counted by the last update.
+    UINT32   heapCount;    // Number of heaps holding tracked blocks.
+    UINT32   stackCount;   // Number of distinct call stacks of the tracked blocks.
+    UINT32   heapsListed;  // Number of valid entries in "heaps".
+    UINT32   stacksListed; // Number of valid entries in "stacks".
+    vldlive_heap_t  heaps [VLDLIVE_HEAPS];
+    vldlive_stack_t stacks [VLDLIVE_STACKS];
+};
@@ -94,7 +94,10 @@ public:
 //  nature, this map class has a noticeable performance advantage over some
 //  other standard STL map implementations.
 //
-template <typename Tk, typename Tv>
+//  Lock is the lock policy of the underlying Tree. Use NoLock for maps which
+//  are only accessed under some other lock.
+//
+template <typename Tk, typename Tv, typename Lock = CriticalSection>
 class Map {
 public:
     class Iterator {
@@ -180,7 +183,7 @@ public:
         // 
         Iterator operator ++ ()
         {
-            typename Tree<Pair<Tk, Tv> >::node_t *cur = m_node;
+            typename Tree<Pair<Tk, Tv>, Lock>::node_t *cur = m_node;
 
             m_node = m_tree->next(m_node);
             return Iterator(m_tree, cur);
@@ -200,7 +203,7 @@ public:
         //
         Iterator operator - (SIZE_T num) const
         {
-            typename Tree<Pair<Tk, Tv> >::node_t *cur = m_node;
+            typename Tree<Pair<Tk, Tv>, Lock>::node_t *cur = m_node;
 
             for (SIZE_T count = 0; count < num; count++)  {
                 cur = m_tree->prev(cur);
@@ -231,17 +234,17 @@ public:
         // Private constructor. Only the Map class itself may use this
         //   constructor. It is used for constructing Iterators which reference
         //   specific nodes in the internal tree's structure.
-        Iterator (const Tree<Pair<Tk, Tv> > *tree, typename Tree<Pair<Tk, Tv> >::node_t *node)
+        Iterator (const Tree<Pair<Tk, Tv>, Lock> *tree, typename Tree<Pair<Tk, Tv>, Lock>::node_t *node)
         {
             m_node = node;
             m_tree = tree;
         }
 
-        typename Tree<Pair<Tk, Tv> >::node_t *m_node; // Pointer to the node referenced by the Map Iterator.
-        const Tree<Pair<Tk, Tv> >            *m_tree; // Pointer to the tree containing the referenced node.
+        typename Tree<Pair<Tk, Tv>, Lock>::node_t *m_node; // Pointer to the node referenced by the Map Iterator.
+        const Tree<Pair<Tk, Tv>, Lock>            *m_tree; // Pointer to the tree containing the referenced node.
 
         // The Map class is a friend of Map Iterators.
-        friend class Map<Tk, Tv>;
+        friend class Map<Tk, Tv, Lock>;
     };
 
     // begin - Obtains an Iterator referencing the beginning of the Map (i.e.
@@ -316,6 +319,57 @@ public:
         return Iterator(&m_tree, m_tree.find(Pair<Tk, Tv>(key, Tv())));
     }
 
+    // floor - Finds the key/value pair with the greatest key which isn't
+    //   greater than the specified key.
+    //
+    //  - key (IN): The key to look for.
+    //
+    //  Return Value:
+    //
+    //    Returns an Iterator referencing the found key/value pair. If every key
+    //    in the map is greater than 'key', then the "NULL" Iterator is
+    //    returned.
+    //
+    Iterator floor (const Tk &key) const
+    {
+        return Iterator(&m_tree, m_tree.floor(Pair<Tk, Tv>(key, Tv())));
+    }
+
+    // position - Obtains the position of an Iterator, for walks which let go
+    //   of the Map between batches (see resume). A Map is walked in key order,
+    //   so the key alone tells where to resume, and the position is always 0.
+    //
+    //  Return Value:
+    //
+    //    Returns 0.
+    //
+    size_t position (const Iterator &) const
+    {
+        return 0;
+    }
+
+    // resume - Obtains an Iterator referencing the key/value pair following
+    //   the key where a walk stopped, whether or not that key is still in the
+    //   Map.
+    //
+    //  - key (IN): The key the walk stopped at.
+    //
+    //  - position (IN): Unused (see position).
+    //
+    //  Return Value:
+    //
+    //    Returns an Iterator referencing the key/value pair with the smallest
+    //    key greater than 'key', or the "NULL" Iterator if there is none.
+    //
+    Iterator resume (const Tk &key, size_t) const
+    {
+        Iterator it = floor(key);
+        if (it == end())
+            return begin();
+        ++it;
+        return it;
+    }
+
     // insert - Inserts a key/value pair into the map.
     //
     //  - key (IN): The key of the key/value pair to be inserted.
@@ -332,6 +386,44 @@ public:
         return Iterator(&m_tree, m_tree.insert(Pair<Tk, Tv>(key, data)));
     }
 
+    // insert - Inserts a key/value pair into the map, unless the key is in the
+    //   map already, in which case the map isn't modified. Either way, the
+    //   map's tree is only descended once.
+    //
+    //  - key (IN): The key of the key/value pair to be inserted.
+    //
+    //  - data (IN): The value of the key/value pair to be inserted.
+    //
+    //  - inserted (OUT): Set to true if the pair has been inserted, or to
+    //      false if the key was found.
+    //
+    //  Return Value:
+    //
+    //    Returns an Iterator referencing the inserted key/value pair, or the
+    //    one with the key which was already in the map.
+    //
+    Iterator insert (const Tk &key, const Tv &data, bool &inserted)
+    {
+        return Iterator(&m_tree, m_tree.insert(Pair<Tk, Tv>(key, data), inserted));
+    }
+
+    // replace - Replaces the value of a key/value pair in the map.
+    //
+    //  - it (IN): Iterator referencing the key/value pair.
+    //
+    //  - data (IN): The new value.
+    //
+    //  Return Value:
+    //
+    //    Returns the previous value.
+    //
+    Tv replace (Iterator &it, const Tv &data)
+    {
+        Tv previous = it.m_node->key.second;
+        it.m_node->key.second = data;
+        return previous;
+    }
+
     // reserve - Sets the reserve size of the map. The reserve size is the
     //   number of key/value pairs for which space should be pre-allocated
     //   to avoid frequent heap hits when inserting new key/value pairs into
@@ -349,7 +441,33 @@ public:
         return m_tree.reserve(count);
     }
 
+    // compact - Frees the Map's spare storage. This invalidates every
+    //   Iterator into the Map (see Tree::compact).
+    //
+    //  Return Value:
+    //
+    //    Returns the number of key/value pairs' worth of storage freed.
+    //
+    size_t compact ()
+    {
+        return m_tree.compact();
+    }
+
+    // capacity - Returns the number of key/value pairs the map has storage
+    //   for.
+    size_t capacity () const
+    {
+        return m_tree.capacity();
+    }
+
+    // bytes - Returns the bytes of storage the map's nodes take, free nodes
+    //   included.
+    size_t bytes () const
+    {
+        return m_tree.capacity() * sizeof(typename Tree<Pair<Tk, Tv>, Lock>::node_t);
+    }
+
 private:
     // Private data
-    Tree<Pair<Tk, Tv> > m_tree; // The key/value pairs are actually stored in a tree.
+    Tree<Pair<Tk, Tv>, Lock> m_tree; // The key/value pairs are actually stored in a tree.
 };
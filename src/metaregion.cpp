@@ -0,0 +1,241 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - MetadataRegion Class Implementation
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#define VLDBUILD
+#include <winioctl.h>   // Provides FSCTL_SET_SPARSE.
+#include "metaregion.h" // This class' header.
+
+// enableLockMemoryPrivilege - Enables the privilege needed to allocate large
+//   pages in the process token. It has to be granted to the user first.
+//
+//  Return Value:
+//
+//    Returns TRUE if the privilege is enabled.
+//
+static BOOL enableLockMemoryPrivilege ()
+{
+    HANDLE token;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+        return FALSE;
+
+    TOKEN_PRIVILEGES privileges;
+    privileges.PrivilegeCount = 1;
+    privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    BOOL enabled = LookupPrivilegeValueW(NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid) &&
+        AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL) &&
+        (GetLastError() == ERROR_SUCCESS); // Not ERROR_NOT_ALL_ASSIGNED.
+    CloseHandle(token);
+    return enabled;
+}
+
+// Constructor - Initializes the region as not created.
+//
+MetadataRegion::MetadataRegion ()
+{
+    m_lock.Initialize();
+    m_reserve     = 0;
+    m_committed   = 0;
+    m_pageSize    = 0;
+    m_base        = NULL;
+    m_used        = 0;
+    m_size        = 0;
+    m_extentCount = 0;
+    m_file        = INVALID_HANDLE_VALUE;
+    m_mapping     = NULL;
+}
+
+// Destructor - Frees the region, if it hasn't been destroyed yet.
+//
+MetadataRegion::~MetadataRegion ()
+{
+    Destroy();
+    m_lock.Delete();
+}
+
+// Create - Sets the address space of the region aside.
+//
+//  - reserve (IN): Size of the region, in bytes.
+//
+//  - largePages (IN): If TRUE, the region is made of large pages, if the
+//      system and the process token allow it. Otherwise, or if they don't,
+//      it is made of normal pages.
+//
+//  Return Value:
+//
+//    Returns TRUE if the region was created.
+//
+BOOL MetadataRegion::Create (SIZE_T reserve, BOOL largePages)
+{
+    CriticalSectionLocker<> cs(m_lock);
+    if ((m_reserve != 0) || (reserve == 0))
+        return FALSE;
+
+    if (largePages) {
+        SIZE_T pageSize = GetLargePageMinimum();
+        if ((pageSize != 0) && enableLockMemoryPrivilege()) {
+            m_pageSize = pageSize;
+            m_reserve = reserve;
+            return TRUE;
+        }
+    }
+
+    reserve = (reserve + METADATA_COMMIT - 1) & ~(SIZE_T)(METADATA_COMMIT - 1);
+    m_base = (BYTE*)VirtualAlloc(NULL, reserve, MEM_RESERVE, PAGE_READWRITE);
+    if (m_base == NULL)
+        return FALSE;
+    m_reserve = reserve;
+    return TRUE;
+}
+
+// CreateMapped - Maps the region onto a scratch file, which is deleted once
+//   the region is destroyed. The file is sparse, so it only takes the disk
+//   space of the records written out to it.
+//
+//  - reserve (IN): Size of the region, in bytes.
+//
+//  - path (IN): Path of the scratch file. An existing file is overwritten.
+//
+//  Return Value:
+//
+//    Returns TRUE if the region was created.
+//
+BOOL MetadataRegion::CreateMapped (SIZE_T reserve, LPCWSTR path)
+{
+    CriticalSectionLocker<> cs(m_lock);
+    if ((m_reserve != 0) || (reserve == 0))
+        return FALSE;
+
+    HANDLE file = CreateFileW(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+        FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return FALSE;
+    DWORD returned;
+    DeviceIoControl(file, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &returned, NULL); // Merely saves disk space.
+
+    ULARGE_INTEGER size;
+    size.QuadPart = reserve;
+    HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READWRITE, size.HighPart, size.LowPart, NULL);
+    if (mapping == NULL) {
+        CloseHandle(file);
+        return FALSE;
+    }
+    m_base = (BYTE*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, reserve);
+    if (m_base == NULL) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return FALSE;
+    }
+    m_file = file;
+    m_mapping = mapping;
+    m_reserve = reserve;
+    m_size = reserve; // The whole view is usable right away.
+    return TRUE;
+}
+
+// Destroy - Frees the whole region. Nothing allocated from it may be used
+//   afterwards.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID MetadataRegion::Destroy ()
+{
+    CriticalSectionLocker<> cs(m_lock);
+    if (m_mapping != NULL) {
+        UnmapViewOfFile(m_base);
+        CloseHandle(m_mapping);
+        CloseHandle(m_file);
+        m_mapping = NULL;
+        m_file = INVALID_HANDLE_VALUE;
+    }
+    else if (m_pageSize != 0) {
+        for (UINT index = 0; index < m_extentCount; index++)
+            VirtualFree(m_extents[index], 0, MEM_RELEASE);
+    }
+    else if (m_base != NULL) {
+        VirtualFree(m_base, 0, MEM_RELEASE);
+    }
+    m_reserve     = 0;
+    m_committed   = 0;
+    m_pageSize    = 0;
+    m_base        = NULL;
+    m_used        = 0;
+    m_size        = 0;
+    m_extentCount = 0;
+}
+
+// Allocate - Allocates memory from the region, committing more of it if
+//   needed.
+//
+//  - size (IN): Number of bytes to allocate.
+//
+//  Return Value:
+//
+//    Returns a pointer to the memory, aligned on METADATA_ALIGNMENT bytes, or
+//    NULL if the region hasn't been created or has no room left for it.
+//
+LPVOID MetadataRegion::Allocate (SIZE_T size)
+{
+    size = (size + METADATA_ALIGNMENT - 1) & ~(SIZE_T)(METADATA_ALIGNMENT - 1);
+
+    CriticalSectionLocker<> cs(m_lock);
+    if (m_reserve == 0)
+        return NULL;
+
+    if (size > m_size - m_used) {
+        if (m_mapping != NULL) {
+            // The view can't grow.
+            return NULL;
+        }
+        else if (m_pageSize != 0) {
+            // Start a new extent, leaving the rest of the current one unused.
+            SIZE_T extentSize = (size + m_pageSize - 1) & ~(m_pageSize - 1);
+            if ((m_extentCount == METADATA_MAXEXTENTS) || (extentSize > m_reserve - m_committed))
+                return NULL;
+            BYTE *extent = (BYTE*)VirtualAlloc(NULL, extentSize, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                PAGE_READWRITE);
+            if (extent == NULL)
+                return NULL;
+            m_extents[m_extentCount++] = extent;
+            m_base = extent;
+            m_used = 0;
+            m_size = extentSize;
+            m_committed += extentSize;
+        }
+        else {
+            SIZE_T commitSize = (m_used + size - m_size + METADATA_COMMIT - 1) & ~(SIZE_T)(METADATA_COMMIT - 1);
+            if (commitSize > m_reserve - m_size)
+                return NULL;
+            if (VirtualAlloc(m_base + m_size, commitSize, MEM_COMMIT, PAGE_READWRITE) == NULL)
+                return NULL;
+            m_size += commitSize;
+            m_committed = m_size;
+        }
+    }
+
+    LPVOID memory = m_base + m_used;
+    m_used += size;
+    return memory;
+}
@@ -0,0 +1,99 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - MetadataRegion Class Definition
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#ifndef VLDBUILD
+#error \
+    "This header should only be included by Visual Leak Detector when building it from source. \
+    Applications should never include this header."
+#endif
+
+#include <windows.h>
+#include "criticalsection.h"
+
+#define METADATA_ALIGNMENT  64      // Alignment of the allocations, a cache line.
+#define METADATA_COMMIT     0x10000 // Bytes committed at a time, without large pages.
+#define METADATA_MAXEXTENTS 512     // Large page extents a region can hold.
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The MetadataRegion Class
+//
+//    A MetadataRegion hands out memory for VLD's bulk metadata, such as the
+//    slabs of blockinfo_t records, from address space set aside for it alone.
+//    The records then lie densely together instead of being interleaved with
+//    other allocations and the heap's own bookkeeping, so walking millions of
+//    them touches as few pages (and TLB entries) as possible, and the memory
+//    they take is simply the size of the region in use.
+//
+//    Without large pages, the whole region is reserved up front and committed
+//    as it fills up. Large pages can't be committed bit by bit, so with them
+//    the region is made of separate extents of one large page or more, each
+//    committed on allocation, up to the size reserved.
+//
+//    The region can instead be a view of a sparse scratch file (see
+//    CreateMapped). Records which aren't touched between reports are then
+//    written out to that file, rather than to the paging file, when memory
+//    gets short, and don't count against the process' commit charge.
+//
+//    Memory is never given back before the region is destroyed; allocations
+//    are only meant for objects which live until then.
+//
+class MetadataRegion
+{
+public:
+    MetadataRegion ();
+    ~MetadataRegion ();
+
+    BOOL Create (SIZE_T reserve, BOOL largePages);
+    BOOL CreateMapped (SIZE_T reserve, LPCWSTR path);
+    VOID Destroy ();
+    LPVOID Allocate (SIZE_T size);
+    SIZE_T Bytes () const { return (m_mapping != NULL) ? m_used : m_committed; }
+    BOOL IsOpen () const { return m_reserve != 0; }
+    BOOL IsMapped () const { return m_mapping != NULL; }
+    BOOL UsesLargePages () const { return m_pageSize != 0; }
+
+private:
+    // Don't allow this!!
+    MetadataRegion (const MetadataRegion &other);
+    MetadataRegion& operator = (const MetadataRegion &other);
+
+    CriticalSection m_lock;        // Serializes allocations.
+    SIZE_T          m_reserve;     // Size of the region, in bytes, or 0 if it hasn't been created.
+    SIZE_T          m_committed;   // Bytes of the region committed so far.
+    SIZE_T          m_pageSize;    // Size of a large page, or 0 if large pages aren't used.
+    BYTE           *m_base;        // Start of the current extent (the whole region, without large pages).
+    SIZE_T          m_used;        // Bytes of the current extent handed out.
+    SIZE_T          m_size;        // Size of the current extent (committed bytes, without large pages).
+    BYTE           *m_extents [METADATA_MAXEXTENTS]; // The large page extents.
+    UINT            m_extentCount;
+    HANDLE          m_file;        // The scratch file the region is a view of, or INVALID_HANDLE_VALUE.
+    HANDLE          m_mapping;     // Its file mapping, or NULL if the region isn't file-backed.
+};
+
+// VLD's region for metadata, defined along with the other globals in vld.cpp
+// so that it is constructed before, and destroyed after, g_vld. Created at
+// startup unless disabled (see MetadataReserve in vld.ini).
+extern MetadataRegion g_metadataRegion;
@@ -0,0 +1,221 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Minidump User Stream
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#define VLDBUILD
+#include "binreport.h"  // Provides the binary report format.
+#include "vldheap.h"    // Provides internal new and delete operators.
+#include "vldint.h"     // Provides access to VLD internals.
+
+// Imported global variables.
+extern HeapMapLock g_heapMapLock;
+extern DbgHelp     g_DbgHelp;
+
+// appendStream - Copies bytes to the minidump stream being built.
+static VOID appendStream (BYTE *&cursor, const VOID *data, SIZE_T size)
+{
+    memcpy(cursor, data, size);
+    cursor += size;
+}
+
+// GetMiniDumpStream - Builds a minidump user stream holding VLD's state: the
+//   module table, the call stacks and a record of every live block, in the
+//   binary report format with VLDBIN_HEADER_SNAPSHOT set. Like a binary
+//   report, nothing is symbolized, so building it is a copy of raw tables.
+//
+//  - stream (OUT): Receives the stream's type and buffer. The buffer must be
+//      freed with FreeMiniDumpStream.
+//
+//  Return Value:
+//
+//    Returns TRUE if the stream was built, FALSE if its buffer couldn't be
+//    allocated.
+//
+BOOL VisualLeakDetector::GetMiniDumpStream (VLD_MINIDUMP_STREAM *stream)
+{
+    stream->type       = VLD_MINIDUMP_STREAM_TYPE;
+    stream->bufferSize = 0;
+    stream->buffer     = NULL;
+
+    flushAllPendingBlocks();
+    CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+    CriticalSectionLocker<> ml(m_modulesLock);
+
+    // Number the distinct call stacks, and size the stream, so that it can be
+    // written in one go into a buffer of the right size.
+    SIZE_T size = sizeof(vldbin_header_t);
+    UINT32 moduleCount = 0;
+    for (ModuleSet::Iterator moduleit = m_loadedModules->begin(); moduleit != m_loadedModules->end(); ++moduleit) {
+        size += sizeof(vldbin_module_t) + (*moduleit).pathLength * sizeof(WCHAR);
+        moduleCount++;
+    }
+    HashMap<CallStack*, UINT32> stackIndices;
+    UINT32 blockCount = 0;
+    for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
+        BlockMap *blockmap = &(*heapit).second->blockMap;
+        for (BlockMap::Iterator blockit = blockmap->begin(); blockit != blockmap->end(); ++blockit) {
+            CallStack *callstack = (*blockit).second->callStack;
+            bool inserted = false;
+            if (callstack != NULL)
+                stackIndices.insert(callstack, (UINT32)stackIndices.size(), inserted);
+            if (inserted)
+                size += sizeof(vldbin_stack_t) + callstack->size() * sizeof(UINT64);
+            size += sizeof(vldbin_block_t);
+            blockCount++;
+        }
+    }
+    UINT32 stackCount = (UINT32)stackIndices.size();
+    if (size > MAXULONG) {
+        Report(L"WARNING: Visual Leak Detector: VLD's state is too large for a minidump stream.\n");
+        return FALSE;
+    }
+    BYTE *buffer = (BYTE*)VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (buffer == NULL)
+        return FALSE;
+    BYTE *cursor = buffer;
+
+    vldbin_header_t header = { 0 };
+    header.magic       = VLDBIN_MAGIC;
+    header.version     = VLDBIN_VERSION;
+    header.pointerSize = sizeof(LPVOID);
+    header.processId   = GetCurrentProcessId();
+    GetSystemTimeAsFileTime(&header.timestamp);
+    header.moduleCount = moduleCount;
+    header.stackCount  = stackCount;
+    header.blockCount  = blockCount;
+    header.flags       = VLDBIN_HEADER_SNAPSHOT;
+    appendStream(cursor, &header, sizeof(header));
+
+    for (ModuleSet::Iterator moduleit = m_loadedModules->begin(); moduleit != m_loadedModules->end(); ++moduleit) {
+        const moduleinfo_t &moduleinfo = *moduleit;
+        vldbin_module_t module = { 0 };
+        module.base       = moduleinfo.addrLow;
+        module.size       = moduleinfo.addrHigh - moduleinfo.addrLow + 1;
+        module.pdbGuid    = moduleinfo.pdbGuid;
+        module.pdbAge     = moduleinfo.pdbAge;
+        module.pathLength = moduleinfo.pathLength;
+        appendStream(cursor, &module, sizeof(module));
+        appendStream(cursor, moduleinfo.path, module.pathLength * sizeof(WCHAR));
+    }
+
+    // The stack records are written in the order of their numbers.
+    CallStack **stacks = new CallStack* [stackCount + 1];
+    for (HashMap<CallStack*, UINT32>::Iterator it = stackIndices.begin(); it != stackIndices.end(); ++it) {
+        stacks[(*it).second] = (*it).first;
+    }
+    for (UINT32 index = 0; index < stackCount; index++) {
+        CallStack *callstack = stacks[index];
+        vldbin_stack_t stack;
+        stack.hash       = callstack->getHashValue();
+        stack.frameCount = callstack->size();
+        appendStream(cursor, &stack, sizeof(stack));
+        for (UINT32 frame = 0; frame < stack.frameCount; frame++) {
+            UINT64 pc = (*callstack)[frame];
+            appendStream(cursor, &pc, sizeof(pc));
+        }
+    }
+    delete [] stacks;
+
+    for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
+        BlockMap *blockmap = &(*heapit).second->blockMap;
+        for (BlockMap::Iterator blockit = blockmap->begin(); blockit != blockmap->end(); ++blockit) {
+            const blockinfo_t *info = (*blockit).second;
+            vldbin_block_t block = { 0 };
+            block.serialNumber = info->serialNumber;
+            block.address      = (UINT_PTR)(*blockit).first;
+            block.size         = info->size;
+            block.heap         = (UINT_PTR)(*heapit).first;
+            block.threadId     = getThreadId(info);
+            block.stackIndex   = VLDBIN_NO_STACK;
+            if (info->callStack != NULL)
+                block.stackIndex = (*stackIndices.find(info->callStack)).second;
+            if (info->crtHeader != crtheader_none)
+                block.flags |= VLDBIN_BLOCK_CRT;
+            if (info->crtHeader == crtheader_ucrt)
+                block.flags |= VLDBIN_BLOCK_UCRT;
+            appendStream(cursor, &block, sizeof(block));
+        }
+    }
+    assert(cursor == buffer + size);
+
+    stream->bufferSize = (UINT)size;
+    stream->buffer     = buffer;
+    return TRUE;
+}
+
+// FreeMiniDumpStream - Frees the buffer of a stream built by
+//   GetMiniDumpStream.
+//
+//  - stream (IN/OUT): The stream. Its buffer is set to NULL.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::FreeMiniDumpStream (VLD_MINIDUMP_STREAM *stream)
+{
+    if (stream->buffer != NULL)
+        VirtualFree(stream->buffer, 0, MEM_RELEASE);
+    stream->buffer     = NULL;
+    stream->bufferSize = 0;
+}
+
+// WriteMiniDump - Writes a minidump of the process, with VLD's state as a
+//   user stream, for programs which don't write their own.
+//
+//  - file (IN): The file to write the minidump to.
+//
+//  - dumpType (IN): The MINIDUMP_TYPE flags of the minidump.
+//
+//  - exceptionPointers (IN): The exception the current thread is handling,
+//      or NULL if there is none.
+//
+//  Return Value:
+//
+//    Returns TRUE if the minidump was written.
+//
+BOOL VisualLeakDetector::WriteMiniDump (HANDLE file, UINT dumpType, PEXCEPTION_POINTERS exceptionPointers)
+{
+    VLD_MINIDUMP_STREAM stream;
+    if (!GetMiniDumpStream(&stream))
+        return FALSE;
+
+    MINIDUMP_USER_STREAM userStream;
+    userStream.Type       = stream.type;
+    userStream.BufferSize = stream.bufferSize;
+    userStream.Buffer     = stream.buffer;
+    MINIDUMP_USER_STREAM_INFORMATION userStreams;
+    userStreams.UserStreamCount = 1;
+    userStreams.UserStreamArray = &userStream;
+    MINIDUMP_EXCEPTION_INFORMATION exception;
+    exception.ThreadId          = GetCurrentThreadId();
+    exception.ExceptionPointers = exceptionPointers;
+    exception.ClientPointers    = FALSE;
+
+    BOOL written = g_DbgHelp.MiniDumpWriteDump(GetCurrentProcess(), GetCurrentProcessId(), file,
+        (MINIDUMP_TYPE)dumpType, (exceptionPointers != NULL) ? &exception : NULL, &userStreams, NULL);
+    if (!written)
+        Report(L"WARNING: Visual Leak Detector: Couldn't write the minidump (error %u).\n", GetLastError());
+    FreeMiniDumpStream(&stream);
+    return written;
+}
@@ -37,4 +37,19 @@ LdrGetDllHandle_t   LdrGetDllHandle;
 LdrGetProcedureAddress_t LdrGetProcedureAddress;
 LdrUnloadDll_t      LdrUnloadDll;
 LdrLockLoaderLock_t LdrLockLoaderLock;
-LdrUnlockLoaderLock_t LdrUnlockLoaderLock;
\ No newline at end of file
+LdrUnlockLoaderLock_t LdrUnlockLoaderLock;
+LdrRegisterDllNotification_t LdrRegisterDllNotification;
+LdrUnregisterDllNotification_t LdrUnregisterDllNotification;
+
+NtAllocateVirtualMemory_t   NtAllocateVirtualMemory;
+NtAllocateVirtualMemoryEx_t NtAllocateVirtualMemoryEx;
+NtFreeVirtualMemory_t       NtFreeVirtualMemory;
+NtMapViewOfSection_t        NtMapViewOfSection;
+NtMapViewOfSectionEx_t      NtMapViewOfSectionEx;
+NtUnmapViewOfSection_t      NtUnmapViewOfSection;
+NtUnmapViewOfSectionEx_t    NtUnmapViewOfSectionEx;
+
+RtlCreateQueryDebugBuffer_t       RtlCreateQueryDebugBuffer;
+RtlQueryProcessDebugInformation_t RtlQueryProcessDebugInformation;
+RtlDestroyQueryDebugBuffer_t      RtlDestroyQueryDebugBuffer;
+RtlDllShutdownInProgress_t        RtlDllShutdownInProgress;
\ No newline at end of file
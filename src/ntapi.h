@@ -56,6 +56,137 @@ typedef NTSTATUS(NTAPI *LdrUnloadDll_t)(PVOID);
 typedef NTSTATUS(NTAPI *LdrLockLoaderLock_t)(ULONG, PULONG, PULONG_PTR);
 typedef NTSTATUS(NTAPI *LdrUnlockLoaderLock_t)(ULONG, ULONG_PTR);
 
+// Loader notifications, delivered (with the loader lock held) whenever a DLL
+// is mapped into or unmapped from the process.
+#define LDR_DLL_NOTIFICATION_REASON_LOADED   1
+#define LDR_DLL_NOTIFICATION_REASON_UNLOADED 2
+
+struct ldrdllnotificationdata_t {
+    ULONG                  flags;       // Reserved.
+    const unicodestring_t *fullDllName; // The full path of the DLL.
+    const unicodestring_t *baseDllName; // The file name of the DLL.
+    PVOID                  dllBase;     // The base address of the DLL.
+    ULONG                  sizeOfImage; // The size, in bytes, of the DLL's image.
+};
+
+typedef VOID (NTAPI *LdrDllNotification_t)(ULONG, const ldrdllnotificationdata_t *, PVOID);
+typedef NTSTATUS(NTAPI *LdrRegisterDllNotification_t)(ULONG, LdrDllNotification_t, PVOID, PVOID *);
+typedef NTSTATUS(NTAPI *LdrUnregisterDllNotification_t)(PVOID);
+
+// Basic information of a thread, as returned by NtQueryInformationThread for
+// THREADBASICINFORMATION.
+#define THREADBASICINFORMATION 0
+struct threadbasicinformation_t {
+    NTSTATUS  exitStatus;
+    PVOID     tebBaseAddress; // The thread's environment block, which starts with an NT_TIB.
+    HANDLE    processId;
+    HANDLE    threadId;
+    ULONG_PTR affinityMask;
+    LONG      priority;
+    LONG      basePriority;
+};
+
+typedef NTSTATUS(NTAPI *NtQueryInformationThread_t)(HANDLE, ULONG, PVOID, ULONG, PULONG);
+
+// Virtual memory and section view functions, hooked with TrackVirtualMemory.
+// The extended parameters of the Ex functions (MEM_EXTENDED_PARAMETER) are
+// only passed through.
+typedef NTSTATUS(NTAPI *NtAllocateVirtualMemory_t)(HANDLE, PVOID *, ULONG_PTR, PSIZE_T, ULONG, ULONG);
+typedef NTSTATUS(NTAPI *NtAllocateVirtualMemoryEx_t)(HANDLE, PVOID *, PSIZE_T, ULONG, ULONG, PVOID, ULONG);
+typedef NTSTATUS(NTAPI *NtFreeVirtualMemory_t)(HANDLE, PVOID *, PSIZE_T, ULONG);
+typedef NTSTATUS(NTAPI *NtMapViewOfSection_t)(HANDLE, HANDLE, PVOID *, ULONG_PTR, SIZE_T, PLARGE_INTEGER, PSIZE_T,
+    ULONG, ULONG, ULONG);
+typedef NTSTATUS(NTAPI *NtMapViewOfSectionEx_t)(HANDLE, HANDLE, PVOID *, PLARGE_INTEGER, PSIZE_T, ULONG, ULONG,
+    PVOID, ULONG);
+typedef NTSTATUS(NTAPI *NtUnmapViewOfSection_t)(HANDLE, PVOID);
+typedef NTSTATUS(NTAPI *NtUnmapViewOfSectionEx_t)(HANDLE, PVOID, ULONG);
+
+// The process debug information query, which reads the heaps' entries and
+// the user-mode stack trace database (gflags +ust), for the "ntdb" stack walk
+// method. Only the parts VLD reads are declared; the buffer is laid out by
+// ntdll, and the heap information records grew a field in Windows 11, so
+// their size is worked out at run time.
+#define RTL_QUERY_PROCESS_BACKTRACES   0x00000002
+#define RTL_QUERY_PROCESS_HEAP_SUMMARY 0x00000004
+#define RTL_QUERY_PROCESS_HEAP_ENTRIES 0x00000010
+
+#define RTL_HEAP_BUSY              0x0001 // The entry is an allocated block.
+#define RTL_HEAP_SEGMENT           0x0002 // The entry describes a segment, not a block.
+#define RTL_HEAP_UNCOMMITTED_RANGE 0x0100 // The entry describes an uncommitted range, not a block.
+
+struct rtlheapentry_t {
+    SIZE_T size;                     // Size of the block, in bytes.
+    USHORT flags;                    // RTL_HEAP_* flags.
+    USHORT allocatorBackTraceIndex;  // Index of the block's call stack in the stack trace database, or 0.
+    SIZE_T settable;
+    SIZE_T tag;
+};
+
+struct rtlheapinformation_t {
+    PVOID           baseAddress;     // The heap's handle.
+    ULONG           flags;
+    USHORT          entryOverhead;
+    USHORT          creatorBackTraceIndex;
+    SIZE_T          bytesAllocated;
+    SIZE_T          bytesCommitted;
+    ULONG           numberOfTags;
+    ULONG           numberOfEntries;
+    ULONG           numberOfPseudoTags;
+    ULONG           pseudoTagGranularity;
+    ULONG           reserved [5];
+    PVOID           tags;
+    rtlheapentry_t *entries;         // The heap's entries, in address order.
+};
+
+struct rtlprocessheaps_t {
+    ULONG                numberOfHeaps;
+    rtlheapinformation_t heaps [1];
+};
+
+#define RTL_BACKTRACE_DEPTH 32 // Frames kept by each stack trace database entry.
+
+struct rtlbacktraceinformation_t {
+    PCHAR  symbolicBackTrace;
+    ULONG  traceCount;
+    USHORT index;                    // The entry's index, as the heap entries refer to it.
+    USHORT depth;                    // Number of frames.
+    PVOID  backTrace [RTL_BACKTRACE_DEPTH];
+};
+
+struct rtlprocessbacktraces_t {
+    ULONG                     committedMemory;
+    ULONG                     reservedMemory;
+    ULONG                     numberOfBackTraceLookups;
+    ULONG                     numberOfBackTraces;
+    rtlbacktraceinformation_t backTraces [1];
+};
+
+struct rtldebuginformation_t {
+    HANDLE                  sectionHandleClient;
+    PVOID                   viewBaseClient;
+    PVOID                   viewBaseTarget;
+    ULONG_PTR               viewBaseDelta;
+    HANDLE                  eventPairClient;
+    HANDLE                  eventPairTarget;
+    HANDLE                  targetProcessId;
+    HANDLE                  targetThreadHandle;
+    ULONG                   flags;
+    SIZE_T                  offsetFree;
+    SIZE_T                  commitSize;
+    SIZE_T                  viewSize;
+    PVOID                   modules;
+    rtlprocessbacktraces_t *backTraces;
+    rtlprocessheaps_t      *heaps;
+    PVOID                   locks;
+};
+
+typedef rtldebuginformation_t* (NTAPI *RtlCreateQueryDebugBuffer_t)(ULONG, BOOLEAN);
+typedef NTSTATUS(NTAPI *RtlQueryProcessDebugInformation_t)(HANDLE, ULONG, rtldebuginformation_t *);
+typedef NTSTATUS(NTAPI *RtlDestroyQueryDebugBuffer_t)(rtldebuginformation_t *);
+
+// Whether the process is exiting, as opposed to the DLL being unloaded.
+typedef BOOLEAN (NTAPI *RtlDllShutdownInProgress_t)();
+
 // Provide forward declarations for the NT APIs for any source files that
 // include this header.
 extern LdrLoadDll_t        LdrLoadDll;
@@ -69,3 +200,18 @@ extern LdrGetProcedureAddress_t LdrGetProcedureAddress;
 extern LdrUnloadDll_t LdrUnloadDll;
 extern LdrLockLoaderLock_t LdrLockLoaderLock;
 extern LdrUnlockLoaderLock_t LdrUnlockLoaderLock;
+extern LdrRegisterDllNotification_t LdrRegisterDllNotification;
+extern LdrUnregisterDllNotification_t LdrUnregisterDllNotification;
+
+extern NtAllocateVirtualMemory_t   NtAllocateVirtualMemory;
+extern NtAllocateVirtualMemoryEx_t NtAllocateVirtualMemoryEx;
+extern NtFreeVirtualMemory_t       NtFreeVirtualMemory;
+extern NtMapViewOfSection_t        NtMapViewOfSection;
+extern NtMapViewOfSectionEx_t      NtMapViewOfSectionEx;
+extern NtUnmapViewOfSection_t      NtUnmapViewOfSection;
+extern NtUnmapViewOfSectionEx_t    NtUnmapViewOfSectionEx;
+
+extern RtlCreateQueryDebugBuffer_t       RtlCreateQueryDebugBuffer;
+extern RtlQueryProcessDebugInformation_t RtlQueryProcessDebugInformation;
+extern RtlDestroyQueryDebugBuffer_t      RtlDestroyQueryDebugBuffer;
+extern RtlDllShutdownInProgress_t        RtlDllShutdownInProgress;
@@ -0,0 +1,535 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Parallel Formatting of Leak Reports
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#define VLDBUILD
+#include "vldheap.h"    // Provides internal new and delete operators.
+#include "vldint.h"     // Provides access to VLD internals.
+#include "diasymbolizer.h" // Provides program counter resolution without dbghelp.
+
+// Imported global variables.
+extern HeapMapLock    g_heapMapLock;
+extern DbgHelp        g_DbgHelp;
+extern SymbolCache    g_symbolCache;
+extern ModuleImages   g_moduleImages;
+extern SymbolStore    g_symbolStore;
+
+#define VLD_MIN_PARALLEL_LEAKS 64 // Fewer leaks than this are formatted by the reporting thread alone.
+#define VLD_LEAKS_PER_CHUNK    16 // Fewest leaks handed to a thread at a time.
+#define VLD_CHUNKS_PER_THREAD  4  // Chunks per formatting thread, so that uneven chunks even out.
+#define VLD_SYMBOLS_PER_CHUNK  64 // Program counters handed to a thread at a time, with "Symbolizer = dia".
+
+// A text report split into chunks of consecutive leaks, which the report
+// threads and the reporting thread format side by side. Each chunk's text is
+// captured, and the captures are printed in chunk order once every chunk is
+// formatted, so the report reads exactly as if it had been formatted by one
+// thread.
+struct reportjob_t {
+    const leakentry_t *leaks;      // The leaks, in report order.
+    SIZE_T             leakCount;
+    SIZE_T             chunkSize;  // Leaks per chunk (the last chunk may have fewer).
+    LONG               chunkCount;
+    reportcapture_t   *prefixes;   // Per chunk, what resolving its call stacks printed.
+    reportcapture_t   *chunks;     // Per chunk, the formatted leaks.
+    reportstats_t     *stats;      // Per chunk, the time spent formatting the leaks.
+    volatile LONG      nextChunk;  // Index of the next chunk to be claimed.
+    volatile LONG      pending;    // Chunks not formatted yet, plus the threads working on the report.
+};
+
+// A program counter of a parallel report which the SymbolCache doesn't know
+// yet, to be resolved with DIA.
+struct symbolentry_t {
+    SIZE_T      programCounter; // The address the SymbolCache will be asked about.
+    UINT32      image;          // The module image it is within.
+    UINT32      rva;            // Its offset within the image.
+    LPCWSTR     imagePath;      // The image's path.
+    bool        resolved;       // Set once DIA has resolved it.
+    diasymbol_t symbol;         // What DIA found out, if it has.
+};
+
+// With "Symbolizer = dia", the program counters of a parallel report,
+// sorted by image so that a chunk mostly needs one DIA session, which the
+// report threads and the reporting thread resolve side by side before the
+// call stacks are resolved (see symbolizeInParallel).
+struct symboljob_t {
+    symbolentry_t *entries;
+    SIZE_T         entryCount;
+    LPWSTR         searchPath; // Where DIA looks for the PDBs.
+    LONG           chunkCount;
+    volatile LONG  nextChunk;  // Index of the next chunk to be claimed.
+    volatile LONG  pending;    // Chunks not resolved yet, plus the threads working on the job.
+};
+
+// compareSymbolEntries - qsort callback ordering program counters by image,
+//   then by offset.
+static int __cdecl compareSymbolEntries (const void *first, const void *second)
+{
+    const symbolentry_t *a = (const symbolentry_t*)first;
+    const symbolentry_t *b = (const symbolentry_t*)second;
+    if (a->image != b->image)
+        return (a->image < b->image) ? -1 : 1;
+    if (a->rva != b->rva)
+        return (a->rva < b->rva) ? -1 : 1;
+    return 0;
+}
+
+// The LeakSink of a parallel report. Only keeps the leaks: the heap maps stay
+// locked until they are printed, so their blocks can't go away.
+class LeakList : public LeakSink
+{
+public:
+    LeakList () : m_leaks(NULL), m_count(0), m_capacity(0) {}
+    ~LeakList () { delete [] m_leaks; }
+
+    virtual VOID Leak (const leakentry_t &leak);
+    SIZE_T Count () const { return m_count; }
+    const leakentry_t* Entries () const { return m_leaks; }
+
+private:
+    // Don't allow this!!
+    LeakList (const LeakList &other);
+    LeakList& operator = (const LeakList &other);
+
+    leakentry_t *m_leaks;     // The leaks, in report order.
+    SIZE_T       m_count;
+    SIZE_T       m_capacity;
+};
+
+VOID LeakList::Leak (const leakentry_t &leak)
+{
+    if (m_count == m_capacity) {
+        m_capacity = (m_capacity == 0) ? 256 : m_capacity * 2;
+        leakentry_t *leaks = new leakentry_t [m_capacity];
+        if (m_count != 0)
+            memcpy(leaks, m_leaks, m_count * sizeof(leakentry_t));
+        delete [] m_leaks;
+        m_leaks = leaks;
+    }
+    m_leaks[m_count++] = leak;
+}
+
+// startReportThreads - Creates the threads which help format text reports,
+//   for the ReportThreads option. They are created up front, because a
+//   report may be generated while the loader lock is held, when no new
+//   thread could start. Threads which can't be created are done without.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::startReportThreads ()
+{
+    m_reportWork = CreateSemaphoreW(NULL, 0, MAXLONG, NULL);
+    m_reportDone = CreateEventW(NULL, FALSE, FALSE, NULL);
+    if ((m_reportWork == NULL) || (m_reportDone == NULL)) {
+        if (m_reportWork != NULL)
+            CloseHandle(m_reportWork);
+        if (m_reportDone != NULL)
+            CloseHandle(m_reportDone);
+        m_reportWork = m_reportDone = NULL;
+        m_reportThreadCount = 0;
+        return;
+    }
+
+    UINT32 count = 0;
+    for (UINT32 index = 0; index < m_reportThreadCount; index++) {
+        m_reportThreads[count] = CreateThread(NULL, 0, reportThreadProc, this, 0, &m_reportThreadIds[count]);
+        if (m_reportThreads[count] != NULL)
+            count++;
+    }
+    m_reportThreadCount = count;
+}
+
+// stopReportThreads - Stops the report threads. Like stopSymbolPrefetch,
+//   this never waits for them; they exit as soon as they wake up. At process
+//   exit, they have been terminated already.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::stopReportThreads ()
+{
+    if (m_reportWork == NULL)
+        return;
+
+    m_reportStop = TRUE;
+    bool exited = true;
+    if (m_reportThreadCount != 0) {
+        ReleaseSemaphore(m_reportWork, m_reportThreadCount, NULL);
+        for (UINT32 index = 0; index < m_reportThreadCount; index++) {
+            if (WaitForSingleObject(m_reportThreads[index], 0) != WAIT_OBJECT_0)
+                exited = false;
+            CloseHandle(m_reportThreads[index]);
+            m_reportThreads[index] = NULL;
+            m_reportThreadIds[index] = 0;
+        }
+    }
+    if (exited) {
+        CloseHandle(m_reportWork);
+        CloseHandle(m_reportDone);
+        m_reportWork = m_reportDone = NULL;
+    }
+    m_reportThreadCount = 0;
+}
+
+// isReportThread - Checks whether a thread is one of the report threads.
+//
+//  - threadId (IN): ID of the thread.
+//
+//  Return Value:
+//
+//    Returns true if the thread is a report thread.
+//
+bool VisualLeakDetector::isReportThread (DWORD threadId) const
+{
+    for (UINT32 index = 0; index < m_reportThreadCount; index++) {
+        if (m_reportThreadIds[index] == threadId)
+            return true;
+    }
+    return false;
+}
+
+// reportThreadProc - Helps format each report posted in m_reportJob, mark
+//   each reachability scan posted in m_scanJob, and resolve the program
+//   counters posted in m_symbolJob, until the report threads are stopped.
+//
+//  - param (IN): The VisualLeakDetector.
+//
+//  Return Value:
+//
+//    Always returns 0.
+//
+DWORD WINAPI VisualLeakDetector::reportThreadProc (LPVOID param)
+{
+    VisualLeakDetector *vld = (VisualLeakDetector*)param;
+    HANDLE work = vld->m_reportWork;
+    while (WaitForSingleObject(work, INFINITE) == WAIT_OBJECT_0) {
+        if (vld->m_reportStop)
+            break;
+
+        // A thread which wakes up late may find the report finished, or
+        // already taken down.
+        reportjob_t *job;
+        reachscan_t *scan;
+        symboljob_t *symbols;
+        {
+            CriticalSectionLocker<> cs(vld->m_reportJobLock);
+            job = vld->m_reportJob;
+            if (job != NULL)
+                InterlockedIncrement(&job->pending);
+            scan = vld->m_scanJob;
+            if (scan != NULL)
+                vld->joinScan(scan);
+            symbols = vld->m_symbolJob;
+            if (symbols != NULL)
+                InterlockedIncrement(&symbols->pending);
+        }
+        if (scan != NULL) {
+            vld->markScan(scan);
+            continue;
+        }
+        if (symbols != NULL) {
+            vld->resolveSymbolChunks(symbols);
+            if (InterlockedDecrement(&symbols->pending) == 0)
+                SetEvent(vld->m_reportDone);
+            continue;
+        }
+        if (job == NULL)
+            continue;
+        vld->formatReportChunks(job);
+        if (InterlockedDecrement(&job->pending) == 0)
+            SetEvent(vld->m_reportDone);
+    }
+    return 0;
+}
+
+// formatReportChunks - Claims chunks of a report and formats their leaks,
+//   into each chunk's capture, until none is left.
+//
+//  - job (IN/OUT): The report.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::formatReportChunks (reportjob_t *job)
+{
+    for (;;) {
+        LONG chunk = InterlockedIncrement(&job->nextChunk) - 1;
+        if (chunk >= job->chunkCount)
+            return;
+
+        SIZE_T first = chunk * job->chunkSize;
+        SIZE_T last = min(first + job->chunkSize, job->leakCount);
+        // The warning heading the leaks is printed by the reporting thread.
+        bool firstLeak = false;
+        BeginReportCapture(&job->chunks[chunk]);
+        for (SIZE_T index = first; index < last; index++)
+            printLeak(job->leaks[index], firstLeak, job->stats[chunk]);
+        EndReportCapture();
+        if (InterlockedDecrement(&job->pending) == 0)
+            SetEvent(m_reportDone);
+    }
+}
+
+// resolveSymbolChunks - Claims chunks of program counters and resolves them
+//   with DIA, until none is left. The thread's DiaSymbolizer, and the
+//   sessions it opened, last as long as the job.
+//
+//  - job (IN/OUT): The program counters.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::resolveSymbolChunks (symboljob_t *job)
+{
+    DiaSymbolizer dia(job->searchPath);
+    for (;;) {
+        LONG chunk = InterlockedIncrement(&job->nextChunk) - 1;
+        if (chunk >= job->chunkCount)
+            return;
+
+        SIZE_T first = chunk * VLD_SYMBOLS_PER_CHUNK;
+        SIZE_T last = min(first + VLD_SYMBOLS_PER_CHUNK, job->entryCount);
+        for (SIZE_T index = first; index < last; index++) {
+            symbolentry_t &entry = job->entries[index];
+            entry.resolved = dia.Resolve(entry.imagePath, entry.rva, entry.symbol);
+        }
+        if (InterlockedDecrement(&job->pending) == 0)
+            SetEvent(m_reportDone);
+    }
+}
+
+// symbolizeInParallel - Resolves the program counters of a parallel report
+//   with DIA, on the report threads alongside the calling thread, and
+//   caches the results in the SymbolCache, for "Symbolizer = dia". dbghelp
+//   is single-threaded, so without this the call stacks of the report are
+//   resolved on one core. The program counters DIA can't resolve are left
+//   to dbghelp, which then resolves the call stacks as usual, mostly from
+//   the cache. Called by reportLeaksInParallel, while the report threads are
+//   alive.
+//
+//  - leaks (IN): The leaks of the report.
+//
+//  - leakCount (IN): The number of leaks.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::symbolizeInParallel (const leakentry_t *leaks, SIZE_T leakCount)
+{
+    if (!DiaSymbolizer::Load()) {
+        static bool warned = false;
+        if (!warned) {
+            warned = true;
+            Report(L"WARNING: Visual Leak Detector: msdia140.dll couldn't be loaded; call stacks are resolved\n"
+                L"  with dbghelp alone. Copy it next to VLD to use \"Symbolizer = dia\".\n");
+        }
+        return;
+    }
+
+    symboljob_t job;
+    job.entries = NULL;
+    job.entryCount = 0;
+    {
+        // Collect the program counters which the SymbolCache (and the
+        // SymbolCacheFile) don't know yet, each once.
+        CriticalSectionLocker<DbgHelp> locker(g_DbgHelp);
+        SIZE_T capacity = 0;
+        for (SIZE_T index = 0; index < leakCount; index++) {
+            CallStack *callStack = leaks[index].callStack;
+            if ((callStack != NULL) && !callStack->isResolved())
+                capacity += callStack->size();
+        }
+        if (capacity == 0)
+            return;
+        job.entries = new symbolentry_t [capacity];
+
+        HashMap<SIZE_T, SIZE_T> seen;
+        for (SIZE_T index = 0; index < leakCount; index++) {
+            CallStack *callStack = leaks[index].callStack;
+            if ((callStack == NULL) || callStack->isResolved())
+                continue;
+            for (UINT32 frame = 0; frame < callStack->size(); frame++) {
+                if (isVldAddress((*callStack)[frame]))
+                    continue;
+                SIZE_T programCounter = callStack->symbolAddress(frame, locker);
+                if (g_symbolCache.Contains(programCounter, locker))
+                    continue;
+                UINT32 rva = 0;
+                UINT32 image = g_moduleImages.Find(programCounter, rva);
+                if (image == MODULEIMAGE_NONE)
+                    continue;
+                const moduleimage_t *moduleimage = g_moduleImages.Get(image);
+                if (g_symbolStore.IsOpen() && (moduleimage->pdbAge != 0) &&
+                    (g_symbolStore.Find(moduleimage->pdbGuid, moduleimage->pdbAge, rva, locker) != NULL))
+                    continue;
+                if (seen.insert(programCounter, 0) == seen.end())
+                    continue;
+
+                symbolentry_t &entry = job.entries[job.entryCount++];
+                entry.programCounter = programCounter;
+                entry.image = image;
+                entry.rva = rva;
+                entry.imagePath = moduleimage->path;
+                entry.resolved = false;
+            }
+        }
+        job.searchPath = buildSymbolSearchPath();
+    }
+    if (job.entryCount == 0) {
+        delete [] job.searchPath;
+        delete [] job.entries;
+        return;
+    }
+    qsort(job.entries, job.entryCount, sizeof(symbolentry_t), compareSymbolEntries);
+
+    job.chunkCount = (LONG)((job.entryCount + VLD_SYMBOLS_PER_CHUNK - 1) / VLD_SYMBOLS_PER_CHUNK);
+    job.nextChunk = 0;
+    // The calling thread counts as working on the job until it has taken
+    // it down.
+    job.pending = job.chunkCount + 1;
+    {
+        CriticalSectionLocker<> cs(m_reportJobLock);
+        m_symbolJob = &job;
+    }
+    ReleaseSemaphore(m_reportWork, m_reportThreadCount, NULL);
+    resolveSymbolChunks(&job);
+    {
+        CriticalSectionLocker<> cs(m_reportJobLock);
+        m_symbolJob = NULL;
+    }
+    if (InterlockedDecrement(&job.pending) != 0)
+        WaitForSingleObject(m_reportDone, INFINITE);
+
+    CriticalSectionLocker<DbgHelp> locker(g_DbgHelp);
+    for (SIZE_T index = 0; index < job.entryCount; index++) {
+        symbolentry_t &entry = job.entries[index];
+        if (!entry.resolved)
+            continue;
+        g_symbolCache.Insert(entry.programCounter, entry.image, entry.rva, entry.symbol.functionName,
+            entry.symbol.displacement, entry.symbol.fileName, entry.symbol.lineNumber, entry.symbol.lineDisplacement,
+            locker);
+        delete [] entry.symbol.functionName;
+        delete [] entry.symbol.fileName;
+    }
+    delete [] job.searchPath;
+    delete [] job.entries;
+}
+
+// reportLeaksInParallel - Generates the text memory leak report of every
+//   heap, with the report threads formatting the leaks alongside the calling
+//   thread. The leaks are gathered first, and their call stacks resolved by
+//   the calling thread, so that the report threads only format text and
+//   never enter the symbol handler. The caller must hold g_heapMapLock.
+//
+//  Return Value:
+//
+//    Returns the number of leaks found.
+//
+SIZE_T VisualLeakDetector::reportLeaksInParallel ()
+{
+    LeakList list;
+    bool firstLeak = true;
+    DuplicateIndex duplicates;
+    SIZE_T leaksCount = 0;
+    for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit)
+        leaksCount += reportLeaks((*heapit).second, firstLeak, duplicates, (DWORD)-1, (SIZE_T)-1, &list);
+    if (list.Count() == 0)
+        return leaksCount;
+
+    // The first report thread still alive tells whether any helps: at
+    // process exit, they have all been terminated.
+    bool alone = (list.Count() < VLD_MIN_PARALLEL_LEAKS) || (m_reportThreadCount == 0) ||
+        (WaitForSingleObject(m_reportThreads[0], 0) != WAIT_TIMEOUT);
+    if (!alone) {
+        // Without captures, the chunks couldn't be put back in order.
+        reportcapture_t probe;
+        alone = !BeginReportCapture(&probe);
+        if (!alone)
+            EndReportCapture();
+    }
+    if (alone) {
+        for (SIZE_T index = 0; index < list.Count(); index++)
+            printLeak(list.Entries()[index], firstLeak, m_reportStats);
+        return leaksCount;
+    }
+
+    reportjob_t job;
+    job.leaks = list.Entries();
+    job.leakCount = list.Count();
+    SIZE_T chunks = (SIZE_T)(m_reportThreadCount + 1) * VLD_CHUNKS_PER_THREAD;
+    job.chunkSize = max((job.leakCount + chunks - 1) / chunks, (SIZE_T)VLD_LEAKS_PER_CHUNK);
+    job.chunkCount = (LONG)((job.leakCount + job.chunkSize - 1) / job.chunkSize);
+    job.prefixes = new reportcapture_t [job.chunkCount];
+    job.chunks = new reportcapture_t [job.chunkCount];
+    job.stats = new reportstats_t [job.chunkCount];
+    ZeroMemory(job.stats, job.chunkCount * sizeof(reportstats_t));
+    job.nextChunk = 0;
+    // The calling thread counts as working on the report until it has
+    // taken it down.
+    job.pending = job.chunkCount + 1;
+
+    // Whatever resolving a call stack prints (a hint that it's incomplete)
+    // goes before the chunk of the first leak with that call stack.
+    UINT64 start = __rdtsc();
+    if ((m_symbolizer == VLD_SYMBOLIZER_DIA) && (m_symbolLevel == VLD_SYMBOLS_LINE))
+        symbolizeInParallel(job.leaks, job.leakCount);
+    for (SIZE_T index = 0; index < job.leakCount; index++) {
+        CallStack *callStack = job.leaks[index].callStack;
+        if ((callStack == NULL) || callStack->isResolved())
+            continue;
+        BeginReportCapture(&job.prefixes[index / job.chunkSize]);
+        callStack->resolve(m_options & VLD_OPT_TRACE_INTERNAL_FRAMES);
+        EndReportCapture();
+    }
+    m_reportStats.stackDumpTicks += __rdtsc() - start;
+
+    {
+        CriticalSectionLocker<> cs(m_reportJobLock);
+        m_reportJob = &job;
+    }
+    ReleaseSemaphore(m_reportWork, m_reportThreadCount, NULL);
+    formatReportChunks(&job);
+    {
+        CriticalSectionLocker<> cs(m_reportJobLock);
+        m_reportJob = NULL;
+    }
+    if (InterlockedDecrement(&job.pending) != 0)
+        WaitForSingleObject(m_reportDone, INFINITE);
+
+    Report(L"WARNING: Visual Leak Detector detected memory leaks!\n");
+    for (LONG chunk = 0; chunk < job.chunkCount; chunk++) {
+        ReplayReport(job.prefixes[chunk]);
+        ReplayReport(job.chunks[chunk]);
+        m_reportStats.stackDumpTicks += job.stats[chunk].stackDumpTicks;
+        m_reportStats.dataDumpTicks += job.stats[chunk].dataDumpTicks;
+    }
+    delete [] job.stats;
+    delete [] job.chunks;
+    delete [] job.prefixes;
+    return leaksCount;
+}
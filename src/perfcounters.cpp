@@ -0,0 +1,250 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Performance Counter Provider
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// With "PerfCounters = yes", VLD registers as a perflib V2 provider and creates
+// an instance of the "Visual Leak Detector" counter set for the process, named
+// after the executable and the process ID. Every PerfCounterInterval
+// milliseconds, the instance's counters are set from the running totals VLD
+// keeps anyway, so PerfMon and PDH-based agents can graph them like any other
+// counters. The counter set is described by vldcounters.man, which has to be
+// registered once with "lodctr /m:vldcounters.man" for consumers to see it.
+
+#include "stdafx.h"
+#include <perflib.h>
+#define VLDBUILD
+#include "vldheap.h"    // Provides internal new and delete operators.
+#include "vldint.h"     // Provides access to VLD internals.
+
+// Imported global variables.
+extern HeapMapLock    g_heapMapLock;
+extern CallStackTable g_callStackTable;
+extern MetadataRegion g_metadataRegion;
+
+// The provider and counter set of vldcounters.man.
+static const GUID PerfProviderGuid =
+    { 0xc1d11ac2, 0x0ecb, 0x4c9a, { 0x9e, 0x37, 0x22, 0x9e, 0x46, 0x90, 0x1f, 0xa7 } };
+static const GUID PerfCounterSetGuid =
+    { 0x505ae215, 0xa75f, 0x4777, { 0x98, 0xf0, 0x0a, 0xa3, 0x61, 0x84, 0xcc, 0x42 } };
+
+// Counter IDs, as in vldcounters.man.
+#define VLDPERF_TRACKED_BYTES  1 // Bytes currently allocated by the program.
+#define VLDPERF_TRACKED_BLOCKS 2 // Blocks currently tracked.
+#define VLDPERF_ALLOCATIONS    3 // Allocations tracked, shown as a rate.
+#define VLDPERF_CALL_STACKS    4 // Call stacks in the intern table.
+#define VLDPERF_SAMPLE_RATE    5 // One in this many allocations is tracked (1 for all).
+#define VLDPERF_INTERNAL_BYTES 6 // VLD's private heap and metadata region.
+#define VLDPERF_PEAK_BYTES     7 // Most bytes ever allocated at once.
+#define VLDPERF_COUNTERS       7
+
+// The counter set template handed to PerfSetCounterSetInfo.
+struct perfcounterset_t {
+    PERF_COUNTERSET_INFO set;
+    PERF_COUNTER_INFO    counters [VLDPERF_COUNTERS];
+};
+
+// perflib (advapi32.dll on Windows Vista and later).
+typedef ULONG (WINAPI *PerfStartProvider_t) (LPGUID, PERFLIBREQUEST, HANDLE*);
+typedef ULONG (WINAPI *PerfStopProvider_t) (HANDLE);
+typedef ULONG (WINAPI *PerfSetCounterSetInfo_t) (HANDLE, PPERF_COUNTERSET_INFO, ULONG);
+typedef PPERF_COUNTERSET_INSTANCE (WINAPI *PerfCreateInstance_t) (HANDLE, LPCGUID, PCWSTR, ULONG);
+typedef ULONG (WINAPI *PerfDeleteInstance_t) (HANDLE, PPERF_COUNTERSET_INSTANCE);
+typedef ULONG (WINAPI *PerfSetULongLongCounterValue_t) (HANDLE, PPERF_COUNTERSET_INSTANCE, ULONG, ULONGLONG);
+
+static PerfStopProvider_t             s_PerfStopProvider = NULL;
+static PerfDeleteInstance_t           s_PerfDeleteInstance = NULL;
+static PerfSetULongLongCounterValue_t s_PerfSetULongLongCounterValue = NULL;
+
+// startPerfCounters - Registers the provider, creates the process's instance
+//   of the counter set and the thread which updates it. If any of them can't
+//   be created, VLD runs without performance counters.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::startPerfCounters ()
+{
+    HMODULE advapi32 = GetModuleHandleW(L"advapi32.dll");
+    PerfStartProvider_t PerfStartProvider = NULL;
+    PerfSetCounterSetInfo_t PerfSetCounterSetInfo = NULL;
+    PerfCreateInstance_t PerfCreateInstance = NULL;
+    if (advapi32 != NULL) {
+        PerfStartProvider = (PerfStartProvider_t)GetProcAddress(advapi32, "PerfStartProvider");
+        PerfSetCounterSetInfo = (PerfSetCounterSetInfo_t)GetProcAddress(advapi32, "PerfSetCounterSetInfo");
+        PerfCreateInstance = (PerfCreateInstance_t)GetProcAddress(advapi32, "PerfCreateInstance");
+        s_PerfStopProvider = (PerfStopProvider_t)GetProcAddress(advapi32, "PerfStopProvider");
+        s_PerfDeleteInstance = (PerfDeleteInstance_t)GetProcAddress(advapi32, "PerfDeleteInstance");
+        s_PerfSetULongLongCounterValue =
+            (PerfSetULongLongCounterValue_t)GetProcAddress(advapi32, "PerfSetULongLongCounterValue");
+    }
+    if ((PerfStartProvider == NULL) || (PerfSetCounterSetInfo == NULL) || (PerfCreateInstance == NULL) ||
+        (s_PerfStopProvider == NULL) || (s_PerfDeleteInstance == NULL) || (s_PerfSetULongLongCounterValue == NULL)) {
+        Report(L"WARNING: Visual Leak Detector: Performance counters aren't available on this system.\n");
+        return;
+    }
+
+    ULONG status = PerfStartProvider((LPGUID)&PerfProviderGuid, NULL, &m_perfProvider);
+    if (status != ERROR_SUCCESS) {
+        Report(L"WARNING: Visual Leak Detector: Couldn't register the performance counter provider (error %u).\n", status);
+        m_perfProvider = NULL;
+        return;
+    }
+
+    // Every counter is 64 bits wide, one after the other in the instance.
+    static const ULONG types [VLDPERF_COUNTERS] = {
+        PERF_COUNTER_LARGE_RAWCOUNT, PERF_COUNTER_LARGE_RAWCOUNT, PERF_COUNTER_BULK_COUNT,
+        PERF_COUNTER_LARGE_RAWCOUNT, PERF_COUNTER_LARGE_RAWCOUNT, PERF_COUNTER_LARGE_RAWCOUNT,
+        PERF_COUNTER_LARGE_RAWCOUNT
+    };
+    perfcounterset_t info;
+    ZeroMemory(&info, sizeof(info));
+    info.set.CounterSetGuid = PerfCounterSetGuid;
+    info.set.ProviderGuid   = PerfProviderGuid;
+    info.set.NumCounters    = VLDPERF_COUNTERS;
+    info.set.InstanceType   = PERF_COUNTERSET_MULTI_INSTANCES;
+    for (ULONG index = 0; index < VLDPERF_COUNTERS; index++) {
+        info.counters[index].CounterId   = index + 1;
+        info.counters[index].Type        = types[index];
+        info.counters[index].Size        = sizeof(ULONGLONG);
+        info.counters[index].DetailLevel = PERF_DETAIL_NOVICE;
+        info.counters[index].Offset      = index * sizeof(ULONGLONG);
+    }
+    status = PerfSetCounterSetInfo(m_perfProvider, &info.set, sizeof(info));
+    if (status == ERROR_SUCCESS) {
+        WCHAR path [MAX_PATH];
+        GetModuleFileNameW(NULL, path, MAX_PATH);
+        path[MAX_PATH - 1] = L'\0';
+        LPCWSTR name = wcsrchr(path, L'\\');
+        name = (name != NULL) ? name + 1 : path;
+        WCHAR instance [MAX_PATH + 16];
+        swprintf_s(instance, _countof(instance), L"%s_%u", name, GetCurrentProcessId());
+        m_perfInstance = PerfCreateInstance(m_perfProvider, &PerfCounterSetGuid, instance, GetCurrentProcessId());
+        if (m_perfInstance == NULL)
+            status = GetLastError();
+    }
+    if (status != ERROR_SUCCESS) {
+        Report(L"WARNING: Visual Leak Detector: Couldn't create the performance counters (error %u).\n", status);
+        stopPerfCounters();
+        return;
+    }
+
+    publishPerfCounters();
+    m_perfWake = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (m_perfWake != NULL)
+        m_perfThread = CreateThread(NULL, 0, perfCountersProc, this, 0, &m_perfThreadId);
+    if (m_perfThread == NULL)
+        stopPerfCounters();
+}
+
+// stopPerfCounters - Stops updating the performance counters, deletes the
+//   process's instance and unregisters the provider. Like stopLiveView, this
+//   never waits for the thread to exit, only for it to finish the update it
+//   may be making.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::stopPerfCounters ()
+{
+    if (m_perfProvider == NULL)
+        return;
+
+    {
+        CriticalSectionLocker<> cs(m_perfLock);
+        m_perfStop = TRUE;
+        if (m_perfInstance != NULL) {
+            s_PerfDeleteInstance(m_perfProvider, m_perfInstance);
+            m_perfInstance = NULL;
+        }
+    }
+    if (m_perfThread != NULL) {
+        SetEvent(m_perfWake);
+        if (WaitForSingleObject(m_perfThread, 0) == WAIT_OBJECT_0) {
+            CloseHandle(m_perfWake);
+            m_perfWake = NULL;
+        }
+        CloseHandle(m_perfThread);
+        m_perfThread = NULL;
+        m_perfThreadId = 0;
+    }
+    else if (m_perfWake != NULL) {
+        CloseHandle(m_perfWake);
+        m_perfWake = NULL;
+    }
+
+    s_PerfStopProvider(m_perfProvider);
+    m_perfProvider = NULL;
+}
+
+// perfCountersProc - Updates the performance counters every
+//   PerfCounterInterval milliseconds until they are stopped.
+//
+//  - param (IN): The VisualLeakDetector.
+//
+//  Return Value:
+//
+//    Always returns 0.
+//
+DWORD WINAPI VisualLeakDetector::perfCountersProc (LPVOID param)
+{
+    VisualLeakDetector *vld = (VisualLeakDetector*)param;
+    while (WaitForSingleObject(vld->m_perfWake, vld->m_perfCounterInterval) == WAIT_TIMEOUT) {
+        CriticalSectionLocker<> cs(vld->m_perfLock);
+        if (vld->m_perfStop)
+            break;
+        vld->publishPerfCounters();
+    }
+    return 0;
+}
+
+// publishPerfCounters - Sets the counters of the process's instance. They are
+//   all read from running totals: the blocks are counted from each heap's
+//   per-shard counts, one shard at a time, which takes no walk of the blocks.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::publishPerfCounters ()
+{
+    UINT64 blocks = 0;
+    for (UINT shard = 0; shard < BLOCKMAPSHARDS; shard++) {
+        CriticalSectionLocker<> cs(g_heapMapLock.ShardAt(shard));
+        for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit)
+            blocks += (*heapit).second->blocks[shard];
+    }
+    const capturepolicy_t *policy = m_capturePolicy;
+    UINT64 samplerate = (policy->sampleRate > 1) ? policy->sampleRate : 1;
+    SIZE_T allocations, current, peak, total;
+    readAllocTotals(allocations, current, peak, total);
+
+    s_PerfSetULongLongCounterValue(m_perfProvider, m_perfInstance, VLDPERF_TRACKED_BYTES, current);
+    s_PerfSetULongLongCounterValue(m_perfProvider, m_perfInstance, VLDPERF_TRACKED_BLOCKS, blocks);
+    s_PerfSetULongLongCounterValue(m_perfProvider, m_perfInstance, VLDPERF_ALLOCATIONS, allocations);
+    s_PerfSetULongLongCounterValue(m_perfProvider, m_perfInstance, VLDPERF_CALL_STACKS, g_callStackTable.Count());
+    s_PerfSetULongLongCounterValue(m_perfProvider, m_perfInstance, VLDPERF_SAMPLE_RATE, samplerate);
+    s_PerfSetULongLongCounterValue(m_perfProvider, m_perfInstance, VLDPERF_INTERNAL_BYTES,
+        GetVldHeapBytes() + g_metadataRegion.Bytes());
+    s_PerfSetULongLongCounterValue(m_perfProvider, m_perfInstance, VLDPERF_PEAK_BYTES, peak);
+}
@@ -0,0 +1,563 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Reachability Scan
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#define VLDBUILD
+#include <tlhelp32.h>
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>  // Provides the SSE2 intrinsics.
+#include <nmmintrin.h>  // Provides the SSE4.2 64-bit comparison.
+#endif
+#include "vldheap.h"    // Provides internal new and delete operators.
+#include "vldint.h"     // Provides access to VLD internals.
+
+// Imported global variables.
+extern HeapMapLock g_heapMapLock;
+
+#define VLD_SCAN_CHUNK     0x10000 // Bytes of a root claimed by a marking thread at a time.
+#define VLD_SCAN_TEB_BYTES 0x2000  // Bytes of each thread environment block scanned, for its TLS slots.
+
+// A tracked block, in the reachability scan's sorted address array. The range
+// is that of the block's user data, so that the CRT's list of debug blocks,
+// which links their headers, doesn't make them all reachable.
+struct scanblock_t {
+    UINT_PTR start;
+    UINT_PTR end;                // Just past the block (and past its start, even if it is empty).
+};
+
+// A range of memory scanned for pointers to tracked blocks.
+struct scanrange_t {
+    UINT_PTR start;
+    UINT_PTR end;
+};
+
+// The blocks a marking thread found reachable, and is yet to scan.
+struct scanstack_t {
+    SIZE_T  *indices;
+    SIZE_T   count;
+    SIZE_T   capacity;
+};
+
+// A conservative reachability scan: any pointer-sized, pointer-aligned value
+// in a root, or in a block found reachable, which falls within a tracked
+// block makes that block reachable. The roots are the writable sections of
+// the loaded modules, and the stacks and TLS slots of the process' threads.
+// The roots are split into chunks, which the report threads and the reporting
+// thread claim side by side; each thread then scans the blocks it finds
+// reachable itself.
+struct reachscan_t {
+    scanblock_t   *blocks;       // Every tracked block, by increasing address.
+    SIZE_T         blockCount;
+    UINT_PTR       low;          // Start of the first block.
+    UINT_PTR       span;         // From the start of the first block to the end of the last.
+    volatile LONG *marks;        // One bit per block, set once the block is found reachable.
+    scanrange_t   *roots;        // The chunks of the roots.
+    SIZE_T         rootCount;
+    SIZE_T         rootCapacity;
+    SIZE_T         rootBytes;    // Total size of the roots.
+    bool           sse42;        // Whether the 64-bit values can be filtered with SSE4.2.
+    volatile LONG  nextRoot;     // Index of the next chunk to be claimed.
+    volatile LONG  pending;      // Threads working on the scan.
+    volatile LONG  faults;       // Chunks or blocks which couldn't be read to the end.
+};
+
+// compareScanBlocks - qsort callback ordering blocks by address.
+static int __cdecl compareScanBlocks (const void *first, const void *second)
+{
+    const scanblock_t *a = (const scanblock_t*)first;
+    const scanblock_t *b = (const scanblock_t*)second;
+    return (a->start < b->start) ? -1 : (a->start > b->start) ? 1 : 0;
+}
+
+// findScanBlock - Searches the scan's blocks for the one containing an
+//   address.
+//
+//  - scan (IN): The scan.
+//
+//  - address (IN): The address.
+//
+//  Return Value:
+//
+//    Returns the index of the block, or -1 if no block contains the address.
+//
+static __forceinline SIZE_T findScanBlock (const reachscan_t *scan, UINT_PTR address)
+{
+    if (address - scan->low >= scan->span)
+        return (SIZE_T)-1;
+    SIZE_T low = 0;
+    SIZE_T high = scan->blockCount;
+    while (low < high) {
+        SIZE_T middle = low + (high - low) / 2;
+        if (scan->blocks[middle].start <= address)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    if ((low == 0) || (address >= scan->blocks[low - 1].end))
+        return (SIZE_T)-1;
+    return low - 1;
+}
+
+// checkScanValue - Marks the block a value points into, if any, and pushes it
+//   if it wasn't marked yet.
+static __forceinline VOID checkScanValue (reachscan_t *scan, UINT_PTR value, scanstack_t *stack)
+{
+    SIZE_T index = findScanBlock(scan, value);
+    if ((index == (SIZE_T)-1) || InterlockedBitTestAndSet(&scan->marks[index / 32], (LONG)(index % 32)))
+        return;
+
+    if (stack->count == stack->capacity) {
+        SIZE_T capacity = (stack->capacity == 0) ? 256 : stack->capacity * 2;
+        SIZE_T *indices = new SIZE_T [capacity];
+        if (stack->count != 0)
+            memcpy(indices, stack->indices, stack->count * sizeof(SIZE_T));
+        delete [] stack->indices;
+        stack->indices = indices;
+        stack->capacity = capacity;
+    }
+    stack->indices[stack->count++] = index;
+}
+
+// scanRange - Looks for pointers to tracked blocks in a range of memory. Most
+//   values don't fall within the span of the tracked blocks at all, so they
+//   are ruled out 16 or 32 bytes at a time before any block is searched for:
+//   a value is within the span if its offset from the first block, compared
+//   as unsigned (by flipping the sign bits), is below the span.
+//
+//  - scan (IN/OUT): The scan.
+//
+//  - start (IN): Start of the range.
+//
+//  - end (IN): End of the range.
+//
+//  - stack (IN/OUT): Receives the blocks newly found reachable.
+//
+//  Return Value:
+//
+//    None.
+//
+static VOID scanRange (reachscan_t *scan, UINT_PTR start, UINT_PTR end, scanstack_t *stack)
+{
+    const UINT_PTR *value = (const UINT_PTR*)((start + sizeof(UINT_PTR) - 1) & ~(UINT_PTR)(sizeof(UINT_PTR) - 1));
+    const UINT_PTR *last = (const UINT_PTR*)(end & ~(UINT_PTR)(sizeof(UINT_PTR) - 1));
+#if defined(_M_X64)
+    if (scan->sse42) {
+        const __m128i sign = _mm_set1_epi64x((LONGLONG)0x8000000000000000ULL);
+        const __m128i low = _mm_set1_epi64x((LONGLONG)scan->low);
+        const __m128i span = _mm_xor_si128(_mm_set1_epi64x((LONGLONG)scan->span), sign);
+        for (; value + 4 <= last; value += 4) {
+            __m128i first = _mm_xor_si128(_mm_sub_epi64(_mm_loadu_si128((const __m128i*)value), low), sign);
+            __m128i second = _mm_xor_si128(_mm_sub_epi64(_mm_loadu_si128((const __m128i*)(value + 2)), low), sign);
+            __m128i within = _mm_or_si128(_mm_cmpgt_epi64(span, first), _mm_cmpgt_epi64(span, second));
+            if (_mm_movemask_epi8(within) == 0)
+                continue;
+            for (UINT32 index = 0; index < 4; index++)
+                checkScanValue(scan, value[index], stack);
+        }
+    }
+#elif defined(_M_IX86)
+    const __m128i sign = _mm_set1_epi32((int)0x80000000);
+    const __m128i low = _mm_set1_epi32((int)scan->low);
+    const __m128i span = _mm_xor_si128(_mm_set1_epi32((int)scan->span), sign);
+    for (; value + 8 <= last; value += 8) {
+        __m128i first = _mm_xor_si128(_mm_sub_epi32(_mm_loadu_si128((const __m128i*)value), low), sign);
+        __m128i second = _mm_xor_si128(_mm_sub_epi32(_mm_loadu_si128((const __m128i*)(value + 4)), low), sign);
+        __m128i within = _mm_or_si128(_mm_cmpgt_epi32(span, first), _mm_cmpgt_epi32(span, second));
+        if (_mm_movemask_epi8(within) == 0)
+            continue;
+        for (UINT32 index = 0; index < 8; index++)
+            checkScanValue(scan, value[index], stack);
+    }
+#endif
+    for (; value < last; value++)
+        checkScanValue(scan, *value, stack);
+}
+
+// scanRangeSafe - Scans a range like scanRange, stopping at the first byte
+//   which can't be read. A root gathered while its thread still ran may have
+//   gone away since.
+static VOID scanRangeSafe (reachscan_t *scan, UINT_PTR start, UINT_PTR end, scanstack_t *stack)
+{
+    __try {
+        scanRange(scan, start, end, stack);
+    }
+    __except(EXCEPTION_EXECUTE_HANDLER) {
+        InterlockedIncrement(&scan->faults);
+    }
+}
+
+// markFromRoots - Claims chunks of the roots and scans them, along with every
+//   block found reachable from them, until no chunk is left.
+//
+//  - scan (IN/OUT): The scan.
+//
+//  Return Value:
+//
+//    None.
+//
+static VOID markFromRoots (reachscan_t *scan)
+{
+    scanstack_t stack = { NULL, 0, 0 };
+    for (;;) {
+        SIZE_T root = (SIZE_T)(InterlockedIncrement(&scan->nextRoot) - 1);
+        if (root >= scan->rootCount)
+            break;
+        scanRangeSafe(scan, scan->roots[root].start, scan->roots[root].end, &stack);
+        while (stack.count != 0) {
+            const scanblock_t &block = scan->blocks[stack.indices[--stack.count]];
+            scanRangeSafe(scan, block.start, block.end, &stack);
+        }
+    }
+    delete [] stack.indices;
+}
+
+// addScanRoot - Adds the readable parts of a range of memory to the roots of
+//   a scan, in chunks of at most VLD_SCAN_CHUNK bytes.
+//
+//  - scan (IN/OUT): The scan.
+//
+//  - start (IN): Start of the range.
+//
+//  - end (IN): End of the range.
+//
+//  Return Value:
+//
+//    None.
+//
+static VOID addScanRoot (reachscan_t *scan, UINT_PTR start, UINT_PTR end)
+{
+    const DWORD readable = PAGE_READONLY | PAGE_READWRITE | PAGE_WRITECOPY |
+        PAGE_EXECUTE_READ | PAGE_EXECUTE_READWRITE | PAGE_EXECUTE_WRITECOPY;
+    UINT_PTR address = start;
+    while (address < end) {
+        MEMORY_BASIC_INFORMATION region;
+        if (VirtualQuery((LPCVOID)address, &region, sizeof(region)) == 0)
+            return;
+        UINT_PTR stop = (UINT_PTR)region.BaseAddress + region.RegionSize;
+        if ((stop > end) || (stop <= address))
+            stop = end;
+        if ((region.State == MEM_COMMIT) && (region.Protect & readable) && !(region.Protect & PAGE_GUARD)) {
+            for (UINT_PTR chunk = address; chunk < stop; ) {
+                UINT_PTR next = ((stop - chunk) > VLD_SCAN_CHUNK) ? chunk + VLD_SCAN_CHUNK : stop;
+                if (scan->rootCount == scan->rootCapacity) {
+                    SIZE_T capacity = (scan->rootCapacity == 0) ? 256 : scan->rootCapacity * 2;
+                    scanrange_t *roots = new scanrange_t [capacity];
+                    if (scan->rootCount != 0)
+                        memcpy(roots, scan->roots, scan->rootCount * sizeof(scanrange_t));
+                    delete [] scan->roots;
+                    scan->roots = roots;
+                    scan->rootCapacity = capacity;
+                }
+                scan->roots[scan->rootCount].start = chunk;
+                scan->roots[scan->rootCount].end = next;
+                scan->rootCount++;
+                scan->rootBytes += next - chunk;
+                chunk = next;
+            }
+        }
+        address = stop;
+    }
+}
+
+// addModuleRoots - Adds the writable sections of a module to the roots of a
+//   scan.
+//
+//  - scan (IN/OUT): The scan.
+//
+//  - base (IN): Base address of the module.
+//
+//  Return Value:
+//
+//    None.
+//
+static VOID addModuleRoots (reachscan_t *scan, UINT_PTR base)
+{
+    __try {
+        const IMAGE_DOS_HEADER *dos = (const IMAGE_DOS_HEADER*)base;
+        if (dos->e_magic != IMAGE_DOS_SIGNATURE)
+            return;
+        const IMAGE_NT_HEADERS *nt = (const IMAGE_NT_HEADERS*)(base + dos->e_lfanew);
+        if (nt->Signature != IMAGE_NT_SIGNATURE)
+            return;
+        const IMAGE_SECTION_HEADER *section = IMAGE_FIRST_SECTION(nt);
+        for (WORD index = 0; index < nt->FileHeader.NumberOfSections; index++, section++) {
+            if (!(section->Characteristics & IMAGE_SCN_MEM_WRITE))
+                continue;
+            DWORD size = (section->Misc.VirtualSize != 0) ? section->Misc.VirtualSize : section->SizeOfRawData;
+            addScanRoot(scan, base + section->VirtualAddress, base + section->VirtualAddress + size);
+        }
+    }
+    __except(EXCEPTION_EXECUTE_HANDLER) {
+        // The module went away.
+    }
+}
+
+// addThreadRoots - Adds the stack and the TLS slots of a thread to the roots
+//   of a scan: its committed stack, or only what's above the stack pointer
+//   for the current thread, and the start of its environment block.
+//
+//  - scan (IN/OUT): The scan.
+//
+//  - tib (IN): The thread's environment block.
+//
+//  - stackPointer (IN): The current stack pointer, for the current thread,
+//      or 0.
+//
+//  Return Value:
+//
+//    None.
+//
+static VOID addThreadRoots (reachscan_t *scan, const NT_TIB *tib, UINT_PTR stackPointer)
+{
+    __try {
+        UINT_PTR stackLow = (stackPointer != 0) ? stackPointer : (UINT_PTR)tib->StackLimit;
+        addScanRoot(scan, stackLow, (UINT_PTR)tib->StackBase);
+        addScanRoot(scan, (UINT_PTR)tib, (UINT_PTR)tib + VLD_SCAN_TEB_BYTES);
+    }
+    __except(EXCEPTION_EXECUTE_HANDLER) {
+        // The thread exited.
+    }
+}
+
+// gatherScanRoots - Adds the writable sections of every module but VLD's, and
+//   the stacks and TLS slots of every thread but VLD's own, to the roots of
+//   a scan. The other threads keep running, so only the memory they had
+//   stored pointers in counts; pointers held in registers are missed.
+//
+//  - scan (IN/OUT): The scan.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::gatherScanRoots (reachscan_t *scan)
+{
+    ModuleRangesReader reader(*this, getTls());
+    const moduleranges_t *modules = reader.Table();
+    if (modules != NULL) {
+        for (SIZE_T index = 0; index < modules->count; index++) {
+            if (modules->ranges[index].addrLow != (UINT_PTR)m_vldBase)
+                addModuleRoots(scan, modules->ranges[index].addrLow);
+        }
+    }
+
+    HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+    if (snapshot == INVALID_HANDLE_VALUE)
+        return;
+    DWORD processId = GetCurrentProcessId();
+    DWORD currentId = GetCurrentThreadId();
+    THREADENTRY32 entry;
+    entry.dwSize = sizeof(entry);
+    for (BOOL more = Thread32First(snapshot, &entry); more; more = Thread32Next(snapshot, &entry)) {
+        if ((entry.th32OwnerProcessID != processId) || isVLDThread(entry.th32ThreadID))
+            continue;
+        if (entry.th32ThreadID == currentId) {
+            addThreadRoots(scan, (const NT_TIB*)NtCurrentTeb(), (UINT_PTR)_AddressOfReturnAddress());
+            continue;
+        }
+        if (m_NtQueryInformationThread == NULL)
+            continue;
+        HANDLE thread = OpenThread(THREAD_QUERY_INFORMATION, FALSE, entry.th32ThreadID);
+        if (thread == NULL)
+            continue;
+        threadbasicinformation_t info;
+        if (m_NtQueryInformationThread(thread, THREADBASICINFORMATION, &info, sizeof(info), NULL) == STATUS_SUCCESS)
+            addThreadRoots(scan, (const NT_TIB*)info.tebBaseAddress, 0);
+        CloseHandle(thread);
+    }
+    CloseHandle(snapshot);
+}
+
+// joinScan - Counts a report thread as working on a scan. Called with
+//   m_reportJobLock held, while the scan is posted in m_scanJob.
+//
+//  - scan (IN/OUT): The scan.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::joinScan (reachscan_t *scan)
+{
+    InterlockedIncrement(&scan->pending);
+}
+
+// markScan - Helps mark a scan the report thread has joined, then leaves it.
+//
+//  - scan (IN/OUT): The scan.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::markScan (reachscan_t *scan)
+{
+    markFromRoots(scan);
+    if (InterlockedDecrement(&scan->pending) == 0)
+        SetEvent(m_reportDone);
+}
+
+// scanReachability - Finds out which tracked blocks can still be reached from
+//   the roots (see reachscan_t), for the report about to be generated. With
+//   "ReachabilityScan = unreachable", the leaks found reachable are then
+//   marked as reported, so that only the unreachable ones are resolved and
+//   reported. Must be called with the whole heap map lock held.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::scanReachability ()
+{
+    ULONGLONG start = GetTickCount64();
+    reachscan_t *scan = new reachscan_t;
+    ZeroMemory(scan, sizeof(reachscan_t));
+    scan->sse42 = HasSse42();
+
+    // Every tracked block counts, leaked or not: those already reported may
+    // still point to leaks.
+    SIZE_T capacity = 0;
+    for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
+        BlockMap *blockmap = &(*heapit).second->blockMap;
+        for (BlockMap::Iterator blockit = blockmap->begin(); blockit != blockmap->end(); ++blockit)
+            capacity++;
+    }
+    scan->blocks = new scanblock_t [capacity + 1];
+    for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
+        BlockMap *blockmap = &(*heapit).second->blockMap;
+        for (BlockMap::Iterator blockit = blockmap->begin(); blockit != blockmap->end(); ++blockit) {
+            LPCVOID block = (*blockit).first;
+            blockinfo_t *info = (*blockit).second;
+            UINT_PTR address = (UINT_PTR)block;
+            SIZE_T size = info->size;
+            if (isDebugCrtAlloc(block, info)) {
+                address = (UINT_PTR)CRTDBGBLOCKDATA(block);
+                size = getCrtBlockSize(block, info);
+            }
+            scanblock_t &entry = scan->blocks[scan->blockCount++];
+            entry.start = address;
+            entry.end = address + ((size != 0) ? size : 1);
+        }
+    }
+    qsort(scan->blocks, scan->blockCount, sizeof(scanblock_t), compareScanBlocks);
+    if (scan->blockCount != 0) {
+        scan->low = scan->blocks[0].start;
+        UINT_PTR high = 0;
+        for (SIZE_T index = 0; index < scan->blockCount; index++)
+            high = max(high, scan->blocks[index].end);
+        scan->span = high - scan->low;
+    }
+    SIZE_T markWords = (scan->blockCount + 31) / 32;
+    scan->marks = new LONG [markWords + 1];
+    ZeroMemory((PVOID)scan->marks, (markWords + 1) * sizeof(LONG));
+
+    gatherScanRoots(scan);
+
+    // The report threads help, unless they have been terminated along with
+    // the rest of the process (see reportLeaksInParallel).
+    bool alone = (m_reportThreadCount == 0) || (scan->rootCount < 2) ||
+        (WaitForSingleObject(m_reportThreads[0], 0) != WAIT_TIMEOUT);
+    scan->pending = 1;
+    if (!alone) {
+        {
+            CriticalSectionLocker<> cs(m_reportJobLock);
+            m_scanJob = scan;
+        }
+        ReleaseSemaphore(m_reportWork, m_reportThreadCount, NULL);
+    }
+    markFromRoots(scan);
+    if (!alone) {
+        {
+            CriticalSectionLocker<> cs(m_reportJobLock);
+            m_scanJob = NULL;
+        }
+        if (InterlockedDecrement(&scan->pending) != 0)
+            WaitForSingleObject(m_reportDone, INFINITE);
+    }
+    m_reachScan = scan;
+
+    SIZE_T leaks = 0;
+    SIZE_T unreachable = 0;
+    for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
+        BlockMap *blockmap = &(*heapit).second->blockMap;
+        for (BlockMap::Iterator blockit = blockmap->begin(); blockit != blockmap->end(); ++blockit) {
+            LPCVOID address;
+            SIZE_T  size;
+            blockinfo_t *info = (*blockit).second;
+            if (!getLeakedBlock((*blockit).first, info, address, size))
+                continue;
+            leaks++;
+            if (reachabilityOf(address) == reachability_unreachable)
+                unreachable++;
+            else if (m_reachabilityScan == VLD_REACHABILITY_UNREACHABLE)
+                markReported(info);
+        }
+    }
+
+    if (scan->faults != 0) {
+        Report(L"WARNING: Visual Leak Detector: %ld memory ranges became unreadable during the reachability scan; "
+            L"some leaks may be wrongly found unreachable.\n", scan->faults);
+    }
+    Report(L"Visual Leak Detector: %Iu of %Iu leaks are unreachable (%Iu bytes of roots scanned in %llu ms)%s.\n",
+        unreachable, leaks, scan->rootBytes, GetTickCount64() - start,
+        (m_reachabilityScan == VLD_REACHABILITY_UNREACHABLE) ? L"; only those are reported" : L"");
+}
+
+// reachabilityOf - Tells what the reachability scan of the current report
+//   found out about a block.
+//
+//  - address (IN): Address of the block's user data.
+//
+//  Return Value:
+//
+//    Returns reachability_unknown if no scan was made for the report.
+//
+reachability_e VisualLeakDetector::reachabilityOf (LPCVOID address) const
+{
+    const reachscan_t *scan = m_reachScan;
+    if (scan == NULL)
+        return reachability_unknown;
+    SIZE_T index = findScanBlock(scan, (UINT_PTR)address);
+    if (index == (SIZE_T)-1)
+        return reachability_unknown;
+    return (scan->marks[index / 32] & (1 << (index % 32))) ? reachability_reachable : reachability_unreachable;
+}
+
+// releaseReachability - Frees the result of the reachability scan, once the
+//   report it was made for is complete.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::releaseReachability ()
+{
+    reachscan_t *scan = m_reachScan;
+    if (scan == NULL)
+        return;
+    m_reachScan = NULL;
+    delete [] scan->blocks;
+    delete [] (LONG*)scan->marks;
+    delete [] scan->roots;
+    delete scan;
+}
@@ -44,7 +44,10 @@ Applications should never include this header."
 //  nature, this set class has a noticeable performance advantage over some
 //  other standard STL set implementations.
 //
-template <typename Tk>
+//  Lock is the lock policy of the underlying Tree. Use NoLock for sets which
+//  are only accessed under some other lock.
+//
+template <typename Tk, typename Lock = CriticalSection>
 class Set {
 public:
     class Iterator {
@@ -130,7 +133,7 @@ public:
         // 
         Iterator operator ++ ()
         {
-            typename Tree<Tk>::node_t *cur = m_node;
+            typename Tree<Tk, Lock>::node_t *cur = m_node;
 
             m_node = m_tree->next(m_node);
             return Iterator(m_tree, cur);
@@ -150,7 +153,7 @@ public:
         //
         Iterator operator - (SIZE_T num) const
         {
-            typename Tree<Tk>::node_t *cur = m_node;
+            typename Tree<Tk, Lock>::node_t *cur = m_node;
 
             for (SIZE_T count = 0; count < num; count++)  {
                 cur = m_tree->prev(cur);
@@ -181,18 +184,18 @@ public:
         // Private constructor. Only the Set class itself may use this
         //   constructor. It is used for constructing Iterators which reference
         //   specific nodes in the internal tree's structure.
-        Iterator (const Tree<Tk> *tree, typename Tree<Tk>::node_t *node)
+        Iterator (const Tree<Tk, Lock> *tree, typename Tree<Tk, Lock>::node_t *node)
         {
             m_node = node;
             m_tree = tree;
         }
 
     protected:
-        typename Tree<Tk>::node_t *m_node; // Pointer to the node referenced by the Set Iterator.
-        const Tree<Tk>            *m_tree; // Pointer to the tree containing the referenced node.
+        typename Tree<Tk, Lock>::node_t *m_node; // Pointer to the node referenced by the Set Iterator.
+        const Tree<Tk, Lock>            *m_tree; // Pointer to the tree containing the referenced node.
 
         // The Set class is a friend of Set Iterators.
-        friend class Set<Tk>;
+        friend class Set<Tk, Lock>;
     };
 
     // Muterator class - This class provides a mutable Iterator (the regular
@@ -299,6 +302,21 @@ public:
         return Iterator(&m_tree, m_tree.find(key));
     }
 
+    // floor - Finds the greatest key in the Set which isn't greater than the
+    //   specified key.
+    //
+    //  - key (IN): The key to look for.
+    //
+    //  Return Value:
+    //
+    //    Returns an Iterator referencing the found key. If every key in the
+    //    Set is greater than 'key', then the "NULL" Iterator is returned.
+    //
+    Iterator floor (const Tk &key) const
+    {
+        return Iterator(&m_tree, m_tree.floor(key));
+    }
+
     // insert - Inserts a key into the Set.
     //
     //  - key (IN): The key to be inserted.
@@ -329,7 +347,26 @@ public:
         return m_tree.reserve(count);
     }
 
+    // compact - Frees the Set's spare storage. This invalidates every
+    //   Iterator into the Set (see Tree::compact).
+    //
+    //  Return Value:
+    //
+    //    Returns the number of keys' worth of storage freed.
+    //
+    size_t compact ()
+    {
+        return m_tree.compact();
+    }
+
+    // bytes - Returns the bytes of storage the set's nodes take, free nodes
+    //   included.
+    size_t bytes () const
+    {
+        return m_tree.capacity() * sizeof(typename Tree<Tk, Lock>::node_t);
+    }
+
 private:
     // Private data
-    Tree<Tk> m_tree; // The keys are actually stored in a tree.
+    Tree<Tk, Lock> m_tree; // The keys are actually stored in a tree.
 };
@@ -0,0 +1,344 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Address-Sharded Map and Lock Templates
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#ifndef VLDBUILD
+#error \
+"This header should only be included by Visual Leak Detector when building it from source. \
+Applications should never include this header."
+#endif
+
+#include "criticalsection.h" // Provides the CriticalSection class.
+#include "map.h"             // Provides access to the Map template class.
+
+// ShardIndex - Maps an address onto one of "shards" buckets. The low bits of
+//   heap addresses are mostly alignment, so they are shifted out before the
+//   bits are mixed. "shards" must be a power of two.
+//
+//  - address (IN): The address to be hashed.
+//
+//  - shards (IN): The number of shards.
+//
+//  Return Value:
+//
+//    Returns the index of the shard that owns the address.
+//
+inline UINT ShardIndex (LPCVOID address, UINT shards)
+{
+    UINT_PTR a = (UINT_PTR)address >> 4;
+    a ^= (a >> 7) ^ (a >> 13);
+    return (UINT)(a & (shards - 1));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The ShardedLock Template Class
+//
+//  An array of critical sections, indexed by address. Threads working on
+//  unrelated addresses lock different shards and so don't serialize on each
+//  other. Enter/Leave acquire and release every shard (always in ascending
+//  order), so a ShardedLock can be used with CriticalSectionLocker wherever
+//  a consistent view of everything guarded by the shards is needed.
+//
+//  Note: a thread which holds a single shard must release it before entering
+//    the whole lock; otherwise two threads can deadlock on each other's shard.
+//
+//  Each shard's critical section has a cache line to itself. Otherwise the
+//  threads entering neighbouring shards would still contend, on the line
+//  shared by their critical sections.
+//
+#define SHARD_CACHE_LINE 64 // Bytes per cache line.
+
+template <UINT Shards>
+class ShardedLock
+{
+public:
+    void Initialize ()
+    {
+        for (UINT index = 0; index < Shards; index++)
+            m_shards[index].lock.Initialize();
+    }
+
+    void Delete ()
+    {
+        for (UINT index = 0; index < Shards; index++)
+            m_shards[index].lock.Delete();
+    }
+
+    // Enter - Acquires every shard.
+    void Enter ()
+    {
+        for (UINT index = 0; index < Shards; index++)
+            m_shards[index].lock.Enter();
+    }
+
+    // Leave - Releases every shard, in the reverse order they were acquired.
+    void Leave ()
+    {
+        for (UINT index = Shards; index > 0; index--)
+            m_shards[index - 1].lock.Leave();
+    }
+
+    // Profile - Counts the acquisitions of every shard into one profile.
+    void Profile (lockprofile_t *profile)
+    {
+        for (UINT index = 0; index < Shards; index++)
+            m_shards[index].lock.Profile(profile);
+    }
+
+    // Shard - Obtains the critical section guarding the specified address.
+    CriticalSection& Shard (LPCVOID address)
+    {
+        return m_shards[ShardIndex(address, Shards)].lock;
+    }
+
+    // ShardAt - Obtains the critical section of a shard by its index.
+    CriticalSection& ShardAt (UINT index)
+    {
+        return m_shards[index].lock;
+    }
+
+private:
+    struct __declspec(align(SHARD_CACHE_LINE)) shard_t {
+        CriticalSection lock;
+    };
+    shard_t m_shards [Shards];
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The ShardedMap Template Class
+//
+//  A Map whose key/value pairs are spread across several underlying maps by
+//  address, using the same ShardIndex as ShardedLock. Keys in different
+//  shards never touch the same container, so inserts and erases on them
+//  don't contend.
+//
+//  The interface mirrors the subset of Map used by Visual Leak Detector.
+//  Iterators walk the shards one after another, so iteration order is only
+//  ordered within a shard. ShardMap selects the container used for each
+//  shard; it must provide the same interface as Map (HashMap does).
+//
+template <typename Tk, typename Tv, UINT Shards, typename ShardMap = Map<Tk, Tv> >
+class ShardedMap {
+public:
+    typedef ShardMap ShardType; // The map holding each shard.
+
+    class Iterator {
+    public:
+        // Constructor
+        Iterator ()
+        {
+            // Plainly constructed iterators don't reference anything.
+            m_map   = NULL;
+            m_shard = Shards;
+        }
+
+        // operator != - Inequality operator for ShardedMap Iterators.
+        BOOL operator != (const Iterator &other) const
+        {
+            return !(*this == other);
+        }
+
+        // operator == - Equality operator for ShardedMap Iterators. Two
+        //   Iterators are equal if they reference the same key/value pair of
+        //   the same ShardedMap.
+        BOOL operator == (const Iterator &other) const
+        {
+            return ((m_map == other.m_map) && (m_shard == other.m_shard) && (m_it == other.m_it));
+        }
+
+        // operator * - Dereference operator for ShardedMap Iterators.
+        const Pair<Tk, Tv>& operator * () const
+        {
+            return *m_it;
+        }
+
+        // operator ++ - Prefix increment operator for ShardedMap Iterators.
+        Iterator& operator ++ (int)
+        {
+            m_it++;
+            skipEmpty();
+            return *this;
+        }
+
+        // operator ++ - Postfix increment operator for ShardedMap Iterators.
+        Iterator operator ++ ()
+        {
+            Iterator cur = *this;
+
+            m_it++;
+            skipEmpty();
+            return cur;
+        }
+
+    private:
+        // Private constructor. Only the ShardedMap class itself may use this
+        //   constructor.
+        Iterator (const ShardedMap *map, UINT shard, const typename ShardMap::Iterator &it)
+        {
+            m_map   = map;
+            m_shard = shard;
+            m_it    = it;
+        }
+
+        // skipEmpty - Moves an Iterator that reached the end of its shard to
+        //   the first key/value pair of the next non-empty shard, or to the
+        //   end of the ShardedMap.
+        VOID skipEmpty ()
+        {
+            while (!(m_it != m_map->m_shards[m_shard].end())) {
+                if (++m_shard == Shards) {
+                    m_it = typename ShardMap::Iterator();
+                    return;
+                }
+                m_it = m_map->m_shards[m_shard].begin();
+            }
+        }
+
+        const ShardedMap             *m_map;   // The ShardedMap being iterated.
+        UINT                          m_shard; // Index of the shard currently being walked.
+        typename ShardMap::Iterator   m_it;    // Position within the current shard.
+
+        friend class ShardedMap<Tk, Tv, Shards, ShardMap>;
+    };
+
+    // begin - Obtains an Iterator referencing the first key/value pair of the
+    //   first non-empty shard.
+    Iterator begin () const
+    {
+        Iterator it(this, 0, m_shards[0].begin());
+        it.skipEmpty();
+        return it;
+    }
+
+    // end - Obtains the "NULL" Iterator, signifying the end of the ShardedMap.
+    Iterator end () const
+    {
+        return Iterator(this, Shards, typename ShardMap::Iterator());
+    }
+
+    // erase - Erases the key/value pair referenced by the Iterator.
+    VOID erase (Iterator &it)
+    {
+        m_shards[it.m_shard].erase(it.m_it);
+    }
+
+    // erase - Erases the key/value pair with the specified key.
+    VOID erase (const Tk &key)
+    {
+        m_shards[ShardIndex(key, Shards)].erase(key);
+    }
+
+    // find - Finds a key/value pair in the map. Returns end() if not found.
+    Iterator find (const Tk &key) const
+    {
+        UINT shard = ShardIndex(key, Shards);
+        typename ShardMap::Iterator it = m_shards[shard].find(key);
+        if (it == m_shards[shard].end())
+            return end();
+        return Iterator(this, shard, it);
+    }
+
+    // insert - Inserts a key/value pair into the map. Returns end() if the key
+    //   is already present.
+    Iterator insert (const Tk &key, const Tv &data)
+    {
+        UINT shard = ShardIndex(key, Shards);
+        typename ShardMap::Iterator it = m_shards[shard].insert(key, data);
+        if (it == m_shards[shard].end())
+            return end();
+        return Iterator(this, shard, it);
+    }
+
+    // insert - Inserts a key/value pair into the map, unless the key is
+    //   already present. "inserted" tells which; the Iterator references the
+    //   pair inserted or found.
+    Iterator insert (const Tk &key, const Tv &data, bool &inserted)
+    {
+        UINT shard = ShardIndex(key, Shards);
+        return Iterator(this, shard, m_shards[shard].insert(key, data, inserted));
+    }
+
+    // replace - Replaces the value of the key/value pair referenced by the
+    //   Iterator, and returns the previous value.
+    Tv replace (Iterator &it, const Tv &data)
+    {
+        return m_shards[it.m_shard].replace(it.m_it, data);
+    }
+
+    // ShardAt - Obtains the map holding one shard's key/value pairs, for
+    //   walking a single shard while only its lock is held.
+    const ShardMap& ShardAt (UINT index) const
+    {
+        return m_shards[index];
+    }
+
+    // reserve - Sets the reserve size of the map. The reserve is split evenly
+    //   between the shards.
+    size_t reserve (size_t count)
+    {
+        size_t perShard = (count + Shards - 1) / Shards;
+        size_t previous = 0;
+        for (UINT index = 0; index < Shards; index++)
+            previous += m_shards[index].reserve(perShard);
+        return previous;
+    }
+
+    // compact - Compacts every shard. The caller must hold the whole lock.
+    //
+    //  Return Value:
+    //
+    //    Returns the total storage freed, as reported by the shards.
+    //
+    size_t compact ()
+    {
+        size_t freed = 0;
+        for (UINT index = 0; index < Shards; index++)
+            freed += m_shards[index].compact();
+        return freed;
+    }
+
+    // capacity - Returns the number of key/value pairs the shards have room
+    //   for, in all.
+    size_t capacity () const
+    {
+        size_t total = 0;
+        for (UINT index = 0; index < Shards; index++)
+            total += m_shards[index].capacity();
+        return total;
+    }
+
+    // bytes - Returns the bytes of storage taken by all of the shards.
+    size_t bytes () const
+    {
+        size_t total = 0;
+        for (UINT index = 0; index < Shards; index++)
+            total += m_shards[index].bytes();
+        return total;
+    }
+
+private:
+    ShardMap m_shards [Shards]; // The key/value pairs are actually stored in these maps.
+};
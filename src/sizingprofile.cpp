@@ -0,0 +1,168 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Warm-Start Sizing Profile
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#define VLDBUILD
+#include "sizingprofile.h" // Provides the sizing profile file format.
+#include "vldheap.h"    // Provides internal new and delete operators.
+#include "vldint.h"     // Provides access to VLD internals.
+
+// Imported global variables.
+extern HeapMapLock    g_heapMapLock;
+extern CallStackTable g_callStackTable;
+extern SymbolCache    g_symbolCache;
+extern DbgHelp        g_DbgHelp;
+
+// loadSizingProfile - Reads the sizing profile written by the previous run,
+//   and reserves the call stack table and the symbol cache from it. The heap
+//   map, the block maps and the module sets are reserved from it as they are
+//   created. If there is no profile yet, or it is invalid, everything starts
+//   at its default size, and the profile is written at shutdown.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::loadSizingProfile ()
+{
+    HANDLE file = CreateFileW(m_sizingProfilePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return;
+
+    vldsizing_t profile;
+    DWORD read = 0;
+    LARGE_INTEGER size;
+    bool valid = GetFileSizeEx(file, &size) && (size.QuadPart == (LONGLONG)sizeof(profile)) &&
+        ReadFile(file, &profile, sizeof(profile), &read, NULL) && (read == sizeof(profile)) &&
+        (profile.magic == VLDSIZING_MAGIC) && (profile.version == VLDSIZING_VERSION);
+    CloseHandle(file);
+    if (!valid) {
+        Report(L"WARNING: Visual Leak Detector: The sizing profile %s is invalid; it will be replaced.\n",
+            m_sizingProfilePath);
+        return;
+    }
+
+    m_sizingReserve = profile;
+    if (profile.stacks != 0)
+        g_callStackTable.Reserve(profile.stacks);
+    if (profile.symbols != 0) {
+        CriticalSectionLocker<DbgHelp> locker(g_DbgHelp);
+        g_symbolCache.Reserve(profile.symbols, locker);
+    }
+}
+
+// writeSizingProfile - Writes the sizes VLD's containers grew to during the
+//   run to the sizing profile, for the next run to start with. Called at
+//   shutdown, before the containers are freed.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::writeSizingProfile ()
+{
+    {
+        CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+        for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit)
+            noteHeapSizing((*heapit).second);
+        m_sizingPeak.heaps = m_heapsMapped;
+    }
+    {
+        CriticalSectionLocker<> cs(m_modulesLock);
+        noteModuleSizing(m_loadedModules);
+    }
+    m_sizingPeak.stacks = g_callStackTable.Capacity();
+    {
+        CriticalSectionLocker<DbgHelp> locker(g_DbgHelp);
+        m_sizingPeak.symbols = (UINT32)g_symbolCache.Capacity(locker);
+    }
+    m_sizingPeak.magic = VLDSIZING_MAGIC;
+    m_sizingPeak.version = VLDSIZING_VERSION;
+
+    HANDLE file = CreateFileW(m_sizingProfilePath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    bool succeeded = (file != INVALID_HANDLE_VALUE);
+    if (succeeded) {
+        DWORD written = 0;
+        succeeded = (WriteFile(file, &m_sizingPeak, sizeof(m_sizingPeak), &written, NULL) != FALSE) &&
+            (written == sizeof(m_sizingPeak));
+        CloseHandle(file);
+    }
+    if (!succeeded)
+        Report(L"WARNING: Visual Leak Detector: Couldn't write the sizing profile %s.\n", m_sizingProfilePath);
+}
+
+// blockMapReserve - Obtains the number of blocks to reserve in the block map
+//   of the next heap to be mapped: as many as the heap mapped in the same
+//   order held in the previous run. The caller must hold the whole heap map
+//   lock.
+//
+//  Return Value:
+//
+//    Returns the number of blocks, or 0 if the profile has none for the heap.
+//
+SIZE_T VisualLeakDetector::blockMapReserve () const
+{
+    if (m_heapsMapped >= VLDSIZING_HEAPS)
+        return 0;
+    return (SIZE_T)m_sizingReserve.blocks[m_heapsMapped];
+}
+
+// noteHeapSizing - Records how many blocks a heap's block map has grown to
+//   hold, before the map is compacted or freed. The caller must hold the
+//   whole heap map lock.
+//
+//  - heapinfo (IN): The heap's information.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::noteHeapSizing (const heapinfo_t *heapinfo)
+{
+    if ((m_sizingProfilePath[0] == L'\0') || (heapinfo->ordinal >= VLDSIZING_HEAPS))
+        return;
+    UINT64 capacity = (UINT64)heapinfo->blockMap.capacity();
+    if (capacity > m_sizingPeak.blocks[heapinfo->ordinal])
+        m_sizingPeak.blocks[heapinfo->ordinal] = capacity;
+}
+
+// noteModuleSizing - Records the number of modules in a new set of loaded
+//   modules, if it's the most seen so far.
+//
+//  - modules (IN): The set of loaded modules.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::noteModuleSizing (const ModuleSet *modules)
+{
+    if (m_sizingProfilePath[0] == L'\0')
+        return;
+    UINT32 count = 0;
+    for (ModuleSet::Iterator moduleit = modules->begin(); moduleit != modules->end(); ++moduleit)
+        count++;
+    if (count > m_sizingPeak.modules)
+        m_sizingPeak.modules = count;
+}
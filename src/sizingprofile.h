@@ -0,0 +1,53 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Sizing Profile File Format
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// This header only describes the on-disk layout of the file named by the
+// "SizingProfile" option, in which one run records how big VLD's containers
+// grew, for the next run to reserve up front.
+//
+// A sizing profile is a single vldsizing_t. All values are little-endian.
+// Heaps are told apart by the order in which they were mapped, which stays
+// the same from run to run as long as the program creates its heaps in the
+// same order; the process heap always comes first.
+
+#include <windows.h>
+
+#define VLDSIZING_MAGIC     0x5A444C56 // "VLDZ"
+#define VLDSIZING_VERSION   1
+#define VLDSIZING_HEAPS     16         // Heaps whose block maps are sized, in the order they are mapped.
+
+#pragma pack(push, 1)
+
+struct vldsizing_t {
+    UINT32 magic;            // VLDSIZING_MAGIC.
+    UINT32 version;          // VLDSIZING_VERSION.
+    UINT32 heaps;            // Heaps mapped during the run, including those destroyed.
+    UINT32 modules;          // Most modules loaded at once.
+    UINT32 stacks;           // Call stacks the intern table grew to hold.
+    UINT32 symbols;          // Program counters the symbol cache grew to hold.
+    UINT64 blocks [VLDSIZING_HEAPS]; // Blocks the block map of each heap grew to hold.
+};
+
+#pragma pack(pop)
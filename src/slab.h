@@ -0,0 +1,281 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Fixed-Size Slab Allocator Template
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#ifndef VLDBUILD
+#error \
+"This header should only be included by Visual Leak Detector when building it from source. \
+Applications should never include this header."
+#endif
+
+#pragma push_macro("new")
+#undef new
+#include <new>
+#include <type_traits>
+#pragma pop_macro("new")
+#include "criticalsection.h" // Provides the CriticalSection class.
+#include "metaregion.h"      // Provides the region slabs are carved from.
+
+#define SLAB_DEFAULT_OBJECTS 256 // Objects carved out of each slab.
+#define SLAB_CACHE_BATCH     32  // Objects moved between a thread cache and the shared free list at once.
+
+// A per-thread list of free objects. Owned by exactly one thread, so it's
+// used without any locking. Zero-initialize before first use.
+struct slabcache_t {
+    LPVOID head;  // First free object (the free objects are linked through their storage).
+    UINT   count; // Number of free objects in the list.
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The SlabAllocator Template Class
+//
+//  Allocates objects of a single type out of large slabs obtained from VLD's
+//  metadata region, or from its private heap if there is no room there. Allocation and deallocation normally only push and pop the
+//  calling thread's slabcache_t. The shared free list, protected by a lock,
+//  is touched once per SLAB_CACHE_BATCH objects to refill or drain a cache.
+//
+//  Slabs are never returned to the heap until Release is called, which must
+//  only happen after every object has been freed.
+//
+template <typename T, UINT SlabObjects = SLAB_DEFAULT_OBJECTS>
+class SlabAllocator
+{
+    union slot_t {
+        slot_t *next;
+        typename std::aligned_storage<sizeof(T), __alignof(T)>::type storage;
+    };
+
+    struct slab_t {
+        slab_t *next;
+        bool    inRegion; // The slab was allocated from g_metadataRegion, which frees it.
+        slot_t  slots [SlabObjects];
+    };
+
+public:
+    SlabAllocator ()
+    {
+        m_slabs     = NULL;
+        m_freelist  = NULL;
+        m_freecount = 0;
+        m_lock.Initialize();
+    }
+
+    ~SlabAllocator ()
+    {
+        Release();
+        m_lock.Delete();
+    }
+
+    // Allocate - Allocates and default-constructs an object.
+    //
+    //  - cache (IN/OUT): The calling thread's cache of free objects.
+    //
+    //  Return Value:
+    //
+    //    Returns a pointer to the new object.
+    //
+    T* Allocate (slabcache_t &cache)
+    {
+        if (cache.head == NULL)
+            refill(cache);
+
+        slot_t *slot = (slot_t*)cache.head;
+        cache.head = slot->next;
+        cache.count--;
+#pragma push_macro("new")
+#undef new
+        return ::new (&slot->storage) T();
+#pragma pop_macro("new")
+    }
+
+    // Free - Destroys an object and returns its storage to the calling
+    //   thread's cache. The object may have been allocated by any thread.
+    //
+    //  - cache (IN/OUT): The calling thread's cache of free objects.
+    //
+    //  - object (IN): The object to free.
+    //
+    //  Return Value:
+    //
+    //    None.
+    //
+    VOID Free (slabcache_t &cache, T *object)
+    {
+        if (object == NULL)
+            return;
+
+        object->~T();
+        slot_t *slot = (slot_t*)object;
+        slot->next = (slot_t*)cache.head;
+        cache.head = slot;
+        cache.count++;
+
+        if (cache.count >= 2 * SLAB_CACHE_BATCH)
+            drain(cache, SLAB_CACHE_BATCH);
+    }
+
+    // Gather - Destroys an object and adds its storage to a batch, which
+    //   FreeBatch returns to the shared free list all at once.
+    //
+    //  - batch (IN/OUT): The batch, zero-initialized before the first object.
+    //
+    //  - object (IN): The object to free.
+    //
+    //  Return Value:
+    //
+    //    None.
+    //
+    VOID Gather (slabcache_t &batch, T *object)
+    {
+        object->~T();
+        slot_t *slot = (slot_t*)object;
+        slot->next = (slot_t*)batch.head;
+        batch.head = slot;
+        batch.count++;
+    }
+
+    // FreeBatch - Returns the objects gathered into a batch to the shared
+    //   free list, taking the lock once.
+    //
+    //  - batch (IN/OUT): The batch. It's left empty.
+    //
+    //  Return Value:
+    //
+    //    None.
+    //
+    VOID FreeBatch (slabcache_t &batch)
+    {
+        if (batch.head == NULL)
+            return;
+
+        slot_t *last = (slot_t*)batch.head;
+        while (last->next != NULL)
+            last = last->next;
+        CriticalSectionLocker<> cs(m_lock);
+        last->next = m_freelist;
+        m_freelist = (slot_t*)batch.head;
+        m_freecount += batch.count;
+        batch.head = NULL;
+        batch.count = 0;
+    }
+
+    // Release - Returns every slab to the heap; those in the metadata region
+    //   are left to be freed with it. All objects must have been freed, and
+    //   no thread cache may be used afterwards.
+    //
+    //  Return Value:
+    //
+    //    None.
+    //
+    VOID Release ()
+    {
+        CriticalSectionLocker<> cs(m_lock);
+        while (m_slabs != NULL) {
+            slab_t *slab = m_slabs;
+            m_slabs = slab->next;
+            if (!slab->inRegion)
+                delete slab;
+        }
+        m_freelist  = NULL;
+        m_freecount = 0;
+    }
+
+    // Bytes - Obtains the storage carved into slabs so far, whether the
+    //   objects in it are allocated or free.
+    //
+    //  Return Value:
+    //
+    //    Returns the number of bytes.
+    //
+    SIZE_T Bytes ()
+    {
+        CriticalSectionLocker<> cs(m_lock);
+        SIZE_T slabs = 0;
+        for (slab_t *slab = m_slabs; slab != NULL; slab = slab->next)
+            slabs++;
+        return slabs * sizeof(slab_t);
+    }
+
+private:
+    // refill - Moves a batch of free objects from the shared free list into
+    //   the cache, carving a new slab if the shared list is empty.
+    VOID refill (slabcache_t &cache)
+    {
+        CriticalSectionLocker<> cs(m_lock);
+        if (m_freelist == NULL) {
+            slab_t *slab = (slab_t*)g_metadataRegion.Allocate(sizeof(slab_t));
+            if (slab != NULL) {
+                slab->inRegion = true;
+            }
+            else {
+                slab = new slab_t;
+                slab->inRegion = false;
+            }
+            slab->next = m_slabs;
+            m_slabs = slab;
+            for (UINT index = 0; index < SlabObjects - 1; index++) {
+                slab->slots[index].next = &slab->slots[index + 1];
+            }
+            slab->slots[SlabObjects - 1].next = NULL;
+            m_freelist = slab->slots;
+            m_freecount = SlabObjects;
+        }
+
+        UINT moved = 0;
+        while ((m_freelist != NULL) && (moved < SLAB_CACHE_BATCH)) {
+            slot_t *slot = m_freelist;
+            m_freelist = slot->next;
+            slot->next = (slot_t*)cache.head;
+            cache.head = slot;
+            moved++;
+        }
+        m_freecount -= moved;
+        cache.count += moved;
+    }
+
+    // drain - Moves "count" free objects from the cache to the shared free
+    //   list.
+    VOID drain (slabcache_t &cache, UINT count)
+    {
+        CriticalSectionLocker<> cs(m_lock);
+        while ((cache.head != NULL) && (count > 0)) {
+            slot_t *slot = (slot_t*)cache.head;
+            cache.head = slot->next;
+            slot->next = m_freelist;
+            m_freelist = slot;
+            cache.count--;
+            m_freecount++;
+            count--;
+        }
+    }
+
+    SlabAllocator (const SlabAllocator&);             // Don't make copies of SlabAllocators!
+    SlabAllocator& operator = (const SlabAllocator&);
+
+    slab_t          *m_slabs;     // List of all slabs carved so far.
+    slot_t          *m_freelist;  // Shared list of free objects.
+    UINT             m_freecount; // Number of objects in the shared free list.
+    CriticalSection  m_lock;      // Protects the slab list and the shared free list.
+};
@@ -0,0 +1,529 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Structured (JSON and CSV) Leak Report Writer
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// With "ReportFormat = json" or "csv", the leak report is written for tools
+// rather than for humans. Each leak (each group of duplicates, with
+// AggregateDuplicates) is one record, written as soon as it is found. Its
+// call stack is a reference to a table of call stacks written after the
+// leaks, so stacks shared by many leaks are resolved and written once.
+//
+// JSON: one object, {"version", "processId", "pointerSize", "leaks": [...],
+// "stacks": [...]}. A leak is {"serial", "address", "size", "count",
+// "total", "thread", "hash", "stack"} ("stack" is null for blocks without a
+// call stack), plus "estimatedCount" and "estimatedTotal" when sampling. A
+// stack is {"id", "hash", "frames": [...]}, and a frame is {"address",
+// "module", "function"}, plus "file" and "line" when known.
+//
+// CSV: the leaks go to the report file, and the frames to a second file
+// named after it (memory_leak_report.frames.csv for memory_leak_report.csv).
+// Each file starts with a header line naming its columns.
+//
+// Both are UTF-8. Addresses and hashes are hexadecimal strings; "hash" is the
+// "Leak Hash" of the text report.
+//
+// With "ReportFormat = folded", the leaks are aggregated by call stack into
+// the collapsed stack format of flamegraph.pl and speedscope: one line per
+// call stack, "module!function;module!function;... bytes", outermost frame
+// first, with the bytes the stack leaked (estimated, when sampling). Leaks
+// without a call stack are counted under one "[no call stack]" line. Each
+// program counter is resolved through the symbol cache, so once only.
+
+#include "stdafx.h"
+#define VLDBUILD
+#include "callstack.h"  // Provides CallStack and SymbolCache.
+#include "utility.h"    // Provides various utility functions.
+#include "vldheap.h"    // Provides internal new and delete operators.
+#include "vldint.h"     // Provides access to VLD internals.
+
+// Imported global variables.
+extern DbgHelp     g_DbgHelp;
+extern SymbolCache g_symbolCache;
+
+#define STRUCTREPORT_VERSION 1
+
+// The formats of a structured report.
+enum structformat_e {
+    structformat_json,
+    structformat_csv,
+    structformat_folded
+};
+
+// Writes the strings of a structured report, converted to UTF-8 and quoted
+// as JSON strings or CSV fields, or as frames of folded stacks.
+class StructuredWriter
+{
+public:
+    StructuredWriter (FILE *file, structformat_e format) : m_file(file), m_format(format), m_buffer(NULL),
+        m_capacity(0) {}
+    ~StructuredWriter () { delete [] m_buffer; }
+
+    FILE* File () const { return m_file; }
+    bool Json () const { return m_format == structformat_json; }
+    bool Folded () const { return m_format == structformat_folded; }
+    VOID String (LPCWSTR string);
+    VOID Frame (LPCWSTR string);
+
+private:
+    // Don't allow this!!
+    StructuredWriter (const StructuredWriter &other);
+    StructuredWriter& operator = (const StructuredWriter &other);
+
+    const char* utf8 (LPCWSTR string);
+
+    FILE          *m_file;
+    structformat_e m_format;
+    char          *m_buffer;   // Holds the UTF-8 conversion of the string being written.
+    int            m_capacity; // Size of the buffer, in bytes.
+};
+
+// utf8 - Converts a string to UTF-8.
+//
+//  - string (IN): The string.
+//
+//  Return Value:
+//
+//    Returns the converted string, valid until the next conversion.
+//
+const char* StructuredWriter::utf8 (LPCWSTR string)
+{
+    int length = WideCharToMultiByte(CP_UTF8, 0, string, -1, NULL, 0, NULL, NULL);
+    if (length > m_capacity) {
+        delete [] m_buffer;
+        m_capacity = max(length, 256);
+        m_buffer = new char [m_capacity];
+    }
+    if ((length > 0) && (WideCharToMultiByte(CP_UTF8, 0, string, -1, m_buffer, m_capacity, NULL, NULL) > 0))
+        return m_buffer;
+    return "";
+}
+
+// String - Writes a quoted, escaped string.
+//
+//  - string (IN): The string.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID StructuredWriter::String (LPCWSTR string)
+{
+    fputc('"', m_file);
+    for (const char *c = utf8(string); *c != '\0'; c++) {
+        unsigned char ch = (unsigned char)*c;
+        if (m_format == structformat_json) {
+            if ((ch == '"') || (ch == '\\')) {
+                fputc('\\', m_file);
+                fputc(ch, m_file);
+            }
+            else if (ch < 0x20) {
+                fprintf(m_file, "\\u%04x", ch);
+            }
+            else {
+                fputc(ch, m_file);
+            }
+        }
+        else {
+            if (ch == '"')
+                fputc('"', m_file);
+            fputc(ch, m_file);
+        }
+    }
+    fputc('"', m_file);
+}
+
+// Frame - Writes part of the name of a frame of a folded stack. Semicolons
+//   separate the frames, and line breaks the stacks, so both are replaced.
+//
+//  - string (IN): The string.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID StructuredWriter::Frame (LPCWSTR string)
+{
+    for (const char *c = utf8(string); *c != '\0'; c++) {
+        char ch = *c;
+        if (ch == ';')
+            ch = ':';
+        else if ((ch == '\r') || (ch == '\n'))
+            ch = ' ';
+        fputc(ch, m_file);
+    }
+}
+
+// The LeakSink of a structured report. Writes a record per leak, and numbers
+// the distinct call stacks, so that they can be written afterwards. For
+// folded stacks, only adds up the bytes leaked by each call stack.
+class StructuredReport : public LeakSink
+{
+public:
+    StructuredReport (StructuredWriter &writer) : m_writer(writer), m_first(true), m_stacks(NULL), m_bytes(NULL),
+        m_stackCount(0), m_capacity(0), m_unknownBytes(0) {}
+    ~StructuredReport () { delete [] m_stacks; delete [] m_bytes; }
+
+    virtual VOID Leak (const leakentry_t &leak);
+    UINT32 StackCount () const { return m_stackCount; }
+    CallStack* Stack (UINT32 id) const { return m_stacks[id]; }
+    double Bytes (UINT32 id) const { return m_bytes[id]; }
+    double UnknownBytes () const { return m_unknownBytes; }
+
+private:
+    // Don't allow this!!
+    StructuredReport (const StructuredReport &other);
+    StructuredReport& operator = (const StructuredReport &other);
+
+    typedef HashMap<CallStack*, UINT32> StackIds;
+
+    StructuredWriter &m_writer;
+    bool              m_first;      // No leak has been written yet.
+    StackIds          m_ids;        // Maps each call stack to its index in the stack table.
+    CallStack       **m_stacks;     // The stack table.
+    double           *m_bytes;      // Bytes leaked by each call stack of the table.
+    UINT32            m_stackCount;
+    UINT32            m_capacity;
+    double            m_unknownBytes; // Bytes leaked by blocks without a call stack.
+};
+
+VOID StructuredReport::Leak (const leakentry_t &leak)
+{
+    CallStack *stack = leak.callStack;
+    UINT32 id = 0;
+    DWORD hash = 0;
+    if (stack != NULL) {
+        StackIds::Iterator it = m_ids.find(stack);
+        if (it != m_ids.end()) {
+            id = (*it).second;
+        }
+        else {
+            if (m_stackCount == m_capacity) {
+                m_capacity = (m_capacity == 0) ? 256 : m_capacity * 2;
+                CallStack **stacks = new CallStack* [m_capacity];
+                double *bytes = new double [m_capacity];
+                if (m_stackCount != 0) {
+                    memcpy(stacks, m_stacks, m_stackCount * sizeof(CallStack*));
+                    memcpy(bytes, m_bytes, m_stackCount * sizeof(double));
+                }
+                delete [] m_stacks;
+                delete [] m_bytes;
+                m_stacks = stacks;
+                m_bytes = bytes;
+            }
+            id = m_stackCount++;
+            m_stacks[id] = stack;
+            m_bytes[id] = 0;
+            m_ids.insert(stack, id);
+        }
+        hash = CalculateCRC32(leak.blockSize, stack->getHashValue());
+    }
+
+    if (m_writer.Folded()) {
+        double bytes = (leak.estimate != 0) ? leak.estimate * leak.size : (double)(leak.size * leak.count);
+        if (stack != NULL)
+            m_bytes[id] += bytes;
+        else
+            m_unknownBytes += bytes;
+        return;
+    }
+
+    FILE *file = m_writer.File();
+    if (m_writer.Json()) {
+        fprintf(file, "%s\n{\"serial\":%Iu,\"address\":\"0x%IX\",\"size\":%Iu,\"count\":%Iu,\"total\":%Iu,\"thread\":%lu,"
+            "\"hash\":\"0x%08X\",\"stack\":", m_first ? "" : ",", leak.serialNumber, (UINT_PTR)leak.address, leak.size,
+            leak.count, leak.size * leak.count, leak.threadId, hash);
+        if (stack != NULL)
+            fprintf(file, "%u", id);
+        else
+            fputs("null", file);
+        if (leak.estimate != 0)
+            fprintf(file, ",\"estimatedCount\":%.0f,\"estimatedTotal\":%.0f", leak.estimate, leak.estimate * leak.size);
+        fputc('}', file);
+    }
+    else {
+        fprintf(file, "%Iu,0x%IX,%Iu,%Iu,%Iu,%lu,0x%08X,", leak.serialNumber, (UINT_PTR)leak.address, leak.size,
+            leak.count, leak.size * leak.count, leak.threadId, hash);
+        if (stack != NULL)
+            fprintf(file, "%u", id);
+        if (leak.estimate != 0)
+            fprintf(file, ",%.0f,%.0f\n", leak.estimate, leak.estimate * leak.size);
+        else
+            fputs(",,\n", file);
+    }
+    m_first = false;
+}
+
+// framesPath - Builds the name of the frames file of a CSV report, by
+//   inserting ".frames" before the report file's extension.
+static VOID framesPath (LPCWSTR reportpath, LPWSTR path, size_t size)
+{
+    LPCWSTR name = wcsrchr(reportpath, L'\\');
+    LPCWSTR extension = wcsrchr((name != NULL) ? name : reportpath, L'.');
+    if (extension == NULL)
+        extension = reportpath + wcslen(reportpath);
+    _snwprintf_s(path, size, _TRUNCATE, L"%.*s.frames%s", (int)(extension - reportpath), reportpath,
+        (*extension != L'\0') ? extension : L".csv");
+}
+
+// writeStructuredReport - Writes the leaks to the report file, as JSON or
+//   CSV. The leaks are found by reportLeaks, so they are the ones the text
+//   report would show, aggregated the same way. Must be called with the
+//   whole heap map lock held.
+//
+//  - threadId (IN): Only report the leaks of this thread, or of all threads
+//      if -1.
+//
+//  Return Value:
+//
+//    Returns the number of leaks found.
+//
+SIZE_T VisualLeakDetector::writeStructuredReport (DWORD threadId)
+{
+    structformat_e format = structformat_csv;
+    if ((m_options & VLD_OPT_REPORT_FOLDED) == VLD_OPT_REPORT_FOLDED)
+        format = structformat_folded;
+    else if (m_options & VLD_OPT_REPORT_JSON)
+        format = structformat_json;
+    bool json = (format == structformat_json);
+    FILE *file = NULL;
+    if ((_wfopen_s(&file, m_reportFilePath, L"wb") != 0) || (file == NULL)) {
+        Report(L"WARNING: Visual Leak Detector: Couldn't open report file for writing: %s\n", m_reportFilePath);
+        return 0;
+    }
+    FILE *framesfile = file;
+    if (format == structformat_csv) {
+        WCHAR path [MAX_PATH];
+        framesPath(m_reportFilePath, path, MAX_PATH);
+        if ((_wfopen_s(&framesfile, path, L"wb") != 0) || (framesfile == NULL)) {
+            Report(L"WARNING: Visual Leak Detector: Couldn't open report file for writing: %s\n", path);
+            fclose(file);
+            return 0;
+        }
+    }
+
+    StructuredWriter leakwriter(file, format);
+    StructuredWriter framewriter(framesfile, format);
+    if (json) {
+        fprintf(file, "{\"version\":%u,\"processId\":%lu,\"pointerSize\":%u,\"leaks\":[", STRUCTREPORT_VERSION,
+            GetCurrentProcessId(), (UINT)sizeof(LPVOID));
+    }
+    else if (format == structformat_csv) {
+        fputs("serial,address,size,count,total,thread,hash,stack,estimated_count,estimated_total\n", file);
+        fputs("stack,frame,address,module,function,file,line\n", framesfile);
+    }
+
+    // The leaks are written as they are found.
+    StructuredReport report(leakwriter);
+    SIZE_T leaksCount = 0;
+    bool firstLeak = false;
+    DuplicateIndex duplicates;
+    for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
+        leaksCount += reportLeaks((*heapit).second, firstLeak, duplicates, threadId, (SIZE_T)-1, &report);
+    }
+
+    // Then the call stacks they refer to.
+    if (json)
+        fputs("\n],\"stacks\":[", file);
+    UINT64 start = __rdtsc();
+    if (format == structformat_folded) {
+        for (UINT32 id = 0; id < report.StackCount(); id++) {
+            writeFoldedStack(framewriter, report.Stack(id), report.Bytes(id));
+        }
+        if (report.UnknownBytes() != 0)
+            fprintf(file, "[no call stack] %.0f\n", report.UnknownBytes());
+    }
+    else {
+        for (UINT32 id = 0; id < report.StackCount(); id++) {
+            writeStructuredStack(framewriter, id, report.Stack(id));
+        }
+    }
+    m_reportStats.stackDumpTicks += __rdtsc() - start;
+    if (json)
+        fputs("\n]}\n", file);
+
+    BOOL failed = ferror(file) || ferror(framesfile);
+    if (framesfile != file)
+        fclose(framesfile);
+    fclose(file);
+    if (failed) {
+        Report(L"WARNING: Visual Leak Detector: Failed to write the report file: %s\n", m_reportFilePath);
+    }
+    return leaksCount;
+}
+
+// selectStructuredFrames - Resolves the frames of a call stack which a
+//   structured report shows. Frames are left out as in the text report:
+//   VLD's own frames always, and frames internal to the heap unless
+//   TraceInternalFrames is on, except for the last one, which shows the
+//   allocation function.
+//
+//  - stack (IN): The stack.
+//
+//  - locker (IN): The lock of dbghelp, held by the caller.
+//
+//  - frames (OUT): Receives the indices of the frames shown, innermost
+//      first. Has room for every frame of the stack.
+//
+//  - symbols (OUT): Receives the symbols of those frames.
+//
+//  Return Value:
+//
+//    Returns the number of frames shown.
+//
+UINT32 VisualLeakDetector::selectStructuredFrames (CallStack *stack, CriticalSectionLocker<DbgHelp> &locker,
+    UINT32 *frames, const symbolinfo_t **symbols)
+{
+    BOOL showInternalFrames = m_options & VLD_OPT_TRACE_INTERNAL_FRAMES;
+    UINT32 selected = 0;
+    UINT32 pending = (UINT32)-1;       // Last internal frame, shown before the next frame which isn't.
+    const symbolinfo_t *pendingSymbol = NULL;
+    for (UINT32 frame = 0; frame < stack->size(); frame++) {
+        if (isVldAddress((*stack)[frame]))
+            continue;
+
+        const symbolinfo_t *symbol = g_symbolCache.Lookup(stack->symbolAddress(frame, locker), locker);
+        if (!showInternalFrames && (symbol->fileName != NULL) && symbol->internalFile) {
+            pending = frame;
+            pendingSymbol = symbol;
+            continue;
+        }
+        if (pending != (UINT32)-1) {
+            frames[selected] = pending;
+            symbols[selected++] = pendingSymbol;
+            pending = (UINT32)-1;
+        }
+        frames[selected] = frame;
+        symbols[selected++] = symbol;
+    }
+    return selected;
+}
+
+// frameModuleName - Obtains the file name of the module of a frame.
+static LPCWSTR frameModuleName (CallStack *stack, UINT32 frame)
+{
+    LPCWSTR module = stack->imagePath(frame);
+    if (module == NULL)
+        return L"";
+    if (wcsrchr(module, L'\\') != NULL)
+        return wcsrchr(module, L'\\') + 1;
+    return module;
+}
+
+// writeStructuredStack - Resolves and writes one call stack of the stack
+//   table, with the frames selectStructuredFrames selects.
+//
+//  - writer (IN): Writes to the file which holds the frames.
+//
+//  - id (IN): The stack's index in the table.
+//
+//  - stack (IN): The stack.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::writeStructuredStack (StructuredWriter &writer, UINT32 id, CallStack *stack)
+{
+    FILE *file = writer.File();
+    bool json = writer.Json();
+    if (json)
+        fprintf(file, "%s\n{\"id\":%u,\"hash\":\"0x%08X\",\"frames\":[", (id == 0) ? "" : ",", id, stack->getHashValue());
+
+    UINT32 *frames = new UINT32 [stack->size() + 1];
+    const symbolinfo_t **symbols = new const symbolinfo_t* [stack->size() + 1];
+    {
+        CriticalSectionLocker<DbgHelp> locker(g_DbgHelp);
+        UINT32 count = selectStructuredFrames(stack, locker, frames, symbols);
+        for (UINT32 written = 0; written < count; written++) {
+            UINT32 index = frames[written];
+            const symbolinfo_t *info = symbols[written];
+            LPCWSTR module = frameModuleName(stack, index);
+            if (json) {
+                fprintf(file, "%s{\"address\":\"0x%IX\",\"module\":", (written == 0) ? "" : ",", (*stack)[index]);
+                writer.String(module);
+                fputs(",\"function\":", file);
+                writer.String(info->functionName);
+                if (info->fileName != NULL) {
+                    fputs(",\"file\":", file);
+                    writer.String(info->fileName);
+                    fprintf(file, ",\"line\":%lu", info->lineNumber);
+                }
+                fputc('}', file);
+            }
+            else {
+                fprintf(file, "%u,%u,0x%IX,", id, written, (*stack)[index]);
+                writer.String(module);
+                fputc(',', file);
+                writer.String(info->functionName);
+                fputc(',', file);
+                if (info->fileName != NULL) {
+                    writer.String(info->fileName);
+                    fprintf(file, ",%lu\n", info->lineNumber);
+                }
+                else {
+                    fputs(",\n", file);
+                }
+            }
+        }
+    }
+    delete [] frames;
+    delete [] symbols;
+    if (json)
+        fputs("]}", file);
+}
+
+// writeFoldedStack - Resolves and writes one call stack as a line of folded
+//   stacks: its frames, outermost first, and the bytes it leaked.
+//
+//  - writer (IN): Writes to the report file.
+//
+//  - stack (IN): The stack.
+//
+//  - bytes (IN): The bytes leaked by the stack.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::writeFoldedStack (StructuredWriter &writer, CallStack *stack, double bytes)
+{
+    FILE *file = writer.File();
+    UINT32 *frames = new UINT32 [stack->size() + 1];
+    const symbolinfo_t **symbols = new const symbolinfo_t* [stack->size() + 1];
+    {
+        CriticalSectionLocker<DbgHelp> locker(g_DbgHelp);
+        UINT32 count = selectStructuredFrames(stack, locker, frames, symbols);
+        for (UINT32 written = 0; written < count; written++) {
+            UINT32 index = count - 1 - written;
+            if (written != 0)
+                fputc(';', file);
+            writer.Frame(frameModuleName(stack, frames[index]));
+            fputc('!', file);
+            writer.Frame(symbols[index]->functionName);
+        }
+        if (count == 0)
+            fputs("[no frames]", file);
+    }
+    fprintf(file, " %.0f\n", bytes);
+    delete [] frames;
+    delete [] symbols;
+}
@@ -0,0 +1,435 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - SymbolStore Class Implementation
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#define VLDBUILD
+#include "callstack.h"   // Provides the SymbolStore class.
+#include "symbolstore.h" // Provides the symbol cache file format.
+#include "vldheap.h"     // Provides internal new and delete operators.
+#include "vldint.h"      // Provides access to VLD internals.
+
+// Imported global variables.
+extern HANDLE       g_currentProcess;
+extern ModuleImages g_moduleImages;
+extern DbgHelp      g_DbgHelp;
+
+#define VLDSYM_MIN_RECORDS  256  // Records first allocated for the ones added during a run.
+#define VLDSYM_MIN_CHARS    8192 // Characters first allocated for their strings.
+#define VLDSYM_WRITE_BATCH  256  // Records merged and written at once.
+
+// compareRecords - Orders two records by PDB signature, PDB age and RVA, the
+//   order they are sorted in in the file. Also used as a qsort callback.
+static int __cdecl compareRecords (const void *first, const void *second)
+{
+    const vldsym_record_t *a = (const vldsym_record_t*)first;
+    const vldsym_record_t *b = (const vldsym_record_t*)second;
+    int order = memcmp(&a->pdbGuid, &b->pdbGuid, sizeof(GUID));
+    if (order != 0)
+        return order;
+    if (a->pdbAge != b->pdbAge)
+        return (a->pdbAge < b->pdbAge) ? -1 : 1;
+    if (a->rva != b->rva)
+        return (a->rva < b->rva) ? -1 : 1;
+    return 0;
+}
+
+// hashString - FNV-1a hash of a string, used to find the added strings which
+//   are already in the file being written (file names repeat a lot). Never 0
+//   or 1, which the StringMap reserves.
+static SIZE_T hashString (LPCWSTR string)
+{
+    UINT32 hash = 2166136261u;
+    for (; *string != L'\0'; string++) {
+        hash ^= (UINT32)*string;
+        hash *= 16777619u;
+    }
+    return (SIZE_T)hash | 0x2;
+}
+
+SymbolStore::SymbolStore ()
+{
+    m_path               = NULL;
+    m_file               = INVALID_HANDLE_VALUE;
+    m_mapping            = NULL;
+    m_view               = NULL;
+    m_records            = NULL;
+    m_recordCount        = 0;
+    m_strings            = NULL;
+    m_stringBytes        = 0;
+    m_added              = NULL;
+    m_addedCount         = 0;
+    m_addedCapacity      = 0;
+    m_addedStrings       = NULL;
+    m_addedChars         = 0;
+    m_addedCharsCapacity = 0;
+}
+
+SymbolStore::~SymbolStore ()
+{
+    unmap();
+    delete [] m_path;
+    delete [] m_added;
+    delete [] m_addedStrings;
+}
+
+// Open - Maps the symbol cache file, if it exists, so that the symbols it
+//   holds are found instead of being resolved again. From then on, the
+//   symbols resolved by dbghelp are added to it too.
+//
+//  - path (IN): Full path of the file.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID SymbolStore::Open (LPCWSTR path)
+{
+    CriticalSectionLocker<DbgHelp> locker(g_DbgHelp);
+    size_t length = wcslen(path) + 1;
+    m_path = new WCHAR [length];
+    wcscpy_s(m_path, length, path);
+
+    m_file = CreateFileW(m_path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m_file == INVALID_HANDLE_VALUE) {
+        // Nothing resolved yet.
+        return;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_file, &size) || (size.QuadPart < (LONGLONG)sizeof(vldsym_header_t)) || (size.HighPart != 0)) {
+        unmap();
+        return;
+    }
+    m_mapping = CreateFileMappingW(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (m_mapping != NULL)
+        m_view = (const BYTE*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+    if (m_view == NULL) {
+        unmap();
+        return;
+    }
+
+    // A file which isn't what it should be is ignored, and replaced at
+    // shutdown. The strings must end with a NUL, so that no string can run
+    // past the end of the view.
+    const vldsym_header_t *header = (const vldsym_header_t*)m_view;
+    UINT64 expected = sizeof(vldsym_header_t) + (UINT64)header->recordCount * sizeof(vldsym_record_t) + header->stringBytes;
+    const WCHAR *strings = (const WCHAR*)(m_view + sizeof(vldsym_header_t) + (SIZE_T)header->recordCount * sizeof(vldsym_record_t));
+    if ((header->magic != VLDSYM_MAGIC) || (header->version != VLDSYM_VERSION) || (expected != (UINT64)size.QuadPart) ||
+        (header->stringBytes % sizeof(WCHAR) != 0) ||
+        ((header->stringBytes != 0) && (strings[header->stringBytes / sizeof(WCHAR) - 1] != L'\0'))) {
+        Report(L"WARNING: Visual Leak Detector: The symbol cache file %s is invalid; it will be replaced.\n", m_path);
+        unmap();
+        return;
+    }
+    m_records     = (const vldsym_record_t*)(m_view + sizeof(vldsym_header_t));
+    m_recordCount = header->recordCount;
+    m_strings     = strings;
+    m_stringBytes = header->stringBytes;
+}
+
+// Find - Searches the file for the symbolic information of a program counter.
+//
+//  - pdbGuid (IN): PDB signature of the program counter's module.
+//
+//  - pdbAge (IN): PDB age of the program counter's module.
+//
+//  - rva (IN): Offset of the program counter from the module's base.
+//
+//  - locker (IN): Proof that the caller holds the DbgHelp lock.
+//
+//  Return Value:
+//
+//    Returns the record of the program counter, or NULL if the file has none.
+//    Its strings are obtained with String.
+//
+const vldsym_record_t* SymbolStore::Find (const GUID &pdbGuid, DWORD pdbAge, UINT32 rva,
+    CriticalSectionLocker<DbgHelp>& /*locker*/) const
+{
+    vldsym_record_t key;
+    key.pdbGuid = pdbGuid;
+    key.pdbAge  = pdbAge;
+    key.rva     = rva;
+    UINT32 low = 0;
+    UINT32 high = m_recordCount;
+    while (low < high) {
+        UINT32 middle = low + (high - low) / 2;
+        int order = compareRecords(&m_records[middle], &key);
+        if (order == 0)
+            return &m_records[middle];
+        if (order < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return NULL;
+}
+
+// String - Obtains a string of a record returned by Find.
+//
+//  - offset (IN): The string's offset, from the record.
+//
+//  Return Value:
+//
+//    Returns the string, or an empty string if the offset is invalid.
+//
+LPCWSTR SymbolStore::String (UINT32 offset) const
+{
+    if ((offset % sizeof(WCHAR) != 0) || (offset >= m_stringBytes))
+        return L"";
+    return m_strings + offset / sizeof(WCHAR);
+}
+
+// Add - Adds the symbolic information which dbghelp returned for a program
+//   counter, to be written to the file at shutdown. Ignored unless dbghelp
+//   found it in the module's own PDB.
+//
+//  - image (IN): Index of the program counter's module image.
+//
+//  - symbolBase (IN): Address the image's symbols are loaded at.
+//
+//  - rva (IN): Offset of the program counter from the image's base.
+//
+//  - symbol (IN): What dbghelp returned.
+//
+//  - locker (IN): Proof that the caller holds the DbgHelp lock.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID SymbolStore::Add (UINT32 image, UINT_PTR symbolBase, UINT32 rva, const symbolinfo_t &symbol,
+    CriticalSectionLocker<DbgHelp>& locker)
+{
+    if ((m_path == NULL) || !fromPdb(image, symbolBase, locker))
+        return;
+
+    if (m_addedCount == m_addedCapacity) {
+        UINT32 capacity = (m_addedCapacity == 0) ? VLDSYM_MIN_RECORDS : m_addedCapacity * 2;
+        vldsym_record_t *added = new vldsym_record_t [capacity];
+        if (m_addedCount != 0)
+            memcpy(added, m_added, m_addedCount * sizeof(vldsym_record_t));
+        delete [] m_added;
+        m_added = added;
+        m_addedCapacity = capacity;
+    }
+
+    const moduleimage_t *moduleimage = g_moduleImages.Get(image);
+    vldsym_record_t &record = m_added[m_addedCount++];
+    record.pdbGuid          = moduleimage->pdbGuid;
+    record.pdbAge           = moduleimage->pdbAge;
+    record.rva              = rva;
+    record.displacement     = (UINT32)symbol.displacement;
+    record.functionName     = addString(symbol.functionName);
+    record.fileName         = (symbol.fileName != NULL) ? addString(symbol.fileName) : VLDSYM_NO_STRING;
+    record.lineNumber       = symbol.lineNumber;
+    record.lineDisplacement = symbol.lineDisplacement;
+}
+
+// Close - Replaces the file with one holding both its records and the ones
+//   added during this run, if there are any. Called at shutdown, before the
+//   symbol handler is cleaned up.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID SymbolStore::Close ()
+{
+    CriticalSectionLocker<DbgHelp> locker(g_DbgHelp);
+    if ((m_path != NULL) && (m_addedCount != 0)) {
+        // Another process may be using the file, so the new one is written
+        // next to it and then moved over it.
+        size_t length = wcslen(m_path) + 16;
+        WCHAR *temppath = new WCHAR [length];
+        _snwprintf_s(temppath, length, _TRUNCATE, L"%s.%lu.tmp", m_path, GetCurrentProcessId());
+        qsort(m_added, m_addedCount, sizeof(vldsym_record_t), compareRecords);
+        bool written = write(temppath);
+        unmap();
+        if (!written || !MoveFileExW(temppath, m_path, MOVEFILE_REPLACE_EXISTING)) {
+            Report(L"WARNING: Visual Leak Detector: The symbol cache file %s could not be written (error=%lu).\n",
+                m_path, GetLastError());
+            DeleteFileW(temppath);
+        }
+        delete [] temppath;
+    }
+    unmap();
+
+    for (StringMap::Iterator it = m_stringOffsets.begin(); it != m_stringOffsets.end(); it++)
+        m_stringOffsets.erase(it);
+    for (ImageMap::Iterator it = m_fromPdb.begin(); it != m_fromPdb.end(); it++)
+        m_fromPdb.erase(it);
+    delete [] m_added;
+    m_added = NULL;
+    m_addedCount = m_addedCapacity = 0;
+    delete [] m_addedStrings;
+    m_addedStrings = NULL;
+    m_addedChars = m_addedCharsCapacity = 0;
+    delete [] m_path;
+    m_path = NULL;
+}
+
+// addString - Adds a string for the added records, unless an equal one has
+//   been added already.
+//
+//  - string (IN): The string.
+//
+//  Return Value:
+//
+//    Returns the string's offset in the file to be written.
+//
+UINT32 SymbolStore::addString (LPCWSTR string)
+{
+    SIZE_T hash = hashString(string);
+    StringMap::Iterator it = m_stringOffsets.find(hash);
+    if ((it != m_stringOffsets.end()) && (wcscmp(m_addedStrings + (*it).second, string) == 0))
+        return m_stringBytes + (*it).second * sizeof(WCHAR);
+
+    UINT32 length = (UINT32)wcslen(string) + 1;
+    if (m_addedChars + length > m_addedCharsCapacity) {
+        UINT32 capacity = max(m_addedCharsCapacity * 2, (UINT32)VLDSYM_MIN_CHARS);
+        while (capacity < m_addedChars + length)
+            capacity *= 2;
+        WCHAR *strings = new WCHAR [capacity];
+        if (m_addedChars != 0)
+            memcpy(strings, m_addedStrings, m_addedChars * sizeof(WCHAR));
+        delete [] m_addedStrings;
+        m_addedStrings = strings;
+        m_addedCharsCapacity = capacity;
+    }
+    UINT32 index = m_addedChars;
+    memcpy(m_addedStrings + index, string, length * sizeof(WCHAR));
+    m_addedChars += length;
+    if (it == m_stringOffsets.end())
+        m_stringOffsets.insert(hash, index);
+    return m_stringBytes + index * sizeof(WCHAR);
+}
+
+// fromPdb - Determines whether dbghelp resolves an image's addresses with the
+//   image's own PDB, rather than with its exports or with a PDB which doesn't
+//   match it. Only found out once per image.
+//
+//  - image (IN): Index of the image.
+//
+//  - symbolBase (IN): Address the image's symbols are loaded at.
+//
+//  - locker (IN): Proof that the caller holds the DbgHelp lock.
+//
+//  Return Value:
+//
+//    Returns true if the image's symbols come from its PDB.
+//
+bool SymbolStore::fromPdb (UINT32 image, UINT_PTR symbolBase, CriticalSectionLocker<DbgHelp>& locker)
+{
+    SIZE_T key = (SIZE_T)image + 2;
+    ImageMap::Iterator it = m_fromPdb.find(key);
+    if (it != m_fromPdb.end())
+        return (*it).second;
+
+    const moduleimage_t *moduleimage = g_moduleImages.Get(image);
+    IMAGEHLP_MODULEW64 moduleinfo = { 0 };
+    moduleinfo.SizeOfStruct = sizeof(IMAGEHLP_MODULEW64);
+    bool frompdb = g_DbgHelp.SymGetModuleInfoW64(g_currentProcess, (DWORD64)symbolBase, &moduleinfo, locker) &&
+        (moduleinfo.SymType == SymPdb) && IsEqualGUID(moduleinfo.PdbSig70, moduleimage->pdbGuid) &&
+        (moduleinfo.PdbAge == moduleimage->pdbAge);
+    m_fromPdb.insert(key, frompdb);
+    return frompdb;
+}
+
+// unmap - Unmaps and closes the file, if it is open.
+VOID SymbolStore::unmap ()
+{
+    if (m_view != NULL)
+        UnmapViewOfFile(m_view);
+    if (m_mapping != NULL)
+        CloseHandle(m_mapping);
+    if (m_file != INVALID_HANDLE_VALUE)
+        CloseHandle(m_file);
+    m_file        = INVALID_HANDLE_VALUE;
+    m_mapping     = NULL;
+    m_view        = NULL;
+    m_records     = NULL;
+    m_recordCount = 0;
+    m_strings     = NULL;
+    m_stringBytes = 0;
+}
+
+// write - Writes the file's records merged with the (sorted) added ones,
+//   followed by the file's strings and the added ones.
+//
+//  - path (IN): Full path of the file to write.
+//
+//  Return Value:
+//
+//    Returns true if the file has been written.
+//
+bool SymbolStore::write (LPCWSTR path) const
+{
+    HANDLE file = CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    // The header is written again once the number of records is known.
+    vldsym_header_t header = { VLDSYM_MAGIC, VLDSYM_VERSION, 0, m_stringBytes + m_addedChars * (UINT32)sizeof(WCHAR) };
+    DWORD written = 0;
+    bool succeeded = (WriteFile(file, &header, sizeof(header), &written, NULL) != FALSE);
+
+    vldsym_record_t batch [VLDSYM_WRITE_BATCH];
+    UINT32 batched = 0;
+    UINT32 fileindex = 0;
+    UINT32 addedindex = 0;
+    const vldsym_record_t *last = NULL;
+    while (succeeded && ((fileindex < m_recordCount) || (addedindex < m_addedCount))) {
+        const vldsym_record_t *next;
+        if (addedindex == m_addedCount)
+            next = &m_records[fileindex++];
+        else if (fileindex == m_recordCount)
+            next = &m_added[addedindex++];
+        else if (compareRecords(&m_records[fileindex], &m_added[addedindex]) <= 0)
+            next = &m_records[fileindex++];
+        else
+            next = &m_added[addedindex++];
+
+        // The same program counter may have been added twice, through images
+        // with the same PDB.
+        if ((last != NULL) && (compareRecords(last, next) == 0))
+            continue;
+        last = next;
+        batch[batched++] = *next;
+        header.recordCount++;
+        if (batched == VLDSYM_WRITE_BATCH) {
+            succeeded = (WriteFile(file, batch, batched * sizeof(vldsym_record_t), &written, NULL) != FALSE);
+            batched = 0;
+        }
+    }
+    if (succeeded && (batched != 0))
+        succeeded = (WriteFile(file, batch, batched * sizeof(vldsym_record_t), &written, NULL) != FALSE);
+    if (succeeded && (m_stringBytes != 0))
+        succeeded = (WriteFile(file, m_strings, m_stringBytes, &written, NULL) != FALSE);
+    if (succeeded && (m_addedChars != 0))
+        succeeded = (WriteFile(file, m_addedStrings, m_addedChars * sizeof(WCHAR), &written, NULL) != FALSE);
+    if (succeeded)
+        succeeded = (SetFilePointer(file, 0, NULL, FILE_BEGIN) == 0) &&
+            (WriteFile(file, &header, sizeof(header), &written, NULL) != FALSE);
+    CloseHandle(file);
+    return succeeded;
+}
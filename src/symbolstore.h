@@ -0,0 +1,68 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Symbol Cache File Format
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// This header only describes the on-disk layout of the file named by the
+// "SymbolCacheFile" option, in which symbols resolved by one run are kept for
+// the next ones.
+//
+// A symbol cache file is a vldsym_header_t followed by:
+//
+//   - recordCount vldsym_record_t records, sorted by PDB signature, then PDB
+//     age, then RVA (the GUIDs are compared bytewise, the numbers by value);
+//   - stringBytes bytes of NUL-terminated UTF-16 strings, which the records
+//     refer to by their byte offset from the first one.
+//
+// All values are little-endian. A program counter is identified by the PDB
+// of its module and its offset from the module's base, so the records stay
+// valid whatever address the module is loaded at, and for as long as the
+// module is rebuilt with the same PDB signature and age.
+
+#include <windows.h>
+
+#define VLDSYM_MAGIC        0x53444C56 // "VLDS"
+#define VLDSYM_VERSION      1
+#define VLDSYM_NO_STRING    0xFFFFFFFF // String offset of records without line information.
+
+#pragma pack(push, 1)
+
+struct vldsym_header_t {
+    UINT32 magic;            // VLDSYM_MAGIC.
+    UINT32 version;          // VLDSYM_VERSION.
+    UINT32 recordCount;      // Number of vldsym_record_t records.
+    UINT32 stringBytes;      // Size of the strings that follow the records, in bytes.
+};
+
+struct vldsym_record_t {
+    GUID   pdbGuid;          // PDB signature of the module.
+    UINT32 pdbAge;           // PDB age of the module.
+    UINT32 rva;              // Offset of the program counter from the module's base.
+    UINT32 displacement;     // Offset of the program counter from the start of the function.
+    UINT32 functionName;     // Offset of the name of the function.
+    UINT32 fileName;         // Offset of the source file name, or VLDSYM_NO_STRING.
+    UINT32 lineNumber;       // Source line containing the program counter.
+    UINT32 lineDisplacement; // Offset of the program counter from the start of the source line.
+};
+
+#pragma pack(pop)
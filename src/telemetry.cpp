@@ -0,0 +1,239 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Memory Telemetry Sampler
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#define VLDBUILD
+#include "vldheap.h"    // Provides internal new and delete operators.
+#include "vldint.h"     // Provides access to VLD internals.
+
+// Imported global variables.
+extern HeapMapLock    g_heapMapLock;
+extern CallStackTable g_callStackTable;
+
+// The tracked blocks of one heap, gathered by sampleTelemetry.
+struct heaptally_t {
+    HANDLE     heap;
+    SIZE_T     blocks;
+    SIZE_T     bytes;
+};
+
+// The growth of one call stack's live bytes since the previous sample.
+struct sitedelta_t {
+    CallStack *callStack;
+    INT64      delta;
+};
+
+// compareSiteDeltas - qsort callback ordering call stacks by decreasing
+//   growth.
+static int __cdecl compareSiteDeltas (const void *first, const void *second)
+{
+    const sitedelta_t *a = (const sitedelta_t*)first;
+    const sitedelta_t *b = (const sitedelta_t*)second;
+    return (a->delta > b->delta) ? -1 : (a->delta < b->delta) ? 1 : 0;
+}
+
+// startTelemetry - Opens the telemetry file and creates the thread which
+//   samples the allocation counters into it. If either can't be created, VLD
+//   runs without telemetry.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::startTelemetry ()
+{
+    if ((_wfopen_s(&m_telemetryFile, m_telemetryFilePath, L"w") != 0) || (m_telemetryFile == NULL)) {
+        Report(L"WARNING: Visual Leak Detector: Couldn't open the telemetry file %s.\n", m_telemetryFilePath);
+        m_telemetryFile = NULL;
+        return;
+    }
+    fputs("time,metric,key,value\n", m_telemetryFile);
+    fflush(m_telemetryFile);
+    m_telemetryStart = GetTickCount64();
+    m_telemetrySites = new HashMap<CallStack*, SIZE_T>;
+
+    m_telemetryWake = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (m_telemetryWake != NULL)
+        m_telemetryThread = CreateThread(NULL, 0, telemetryProc, this, 0, &m_telemetryThreadId);
+    if (m_telemetryThread == NULL)
+        stopTelemetry();
+}
+
+// stopTelemetry - Stops sampling and closes the telemetry file.
+//
+//   Note: Like stopLiveView, this never waits for the thread to exit, only
+//     for it to finish the sample it may be writing.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::stopTelemetry ()
+{
+    if (m_telemetryFile == NULL)
+        return;
+
+    {
+        CriticalSectionLocker<> cs(m_telemetryLock);
+        m_telemetryStop = TRUE;
+        fclose(m_telemetryFile);
+        m_telemetryFile = NULL;
+    }
+    if (m_telemetryThread != NULL) {
+        SetEvent(m_telemetryWake);
+        if (WaitForSingleObject(m_telemetryThread, 0) == WAIT_OBJECT_0) {
+            CloseHandle(m_telemetryWake);
+            m_telemetryWake = NULL;
+        }
+        CloseHandle(m_telemetryThread);
+        m_telemetryThread = NULL;
+        m_telemetryThreadId = 0;
+    }
+    else if (m_telemetryWake != NULL) {
+        CloseHandle(m_telemetryWake);
+        m_telemetryWake = NULL;
+    }
+
+    for (HashMap<CallStack*, SIZE_T>::Iterator siteit = m_telemetrySites->begin();
+        siteit != m_telemetrySites->end(); ++siteit)
+        g_callStackTable.Release((*siteit).first);
+    delete m_telemetrySites;
+    m_telemetrySites = NULL;
+}
+
+// telemetryProc - Samples the allocation counters every TelemetryInterval
+//   milliseconds until telemetry is stopped.
+//
+//  - param (IN): The VisualLeakDetector.
+//
+//  Return Value:
+//
+//    Always returns 0.
+//
+DWORD WINAPI VisualLeakDetector::telemetryProc (LPVOID param)
+{
+    VisualLeakDetector *vld = (VisualLeakDetector*)param;
+    while (WaitForSingleObject(vld->m_telemetryWake, vld->m_telemetryInterval) == WAIT_TIMEOUT) {
+        CriticalSectionLocker<> cs(vld->m_telemetryLock);
+        if (vld->m_telemetryStop)
+            break;
+        vld->sampleTelemetry();
+    }
+    return 0;
+}
+
+// sampleTelemetry - Appends one sample to the telemetry file: the allocation
+//   totals, the blocks and bytes of each heap, and the call stacks whose live
+//   bytes grew the most since the previous sample. Every figure is read from
+//   a counter kept up to date as blocks come and go, so no block map is
+//   walked. Rows have the form "time,metric,key,value", where time is in
+//   milliseconds since VLD started.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::sampleTelemetry ()
+{
+    FILE *file = m_telemetryFile;
+    ULONGLONG time = GetTickCount64() - m_telemetryStart;
+    SIZE_T allocations, current, peak, total;
+    readAllocTotals(allocations, current, peak, total);
+    fprintf(file, "%llu,allocations,,%Iu\n", time, allocations);
+    fprintf(file, "%llu,current_bytes,,%Iu\n", time, current);
+    fprintf(file, "%llu,peak_bytes,,%Iu\n", time, peak);
+    fprintf(file, "%llu,total_bytes,,%Iu\n", time, total);
+
+    // The heap map can't change while any one shard is held, since mapping or
+    // unmapping a heap needs every shard. The counters of the other shards are
+    // read as they are. Nothing is written to the file until the shard is
+    // released, since writing may allocate.
+    heaptally_t *heaps;
+    size_t heapCount = 0;
+    {
+        CriticalSectionLocker<> cs(g_heapMapLock.ShardAt(0));
+        size_t capacity = 0;
+        for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit)
+            capacity++;
+        heaps = new heaptally_t [capacity + 1];
+        for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
+            const heapinfo_t *heapinfo = (*heapit).second;
+            heaptally_t &tally = heaps[heapCount];
+            tally.heap = (*heapit).first;
+            tally.blocks = 0;
+            tally.bytes = 0;
+            for (UINT shard = 0; shard < BLOCKMAPSHARDS; shard++) {
+                tally.blocks += heapinfo->blocks[shard];
+                tally.bytes += heapinfo->bytes[shard];
+            }
+            if (tally.blocks != 0)
+                heapCount++;
+        }
+    }
+    SIZE_T liveBlocks = 0;
+    for (size_t index = 0; index < heapCount; index++) {
+        fprintf(file, "%llu,heap_blocks,0x%p,%Iu\n", time, heaps[index].heap, heaps[index].blocks);
+        fprintf(file, "%llu,heap_bytes,0x%p,%Iu\n", time, heaps[index].heap, heaps[index].bytes);
+        liveBlocks += heaps[index].blocks;
+    }
+    fprintf(file, "%llu,live_blocks,,%Iu\n", time, liveBlocks);
+    delete [] heaps;
+
+    if (m_telemetrySiteCount != 0) {
+        // Site statistics keep every call stack interned, so the stacks of
+        // the previous sample are still there to compare with.
+        UINT32 capacity = g_callStackTable.Count();
+        CallStack **stacks = new CallStack* [capacity + 1];
+        UINT32 stackCount = g_callStackTable.Collect(stacks, capacity);
+        sitedelta_t *deltas = new sitedelta_t [stackCount + 1];
+        UINT32 deltaCount = 0;
+        for (UINT32 index = 0; index < stackCount; index++) {
+            CallStack *stack = stacks[index];
+            SIZE_T bytes = stack->getLiveBytes();
+            bool inserted;
+            HashMap<CallStack*, SIZE_T>::Iterator siteit = m_telemetrySites->insert(stack, bytes, inserted);
+            SIZE_T previous = 0;
+            if (!inserted) {
+                // The table already holds a reference on the stack; a new
+                // one keeps the reference Collect took.
+                previous = m_telemetrySites->replace(siteit, bytes);
+                g_callStackTable.Release(stack);
+            }
+            INT64 delta = (INT64)bytes - (INT64)previous;
+            if (delta > 0) {
+                deltas[deltaCount].callStack = stack;
+                deltas[deltaCount].delta = delta;
+                deltaCount++;
+            }
+        }
+        delete [] stacks;
+
+        qsort(deltas, deltaCount, sizeof(sitedelta_t), compareSiteDeltas);
+        for (UINT32 index = 0; (index < deltaCount) && (index < m_telemetrySiteCount); index++) {
+            fprintf(file, "%llu,site_delta,0x%08X,%lld\n", time, deltas[index].callStack->getHashValue(),
+                deltas[index].delta);
+        }
+        delete [] deltas;
+    }
+    fflush(file);
+}
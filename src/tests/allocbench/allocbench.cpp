@@ -0,0 +1,304 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Allocation Throughput Benchmark
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Allocation throughput benchmark for Visual Leak Detector
+//
+//  Measures what VLD adds to each allocation and free. Started without the
+//  "--child" argument, the benchmark runs itself once per VLD configuration
+//  (VLD off, "fast", "safe" and "unwind" stack walks, sampled tracking). Each
+//  child runs in its own directory, holding a generated vld.ini, and prints
+//  the cost per operation of every workload for 1, 2, 4, ... up to the
+//  requested number of threads.
+//
+//  Usage: allocbench [maxthreads [operations]]
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+#include <windows.h>
+#include <objbase.h>
+#include <process.h>
+
+#include <vld.h>
+
+static const UINT BATCH = 64;                // Blocks kept alive at once by each thread.
+static const UINT DEFAULT_OPERATIONS = 200000; // Operations per thread and measurement.
+static const UINT MAX_THREADS = 64;          // Upper limit for the number of threads.
+
+// A VLD configuration, written to the vld.ini read by a child process.
+struct config_t {
+    const char *name;
+    const char *ini;
+};
+
+static const config_t configs [] = {
+    { "off",     "[Options]\r\nVLD = off\r\n" },
+    { "fast",    "[Options]\r\nVLD = on\r\nStackWalkMethod = fast\r\n" },
+    { "safe",    "[Options]\r\nVLD = on\r\nStackWalkMethod = safe\r\n" },
+    { "unwind",  "[Options]\r\nVLD = on\r\nStackWalkMethod = unwind\r\n" },
+    { "sampled", "[Options]\r\nVLD = on\r\nStackWalkMethod = fast\r\nSampleRate = 64\r\n" },
+};
+
+typedef void (*workload_t) (UINT operations);
+
+// Each workload performs "operations" allocating calls, freeing everything it
+// allocates.
+
+static void runMalloc (UINT operations)
+{
+    void *blocks [BATCH];
+    for (UINT done = 0; done < operations; done += BATCH) {
+        for (UINT index = 0; index < BATCH; index++)
+            blocks[index] = malloc(16 + index * 8);
+        for (UINT index = 0; index < BATCH; index++)
+            free(blocks[index]);
+    }
+}
+
+static void runNew (UINT operations)
+{
+    char *blocks [BATCH];
+    for (UINT done = 0; done < operations; done += BATCH) {
+        for (UINT index = 0; index < BATCH; index++)
+            blocks[index] = new char [16 + index * 8];
+        for (UINT index = 0; index < BATCH; index++)
+            delete [] blocks[index];
+    }
+}
+
+static void runHeapAlloc (UINT operations)
+{
+    HANDLE heap = GetProcessHeap();
+    void *blocks [BATCH];
+    for (UINT done = 0; done < operations; done += BATCH) {
+        for (UINT index = 0; index < BATCH; index++)
+            blocks[index] = HeapAlloc(heap, 0, 16 + index * 8);
+        for (UINT index = 0; index < BATCH; index++)
+            HeapFree(heap, 0, blocks[index]);
+    }
+}
+
+static void runCoTaskMemAlloc (UINT operations)
+{
+    void *blocks [BATCH];
+    for (UINT done = 0; done < operations; done += BATCH) {
+        for (UINT index = 0; index < BATCH; index++)
+            blocks[index] = CoTaskMemAlloc(16 + index * 8);
+        for (UINT index = 0; index < BATCH; index++)
+            CoTaskMemFree(blocks[index]);
+    }
+}
+
+// Grows each block from 16 bytes to 4 KB, one realloc per operation.
+static void runRealloc (UINT operations)
+{
+    void *blocks [BATCH];
+    UINT done = 0;
+    while (done < operations) {
+        for (UINT index = 0; index < BATCH; index++)
+            blocks[index] = malloc(16);
+        for (size_t size = 32; size <= 4096; size *= 2) {
+            for (UINT index = 0; index < BATCH; index++)
+                blocks[index] = realloc(blocks[index], size);
+            done += BATCH;
+        }
+        for (UINT index = 0; index < BATCH; index++)
+            free(blocks[index]);
+    }
+}
+
+static void runAlignedMalloc (UINT operations)
+{
+    void *blocks [BATCH];
+    for (UINT done = 0; done < operations; done += BATCH) {
+        for (UINT index = 0; index < BATCH; index++)
+            blocks[index] = _aligned_malloc(16 + index * 8, 64);
+        for (UINT index = 0; index < BATCH; index++)
+            _aligned_free(blocks[index]);
+    }
+}
+
+struct benchmark_t {
+    const char *name;
+    workload_t  run;
+};
+
+static const benchmark_t benchmarks [] = {
+    { "malloc",         runMalloc },
+    { "new",            runNew },
+    { "HeapAlloc",      runHeapAlloc },
+    { "CoTaskMemAlloc", runCoTaskMemAlloc },
+    { "realloc",        runRealloc },
+    { "_aligned_malloc", runAlignedMalloc },
+};
+
+struct threadcontext_t {
+    workload_t run;
+    UINT       operations;
+    HANDLE     start;
+};
+
+static unsigned __stdcall runThread (LPVOID param)
+{
+    threadcontext_t *context = (threadcontext_t*)param;
+    CoInitializeEx(NULL, COINIT_MULTITHREADED);
+    WaitForSingleObject(context->start, INFINITE);
+    context->run(context->operations);
+    CoUninitialize();
+    return 0;
+}
+
+// measure - Runs a workload on "threads" threads at once.
+//
+//  Return Value:
+//
+//    Returns the elapsed time, in nanoseconds, per operation and thread.
+//
+static double measure (workload_t run, UINT threads, UINT operations)
+{
+    threadcontext_t context;
+    context.run        = run;
+    context.operations = operations;
+    context.start      = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+    HANDLE handles [MAX_THREADS];
+    for (UINT index = 0; index < threads; index++)
+        handles[index] = (HANDLE)_beginthreadex(NULL, 0, runThread, &context, 0, NULL);
+
+    // Give every thread time to reach the start line.
+    Sleep(50);
+
+    LARGE_INTEGER frequency, begin, end;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&begin);
+    SetEvent(context.start);
+    WaitForMultipleObjects(threads, handles, TRUE, INFINITE);
+    QueryPerformanceCounter(&end);
+
+    for (UINT index = 0; index < threads; index++)
+        CloseHandle(handles[index]);
+    CloseHandle(context.start);
+
+    double nanoseconds = (double)(end.QuadPart - begin.QuadPart) * 1e9 / (double)frequency.QuadPart;
+    return nanoseconds / operations;
+}
+
+static int runChild (const config_t &config, UINT maxthreads, UINT operations)
+{
+    for (UINT bench = 0; bench < _countof(benchmarks); bench++) {
+        // Warm up the heaps and VLD's internal structures first.
+        measure(benchmarks[bench].run, 1, operations / 10);
+
+        // Double the threads each round, always finishing with maxthreads.
+        for (UINT threads = 1; ; threads = min(threads * 2, maxthreads)) {
+            double perop = measure(benchmarks[bench].run, threads, operations);
+            printf("%-8s %-16s %7u %10.1f %10.2f\n", config.name, benchmarks[bench].name,
+                threads, perop, 1e3 * threads / perop);
+            if (threads == maxthreads)
+                break;
+        }
+    }
+
+    VLD_STATISTICS stats = { 0 };
+    VLDGetStatistics(&stats);
+    if (stats.stackCaptures != 0) {
+        printf("%-8s ticks per stack capture %.0f, map insert %.0f, map erase %.0f, lock wait %.0f, exclusion check %.0f\n",
+            config.name,
+            (double)stats.stackCaptureTicks / stats.stackCaptures,
+            stats.mapInserts ? (double)stats.mapInsertTicks / stats.mapInserts : 0.0,
+            stats.mapErases ? (double)stats.mapEraseTicks / stats.mapErases : 0.0,
+            stats.lockAcquires ? (double)stats.lockWaitTicks / stats.lockAcquires : 0.0,
+            stats.exclusionChecks ? (double)stats.exclusionCheckTicks / stats.exclusionChecks : 0.0);
+    }
+    fflush(stdout);
+    return 0;
+}
+
+// runConfig - Runs the benchmark in a child process, in a directory of its own
+//   holding the vld.ini for the configuration.
+static bool runConfig (UINT config, UINT maxthreads, UINT operations)
+{
+    char directory [MAX_PATH];
+    GetTempPathA(MAX_PATH, directory);
+    strcat_s(directory, "vld_allocbench_");
+    strcat_s(directory, configs[config].name);
+    CreateDirectoryA(directory, NULL);
+
+    char inipath [MAX_PATH];
+    sprintf_s(inipath, "%s\\vld.ini", directory);
+    FILE *ini = NULL;
+    if (fopen_s(&ini, inipath, "wb") != 0)
+        return false;
+    fputs(configs[config].ini, ini);
+    fclose(ini);
+
+    char exepath [MAX_PATH];
+    GetModuleFileNameA(NULL, exepath, MAX_PATH);
+    char commandline [MAX_PATH * 2];
+    sprintf_s(commandline, "\"%s\" --child %u %u %u", exepath, config, maxthreads, operations);
+
+    STARTUPINFOA startup = { sizeof(startup) };
+    PROCESS_INFORMATION process;
+    if (!CreateProcessA(exepath, commandline, NULL, NULL, FALSE, 0, NULL, directory, &startup, &process))
+        return false;
+    WaitForSingleObject(process.hProcess, INFINITE);
+    DWORD exitcode = 1;
+    GetExitCodeProcess(process.hProcess, &exitcode);
+    CloseHandle(process.hThread);
+    CloseHandle(process.hProcess);
+    return exitcode == 0;
+}
+
+int main (int argc, char **argv)
+{
+    if ((argc == 5) && (strcmp(argv[1], "--child") == 0)) {
+        UINT config = (UINT)atoi(argv[2]);
+        if (config >= _countof(configs))
+            return 1;
+        return runChild(configs[config], (UINT)atoi(argv[3]), (UINT)atoi(argv[4]));
+    }
+
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    UINT maxthreads = (argc > 1) ? (UINT)atoi(argv[1]) : info.dwNumberOfProcessors;
+    UINT operations = (argc > 2) ? (UINT)atoi(argv[2]) : DEFAULT_OPERATIONS;
+    maxthreads = min(max(maxthreads, 1u), MAX_THREADS);
+    operations = max(operations, BATCH * 9);
+
+    printf("%-8s %-16s %7s %10s %10s\n", "config", "workload", "threads", "ns/op", "Mops/s");
+    fflush(stdout);
+
+    int failures = 0;
+    for (UINT config = 0; config < _countof(configs); config++) {
+        if (!runConfig(config, maxthreads, operations)) {
+            fprintf(stderr, "allocbench: the \"%s\" configuration failed to run\n", configs[config].name);
+            failures++;
+        }
+    }
+    return failures;
+}
@@ -140,6 +140,42 @@ TEST_P(TestBasics, GetProcMalloc)
     ASSERT_EQ(correctLeaks, leaks);
 }
 
+struct EnumeratedLeaks
+{
+    const void *block;
+    int found;
+    int total;
+};
+
+static int __cdecl CountLeak(const VLD_LEAK *leak, void *context)
+{
+    EnumeratedLeaks *leaks = static_cast<EnumeratedLeaks*>(context);
+    leaks->total++;
+    if (leak->address == leaks->block) {
+        leaks->found++;
+        EXPECT_EQ(64u, leak->size);
+        EXPECT_NE(0u, leak->frameCount);
+        EXPECT_TRUE(leak->frames != NULL);
+        VLD_FRAME_INFO frame;
+        EXPECT_TRUE(VLDResolveLeakFrame(leak, 0, &frame));
+        EXPECT_FALSE(VLDResolveLeakFrame(leak, leak->frameCount, &frame));
+    }
+    return 1;
+}
+
+TEST_P(TestBasics, EnumerateLeaks)
+{
+    void *block = malloc(64);
+    if (GetParam())
+        free(block);
+    EnumeratedLeaks leaks = { block, 0, 0 };
+    int enumerated = static_cast<int>(VLDEnumerateLeaks(CountLeak, &leaks, 0));
+    ASSERT_EQ(leaks.total, enumerated);
+    ASSERT_EQ(GetParam() ? 0 : 1, leaks.found);
+    if (!GetParam())
+        free(block);
+}
+
 INSTANTIATE_TEST_CASE_P(FreeVal,
     TestBasics,
     ::testing::Bool());
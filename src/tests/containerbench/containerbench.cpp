@@ -0,0 +1,302 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Container Benchmark
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Container benchmark for Visual Leak Detector
+//
+//  Measures VLD's own containers, Tree, Set and Map, against candidate
+//  replacements from the standard library, so that a change to the containers
+//  comes with figures. Keys are block addresses, as in VLD's block and heap
+//  maps, inserted either in increasing order or in random order. For each
+//  element count, every container is filled, searched, iterated and emptied,
+//  and the cost per element of each operation is printed.
+//
+//  The containers are built from VLD's sources, without the rest of VLD, so
+//  the benchmark provides the operators vldheap.h declares. They allocate from
+//  the CRT, like the standard containers do.
+//
+//  Usage: containerbench [maxelements]
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <windows.h>
+
+#define VLDBUILD
+#include "map.h"
+#include "set.h"
+
+static const UINT DEFAULT_MAX_ELEMENTS = 10000000;
+static const UINT MIN_ELEMENTS = 1000;
+static const UINT MIN_OPERATIONS = 2000000; // Small containers are rebuilt until this many elements were handled.
+
+void* operator new (size_t size, const char *, int)
+{
+    return ::operator new(size);
+}
+
+void* operator new [] (size_t size, const char *, int)
+{
+    return ::operator new [](size);
+}
+
+void operator delete (void *block, const char *, int)
+{
+    ::operator delete(block);
+}
+
+void operator delete [] (void *block, const char *, int)
+{
+    ::operator delete [](block);
+}
+
+// Each adapter gives a container the same four operations, over address
+// keys. find returns whether the key was found, iterate the sum of the keys,
+// so that neither can be optimized away.
+
+struct TreeAdapter {
+    static const char *name () { return "Tree"; }
+    Tree<UINT_PTR> tree;
+    void insert (UINT_PTR key) { tree.insert(key); }
+    bool find (UINT_PTR key) const { return tree.find(key) != NULL; }
+    void erase (UINT_PTR key) { tree.erase(key); }
+    UINT_PTR iterate () const
+    {
+        UINT_PTR sum = 0;
+        for (Tree<UINT_PTR>::node_t *node = tree.begin(); node != NULL; node = tree.next(node))
+            sum += node->key;
+        return sum;
+    }
+};
+
+struct UnlockedTreeAdapter {
+    static const char *name () { return "Tree<NoLock>"; }
+    Tree<UINT_PTR, NoLock> tree;
+    void insert (UINT_PTR key) { tree.insert(key); }
+    bool find (UINT_PTR key) const { return tree.find(key) != NULL; }
+    void erase (UINT_PTR key) { tree.erase(key); }
+    UINT_PTR iterate () const
+    {
+        UINT_PTR sum = 0;
+        for (Tree<UINT_PTR, NoLock>::node_t *node = tree.begin(); node != NULL; node = tree.next(node))
+            sum += node->key;
+        return sum;
+    }
+};
+
+struct SetAdapter {
+    static const char *name () { return "Set"; }
+    Set<UINT_PTR> set;
+    void insert (UINT_PTR key) { set.insert(key); }
+    bool find (UINT_PTR key) const { return set.find(key) != set.end(); }
+    void erase (UINT_PTR key) { set.erase(key); }
+    UINT_PTR iterate () const
+    {
+        UINT_PTR sum = 0;
+        for (Set<UINT_PTR>::Iterator it = set.begin(); it != set.end(); ++it)
+            sum += *it;
+        return sum;
+    }
+};
+
+struct MapAdapter {
+    static const char *name () { return "Map"; }
+    Map<UINT_PTR, SIZE_T> map;
+    void insert (UINT_PTR key) { map.insert(key, key & 0xFF); }
+    bool find (UINT_PTR key) const { return map.find(key) != map.end(); }
+    void erase (UINT_PTR key) { map.erase(key); }
+    UINT_PTR iterate () const
+    {
+        UINT_PTR sum = 0;
+        for (Map<UINT_PTR, SIZE_T>::Iterator it = map.begin(); it != map.end(); ++it)
+            sum += (*it).first + (*it).second;
+        return sum;
+    }
+};
+
+struct StdSetAdapter {
+    static const char *name () { return "std::set"; }
+    std::set<UINT_PTR> set;
+    void insert (UINT_PTR key) { set.insert(key); }
+    bool find (UINT_PTR key) const { return set.find(key) != set.end(); }
+    void erase (UINT_PTR key) { set.erase(key); }
+    UINT_PTR iterate () const
+    {
+        UINT_PTR sum = 0;
+        for (std::set<UINT_PTR>::const_iterator it = set.begin(); it != set.end(); ++it)
+            sum += *it;
+        return sum;
+    }
+};
+
+struct StdMapAdapter {
+    static const char *name () { return "std::map"; }
+    std::map<UINT_PTR, SIZE_T> map;
+    void insert (UINT_PTR key) { map.insert(std::make_pair(key, key & 0xFF)); }
+    bool find (UINT_PTR key) const { return map.find(key) != map.end(); }
+    void erase (UINT_PTR key) { map.erase(key); }
+    UINT_PTR iterate () const
+    {
+        UINT_PTR sum = 0;
+        for (std::map<UINT_PTR, SIZE_T>::const_iterator it = map.begin(); it != map.end(); ++it)
+            sum += it->first + it->second;
+        return sum;
+    }
+};
+
+struct StdHashMapAdapter {
+    static const char *name () { return "std::unordered_map"; }
+    std::unordered_map<UINT_PTR, SIZE_T> map;
+    void insert (UINT_PTR key) { map.insert(std::make_pair(key, key & 0xFF)); }
+    bool find (UINT_PTR key) const { return map.find(key) != map.end(); }
+    void erase (UINT_PTR key) { map.erase(key); }
+    UINT_PTR iterate () const
+    {
+        UINT_PTR sum = 0;
+        for (std::unordered_map<UINT_PTR, SIZE_T>::const_iterator it = map.begin(); it != map.end(); ++it)
+            sum += it->first + it->second;
+        return sum;
+    }
+};
+
+// The time spent in each operation, in performance counter ticks.
+struct timing_t {
+    LONGLONG insert;
+    LONGLONG find;
+    LONGLONG iterate;
+    LONGLONG erase;
+};
+
+static LONGLONG now ()
+{
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return counter.QuadPart;
+}
+
+static volatile UINT_PTR s_sink; // Keeps the results of find and iterate alive.
+
+// measure - Fills, searches, iterates and empties one kind of container,
+//   as many times as needed to handle MIN_OPERATIONS elements.
+template <typename Adapter>
+static UINT measure (const UINT_PTR *keys, UINT count, timing_t &timing)
+{
+    UINT rounds = max(MIN_OPERATIONS / count, 1u);
+    ZeroMemory(&timing, sizeof(timing));
+    for (UINT round = 0; round < rounds; round++) {
+        Adapter *container = new Adapter;
+        LONGLONG start = now();
+        for (UINT index = 0; index < count; index++)
+            container->insert(keys[index]);
+        LONGLONG inserted = now();
+        UINT_PTR found = 0;
+        for (UINT index = 0; index < count; index++)
+            found += container->find(keys[index]) ? 1 : 0;
+        LONGLONG searched = now();
+        UINT_PTR sum = container->iterate();
+        LONGLONG iterated = now();
+        for (UINT index = 0; index < count; index++)
+            container->erase(keys[index]);
+        LONGLONG erased = now();
+        delete container;
+
+        timing.insert += inserted - start;
+        timing.find += searched - inserted;
+        timing.iterate += iterated - searched;
+        timing.erase += erased - iterated;
+        s_sink = found + sum;
+    }
+    return rounds;
+}
+
+template <typename Adapter>
+static void run (const UINT_PTR *keys, UINT count, const char *order)
+{
+    timing_t timing;
+    UINT rounds = measure<Adapter>(keys, count, timing);
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    double scale = 1e9 / ((double)frequency.QuadPart * (double)count * (double)rounds);
+    printf("%-20s %-10s %9u %10.1f %10.1f %10.1f %10.1f\n", Adapter::name(), order, count,
+        (double)timing.insert * scale, (double)timing.find * scale, (double)timing.iterate * scale,
+        (double)timing.erase * scale);
+    fflush(stdout);
+}
+
+static void runAll (const UINT_PTR *keys, UINT count, const char *order)
+{
+    run<TreeAdapter>(keys, count, order);
+    run<UnlockedTreeAdapter>(keys, count, order);
+    run<SetAdapter>(keys, count, order);
+    run<MapAdapter>(keys, count, order);
+    run<StdSetAdapter>(keys, count, order);
+    run<StdMapAdapter>(keys, count, order);
+    run<StdHashMapAdapter>(keys, count, order);
+}
+
+int main (int argc, char **argv)
+{
+    UINT maxelements = (argc > 1) ? max((UINT)atoi(argv[1]), MIN_ELEMENTS) : DEFAULT_MAX_ELEMENTS;
+
+    UINT_PTR *keys = (UINT_PTR*)VirtualAlloc(NULL, maxelements * sizeof(UINT_PTR), MEM_COMMIT, PAGE_READWRITE);
+    if (keys == NULL) {
+        fprintf(stderr, "containerbench: couldn't allocate %u keys\n", maxelements);
+        return 1;
+    }
+
+    printf("%-20s %-10s %9s %10s %10s %10s %10s\n", "container", "keys", "elements", "insert ns",
+        "find ns", "iterate ns", "erase ns");
+    fflush(stdout);
+    for (UINT count = MIN_ELEMENTS; count <= maxelements; count *= 10) {
+        // Addresses of 48-byte blocks, which is what a heap hands out to
+        // small allocations.
+        UINT_PTR base = (UINT_PTR)0x10000000;
+        for (UINT index = 0; index < count; index++)
+            keys[index] = base + (UINT_PTR)index * 48;
+        runAll(keys, count, "sequential");
+
+        // The same addresses, shuffled with a fixed seed so that every run
+        // sees the same order.
+        UINT32 state = 0x2545F491;
+        for (UINT index = count - 1; index > 0; index--) {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            UINT other = state % (index + 1);
+            UINT_PTR key = keys[index];
+            keys[index] = keys[other];
+            keys[other] = key;
+        }
+        runAll(keys, count, "random");
+        if (count > maxelements / 10)
+            break;
+    }
+
+    VirtualFree(keys, 0, MEM_RELEASE);
+    return 0;
+}
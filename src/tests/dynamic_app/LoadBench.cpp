@@ -0,0 +1,194 @@
+#include "stdafx.h"
+#include "LoadBench.h"
+#include "vld.h"
+#include <process.h>
+#include <algorithm>
+#include <vector>
+
+// Loads and unloads copies of dynamic.dll over and over from several threads,
+// and prints the latency of each LoadLibrary and FreeLibrary, along with the
+// time VLD spent attaching to and forgetting the modules. Every load leaks a
+// few blocks from the DLL, so the cost of resolving call stacks into modules
+// which are gone is measured at the end.
+//
+// Each thread loads copies of its own, so that every load really maps a new
+// module instead of just counting another reference.
+
+static const UINT MAX_BENCH_THREADS = 64;
+
+struct BenchThread
+{
+    UINT index;
+    UINT dlls;
+    UINT rounds;
+    HANDLE start;
+    std::vector<double> loads;   // Microseconds per LoadLibrary.
+    std::vector<double> unloads; // Microseconds per FreeLibrary.
+};
+
+static LARGE_INTEGER sFrequency;
+
+static void GetCopyPath(UINT thread, UINT dll, TCHAR* path)
+{
+    GetTempPath(MAX_PATH, path);
+    TCHAR name[MAX_PATH];
+    _stprintf_s(name, _T("vld_loadbench\\dynamic_%u_%u.dll"), thread, dll);
+    _tcscat_s(path, MAX_PATH, name);
+}
+
+static double Microseconds(const LARGE_INTEGER& begin, const LARGE_INTEGER& end)
+{
+    return (double)(end.QuadPart - begin.QuadPart) * 1e6 / (double)sFrequency.QuadPart;
+}
+
+unsigned __stdcall LoadBench_Thread_Procedure(LPVOID param)
+{
+    BenchThread& thread = *(BenchThread*)param;
+    WaitForSingleObject(thread.start, INFINITE);
+    typedef void (__cdecl *DYNAPI_FNC)();
+    for (UINT round = 0; round < thread.rounds; ++round)
+    {
+        for (UINT dll = 0; dll < thread.dlls; ++dll)
+        {
+            TCHAR path[MAX_PATH];
+            GetCopyPath(thread.index, dll, path);
+            LARGE_INTEGER begin, end;
+            QueryPerformanceCounter(&begin);
+            HMODULE module = LoadLibrary(path);
+            QueryPerformanceCounter(&end);
+            if (module == NULL)
+                continue;
+            thread.loads.push_back(Microseconds(begin, end));
+
+            DYNAPI_FNC leak = (DYNAPI_FNC)GetProcAddress(module, "SimpleLeak_Malloc"); // leaks 6
+            if (leak)
+                leak();
+
+            QueryPerformanceCounter(&begin);
+            FreeLibrary(module);
+            QueryPerformanceCounter(&end);
+            thread.unloads.push_back(Microseconds(begin, end));
+        }
+    }
+    return 0;
+}
+
+static void PrintLatencies(const TCHAR* name, std::vector<double>& latencies)
+{
+    if (latencies.empty())
+    {
+        _tprintf(_T("%-8s none\n"), name);
+        return;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    double total = 0;
+    for (size_t i = 0; i < latencies.size(); ++i)
+        total += latencies[i];
+    size_t count = latencies.size();
+    _tprintf(_T("%-8s %8u %10.1f %10.1f %10.1f %10.1f\n"), name, (UINT)count, total / count,
+        latencies[count / 2], latencies[min(count - 1, count * 99 / 100)], latencies[count - 1]);
+}
+
+int RunLoadBenchmark(UINT dlls, UINT threads, UINT rounds)
+{
+    threads = min(max(threads, 1u), MAX_BENCH_THREADS);
+    dlls = max(dlls, 1u);
+    rounds = max(rounds, 1u);
+    QueryPerformanceFrequency(&sFrequency);
+
+    // Make the copies next to nothing else, so that the loader finds each
+    // one by its full path.
+    TCHAR source[MAX_PATH];
+    GetModuleFileName(NULL, source, MAX_PATH);
+    TCHAR* slash = _tcsrchr(source, _T('\\'));
+    if (slash == NULL)
+        return 1;
+    _tcscpy_s(slash + 1, MAX_PATH - (slash + 1 - source), _T("dynamic.dll"));
+    TCHAR directory[MAX_PATH];
+    GetTempPath(MAX_PATH, directory);
+    _tcscat_s(directory, _T("vld_loadbench"));
+    CreateDirectory(directory, NULL);
+    for (UINT thread = 0; thread < threads; ++thread)
+    {
+        for (UINT dll = 0; dll < dlls; ++dll)
+        {
+            TCHAR path[MAX_PATH];
+            GetCopyPath(thread, dll, path);
+            if (!CopyFile(source, path, FALSE))
+            {
+                _tprintf(_T("Couldn't copy %s to %s.\n"), source, path);
+                return 1;
+            }
+        }
+    }
+
+    VLD_STATISTICS before = { 0 };
+    VLDGetStatistics(&before);
+    VLDMarkAllLeaksAsReported();
+
+    HANDLE start = CreateEvent(NULL, TRUE, FALSE, NULL);
+    BenchThread contexts[MAX_BENCH_THREADS];
+    HANDLE handles[MAX_BENCH_THREADS];
+    for (UINT i = 0; i < threads; ++i)
+    {
+        contexts[i].index = i;
+        contexts[i].dlls = dlls;
+        contexts[i].rounds = rounds;
+        contexts[i].start = start;
+        contexts[i].loads.reserve(dlls * rounds);
+        contexts[i].unloads.reserve(dlls * rounds);
+        handles[i] = (HANDLE)_beginthreadex(NULL, 0, LoadBench_Thread_Procedure, &contexts[i], 0, NULL);
+    }
+    // Give every thread time to reach the start line.
+    Sleep(50);
+    LARGE_INTEGER begin, end;
+    QueryPerformanceCounter(&begin);
+    SetEvent(start);
+    WaitForMultipleObjects(threads, handles, TRUE, INFINITE);
+    QueryPerformanceCounter(&end);
+    for (UINT i = 0; i < threads; ++i)
+        CloseHandle(handles[i]);
+    CloseHandle(start);
+
+    VLD_STATISTICS after = { 0 };
+    VLDGetStatistics(&after);
+
+    std::vector<double> loads, unloads;
+    for (UINT i = 0; i < threads; ++i)
+    {
+        loads.insert(loads.end(), contexts[i].loads.begin(), contexts[i].loads.end());
+        unloads.insert(unloads.end(), contexts[i].unloads.begin(), contexts[i].unloads.end());
+    }
+    _tprintf(_T("%u DLLs loaded and unloaded %u times by each of %u threads in %.1f ms\n"),
+        dlls, rounds, threads, Microseconds(begin, end) / 1e3);
+    _tprintf(_T("%-8s %8s %10s %10s %10s %10s\n"), _T("us"), _T("calls"), _T("mean"), _T("median"), _T("p99"), _T("max"));
+    PrintLatencies(_T("load"), loads);
+    PrintLatencies(_T("unload"), unloads);
+
+    UINT64 attaches = after.moduleAttaches - before.moduleAttaches;
+    UINT64 detaches = after.moduleDetaches - before.moduleDetaches;
+    _tprintf(_T("VLD attaches %llu, ticks per attach %.0f; detaches %llu, ticks per detach %.0f\n"),
+        attaches, attaches ? (double)(after.moduleAttachTicks - before.moduleAttachTicks) / attaches : 0.0,
+        detaches, detaches ? (double)(after.moduleDetachTicks - before.moduleDetachTicks) / detaches : 0.0);
+
+    // The leaked blocks' call stacks point into the unloaded copies.
+    UINT leaks = VLDGetLeaksCount();
+    QueryPerformanceCounter(&begin);
+    int unresolved = VLDResolveCallstacks();
+    QueryPerformanceCounter(&end);
+    _tprintf(_T("Resolved the call stacks of %u leaks into unloaded modules in %.1f ms (%d unresolved functions)\n"),
+        leaks, Microseconds(begin, end) / 1e3, unresolved);
+    VLDMarkAllLeaksAsReported();
+
+    for (UINT thread = 0; thread < threads; ++thread)
+    {
+        for (UINT dll = 0; dll < dlls; ++dll)
+        {
+            TCHAR path[MAX_PATH];
+            GetCopyPath(thread, dll, path);
+            DeleteFile(path);
+        }
+    }
+    RemoveDirectory(directory);
+    return 0;
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+int RunLoadBenchmark(UINT dlls, UINT threads, UINT rounds);
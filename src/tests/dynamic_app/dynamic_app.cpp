@@ -3,6 +3,7 @@
 
 #include "stdafx.h"
 #include "LoadTests.h"
+#include "LoadBench.h"
 #include "ThreadTests.h"
 #include "vld.h"
 
@@ -136,6 +137,16 @@ int __cdecl ReportHook(int /*reportHook*/, wchar_t *message, int* /*returnValue*
 }
 
 int main(int argc, char **argv) {
+    // dynamic_app --bench [dlls [threads [rounds]]] measures the module load
+    // and unload latency instead of running the tests. Run it again with
+    // "VLD = off" in vld.ini for the latency without VLD.
+    if ((argc > 1) && (strcmp(argv[1], "--bench") == 0)) {
+        UINT dlls = (argc > 2) ? (UINT)atoi(argv[2]) : 16;
+        UINT threads = (argc > 3) ? (UINT)atoi(argv[3]) : 4;
+        UINT rounds = (argc > 4) ? (UINT)atoi(argv[4]) : 50;
+        return RunLoadBenchmark(dlls, threads, rounds);
+    }
+
     VLDSetReportHook(VLD_RPTHOOK_INSTALL, ReportHook);
     ::testing::InitGoogleTest(&argc, argv);
     int res = RUN_ALL_TESTS();
@@ -0,0 +1,186 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Report Generation Benchmark
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Report generation benchmark for Visual Leak Detector
+//
+//  Leaks a configurable number of blocks from a configurable number of
+//  distinct call stacks, then generates leak reports with different options
+//  and prints how long each phase took: resolving the call stacks, grouping
+//  duplicate leaks, dumping call stacks, dumping block data (ANSI and
+//  Unicode), and printing. The phase times come from VLDGetStatistics; the
+//  reports are written to a file in the temporary directory.
+//
+//  Usage: reportbench [blocks [stacks]]
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <cstdio>
+#include <cstdlib>
+#include <intrin.h>
+#include <windows.h>
+
+#include <vld.h>
+
+static const UINT DEFAULT_BLOCKS = 100000; // Leaked blocks.
+static const UINT DEFAULT_STACKS = 1000;   // Distinct call stacks the blocks are allocated from.
+static const UINT MAX_BLOCKS = 1000000;
+
+static volatile UINT s_sideA; // Written after each call, so that the branches
+static volatile UINT s_sideB; //   are neither tail calls nor folded together.
+
+static void* branch (UINT pattern, UINT depth, size_t size);
+
+// branchA and branchB form the frames of the synthesized call stacks. Each bit
+// of a pattern selects which of the two a frame returns to, so every pattern
+// leaks from a call stack of its own.
+static __declspec(noinline) void* branchA (UINT pattern, UINT depth, size_t size)
+{
+    void *block = branch(pattern, depth, size);
+    s_sideA++;
+    return block;
+}
+
+static __declspec(noinline) void* branchB (UINT pattern, UINT depth, size_t size)
+{
+    void *block = branch(pattern, depth, size);
+    s_sideB += 3;
+    return block;
+}
+
+static void* branch (UINT pattern, UINT depth, size_t size)
+{
+    if (depth == 0)
+        return malloc(size);
+    if (pattern & 1)
+        return branchA(pattern >> 1, depth - 1, size);
+    return branchB(pattern >> 1, depth - 1, size);
+}
+
+static double s_ticksPerMs; // Time stamp counter frequency.
+
+// calibrate - Measures the time stamp counter frequency against the
+//   performance counter.
+static void calibrate ()
+{
+    LARGE_INTEGER frequency, begin, end;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&begin);
+    unsigned long long start = __rdtsc();
+    Sleep(200);
+    unsigned long long ticks = __rdtsc() - start;
+    QueryPerformanceCounter(&end);
+    s_ticksPerMs = (double)ticks * (double)frequency.QuadPart / (1e3 * (double)(end.QuadPart - begin.QuadPart));
+}
+
+static double ms (unsigned long long ticks)
+{
+    return (double)ticks / s_ticksPerMs;
+}
+
+// A report configuration, or resolving the call stacks.
+struct phase_t {
+    const char *name;
+    bool        resolve;     // Call VLDResolveCallstacks instead of generating a report.
+    UINT        options;     // Options passed to VLDSetOptions.
+    UINT        report;      // Options passed to VLDSetReportOptions.
+    size_t      maxDataDump;
+};
+
+static const phase_t phases [] = {
+    { "resolve",      true,  0,                            VLD_OPT_REPORT_TO_FILE,                          0 },
+    { "report",       false, 0,                            VLD_OPT_REPORT_TO_FILE,                          0 },
+    { "aggregate",    false, VLD_OPT_AGGREGATE_DUPLICATES, VLD_OPT_REPORT_TO_FILE,                          0 },
+    { "dump ansi",    false, 0,                            VLD_OPT_REPORT_TO_FILE,                          64 },
+    { "dump unicode", false, 0,                            VLD_OPT_REPORT_TO_FILE | VLD_OPT_UNICODE_REPORT, 64 },
+};
+
+int main (int argc, char **argv)
+{
+    UINT blocks = (argc > 1) ? (UINT)atoi(argv[1]) : DEFAULT_BLOCKS;
+    UINT stacks = (argc > 2) ? (UINT)atoi(argv[2]) : DEFAULT_STACKS;
+    blocks = min(max(blocks, 1u), MAX_BLOCKS);
+    stacks = min(max(stacks, 1u), blocks);
+
+    UINT depth = 0;
+    while ((1u << depth) < stacks)
+        depth++;
+
+    // The block list is allocated outside of any heap, so it isn't a leak itself.
+    void **leaks = (void**)VirtualAlloc(NULL, blocks * sizeof(void*), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (leaks == NULL)
+        return 1;
+
+    calibrate();
+    LARGE_INTEGER frequency, begin, end;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&begin);
+    for (UINT index = 0; index < blocks; index++) {
+        UINT pattern = index % stacks;
+        leaks[index] = branch(pattern, depth, 16 + (pattern % 8) * 16);
+    }
+    QueryPerformanceCounter(&end);
+    printf("%u blocks leaked from %u call stacks (%u frames deep) in %.1f ms\n", blocks, stacks, depth,
+        (double)(end.QuadPart - begin.QuadPart) * 1e3 / (double)frequency.QuadPart);
+
+    WCHAR reportpath [MAX_PATH];
+    GetTempPathW(MAX_PATH, reportpath);
+    wcscat_s(reportpath, L"vld_reportbench.txt");
+
+    UINT baseoptions = VLDGetOptions() & ~VLD_OPT_AGGREGATE_DUPLICATES;
+    printf("%-13s %9s %9s %9s %9s %9s %9s %9s %9s\n", "phase (ms)", "wall", "resolve", "report",
+        "aggregate", "stacks", "data", "print", "leaks");
+    for (UINT index = 0; index < _countof(phases); index++) {
+        const phase_t &phase = phases[index];
+        VLDSetOptions(baseoptions | phase.options, phase.maxDataDump, 0);
+        VLDSetReportOptions(phase.report, reportpath);
+
+        VLD_STATISTICS before, after;
+        VLDGetStatistics(&before);
+        QueryPerformanceCounter(&begin);
+        UINT leaksfound = 0;
+        if (phase.resolve)
+            VLDResolveCallstacks();
+        else
+            leaksfound = VLDReportLeaks();
+        QueryPerformanceCounter(&end);
+        VLDGetStatistics(&after);
+
+        printf("%-13s %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9u\n", phase.name,
+            (double)(end.QuadPart - begin.QuadPart) * 1e3 / (double)frequency.QuadPart,
+            ms(after.resolveTicks - before.resolveTicks),
+            ms(after.reportTicks - before.reportTicks),
+            ms(after.aggregationTicks - before.aggregationTicks),
+            ms(after.stackDumpTicks - before.stackDumpTicks),
+            ms(after.dataDumpTicks - before.dataDumpTicks),
+            ms(after.printTicks - before.printTicks),
+            leaksfound);
+        fflush(stdout);
+    }
+
+    for (UINT index = 0; index < blocks; index++)
+        free(leaks[index]);
+    VirtualFree(leaks, 0, MEM_RELEASE);
+    return 0;
+}
@@ -0,0 +1,234 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Startup Time Benchmark
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Startup time benchmark for Visual Leak Detector
+//
+//  Measures what VLD's installation costs in a process which already has many
+//  DLLs loaded. For each DLL count, the benchmark runs itself as a child
+//  process twice: once with VLD and once without. The child loads that many
+//  copies of dynamic.dll, then loads VLD, when installed, the way an
+//  application's startup would. VLD's constructor enumerates and patches every
+//  one of them. The child prints the time from its creation until then, the
+//  time the DLLs took to load, the time VLD took to install, and VLD's own
+//  breakdown of the installation by phase: reading the options, initializing
+//  the symbol handler, enumerating the loaded modules and patching them.
+//
+//  The benchmark doesn't include vld.h, so that VLD is only loaded when the
+//  child chooses to.
+//
+//  Usage: startbench [dlls ...]
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <intrin.h>
+#include <windows.h>
+
+#include <vld_def.h>
+
+#ifdef _WIN64
+static const char *VLD_DLL = "vld_x64.dll";
+#else
+static const char *VLD_DLL = "vld_x86.dll";
+#endif
+
+static const UINT DEFAULT_DLLS [] = { 100, 300, 1000 };
+static const UINT MAX_DLLS = 4000;
+
+typedef void (*VLDGetStatistics_t) (VLD_STATISTICS *statistics);
+typedef VOID (WINAPI *GetSystemTimePreciseAsFileTime_t) (LPFILETIME time);
+
+static double s_ticksPerMs; // Time stamp counter frequency.
+
+// calibrate - Measures the time stamp counter frequency against the
+//   performance counter.
+static void calibrate ()
+{
+    LARGE_INTEGER frequency, begin, end;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&begin);
+    unsigned long long start = __rdtsc();
+    Sleep(200);
+    unsigned long long ticks = __rdtsc() - start;
+    QueryPerformanceCounter(&end);
+    s_ticksPerMs = (double)ticks * (double)frequency.QuadPart / (1e3 * (double)(end.QuadPart - begin.QuadPart));
+}
+
+static double ms (unsigned long long ticks)
+{
+    return (double)ticks / s_ticksPerMs;
+}
+
+static void copyPath (UINT dll, char *path)
+{
+    GetTempPathA(MAX_PATH, path);
+    char name [MAX_PATH];
+    sprintf_s(name, "vld_startbench\\dynamic_%u.dll", dll);
+    strcat_s(path, MAX_PATH, name);
+}
+
+// sinceCreation - Returns the time, in milliseconds, since the process was
+//   created.
+static double sinceCreation ()
+{
+    static GetSystemTimePreciseAsFileTime_t getTime = (GetSystemTimePreciseAsFileTime_t)
+        GetProcAddress(GetModuleHandleA("kernel32.dll"), "GetSystemTimePreciseAsFileTime");
+    FILETIME creation, exit, kernel, user, now;
+    GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+    if (getTime != NULL)
+        getTime(&now);
+    else
+        GetSystemTimeAsFileTime(&now);
+    ULARGE_INTEGER from, to;
+    from.LowPart = creation.dwLowDateTime;
+    from.HighPart = creation.dwHighDateTime;
+    to.LowPart = now.dwLowDateTime;
+    to.HighPart = now.dwHighDateTime;
+    return (double)(to.QuadPart - from.QuadPart) / 1e4;
+}
+
+static int runChild (UINT dlls, bool vld)
+{
+    LARGE_INTEGER frequency, begin, end;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&begin);
+    for (UINT dll = 0; dll < dlls; dll++) {
+        char path [MAX_PATH];
+        copyPath(dll, path);
+        if (LoadLibraryA(path) == NULL)
+            return 1;
+    }
+    QueryPerformanceCounter(&end);
+    double loadms = (double)(end.QuadPart - begin.QuadPart) * 1e3 / (double)frequency.QuadPart;
+
+    double vldms = 0.0;
+    HMODULE vldmodule = NULL;
+    if (vld) {
+        QueryPerformanceCounter(&begin);
+        vldmodule = LoadLibraryA(VLD_DLL);
+        QueryPerformanceCounter(&end);
+        if (vldmodule == NULL)
+            return 1;
+        vldms = (double)(end.QuadPart - begin.QuadPart) * 1e3 / (double)frequency.QuadPart;
+    }
+    double readyms = sinceCreation();
+
+    VLD_STATISTICS stats = { 0 };
+    if (vldmodule != NULL) {
+        VLDGetStatistics_t getStatistics = (VLDGetStatistics_t)GetProcAddress(vldmodule, "VLDGetStatistics");
+        if (getStatistics != NULL)
+            getStatistics(&stats);
+    }
+    calibrate();
+
+    printf("%6u %-4s %8llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", dlls, vld ? "on" : "off",
+        stats.startupModules, readyms, loadms, vldms, ms(stats.configureTicks), ms(stats.symbolInitTicks),
+        ms(stats.moduleEnumTicks), ms(stats.modulePatchTicks));
+    fflush(stdout);
+    return 0;
+}
+
+// runChild - Runs the benchmark in a child process, so that each
+//   measurement starts from a fresh process.
+static bool runChildProcess (UINT dlls, bool vld)
+{
+    char exepath [MAX_PATH];
+    GetModuleFileNameA(NULL, exepath, MAX_PATH);
+    char commandline [MAX_PATH * 2];
+    sprintf_s(commandline, "\"%s\" --child %u %u", exepath, dlls, vld ? 1 : 0);
+
+    STARTUPINFOA startup = { sizeof(startup) };
+    PROCESS_INFORMATION process;
+    if (!CreateProcessA(exepath, commandline, NULL, NULL, FALSE, 0, NULL, NULL, &startup, &process))
+        return false;
+    WaitForSingleObject(process.hProcess, INFINITE);
+    DWORD exitcode = 1;
+    GetExitCodeProcess(process.hProcess, &exitcode);
+    CloseHandle(process.hThread);
+    CloseHandle(process.hProcess);
+    return exitcode == 0;
+}
+
+int main (int argc, char **argv)
+{
+    if ((argc == 4) && (strcmp(argv[1], "--child") == 0))
+        return runChild(min((UINT)atoi(argv[2]), MAX_DLLS), atoi(argv[3]) != 0);
+
+    UINT counts [64];
+    UINT countCount = 0;
+    for (int arg = 1; (arg < argc) && (countCount < _countof(counts)); arg++)
+        counts[countCount++] = min(max((UINT)atoi(argv[arg]), 1u), MAX_DLLS);
+    if (countCount == 0) {
+        for (UINT index = 0; index < _countof(DEFAULT_DLLS); index++)
+            counts[countCount++] = DEFAULT_DLLS[index];
+    }
+    UINT maxdlls = 0;
+    for (UINT index = 0; index < countCount; index++)
+        maxdlls = max(maxdlls, counts[index]);
+
+    // Every copy is a module of its own to the loader, and to VLD.
+    char source [MAX_PATH];
+    GetModuleFileNameA(NULL, source, MAX_PATH);
+    char *slash = strrchr(source, '\\');
+    if (slash == NULL)
+        return 1;
+    strcpy_s(slash + 1, MAX_PATH - (slash + 1 - source), "dynamic.dll");
+    char directory [MAX_PATH];
+    GetTempPathA(MAX_PATH, directory);
+    strcat_s(directory, "vld_startbench");
+    CreateDirectoryA(directory, NULL);
+    for (UINT dll = 0; dll < maxdlls; dll++) {
+        char path [MAX_PATH];
+        copyPath(dll, path);
+        if (!CopyFileA(source, path, FALSE)) {
+            fprintf(stderr, "startbench: couldn't copy %s to %s\n", source, path);
+            return 1;
+        }
+    }
+
+    printf("%6s %-4s %8s %10s %10s %10s %10s %10s %10s %10s\n", "dlls", "vld", "modules", "ready ms",
+        "load ms", "vld ms", "config ms", "symbol ms", "enum ms", "patch ms");
+    fflush(stdout);
+
+    int failures = 0;
+    for (UINT index = 0; index < countCount; index++) {
+        for (UINT vld = 0; vld < 2; vld++) {
+            if (!runChildProcess(counts[index], vld != 0)) {
+                fprintf(stderr, "startbench: the run with %u DLLs failed\n", counts[index]);
+                failures++;
+            }
+        }
+    }
+
+    for (UINT dll = 0; dll < maxdlls; dll++) {
+        char path [MAX_PATH];
+        copyPath(dll, path);
+        DeleteFileA(path);
+    }
+    RemoveDirectoryA(directory);
+    return failures;
+}
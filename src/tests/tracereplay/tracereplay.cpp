@@ -0,0 +1,549 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Allocation Trace Replay
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Allocation trace replay harness for Visual Leak Detector
+//
+//  Replays a trace recorded with the "RecordTrace" option, so that VLD's
+//  tracking can be measured on a real application's heap traffic without the
+//  application. Every recorded heap is replaced by a heap of its own, and
+//  every allocation, free and reallocation is made again, so each one goes
+//  through VLD's mapBlock, unmapBlock or remapBlock. The blocks still alive at
+//  the end of the trace are then reported as leaks.
+//
+//  Each recorded thread is replayed on a thread of its own (up to the given
+//  number of threads, among which the recorded ones are then shared out), and
+//  a call on a block waits for the block's previous call to be made, wherever
+//  it was recorded. With one thread, the trace is replayed in order. The call
+//  stacks aren't the recorded ones: each recorded stack is stood in for by one
+//  of 2^STACK_DEPTH synthesized stacks, chosen by its hash. Heaps destroyed by
+//  the application are only destroyed once every thread is done, unless the
+//  trace is replayed on one thread.
+//
+//  Started without the "--child" argument, the harness replays the trace once
+//  per VLD configuration, each in a child process in a directory of its own
+//  holding a generated vld.ini (see allocbench), and prints the replay time,
+//  the calls per second, the peak memory VLD used for its metadata, the heap
+//  map lock shards entered and the time spent waiting for them, and the time
+//  taken to report the leaks. Container backends are compared by running the
+//  harness against each build of vld.dll.
+//
+//  Usage: tracereplay tracefile [threads]
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+#include <intrin.h>
+#include <windows.h>
+#include <process.h>
+
+#include <vld.h>
+#include <alloctrace.h>
+
+static const UINT MAX_THREADS = 64;    // Upper limit for the number of threads.
+static const UINT STACK_DEPTH = 8;     // Synthesized frames standing in for each recorded call stack.
+static const UINT SAMPLE_INTERVAL = 10; // Milliseconds between samples of VLD's metadata memory.
+
+// A VLD configuration, written to the vld.ini read by a child process. The
+// leaks are reported to a file, so that the report time isn't the debugger's.
+struct config_t {
+    const char *name;
+    const char *ini;
+};
+
+#define REPORT_OPTIONS "ReportTo = file\r\nReportFile = report.txt\r\n"
+
+static const config_t configs [] = {
+    { "off",      "[Options]\r\nVLD = off\r\n" },
+    { "fast",     "[Options]\r\nVLD = on\r\nStackWalkMethod = fast\r\n" REPORT_OPTIONS },
+    { "deferred", "[Options]\r\nVLD = on\r\nStackWalkMethod = fast\r\nDeferStackCapture = yes\r\n" REPORT_OPTIONS },
+    { "sampled",  "[Options]\r\nVLD = on\r\nStackWalkMethod = fast\r\nSampleRate = 64\r\n" REPORT_OPTIONS },
+};
+
+// A call to replay.
+struct replayop_t {
+    UINT8  op;    // One of the VLDATRACE_* operations.
+    UINT32 slot;  // Slot of the block, or the heap for VLDATRACE_HEAPDESTROY.
+    UINT32 turn;  // Number of calls made on the block before this one.
+    UINT32 shape; // Hash of the recorded call stack, which picks the synthesized one.
+    SIZE_T size;  // Size, in bytes, of the block.
+};
+
+// A recorded block, from its allocation to its free. Blocks are told apart by
+// slot rather than by address, since addresses are reused.
+struct slot_t {
+    LPVOID volatile mem;   // The replayed block, or NULL.
+    volatile LONG   turn;  // Number of calls made on the block so far.
+    UINT32          heap;  // Index of the block's heap.
+};
+
+// The trace, made ready for replaying. Everything is allocated with
+// VirtualAlloc, so that it isn't tracked itself.
+struct trace_t {
+    replayop_t *ops;
+    UINT32      opCount;
+    slot_t     *slots;
+    UINT32      slotCount;
+    HANDLE     *heaps;
+    UINT32      heapCount;
+    bool       *destroyed;            // The heaps the application destroyed.
+    UINT32     *order [MAX_THREADS];  // Indices of the calls each thread makes, in recorded order.
+    UINT32      orderCount [MAX_THREADS];
+    UINT32      threads;
+    UINT32      recordedThreads;
+};
+
+static trace_t s_trace;
+
+static LPVOID allocate (SIZE_T size)
+{
+    return VirtualAlloc(NULL, max(size, (SIZE_T)1), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+}
+
+// loadTrace - Reads a trace file and turns its events into the calls of each
+//   replay thread. Frees and reallocations of blocks the trace has no
+//   allocation of are dropped.
+//
+//  Return Value:
+//
+//    Returns true if the trace was loaded.
+//
+static bool loadTrace (const char *path, UINT threads)
+{
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER filesize;
+    GetFileSizeEx(file, &filesize);
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    const BYTE *view = (mapping != NULL) ? (const BYTE*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (view == NULL) {
+        if (mapping != NULL)
+            CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+
+    const vldatrace_header_t *header = (const vldatrace_header_t*)view;
+    UINT64 size = (UINT64)filesize.QuadPart;
+    bool valid = (size >= sizeof(vldatrace_header_t)) && (header->magic == VLDATRACE_MAGIC) &&
+        (header->version == VLDATRACE_VERSION) && (header->eventOffset <= size) &&
+        (header->eventCount <= (size - header->eventOffset) / sizeof(vldatrace_event_t)) &&
+        (header->eventCount < MAXUINT32) && (header->stackOffset <= size);
+    if (valid) {
+        const vldatrace_event_t *events = (const vldatrace_event_t*)(view + header->eventOffset);
+        UINT32 eventCount = (UINT32)header->eventCount;
+
+        // Hashes of the recorded call stacks, by ID.
+        std::unordered_map<UINT64, UINT32> stacks;
+        UINT64 offset = header->stackOffset;
+        for (UINT32 index = 0; (index < header->stackCount) && (offset + sizeof(vldatrace_stack_t) <= size); index++) {
+            const vldatrace_stack_t *stack = (const vldatrace_stack_t*)(view + offset);
+            stacks[stack->id] = stack->hash;
+            offset += sizeof(vldatrace_stack_t) + (UINT64)stack->frameCount * sizeof(UINT64);
+        }
+
+        // The threads' events are interleaved in the order they were
+        // flushed, so they're put back in the order they happened.
+        UINT32 *sorted = (UINT32*)allocate(eventCount * sizeof(UINT32));
+        for (UINT32 index = 0; index < eventCount; index++)
+            sorted[index] = index;
+        std::sort(sorted, sorted + eventCount, [events] (UINT32 a, UINT32 b) {
+            return (events[a].timestamp != events[b].timestamp) ? (events[a].timestamp < events[b].timestamp) : (a < b);
+        });
+
+        s_trace.ops   = (replayop_t*)allocate(eventCount * sizeof(replayop_t));
+        s_trace.slots = (slot_t*)allocate(eventCount * sizeof(slot_t));
+        UINT32 *threadOf = (UINT32*)allocate(eventCount * sizeof(UINT32));
+        std::unordered_map<UINT64, UINT32> blocks;   // Slot of each live block, by address.
+        std::unordered_map<UINT64, UINT32> heaps;    // Index of each live heap, by handle.
+        std::unordered_map<DWORD, UINT32> threadIds; // Replay thread of each recorded thread.
+        for (UINT32 index = 0; index < eventCount; index++) {
+            const vldatrace_event_t &event = events[sorted[index]];
+            replayop_t &op = s_trace.ops[s_trace.opCount];
+            op.op = event.op;
+            op.size = (SIZE_T)event.size;
+            op.turn = 0;
+            std::unordered_map<UINT64, UINT32>::iterator stackit = stacks.find(event.stack);
+            op.shape = (stackit != stacks.end()) ? stackit->second : 0;
+
+            UINT32 heap;
+            std::unordered_map<UINT64, UINT32>::iterator heapit = heaps.find(event.heap);
+            if (heapit != heaps.end())
+                heap = heapit->second;
+            else if (event.op == VLDATRACE_ALLOC)
+                heaps[event.heap] = heap = s_trace.heapCount++;
+            else if (event.op != VLDATRACE_HEAPDESTROY)
+                heap = MAXUINT32; // Looked up by the block's slot.
+            else
+                continue;
+
+            std::unordered_map<UINT64, UINT32>::iterator blockit = blocks.find(event.address);
+            switch (event.op) {
+            case VLDATRACE_ALLOC:
+                // Any live block at the same address was freed unseen, and
+                // is left as it is.
+                op.slot = s_trace.slotCount++;
+                s_trace.slots[op.slot].mem = NULL;
+                s_trace.slots[op.slot].turn = 0;
+                s_trace.slots[op.slot].heap = heap;
+                blocks[event.address] = op.slot;
+                break;
+
+            case VLDATRACE_FREE:
+            case VLDATRACE_REALLOC:
+                if (blockit == blocks.end())
+                    continue;
+                op.slot = blockit->second;
+                op.turn = s_trace.slots[op.slot].turn++;
+                if (event.op == VLDATRACE_FREE)
+                    blocks.erase(blockit);
+                break;
+
+            case VLDATRACE_HEAPDESTROY:
+                // The handle may be given to a new heap afterwards.
+                op.slot = heap;
+                heaps.erase(event.heap);
+                break;
+
+            default:
+                continue;
+            }
+
+            std::unordered_map<DWORD, UINT32>::iterator threadit = threadIds.find(event.threadId);
+            UINT32 thread;
+            if (threadit != threadIds.end())
+                thread = threadit->second;
+            else {
+                thread = (UINT32)threadIds.size() % threads;
+                threadIds[event.threadId] = thread;
+            }
+            threadOf[s_trace.opCount] = thread;
+            s_trace.orderCount[thread]++;
+            s_trace.opCount++;
+        }
+        s_trace.recordedThreads = (UINT32)threadIds.size();
+        s_trace.threads = min(threads, max(s_trace.recordedThreads, 1u));
+
+        // The turns were counted up while loading; the replay counts them
+        // again from zero.
+        for (UINT32 index = 0; index < s_trace.slotCount; index++)
+            s_trace.slots[index].turn = 0;
+
+        for (UINT32 thread = 0; thread < s_trace.threads; thread++) {
+            s_trace.order[thread] = (UINT32*)allocate(s_trace.orderCount[thread] * sizeof(UINT32));
+            s_trace.orderCount[thread] = 0;
+        }
+        for (UINT32 index = 0; index < s_trace.opCount; index++) {
+            UINT32 thread = threadOf[index];
+            s_trace.order[thread][s_trace.orderCount[thread]++] = index;
+        }
+        VirtualFree(threadOf, 0, MEM_RELEASE);
+        VirtualFree(sorted, 0, MEM_RELEASE);
+
+        s_trace.heaps = (HANDLE*)allocate(s_trace.heapCount * sizeof(HANDLE));
+        s_trace.destroyed = (bool*)allocate(s_trace.heapCount * sizeof(bool));
+        for (UINT32 index = 0; index < s_trace.heapCount; index++)
+            s_trace.heaps[index] = HeapCreate(0, 0, 0);
+    }
+
+    UnmapViewOfFile(view);
+    CloseHandle(mapping);
+    CloseHandle(file);
+    return valid;
+}
+
+static volatile UINT s_sideA; // Written after each call, so that the branches
+static volatile UINT s_sideB; //   are neither tail calls nor folded together.
+
+static void branch (const replayop_t &op, slot_t &slot, UINT pattern, UINT depth);
+
+// branchA and branchB form the frames of the synthesized call stacks, as in
+// reportbench: each bit of a recorded stack's hash selects which of the two
+// a frame returns to.
+static __declspec(noinline) void branchA (const replayop_t &op, slot_t &slot, UINT pattern, UINT depth)
+{
+    branch(op, slot, pattern, depth);
+    s_sideA++;
+}
+
+static __declspec(noinline) void branchB (const replayop_t &op, slot_t &slot, UINT pattern, UINT depth)
+{
+    branch(op, slot, pattern, depth);
+    s_sideB += 3;
+}
+
+static void branch (const replayop_t &op, slot_t &slot, UINT pattern, UINT depth)
+{
+    if (depth != 0) {
+        if (pattern & 1)
+            branchA(op, slot, pattern >> 1, depth - 1);
+        else
+            branchB(op, slot, pattern >> 1, depth - 1);
+        return;
+    }
+
+    HANDLE heap = s_trace.heaps[slot.heap];
+    if (heap == NULL)
+        return; // Destroyed already.
+    switch (op.op) {
+    case VLDATRACE_ALLOC:
+        slot.mem = HeapAlloc(heap, 0, op.size);
+        break;
+
+    case VLDATRACE_FREE:
+        if (slot.mem != NULL)
+            HeapFree(heap, 0, slot.mem);
+        slot.mem = NULL;
+        break;
+
+    case VLDATRACE_REALLOC:
+        if (slot.mem != NULL) {
+            LPVOID mem = HeapReAlloc(heap, 0, slot.mem, op.size);
+            if (mem != NULL)
+                slot.mem = mem;
+        }
+        break;
+    }
+}
+
+// destroyHeap - Replays the destruction of a heap by the application.
+static void destroyHeap (UINT32 heap)
+{
+    if (s_trace.heaps[heap] == NULL)
+        return;
+    HeapDestroy(s_trace.heaps[heap]);
+    s_trace.heaps[heap] = NULL;
+}
+
+struct threadcontext_t {
+    UINT32 thread;
+    HANDLE start;
+};
+
+// replayThread - Makes one thread's calls. A call waits until the block's
+//   previous calls are made; since those were all recorded earlier, the
+//   earliest call not made yet can always go ahead.
+static unsigned __stdcall replayThread (LPVOID param)
+{
+    threadcontext_t *context = (threadcontext_t*)param;
+    WaitForSingleObject(context->start, INFINITE);
+    const UINT32 *order = s_trace.order[context->thread];
+    UINT32 count = s_trace.orderCount[context->thread];
+    for (UINT32 index = 0; index < count; index++) {
+        const replayop_t &op = s_trace.ops[order[index]];
+        if (op.op == VLDATRACE_HEAPDESTROY) {
+            s_trace.destroyed[op.slot] = true;
+            if (s_trace.threads == 1)
+                destroyHeap(op.slot);
+            continue;
+        }
+        slot_t &slot = s_trace.slots[op.slot];
+        for (UINT spins = 0; (UINT32)slot.turn != op.turn; spins++) {
+            if (spins < 64)
+                YieldProcessor();
+            else
+                SwitchToThread();
+        }
+        branch(op, slot, op.shape, STACK_DEPTH);
+        InterlockedIncrement(&slot.turn);
+    }
+    return 0;
+}
+
+static volatile BOOL s_sampling;
+static size_t s_peakMetadata; // Most bytes VLD used for its metadata at once.
+
+// sampleThread - Samples the memory VLD uses for its metadata until the
+//   replay is over.
+static unsigned __stdcall sampleThread (LPVOID)
+{
+    while (s_sampling) {
+        VLD_STATISTICS stats = { 0 };
+        VLDGetStatistics(&stats);
+        s_peakMetadata = max(s_peakMetadata, stats.privateHeapBytes + stats.metadataBytes);
+        Sleep(SAMPLE_INTERVAL);
+    }
+    return 0;
+}
+
+static double s_ticksPerMs; // Time stamp counter frequency.
+
+// calibrate - Measures the time stamp counter frequency against the
+//   performance counter.
+static void calibrate ()
+{
+    LARGE_INTEGER frequency, begin, end;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&begin);
+    unsigned long long start = __rdtsc();
+    Sleep(200);
+    unsigned long long ticks = __rdtsc() - start;
+    QueryPerformanceCounter(&end);
+    s_ticksPerMs = (double)ticks * (double)frequency.QuadPart / (1e3 * (double)(end.QuadPart - begin.QuadPart));
+}
+
+static double ms (unsigned long long ticks)
+{
+    return (double)ticks / s_ticksPerMs;
+}
+
+static int runChild (const config_t &config, UINT threads, const char *path)
+{
+    if (!loadTrace(path, threads)) {
+        fprintf(stderr, "tracereplay: \"%s\" isn't a valid trace file\n", path);
+        return 1;
+    }
+    calibrate();
+
+    threadcontext_t contexts [MAX_THREADS];
+    HANDLE handles [MAX_THREADS];
+    HANDLE start = CreateEvent(NULL, TRUE, FALSE, NULL);
+    for (UINT32 thread = 0; thread < s_trace.threads; thread++) {
+        contexts[thread].thread = thread;
+        contexts[thread].start  = start;
+        handles[thread] = (HANDLE)_beginthreadex(NULL, 0, replayThread, &contexts[thread], 0, NULL);
+    }
+
+    // Give every thread time to reach the start line.
+    Sleep(50);
+
+    VLD_STATISTICS before, after;
+    VLDGetStatistics(&before);
+    s_peakMetadata = before.privateHeapBytes + before.metadataBytes;
+    s_sampling = TRUE;
+    HANDLE sampler = (HANDLE)_beginthreadex(NULL, 0, sampleThread, NULL, 0, NULL);
+
+    LARGE_INTEGER frequency, begin, end;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&begin);
+    SetEvent(start);
+    WaitForMultipleObjects(s_trace.threads, handles, TRUE, INFINITE);
+    if (s_trace.threads != 1) {
+        for (UINT32 heap = 0; heap < s_trace.heapCount; heap++) {
+            if (s_trace.destroyed[heap])
+                destroyHeap(heap);
+        }
+    }
+    QueryPerformanceCounter(&end);
+
+    s_sampling = FALSE;
+    WaitForSingleObject(sampler, INFINITE);
+    CloseHandle(sampler);
+    VLDGetStatistics(&after);
+    for (UINT32 thread = 0; thread < s_trace.threads; thread++)
+        CloseHandle(handles[thread]);
+    CloseHandle(start);
+
+    LARGE_INTEGER reportBegin, reportEnd;
+    QueryPerformanceCounter(&reportBegin);
+    UINT leaks = VLDReportLeaks();
+    QueryPerformanceCounter(&reportEnd);
+
+    double replayms = (double)(end.QuadPart - begin.QuadPart) * 1e3 / (double)frequency.QuadPart;
+    printf("%-8s %7u %10u %10.1f %10.2f %10.0f %12llu %10.1f %10.1f %8u\n", config.name, s_trace.threads,
+        s_trace.opCount, replayms, s_trace.opCount / (replayms * 1e3), s_peakMetadata / 1024.0,
+        after.lockAcquires - before.lockAcquires, ms(after.lockWaitTicks - before.lockWaitTicks),
+        (double)(reportEnd.QuadPart - reportBegin.QuadPart) * 1e3 / (double)frequency.QuadPart, leaks);
+    fflush(stdout);
+
+    // The leaks have been measured; they go with their heaps, so that the
+    // shutdown report is empty.
+    for (UINT32 heap = 0; heap < s_trace.heapCount; heap++)
+        destroyHeap(heap);
+    return 0;
+}
+
+// runConfig - Replays the trace in a child process, in a directory of its own
+//   holding the vld.ini for the configuration.
+static bool runConfig (UINT config, UINT threads, const char *path)
+{
+    char directory [MAX_PATH];
+    GetTempPathA(MAX_PATH, directory);
+    strcat_s(directory, "vld_tracereplay_");
+    strcat_s(directory, configs[config].name);
+    CreateDirectoryA(directory, NULL);
+
+    char inipath [MAX_PATH];
+    sprintf_s(inipath, "%s\\vld.ini", directory);
+    FILE *ini = NULL;
+    if (fopen_s(&ini, inipath, "wb") != 0)
+        return false;
+    fputs(configs[config].ini, ini);
+    fclose(ini);
+
+    char exepath [MAX_PATH];
+    GetModuleFileNameA(NULL, exepath, MAX_PATH);
+    char commandline [MAX_PATH * 3];
+    sprintf_s(commandline, "\"%s\" --child %u %u \"%s\"", exepath, config, threads, path);
+
+    STARTUPINFOA startup = { sizeof(startup) };
+    PROCESS_INFORMATION process;
+    if (!CreateProcessA(exepath, commandline, NULL, NULL, FALSE, 0, NULL, directory, &startup, &process))
+        return false;
+    WaitForSingleObject(process.hProcess, INFINITE);
+    DWORD exitcode = 1;
+    GetExitCodeProcess(process.hProcess, &exitcode);
+    CloseHandle(process.hThread);
+    CloseHandle(process.hProcess);
+    return exitcode == 0;
+}
+
+int main (int argc, char **argv)
+{
+    if ((argc == 5) && (strcmp(argv[1], "--child") == 0)) {
+        UINT config = (UINT)atoi(argv[2]);
+        if (config >= _countof(configs))
+            return 1;
+        return runChild(configs[config], (UINT)atoi(argv[3]), argv[4]);
+    }
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: tracereplay tracefile [threads]\n");
+        return 1;
+    }
+    // The children run in other directories.
+    char path [MAX_PATH];
+    if (GetFullPathNameA(argv[1], MAX_PATH, path, NULL) == 0)
+        return 1;
+    UINT threads = (argc > 2) ? (UINT)atoi(argv[2]) : MAX_THREADS;
+    threads = min(max(threads, 1u), MAX_THREADS);
+
+    printf("%-8s %7s %10s %10s %10s %10s %12s %10s %10s %8s\n", "config", "threads", "calls", "replay ms",
+        "Mcalls/s", "peak KB", "lock enters", "lock ms", "report ms", "leaks");
+    fflush(stdout);
+
+    int failures = 0;
+    for (UINT config = 0; config < _countof(configs); config++) {
+        if (!runConfig(config, threads, path)) {
+            fprintf(stderr, "tracereplay: the \"%s\" configuration failed to run\n", configs[config].name);
+            failures++;
+        }
+    }
+    return failures;
+}
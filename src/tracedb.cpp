@@ -0,0 +1,192 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Stack Trace Database Call Stacks
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// With "StackWalkMethod = ntdb", VLD captures no call stacks of its own. When
+// the user-mode stack trace database is enabled for the program (gflags /i
+// program.exe +ust), the NT heap records a call stack for each block itself,
+// and keeps its index in the block's heap entry. Before a report, VLD reads
+// the heap entries and the database through RtlQueryProcessDebugInformation,
+// and gives the blocks which have no call stack yet the call stack the
+// database has for them. So the capture is paid for by the heap, and VLD only
+// creates the call stacks of the blocks which are still allocated when a
+// report is made.
+//
+// The heap entries don't give the addresses of the blocks. They are listed in
+// address order though, as HeapWalk lists the blocks, so the busy entries are
+// matched with the busy blocks HeapWalk finds, one for one, for as long as
+// their sizes agree.
+
+#include "stdafx.h"
+#define VLDBUILD
+#include "vldheap.h"    // Provides internal new and delete operators.
+#include "vldint.h"     // Provides access to VLD internals.
+
+// Imported global variables.
+extern HANDLE         g_vldHeap;
+extern HeapMapLock    g_heapMapLock;
+extern CallStackTable g_callStackTable;
+
+// heapInformationSize - Works out the size of the heap information records
+//   in the query buffer. It grew by a 64-bit field in Windows 11, so both
+//   sizes are tried: with the right one, every record is of a heap of the
+//   process.
+//
+//  - heaps (IN): The heaps of the query buffer.
+//
+//  - current (IN): The handles of the heaps of the process.
+//
+//  Return Value:
+//
+//    Returns the size of the records, or 0 if neither size fits.
+//
+static SIZE_T heapInformationSize (const rtlprocessheaps_t *heaps, const HashMap<HANDLE, HANDLE> &current)
+{
+    static const SIZE_T sizes [] = { sizeof(rtlheapinformation_t), sizeof(rtlheapinformation_t) + sizeof(ULONG64) };
+    for (UINT32 index = 0; index < _countof(sizes); index++) {
+        bool fits = true;
+        for (ULONG heap = 0; (heap < heaps->numberOfHeaps) && fits; heap++) {
+            const rtlheapinformation_t *info = (const rtlheapinformation_t*)((const BYTE*)heaps->heaps + heap * sizes[index]);
+            fits = (current.find((HANDLE)info->baseAddress) != current.end());
+        }
+        if (fits)
+            return sizes[index];
+    }
+    return 0;
+}
+
+// attachTraceDatabaseStacks - Gives the blocks tracked without a call stack
+//   the call stacks the stack trace database recorded for them (see above).
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::attachTraceDatabaseStacks ()
+{
+    if ((RtlCreateQueryDebugBuffer == NULL) || (RtlQueryProcessDebugInformation == NULL) ||
+        (RtlDestroyQueryDebugBuffer == NULL))
+        return;
+
+    flushAllPendingBlocks();
+    rtldebuginformation_t *buffer = RtlCreateQueryDebugBuffer(0, FALSE);
+    if (buffer == NULL)
+        return;
+    NTSTATUS status = RtlQueryProcessDebugInformation((HANDLE)(UINT_PTR)GetCurrentProcessId(),
+        RTL_QUERY_PROCESS_BACKTRACES | RTL_QUERY_PROCESS_HEAP_SUMMARY | RTL_QUERY_PROCESS_HEAP_ENTRIES, buffer);
+    if ((status < 0) || (buffer->backTraces == NULL) || (buffer->backTraces->numberOfBackTraces == 0) ||
+        (buffer->heaps == NULL)) {
+        if (!m_traceDatabaseWarned) {
+            Report(L"WARNING: Visual Leak Detector: The user-mode stack trace database isn't enabled; leaks have\n"
+                L"    no call stacks (enable it with \"gflags /i <program>.exe +ust\").\n");
+            m_traceDatabaseWarned = true;
+        }
+        RtlDestroyQueryDebugBuffer(buffer);
+        return;
+    }
+
+    // The database's entries, by index. The HashMap reserves keys 0 and 1.
+    HashMap<UINT_PTR, const rtlbacktraceinformation_t*> traces;
+    const rtlprocessbacktraces_t *backtraces = buffer->backTraces;
+    for (ULONG index = 0; index < backtraces->numberOfBackTraces; index++) {
+        const rtlbacktraceinformation_t *trace = &backtraces->backTraces[index];
+        traces.insert((UINT_PTR)trace->index + 2, trace);
+    }
+
+    DWORD count = GetProcessHeaps(0, NULL);
+    HANDLE *handles = new HANDLE [count + 1];
+    count = GetProcessHeaps(count + 1, handles);
+    HashMap<HANDLE, HANDLE> current;
+    for (DWORD index = 0; index < count; index++)
+        current.insert(handles[index], handles[index]);
+    delete [] handles;
+    SIZE_T infosize = heapInformationSize(buffer->heaps, current);
+
+    // The call stacks created so far, by database index.
+    HashMap<UINT_PTR, CallStack*> stacks;
+    UINT_PTR frames [RTL_BACKTRACE_DEPTH];
+    for (ULONG heap = 0; (infosize != 0) && (heap < buffer->heaps->numberOfHeaps); heap++) {
+        const rtlheapinformation_t *info = (const rtlheapinformation_t*)((const BYTE*)buffer->heaps->heaps + heap * infosize);
+        HANDLE handle = (HANDLE)info->baseAddress;
+        if ((handle == g_vldHeap) || (info->entries == NULL))
+            continue;
+        {
+            CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+            if (m_heapMap->find(handle) == m_heapMap->end())
+                continue;
+        }
+
+        // Match the busy entries with the busy blocks.
+        HashMap<LPCVOID, UINT_PTR> indices;
+        ULONG entry = 0;
+        if (HeapLock(handle)) {
+            PROCESS_HEAP_ENTRY block;
+            block.lpData = NULL;
+            while (HeapWalk(handle, &block)) {
+                if (!(block.wFlags & PROCESS_HEAP_ENTRY_BUSY) || (block.lpData == NULL))
+                    continue;
+                while ((entry < info->numberOfEntries) && ((info->entries[entry].flags &
+                    (RTL_HEAP_BUSY | RTL_HEAP_SEGMENT | RTL_HEAP_UNCOMMITTED_RANGE)) != RTL_HEAP_BUSY))
+                    entry++;
+                if ((entry == info->numberOfEntries) || (info->entries[entry].size != block.cbData))
+                    break;
+                if (info->entries[entry].allocatorBackTraceIndex != 0)
+                    indices.insert(block.lpData, info->entries[entry].allocatorBackTraceIndex);
+                entry++;
+            }
+            HeapUnlock(handle);
+        }
+
+        CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+        HeapMap::Iterator heapit = m_heapMap->find(handle);
+        if (heapit == m_heapMap->end())
+            continue;
+        BlockMap *blockmap = &(*heapit).second->blockMap;
+        for (HashMap<LPCVOID, UINT_PTR>::Iterator it = indices.begin(); it != indices.end(); ++it) {
+            BlockMap::Iterator blockit = blockmap->find((*it).first);
+            if ((blockit == blockmap->end()) || (*blockit).second->callStack)
+                continue;
+            HashMap<UINT_PTR, const rtlbacktraceinformation_t*>::Iterator traceit = traces.find((*it).second + 2);
+            if (traceit == traces.end())
+                continue;
+
+            // Each block holds a reference on its call stack.
+            CallStack *callstack;
+            HashMap<UINT_PTR, CallStack*>::Iterator stackit = stacks.find((*it).second + 2);
+            if (stackit != stacks.end()) {
+                callstack = (*stackit).second;
+                g_callStackTable.AddRef(callstack);
+            }
+            else {
+                // Hashed as CallStack hashes the frames it captures itself.
+                const rtlbacktraceinformation_t *trace = (*traceit).second;
+                UINT32 depth = min((UINT32)trace->depth, min(m_capturePolicy->maxTraceFrames, (UINT32)RTL_BACKTRACE_DEPTH));
+                for (UINT32 frame = 0; frame < depth; frame++)
+                    frames[frame] = (UINT_PTR)trace->backTrace[frame];
+                callstack = g_callStackTable.Intern(CallStack::Create(frames, depth, CalculateCRC32(frames, depth)));
+                stacks.insert((*it).second + 2, callstack);
+            }
+            (*blockit).second->callStack.reset(callstack);
+        }
+    }
+    RtlDestroyQueryDebugBuffer(buffer);
+}
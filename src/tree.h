@@ -33,6 +33,11 @@ Applications should never include this header."
 #include "criticalsection.h"
 
 #define TREE_DEFAULT_RESERVE 32 // By default, trees reserve enough space, in advance, for this many nodes.
+#define TREE_MAX_CHUNK     4096 // Chunks grow geometrically from the reserve size up to this many nodes.
+
+// The profile every Tree's lock counts into, with the LockProfiling option.
+// Only the trees created after the option is read are profiled.
+__declspec(selectany) lockprofile_t *g_treeLockProfile = NULL;
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -51,7 +56,11 @@ Applications should never include this header."
 //    an STL-like interface so that it can be used as the backend for STL-like
 //    container classes.
 //
-template <typename T>
+//    Every operation enters the tree's own lock, of type Lock. Trees which are
+//    only ever accessed under some other lock use NoLock instead, so they
+//    don't pay for a second critical section, nor carry one.
+//
+template <typename T, typename Lock = CriticalSection>
 class Tree
 {
 public:
@@ -78,6 +87,7 @@ public:
     struct chunk_t {
         struct chunk_t *next;  // Pointer to the next node in the chunk list.
         node_t         *nodes; // Pointer to an array (of variable size) where nodes are stored.
+        size_t          count; // Number of nodes in the array.
     };
 
     // Constructor
@@ -85,12 +95,16 @@ public:
     {
         m_freelist   = NULL;
         m_lock.Initialize();
+        m_lock.Profile(g_treeLockProfile);
         m_nil.color  = black;
         m_nil.key    = T();
         m_nil.left   = &m_nil;
         m_nil.parent = &m_nil;
         m_nil.right  = &m_nil;
         m_reserve    = TREE_DEFAULT_RESERVE;
+        m_chunk      = TREE_DEFAULT_RESERVE;
+        m_size       = 0;
+        m_capacity   = 0;
         m_root       = &m_nil;
         m_store      = NULL;
         m_storetail  = NULL;
@@ -98,7 +112,7 @@ public:
 
     // Copy constructor - The sole purpose of this constructor's existence is
     //   to ensure that trees are not being inadvertently copied.
-    Tree<T> (const Tree<T>& source)
+    Tree (const Tree& source)
     {
         assert(FALSE); // Do not make copies of trees!
     }
@@ -128,7 +142,7 @@ public:
     //   should be performed). The sole purpose of this assignment operator is
     //   to ensure that no copying is being done inadvertently.
     //
-    Tree<T>& operator = (const Tree<T> &other)
+    Tree& operator = (const Tree &other)
     {
         // Don't make copies of Trees!
         assert(FALSE);
@@ -146,7 +160,7 @@ public:
     {
         node_t *cur;
 
-        CriticalSectionLocker<> cs(m_lock);
+        CriticalSectionLocker<Lock> cs(m_lock);
         if (m_root == &m_nil) {
             return NULL;
         }
@@ -177,7 +191,7 @@ public:
         node_t *erasure;
         node_t *sibling;
 
-        CriticalSectionLocker<> cs(m_lock);
+        CriticalSectionLocker<Lock> cs(m_lock);
 
         if ((node->left == &m_nil) || (node->right == &m_nil)) {
             // The node to be erased has less than two children. It can be directly
@@ -297,6 +311,7 @@ public:
         // Put the erased node onto the free list.
         erasure->next = m_freelist;
         m_freelist = erasure;
+        m_size--;
     }
 
     // erase - Erases the specified key from the tree. Note that this does
@@ -317,7 +332,7 @@ public:
         node_t *node;
 
         // Find the node to erase.
-        CriticalSectionLocker<> cs(m_lock);
+        CriticalSectionLocker<Lock> cs(m_lock);
         node = m_root;
         while (node != &m_nil) {
             if (node->key < key) {
@@ -353,7 +368,7 @@ public:
     {
         node_t *cur;
 
-        CriticalSectionLocker<> cs(m_lock);
+        CriticalSectionLocker<Lock> cs(m_lock);
         cur = m_root;
         while (cur != &m_nil) {
             if (cur->key < key) {
@@ -374,6 +389,38 @@ public:
         return NULL;
     }
 
+    // floor - Obtains a pointer to the node with the greatest key which isn't
+    //   greater than the specified key.
+    //
+    //  - key (IN): The value to search for in the tree.
+    //
+    //  Return Value:
+    //
+    //    Returns a pointer to the node found. If every key in the tree is
+    //    greater than 'key', then "floor" returns NULL.
+    //
+    typename Tree::node_t* floor (const T &key) const
+    {
+        node_t *cur;
+        node_t *found = NULL;
+
+        CriticalSectionLocker<Lock> cs(m_lock);
+        cur = m_root;
+        while (cur != &m_nil) {
+            if (key < cur->key) {
+                // Go left.
+                cur = cur->left;
+            }
+            else {
+                // This node is a candidate; a greater one may lie to the right.
+                found = cur;
+                cur = cur->right;
+            }
+        }
+
+        return found;
+    }
+
     // insert - Inserts a new key into the tree.
     //
     //  - key (IN): The key to insert into the tree. This value is treated as
@@ -388,7 +435,27 @@ public:
     //
     typename Tree::node_t* insert (const T &key)
     {
-        CriticalSectionLocker<> cs(m_lock);
+        bool inserted;
+        node_t *node = insert(key, inserted);
+        return inserted ? node : NULL;
+    }
+
+    // insert - Inserts a new key into the tree, unless an equal key is in the
+    //   tree already. Either way, the tree is only descended once.
+    //
+    //  - key (IN): The key to insert into the tree.
+    //
+    //  - inserted (OUT): Set to true if the key has been inserted, or to false
+    //      if an equal key was found.
+    //
+    //  Return Value:
+    //
+    //    Returns a pointer to the node of the newly inserted key, or to that
+    //    of the equal key which was already in the tree.
+    //
+    typename Tree::node_t* insert (const T &key, bool &inserted)
+    {
+        CriticalSectionLocker<Lock> cs(m_lock);
 
         // Find the location where the new node should be inserted..
         node_t  *cur = m_root;
@@ -405,17 +472,22 @@ public:
             }
             else {
                 // Keys in the tree must be unique.
-                return NULL;
+                inserted = false;
+                return cur;
             }
         }
 
         // Obtain a new node from the free list.
         if (m_freelist == NULL) {
-            // Allocate additional storage.
-            reserve(m_reserve);
+            // Allocate additional storage. Each chunk is twice the size of
+            // the previous one, so a big tree has few chunks.
+            _grow(m_chunk);
+            if (m_chunk < TREE_MAX_CHUNK)
+                m_chunk = (m_chunk * 2 < TREE_MAX_CHUNK) ? m_chunk * 2 : TREE_MAX_CHUNK;
         }
         node_t  *node = m_freelist;
         m_freelist = m_freelist->next;
+        m_size++;
 
         // Initialize the new node and insert it.
         node->color  = red;
@@ -489,6 +561,7 @@ public:
 
         // The root node is always colored black.
         m_root->color = black;
+        inserted = true;
         return node;
     }
 
@@ -508,7 +581,7 @@ public:
         if (node == NULL)
             return NULL;
 
-        CriticalSectionLocker<> cs(m_lock);
+        CriticalSectionLocker<Lock> cs(m_lock);
         node_t* cur;
         if (node->right != &m_nil) {
             // 'node' has a right child. Successor is the far left node in
@@ -567,7 +640,7 @@ public:
             return NULL;
         }
 
-        CriticalSectionLocker<> cs(m_lock);
+        CriticalSectionLocker<Lock> cs(m_lock);
         node_t* cur;
         if (node->left != &m_nil) {
             // 'node' has left child. Predecessor is the far right node in the
@@ -628,10 +701,9 @@ public:
     //
     size_t reserve (size_t count)
     {
-        chunk_t *chunk;
-        size_t   index;
         size_t   oldreserve = m_reserve;
 
+        CriticalSectionLocker<Lock> cs(m_lock);
         if (count != m_reserve) {
             if (count < 1) {
                 // Minimum reserve size is 1.
@@ -640,35 +712,137 @@ public:
             else {
                 m_reserve = count;
             }
+            m_chunk = m_reserve;
         }
 
-        CriticalSectionLocker<> cs(m_lock);
         if (m_freelist == NULL) {
             // Allocate additional storage.
-            // Link a new chunk into the chunk list.
-            chunk = new Tree::chunk_t;
-            chunk->nodes = new Tree::node_t [m_reserve];
-            chunk->next = NULL;
-            if (m_store == NULL) {
-                m_store = chunk;
-            }
-            else {
-                m_storetail->next = chunk;
-            }
-            m_storetail = chunk;
-
-            // Link the individual nodes together to form a new free list.
-            for (index = 0; index < m_reserve - 1; index++) {
-                chunk->nodes[index].next = &chunk->nodes[index + 1];
-            }
-            chunk->nodes[index].next = NULL;
-            m_freelist = chunk->nodes;
+            _grow(m_reserve);
         }
 
         return oldreserve;
     }
 
+    // compact - Moves every node into a single chunk just large enough for
+    //   the tree (or the reserve size, if that's larger) and frees all the
+    //   other chunks, so that storage left over by a burst of inserts is
+    //   given back. The nodes are laid out in depth-first order.
+    //
+    //  Note: Compacting moves the nodes, so every node pointer and Iterator
+    //    into the tree is invalidated. The caller must make sure none is in
+    //    use, which for trees without a lock of their own means holding the
+    //    lock which serializes their accesses.
+    //
+    //  Return Value:
+    //
+    //    Returns the number of nodes' worth of storage freed.
+    //
+    size_t compact ()
+    {
+        CriticalSectionLocker<Lock> cs(m_lock);
+        size_t count = (m_size > m_reserve) ? m_size : m_reserve;
+        if ((m_store == NULL) || (m_capacity <= count))
+            return 0;
+
+        chunk_t *oldstore = m_store;
+        size_t   oldcapacity = m_capacity;
+        m_store      = NULL;
+        m_storetail  = NULL;
+        m_freelist   = NULL;
+        m_capacity   = 0;
+        if (m_size != 0) {
+            _grow(count);
+            m_root = _copy(m_root, &m_nil);
+        }
+        // Growth picks up where a tree of this size would be.
+        m_chunk = m_reserve;
+        while ((m_chunk < TREE_MAX_CHUNK) && (m_chunk * 2 <= count))
+            m_chunk *= 2;
+
+        while (oldstore != NULL) {
+            chunk_t *chunk = oldstore;
+            oldstore = oldstore->next;
+            delete [] chunk->nodes;
+            delete chunk;
+        }
+        return oldcapacity - m_capacity;
+    }
+
+    // size - Returns the number of keys in the tree.
+    size_t size () const
+    {
+        return m_size;
+    }
+
+    // capacity - Returns the number of nodes the tree has storage for.
+    size_t capacity () const
+    {
+        return m_capacity;
+    }
+
 private:
+    // _copy - Copies a subtree into nodes taken from the free list, for
+    //   compact.
+    //
+    //  - node (IN): Pointer to the root of the subtree to copy.
+    //
+    //  - parent (IN): Pointer to the copy's parent.
+    //
+    //  Return Value:
+    //
+    //    Returns a pointer to the copy of the subtree's root.
+    //
+    typename Tree::node_t* _copy (typename Tree::node_t *node, typename Tree::node_t *parent)
+    {
+        if (node == &m_nil)
+            return &m_nil;
+
+        node_t *copy = m_freelist;
+        m_freelist = m_freelist->next;
+        copy->color  = node->color;
+        copy->key    = node->key;
+        copy->parent = parent;
+        copy->left   = _copy(node->left, copy);
+        copy->right  = _copy(node->right, copy);
+        return copy;
+    }
+
+    // _grow - Links a new chunk of nodes into the chunk list and onto the free
+    //   list. The caller must hold the tree's lock.
+    //
+    //  - count (IN): The number of nodes in the new chunk.
+    //
+    //  Return Value:
+    //
+    //    None.
+    //
+    VOID _grow (size_t count)
+    {
+        chunk_t *chunk;
+        size_t   index;
+
+        // Link a new chunk into the chunk list.
+        chunk = new Tree::chunk_t;
+        chunk->nodes = new Tree::node_t [count];
+        chunk->count = count;
+        chunk->next = NULL;
+        if (m_store == NULL) {
+            m_store = chunk;
+        }
+        else {
+            m_storetail->next = chunk;
+        }
+        m_storetail = chunk;
+        m_capacity += count;
+
+        // Link the individual nodes together to form a new free list.
+        for (index = 0; index < count - 1; index++) {
+            chunk->nodes[index].next = &chunk->nodes[index + 1];
+        }
+        chunk->nodes[index].next = m_freelist;
+        m_freelist = chunk->nodes;
+    }
+
     // _rotateleft: Rotates a pair of nodes counter-clockwise so that the parent
     //   node becomes the left child and the right child becomes the parent.
     //
@@ -747,9 +921,12 @@ private:
 
     // Private data members.
     node_t                   *m_freelist;  // Pointer to the list of free nodes (reserve storage).
-    mutable CriticalSection   m_lock;      // Protects the tree's integrity against concurrent accesses.
+    mutable Lock              m_lock;      // Protects the tree's integrity against concurrent accesses.
     node_t                    m_nil;       // The tree's nil node. All leaf nodes point to this.
-    size_t                    m_reserve;   // The size (in nodes) of the chunks of reserve storage.
+    size_t                    m_reserve;   // The size (in nodes) of the first chunk of reserve storage.
+    size_t                    m_chunk;     // The size (in nodes) of the next chunk, doubling up to TREE_MAX_CHUNK.
+    size_t                    m_size;      // The number of nodes in the tree.
+    size_t                    m_capacity;  // The number of nodes in all the chunks.
     node_t                   *m_root;      // Pointer to the tree's root node.
     chunk_t                  *m_store;     // Pointer to the start of the chunk list.
     chunk_t                  *m_storetail; // Pointer to the end of the chunk list.
@@ -26,8 +26,10 @@
 #include "utility.h"    // Provides various utility functions and macros.
 #include "vldheap.h"    // Provides internal new and delete operators.
 #include "vldint.h"
+#include "gzipstream.h" // Provides compression of report files.
 #include <tchar.h>
 #include <string.h>
+#include <nmmintrin.h> // Provides the SSE4.2 crc32 intrinsics.
 
 //#define PRINTHOOKINFO
 
@@ -38,13 +40,89 @@ extern ImageDirectoryEntries g_Ide;
 
 // Global variables.
 static BOOL         s_reportDelay = FALSE;     // If TRUE, we sleep for a bit after calling OutputDebugString to give the debugger time to catch up.
-static FILE        *s_reportFile = NULL;       // Pointer to the file, if any, to send the memory leak report to.
+static size_t       s_reportDelayChars = 0;    // Characters sent to the debugger that haven't been slept for yet.
+static FileStream  *s_reportFile = NULL;       // Pointer to the file, if any, to send the memory leak report to.
 static BOOL         s_reportToDebugger = TRUE; // If TRUE, a copy of the memory leak report will be sent to the debugger for display.
 static BOOL         s_reportToStdOut = TRUE;   // If TRUE, a copy of the memory leak report will be sent to standard output.
 static encoding_e   s_reportEncoding = ascii;  // Output encoding of the memory leak report.
+static GzipStream   s_reportCompressor;        // Compresses the report file, if it is open.
+static HANDLE       s_reportPipe = NULL;       // Named pipe, if any, the report is streamed to instead of a file.
+static HANDLE       s_reportPipeEvent = NULL;  // Signaled when a write to the pipe completes.
+static BOOL         s_reportPipeBroken = FALSE; // If TRUE, the pipe's reader has gone; nothing more is written to it.
+static BOOL         s_reportPipeStalled = FALSE; // If TRUE, the last write to the pipe timed out.
+static UINT64       s_reportPipeDropped = 0;   // Bytes of report text dropped because the pipe wasn't read in time.
+
+// Report buffering. Once the report writer is started, Print appends to the
+// active buffer and the writer thread writes full (or, periodically, partial)
+// buffers out in one go while the other buffer is being filled.
+static CriticalSection s_reportLock;                                  // Protects the buffer state below.
+static WCHAR        s_reportBuffers [2][REPORTBUFFERLENGTH + 1];      // Double buffered report text.
+static size_t       s_reportLengths [2];                              // Characters stored in each buffer.
+static UINT         s_reportActive = 0;                               // Index of the buffer Print appends to.
+static BOOL         s_reportInFlight = FALSE;                         // If TRUE, the other buffer is waiting to be, or being, written.
+static BOOL         s_reportBuffered = FALSE;                         // If TRUE, Print buffers its output.
+static volatile BOOL s_reportStop = FALSE;                            // If TRUE, the writer thread should exit.
+static HANDLE       s_reportWriter = NULL;                            // The writer thread, if running.
+static DWORD        s_reportWriterId = 0;                             // Thread ID of the writer thread.
+static HANDLE       s_reportWake = NULL;                              // Wakes the writer thread up early.
+static HANDLE       s_reportDone = NULL;                              // Signaled whenever no buffer is in flight.
+static DWORD        s_captureIndex = TLS_OUT_OF_INDEXES;              // TLS slot holding each thread's report capture, once allocated.
+static volatile LONG s_captures = 0;                                  // Number of threads capturing their report text.
+static volatile LONG64 s_prints = 0;                                  // Number of messages printed.
+static volatile LONG64 s_printTicks = 0;                              // Time stamp counter ticks spent printing them.
 
 #define IS_ORDINAL(name) (((UINT_PTR)name & 0xFFFF) == ((UINT_PTR)name))
 
+// A memory dump line is "    ", the hex column, "    ", the character column
+// and a line break. Dump lines are rendered into one buffer, and printed
+// DUMPLINESPERPRINT lines at a time (a whole dump, at the default MaxDataDump).
+#define DUMPLINELENGTH    (4 + (HEXDUMPLINELENGTH - 1) + 4 + 17 + 1)
+#define DUMPLINESPERPRINT 32
+
+static const WCHAR s_hexDigits [] = L"0123456789ABCDEF";
+
+// dumpHex - Renders the hex column of one line of a memory dump: 16 bytes as
+//   "XX ", with a 3-character space after every 4 bytes. Bytes past the end of
+//   the region are rendered as spaces.
+//
+//  - out (IN): Receives the column (HEXDUMPLINELENGTH - 1 characters).
+//
+//  - bytes (IN): The bytes of the line.
+//
+//  - count (IN): Number of bytes in the line, up to 16.
+//
+//  Return Value:
+//
+//    Returns the end of the column.
+//
+static LPWSTR dumpHex (LPWSTR out, const BYTE *bytes, SIZE_T count)
+{
+    for (SIZE_T index = 0; index < 16; index++) {
+        if (index < count) {
+            out[0] = s_hexDigits[bytes[index] >> 4];
+            out[1] = s_hexDigits[bytes[index] & 0xF];
+        }
+        else {
+            out[0] = out[1] = L' ';
+        }
+        out[2] = L' ';
+        out += 3;
+        if (((index % 4) == 3) && (index != 15)) {
+            out[0] = out[1] = out[2] = L' ';
+            out += 3;
+        }
+    }
+    return out;
+}
+
+// dumpSpaces - Renders the 4-character space which starts a memory dump line
+//   and separates its columns.
+static LPWSTR dumpSpaces (LPWSTR out)
+{
+    out[0] = out[1] = out[2] = out[3] = L' ';
+    return out + 4;
+}
+
 // DumpMemoryA - Dumps a nicely formatted rendition of a region of memory.
 //   Includes both the hex value of each byte and its ASCII equivalent (if
 //   printable).
@@ -59,59 +137,32 @@ static encoding_e   s_reportEncoding = ascii;  // Output encoding of the memory
 //
 VOID DumpMemoryA (LPCVOID address, SIZE_T size)
 {
-    // Each line of output is 16 bytes.
-    SIZE_T dumpLen;
-    if ((size % 16) == 0) {
-        // No padding needed.
-        dumpLen = size;
-    }
-    else {
-        // We'll need to pad the last line out to 16 bytes.
-        dumpLen = size + (16 - (size % 16));
-    }
-
-    // For each byte of data, get both the ASCII equivalent (if it is a
-    // printable character) and the hex representation.
-    SIZE_T bytesDone = 0;
-    WCHAR  hexDump [HEXDUMPLINELENGTH] = {0};
-    WCHAR  ascDump [18] = {0};
-    WCHAR  formatBuf [BYTEFORMATBUFFERLENGTH];
-    for (SIZE_T byteIndex = 0; byteIndex < dumpLen; byteIndex++) {
-        SIZE_T wordIndex = byteIndex % 16;
-        SIZE_T hexIndex = 3 * (wordIndex + (wordIndex / 4)); // 3 characters per byte, plus a 3-character space after every 4 bytes.
-        SIZE_T ascIndex = wordIndex + wordIndex / 8;         // 1 character per byte, plus a 1-character space after every 8 bytes.
-        if (byteIndex < size) {
-            BYTE byte = ((PBYTE)address)[byteIndex];
-            _snwprintf_s(formatBuf, BYTEFORMATBUFFERLENGTH, _TRUNCATE, L"%.2X ", byte);
-            formatBuf[3] = '\0';
-            wcsncpy_s(hexDump + hexIndex, HEXDUMPLINELENGTH - hexIndex, formatBuf, 4);
-            if (isgraph(byte)) {
-                ascDump[ascIndex] = (WCHAR)byte;
-            }
-            else {
-                ascDump[ascIndex] = L'.';
-            }
+    // Each line of output is 16 bytes; the last one is padded out.
+    const BYTE *bytes = (const BYTE*)address;
+    WCHAR  dump [DUMPLINESPERPRINT * DUMPLINELENGTH + 1];
+    LPWSTR out = dump;
+    UINT   lines = 0;
+    for (SIZE_T offset = 0; offset < size; offset += 16) {
+        SIZE_T count = min(size - offset, 16);
+        out = dumpSpaces(out);
+        out = dumpHex(out, bytes + offset, count);
+        out = dumpSpaces(out);
+
+        // The printable (graphic, in the C locale) ASCII characters, with a
+        // space after 8 bytes.
+        for (SIZE_T index = 0; index < 16; index++) {
+            if (index == 8)
+                *out++ = L' ';
+            BYTE byte = (index < count) ? bytes[offset + index] : 0;
+            *out++ = ((byte > 0x20) && (byte < 0x7F)) ? (WCHAR)byte : L'.';
         }
-        else {
-            // Add padding to fill out the last line to 16 bytes.
-            wcsncpy_s(hexDump + hexIndex, HEXDUMPLINELENGTH - hexIndex, L"   ", 4);
-            ascDump[ascIndex] = L'.';
-        }
-        bytesDone++;
-        if ((bytesDone % 16) == 0) {
-            // Print one line of data for every 16 bytes. Include the
-            // ASCII dump and the hex dump side-by-side.
-            Report(L"    %s    %s\n", hexDump, ascDump);
-        }
-        else {
-            if ((bytesDone % 8) == 0) {
-                // Add a spacer in the ASCII dump after every 8 bytes.
-                ascDump[ascIndex + 1] = L' ';
-            }
-            if ((bytesDone % 4) == 0) {
-                // Add a spacer in the hex dump after every 4 bytes.
-                wcsncpy_s(hexDump + hexIndex + 3, HEXDUMPLINELENGTH - hexIndex - 3, L"   ", 4);
-            }
+        *out++ = L'\n';
+
+        if ((++lines == DUMPLINESPERPRINT) || (offset + 16 >= size)) {
+            *out = L'\0';
+            Print(dump);
+            out = dump;
+            lines = 0;
         }
     }
 }
@@ -129,62 +180,32 @@ VOID DumpMemoryA (LPCVOID address, SIZE_T size)
 //
 VOID DumpMemoryW (LPCVOID address, SIZE_T size)
 {
-    // Each line of output is 16 bytes.
-    SIZE_T dumpLen;
-    if ((size % 16) == 0) {
-        // No padding needed.
-        dumpLen = size;
-    }
-    else {
-        // We'll need to pad the last line out to 16 bytes.
-        dumpLen = size + (16 - (size % 16));
-    }
-
-    // For each word of data, get both the Unicode equivalent and the hex
-    // representation.
-    WCHAR  formatBuf [BYTEFORMATBUFFERLENGTH];
-    WCHAR  hexDump [HEXDUMPLINELENGTH] = {0};
-    WCHAR  unidump [18] = {0};
-    SIZE_T bytesDone = 0;
-    for (SIZE_T byteIndex = 0; byteIndex < dumpLen; byteIndex++) {
-        SIZE_T hexIndex = 3 * ((byteIndex % 16) + ((byteIndex % 16) / 4));   // 3 characters per byte, plus a 3-character space after every 4 bytes.
-        SIZE_T uniIndex = ((byteIndex / 2) % 8) + ((byteIndex / 2) % 8) / 8; // 1 character every other byte, plus a 1-character space after every 8 bytes.
-        if (byteIndex < size) {
-            BYTE byte = ((PBYTE)address)[byteIndex];
-            _snwprintf_s(formatBuf, BYTEFORMATBUFFERLENGTH, _TRUNCATE, L"%.2X ", byte);
-            formatBuf[BYTEFORMATBUFFERLENGTH - 1] = '\0';
-            wcsncpy_s(hexDump + hexIndex, HEXDUMPLINELENGTH - hexIndex, formatBuf, 4);
-            if (((byteIndex % 2) == 0) && ((byteIndex + 1) < dumpLen)) {
-                // On every even byte, print one character.
-                WORD   word = ((PWORD)address)[byteIndex / 2];
-                if ((word == 0x0000) || (word == 0x0020)) {
-                    unidump[uniIndex] = L'.';
-                }
-                else {
-                    unidump[uniIndex] = word;
-                }
-            }
+    // Each line of output is 16 bytes; the last one is padded out.
+    const BYTE *bytes = (const BYTE*)address;
+    WCHAR  dump [DUMPLINESPERPRINT * DUMPLINELENGTH + 1];
+    LPWSTR out = dump;
+    UINT   lines = 0;
+    for (SIZE_T offset = 0; offset < size; offset += 16) {
+        SIZE_T count = min(size - offset, 16);
+        out = dumpSpaces(out);
+        out = dumpHex(out, bytes + offset, count);
+        out = dumpSpaces(out);
+
+        // One character per word. A trailing odd byte is shown with the byte
+        // that follows it, as a whole word.
+        for (SIZE_T index = 0; index < 16; index += 2) {
+            WORD word = 0;
+            if (index < count)
+                word = ((PWORD)address)[(offset + index) / 2];
+            *out++ = ((word == 0x0000) || (word == 0x0020)) ? L'.' : (WCHAR)word;
         }
-        else {
-            // Add padding to fill out the last line to 16 bytes.
-            wcsncpy_s(hexDump + hexIndex, HEXDUMPLINELENGTH - hexIndex, L"   ", 4);
-            unidump[uniIndex] = L'.';
-        }
-        bytesDone++;
-        if ((bytesDone % 16) == 0) {
-            // Print one line of data for every 16 bytes. Include the
-            // ASCII dump and the hex dump side-by-side.
-            Report(L"    %s    %s\n", hexDump, unidump);
-        }
-        else {
-            if ((bytesDone % 8) == 0) {
-                // Add a spacer in the ASCII dump after every 8 bytes.
-                unidump[uniIndex + 1] = L' ';
-            }
-            if ((bytesDone % 4) == 0) {
-                // Add a spacer in the hex dump after every 4 bytes.
-                wcsncpy_s(hexDump + hexIndex + 3, HEXDUMPLINELENGTH - hexIndex - 3, L"   ", 4);
-            }
+        *out++ = L'\n';
+
+        if ((++lines == DUMPLINESPERPRINT) || (offset + 16 >= size)) {
+            *out = L'\0';
+            Print(dump);
+            out = dump;
+            lines = 0;
         }
     }
 }
@@ -356,8 +377,10 @@ BOOL FindPatch (HMODULE importmodule, moduleentry_t *module)
     return FALSE;
 }
 
-// InsertReportDelay - Sets the report function to sleep for a bit after each
-//   call to OutputDebugString, in order to allow the debugger to catch up.
+// InsertReportDelay - Sets the report function to sleep for a bit as it calls
+//   OutputDebugString, in order to allow the debugger to catch up. The delay
+//   depends on the amount of text sent (see delayReport), not on the number
+//   of messages.
 //
 //  Return Value:
 //
@@ -752,66 +775,630 @@ int CallReportHook(int reportType, LPWSTR message, int* hook_retval)
     return 0;
 }
 
-// Print - Sends a message to the debugger for display
-//   and/or to a file.
+// encodeUtf8 - Converts report text from UTF-16 to UTF-8, independently of
+//   the locale. Runs of ASCII characters, which make up nearly all of a
+//   report, are converted 8 characters at a time. Unpaired surrogates are
+//   replaced by U+FFFD.
 //
-//   Note: A message longer than MAXREPORTLENGTH characters will be truncated
-//     to MAXREPORTLENGTH.
+//  - text (IN): The text to convert.
 //
-//  - ... (IN): Arguments to be formatted using the specified format string.
+//  - length (IN): Length of the text, in characters. Mustn't end in the
+//      middle of a surrogate pair, unless the text does.
+//
+//  - out (OUT): Receives the UTF-8 text, which isn't NUL-terminated. Must
+//      have room for 3 bytes per character.
+//
+//  Return Value:
+//
+//    Returns the length of the UTF-8 text, in bytes.
+//
+static size_t encodeUtf8 (LPCWSTR text, size_t length, CHAR *out)
+{
+#if defined(_M_IX86) || defined(_M_X64)
+    const __m128i nonascii = _mm_set1_epi16((short)0xFF80);
+#endif
+    CHAR   *start = out;
+    size_t  index = 0;
+    while (index < length) {
+#if defined(_M_IX86) || defined(_M_X64)
+        if (index + 8 <= length) {
+            __m128i chars = _mm_loadu_si128((const __m128i*)(text + index));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(chars, nonascii), _mm_setzero_si128())) == 0xFFFF) {
+                _mm_storel_epi64((__m128i*)out, _mm_packus_epi16(chars, chars));
+                out += 8;
+                index += 8;
+                continue;
+            }
+        }
+#endif
+
+        UINT32 c = text[index++];
+        if (c < 0x80) {
+            *out++ = (CHAR)c;
+            continue;
+        }
+        if (c < 0x800) {
+            *out++ = (CHAR)(0xC0 | (c >> 6));
+            *out++ = (CHAR)(0x80 | (c & 0x3F));
+            continue;
+        }
+        if ((c >= 0xD800) && (c <= 0xDFFF)) {
+            if ((c <= 0xDBFF) && (index < length) && (text[index] >= 0xDC00) && (text[index] <= 0xDFFF)) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (text[index++] - 0xDC00);
+                *out++ = (CHAR)(0xF0 | (c >> 18));
+                *out++ = (CHAR)(0x80 | ((c >> 12) & 0x3F));
+                *out++ = (CHAR)(0x80 | ((c >> 6) & 0x3F));
+                *out++ = (CHAR)(0x80 | (c & 0x3F));
+                continue;
+            }
+            c = 0xFFFD;
+        }
+        *out++ = (CHAR)(0xE0 | (c >> 12));
+        *out++ = (CHAR)(0x80 | ((c >> 6) & 0x3F));
+        *out++ = (CHAR)(0x80 | (c & 0x3F));
+    }
+    return out - start;
+}
+
+// writeReportPipe - Writes encoded report text to the report pipe. The
+//   pipe's reader sets the pace: a write it doesn't take within
+//   REPORTPIPETIMEOUT milliseconds is cancelled and its text dropped, and
+//   while the reader lags behind, only what fits in the pipe right away is
+//   written. The program is never held up for long by a slow reader, at the
+//   cost of gaps in the text it receives.
+//
+//  - data (IN): The encoded text.
+//
+//  - size (IN): Size of the encoded text, in bytes.
 //
 //  Return Value:
 //
 //    None.
 //
-VOID Print (LPWSTR messagew)
+static VOID writeReportPipe (LPCVOID data, size_t size)
 {
-    if (NULL == messagew)
+    if (s_reportPipeBroken) {
+        s_reportPipeDropped += size;
         return;
+    }
 
-    int hook_retval=0;
-    if (!CallReportHook(0, messagew, &hook_retval))
-    {
-        if (s_reportEncoding == unicode) {
-            if (s_reportFile != NULL) {
+    OVERLAPPED overlapped = { 0 };
+    overlapped.hEvent = s_reportPipeEvent;
+    DWORD written = 0;
+    if (!WriteFile(s_reportPipe, data, (DWORD)size, NULL, &overlapped) && (GetLastError() != ERROR_IO_PENDING)) {
+        // The reader has closed its end.
+        s_reportPipeBroken = TRUE;
+    }
+    else {
+        DWORD timeout = s_reportPipeStalled ? 0 : REPORTPIPETIMEOUT;
+        s_reportPipeStalled = (WaitForSingleObject(s_reportPipeEvent, timeout) == WAIT_TIMEOUT);
+        if (s_reportPipeStalled)
+            CancelIoEx(s_reportPipe, &overlapped);
+        if (!GetOverlappedResult(s_reportPipe, &overlapped, &written, TRUE) &&
+            (GetLastError() != ERROR_OPERATION_ABORTED))
+            s_reportPipeBroken = TRUE;
+    }
+    s_reportPipeDropped += size - written;
+}
+
+// writeReportFile - Writes encoded report text to the report file, through
+//   the compressor if the file is compressed.
+//
+//  - data (IN): The encoded text.
+//
+//  - size (IN): Size of the encoded text, in bytes.
+//
+//  Return Value:
+//
+//    None.
+//
+static VOID writeReportFile (LPCVOID data, size_t size)
+{
+    if (s_reportPipe != NULL)
+        writeReportPipe(data, size);
+    else if (s_reportCompressor.IsOpen())
+        s_reportCompressor.Write(data, size);
+    else
+        s_reportFile->Write(data, size);
+}
+
+// delayReport - Sleeps, if the debugger has to be given time to catch up
+//   (see InsertReportDelay), so that no more than REPORTDELAYCHARS characters
+//   are sent to it every REPORTDELAYTIME milliseconds. This works around the
+//   Visual Studio 6 bug where debug strings are sometimes lost if they're sent
+//   too fast.
+//
+//  - length (IN): Number of characters just sent to the debugger.
+//
+//  Return Value:
+//
+//    None.
+//
+static VOID delayReport (size_t length)
+{
+    if (!s_reportDelay)
+        return;
+
+    s_reportDelayChars += length;
+    if (s_reportDelayChars >= REPORTDELAYCHARS) {
+        Sleep((DWORD)(REPORTDELAYTIME * (s_reportDelayChars / REPORTDELAYCHARS)));
+        s_reportDelayChars %= REPORTDELAYCHARS;
+    }
+}
+
+// writeReport - Sends report text to the debugger and/or to a file, as
+//   configured. This is where the report actually gets written out.
+//
+//  - text (IN): The text to write. Must be NUL-terminated.
+//
+//  - length (IN): Length of the text, in characters.
+//
+//  Return Value:
+//
+//    None.
+//
+static VOID writeReport (LPCWSTR text, size_t length)
+{
+    BOOL tofile = (s_reportFile != NULL) || (s_reportPipe != NULL);
+    if (s_reportEncoding == unicode) {
+        if (tofile) {
+            // Send the report to the previously specified file.
+            writeReportFile(text, length * sizeof(WCHAR));
+        }
+
+        if ( s_reportToStdOut )
+            fputws(text, stdout);
+    }
+    else if ((s_reportEncoding == utf8) && ((tofile) || s_reportToStdOut)) {
+        // Convert the whole text in a few large pieces. A piece never ends
+        // in the middle of a surrogate pair.
+        CHAR    messagea [REPORTUTF8CHUNK * 3];
+        size_t  offset = 0;
+        while (offset < length) {
+            size_t chars = min(length - offset, (size_t)REPORTUTF8CHUNK);
+            if ((offset + chars < length) && (text[offset + chars - 1] >= 0xD800) && (text[offset + chars - 1] <= 0xDBFF))
+                chars--;
+            size_t bytes = encodeUtf8(text + offset, chars, messagea);
+            offset += chars;
+
+            if (tofile) {
                 // Send the report to the previously specified file.
-                fwrite(messagew, sizeof(WCHAR), wcslen(messagew), s_reportFile);
+                writeReportFile(messagea, bytes);
             }
 
             if ( s_reportToStdOut )
-                fputws(messagew, stdout);
+                fwrite(messagea, sizeof(CHAR), bytes, stdout);
         }
-        else {
-            const size_t MAXMESSAGELENGTH = 5119;
+    }
+    else if ((tofile) || s_reportToStdOut) {
+        // Convert to ASCII in pieces, so that large buffers don't need a
+        // large conversion buffer.
+        const size_t MAXMESSAGELENGTH = 5119;
+        CHAR    messagea [MAXMESSAGELENGTH + 1];
+        size_t  offset = 0;
+        while (offset < length) {
+            size_t  chars = min(length - offset, MAXMESSAGELENGTH / 2);
             size_t  count = 0;
-            CHAR    messagea [MAXMESSAGELENGTH + 1];
-            if (wcstombs_s(&count, messagea, MAXMESSAGELENGTH + 1, messagew, _TRUNCATE) != 0) {
+            if (wcstombs_s(&count, messagea, MAXMESSAGELENGTH + 1, text + offset, chars) != 0) {
                 // Failed to convert the Unicode message to ASCII.
                 assert(FALSE);
                 return;
             }
             messagea[MAXMESSAGELENGTH] = '\0';
+            offset += chars;
 
-            if (s_reportFile != NULL) {
+            if (tofile) {
                 // Send the report to the previously specified file.
-                fwrite(messagea, sizeof(CHAR), strlen(messagea), s_reportFile);
+                writeReportFile(messagea, strlen(messagea));
             }
 
             if ( s_reportToStdOut )
                 fputs(messagea, stdout);
-		}
+        }
+    }
+
+    if (s_reportToDebugger) {
+        if (length <= REPORTDEBUGCHUNK) {
+            OutputDebugStringW(text);
+            delayReport(length);
+            return;
+        }
+
+        // Some debuggers truncate very long debug strings, so send big
+        // buffers in pieces that fill the DBWIN buffer as far as possible
+        // and end at a line break.
+        WCHAR   chunk [REPORTDEBUGCHUNK + 1];
+        size_t  offset = 0;
+        while (offset < length) {
+            size_t chars = min(length - offset, (size_t)REPORTDEBUGCHUNK);
+            if (offset + chars < length) {
+                size_t end = chars;
+                while ((end > 0) && (text[offset + end - 1] != L'\n'))
+                    end--;
+                if (end > 0)
+                    chars = end;
+            }
+            wcsncpy_s(chunk, _countof(chunk), text + offset, chars);
+            OutputDebugStringW(chunk);
+            offset += chars;
+            delayReport(chars);
+        }
+    }
+}
+
+// queueReport - Hands the active buffer over for writing and switches Print
+//   to the other buffer. Waits for the previous hand-over to be written
+//   first. Must be called with s_reportLock held; may release and re-acquire
+//   it while waiting.
+//
+//  Return Value:
+//
+//    Returns TRUE if a buffer is now in flight.
+//
+static BOOL queueReport ()
+{
+    while (s_reportInFlight) {
+        s_reportLock.Leave();
+        WaitForSingleObject(s_reportDone, INFINITE);
+        s_reportLock.Enter();
+    }
+    if (s_reportLengths[s_reportActive] == 0)
+        return FALSE;
+
+    s_reportInFlight = TRUE;
+    ResetEvent(s_reportDone);
+    s_reportActive ^= 1;
+    return TRUE;
+}
+
+// writeInFlight - Writes the buffer that is in flight and releases it. Must
+//   be called without s_reportLock held, only by the thread responsible for
+//   writing (the writer thread when it runs).
+//
+//  Return Value:
+//
+//    None.
+//
+static VOID writeInFlight ()
+{
+    UINT index = s_reportActive ^ 1;
+    writeReport(s_reportBuffers[index], s_reportLengths[index]);
+
+    CriticalSectionLocker<> cs(s_reportLock);
+    s_reportLengths[index] = 0;
+    s_reportInFlight = FALSE;
+    SetEvent(s_reportDone);
+}
+
+// reportWriterProc - The writer thread. Writes buffers as they are handed
+//   over, and flushes partially filled buffers every REPORTFLUSHINTERVAL
+//   milliseconds so that messages don't linger in the buffer.
+//
+static DWORD WINAPI reportWriterProc (LPVOID)
+{
+    while (!s_reportStop) {
+        WaitForSingleObject(s_reportWake, REPORTFLUSHINTERVAL);
+        if (s_reportStop)
+            break;
+
+        s_reportLock.Enter();
+        BOOL write = s_reportInFlight || queueReport();
+        s_reportLock.Leave();
+        if (write)
+            writeInFlight();
+    }
+    return 0;
+}
+
+// bufferReport - Appends a message to the active report buffer, handing the
+//   buffer over for writing when it fills up.
+//
+//  - message (IN): The message.
+//
+//  - length (IN): Length of the message, in characters.
+//
+//  Return Value:
+//
+//    None.
+//
+static VOID bufferReport (LPCWSTR message, size_t length)
+{
+    s_reportLock.Enter();
+    if (s_reportLengths[s_reportActive] + length > REPORTBUFFERLENGTH) {
+        if (queueReport()) {
+            if (s_reportWriter != NULL) {
+                SetEvent(s_reportWake);
+            }
+            else {
+                s_reportLock.Leave();
+                writeInFlight();
+                s_reportLock.Enter();
+            }
+        }
+    }
+
+    if (length > REPORTBUFFERLENGTH) {
+        // Too big to be buffered at all (a resolved call stack can be).
+        // Everything before it has been handed over already; make sure it
+        // is written before this message goes out directly.
+        while (s_reportInFlight) {
+            s_reportLock.Leave();
+            WaitForSingleObject(s_reportDone, INFINITE);
+            s_reportLock.Enter();
+        }
+        writeReport(message, length);
+        s_reportLock.Leave();
+        return;
+    }
+
+    WCHAR *buffer = s_reportBuffers[s_reportActive];
+    size_t &used = s_reportLengths[s_reportActive];
+    wcsncpy_s(buffer + used, REPORTBUFFERLENGTH + 1 - used, message, length);
+    used += length;
+    s_reportLock.Leave();
+}
+
+// FlushReport - Writes out everything that has been buffered so far, the
+//   report file's own buffers included, and waits for it to be written.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID FlushReport ()
+{
+    if (!s_reportBuffered) {
+        if (s_reportFile != NULL)
+            s_reportFile->Flush();
+        return;
+    }
+
+    s_reportLock.Enter();
+    if (queueReport()) {
+        if (s_reportWriter != NULL) {
+            SetEvent(s_reportWake);
+            while (s_reportInFlight) {
+                s_reportLock.Leave();
+                WaitForSingleObject(s_reportDone, INFINITE);
+                s_reportLock.Enter();
+            }
+        }
+        else {
+            s_reportLock.Leave();
+            writeInFlight();
+            s_reportLock.Enter();
+        }
+    }
+    // Nothing is in flight, and nothing gets written while the lock is held.
+    if (s_reportFile != NULL)
+        s_reportFile->Flush();
+    s_reportLock.Leave();
+}
+
+// StartReportWriter - Starts buffering the report and creates the writer
+//   thread which writes it out in large chunks.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID StartReportWriter ()
+{
+    if (s_reportBuffered)
+        return;
+
+    s_reportLock.Initialize();
+    s_reportLengths[0] = s_reportLengths[1] = 0;
+    s_reportActive = 0;
+    s_reportInFlight = FALSE;
+    s_reportStop = FALSE;
+    s_reportWake = CreateEventW(NULL, FALSE, FALSE, NULL);
+    s_reportDone = CreateEventW(NULL, TRUE, TRUE, NULL);
+    if ((s_reportWake == NULL) || (s_reportDone == NULL)) {
+        // Stay unbuffered.
+        if (s_reportWake != NULL)
+            CloseHandle(s_reportWake);
+        if (s_reportDone != NULL)
+            CloseHandle(s_reportDone);
+        s_reportWake = s_reportDone = NULL;
+        s_reportLock.Delete();
+        return;
+    }
+    s_reportBuffered = TRUE;
+
+    // If the thread can't be created, the report is still buffered, just
+    // written out by whoever fills the buffer.
+    s_reportWriter = CreateThread(NULL, 0, reportWriterProc, NULL, 0, &s_reportWriterId);
+}
+
+// StopReportWriter - Stops the writer thread. Everything that is already
+//   buffered is written out. The report stays buffered afterwards, but is
+//   written by the reporting thread itself; call FlushReport when done.
+//
+//   Note: This is called while the process shuts down, when the writer
+//     thread may already have been terminated. It never waits for the thread
+//     itself to exit.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID StopReportWriter ()
+{
+    if (s_reportWriter == NULL)
+        return;
+
+    s_reportStop = TRUE;
+    SetEvent(s_reportWake);
+
+    if (WaitForSingleObject(s_reportWriter, 0) == WAIT_TIMEOUT) {
+        // The writer is still alive; let it finish what it is writing.
+        s_reportLock.Enter();
+        while (s_reportInFlight) {
+            s_reportLock.Leave();
+            WaitForSingleObject(s_reportDone, INFINITE);
+            s_reportLock.Enter();
+        }
+        s_reportLock.Leave();
+    }
+    else if (s_reportInFlight) {
+        // The writer was killed (the process is exiting) before it wrote the
+        // buffer it had been handed. Write it now.
+        writeInFlight();
+    }
 
-		if (s_reportToDebugger)
-			OutputDebugStringW(messagew);
+    CloseHandle(s_reportWriter);
+    s_reportWriter = NULL;
+    s_reportWriterId = 0;
+}
+
+// GetReportWriterThreadId - Obtains the thread ID of the report writer.
+//
+//  Return Value:
+//
+//    Returns the writer thread's ID, or 0 if it isn't running.
+//
+DWORD GetReportWriterThreadId ()
+{
+    return s_reportWriterId;
+}
+
+// printReport - Calls the report hooks with a message, and then, unless a
+//   hook handled it, buffers or writes it.
+//
+//  - messagew (IN): The message. Must be NUL-terminated.
+//
+//  - length (IN): Length of the message, in characters.
+//
+//  Return Value:
+//
+//    None.
+//
+static VOID printReport (LPWSTR messagew, size_t length)
+{
+    if (s_captures != 0) {
+        // The last error is left as it was, as for any other message.
+        DWORD error = GetLastError();
+        reportcapture_t *capture = (reportcapture_t*)TlsGetValue(s_captureIndex);
+        SetLastError(error);
+        if (capture != NULL) {
+            capture->append(messagew, length + 1);
+            return;
+        }
+    }
+
+    UINT64 start = __rdtsc();
+    int hook_retval=0;
+    if (!CallReportHook(0, messagew, &hook_retval))
+    {
+        if (s_reportBuffered)
+            bufferReport(messagew, length);
+        else
+            writeReport(messagew, length);
     }
     else if (hook_retval == 1)
         __debugbreak();
 
-    if (s_reportToDebugger && (s_reportDelay)) {
-        Sleep(10); // Workaround the Visual Studio 6 bug where debug strings are sometimes lost if they're sent too fast.
+    InterlockedIncrement64(&s_prints);
+    InterlockedExchangeAdd64(&s_printTicks, (LONG64)(__rdtsc() - start));
+}
+
+// Print - Sends a message to the debugger for display
+//   and/or to a file. Report hooks are called right away; once the report
+//   writer has been started, the message itself is buffered.
+//
+//  - messagew (IN): The message.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID Print (LPWSTR messagew)
+{
+    if (NULL == messagew)
+        return;
+
+    printReport(messagew, wcslen(messagew));
+}
+
+// BeginReportCapture - Makes the calling thread's report messages go to a
+//   capture instead of being printed, until EndReportCapture. The report
+//   hooks aren't called until the capture is replayed, so that threads
+//   formatting parts of one report side by side can have their parts printed
+//   in order.
+//
+//  - capture (IN/OUT): Receives the messages.
+//
+//  Return Value:
+//
+//    Returns FALSE if no TLS slot could be allocated for captures; the
+//    thread's messages are then printed as usual.
+//
+BOOL BeginReportCapture (reportcapture_t *capture)
+{
+    if (s_captureIndex == TLS_OUT_OF_INDEXES) {
+        DWORD index = TlsAlloc();
+        if (index == TLS_OUT_OF_INDEXES)
+            return FALSE;
+        if (InterlockedCompareExchange((LONG*)&s_captureIndex, (LONG)index, (LONG)TLS_OUT_OF_INDEXES) != (LONG)TLS_OUT_OF_INDEXES)
+            TlsFree(index);
+    }
+    TlsSetValue(s_captureIndex, capture);
+    InterlockedIncrement(&s_captures);
+    return TRUE;
+}
+
+// EndReportCapture - Makes the calling thread's report messages be printed
+//   again, after a successful BeginReportCapture.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID EndReportCapture ()
+{
+    TlsSetValue(s_captureIndex, NULL);
+    InterlockedDecrement(&s_captures);
+}
+
+// ReplayReport - Prints the messages of a capture, in the order they were
+//   captured, as Print would have.
+//
+//  - capture (IN): The messages.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID ReplayReport (const reportcapture_t &capture)
+{
+    LPCWSTR message = capture.c_str();
+    LPCWSTR end = message + capture.size();
+    while (message < end) {
+        size_t length = wcslen(message);
+        printReport(const_cast<LPWSTR>(message), length);
+        message += length + 1;
     }
 }
 
+// GetPrintStatistics - Obtains the number of messages printed so far, and the
+//   time spent printing them.
+//
+//  - prints (OUT): Receives the number of messages printed.
+//
+//  - ticks (OUT): Receives the time spent in Print, in time stamp counter
+//      ticks.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID GetPrintStatistics (UINT64 &prints, UINT64 &ticks)
+{
+    prints = (UINT64)InterlockedCompareExchange64(&s_prints, 0, 0);
+    ticks  = (UINT64)InterlockedCompareExchange64(&s_printTicks, 0, 0);
+}
+
 // Report - Sends a printf-style formatted message to the debugger for display
 //   and/or to a file.
 //
@@ -841,6 +1428,30 @@ VOID Report (LPCWSTR format, ...)
         Print(messagew);
 }
 
+// FormatReport - Sends a message formatted by cppformat to the debugger for
+//   display and/or to a file. Called with the message's arguments, through
+//   the variadic wrapper declared with it in utility.h.
+//
+//   Unlike Report, the arguments are formatted according to their types, and
+//   messages aren't truncated: they are formatted into a buffer on the stack,
+//   which grows into VLD's private heap if it needs to.
+//
+//  - format (IN): Specifies a cppformat format string ("{}" fields)
+//      containing the message to be sent to the debugger.
+//
+//  - args (IN): Arguments to be formatted using the specified format string.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID FormatReport (fmt::WStringRef format, fmt::ArgList args)
+{
+    fmt::BasicMemoryWriter<WCHAR, vldallocator<WCHAR> > writer;
+    writer.write(format, args);
+    printReport(const_cast<LPWSTR>(writer.c_str()), writer.size());
+}
+
 // RestoreImport - Restores the IAT entry for an import previously patched via
 //   a call to "PatchImport" to the original address of the import.
 //
@@ -995,9 +1606,9 @@ VOID RestoreModule (HMODULE importmodule, moduleentry_t patchtable [], UINT tabl
 }
 
 // SetReportEncoding - Sets the output encoding of report messages to either
-//   ASCII (the default) or Unicode.
+//   ASCII (the default), Unicode or UTF-8.
 //
-//  - encoding (IN): Specifies either "ascii" or "unicode".
+//  - encoding (IN): Specifies "ascii", "unicode" or "utf8".
 //
 //  Return Value:
 //
@@ -1005,9 +1616,12 @@ VOID RestoreModule (HMODULE importmodule, moduleentry_t patchtable [], UINT tabl
 //
 VOID SetReportEncoding (encoding_e encoding)
 {
+    // Anything already buffered was meant for the previous encoding.
+    FlushReport();
     switch (encoding) {
     case ascii:
     case unicode:
+    case utf8:
         s_reportEncoding = encoding;
         break;
 
@@ -1018,7 +1632,9 @@ VOID SetReportEncoding (encoding_e encoding)
 
 // SetReportFile - Sets a destination file to which all report messages should
 //   be sent. If this function is not called to set a destination file, then
-//   report messages will be sent to the debugger instead of to a file.
+//   report messages will be sent to the debugger instead of to a file. A
+//   Unicode encoded file (see SetReportEncoding, which must be called first)
+//   starts with a byte-order mark.
 //
 //  - file (IN): Pointer to an open file, to which future report messages should
 //      be sent.
@@ -1027,15 +1643,121 @@ VOID SetReportEncoding (encoding_e encoding)
 //      the specified file, a copy of each message will also be sent to the
 //      debugger.
 //
+//  - tostdout (IN): If true, a copy of each message will also be sent to
+//      standard output.
+//
+//  - compress (IN): If true, the file is written gzip compressed. It must
+//      have been opened in binary mode, and be finished with FinishReportFile
+//      before it is closed (as any report file must).
+//
 //  Return Value:
 //
-//    None.
+//    Returns FALSE if the file was to be compressed but couldn't be; it is
+//    then written uncompressed.
 //
-VOID SetReportFile (FILE *file, BOOL copydebugger, BOOL tostdout)
+BOOL SetReportFile (FileStream *file, BOOL copydebugger, BOOL tostdout, BOOL compress)
 {
+    // Anything already buffered was meant for the previous destination.
+    FinishReportFile();
     s_reportFile = file;
+    s_reportPipe = NULL;
     s_reportToDebugger = copydebugger;
     s_reportToStdOut = tostdout;
+
+    BOOL compressed = !compress || (file == NULL) || s_reportCompressor.Open(file);
+    if ((file != NULL) && (s_reportEncoding == unicode)) {
+        WCHAR bom = BOM; // Unicode byte-order mark.
+        writeReportFile(&bom, sizeof(bom));
+    }
+    return compressed;
+}
+
+// SetReportPipe - Streams all report messages to a named pipe instead of a
+//   file, for a collector which gathers the reports of many processes. The
+//   text is encoded as it would be for a file (see SetReportEncoding, which
+//   must be called first). Text the pipe's reader doesn't take in time is
+//   dropped (see writeReportPipe), so that a slow reader never stalls the
+//   program for long.
+//
+//  - pipe (IN): Handle of the client end of the pipe, opened for overlapped
+//      writing.
+//
+//  - copydebugger (IN): If true, a copy of each message will also be sent to
+//      the debugger.
+//
+//  - tostdout (IN): If true, a copy of each message will also be sent to
+//      standard output.
+//
+//  Return Value:
+//
+//    Returns FALSE if the pipe can't be written to; the report is then sent
+//    to the debugger, and the pipe is not used.
+//
+BOOL SetReportPipe (HANDLE pipe, BOOL copydebugger, BOOL tostdout)
+{
+    FinishReportFile();
+    s_reportFile = NULL;
+    s_reportToDebugger = copydebugger;
+    s_reportToStdOut = tostdout;
+    if (s_reportPipeEvent == NULL)
+        s_reportPipeEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (s_reportPipeEvent == NULL) {
+        s_reportPipe = NULL;
+        s_reportToDebugger = TRUE;
+        return FALSE;
+    }
+    s_reportPipe = pipe;
+    s_reportPipeBroken = FALSE;
+    s_reportPipeStalled = FALSE;
+    s_reportPipeDropped = 0;
+    if (s_reportEncoding == unicode) {
+        WCHAR bom = BOM; // Unicode byte-order mark.
+        writeReportFile(&bom, sizeof(bom));
+    }
+    return TRUE;
+}
+
+// GetReportPipeDropped - Obtains the number of bytes of report text dropped
+//   because the report pipe's reader didn't take them in time, or had gone.
+//
+//  Return Value:
+//
+//    Returns the number of bytes dropped since SetReportPipe.
+//
+UINT64 GetReportPipeDropped ()
+{
+    return s_reportPipeDropped;
+}
+
+// IsNamedPipePath - Determines whether a path names a named pipe, as in
+//   "\\server\pipe\name" (the server being "." for the local machine).
+//
+//  - path (IN): The path.
+//
+//  Return Value:
+//
+//    Returns TRUE if the path names a pipe.
+//
+BOOL IsNamedPipePath (LPCWSTR path)
+{
+    if ((path[0] != L'\\') || (path[1] != L'\\'))
+        return FALSE;
+    LPCWSTR share = wcschr(path + 2, L'\\');
+    return (share != NULL) && (_wcsnicmp(share, L"\\pipe\\", 6) == 0);
+}
+
+// FinishReportFile - Writes out everything that has been buffered for the
+//   report file and, if it is compressed, finishes the compressed stream. To
+//   be called before the report file is closed.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID FinishReportFile ()
+{
+    FlushReport();
+    s_reportCompressor.Close();
 }
 
 // AppendString - Appends the specified source string to the specified destination
@@ -1068,6 +1790,41 @@ LPWSTR AppendString (LPWSTR dest, LPCWSTR source)
     return new_str;
 }
 
+// ExpandProcessId - Replaces each "%p" in a file name by the ID of the
+//   process, so that processes sharing one vld.ini (a build spawning many
+//   child processes, say) each write files of their own.
+//
+//  - path (IN/OUT): The file name, expanded in place.
+//
+//  - size (IN): Size of the file name's buffer, in characters (at most
+//      MAX_PATH).
+//
+//  Return Value:
+//
+//    None.
+//
+VOID ExpandProcessId (LPWSTR path, size_t size)
+{
+    assert(size <= MAX_PATH);
+    WCHAR pid [16];
+    _ultow_s(GetCurrentProcessId(), pid, _countof(pid), 10);
+
+    WCHAR  expanded [MAX_PATH];
+    size_t length = 0;
+    for (LPCWSTR c = path; (*c != L'\0') && (length + 1 < size); c++) {
+        if ((c[0] == L'%') && ((c[1] == L'p') || (c[1] == L'P'))) {
+            for (LPCWSTR digit = pid; (*digit != L'\0') && (length + 1 < size); digit++)
+                expanded[length++] = *digit;
+            c++;
+        }
+        else {
+            expanded[length++] = *c;
+        }
+    }
+    expanded[length] = L'\0';
+    wcsncpy_s(path, size, expanded, _TRUNCATE);
+}
+
 // StrToBool - Converts string values (e.g. "yes", "no", "on", "off") to boolean
 //   values.
 //
@@ -1092,66 +1849,188 @@ BOOL StrToBool (LPCWSTR s) {
     }
 }
 
+// Table of the software CRC32 below. The polynomial is the one of the SSE4.2
+// crc32 instruction (CRC-32C), so both give the same hashes.
 static const DWORD crctab[256] = {
-    0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
-    0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
-    0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
-    0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
-    0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
-    0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
-    0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b, 0x35b5a8fa, 0x42b2986c,
-    0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
-    0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
-    0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
-    0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190, 0x01db7106,
-    0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
-    0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
-    0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
-    0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
-    0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
-    0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
-    0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
-    0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
-    0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
-    0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
-    0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
-    0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
-    0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
-    0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
-    0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
-    0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
-    0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
-    0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
-    0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
-    0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
-    0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
-    0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
-    0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
-    0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
-    0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
-    0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
-    0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
-    0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
-    0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
-    0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
-    0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
-    0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d,
+    0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c,
+    0x26a1e7e8, 0xd4ca64eb, 0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
+    0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24, 0x105ec76f, 0xe235446c,
+    0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+    0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc,
+    0xbc267848, 0x4e4dfb4b, 0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a,
+    0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35, 0xaa64d611, 0x580f5512,
+    0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+    0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad,
+    0x1642ae59, 0xe4292d5a, 0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+    0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595, 0x417b1dbc, 0xb3109ebf,
+    0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+    0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f,
+    0xed03a29b, 0x1f682198, 0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927,
+    0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38, 0xdbfc821c, 0x2997011f,
+    0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+    0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e,
+    0x4767748a, 0xb50cf789, 0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859,
+    0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46, 0x7198540d, 0x83f3d70e,
+    0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+    0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de,
+    0xdde0eb2a, 0x2f8b6829, 0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c,
+    0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93, 0x082f63b7, 0xfa44e0b4,
+    0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+    0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b,
+    0xb4091bff, 0x466298fc, 0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c,
+    0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033, 0xa24bb5a6, 0x502036a5,
+    0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+    0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975,
+    0x0e330a81, 0xfc588982, 0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+    0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622, 0x38cc2a06, 0xcaa7a905,
+    0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+    0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8,
+    0xe52cc12c, 0x1747422f, 0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff,
+    0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0, 0xd3d3e1ab, 0x21b862a8,
+    0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+    0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78,
+    0x7fab5e8c, 0x8dc0dd8f, 0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee,
+    0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1, 0x69e9f0d5, 0x9b8273d6,
+    0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+    0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69,
+    0xd5cf889d, 0x27a40b9e, 0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e,
+    0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351,
 };
 
+// Whether the processor has SSE4.2: 0 if not checked yet, 1 if not, 2 if so.
+static LONG s_hasSse42 = 0;
+
+// HasSse42 - Checks whether the processor has the SSE4.2 instructions (among
+//   which crc32 and the 64-bit comparisons).
+//
+//  Return Value:
+//
+//    Returns true if it has.
+//
+bool HasSse42 ()
+{
+#if defined(_M_IX86) || defined(_M_X64)
+    LONG has = s_hasSse42;
+    if (has == 0) {
+        int info [4];
+        __cpuid(info, 1);
+        has = (info[2] & (1 << 20)) ? 2 : 1;
+        s_hasSse42 = has;
+    }
+    return has == 2;
+#else
+    return false;
+#endif
+}
+
+static LONG s_hasAvx2 = 0;
+
+// HasAvx2 - Checks whether the processor has the AVX2 instructions and the
+//   operating system saves the 256-bit registers across context switches.
+//
+//  Return Value:
+//
+//    Returns true if it has.
+//
+bool HasAvx2 ()
+{
+#if !defined(_M_IX86) && !defined(_M_X64)
+    return false;
+#else
+    LONG has = s_hasAvx2;
+    if (has == 0) {
+        int info [4];
+        has = 1;
+        __cpuid(info, 1);
+        // OSXSAVE and AVX, then whether XCR0 enables the SSE and AVX state.
+        if (((info[2] & (1 << 27)) != 0) && ((info[2] & (1 << 28)) != 0) &&
+            ((_xgetbv(0) & 0x6) == 0x6)) {
+            __cpuid(info, 0);
+            if (info[0] >= 7) {
+                __cpuidex(info, 7, 0);
+                if (info[1] & (1 << 5))
+                    has = 2;
+            }
+        }
+        s_hasAvx2 = has;
+    }
+    return has == 2;
+#endif
+}
+
+#if !defined(_M_ARM64)
+// crc32Software - Adds one value to a CRC32 a byte at a time.
+static DWORD crc32Software (UINT_PTR p, DWORD hash)
+{
+    for (UINT32 byte = 0; byte < sizeof(UINT_PTR); byte++) {
+        hash = (hash >> 8) ^ crctab[(hash ^ (DWORD)p) & 0xff];
+        p >>= 8;
+    }
+    return hash;
+}
+#endif // !_M_ARM64
+
+// CalculateCRC32 - Adds one value to a CRC32.
+//
+//  - p (IN): The value.
+//
+//  - startValue (IN): The CRC32 so far.
+//
+//  Return Value:
+//
+//    Returns the new CRC32.
+//
 DWORD CalculateCRC32(UINT_PTR p, UINT startValue)
 {
-    register DWORD hash = startValue;
-    hash = (hash >> 8) ^ crctab[(hash & 0xff) ^ ((p >>  0) & 0xff)];
-    hash = (hash >> 8) ^ crctab[(hash & 0xff) ^ ((p >>  8) & 0xff)];
-    hash = (hash >> 8) ^ crctab[(hash & 0xff) ^ ((p >> 16) & 0xff)];
-    hash = (hash >> 8) ^ crctab[(hash & 0xff) ^ ((p >> 24) & 0xff)];
-#ifdef WIN64
-    hash = (hash >> 8) ^ crctab[(hash & 0xff) ^ ((p >> 32) & 0xff)];
-    hash = (hash >> 8) ^ crctab[(hash & 0xff) ^ ((p >> 40) & 0xff)];
-    hash = (hash >> 8) ^ crctab[(hash & 0xff) ^ ((p >> 48) & 0xff)];
-    hash = (hash >> 8) ^ crctab[(hash & 0xff) ^ ((p >> 56) & 0xff)];
+    return CalculateCRC32(&p, 1, startValue);
+}
+
+// CalculateCRC32 - Computes the CRC32 of an array of values, with the crc32
+//   instruction when the processor has one.
+//
+//  - values (IN): The values.
+//
+//  - count (IN): Number of values.
+//
+//  - startValue (IN): The CRC32 to start from.
+//
+//  Return Value:
+//
+//    Returns the CRC32.
+//
+DWORD CalculateCRC32(const UINT_PTR* values, UINT32 count, UINT startValue)
+{
+#if defined(_M_ARM64)
+    // Every processor Windows runs on has the ARMv8 CRC32 instructions; the
+    // CRC32C ones compute the same CRC as SSE4.2's crc32.
+    DWORD hash = startValue;
+    for (UINT32 index = 0; index < count; index++) {
+        hash = __crc32cd(hash, values[index]);
+    }
+    return hash;
+#else
+    if (HasSse42()) {
+#if defined(_M_X64)
+        unsigned __int64 hash = startValue;
+        for (UINT32 index = 0; index < count; index++) {
+            hash = _mm_crc32_u64(hash, values[index]);
+        }
+        return (DWORD)hash;
+#else
+        DWORD hash = startValue;
+        for (UINT32 index = 0; index < count; index++) {
+            hash = _mm_crc32_u32(hash, values[index]);
+        }
+        return hash;
 #endif
+    }
+
+    DWORD hash = startValue;
+    for (UINT32 index = 0; index < count; index++) {
+        hash = crc32Software(values[index], hash);
+    }
     return hash;
+#endif
 }
 
 // Formats a message string using the specified message and variable
@@ -1201,6 +2080,76 @@ HMODULE GetCallingModule(UINT_PTR pCaller )
     return hModule;
 }
 
+// GetModulePdbInfo - Reads the PDB signature and age from a loaded module's
+//   CodeView debug record, which is what symbol servers index PDBs by.
+//
+//  - module (IN): Handle (base address) of the module.
+//
+//  - pdbGuid (OUT): Receives the PDB signature.
+//
+//  - pdbAge (OUT): Receives the PDB age.
+//
+//  - pdbName (OUT): If not NULL, receives the file name of the PDB, without
+//      its directory, as a symbol server expects it.
+//
+//  - pdbNameSize (IN): Size, in characters, of the pdbName buffer.
+//
+//  Return Value:
+//
+//    Returns TRUE if the module has a CodeView (RSDS) record. Otherwise the
+//    outputs are zeroed and FALSE is returned.
+//
+BOOL GetModulePdbInfo(HMODULE module, GUID &pdbGuid, DWORD &pdbAge, LPWSTR pdbName, SIZE_T pdbNameSize)
+{
+    struct cvinfo_t {
+        DWORD signature; // "RSDS"
+        GUID  guid;
+        DWORD age;
+    };
+
+    ZeroMemory(&pdbGuid, sizeof(pdbGuid));
+    pdbAge = 0;
+    if ((pdbName != NULL) && (pdbNameSize > 0))
+        pdbName[0] = L'\0';
+
+    ULONG size = 0;
+    IMAGE_DEBUG_DIRECTORY* debug = (IMAGE_DEBUG_DIRECTORY*)g_Ide.ImageDirectoryEntryToDataEx((PVOID)module, TRUE,
+        IMAGE_DIRECTORY_ENTRY_DEBUG, &size, NULL);
+    if (debug == NULL)
+        return FALSE;
+
+    __try {
+        for (ULONG index = 0; index < size / sizeof(IMAGE_DEBUG_DIRECTORY); index++) {
+            if ((debug[index].Type != IMAGE_DEBUG_TYPE_CODEVIEW) || (debug[index].AddressOfRawData == 0) ||
+                (debug[index].SizeOfData < sizeof(cvinfo_t)))
+                continue;
+            const cvinfo_t* cv = (const cvinfo_t*)R2VA(module, debug[index].AddressOfRawData);
+            if (cv->signature != 'SDSR')
+                continue;
+            pdbGuid = cv->guid;
+            pdbAge = cv->age;
+            if ((pdbName != NULL) && (pdbNameSize > 0)) {
+                // The path of the PDB, as linked, follows in UTF-8.
+                LPCSTR path = (LPCSTR)(cv + 1);
+                size_t length = strnlen(path, debug[index].SizeOfData - sizeof(cvinfo_t));
+                LPCSTR name = path;
+                for (size_t offset = 0; offset < length; offset++) {
+                    if ((path[offset] == '\\') || (path[offset] == '/'))
+                        name = path + offset + 1;
+                }
+                int chars = MultiByteToWideChar(CP_UTF8, 0, name, (int)(length - (name - path)), pdbName,
+                    (int)pdbNameSize - 1);
+                pdbName[chars] = L'\0';
+            }
+            return TRUE;
+        }
+    }
+    __except(EXCEPTION_EXECUTE_HANDLER) {
+        // The image is malformed or went away.
+    }
+    return FALSE;
+}
+
 // LoadBoolOption - Loads specified option from environment variables or from specified ini file,
 //   if env var is unavailable and converts string values (e.g. "yes", "no", "on", "off") to boolean values.
 //
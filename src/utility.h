@@ -30,8 +30,12 @@ Applications should never include this header."
 #endif
 
 #include <cstdio>
+#include <string>
 #include <windows.h>
 #include <intrin.h>
+#include "cppformat\format.h"
+#include "vldallocator.h" // Provides internal allocator.
+#include "filestream.h"   // Provides the report file stream.
 
 #ifdef _WIN64
 #define ADDRESSFORMAT       L"0x%.16X"   // Format string for 64-bit addresses
@@ -42,8 +46,15 @@ Applications should never include this header."
 #endif // _WIN64
 #define BOM             0xFEFF     // Unicode byte-order mark.
 #define MAXREPORTLENGTH 511        // Maximum length, in characters, of "report" messages.
+#define REPORTBUFFERLENGTH  32768  // Characters of report text buffered before they are written out.
+#define REPORTDEBUGCHUNK    4091   // Maximum length, in characters, of each string sent to the debugger (what fits in the 4 KB DBWIN buffer).
+#define REPORTDELAYCHARS    1024   // Characters sent to the debugger per REPORTDELAYTIME, with a slow debugger (see InsertReportDelay).
+#define REPORTDELAYTIME     10     // Milliseconds slept for every REPORTDELAYCHARS characters sent to a slow debugger.
+#define REPORTUTF8CHUNK     2048   // Characters of report text converted to UTF-8 at a time.
+#define REPORTFLUSHINTERVAL 100    // Milliseconds after which the report writer flushes a partial buffer.
+#define REPORTPIPETIMEOUT   100    // Milliseconds a write to the report pipe may take before its text is dropped.
 
-// Architecture-specific definitions for x86 and x64
+// Architecture-specific definitions for x86, x64 and ARM64
 #if defined(_M_IX86)
 #define X86X64ARCHITECTURE IMAGE_FILE_MACHINE_I386
 #define BPREG Ebp
@@ -54,39 +65,31 @@ Applications should never include this header."
 #define BPREG Rbp
 #define IPREG Rip
 #define SPREG Rsp
+#elif defined(_M_ARM64)
+#define X86X64ARCHITECTURE IMAGE_FILE_MACHINE_ARM64
+#define BPREG Fp
+#define IPREG Pc
+#define SPREG Sp
 #endif // _M_IX86
 
+// The point at which an allocation entered VLD's code. Only the return address
+// and where it's stored are recorded; the stack walkers which need the
+// caller's registers rebuild them from those when they run (see
+// CallStack::materializeContext), so the hooks don't pay for a full CONTEXT.
 struct context_t
 {
-    UINT_PTR fp;
-    UINT_PTR func;
-#if defined(_M_IX86)
-    DWORD Ebp;
-    DWORD Esp;
-    DWORD Eip;
-#elif defined(_M_X64)
-    DWORD64 Rbp;
-    DWORD64 Rsp;
-    DWORD64 Rip;
-#endif // _M_IX86
+    UINT_PTR fp;    // Return address into the code which called the hook.
+    UINT_PTR func;  // The hooked function.
+    UINT_PTR stack; // Address of the return address, in the hook's frame.
 };
 
-// Capture current context
-#if defined(_M_IX86)
+// Capture current context. On ARM64, the return address is the link register
+// saved in the hook's frame record, right above the saved frame pointer.
+#if defined(_M_IX86) || defined(_M_X64) || defined(_M_ARM64)
 #define CAPTURE_CONTEXT()                                                       \
     context_t context_;                                                         \
-    {CONTEXT _ctx;                                                              \
-    RtlCaptureContext(&_ctx);                                                   \
-    context_.Ebp = _ctx.Ebp; context_.Esp = _ctx.Esp; context_.Eip = _ctx.Eip;  \
-    context_.fp = (UINT_PTR)_ReturnAddress();}
-#define GET_RETURN_ADDRESS(context)  (context.fp)
-#elif defined(_M_X64)
-#define CAPTURE_CONTEXT()                                                       \
-    context_t context_;                                                         \
-    {CONTEXT _ctx;                                                              \
-    RtlCaptureContext(&_ctx);                                                   \
-    context_.Rbp = _ctx.Rbp; context_.Rsp = _ctx.Rsp; context_.Rip = _ctx.Rip;  \
-    context_.fp = (UINT_PTR)_ReturnAddress();}
+    context_.fp = (UINT_PTR)_ReturnAddress();                                   \
+    context_.stack = (UINT_PTR)_AddressOfReturnAddress();
 #define GET_RETURN_ADDRESS(context)  (context.fp)
 #else
 // If you want to retarget Visual Leak Detector to another processor
@@ -94,17 +97,17 @@ struct context_t
 // obtain the frame pointer (or other address) which can be used to obtain the
 // return address and stack pointer of the calling frame.
 #error "Visual Leak Detector is not supported on this architecture."
-#endif // _M_IX86 || _M_X64
+#endif // _M_IX86 || _M_X64 || _M_ARM64
 
 // Miscellaneous definitions
 #define R2VA(moduleBase, rva)  (((PBYTE)moduleBase) + rva) // Relative Virtual Address to Virtual Address conversion.
-#define BYTEFORMATBUFFERLENGTH 4
 #define HEXDUMPLINELENGTH      58
 
-// Reports can be encoded as either ASCII or Unicode (UTF-16).
+// Reports can be encoded as either ASCII, Unicode (UTF-16) or UTF-8.
 enum encoding_e {
     ascii,
-    unicode
+    unicode,
+    utf8
 };
 
 // This structure allows us to build a table of APIs which should be patched
@@ -124,17 +127,35 @@ struct moduleentry_t
     patchentry_t*   patchTable;
 };
 
+// Report text captured by a thread instead of being printed (see
+// BeginReportCapture). Each message is kept with its terminator, so that
+// replaying them passes each through the report hooks on its own.
+typedef std::basic_string<WCHAR, std::char_traits<WCHAR>, vldallocator<WCHAR> > reportcapture_t;
+
 // Utility functions. See function definitions for details.
+BOOL BeginReportCapture (reportcapture_t *capture);
 VOID DumpMemoryA (LPCVOID address, SIZE_T length);
 VOID DumpMemoryW (LPCVOID address, SIZE_T length);
+VOID EndReportCapture ();
+VOID ExpandProcessId (LPWSTR path, size_t size);
 BOOL FindImport (HMODULE importmodule, HMODULE exportmodule, LPCSTR exportmodulename, LPCSTR importname);
 BOOL FindPatch (HMODULE importmodule, moduleentry_t* module);
+LPVOID FindRealCode (LPVOID pCode);
+VOID FinishReportFile ();
+VOID FlushReport ();
+VOID GetPrintStatistics (UINT64 &prints, UINT64 &ticks);
+UINT64 GetReportPipeDropped ();
+DWORD GetReportWriterThreadId ();
 VOID InsertReportDelay ();
+BOOL IsNamedPipePath (LPCWSTR path);
 BOOL IsModulePatched (HMODULE importmodule, moduleentry_t patchtable [], UINT tablesize);
 BOOL PatchImport (HMODULE importmodule, moduleentry_t *module);
 BOOL PatchModule (HMODULE importmodule, moduleentry_t patchtable [], UINT tablesize);
 VOID Print (LPWSTR message);
+VOID ReplayReport (const reportcapture_t &capture);
 VOID Report (LPCWSTR format, ...);
+VOID FormatReport (fmt::WStringRef format, fmt::ArgList args);
+FMT_VARIADIC_W(VOID, FormatReport, fmt::WStringRef)
 #ifndef NDEBUG
 #define DbgPrint(x)     Print(x)
 #define DbgReport(...)  Report(__VA_ARGS__)
@@ -147,15 +168,22 @@ VOID Report (LPCWSTR format, ...);
 VOID RestoreImport (HMODULE importmodule, moduleentry_t* module);
 VOID RestoreModule (HMODULE importmodule, moduleentry_t patchtable [], UINT tablesize);
 VOID SetReportEncoding (encoding_e encoding);
-VOID SetReportFile (FILE *file, BOOL copydebugger, BOOL copytostdout);
+BOOL SetReportFile (FileStream *file, BOOL copydebugger, BOOL copytostdout, BOOL compress);
+BOOL SetReportPipe (HANDLE pipe, BOOL copydebugger, BOOL copytostdout);
+VOID StartReportWriter ();
+VOID StopReportWriter ();
 LPWSTR AppendString (LPWSTR dest, LPCWSTR source);
 BOOL StrToBool (LPCWSTR s);
 void ConvertModulePathToAscii( LPCWSTR modulename, LPSTR * modulenamea );
 DWORD CalculateCRC32(UINT_PTR p, UINT startValue = 0xD202EF8D);
+DWORD CalculateCRC32(const UINT_PTR* values, UINT32 count, UINT startValue = 0xD202EF8D);
+bool HasSse42 ();
+bool HasAvx2 ();
 // Formats a message string using the specified message and variable
 // list of arguments.
 void GetFormattedMessage(DWORD last_error);
 HMODULE GetCallingModule(UINT_PTR pCaller);
+BOOL GetModulePdbInfo(HMODULE module, GUID &pdbGuid, DWORD &pdbAge, LPWSTR pdbName = NULL, SIZE_T pdbNameSize = 0);
 DWORD FilterFunction(long);
 BOOL LoadBoolOption(LPCWSTR optionname, LPCWSTR defaultvalue, LPCWSTR inipath);
 UINT LoadIntOption(LPCWSTR optionname, UINT defaultvalue, LPCWSTR inipath);
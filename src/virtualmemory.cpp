@@ -0,0 +1,568 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Virtual Memory Region Tracking
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#define VLDBUILD
+#include "ntapi.h"      // Provides access to NT APIs.
+#include "vldheap.h"    // Provides internal new and delete operators.
+#include "vldint.h"     // Provides access to VLD internals.
+
+// Imported global variables.
+extern "C" IMAGE_DOS_HEADER __ImageBase; // VLD's own module.
+extern CallStackTable g_callStackTable;
+extern DbgHelp        g_DbgHelp;
+
+// A tracked region, copied by reportVirtualRegions.
+struct vregionleak_t {
+    UINT_PTR   base;
+    SIZE_T     size;
+    SIZE_T     committed;
+    bool       view;
+    CallStack *callStack; // The call stack, referenced until it's reported.
+    DWORD      threadId;
+};
+
+// virtualMemoryCaller - Finds the module which called the virtual memory
+//   function whose hook is running. The hooks are only patched into
+//   kernel32.dll and KernelBase.dll, so the caller is the first module on the
+//   stack past VLD's own frames and those of the module which called the hook.
+//
+//  - importer (IN): Return address into the module which called the hook.
+//
+//  Return Value:
+//
+//    Returns the calling module, or NULL if it couldn't be found.
+//
+static HMODULE virtualMemoryCaller (UINT_PTR importer)
+{
+    HMODULE self = (HMODULE)&__ImageBase;
+    HMODULE importingModule = GetCallingModule(importer);
+    PVOID frames [16];
+    USHORT count = RtlCaptureStackBackTrace(0, _countof(frames), frames, NULL);
+    for (USHORT index = 0; index < count; index++) {
+        HMODULE module = GetCallingModule((UINT_PTR)frames[index]);
+        if ((module != self) && (module != importingModule))
+            return module;
+    }
+    return NULL;
+}
+
+// commitRange - Adds a range to the committed ranges of a reservation,
+//   merging it with any range it overlaps or touches.
+//
+//  - commits (IN/OUT): The reservation's committed ranges.
+//
+//  - start (IN): Start of the range.
+//
+//  - end (IN): End of the range (exclusive).
+//
+//  Return Value:
+//
+//    Returns the number of bytes which weren't committed yet.
+//
+static SIZE_T commitRange (CommitMap *commits, UINT_PTR start, UINT_PTR end)
+{
+    SIZE_T overlap = 0;
+    UINT_PTR mergedStart = start;
+    UINT_PTR mergedEnd = end;
+    for (;;) {
+        // Ranges never touch, so only the last one starting at or before the
+        // merged range's end can be merged with it at a time. Iterators don't
+        // survive erasing, so the map is searched every time.
+        CommitMap::Iterator it = commits->floor(mergedEnd);
+        if ((it == commits->end()) || ((*it).second < mergedStart))
+            break;
+        UINT_PTR rangeStart = (*it).first;
+        UINT_PTR rangeEnd = (*it).second;
+        UINT_PTR overlapStart = (rangeStart > start) ? rangeStart : start;
+        UINT_PTR overlapEnd = (rangeEnd < end) ? rangeEnd : end;
+        if (overlapEnd > overlapStart)
+            overlap += overlapEnd - overlapStart;
+        if (rangeStart < mergedStart)
+            mergedStart = rangeStart;
+        if (rangeEnd > mergedEnd)
+            mergedEnd = rangeEnd;
+        commits->erase(it);
+    }
+    commits->insert(mergedStart, mergedEnd);
+    return (end - start) - overlap;
+}
+
+// decommitRange - Removes a range from the committed ranges of a
+//   reservation, splitting any range it only partly covers.
+//
+//  - commits (IN/OUT): The reservation's committed ranges.
+//
+//  - start (IN): Start of the range.
+//
+//  - end (IN): End of the range (exclusive).
+//
+//  Return Value:
+//
+//    Returns the number of bytes which were committed.
+//
+static SIZE_T decommitRange (CommitMap *commits, UINT_PTR start, UINT_PTR end)
+{
+    SIZE_T removed = 0;
+    for (;;) {
+        CommitMap::Iterator it = commits->floor(end - 1);
+        if ((it == commits->end()) || ((*it).second <= start))
+            break;
+        UINT_PTR rangeStart = (*it).first;
+        UINT_PTR rangeEnd = (*it).second;
+        commits->erase(it);
+        UINT_PTR overlapStart = (rangeStart > start) ? rangeStart : start;
+        UINT_PTR overlapEnd = (rangeEnd < end) ? rangeEnd : end;
+        removed += overlapEnd - overlapStart;
+        // What's left after the range is never found again; what's left
+        // before it ends the search.
+        if (rangeStart < start)
+            commits->insert(rangeStart, start);
+        if (rangeEnd > end)
+            commits->insert(end, rangeEnd);
+    }
+    return removed;
+}
+
+// trackVirtualRegion - Records a region which has just been reserved, or a
+//   view which has just been mapped, unless VLD itself or an excluded module
+//   asked for it.
+//
+//  - base (IN): Base address of the region.
+//
+//  - size (IN): Size of the region.
+//
+//  - committed (IN): Bytes committed from the region's base on.
+//
+//  - view (IN): Whether the region is a mapped view of a section.
+//
+//  - context (IN): The context the call entered VLD with.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::trackVirtualRegion (UINT_PTR base, SIZE_T size, SIZE_T committed, bool view,
+    const context_t &context)
+{
+    tls_t *tls = enabledTls();
+    if ((tls == NULL) || g_DbgHelp.IsLockedByCurrentThread()) {
+        // Symbol handler mappings aren't the program's.
+        return;
+    }
+    HMODULE caller = virtualMemoryCaller(GET_RETURN_ADDRESS(context));
+    if ((caller == NULL) || (caller == (HMODULE)&__ImageBase) || isModuleExcluded(caller))
+        return;
+
+    capturedstack_t stack;
+    stack.keep = false;
+    captureStack(tls, context, stack);
+    internCallStack(stack);
+
+    vregion_t *region = new vregion_t;
+    region->size = size;
+    region->committed = committed;
+    region->commits = NULL;
+    if (!view) {
+        region->commits = new CommitMap;
+        if (committed != 0)
+            region->commits->insert(base, base + committed);
+    }
+    region->callStack = stack.callStack.detach();
+    region->threadId = GetCurrentThreadId();
+
+    CriticalSectionLocker<> cs(m_virtualLock);
+    VirtualRegionMap::Iterator regionit = m_virtualRegions->find(base);
+    if (regionit != m_virtualRegions->end()) {
+        // The region recorded there was released in a way that wasn't seen,
+        // e.g. by ntdll itself.
+        forgetVirtualRegion((*regionit).second);
+        m_virtualRegions->erase(regionit);
+    }
+    m_virtualRegions->insert(base, region);
+    m_virtualRegionCount++;
+    m_virtualReserved += size;
+    m_virtualCommitted += committed;
+}
+
+// forgetVirtualRegion - Frees a region which is no longer tracked, and takes
+//   its bytes off the totals. m_virtualLock must be held.
+//
+//  - region (IN): The region, which must already be, or be about to be,
+//      erased from the region map.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::forgetVirtualRegion (vregion_t *region)
+{
+    m_virtualRegionCount--;
+    m_virtualReserved -= region->size;
+    m_virtualCommitted -= region->committed;
+    if (region->callStack != NULL)
+        g_callStackTable.Release(region->callStack);
+    delete region->commits;
+    delete region;
+}
+
+// trackVirtualAlloc - Accounts for a successful NtAllocateVirtualMemory call.
+//   Reserving (or committing without a base address, which reserves too)
+//   records a new region, while committing within a tracked reservation adds
+//   to its committed ranges.
+//
+//  - process (IN): The process the memory was allocated in.
+//
+//  - requested (IN): The base address the caller asked for, or NULL.
+//
+//  - base (IN): The base address of the allocated range.
+//
+//  - size (IN): The size of the allocated range.
+//
+//  - type (IN): The allocation type (MEM_*).
+//
+//  - context (IN): The context the call entered VLD with.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::trackVirtualAlloc (HANDLE process, LPCVOID requested, LPCVOID base, SIZE_T size,
+    ULONG type, const context_t &context)
+{
+    if ((process != GetCurrentProcess()) || (m_virtualRegions == NULL))
+        return;
+    if (!(type & (MEM_RESERVE | MEM_COMMIT))) {
+        // MEM_RESET and the like don't change what's reserved or committed.
+        return;
+    }
+
+    if ((type & MEM_RESERVE) || (requested == NULL)) {
+        trackVirtualRegion((UINT_PTR)base, size, (type & MEM_COMMIT) ? size : 0, false, context);
+        return;
+    }
+
+    CriticalSectionLocker<> cs(m_virtualLock);
+    VirtualRegionMap::Iterator regionit = m_virtualRegions->floor((UINT_PTR)base);
+    if (regionit == m_virtualRegions->end())
+        return;
+    vregion_t *region = (*regionit).second;
+    UINT_PTR regionBase = (*regionit).first;
+    if (((UINT_PTR)base >= regionBase + region->size) || (region->commits == NULL))
+        return;
+    SIZE_T added = commitRange(region->commits, (UINT_PTR)base, (UINT_PTR)base + size);
+    region->committed += added;
+    m_virtualCommitted += added;
+}
+
+// untrackVirtualFree - Accounts for a successful NtFreeVirtualMemory call.
+//   Releasing a tracked region at its base forgets it; decommitting (or
+//   releasing part of a placeholder) takes the range off its committed
+//   ranges.
+//
+//  - process (IN): The process the memory was freed in.
+//
+//  - base (IN): The base address of the freed range.
+//
+//  - size (IN): The size of the freed range.
+//
+//  - type (IN): The free type (MEM_DECOMMIT or MEM_RELEASE).
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::untrackVirtualFree (HANDLE process, LPCVOID base, SIZE_T size, ULONG type)
+{
+    if ((process != GetCurrentProcess()) || (m_virtualRegions == NULL))
+        return;
+
+    CriticalSectionLocker<> cs(m_virtualLock);
+    VirtualRegionMap::Iterator regionit = m_virtualRegions->floor((UINT_PTR)base);
+    if (regionit == m_virtualRegions->end())
+        return;
+    vregion_t *region = (*regionit).second;
+    UINT_PTR regionBase = (*regionit).first;
+    if (((UINT_PTR)base >= regionBase + region->size) || (region->commits == NULL))
+        return;
+
+    if ((type & MEM_RELEASE) && ((UINT_PTR)base == regionBase)) {
+        forgetVirtualRegion(region);
+        m_virtualRegions->erase(regionit);
+        return;
+    }
+    if (size == 0)
+        return;
+    SIZE_T removed = decommitRange(region->commits, (UINT_PTR)base, (UINT_PTR)base + size);
+    region->committed -= removed;
+    m_virtualCommitted -= removed;
+}
+
+// untrackVirtualView - Accounts for a successful NtUnmapViewOfSection call.
+//   The view may be named by any address within it.
+//
+//  - process (IN): The process the view was unmapped from.
+//
+//  - address (IN): An address within the view.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::untrackVirtualView (HANDLE process, LPCVOID address)
+{
+    if ((process != GetCurrentProcess()) || (m_virtualRegions == NULL))
+        return;
+
+    CriticalSectionLocker<> cs(m_virtualLock);
+    VirtualRegionMap::Iterator regionit = m_virtualRegions->floor((UINT_PTR)address);
+    if (regionit == m_virtualRegions->end())
+        return;
+    vregion_t *region = (*regionit).second;
+    if (((UINT_PTR)address >= (*regionit).first + region->size) || (region->commits != NULL))
+        return;
+    forgetVirtualRegion(region);
+    m_virtualRegions->erase(regionit);
+}
+
+// reportVirtualRegions - Reports the regions still reserved, and the views
+//   still mapped, like the leaks of one more heap. The regions are copied
+//   first, so that no symbol is resolved with m_virtualLock held.
+//
+//  Return Value:
+//
+//    Returns the number of regions reported.
+//
+SIZE_T VisualLeakDetector::reportVirtualRegions ()
+{
+    if (m_virtualRegions == NULL)
+        return 0;
+
+    vregionleak_t *leaks;
+    SIZE_T count = 0;
+    SIZE_T reserved;
+    SIZE_T committed;
+    {
+        CriticalSectionLocker<> cs(m_virtualLock);
+        leaks = new vregionleak_t [m_virtualRegionCount + 1];
+        for (VirtualRegionMap::Iterator regionit = m_virtualRegions->begin();
+            regionit != m_virtualRegions->end(); ++regionit) {
+            const vregion_t *region = (*regionit).second;
+            vregionleak_t &leak = leaks[count++];
+            leak.base = (*regionit).first;
+            leak.size = region->size;
+            leak.committed = region->committed;
+            leak.view = (region->commits == NULL);
+            leak.callStack = region->callStack;
+            leak.threadId = region->threadId;
+            if (leak.callStack != NULL)
+                g_callStackTable.AddRef(leak.callStack);
+        }
+        reserved = m_virtualReserved;
+        committed = m_virtualCommitted;
+    }
+
+    for (SIZE_T index = 0; index < count; index++) {
+        const vregionleak_t &leak = leaks[index];
+        if (index == 0)
+            Report(L"WARNING: Visual Leak Detector detected virtual memory leaks!\n");
+        Report(L"---------- %s at " ADDRESSFORMAT L": %Iu bytes %s, %Iu bytes committed ----------\n",
+            leak.view ? L"View" : L"Region", leak.base, leak.size, leak.view ? L"mapped" : L"reserved",
+            leak.committed);
+        Report(L"  Call Stack (TID %u):\n", leak.threadId);
+        if (leak.callStack != NULL) {
+            leak.callStack->dump(m_options & VLD_OPT_TRACE_INTERNAL_FRAMES);
+            g_callStackTable.Release(leak.callStack);
+        }
+        Report(L"\n");
+    }
+    delete [] leaks;
+
+    if (count != 0) {
+        Report(L"Visual Leak Detector detected %Iu virtual memory region%s (%Iu bytes reserved, %Iu bytes committed)\n",
+            count, (count > 1) ? L"s" : L"", reserved, committed);
+    }
+    return count;
+}
+
+// releaseVirtualRegions - Frees every tracked region, once the hooks are
+//   removed.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::releaseVirtualRegions ()
+{
+    if (m_virtualRegions == NULL)
+        return;
+
+    CriticalSectionLocker<> cs(m_virtualLock);
+    for (VirtualRegionMap::Iterator regionit = m_virtualRegions->begin();
+        regionit != m_virtualRegions->end(); ++regionit)
+        forgetVirtualRegion((*regionit).second);
+    delete m_virtualRegions;
+    m_virtualRegions = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Virtual Memory Replacement Functions
+//
+// These are only patched into kernel32.dll and KernelBase.dll, and only with
+// TrackVirtualMemory, so VirtualAlloc(Ex), VirtualFree(Ex), MapViewOfFile(Ex)
+// and UnmapViewOfFile(Ex) are seen whichever module calls them.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// _NtAllocateVirtualMemory - Calls to NtAllocateVirtualMemory are patched
+//   through to this function. This function calls the real function, then
+//   records the region (see trackVirtualAlloc).
+//
+//  Return Value:
+//
+//    Returns the value returned by NtAllocateVirtualMemory.
+//
+NTSTATUS NTAPI VisualLeakDetector::_NtAllocateVirtualMemory (HANDLE process, PVOID *base, ULONG_PTR zerobits,
+    PSIZE_T size, ULONG type, ULONG protect)
+{
+    PVOID requested = *base;
+    NTSTATUS status = NtAllocateVirtualMemory(process, base, zerobits, size, type, protect);
+    if (status >= 0) {
+        CAPTURE_CONTEXT();
+        context_.func = reinterpret_cast<UINT_PTR>(NtAllocateVirtualMemory);
+        g_vld.trackVirtualAlloc(process, requested, *base, *size, type, context_);
+    }
+    return status;
+}
+
+// _NtAllocateVirtualMemoryEx - Calls to NtAllocateVirtualMemoryEx are patched
+//   through to this function, like _NtAllocateVirtualMemory.
+//
+//  Return Value:
+//
+//    Returns the value returned by NtAllocateVirtualMemoryEx.
+//
+NTSTATUS NTAPI VisualLeakDetector::_NtAllocateVirtualMemoryEx (HANDLE process, PVOID *base, PSIZE_T size,
+    ULONG type, ULONG protect, PVOID parameters, ULONG parametercount)
+{
+    PVOID requested = *base;
+    NTSTATUS status = NtAllocateVirtualMemoryEx(process, base, size, type, protect, parameters, parametercount);
+    if (status >= 0) {
+        CAPTURE_CONTEXT();
+        context_.func = reinterpret_cast<UINT_PTR>(NtAllocateVirtualMemoryEx);
+        g_vld.trackVirtualAlloc(process, requested, *base, *size, type, context_);
+    }
+    return status;
+}
+
+// _NtFreeVirtualMemory - Calls to NtFreeVirtualMemory are patched through to
+//   this function. This function calls the real function, then forgets what
+//   it released or decommitted (see untrackVirtualFree).
+//
+//  Return Value:
+//
+//    Returns the value returned by NtFreeVirtualMemory.
+//
+NTSTATUS NTAPI VisualLeakDetector::_NtFreeVirtualMemory (HANDLE process, PVOID *base, PSIZE_T size, ULONG type)
+{
+    NTSTATUS status = NtFreeVirtualMemory(process, base, size, type);
+    if (status >= 0)
+        g_vld.untrackVirtualFree(process, *base, *size, type);
+    return status;
+}
+
+// _NtMapViewOfSection - Calls to NtMapViewOfSection are patched through to
+//   this function. This function calls the real function, then records the
+//   view, which counts as committed as a whole.
+//
+//  Return Value:
+//
+//    Returns the value returned by NtMapViewOfSection.
+//
+NTSTATUS NTAPI VisualLeakDetector::_NtMapViewOfSection (HANDLE section, HANDLE process, PVOID *base,
+    ULONG_PTR zerobits, SIZE_T commitsize, PLARGE_INTEGER offset, PSIZE_T viewsize, ULONG inherit, ULONG type,
+    ULONG protect)
+{
+    NTSTATUS status = NtMapViewOfSection(section, process, base, zerobits, commitsize, offset, viewsize, inherit,
+        type, protect);
+    if ((status >= 0) && (process == GetCurrentProcess()) && (g_vld.m_virtualRegions != NULL) &&
+        g_vld.trackingAllocs()) {
+        CAPTURE_CONTEXT();
+        context_.func = reinterpret_cast<UINT_PTR>(NtMapViewOfSection);
+        g_vld.trackVirtualRegion((UINT_PTR)*base, *viewsize, *viewsize, true, context_);
+    }
+    return status;
+}
+
+// _NtMapViewOfSectionEx - Calls to NtMapViewOfSectionEx are patched through
+//   to this function, like _NtMapViewOfSection.
+//
+//  Return Value:
+//
+//    Returns the value returned by NtMapViewOfSectionEx.
+//
+NTSTATUS NTAPI VisualLeakDetector::_NtMapViewOfSectionEx (HANDLE section, HANDLE process, PVOID *base,
+    PLARGE_INTEGER offset, PSIZE_T viewsize, ULONG type, ULONG protect, PVOID parameters, ULONG parametercount)
+{
+    NTSTATUS status = NtMapViewOfSectionEx(section, process, base, offset, viewsize, type, protect, parameters,
+        parametercount);
+    if ((status >= 0) && (process == GetCurrentProcess()) && (g_vld.m_virtualRegions != NULL) &&
+        g_vld.trackingAllocs()) {
+        CAPTURE_CONTEXT();
+        context_.func = reinterpret_cast<UINT_PTR>(NtMapViewOfSectionEx);
+        g_vld.trackVirtualRegion((UINT_PTR)*base, *viewsize, *viewsize, true, context_);
+    }
+    return status;
+}
+
+// _NtUnmapViewOfSection - Calls to NtUnmapViewOfSection are patched through
+//   to this function. This function calls the real function, then forgets
+//   the view (see untrackVirtualView).
+//
+//  Return Value:
+//
+//    Returns the value returned by NtUnmapViewOfSection.
+//
+NTSTATUS NTAPI VisualLeakDetector::_NtUnmapViewOfSection (HANDLE process, PVOID base)
+{
+    NTSTATUS status = NtUnmapViewOfSection(process, base);
+    if (status >= 0)
+        g_vld.untrackVirtualView(process, base);
+    return status;
+}
+
+// _NtUnmapViewOfSectionEx - Calls to NtUnmapViewOfSectionEx are patched
+//   through to this function, like _NtUnmapViewOfSection.
+//
+//  Return Value:
+//
+//    Returns the value returned by NtUnmapViewOfSectionEx.
+//
+NTSTATUS NTAPI VisualLeakDetector::_NtUnmapViewOfSectionEx (HANDLE process, PVOID base, ULONG flags)
+{
+    NTSTATUS status = NtUnmapViewOfSectionEx(process, base, flags);
+    if (status >= 0)
+        g_vld.untrackVirtualView(process, base);
+    return status;
+}
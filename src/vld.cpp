@@ -25,11 +25,16 @@
 
 #pragma comment(lib, "dbghelp.lib")
 
+#include <math.h>
 #include <sys/stat.h>
+#include <TraceLoggingProvider.h>
+#include <winmeta.h>
 
 #define VLDBUILD         // Declares that we are building Visual Leak Detector.
 #include "callstack.h"   // Provides a class for handling call stacks.
 #include "crtmfcpatch.h" // Provides CRT and MFC patch functions.
+#include "etwsession.h"  // Provides the heap ETW session.
+#include "importplan.h"  // Provides the patch plans of attached modules.
 #include "map.h"         // Provides a lightweight STL-like map template.
 #include "ntapi.h"       // Provides access to NT APIs.
 #include "set.h"         // Provides a lightweight STL-like set template.
@@ -42,20 +47,42 @@
 #define HEAP_MAP_RESERVE    2   // Usually there won't be more than a few heaps in the process, so this should be small.
 #define MODULE_SET_RESERVE  16  // There are likely to be several modules loaded in the process.
 
+#define VLD_TRACE_KEYWORD_BLOCKS 0x1 // TraceLogging keyword of the events of blocks being mapped, remapped and unmapped.
+#define VLD_TRACE_KEYWORD_REPORT 0x2 // TraceLogging keyword of the events of the report phases.
+
 // Imported global variables.
-extern vldblockheader_t *g_vldBlockList;
-extern HANDLE            g_vldHeap;
+extern vldarena_t       *g_vldArenas;
 extern CriticalSection   g_vldHeapLock;
 
 // Global variables.
 HANDLE           g_currentProcess; // Pseudo-handle for the current process.
 HANDLE           g_currentThread;  // Pseudo-handle for the current thread.
 HANDLE           g_processHeap;    // Handle to the process's heap (COM allocations come from here).
-CriticalSection  g_heapMapLock;    // Serializes access to the heap and block maps.
+HeapMapLock      g_heapMapLock;    // Serializes access to the heap and block maps, sharded by block address.
 ReportHookSet*   g_pReportHooks;
+ModulePaths      g_modulePaths;    // Interns the paths and names of the modules seen loaded (outlives g_moduleImages).
+ModuleImages     g_moduleImages;   // Every module image seen loaded, which call stack frames refer to (outlives g_callStackTable).
+ContextTree      g_contextTree;    // Frames of the call stacks, with the CallingContextTree option (outlives g_callStackTable).
+ResolvedTextArena g_resolvedText;  // Holds the resolved text of every call stack (outlives g_callStackTable).
+CallStackTable   g_callStackTable; // Interns the call stacks of all tracked blocks.
+StackPrefixTable g_stackPrefixes;  // Stacks known by their innermost frames, with the AdaptiveTraceFrames option.
+MetadataRegion   g_metadataRegion; // Holds the slabs of blockinfo_t records, with the MetadataReserve option.
 DbgHelp g_DbgHelp;
+SymbolCache      g_symbolCache;    // Caches dbghelp's answers per program counter (guarded by g_DbgHelp).
+CrtStartupRanges g_crtStartupRanges; // Address ranges of the functions SkipCrtStartupLeaks looks for (guarded by g_DbgHelp).
+SymbolStore      g_symbolStore;    // Symbols resolved by earlier runs, with the SymbolCacheFile option (guarded by g_DbgHelp).
+Suppressions     g_suppressions;   // Rules of the leaks left out of the reports, with the SuppressionFile option.
 ImageDirectoryEntries g_Ide;
 LoadedModules g_LoadedModules;
+ImportPlans      g_importPlans;    // The IAT entries patched in each attached module (freed with the private heap).
+EtwHeapSession   g_etwSession;     // Tracks the heap blocks from ETW events, with the EtwHeapTracking option.
+
+// VLD's TraceLogging provider. Its events are only written while a trace
+// session has enabled it; otherwise each one costs a test of the provider's
+// enabled level. Call stacks are identified by their hash, which is what the
+// CallStackTable interns them by.
+TRACELOGGING_DEFINE_PROVIDER(g_vldTraceProvider, "VisualLeakDetector",
+    (0x0d658938, 0x04eb, 0x4a84, 0x97, 0x34, 0x10, 0xa6, 0x17, 0x3c, 0x9f, 0xbe));
 
 // The one and only VisualLeakDetector object instance.
 __declspec(dllexport) VisualLeakDetector g_vld;
@@ -73,6 +100,21 @@ moduleentry_t ntdllPatch [] = {
     "ntdll.dll",    FALSE,  NULL,   ldrLoadDllPatch,
 };
 
+// Patch these entries in Kernel32.dll and KernelBase.dll with TrackVirtualMemory
+patchentry_t virtualMemoryPatch [] = {
+    "NtAllocateVirtualMemory",   NULL, VisualLeakDetector::_NtAllocateVirtualMemory,
+    "NtAllocateVirtualMemoryEx", NULL, VisualLeakDetector::_NtAllocateVirtualMemoryEx,
+    "NtFreeVirtualMemory",       NULL, VisualLeakDetector::_NtFreeVirtualMemory,
+    "NtMapViewOfSection",        NULL, VisualLeakDetector::_NtMapViewOfSection,
+    "NtMapViewOfSectionEx",      NULL, VisualLeakDetector::_NtMapViewOfSectionEx,
+    "NtUnmapViewOfSection",      NULL, VisualLeakDetector::_NtUnmapViewOfSection,
+    "NtUnmapViewOfSectionEx",    NULL, VisualLeakDetector::_NtUnmapViewOfSectionEx,
+    NULL,                        NULL, NULL
+};
+moduleentry_t ntdllVirtualMemoryPatch [] = {
+    "ntdll.dll",    FALSE,  NULL,   virtualMemoryPatch,
+};
+
 /////////////////////////////////////////////////////////
 
 // We provide our own DllEntryPoint in order to capture the ReturnAddress of the function calling our DllEntryPoint.
@@ -81,7 +123,7 @@ moduleentry_t ntdllPatch [] = {
 // to properly capture all _CRT_INIT memory allocations which include internal CRT startup memory allocations and all
 // global and static initializers.
 //
-// In getLeaksCount(), reportLeaks() and resolveStacks(), we take extra measures to identify and exclude debug and release
+// In countBlock(), reportLeaks() and collectStacks(), we take extra measures to identify and exclude debug and release
 // internal CRT allocations from reporting as real memory leaks.
 //
 // Global and static initializers *might* be reported as memory leaks based on the order being unintialised by _CRT_INIT.
@@ -91,7 +133,9 @@ BOOLEAN WINAPI LdrpCallInitRoutine(IN PVOID BaseAddress, IN ULONG Reason, IN PVO
 {
     LoaderLock ll;
 
-    if (Reason == DLL_PROCESS_ATTACH) {
+    if ((Reason == DLL_PROCESS_ATTACH) && !g_vld.ModuleLoadsNotified()) {
+        // Without loader notifications, every module has to be re-examined
+        // before each DLL is initialized.
         g_vld.RefreshModules();
     }
 
@@ -298,6 +342,10 @@ BOOL WINAPI DllEntryPoint(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpReserved
         if (!_CRT_INIT(hinstDLL, fdwReason, lpReserved))
             return(FALSE);
 
+    if (fdwReason == DLL_THREAD_DETACH) {
+        g_vld.retireTls();
+    }
+
     if (fdwReason == DLL_PROCESS_DETACH) {
         NtDllRestore(patch);
     }
@@ -339,16 +387,88 @@ bool IsWindows8OrGreater()
 //
 VisualLeakDetector::VisualLeakDetector ()
 {
+    UINT64 startupStart = __rdtsc();
+    ZeroMemory(&m_startupStats, sizeof(m_startupStats));
     _set_error_mode(_OUT_TO_STDERR);
 
     // Initialize configuration options and related private data.
     _wcsnset_s(m_forcedModuleList, MAXMODULELISTLENGTH, '\0', _TRUNCATE);
+    _wcsnset_s(m_ignoredHeapModules, MAXMODULELISTLENGTH, '\0', _TRUNCATE);
+    m_tracePolicyCount = 0;
+    ZeroMemory((PVOID)m_ignoredHeaps, sizeof(m_ignoredHeaps));
     m_maxDataDump    = 0xffffffff;
-    m_maxTraceFrames = 0xffffffff;
+    ZeroMemory(&m_initialPolicy, sizeof(m_initialPolicy));
+    m_initialPolicy.maxTraceFrames = 0xffffffff;
+    m_capturePolicy  = &m_initialPolicy;
+    m_summaryCount   = VLD_DEFAULT_SUMMARY_COUNT;
+    m_summaryGroupBy = VLD_GROUP_BY_STACK;
+    m_threadExitTimeout = VLD_DEFAULT_THREAD_EXIT_TIMEOUT;
+    m_suppressionCount = 0;
+    m_baselineThreshold = 0;
+    m_baselineSites  = NULL;
+    m_baselineRecords = NULL;
+    m_reachabilityScan = VLD_REACHABILITY_OFF;
+    m_symbolizer = VLD_SYMBOLIZER_DBGHELP;
+    m_symbolLevel = VLD_SYMBOLS_LINE;
+    m_sizeClasses     = false;
+    m_addressIndex    = false;
+    m_deferHeapReports = false;
+    m_peakStep        = 0;
+    m_nextPeakSnapshot = 0;
+    m_telemetryFilePath[0] = L'\0';
+    m_telemetryInterval = VLD_DEFAULT_TELEMETRY_INTERVAL;
+    m_telemetrySiteCount = 0;
+    m_idleResolveInterval = 0;
+    m_allocTraceFilePath[0] = L'\0';
+    m_crashSnapshotPath[0] = L'\0';
+    m_growthTrigger   = 0;
+    m_autoExcludeHot  = false;
+    m_hotModuleRate   = VLD_DEFAULT_HOT_MODULE_RATE;
+    m_hotModuleWarmup = VLD_DEFAULT_HOT_MODULE_WARMUP;
+    m_watchIniFile    = false;
+    m_iniFilePath[0]  = L'\0';
+    ZeroMemory(&m_iniWriteTime, sizeof(m_iniWriteTime));
+    m_reportThreadCount = 0;
+    m_metadataReserve = 0;
+    m_maxMetadata    = 0;
+    m_degradation    = VLD_DEGRADED_NONE;
+    m_compactPeak    = 0;
+    m_compacting     = 0;
+    ZeroMemory(m_degradedSerial, sizeof(m_degradedSerial));
+    m_estimatedLeakBytes = 0;
+    m_timeResolution = 0;
+    m_timeLock.Initialize();
+    m_timeRecords    = NULL;
+    m_timeRecordCount = 0;
+    m_lastRecordTime = 0;
+    m_reportBefore   = (SIZE_T)-1;
+    ZeroMemory(&m_reportStats, sizeof(m_reportStats));
+    ZeroMemory(&m_moduleStats, sizeof(m_moduleStats));
+    m_lockProfiling  = false;
+    m_packStacks     = false;
+    m_reallocStackPolicy = VLD_REALLOC_STACK_ORIGINAL;
+    m_trackVirtualMemory = false;
+    m_heapWalkTracking = false;
+    m_fastExit = true;
+    ZeroMemory(&m_sizingReserve, sizeof(m_sizingReserve));
+    ZeroMemory(&m_sizingPeak, sizeof(m_sizingPeak));
+    m_heapsMapped = 0;
+    m_remoteFreeQueue = false;
+    m_recentFreeRing = false;
+    m_validateHeapFreeRate = 1;
+    m_remoteFrees = NULL;
+    m_remoteFreeCount = 0;
+    m_traceDatabaseWarned = false;
+    ZeroMemory((PVOID)m_lockProfiles, sizeof(m_lockProfiles));
+    m_latencyProfiling = false;
+    ZeroMemory(&m_retiredLatency, sizeof(m_retiredLatency));
+    m_lockProfileTicks = 0;
+    m_lockProfileCounter = 0;
     m_options        = 0x0;
-    m_reportFile     = NULL;
+    m_reportPipe     = NULL;
     wcsncpy_s(m_reportFilePath, MAX_PATH, VLD_DEFAULT_REPORT_FILE_NAME, _TRUNCATE);
     m_status         = 0x0;
+    m_tracking       = 0x0;
 
     HMODULE ntdll = GetModuleHandleW(L"ntdll.dll");
     if (ntdll)
@@ -370,14 +490,34 @@ VisualLeakDetector::VisualLeakDetector ()
         LdrUnloadDll = (LdrUnloadDll_t)GetProcAddress(ntdll, "LdrUnloadDll");
         LdrLockLoaderLock = (LdrLockLoaderLock_t)GetProcAddress(ntdll, "LdrLockLoaderLock");
         LdrUnlockLoaderLock = (LdrUnlockLoaderLock_t)GetProcAddress(ntdll, "LdrUnlockLoaderLock");
+        LdrRegisterDllNotification = (LdrRegisterDllNotification_t)GetProcAddress(ntdll, "LdrRegisterDllNotification");
+        LdrUnregisterDllNotification = (LdrUnregisterDllNotification_t)GetProcAddress(ntdll, "LdrUnregisterDllNotification");
+        m_NtQueryInformationThread = (NtQueryInformationThread_t)GetProcAddress(ntdll, "NtQueryInformationThread");
+
+        NtAllocateVirtualMemory = (NtAllocateVirtualMemory_t)GetProcAddress(ntdll, "NtAllocateVirtualMemory");
+        NtAllocateVirtualMemoryEx = (NtAllocateVirtualMemoryEx_t)GetProcAddress(ntdll, "NtAllocateVirtualMemoryEx");
+        NtFreeVirtualMemory = (NtFreeVirtualMemory_t)GetProcAddress(ntdll, "NtFreeVirtualMemory");
+        NtMapViewOfSection = (NtMapViewOfSection_t)GetProcAddress(ntdll, "NtMapViewOfSection");
+        NtMapViewOfSectionEx = (NtMapViewOfSectionEx_t)GetProcAddress(ntdll, "NtMapViewOfSectionEx");
+        NtUnmapViewOfSection = (NtUnmapViewOfSection_t)GetProcAddress(ntdll, "NtUnmapViewOfSection");
+        NtUnmapViewOfSectionEx = (NtUnmapViewOfSectionEx_t)GetProcAddress(ntdll, "NtUnmapViewOfSectionEx");
+
+        RtlCreateQueryDebugBuffer = (RtlCreateQueryDebugBuffer_t)GetProcAddress(ntdll, "RtlCreateQueryDebugBuffer");
+        RtlQueryProcessDebugInformation = (RtlQueryProcessDebugInformation_t)GetProcAddress(ntdll,
+            "RtlQueryProcessDebugInformation");
+        RtlDestroyQueryDebugBuffer = (RtlDestroyQueryDebugBuffer_t)GetProcAddress(ntdll, "RtlDestroyQueryDebugBuffer");
+        RtlDllShutdownInProgress = (RtlDllShutdownInProgress_t)GetProcAddress(ntdll, "RtlDllShutdownInProgress");
     }
 
     // Load configuration options.
+    UINT64 phaseStart = __rdtsc();
     configure();
+    m_startupStats.configureTicks = __rdtsc() - phaseStart;
     if (m_options & VLD_OPT_VLDOFF) {
         Report(L"Visual Leak Detector is turned off.\n");
         return;
     }
+    TraceLoggingRegister(g_vldTraceProvider);
 
     HMODULE kernel32 = GetModuleHandleW(L"kernel32.dll");
     HMODULE kernelBase = GetModuleHandleW(L"KernelBase.dll");
@@ -397,35 +537,193 @@ VisualLeakDetector::VisualLeakDetector ()
         assert(m_patchTable[0].patchTable == m_kernelbasePatch);
         m_patchTable[0].exportModuleName = "kernelbase.dll";
     }
+    // Thread descriptions only exist from Windows 10, version 1607 on.
+    if (kernelBase)
+        m_GetThreadDescription = (GetThreadDescription_t)GetProcAddress(kernelBase, "GetThreadDescription");
 
     // Initialize global variables.
     g_currentProcess = GetCurrentProcess();
     g_currentThread = GetCurrentThread();
-    g_processHeap = GetProcessHeap();
+    g_processHeap = GetProcessHeap();
 
     LoaderLock ll;
 
     g_heapMapLock.Initialize();
-    g_vldHeap         = HeapCreate(0x0, 0, 0);
-    g_vldHeapLock.Initialize();
+    CreateVldHeap();
+
+    // Attach the lock profiles before anything else is allocated, so that
+    // the trees created from now on are profiled too.
+    if (m_lockProfiling || m_latencyProfiling) {
+        LARGE_INTEGER counter;
+        QueryPerformanceCounter(&counter);
+        m_lockProfileCounter = counter.QuadPart;
+        m_lockProfileTicks = __rdtsc();
+    }
+    g_heapMapLock.Profile(lockProfile(VLD_LOCK_HEAP_MAP));
+    g_vldHeapLock.Profile(lockProfile(VLD_LOCK_VLD_HEAP));
+    g_DbgHelp.Profile(lockProfile(VLD_LOCK_DBGHELP));
+    g_Ide.Profile(lockProfile(VLD_LOCK_DBGHELP));
+    g_LoadedModules.Profile(lockProfile(VLD_LOCK_DBGHELP));
+    g_treeLockProfile = lockProfile(VLD_LOCK_TREES);
+    if (m_metadataReserve != 0) {
+        SIZE_T reserve = (SIZE_T)m_metadataReserve * 1024 * 1024;
+        if ((m_metadataFilePath[0] == '\0') || !g_metadataRegion.CreateMapped(reserve, m_metadataFilePath))
+            g_metadataRegion.Create(reserve, m_options & VLD_OPT_LARGE_PAGES);
+    }
     g_pReportHooks    = new ReportHookSet;
 
+    // Size the containers after the previous run, if it left a profile.
+    if (m_sizingProfilePath[0] != L'\0')
+        loadSizingProfile();
+
     // Initialize remaining private data.
     m_heapMap         = new HeapMap;
-    m_heapMap->reserve(HEAP_MAP_RESERVE);
+    m_heapMap->reserve(sizedReserve(m_sizingReserve.heaps, HEAP_MAP_RESERVE));
     m_iMalloc         = NULL;
     m_requestCurr     = 1;
+    m_serialEpoch     = 0;
     m_totalAlloc      = 0;
     m_curAlloc        = 0;
     m_maxAlloc        = 0;
     m_loadedModules   = new ModuleSet();
+    m_moduleRanges    = NULL;
+    m_rangeEpoch      = 1;
+    m_patchIndex      = NULL;
+    m_dllNotificationCookie = NULL;
     m_optionsLock.Initialize();
+    m_policyLock.Initialize();
     m_modulesLock.Initialize();
+    m_modulesLock.Profile(lockProfile(VLD_LOCK_MODULES));
     m_selfTestFile    = __FILE__;
     m_selfTestLine    = 0;
     m_tlsIndex        = TlsAlloc();
     m_tlsLock.Initialize();
+    m_tlsLock.Profile(lockProfile(VLD_LOCK_TLS));
     m_tlsMap          = new TlsMap;
+    m_freeTls         = NULL;
+    ZeroMemory(&m_retiredStats, sizeof(m_retiredStats));
+    m_tagLock.Initialize();
+    ZeroMemory(m_tagNames, sizeof(m_tagNames));
+    m_tagCount        = 1;
+    m_tagIds          = new HashMap<UINT_PTR, WORD>;
+    m_callerSiteLock.Initialize();
+    m_callerSites     = new HashMap<UINT_PTR, CallStack*>;
+    m_deferredHeaps   = NULL;
+    m_deferredHeapLock.Initialize();
+    m_peakLock.Initialize();
+    m_peakSites       = NULL;
+    m_peakSiteCount   = 0;
+    m_peakBytes       = 0;
+    ZeroMemory(m_threadTable, sizeof(m_threadTable));
+    m_threadTable[0]  = new DWORD [VLD_THREAD_TABLE_PAGE];
+    m_threadTable[0][0] = 0;
+    m_threadCount     = 1;
+    ZeroMemory(m_threadLeaks, sizeof(m_threadLeaks));
+    m_threadLeaks[0]  = new threadleaks_t [VLD_THREAD_TABLE_PAGE];
+    ZeroMemory(m_threadLeaks[0], VLD_THREAD_TABLE_PAGE * sizeof(threadleaks_t));
+    ZeroMemory(m_threadNames, sizeof(m_threadNames));
+    m_threadNames[0]  = new LPWSTR [VLD_THREAD_TABLE_PAGE];
+    ZeroMemory(m_threadNames[0], VLD_THREAD_TABLE_PAGE * sizeof(LPWSTR));
+    m_leakCount       = 0;
+    m_unclassifiedLeaks = 0;
+    m_reportedMark    = 0;
+    m_liveViewMapping = NULL;
+    m_liveView        = NULL;
+    m_liveViewThread  = NULL;
+    m_liveViewThreadId = 0;
+    m_liveViewWake    = NULL;
+    m_liveViewStop    = FALSE;
+    m_liveViewLock.Initialize();
+    m_perfProvider    = NULL;
+    m_perfInstance    = NULL;
+    m_perfThread      = NULL;
+    m_perfThreadId    = 0;
+    m_perfWake        = NULL;
+    m_perfStop        = FALSE;
+    m_perfLock.Initialize();
+    m_telemetryFile   = NULL;
+    m_telemetryStart  = 0;
+    m_telemetrySites  = NULL;
+    m_telemetryThread = NULL;
+    m_telemetryThreadId = 0;
+    m_telemetryWake   = NULL;
+    m_telemetryStop   = FALSE;
+    m_telemetryLock.Initialize();
+    m_virtualLock.Initialize();
+    m_virtualRegions  = m_trackVirtualMemory ? new VirtualRegionMap : NULL;
+    m_virtualRegionCount = 0;
+    m_virtualReserved = 0;
+    m_virtualCommitted = 0;
+    m_allocTracing    = FALSE;
+    m_allocTraceFile  = INVALID_HANDLE_VALUE;
+    m_allocTraceMapping = NULL;
+    m_allocTraceView  = NULL;
+    m_allocTraceWindow = 0;
+    m_allocTraceOffset = 0;
+    m_allocTraceEvents = 0;
+    ZeroMemory(&m_allocTraceHeader, sizeof(m_allocTraceHeader));
+    m_allocTraceThread = NULL;
+    m_allocTraceThreadId = 0;
+    m_allocTraceWake  = NULL;
+    m_allocTraceLock.Initialize();
+    m_prefetchThread  = NULL;
+    m_prefetchThreadId = 0;
+    m_prefetchWake    = NULL;
+    m_prefetchHead    = 0;
+    m_prefetchCount   = 0;
+    m_prefetchStop    = FALSE;
+    m_prefetchLock.Initialize();
+    m_symbolServers   = NULL;
+    m_symbolLoadStart = 0;
+    m_symbolLoadBase  = 0;
+    m_symbolLoadCanceled = FALSE;
+    m_symbolFetchThread = NULL;
+    m_symbolFetchThreadId = 0;
+    m_symbolFetchWake = NULL;
+    m_symbolFetchHead = 0;
+    m_symbolFetchCount = 0;
+    m_symbolFetchStop = FALSE;
+    m_symbolFetchLock.Initialize();
+    m_idleResolveThread = NULL;
+    m_idleResolveThreadId = 0;
+    m_idleResolveWake = NULL;
+    m_idleResolveStop = FALSE;
+    m_growthCheckpoint = 0;
+    m_growthSnapshot  = 0;
+    m_growthThread    = NULL;
+    m_growthThreadId  = 0;
+    m_growthWake      = NULL;
+    m_growthStop      = FALSE;
+    m_hotModuleThread = NULL;
+    m_hotModuleThreadId = 0;
+    m_hotModuleWake   = NULL;
+    m_hotModuleStop   = FALSE;
+    m_iniWatchThread  = NULL;
+    m_iniWatchThreadId = 0;
+    m_iniWatchWake    = NULL;
+    m_iniWatchChange  = NULL;
+    m_iniWatchStop    = FALSE;
+    m_crashFile       = INVALID_HANDLE_VALUE;
+    m_crashBuffer     = NULL;
+    m_crashStacks     = NULL;
+    m_crashHandler    = NULL;
+    m_crashPrevFilter = NULL;
+    m_crashState      = VLD_CRASH_IDLE;
+    ZeroMemory(m_moduleCounters, sizeof(m_moduleCounters));
+    ZeroMemory(m_reportThreads, sizeof(m_reportThreads));
+    ZeroMemory(m_reportThreadIds, sizeof(m_reportThreadIds));
+    m_reportWork      = NULL;
+    m_reportDone      = NULL;
+    m_reportJob       = NULL;
+    m_scanJob         = NULL;
+    m_symbolJob       = NULL;
+    m_reachScan       = NULL;
+    m_reportStop      = FALSE;
+    m_reportJobLock.Initialize();
+    m_asyncReportThread = NULL;
+    m_asyncReportThreadId = 0;
+    m_asyncReport     = NULL;
+    m_asyncReportStop = FALSE;
 
     if (m_options & VLD_OPT_SELF_TEST) {
         // Self-test mode has been enabled. Intentionally leak a small amount of
@@ -452,6 +750,9 @@ VisualLeakDetector::VisualLeakDetector ()
         // debugger gets lost if it's sent too fast).
         InsertReportDelay();
     }
+    // From now on the report is buffered and written out by a separate
+    // thread, in large chunks.
+    StartReportWriter();
 
     // This is highly unlikely to happen, but just in case, check to be sure
     // we got a valid TLS index.
@@ -461,50 +762,127 @@ VisualLeakDetector::VisualLeakDetector ()
         return;
     }
 
-    // Initialize the symbol handler. We use it for obtaining source file/line
-    // number information and function names for the memory leak report.
-    LPWSTR symbolpath = buildSymbolSearchPath();
-#ifdef NOISY_DBGHELP_DIAGOSTICS
-    // From MSDN docs about SYMOPT_DEBUG:
-    /* To view all attempts to load symbols, call SymSetOptions with SYMOPT_DEBUG.
-    This causes DbgHelp to call the OutputDebugString function with detailed
-    information on symbol searches, such as the directories it is searching and and error messages.
-    In other words, this will really pollute the debug output window with extra messages.
-    To enable this debug output to be displayed to the console without changing your source code,
-    set the DBGHELP_DBGOUT environment variable to a non-NULL value before calling the SymInitialize function.
-    To log the information to a file, set the DBGHELP_LOG environment variable to the name of the log file to be used.
-    */
-    g_DbgHelp.SymSetOptions(SYMOPT_DEBUG | SYMOPT_UNDNAME | SYMOPT_DEFERRED_LOADS | SYMOPT_LOAD_LINES);
-#else
-    g_DbgHelp.SymSetOptions(SYMOPT_UNDNAME | SYMOPT_DEFERRED_LOADS | SYMOPT_LOAD_LINES);
-#endif
-    DbgTrace(L"dbghelp32.dll %i: SymInitializeW\n", GetCurrentThreadId());
-    if (!g_DbgHelp.SymInitializeW(g_currentProcess, symbolpath, FALSE)) {
-        Report(L"WARNING: Visual Leak Detector: The symbol handler failed to initialize (error=%lu).\n"
-            L"    File and function names will probably not be available in call stacks.\n", GetLastError());
-    }
-    delete [] symbolpath;
+    // The symbol handler, which we use for obtaining source file/line number
+    // information and function names for the memory leak report, is only
+    // initialized the first time symbols are needed; most processes exit
+    // without ever resolving a call stack.
+    g_DbgHelp.DeferInitialize(initializeSymbolHandler);
 
+    // With HeapWalkTracking, nothing at all is hooked (see heapwalk.cpp).
     ntdllPatch[0].moduleBase = (UINT_PTR)ntdll;
-    PatchImport(kernel32, ntdllPatch);
-    if (kernelBase != NULL)
-        PatchImport(kernelBase, ntdllPatch);
+    if (!m_heapWalkTracking) {
+        PatchImport(kernel32, ntdllPatch);
+        if (kernelBase != NULL)
+            PatchImport(kernelBase, ntdllPatch);
+    }
+    if ((m_virtualRegions != NULL) && !m_heapWalkTracking) {
+        // VirtualAlloc, MapViewOfFile and the like all end up in these.
+        ntdllVirtualMemoryPatch[0].moduleBase = (UINT_PTR)ntdll;
+        PatchImport(kernel32, ntdllVirtualMemoryPatch);
+        if (kernelBase != NULL)
+            PatchImport(kernelBase, ntdllVirtualMemoryPatch);
+    }
+    if ((m_options & VLD_OPT_ETW_HEAP_TRACKING) && !m_heapWalkTracking)
+        g_etwSession.Start();
+    if ((m_options & VLD_OPT_INLINE_HEAP_HOOKS) && !g_etwSession.IsActive() && !m_heapWalkTracking)
+        installHeapHooks();
+
+    // The process heap is mapped right away, so that _GetProcessHeap only
+    // has to compare handles.
+    mapHeap(g_processHeap);
+
+    // Read the patch plans made by earlier runs, if any.
+    if (m_patchPlanCachePath[0] != L'\0')
+        g_importPlans.Open(m_patchPlanCachePath);
 
     // Attach Visual Leak Detector to every module loaded in the process.
     ModuleSet* newmodules = new ModuleSet();
-    newmodules->reserve(MODULE_SET_RESERVE);
+    newmodules->reserve(sizedReserve(m_sizingReserve.modules, MODULE_SET_RESERVE));
     DbgTrace(L"dbghelp32.dll %i: EnumerateLoadedModulesW64\n", GetCurrentThreadId());
+    phaseStart = __rdtsc();
     g_LoadedModules.EnumerateLoadedModulesW64(g_currentProcess, addLoadedModule, newmodules);
+    noteModuleSizing(newmodules);
+    m_startupStats.moduleEnumTicks = __rdtsc() - phaseStart;
+    phaseStart = __rdtsc();
     attachToLoadedModules(newmodules);
+    m_startupStats.modulePatchTicks = __rdtsc() - phaseStart;
+    for (ModuleSet::Iterator moduleit = newmodules->begin(); moduleit != newmodules->end(); ++moduleit)
+        m_startupStats.modules++;
     ModuleSet* oldmodules = m_loadedModules;
     m_loadedModules = newmodules;
     delete oldmodules;
+    {
+        CriticalSectionLocker<> cs(m_modulesLock);
+        publishModuleRanges();
+        publishPatchIndex();
+    }
     m_status |= VLD_STATUS_INSTALLED;
+    if (!(m_options & VLD_OPT_START_DISABLED))
+        InterlockedOr(&m_tracking, VLD_TRACKING_ALLOCS);
+
+    // From now on, attach to each module as it's loaded, instead of
+    // re-enumerating every module whenever a DLL is initialized.
+    if (LdrRegisterDllNotification != NULL) {
+        if (LdrRegisterDllNotification(0, dllNotification, NULL, &m_dllNotificationCookie) != STATUS_SUCCESS)
+            m_dllNotificationCookie = NULL;
+    }
 
     m_dbghlpBase = GetModuleHandleW(L"dbghelp.dll");
     if (m_dbghlpBase)
         ChangeModuleState(m_dbghlpBase, false);
 
+    // Without hooks, the blocks allocated so far are found by walking the
+    // heaps, and don't count as leaks.
+    if (m_heapWalkTracking) {
+        walkHeaps();
+        MarkAllLeaksAsReported();
+    }
+
+    if (m_liveViewInterval != 0)
+        startLiveView();
+
+    if (m_perfCounterInterval != 0)
+        startPerfCounters();
+
+    if (m_telemetryFilePath[0] != L'\0')
+        startTelemetry();
+
+    if (m_allocTraceFilePath[0] != L'\0')
+        startAllocTrace();
+
+    if (m_options & VLD_OPT_PREFETCH_SYMBOLS)
+        startSymbolPrefetch();
+
+    if (m_symbolServerTimeout != 0)
+        startSymbolFetch();
+
+    if (m_idleResolveInterval != 0)
+        startIdleResolve();
+
+    if (m_growthTrigger != 0)
+        startGrowthWatchdog();
+
+    if (m_autoExcludeHot)
+        startHotModuleWatch();
+
+    if (m_crashSnapshotPath[0] != L'\0')
+        startCrashSnapshot();
+
+    if (m_watchIniFile)
+        startIniWatch();
+
+    if (m_reportThreadCount != 0)
+        startReportThreads();
+
+    if (m_symbolStorePath[0] != '\0')
+        g_symbolStore.Open(m_symbolStorePath);
+
+    if (m_suppressionFilePath[0] != L'\0')
+        m_suppressionCount = g_suppressions.Load(m_suppressionFilePath);
+
+    if (m_baselineFilePath[0] != L'\0')
+        loadBaseline();
+
     Report(L"Visual Leak Detector Version " VLDVERSION L" installed.\n");
     if (m_status & VLD_STATUS_FORCE_REPORT_TO_FILE) {
         // The report is being forced to a file. Let the human know why.
@@ -514,52 +892,113 @@ VisualLeakDetector::VisualLeakDetector ()
             L"  been specified, the default file name is \"" VLD_DEFAULT_REPORT_FILE_NAME L"\".\n");
     }
     reportConfig();
+    m_startupStats.startupTicks = __rdtsc() - startupStart;
+}
+
+// isVLDThread - Checks whether a thread is one of VLD's own: the report
+//   writer, live view, telemetry, allocation trace, symbol prefetch, idle-time
+//   resolver, growth watchdog, asynchronous report, report formatting or ETW consumer thread.
+//
+//  - threadId (IN): ID of the thread.
+//
+//  Return Value:
+//
+//    Returns true if the thread is one of VLD's.
+//
+bool VisualLeakDetector::isVLDThread (DWORD threadId) const
+{
+    return (threadId == GetReportWriterThreadId()) ||
+        (threadId == m_liveViewThreadId) ||
+        (threadId == m_perfThreadId) ||
+        (threadId == m_telemetryThreadId) ||
+        (threadId == m_allocTraceThreadId) ||
+        (threadId == m_prefetchThreadId) ||
+        (threadId == m_symbolFetchThreadId) ||
+        (threadId == m_idleResolveThreadId) ||
+        (threadId == m_growthThreadId) ||
+        (threadId == m_hotModuleThreadId) ||
+        (threadId == m_iniWatchThreadId) ||
+        (threadId == m_asyncReportThreadId) ||
+        isReportThread(threadId) ||
+        (threadId == g_etwSession.ThreadId());
 }
 
+// waitForAllVLDThreads - Waits for the threads which entered VLD's code and
+//   are still running to exit, for up to ThreadExitTimeout seconds in all.
+//   The threads are waited on together, MAXIMUM_WAIT_OBJECTS at a time, so
+//   the wait is bounded however many there are.
+//
+//  Return Value:
+//
+//    Returns true if any thread took more than 10 seconds to exit, or hadn't
+//    exited by the deadline.
+//
 bool VisualLeakDetector::waitForAllVLDThreads()
 {
-    bool threadsactive = false;
     DWORD dwCurProcessID = GetCurrentProcessId();
-    int waitcount = 0;
 
-    // See if any threads that have ever entered VLD's code are still active.
-    CriticalSectionLocker<> cs(m_tlsLock);
-    for (TlsMap::Iterator tlsit = m_tlsMap->begin(); tlsit != m_tlsMap->end(); ++tlsit) {
-        if ((*tlsit).second->threadId == GetCurrentThreadId()) {
-            // Don't wait for the current thread to exit.
-            continue;
-        }
+    // See if any threads that have entered VLD's code are still active. Exited
+    // threads have left the TlsSet (see retireTls). The handles are gathered
+    // first, so that the TLS lock isn't held while waiting.
+    HANDLE *threads;
+    size_t threadCount = 0;
+    {
+        CriticalSectionLocker<> cs(m_tlsLock);
+        size_t capacity = 0;
+        for (TlsMap::Iterator tlsit = m_tlsMap->begin(); tlsit != m_tlsMap->end(); ++tlsit)
+            capacity++;
+        threads = new HANDLE [capacity + 1];
+        for (TlsMap::Iterator tlsit = m_tlsMap->begin(); tlsit != m_tlsMap->end(); ++tlsit) {
+            if ((*tlsit).second->threadId == GetCurrentThreadId()) {
+                // Don't wait for the current thread to exit.
+                continue;
+            }
+            if (isVLDThread((*tlsit).second->threadId)) {
+                // VLD's own threads are stopped separately.
+                continue;
+            }
 
-        HANDLE thread = OpenThread(SYNCHRONIZE | THREAD_QUERY_INFORMATION, FALSE, (*tlsit).second->threadId);
-        if (thread == NULL) {
-            // Couldn't query this thread. We'll assume that it exited.
-            continue; // XXX should we check GetLastError()?
-        }
-        if (GetProcessIdOfThread(thread) != dwCurProcessID) {
-            //The thread ID has been recycled.
-            CloseHandle(thread);
-            continue;
-        }
-        if (WaitForSingleObject(thread, 10000) == WAIT_TIMEOUT) { // 10 seconds
-            // There is still at least one other thread running. The CRT
-            // will stomp it dead when it cleans up, which is not a
-            // graceful way for a thread to go down. Warn about this,
-            // and wait until the thread has exited so that we know it
-            // can't still be off running somewhere in VLD's code.
-            //
-            // Since we've been waiting a while, let the human know we are
-            // still here and alive.
-            waitcount++;
-            threadsactive = true;
-            if (waitcount >= 9) // 90 sec.
-            {
+            HANDLE thread = OpenThread(SYNCHRONIZE | THREAD_QUERY_INFORMATION, FALSE, (*tlsit).second->threadId);
+            if (thread == NULL) {
+                // Couldn't query this thread. We'll assume that it exited.
+                continue; // XXX should we check GetLastError()?
+            }
+            if (GetProcessIdOfThread(thread) != dwCurProcessID) {
+                //The thread ID has been recycled.
                 CloseHandle(thread);
-                return threadsactive;
+                continue;
             }
-            Report(L"Visual Leak Detector: Waiting for threads to terminate...\n");
+            threads[threadCount++] = thread;
         }
-        CloseHandle(thread);
     }
+
+    bool threadsactive = false;
+    ULONGLONG deadline = GetTickCount64() + (ULONGLONG)m_threadExitTimeout * 1000;
+    size_t first = 0;
+    while (first < threadCount) {
+        DWORD batch = (DWORD)min(threadCount - first, (size_t)MAXIMUM_WAIT_OBJECTS);
+        ULONGLONG now = GetTickCount64();
+        DWORD timeout = (now < deadline) ? (DWORD)min(deadline - now, (ULONGLONG)10000) : 0; // 10 seconds at a time
+        if (WaitForMultipleObjects(batch, &threads[first], TRUE, timeout) != WAIT_TIMEOUT) {
+            first += batch;
+            continue;
+        }
+        // There is still at least one other thread running. The CRT will
+        // stomp it dead when it cleans up, which is not a graceful way for a
+        // thread to go down. Warn about this, and wait until the thread has
+        // exited so that we know it can't still be off running somewhere in
+        // VLD's code.
+        threadsactive = true;
+        if (timeout == 0)
+            break;
+        // Since we've been waiting a while, let the human know we are still
+        // here and alive.
+        Report(L"Visual Leak Detector: Waiting for threads to terminate...\n");
+    }
+
+    for (size_t index = 0; index < threadCount; index++)
+        CloseHandle(threads[index]);
+    delete [] threads;
     return threadsactive;
 }
 
@@ -572,29 +1011,29 @@ void VisualLeakDetector::checkInternalMemoryLeaks()
 
     // Do a memory leak self-check.
     SIZE_T  internalleaks = 0;
-    vldblockheader_t *header = g_vldBlockList;
-    while (header) {
-        // Doh! VLD still has an internally allocated block!
-        // This won't ever actually happen, right guys?... guys?
-        internalleaks++;
-        leakfile = header->file;
-        leakline = header->line;
-        mbstowcs_s(&count, leakfilew, MAX_PATH, leakfile, _TRUNCATE);
-        Report(L"ERROR: Visual Leak Detector: Detected a memory leak internal to Visual Leak Detector!!\n");
-        Report(L"---------- Block %Iu at " ADDRESSFORMAT L": %Iu bytes ----------\n", header->serialNumber, VLDBLOCKDATA(header), header->size);
-        Report(L"  Call Stack:\n");
-        Report(L"    %s (%d): Full call stack not available.\n", leakfilew, leakline);
-        if (m_maxDataDump != 0) {
-            Report(L"  Data:\n");
-            if (m_options & VLD_OPT_UNICODE_REPORT) {
-                DumpMemoryW(VLDBLOCKDATA(header), (m_maxDataDump < header->size) ? m_maxDataDump : header->size);
-            }
-            else {
-                DumpMemoryA(VLDBLOCKDATA(header), (m_maxDataDump < header->size) ? m_maxDataDump : header->size);
+    for (vldarena_t *arena = g_vldArenas; arena != NULL; arena = arena->next) {
+        for (vldblockheader_t *header = arena->blocks; header != NULL; header = header->next) {
+            // Doh! VLD still has an internally allocated block!
+            // This won't ever actually happen, right guys?... guys?
+            internalleaks++;
+            leakfile = header->file;
+            leakline = header->line;
+            mbstowcs_s(&count, leakfilew, MAX_PATH, leakfile, _TRUNCATE);
+            Report(L"ERROR: Visual Leak Detector: Detected a memory leak internal to Visual Leak Detector!!\n");
+            Report(L"---------- Block %Iu at " ADDRESSFORMAT L": %Iu bytes ----------\n", header->serialNumber, VLDBLOCKDATA(header), header->size);
+            Report(L"  Call Stack:\n");
+            Report(L"    %s (%d): Full call stack not available.\n", leakfilew, leakline);
+            if (m_maxDataDump != 0) {
+                Report(L"  Data:\n");
+                if (m_options & VLD_OPT_UNICODE_REPORT) {
+                    DumpMemoryW(VLDBLOCKDATA(header), (m_maxDataDump < header->size) ? m_maxDataDump : header->size);
+                }
+                else {
+                    DumpMemoryA(VLDBLOCKDATA(header), (m_maxDataDump < header->size) ? m_maxDataDump : header->size);
+                }
             }
+            Report(L"\n");
         }
-        Report(L"\n");
-        header = header->next;
     }
     if (m_options & VLD_OPT_SELF_TEST) {
         if ((internalleaks == 1) && (strcmp(leakfile, m_selfTestFile) == 0) && (leakline == m_selfTestLine)) {
@@ -606,6 +1045,127 @@ void VisualLeakDetector::checkInternalMemoryLeaks()
     }
 }
 
+// releaseMetadata - Frees the block maps, call stacks, modules, thread local
+//   storage and every other piece of metadata, at shutdown, once the report
+//   is written. Only needed if VLD's heap isn't destroyed with the process
+//   (see FastExit), or for the internal leak self-check, which needs every
+//   internal block freed.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::releaseMetadata ()
+{
+    {
+        // Free internally allocated resources used by the heapmap and blockmap.
+        flushAllPendingBlocks();
+        slabcache_t &cache = getTls()->blockInfoCache;
+        CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+        for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
+            BlockMap *blockmap = &(*heapit).second->blockMap;
+            for (BlockMap::Iterator blockit = blockmap->begin(); blockit != blockmap->end(); ++blockit) {
+                m_blockInfoPool.Free(cache, (*blockit).second);
+            }
+            delete (*heapit).second->sizeClasses;
+            delete (*heapit).second->addresses;
+            delete blockmap;
+        }
+        delete m_heapMap;
+        releaseVirtualRegions();
+        while (m_remoteFrees != NULL) {
+            remotefree_t *entry = m_remoteFrees;
+            m_remoteFrees = entry->next;
+            delete entry;
+        }
+
+        // Every blockinfo_t is gone now, so the slabs and the call stack
+        // table can be returned to the VLD heap before checking it for
+        // internal leaks.
+        m_blockInfoPool.Release();
+        for (HashMap<UINT_PTR, CallStack*>::Iterator siteit = m_callerSites->begin();
+            siteit != m_callerSites->end(); ++siteit)
+            g_callStackTable.Release((*siteit).second);
+        delete m_callerSites;
+        m_callerSites = NULL;
+        delete m_baselineSites;
+        m_baselineSites = NULL;
+        delete [] m_baselineRecords;
+        m_baselineRecords = NULL;
+        releasePeak(m_peakSites, m_peakSiteCount);
+        m_peakSites = NULL;
+        g_stackPrefixes.Clear();
+        {
+            // The threads still running hold on to the stacks they
+            // interned last.
+            CriticalSectionLocker<> cs(m_tlsLock);
+            for (TlsMap::Iterator tlsit = m_tlsMap->begin(); tlsit != m_tlsMap->end(); ++tlsit)
+                g_callStackTable.ReleaseCache((*tlsit).second->stackCache);
+        }
+        if (m_options & VLD_OPT_SITE_STATISTICS)
+            g_callStackTable.Unpin();
+        g_callStackTable.Clear();
+        g_symbolCache.Clear();
+        g_crtStartupRanges.Clear();
+        g_suppressions.Clear();
+        g_resolvedText.Clear();
+        g_contextTree.Clear();
+        g_moduleImages.Clear();
+    }
+    delete m_loadedModules;
+    g_modulePaths.Clear();
+    while (m_moduleRanges != NULL) {
+        moduleranges_t *table = m_moduleRanges;
+        m_moduleRanges = table->retired;
+        delete [] (BYTE*)table;
+    }
+    while (m_patchIndex != NULL) {
+        patchindex_t *index = m_patchIndex;
+        m_patchIndex = index->retired;
+        delete [] (BYTE*)index;
+    }
+
+    {
+        // Free internally allocated resources used for thread local storage.
+        CriticalSectionLocker<> cs(m_tlsLock);
+        for (TlsMap::Iterator tlsit = m_tlsMap->begin(); tlsit != m_tlsMap->end(); ++tlsit) {
+            (*tlsit).second->pendingLock.Delete();
+            delete [] (*tlsit).second->deferred;
+            delete (*tlsit).second->allocTrace;
+            delete (*tlsit).second->latency;
+            delete (*tlsit).second->recentFrees;
+            delete (*tlsit).second;
+        }
+        delete m_tlsMap;
+        while (m_freeTls != NULL) {
+            tls_t *tls = m_freeTls;
+            m_freeTls = tls->nextFree;
+            tls->pendingLock.Delete();
+            delete [] tls->deferred;
+            delete tls->allocTrace;
+            delete tls->latency;
+            delete tls->recentFrees;
+            delete tls;
+        }
+        for (UINT page = 0; page < VLD_THREAD_TABLE_PAGES; page++) {
+            delete [] m_threadTable[page];
+            delete [] m_threadLeaks[page];
+            if (m_threadNames[page] == NULL)
+                continue;
+            for (UINT index = 0; index < VLD_THREAD_TABLE_PAGE; index++)
+                delete [] m_threadNames[page][index];
+            delete [] m_threadNames[page];
+        }
+        for (UINT page = 0; page < MODULEIMAGES_PAGES; page++)
+            delete [] m_moduleCounters[page];
+        releaseCapturePolicies();
+    }
+    for (UINT32 tag = 1; tag < m_tagCount; tag++)
+        delete [] m_tagNames[tag];
+    delete m_tagIds;
+    delete [] m_timeRecords;
+}
+
 // Destructor - Detaches Visual Leak Detector from all modules loaded in the
 //   process, frees internally allocated resources, and generates the memory
 //   leak report.
@@ -619,39 +1179,109 @@ VisualLeakDetector::~VisualLeakDetector ()
         return;
     }
 
+    // Write the shutdown report from this thread; the writer thread may
+    // already be gone if the process is exiting.
+    StopReportWriter();
+    stopLiveView();
+    stopPerfCounters();
+    stopTelemetry();
+    stopAllocTrace();
+    stopSymbolPrefetch();
+    stopSymbolFetch();
+    stopIdleResolve();
+    stopGrowthWatchdog();
+    stopHotModuleWatch();
+    stopIniWatch();
+    stopCrashSnapshot();
+    stopAsyncReport();
+    stopReportThreads();
+    g_etwSession.Stop();
+
     if (m_status & VLD_STATUS_INSTALLED) {
+        if (m_dllNotificationCookie != NULL) {
+            LdrUnregisterDllNotification(m_dllNotificationCookie);
+            m_dllNotificationCookie = NULL;
+        }
+
         // Detach Visual Leak Detector from all previously attached modules.
         DbgTrace(L"dbghelp32.dll %i: EnumerateLoadedModulesW64\n", GetCurrentThreadId());
         g_LoadedModules.EnumerateLoadedModulesW64(g_currentProcess, detachFromModule, NULL);
+        g_importPlans.Close();
+        g_importPlans.Clear();
 
         HMODULE kernel32 = GetModuleHandleW(L"kernel32.dll");
         HMODULE kernelBase = GetModuleHandleW(L"KernelBase.dll");
         RestoreImport(kernel32, ntdllPatch);
         if (kernelBase != NULL)
             RestoreImport(kernelBase, ntdllPatch);
+        if (m_virtualRegions != NULL) {
+            RestoreImport(kernel32, ntdllVirtualMemoryPatch);
+            if (kernelBase != NULL)
+                RestoreImport(kernelBase, ntdllVirtualMemoryPatch);
+        }
+        removeHeapHooks();
 
         BOOL threadsactive = waitForAllVLDThreads();
 
+        // Find the blocks allocated since the last walk, and their call stacks.
+        if (m_heapWalkTracking)
+            walkHeaps();
+        if (m_capturePolicy->walkMethod == VLD_OPT_NTDB_STACK_WALK)
+            attachTraceDatabaseStacks();
+
+        // The leaks of the heaps destroyed since the last report come first.
+        reportDeferredHeapLeaks();
+
+        // The first run with a baseline file sets the baseline, from all the
+        // leaks which are about to be reported.
+        if ((m_baselineFilePath[0] != L'\0') && (m_baselineSites == NULL) && !(m_status & VLD_STATUS_NEVER_ENABLED))
+            writeBaseline();
+
         if (m_status & VLD_STATUS_NEVER_ENABLED) {
             // Visual Leak Detector started with leak detection disabled and
             // it was never enabled at runtime. A lot of good that does.
             Report(L"WARNING: Visual Leak Detector: Memory leak detection was never enabled.\n");
         }
+        else if (m_options & VLD_OPT_REPORT_TO_BINARY) {
+            // Leave the symbolization to an offline tool.
+            SIZE_T leaks_count = writeBinaryReport();
+            Report(L"Visual Leak Detector wrote %Iu memory leak%s to the binary report %s\n",
+                leaks_count, (leaks_count == 1) ? L"" : L"s", m_reportFilePath);
+        }
         else {
             // Generate a memory leak report for each heap in the process.
-            SIZE_T leaks_count = ReportLeaks();
+            SIZE_T leaks_count = reportLeaksBefore((SIZE_T)-1);
 
             // Show a summary.
             if (leaks_count == 0) {
                 Report(L"No memory leaks detected.\n");
             }
             else {
+                SIZE_T allocations, current, peak, total;
+                readAllocTotals(allocations, current, peak, total);
                 Report(L"Visual Leak Detector detected %Iu memory leak", leaks_count);
-                Report((leaks_count > 1) ? L"s (%Iu bytes).\n" : L" (%Iu bytes).\n", m_curAlloc);
-                Report(L"Largest number used: %Iu bytes.\n", m_maxAlloc);
-                Report(L"Total allocations: %Iu bytes.\n", m_totalAlloc);
+                Report((leaks_count > 1) ? L"s (%Iu bytes).\n" : L" (%Iu bytes).\n", current);
+                Report(L"Largest number used: %Iu bytes.\n", peak);
+                Report(L"Total allocations: %Iu bytes.\n", total);
+                if (sampling()) {
+                    Report(L"Only sampled allocations were tracked; the leaks are estimated to total %Iu bytes.\n",
+                        m_estimatedLeakBytes);
+                }
             }
+            // The regions still reserved are reported like one more heap.
+            reportVirtualRegions();
         }
+        reportDegradation();
+        reportLockProfiles();
+        reportLatencyProfiles();
+        reportMemoryUsage();
+
+        // Let the next run start with containers of the sizes this one needed.
+        if (m_sizingProfilePath[0] != L'\0')
+            writeSizingProfile();
+
+        // Keep what the report resolved for the next run.
+        g_symbolStore.Close();
 
         // Free resources used by the symbol handler.
         DbgTrace(L"dbghelp32.dll %i: SymCleanup\n", GetCurrentThreadId());
@@ -660,28 +1290,12 @@ VisualLeakDetector::~VisualLeakDetector ()
                 GetLastError());
         }
 
-        {
-            // Free internally allocated resources used by the heapmap and blockmap.
-            CriticalSectionLocker<> cs(g_heapMapLock);
-            for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
-                BlockMap *blockmap = &(*heapit).second->blockMap;
-                for (BlockMap::Iterator blockit = blockmap->begin(); blockit != blockmap->end(); ++blockit) {
-                    delete (*blockit).second;
-                }
-                delete blockmap;
-            }
-            delete m_heapMap;
-        }
-        delete m_loadedModules;
-
-        {
-            // Free internally allocated resources used for thread local storage.
-            CriticalSectionLocker<> cs(m_tlsLock);
-            for (TlsMap::Iterator tlsit = m_tlsMap->begin(); tlsit != m_tlsMap->end(); ++tlsit) {
-                delete (*tlsit).second;
-            }
-            delete m_tlsMap;
-        }
+        // When the process is exiting anyway, the metadata goes with VLD's
+        // heap and metadata region, below, without being freed piece by piece.
+        bool fastexit = m_fastExit && !(m_options & VLD_OPT_SELF_TEST) && (RtlDllShutdownInProgress != NULL) &&
+            RtlDllShutdownInProgress();
+        if (!fastexit)
+            releaseMetadata();
         if (threadsactive) {
             Report(L"WARNING: Visual Leak Detector: Some threads appear to have not terminated normally.\n"
                 L"  This could cause inaccurate leak detection results, including false positives.\n");
@@ -691,30 +1305,52 @@ VisualLeakDetector::~VisualLeakDetector ()
         delete g_pReportHooks;
         g_pReportHooks = NULL;
 
-        checkInternalMemoryLeaks();
+        if (m_options & VLD_OPT_SELF_TEST)
+            checkInternalMemoryLeaks();
     }
     else {
         // VLD failed to load properly.
         delete m_heapMap;
+        delete m_virtualRegions;
         delete m_tlsMap;
+        delete m_tagIds;
+        delete m_callerSites;
+        delete [] m_timeRecords;
+        for (UINT page = 0; page < VLD_THREAD_TABLE_PAGES; page++) {
+            delete [] m_threadTable[page];
+            delete [] m_threadLeaks[page];
+            delete [] m_threadNames[page];
+        }
+        for (UINT page = 0; page < MODULEIMAGES_PAGES; page++)
+            delete [] m_moduleCounters[page];
+        releaseCapturePolicies();
         delete g_pReportHooks;
         g_pReportHooks = NULL;
     }
-    HeapDestroy(g_vldHeap);
+    DestroyVldHeap();
+    g_metadataRegion.Destroy();
 
     m_optionsLock.Delete();
+    m_policyLock.Delete();
     m_modulesLock.Delete();
     m_tlsLock.Delete();
+    m_tagLock.Delete();
+    m_callerSiteLock.Delete();
+    m_timeLock.Delete();
+    m_peakLock.Delete();
+    m_virtualLock.Delete();
+    m_deferredHeapLock.Delete();
+    m_reportJobLock.Delete();
     g_heapMapLock.Delete();
-    g_vldHeapLock.Delete();
 
     if (m_tlsIndex != TLS_OUT_OF_INDEXES) {
         TlsFree(m_tlsIndex);
     }
 
-    if (m_reportFile != NULL) {
-        fclose(m_reportFile);
-    }
+    FinishReportFile();
+    m_reportFile.Close();
+    closeReportPipe();
+    TraceLoggingUnregister(g_vldTraceProvider);
 
     // Decrement the library reference count.
     FreeLibrary(m_vldBase);
@@ -764,6 +1400,8 @@ UINT32 VisualLeakDetector::getModuleState(ModuleSet::Iterator& it, UINT32& modul
 
 // dbghelp32.dll should be updated in setup folder if you update dbghelp.h
 static char dbghelp32_assert[sizeof(IMAGEHLP_MODULE64) == 3264 ? 1 : -1];
+// ShardIndex masks addresses with BLOCKMAPSHARDS - 1.
+static char blockmapshards_assert[((BLOCKMAPSHARDS & (BLOCKMAPSHARDS - 1)) == 0) ? 1 : -1];
 
 // attachtoloadedmodules - Attaches VLD to all modules contained in the provided
 //   ModuleSet. Not all modules are in the ModuleSet will actually be included
@@ -787,6 +1425,18 @@ VOID VisualLeakDetector::attachToLoadedModules (ModuleSet *newmodules)
     LoaderLock ll;
     CriticalSectionLocker<DbgHelp> locker(g_DbgHelp);
 
+    // Resolve the patched imports once for all of the modules, if any export
+    // module was loaded (or moved) since the last time.
+    g_importPlans.Resolve(m_patchTable, _countof(m_patchTable));
+
+    // The modules to attach to are collected first and then patched together,
+    // which lets their imports be scanned in parallel.
+    SIZE_T modulecount = 0;
+    for (ModuleSet::Iterator newit = newmodules->begin(); newit != newmodules->end(); ++newit)
+        modulecount++;
+    HMODULE *attached = new HMODULE [max(modulecount, (SIZE_T)1)];
+    SIZE_T attachedcount = 0;
+
     // Iterate through the supplied set, until all modules have been attached.
     for (ModuleSet::Iterator newit = newmodules->begin(); newit != newmodules->end(); ++newit)
     {
@@ -797,9 +1447,7 @@ VOID VisualLeakDetector::attachToLoadedModules (ModuleSet *newmodules)
             continue;
 
         DWORD64 modulebase = (DWORD64) (*newit).addrLow;
-        LPCWSTR modulename = (*newit).name.c_str();
-        LPCWSTR modulepath = (*newit).path.c_str();
-        DWORD modulesize   = (DWORD)((*newit).addrHigh - (*newit).addrLow) + 1;
+        LPCWSTR modulename = (*newit).name;
 
         if ((state == 3) && (moduleFlags & VLD_MODULE_SYMBOLSLOADED)) {
             // Discard the previously loaded symbols, so we can refresh them.
@@ -809,27 +1457,14 @@ VOID VisualLeakDetector::attachToLoadedModules (ModuleSet *newmodules)
                     L" numbers shown in the memory leak report for %s may be inaccurate.\n", modulename, modulename);
             }
         }
+        // The module's symbols are loaded on demand, the first time an address
+        // within the module is resolved (see loadSymbolsForAddress).
+        moduleFlags &= ~(VLD_MODULE_SYMBOLSLOADED | VLD_MODULE_SYMBOLSQUERIED);
 
-        // Try to load the module's symbols. This ensures that we have loaded
-        // the symbols for every module that has ever been loaded into the
-        // process, guaranteeing the symbols' availability when generating the
-        // leak report.
-        IMAGEHLP_MODULE64     moduleimageinfo;
-        moduleimageinfo.SizeOfStruct = sizeof(IMAGEHLP_MODULE64);
-        BOOL SymbolsLoaded = g_DbgHelp.SymGetModuleInfoW64(g_currentProcess, modulebase, &moduleimageinfo, locker);
-
-        if (!SymbolsLoaded || moduleimageinfo.BaseOfImage != modulebase)
-        {
-            DbgTrace(L"dbghelp32.dll %i: SymLoadModuleEx\n", GetCurrentThreadId());
-            DWORD64 module = g_DbgHelp.SymLoadModuleExW(g_currentProcess, NULL, modulepath, NULL, modulebase, modulesize, NULL, 0, locker);
-            if (module == modulebase)
-            {
-                DbgTrace(L"dbghelp32.dll %i: SymGetModuleInfoW64\n", GetCurrentThreadId());
-                SymbolsLoaded = g_DbgHelp.SymGetModuleInfoW64(g_currentProcess, modulebase, &moduleimageinfo, locker);
-            }
-        }
-        if (SymbolsLoaded)
-            moduleFlags |= VLD_MODULE_SYMBOLSLOADED;
+        // Anything cached for this address range belonged to a previous image.
+        g_symbolCache.Invalidate((*newit).addrLow, (*newit).addrHigh, locker);
+        g_crtStartupRanges.Invalidate((*newit).addrLow, (*newit).addrHigh, locker);
+        g_moduleImages.Discard((*newit).addrLow, (*newit).addrHigh, locker);
 
         if (_wcsicmp(TEXT(VLDDLL), modulename) == 0) {
             // What happens when a module goes through it's own portal? Bad things.
@@ -881,2028 +1516,8841 @@ VOID VisualLeakDetector::attachToLoadedModules (ModuleSet *newmodules)
                 }
             }
         }
-        if ((moduleFlags & VLD_MODULE_EXCLUDED) == 0 &&
-            !(moduleFlags & VLD_MODULE_SYMBOLSLOADED) || (moduleimageinfo.SymType == SymExport)) {
-            // This module is going to be included in leak detection, but complete
-            // symbols for this module couldn't be loaded. This means that any stack
-            // traces through this module may lack information, like line numbers
-            // and function names.
-            Report(L"WARNING: Visual Leak Detector: A module, %s, included in memory leak detection\n"
-                L"  does not have any debugging symbols available, or they could not be located.\n"
-                L"  Function names and/or line numbers for this module may not be available.\n", modulename);
-        }
-
         // Update the module's flags in the "new modules" set.
         ModuleSet::Muterator  updateit;
         updateit = newit;
         (*updateit).flags = moduleFlags;
 
-        // Attach to the module.
-        PatchModule(modulelocal, m_patchTable, _countof(m_patchTable));
+        // Attach to the module, with the others (see below).
+        attached[attachedcount++] = modulelocal;
+    }
+
+    // Attach to the modules. With the heap ETW session or HeapWalkTracking,
+    // nothing is patched; the modules are only known for their symbols and
+    // whether they are excluded.
+    if (!g_etwSession.IsActive() && !m_heapWalkTracking)
+        g_importPlans.PatchAll(attached, attachedcount);
+
+    for (SIZE_T index = 0; index < attachedcount; index++)
+        FreeLibrary(attached[index]);
+    delete [] attached;
+}
+
+// loadModuleSymbols - Loads the debug symbols for a module, unless dbghelp
+//   already has them, and records the outcome in the module's flags.
+//
+//   Note: The caller must hold m_modulesLock, as well as the DbgHelp lock.
+//
+//  - moduleinfo (IN): The module, as stored in a ModuleSet.
+//
+//  - locker (IN): Proof that the caller holds the DbgHelp lock.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::loadModuleSymbols (const moduleinfo_t &moduleinfo, CriticalSectionLocker<DbgHelp> &locker)
+{
+    DWORD64 modulebase = (DWORD64) moduleinfo.addrLow;
+    LPCWSTR modulename = moduleinfo.name;
+    LPCWSTR modulepath = moduleinfo.path;
+    DWORD modulesize   = (DWORD)(moduleinfo.addrHigh - moduleinfo.addrLow) + 1;
+    UINT32 moduleFlags = moduleinfo.flags | VLD_MODULE_SYMBOLSQUERIED;
+
+    IMAGEHLP_MODULE64     moduleimageinfo;
+    moduleimageinfo.SizeOfStruct = sizeof(IMAGEHLP_MODULE64);
+    BOOL SymbolsLoaded = g_DbgHelp.SymGetModuleInfoW64(g_currentProcess, modulebase, &moduleimageinfo, locker);
+
+    if (!SymbolsLoaded || moduleimageinfo.BaseOfImage != modulebase)
+    {
+        DbgTrace(L"dbghelp32.dll %i: SymLoadModuleEx\n", GetCurrentThreadId());
+        DWORD64 module = g_DbgHelp.SymLoadModuleExW(g_currentProcess, NULL, modulepath, NULL, modulebase, modulesize, NULL, 0, locker);
+        if (module == modulebase)
+        {
+            DbgTrace(L"dbghelp32.dll %i: SymGetModuleInfoW64\n", GetCurrentThreadId());
+            SymbolsLoaded = g_DbgHelp.SymGetModuleInfoW64(g_currentProcess, modulebase, &moduleimageinfo, locker);
+        }
+    }
+    if (SymbolsLoaded)
+        moduleFlags |= VLD_MODULE_SYMBOLSLOADED;
 
-        FreeLibrary(modulelocal);
+    if ((moduleFlags & VLD_MODULE_EXCLUDED) == 0 &&
+        !(moduleFlags & VLD_MODULE_SYMBOLSLOADED) || (moduleimageinfo.SymType == SymExport)) {
+        // This module is included in leak detection, but complete symbols for
+        // this module couldn't be loaded. This means that any stack traces
+        // through this module may lack information, like line numbers and
+        // function names.
+        Report(L"WARNING: Visual Leak Detector: A module, %s, included in memory leak detection\n"
+            L"  does not have any debugging symbols available, or they could not be located.\n"
+            L"  Function names and/or line numbers for this module may not be available.\n", modulename);
     }
+
+    // Only the flags are updated, which doesn't affect the ordering of the set.
+    ((moduleinfo_t&)moduleinfo).flags = moduleFlags;
 }
 
-// buildsymbolsearchpath - Builds the symbol search path for the symbol handler.
-//   This helps the symbol handler find the symbols for the application being
-//   debugged.
+// loadSymbolsForAddress - Makes sure that the symbols for the module
+//   containing an address have been loaded. Symbols are not loaded when a
+//   module is attached, because most modules never show up in a leak report;
+//   they are loaded the first time an address within the module is resolved.
+//
+//  - address (IN): The address about to be resolved.
+//
+//  - locker (IN): Proof that the caller holds the DbgHelp lock.
 //
 //  Return Value:
 //
-//    Returns a string containing the search path. The caller is responsible for
-//    freeing the string.
+//    Returns false if the module's symbols are being fetched in the
+//    background (see symbolLoadTimedOut); dbghelp mustn't be asked about the
+//    address meanwhile.
 //
-LPWSTR VisualLeakDetector::buildSymbolSearchPath ()
+bool VisualLeakDetector::loadSymbolsForAddress (SIZE_T address, CriticalSectionLocker<DbgHelp> &locker)
 {
-    // Oddly, the symbol handler ignores the link to the PDB embedded in the
-    // executable image. So, we'll manually add the location of the executable
-    // to the search path since that is often where the PDB will be located.
-    WCHAR   directory [_MAX_DIR] = {0};
-    WCHAR   drive [_MAX_DRIVE] = {0};
-    LPWSTR  path = new WCHAR [MAX_PATH * 4];
-    path[0] = L'\0';
+    moduleinfo_t         moduleinfo;
+    ModuleSet::Iterator  moduleit;
+    moduleinfo.addrLow  = address;
+    moduleinfo.addrHigh = address;
+    moduleinfo.flags    = 0;
 
-    HMODULE module = GetModuleHandleW(NULL);
-    GetModuleFileName(module, path, MAX_PATH);
-    _wsplitpath_s(path, drive, _MAX_DRIVE, directory, _MAX_DIR, NULL, 0, NULL, 0);
-    wcsncpy_s(path, MAX_PATH, drive, _TRUNCATE);
-    path = AppendString(path, directory);
-    path = AppendString(path, L";");
+    CriticalSectionLocker<> cs(m_modulesLock);
+    if (m_loadedModules == NULL)
+        return true;
+    moduleit = m_loadedModules->find(moduleinfo);
+    if (moduleit == m_loadedModules->end())
+        return true;
+    if ((*moduleit).flags & VLD_MODULE_SYMBOLSPENDING)
+        return false;
+    if (!((*moduleit).flags & VLD_MODULE_SYMBOLSQUERIED))
+        loadModuleSymbols(*moduleit, locker);
+    return true;
+}
 
-    // When the symbol handler is given a custom symbol search path, it will no
-    // longer search the default directories (working directory, _NT_SYMBOL_PATH,
-    // etc...). But we'd like it to still search those directories, so we'll add
-    // them to our custom search path.
+// symbolLoadTimedOut - Determines whether dbghelp's last symbol load was
+//   canceled for taking longer than SymbolServerTimeout (see
+//   symbolLoadCallback), which happens when a PDB is looked for on a slow
+//   symbol server. To be called after each dbghelp call which may load
+//   symbols. The module is then unloaded from dbghelp and queued for its
+//   PDB to be fetched in the background, without the DbgHelp lock. Until
+//   it is, the module's frames are shown as offsets, which can be
+//   symbolized offline.
+//
+//  - locker (IN): Proof that the caller holds the DbgHelp lock.
+//
+//  Return Value:
+//
+//    Returns true if the load timed out; the answers dbghelp gave are then
+//    not to be used.
+//
+bool VisualLeakDetector::symbolLoadTimedOut (CriticalSectionLocker<DbgHelp> &locker)
+{
+    if (!m_symbolLoadCanceled)
+        return false;
+    m_symbolLoadCanceled = FALSE;
 
-    // Append the working directory.
-    path = AppendString(path, L".\\;");
+    moduleinfo_t moduleinfo;
+    moduleinfo.addrLow  = (SIZE_T)m_symbolLoadBase;
+    moduleinfo.addrHigh = (SIZE_T)m_symbolLoadBase;
+    moduleinfo.flags    = 0;
 
-    // Append %_NT_SYMBOL_PATH%.
-    DWORD   envlen = GetEnvironmentVariable(L"_NT_SYMBOL_PATH", NULL, 0);
-    if (envlen != 0) {
-        LPWSTR env = new WCHAR [envlen];
-        if (GetEnvironmentVariable(L"_NT_SYMBOL_PATH", env, envlen) != 0) {
-            path = AppendString(path, env);
-            path = AppendString(path, L";");
-        }
-        delete [] env;
+    CriticalSectionLocker<> cs(m_modulesLock);
+    if (m_loadedModules == NULL)
+        return true;
+    ModuleSet::Iterator moduleit = m_loadedModules->find(moduleinfo);
+    if ((moduleit == m_loadedModules->end()) || ((*moduleit).addrLow != (SIZE_T)m_symbolLoadBase)) {
+        // An unloaded module's symbols; they just aren't available.
+        return true;
     }
 
-    // Append %_NT_ALT_SYMBOL_PATH%.
-    envlen = GetEnvironmentVariable(L"_NT_ALT_SYMBOL_PATH", NULL, 0);
-    if (envlen != 0) {
-        LPWSTR env = new WCHAR [envlen];
-        if (GetEnvironmentVariable(L"_NT_ALT_SYMBOL_PATH", env, envlen) != 0) {
-            path = AppendString(path, env);
-            path = AppendString(path, L";");
+    // Forget the canceled load. The symbols are loaded afresh once fetched.
+    g_DbgHelp.SymUnloadModule64(g_currentProcess, m_symbolLoadBase, locker);
+    ModuleSet::Muterator updateit;
+    updateit = moduleit;
+    (*updateit).flags |= VLD_MODULE_SYMBOLSPENDING;
+
+    bool queued = false;
+    if ((m_symbolFetchThread != NULL) && (m_symbolServers != NULL)) {
+        CriticalSectionLocker<> fl(m_symbolFetchLock);
+        if (m_symbolFetchCount < VLD_SYMBOL_FETCH_QUEUE) {
+            symbolfetch_t &fetch = m_symbolFetchQueue[(m_symbolFetchHead + m_symbolFetchCount) % VLD_SYMBOL_FETCH_QUEUE];
+            fetch.base = (*moduleit).addrLow;
+            if (GetModulePdbInfo((HMODULE)fetch.base, fetch.pdbGuid, fetch.pdbAge, fetch.pdbName, MAX_PATH) &&
+                (fetch.pdbName[0] != L'\0')) {
+                m_symbolFetchCount++;
+                queued = true;
+            }
         }
-        delete [] env;
     }
-
-    // Append %_NT_ALTERNATE_SYMBOL_PATH%.
-    envlen = GetEnvironmentVariable(L"_NT_ALTERNATE_SYMBOL_PATH", NULL, 0);
-    if (envlen != 0) {
-        LPWSTR env = new WCHAR [envlen];
-        if (GetEnvironmentVariable(L"_NT_ALTERNATE_SYMBOL_PATH", env, envlen) != 0) {
-            path = AppendString(path, env);
-            path = AppendString(path, L";");
-        }
-        delete [] env;
+    if (queued) {
+        SetEvent(m_symbolFetchWake);
+        Report(L"WARNING: Visual Leak Detector: The symbols for %s weren't loaded within %u ms.\n"
+            L"  They are fetched in the background; until then its frames are shown as offsets\n"
+            L"  (%s!0x...), which can be symbolized offline.\n",
+            (*moduleit).name, m_symbolServerTimeout, (*moduleit).name);
     }
-
-#if _MSC_VER > 2000
-#error Not supported VS
-#endif
-    // Append Visual Studio 2015/2013/2012/2010/2008 symbols cache directory.
-    // NOTE: This does not seem to exist for VS 2019 on Windows 10, but leaving it as is for now, updated to 2019 (changed 14->16)
-    for (UINT n = 9; n <= 16; ++n) {
-        WCHAR debuggerpath[MAX_PATH] = { 0 };
-        swprintf(debuggerpath, _countof(debuggerpath), L"Software\\Microsoft\\VisualStudio\\%u.0\\Debugger", n);
-        HKEY debuggerkey;
-        WCHAR symbolCacheDir[MAX_PATH] = { 0 };
-        LSTATUS regstatus = RegOpenKeyExW(HKEY_CURRENT_USER, debuggerpath, 0, KEY_QUERY_VALUE, &debuggerkey);
-
-        if (regstatus == ERROR_SUCCESS) {
-            DWORD valuetype;
-            DWORD dirLength = MAX_PATH * sizeof(WCHAR);
-            regstatus = RegQueryValueExW(debuggerkey, L"SymbolCacheDir", NULL, &valuetype, (LPBYTE)&symbolCacheDir, &dirLength);
-            if (regstatus == ERROR_SUCCESS && valuetype == REG_SZ && symbolCacheDir[0] != NULL && !wcsstr(path, symbolCacheDir)) {
-                path = AppendString(path, symbolCacheDir);
-                path = AppendString(path, L"\\MicrosoftPublicSymbols;");
-                path = AppendString(path, symbolCacheDir);
-                path = AppendString(path, L";");
-            }
-            RegCloseKey(debuggerkey);
-        }
-    }
-
-    // Remove any quotes from the path. The symbol handler doesn't like them.
-    SIZE_T  pos = 0;
-    SIZE_T  length = wcslen(path);
-    while (pos < length) {
-        if (path[pos] == L'\"') {
-            for (SIZE_T  index = pos; index < length; index++) {
-                path[index] = path[index + 1];
-            }
-        }
-        pos++;
+    else {
+        Report(L"WARNING: Visual Leak Detector: The symbols for %s weren't loaded within %u ms.\n"
+            L"  Its frames are shown as offsets (%s!0x...), which can be symbolized offline.\n",
+            (*moduleit).name, m_symbolServerTimeout, (*moduleit).name);
     }
-
-    return path;
+    return true;
 }
 
-// GetIniFilePath - Obtains vld.ini file path.
+// symbolsFetched - Called by the fetch thread once it has tried to fetch a
+//   module's PDB from the symbol servers. If it has been, the module's
+//   symbols are loaded again, from the downstream store, the next time they
+//   are needed, and the offsets cached for its frames are forgotten.
+//
+//  - modulebase (IN): Base address of the module.
+//
+//  - fetched (IN): Whether the PDB was fetched.
+//
+//  - locker (IN): Proof that the caller holds the DbgHelp lock.
 //
 //  Return Value:
 //
-//    Returns true if an actual vld.ini file was found
-//    Otherwise, returns false.
+//    None.
 //
-BOOL VisualLeakDetector::GetIniFilePath(LPTSTR lpPath, SIZE_T cchPath)
+VOID VisualLeakDetector::symbolsFetched (UINT_PTR modulebase, BOOL fetched, CriticalSectionLocker<DbgHelp> &locker)
 {
-    TCHAR  path[MAX_PATH] = {0};
-    struct _stat s;
-    DWORD written = 0;
-
-    // Get the location of the vld.ini file from current directory path.
-    if (0 < (written = GetCurrentDirectory(MAX_PATH, path))) {
-        _tcsncpy_s(&path[written], MAX_PATH - written, TEXT("\\vld.ini"), _TRUNCATE);
-        if (_tstat(path, &s) == 0) {
-            _tcsncpy_s(lpPath, cchPath, path, _TRUNCATE);
-            return TRUE;
-        }
-    }
-
-    // Get the location of the vld.ini file from VLDDLL file path.
-    HMODULE hModule = GetCallingModule((UINT_PTR)this);
-    if (0 < (written = GetModuleFileName(hModule, path, MAX_PATH))) {
-        LPTSTR p = _tcsrchr(path, TEXT('\\'));
-        written = (DWORD)(p - path);
-        if (p && 0 == _tcsncpy_s(p, MAX_PATH - written, TEXT("\\vld.ini"), _TRUNCATE)) {
-            if (_tstat(path, &s) == 0) {
-                _tcsncpy_s(lpPath, cchPath, path, _TRUNCATE);
-                return TRUE;
-            }
-        }
-    }
-
-    // Get the location of the vld.ini file from executable file path.
-    if (0 < (written = GetModuleFileName(NULL, path, MAX_PATH))) {
-        LPTSTR p = _tcsrchr(path, TEXT('\\'));
-        written = (DWORD)(p - path);
-        if (p && 0 == _tcsncpy_s(p, MAX_PATH - written, TEXT("\\vld.ini"), _TRUNCATE)) {
-            if (_tstat(path, &s) == 0) {
-                _tcsncpy_s(lpPath, cchPath, path, _TRUNCATE);
-                return TRUE;
-            }
-        }
-    }
-
-    HKEY         productkey = 0;
-    DWORD        length = 0;
-    DWORD        valuetype = 0;
+    moduleinfo_t moduleinfo;
+    moduleinfo.addrLow  = modulebase;
+    moduleinfo.addrHigh = modulebase;
+    moduleinfo.flags    = 0;
 
-    // Get the location of the vld.ini file from the registry.
-    LONG regstatus = RegOpenKeyEx(HKEY_CURRENT_USER, VLDREGKEYPRODUCT, 0, KEY_QUERY_VALUE, &productkey);
-    if (regstatus == ERROR_SUCCESS) {
-        length = MAX_PATH * sizeof(TCHAR);
-        regstatus = RegQueryValueEx(productkey, TEXT("IniFile"), NULL, &valuetype, (LPBYTE)&path, &length);
-        RegCloseKey(productkey);
-        if (regstatus == ERROR_SUCCESS && (_tstat(path, &s) == 0)) {
-            _tcsncpy_s(lpPath, cchPath, path, _TRUNCATE);
-            return TRUE;
-        }
-    }
+    CriticalSectionLocker<> cs(m_modulesLock);
+    if (m_loadedModules == NULL)
+        return;
+    ModuleSet::Iterator moduleit = m_loadedModules->find(moduleinfo);
+    if ((moduleit == m_loadedModules->end()) || ((*moduleit).addrLow != modulebase) ||
+        !((*moduleit).flags & VLD_MODULE_SYMBOLSPENDING))
+        return;
 
-    // Get the location of the vld.ini file from the registry.
-    regstatus = RegOpenKeyEx(HKEY_LOCAL_MACHINE, VLDREGKEYPRODUCT, 0, KEY_QUERY_VALUE, &productkey);
-    if (regstatus == ERROR_SUCCESS) {
-        length = MAX_PATH * sizeof(TCHAR);
-        regstatus = RegQueryValueEx(productkey, TEXT("IniFile"), NULL, &valuetype, (LPBYTE)&path, &length);
-        RegCloseKey(productkey);
-        if (regstatus == ERROR_SUCCESS && (_tstat(path, &s) == 0)) {
-            _tcsncpy_s(lpPath, cchPath, path, _TRUNCATE);
-            return TRUE;
-        }
+    if (!fetched) {
+        Report(L"WARNING: Visual Leak Detector: The symbols for %s couldn't be fetched from the symbol servers.\n"
+            L"  Its frames stay shown as offsets.\n", (*moduleit).name);
+        return;
     }
-
-    _tcsncpy_s(lpPath, cchPath, TEXT("vld.ini"), _TRUNCATE);
-    return FALSE;
+    ModuleSet::Muterator updateit;
+    updateit = moduleit;
+    (*updateit).flags &= ~(VLD_MODULE_SYMBOLSPENDING | VLD_MODULE_SYMBOLSQUERIED | VLD_MODULE_SYMBOLSLOADED);
+    g_symbolCache.Invalidate((*moduleit).addrLow, (*moduleit).addrHigh, locker);
 }
 
-// configure - Configures VLD using values read from the vld.ini file.
+// startSymbolPrefetch - Starts the thread which loads the symbols of modules
+//   in the background, for the PrefetchSymbols option, and queues the modules
+//   already loaded. If the thread can't be started, symbols are only loaded
+//   on demand.
 //
 //  Return Value:
 //
 //    None.
 //
-VOID VisualLeakDetector::configure ()
+VOID VisualLeakDetector::startSymbolPrefetch ()
 {
-    TCHAR  inipath [MAX_PATH] = {0};
-    BOOL found = GetIniFilePath(inipath, _countof(inipath));
-
-    Report(L"Visual Leak Detector read settings from: %s\n", found ? inipath : L"(default settings)");
-
-    // Read the boolean options.
-    const UINT buffersize = 64;
-    WCHAR buffer[buffersize] = { 0 };
-
-    if (!GetEnvironmentVariable(L"VLD", buffer, buffersize)) {
-        GetPrivateProfileString(L"Options", L"VLD", L"on", buffer, buffersize, inipath);
-    }
-
-    if (StrToBool(buffer) == FALSE) {
-        m_options |= VLD_OPT_VLDOFF;
+    m_prefetchWake = CreateEventW(NULL, FALSE, FALSE, NULL);
+    if (m_prefetchWake == NULL)
+        return;
+    m_prefetchThread = CreateThread(NULL, 0, symbolPrefetchProc, this, CREATE_SUSPENDED, &m_prefetchThreadId);
+    if (m_prefetchThread == NULL) {
+        CloseHandle(m_prefetchWake);
+        m_prefetchWake = NULL;
+        m_prefetchThreadId = 0;
         return;
     }
+    // Loading symbols reads whole PDBs; the program comes first.
+    SetThreadPriority(m_prefetchThread, THREAD_PRIORITY_BELOW_NORMAL);
+    ResumeThread(m_prefetchThread);
 
-    if (LoadBoolOption(L"AggregateDuplicates", L"", inipath)) {
-        m_options |= VLD_OPT_AGGREGATE_DUPLICATES;
-    }
-
-    if (LoadBoolOption(L"SelfTest", L"", inipath)) {
-        m_options |= VLD_OPT_SELF_TEST;
-    }
-
-    if (LoadBoolOption(L"SlowDebuggerDump", L"", inipath)) {
-        m_options |= VLD_OPT_SLOW_DEBUGGER_DUMP;
-    }
-
-    if (LoadBoolOption(L"StartDisabled", L"", inipath)) {
-        m_options |= VLD_OPT_START_DISABLED;
-    }
-
-    if (LoadBoolOption(L"TraceInternalFrames", L"", inipath)) {
-        m_options |= VLD_OPT_TRACE_INTERNAL_FRAMES;
-    }
-
-    if (LoadBoolOption(L"SkipHeapFreeLeaks", L"", inipath)) {
-        m_options |= VLD_OPT_SKIP_HEAPFREE_LEAKS;
-    }
-
-    if (LoadBoolOption(L"SkipCrtStartupLeaks", L"yes", inipath)) {
-        m_options |= VLD_OPT_SKIP_CRTSTARTUP_LEAKS;
-    }
-
-    // Read the integer configuration options.
-    m_maxDataDump = LoadIntOption(L"MaxDataDump", VLD_DEFAULT_MAX_DATA_DUMP, inipath);
-    m_maxTraceFrames = LoadIntOption(L"MaxTraceFrames", VLD_DEFAULT_MAX_TRACE_FRAMES, inipath);
-    if (m_maxTraceFrames < 1) {
-        m_maxTraceFrames = VLD_DEFAULT_MAX_TRACE_FRAMES;
-    }
-
-    // Read the force-include module list.
-    LoadStringOption(L"ForceIncludeModules", m_forcedModuleList, MAXMODULELISTLENGTH, inipath);
-    _wcslwr_s(m_forcedModuleList, MAXMODULELISTLENGTH);
-    if (wcscmp(m_forcedModuleList, L"*") == 0)
-        m_forcedModuleList[0] = '\0';
-    else
-        m_options |= VLD_OPT_MODULE_LIST_INCLUDE;
-
-    // Read the report destination (debugger, file, or both).
-    WCHAR filename [MAX_PATH] = {0};
-    LoadStringOption(L"ReportFile", filename, MAX_PATH, inipath);
-    if (filename[0] == '\0') {
-        wcsncpy_s(filename, MAX_PATH, VLD_DEFAULT_REPORT_FILE_NAME, _TRUNCATE);
-    }
-    WCHAR* path = _wfullpath(m_reportFilePath, filename, MAX_PATH);
-    assert(path);
-
-    LoadStringOption(L"ReportTo", buffer, buffersize, inipath);
-    if (_wcsicmp(buffer, L"both") == 0) {
-        m_options |= (VLD_OPT_REPORT_TO_DEBUGGER | VLD_OPT_REPORT_TO_FILE);
-    }
-    else if (_wcsicmp(buffer, L"file") == 0) {
-        m_options |= VLD_OPT_REPORT_TO_FILE;
-    }
-    else if (_wcsicmp(buffer, L"stdout") == 0) {
-        m_options |= VLD_OPT_REPORT_TO_STDOUT;
-    }
-    else {
-        m_options |= VLD_OPT_REPORT_TO_DEBUGGER;
-    }
-
-    // Read the report file encoding (ascii or unicode).
-    LoadStringOption(L"ReportEncoding", buffer, buffersize, inipath);
-    if (_wcsicmp(buffer, L"unicode") == 0) {
-        m_options |= VLD_OPT_UNICODE_REPORT;
-    }
-    if ((m_options & VLD_OPT_UNICODE_REPORT) && !(m_options & VLD_OPT_REPORT_TO_FILE)) {
-        // If Unicode report encoding is enabled, then the report needs to be
-        // sent to a file because the debugger will not display Unicode
-        // characters, it will display question marks in their place instead.
-        m_options |= VLD_OPT_REPORT_TO_FILE;
-        m_status |= VLD_STATUS_FORCE_REPORT_TO_FILE;
-    }
-
-    // Read the stack walking method.
-    LoadStringOption(L"StackWalkMethod", buffer, buffersize, inipath);
-    if (_wcsicmp(buffer, L"safe") == 0) {
-        m_options |= VLD_OPT_SAFE_STACK_WALK;
-    }
-
-    if (LoadBoolOption(L"ValidateHeapAllocs", L"", inipath)) {
-        m_options |= VLD_OPT_VALIDATE_HEAPFREE;
-    }
+    CriticalSectionLocker<> cs(m_modulesLock);
+    prefetchSymbols(m_loadedModules, NULL);
 }
 
-// enabled - Determines if memory leak detection is enabled for the current
-//   thread.
+// stopSymbolPrefetch - Stops loading symbols in the background. Like
+//   stopLiveView, this never waits for the thread, which may be waiting for
+//   the loader lock held by the caller; it exits as soon as it sees that it
+//   has been stopped, before touching the loaded modules again.
 //
 //  Return Value:
 //
-//    Returns true if Visual Leak Detector is enabled for the current thread.
-//    Otherwise, returns false.
+//    None.
 //
-BOOL VisualLeakDetector::enabled ()
+VOID VisualLeakDetector::stopSymbolPrefetch ()
 {
-    if (!(m_status & VLD_STATUS_INSTALLED)) {
-        // Memory leak detection is not yet enabled because VLD is still
-        // initializing.
-        return FALSE;
-    }
-
-    tls_t* tls = getTls();
-    if (!(tls->flags & VLD_TLS_DISABLED) && !(tls->flags & VLD_TLS_ENABLED)) {
-        // The enabled/disabled state for the current thread has not been
-        // initialized yet. Use the default state.
-        if (m_options & VLD_OPT_START_DISABLED) {
-            tls->flags |= VLD_TLS_DISABLED;
-        }
-        else {
-            tls->flags |= VLD_TLS_ENABLED;
-        }
-    }
+    if (m_prefetchThread == NULL)
+        return;
 
-    return ((tls->flags & VLD_TLS_ENABLED) != 0);
+    {
+        CriticalSectionLocker<> cs(m_prefetchLock);
+        m_prefetchStop = TRUE;
+        m_prefetchCount = 0;
+    }
+    SetEvent(m_prefetchWake);
+    if (WaitForSingleObject(m_prefetchThread, 0) == WAIT_OBJECT_0) {
+        CloseHandle(m_prefetchWake);
+        m_prefetchWake = NULL;
+    }
+    CloseHandle(m_prefetchThread);
+    m_prefetchThread = NULL;
+    m_prefetchThreadId = 0;
 }
 
-// eraseduplicates - Erases, from the block maps, blocks that appear to be
-//   duplicate leaks of an already identified leak.
-//
-//  - element (IN): BlockMap Iterator referencing the block of which to search
-//      for duplicates.
+// startSymbolFetch - Starts the thread which fetches, from the symbol
+//   servers, the PDBs whose loading timed out (see symbolLoadTimedOut). If
+//   the thread can't be started, those modules' frames stay shown as offsets.
 //
 //  Return Value:
 //
-//    Returns the number of duplicate blocks erased from the block map.
+//    None.
 //
-SIZE_T VisualLeakDetector::eraseDuplicates (const BlockMap::Iterator &element, Set<blockinfo_t*> &aggregatedLeaks)
+VOID VisualLeakDetector::startSymbolFetch ()
 {
-    blockinfo_t *elementinfo = (*element).second;
-
-    if (elementinfo->callStack == NULL)
-        return 0;
-
-    SIZE_T       erased = 0;
-    // Iterate through all block maps, looking for blocks with the same size
-    // and callstack as the specified element.
-    CriticalSectionLocker<> cs(g_heapMapLock);
-    for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
-        BlockMap *blockmap = &(*heapit).second->blockMap;
-        for (BlockMap::Iterator blockit = blockmap->begin(); blockit != blockmap->end(); ++blockit) {
-            if (blockit == element) {
-                // Don't delete the element of which we are searching for
-                // duplicates.
-                continue;
-            }
-            blockinfo_t *info = (*blockit).second;
-            if (info->callStack == NULL)
-                continue;
-            Set<blockinfo_t*>::Iterator it = aggregatedLeaks.find(info);
-            if (it != aggregatedLeaks.end())
-                continue;
-            if ((info->size == elementinfo->size) && (*(info->callStack) == *(elementinfo->callStack))) {
-                // Found a duplicate. Mark it.
-                aggregatedLeaks.insert(info);
-                erased++;
-            }
-        }
+    m_symbolFetchWake = CreateEventW(NULL, FALSE, FALSE, NULL);
+    if (m_symbolFetchWake == NULL)
+        return;
+    m_symbolFetchThread = CreateThread(NULL, 0, symbolFetchProc, this, CREATE_SUSPENDED, &m_symbolFetchThreadId);
+    if (m_symbolFetchThread == NULL) {
+        CloseHandle(m_symbolFetchWake);
+        m_symbolFetchWake = NULL;
+        m_symbolFetchThreadId = 0;
+        return;
     }
-
-    return erased;
+    // Downloads take long; the program comes first.
+    SetThreadPriority(m_symbolFetchThread, THREAD_PRIORITY_BELOW_NORMAL);
+    ResumeThread(m_symbolFetchThread);
 }
 
-// gettls - Obtains the thread local storage structure for the calling thread.
+// stopSymbolFetch - Stops fetching symbols in the background. Like
+//   stopSymbolPrefetch, this never waits for the thread, which may be in the
+//   middle of a download; it exits as soon as it sees that it has been
+//   stopped, before touching the loaded modules again.
 //
 //  Return Value:
 //
-//    Returns a pointer to the thread local storage structure. (This function
-//    always succeeds).
+//    None.
 //
-tls_t* VisualLeakDetector::getTls ()
+VOID VisualLeakDetector::stopSymbolFetch ()
 {
-    // Get the pointer to this thread's thread local storage structure.
-    tls_t* tls = (tls_t*)TlsGetValue(m_tlsIndex);
-    assert(GetLastError() == ERROR_SUCCESS);
+    if (m_symbolFetchThread == NULL)
+        return;
 
-    if (tls == NULL) {
-        DWORD threadId = GetCurrentThreadId();
+    {
+        CriticalSectionLocker<> cs(m_symbolFetchLock);
+        m_symbolFetchStop = TRUE;
+        m_symbolFetchCount = 0;
+    }
+    SetEvent(m_symbolFetchWake);
+    if (WaitForSingleObject(m_symbolFetchThread, 0) == WAIT_OBJECT_0) {
+        CloseHandle(m_symbolFetchWake);
+        m_symbolFetchWake = NULL;
+        // The thread reads the servers while it downloads.
+        delete [] m_symbolServers;
+        m_symbolServers = NULL;
+    }
+    CloseHandle(m_symbolFetchThread);
+    m_symbolFetchThread = NULL;
+    m_symbolFetchThreadId = 0;
+}
 
-        CriticalSectionLocker<> cs(m_tlsLock);
-        TlsMap::Iterator it = m_tlsMap->find(threadId);
-        if (it == m_tlsMap->end()) {
-            // This thread's thread local storage structure has not been allocated.
-            tls = new tls_t;
+// startGrowthWatchdog - Starts the thread which writes a growth report
+//   whenever the memory in use grows by GrowthTriggerMB. If the thread can't
+//   be started, no growth reports are written.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::startGrowthWatchdog ()
+{
+    m_growthSnapshot = TakeSnapshot();
+    m_growthCheckpoint = m_curAlloc;
+    m_growthWake = CreateEventW(NULL, FALSE, FALSE, NULL);
+    if (m_growthWake == NULL)
+        return;
+    m_growthThread = CreateThread(NULL, 0, growthWatchdogProc, this, CREATE_SUSPENDED, &m_growthThreadId);
+    if (m_growthThread == NULL) {
+        CloseHandle(m_growthWake);
+        m_growthWake = NULL;
+        m_growthThreadId = 0;
+        return;
+    }
+    // Symbolizing is what takes long; the program comes first.
+    SetThreadPriority(m_growthThread, THREAD_PRIORITY_BELOW_NORMAL);
+    ResumeThread(m_growthThread);
+}
 
-            // Add this thread's TLS to the TlsSet.
-            m_tlsMap->insert(threadId, tls);
-        } else {
-            // Already had a thread with this ID
-            tls = (*it).second;
-        }
+// stopGrowthWatchdog - Stops writing growth reports. Like stopSymbolPrefetch,
+//   this never waits for the thread, which may be waiting for the loader lock
+//   held by the caller; it exits as soon as it sees that it has been stopped.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::stopGrowthWatchdog ()
+{
+    if (m_growthThread == NULL)
+        return;
 
-        ZeroMemory(&tls->context, sizeof(tls->context));
-        tls->flags = 0x0;
-        tls->oldFlags = 0x0;
-        tls->threadId = threadId;
-        tls->blockWithoutGuard = NULL;
-        TlsSetValue(m_tlsIndex, tls);
+    m_growthStop = TRUE;
+    SetEvent(m_growthWake);
+    if (WaitForSingleObject(m_growthThread, 0) == WAIT_OBJECT_0) {
+        CloseHandle(m_growthWake);
+        m_growthWake = NULL;
     }
-
-    return tls;
+    CloseHandle(m_growthThread);
+    m_growthThread = NULL;
+    m_growthThreadId = 0;
 }
 
-// mapblock - Tracks memory allocations. Information about allocated blocks is
-//   collected and then the block is mapped to this information.
+// growthWatchdogProc - Writes a growth report each time one is triggered:
+//   the blocks allocated since the previous report which are still allocated,
+//   grouped by call stack, the top SummaryCount stacks in full. Each report
+//   then becomes the base of the next.
 //
-//  - heap (IN): Handle to the heap from which the block has been allocated.
-//
-//  - mem (IN): Pointer to the memory block being allocated.
+//  - param (IN): The VisualLeakDetector.
 //
-//  - size (IN): Size, in bytes, of the memory block being allocated.
+//  Return Value:
 //
-//  - addrOfRetAddr (IN): Address of return address at the time this allocation
-//      first entered VLD's code. This is used from determining the starting
-//      point for the stack trace.
+//    Always returns 0.
 //
-//  - crtalloc (IN): Should be set to TRUE if this allocation is a CRT memory
-//      block. Otherwise should be FALSE.
+DWORD WINAPI VisualLeakDetector::growthWatchdogProc (LPVOID param)
+{
+    VisualLeakDetector *vld = (VisualLeakDetector*)param;
+    HANDLE wake = vld->m_growthWake;
+    while (WaitForSingleObject(wake, INFINITE) == WAIT_OBJECT_0) {
+        LoaderLock ll;
+        if (vld->m_growthStop)
+            return 0;
+        SIZE_T snapshot = vld->TakeSnapshot();
+        Report(L"Visual Leak Detector: The memory in use grew by %Iu MB or more, to %Iu bytes.\n",
+            vld->m_growthTrigger / (1024 * 1024), vld->m_curAlloc);
+        vld->DiffSnapshots(vld->m_growthSnapshot, snapshot, vld->m_summaryCount);
+        vld->m_growthSnapshot = snapshot;
+    }
+    return 0;
+}
+
+// startHotModuleWatch - Starts the thread which excludes the hot modules that
+//   don't leak (see AutoExcludeHotModules). If the thread can't be started,
+//   no module is excluded automatically.
 //
 //  Return Value:
 //
 //    None.
 //
-VOID VisualLeakDetector::mapBlock (HANDLE heap, LPCVOID mem, SIZE_T size, bool debugcrtalloc, bool ucrt, DWORD threadId, blockinfo_t* &pblockInfo)
+VOID VisualLeakDetector::startHotModuleWatch ()
 {
-    CriticalSectionLocker<> cs(g_heapMapLock);
-
-    // Record the block's information.
-    blockinfo_t* blockinfo = new blockinfo_t();
-    blockinfo->callStack = NULL;
-    pblockInfo = blockinfo;
-    blockinfo->threadId = threadId;
-    blockinfo->serialNumber = m_requestCurr++;
-    blockinfo->size = size;
-    blockinfo->reported = false;
-    blockinfo->debugCrtAlloc = debugcrtalloc;
-    blockinfo->ucrt = ucrt;
-
-    if (SIZE_MAX - m_totalAlloc > size)
-        m_totalAlloc += size;
-    else
-        m_totalAlloc = SIZE_MAX;
-    m_curAlloc += size;
-
-    if (m_curAlloc > m_maxAlloc)
-        m_maxAlloc = m_curAlloc;
-
-    // Insert the block's information into the block map.
-    HeapMap::Iterator heapit = m_heapMap->find(heap);
-    if (heapit == m_heapMap->end()) {
-        // We haven't mapped this heap to a block map yet. Do it now.
-        mapHeap(heap);
-        heapit = m_heapMap->find(heap);
-        assert(heapit != m_heapMap->end());
-    }
-    BlockMap* blockmap = &(*heapit).second->blockMap;
-    BlockMap::Iterator blockit = blockmap->insert(mem, blockinfo);
-    if (blockit == blockmap->end()) {
-        // A block with this address has already been allocated. The
-        // previously allocated block must have been freed (probably by some
-        // mechanism unknown to VLD), or the heap wouldn't have allocated it
-        // again. Replace the previously allocated info with the new info.
-        blockit = blockmap->find(mem);
-        blockinfo_t* info = (*blockit).second;
-        m_curAlloc -= info->size;
-        Report(L"VLD: New allocation at already allocated address: 0x%p with size: %u and new size: %u\n", mem, info->size, size);
-        delete info;
-        blockmap->erase(blockit);
-        blockmap->insert(mem, blockinfo);
+    m_hotModuleWake = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (m_hotModuleWake == NULL)
+        return;
+    m_hotModuleThread = CreateThread(NULL, 0, hotModuleProc, this, CREATE_SUSPENDED, &m_hotModuleThreadId);
+    if (m_hotModuleThread == NULL) {
+        CloseHandle(m_hotModuleWake);
+        m_hotModuleWake = NULL;
+        m_hotModuleThreadId = 0;
+        return;
     }
+    SetThreadPriority(m_hotModuleThread, THREAD_PRIORITY_BELOW_NORMAL);
+    ResumeThread(m_hotModuleThread);
 }
 
-// mapheap - Tracks heap creation. Creates a block map for tracking individual
-//   allocations from the newly created heap and then maps the heap to this
-//   block map.
-//
-//  - heap (IN): Handle to the newly created heap.
+// stopHotModuleWatch - Stops excluding hot modules. Like stopGrowthWatchdog,
+//   this never waits for the thread to exit.
 //
 //  Return Value:
 //
 //    None.
 //
-VOID VisualLeakDetector::mapHeap (HANDLE heap)
+VOID VisualLeakDetector::stopHotModuleWatch ()
 {
-    CriticalSectionLocker<> cs(g_heapMapLock);
-
-    // Create a new block map for this heap and insert it into the heap map.
-    heapinfo_t* heapinfo = new heapinfo_t;
-    heapinfo->blockMap.reserve(BLOCK_MAP_RESERVE);
-    heapinfo->flags = 0x0;
+    if (m_hotModuleThread == NULL)
+        return;
 
-    HeapMap::Iterator heapit = m_heapMap->insert(heap, heapinfo);
-    if (heapit == m_heapMap->end()) {
-        // Somehow this heap has been created twice without being destroyed,
-        // or at least it was destroyed without VLD's knowledge. Unmap the heap
-        // from the existing heapinfo, and remap it to the new one.
-        Report(L"WARNING: Visual Leak Detector detected a duplicate heap (" ADDRESSFORMAT L").\n", heap);
-        heapit = m_heapMap->find(heap);
-        unmapHeap((*heapit).first);
-        m_heapMap->insert(heap, heapinfo);
+    m_hotModuleStop = TRUE;
+    SetEvent(m_hotModuleWake);
+    if (WaitForSingleObject(m_hotModuleThread, 0) == WAIT_OBJECT_0) {
+        CloseHandle(m_hotModuleWake);
+        m_hotModuleWake = NULL;
     }
+    CloseHandle(m_hotModuleThread);
+    m_hotModuleThread = NULL;
+    m_hotModuleThreadId = 0;
 }
 
-// unmapblock - Tracks memory blocks that are freed. Unmaps the specified block
-//   from the block's information, relinquishing internally allocated resources.
+// hotModuleProc - Watches the modules' allocation rates, once the warm-up is
+//   over, in rounds of two HotModuleWarmup periods: the allocations counted
+//   during the first period tell the hot modules, and the blocks allocated
+//   during it which are still allocated at the end of the second one are
+//   taken for leaks. The hot modules none of those blocks were allocated
+//   through are excluded.
 //
-//  - heap (IN): Handle to the heap to which this block is being freed.
-//
-//  - mem (IN): Pointer to the memory block being freed.
+//  - param (IN): The VisualLeakDetector.
 //
 //  Return Value:
 //
-//    None.
+//    Always returns 0.
 //
-VOID VisualLeakDetector::unmapBlock (HANDLE heap, LPCVOID mem, const context_t &context)
+DWORD WINAPI VisualLeakDetector::hotModuleProc (LPVOID param)
 {
-    if (NULL == mem)
-        return;
+    VisualLeakDetector *vld = (VisualLeakDetector*)param;
+    HANDLE wake = vld->m_hotModuleWake;
+    DWORD period = vld->m_hotModuleWarmup;
 
-    // Find this heap's block map.
-    CriticalSectionLocker<> cs(g_heapMapLock);
-    HeapMap::Iterator heapit = m_heapMap->find(heap);
-    if (heapit == m_heapMap->end()) {
-        // We don't have a block map for this heap. We must not have monitored
-        // this allocation (probably happened before VLD was initialized).
-        return;
-    }
+    // The warm-up leaves out the allocations made while the program starts,
+    // many of which are never freed on purpose.
+    if (WaitForSingleObject(wake, period) != WAIT_TIMEOUT)
+        return 0;
+    for (;;) {
+        SIZE_T count;
+        hotmodule_t *modules = vld->sampleHotModules(count);
+        SIZE_T from = vld->m_requestCurr;
+        ULONGLONG start = GetTickCount64();
+        if (WaitForSingleObject(wake, period) != WAIT_TIMEOUT) {
+            delete [] modules;
+            return 0;
+        }
 
-    // Find this block in the block map.
-    BlockMap           *blockmap = &(*heapit).second->blockMap;
-    BlockMap::Iterator  blockit = blockmap->find(mem);
-    if (blockit == blockmap->end())
-    {
-        // This memory block is not in the block map. We must not have monitored this
-        // allocation (probably happened before VLD was initialized).
-
-        // This can also result from allocating on one heap, and freeing on another heap.
-        // This is an especially bad way to corrupt the application.
-        // Now we have to search through every heap and every single block in each to make
-        // sure that this is indeed the case.
-        if (m_options & VLD_OPT_VALIDATE_HEAPFREE)
-        {
-            HANDLE other_heap = NULL;
-            blockinfo_t* alloc_block = findAllocedBlock(mem, other_heap); // other_heap is an out parameter
-            bool diff = other_heap != heap; // Check indeed if the other heap is different
-            if (alloc_block && alloc_block->callStack && diff)
-            {
-                Report(L"CRITICAL ERROR!: VLD reports that memory was allocated in one heap and freed in another.\nThis will result in a corrupted heap.\nAllocation Call stack.\n");
-                Report(L"---------- Block %Iu at " ADDRESSFORMAT L": %Iu bytes ----------\n", alloc_block->serialNumber, mem, alloc_block->size);
-                Report(L"  TID: %u\n", alloc_block->threadId);
-                Report(L"  Call Stack:\n");
-                alloc_block->callStack->dump(m_options & VLD_OPT_TRACE_INTERNAL_FRAMES);
+        // Keep the modules which were hot during the period.
+        SIZE_T to = vld->m_requestCurr;
+        ULONGLONG elapsed = max(GetTickCount64() - start, 1ULL);
+        SIZE_T hotCount = 0;
+        for (SIZE_T index = 0; index < count; index++) {
+            hotmodule_t &module = modules[index];
+            UINT64 allocations = (UINT64)vld->m_moduleCounters[module.image / MODULEIMAGES_PAGE_SIZE]
+                [module.image % MODULEIMAGES_PAGE_SIZE].allocations - module.allocations;
+            if (allocations * 1000 / elapsed >= vld->m_hotModuleRate) {
+                module.allocations = allocations * 1000 / elapsed;
+                modules[hotCount++] = module;
+            }
+        }
 
-                // Now we need a way to print the current callstack at this point:
-                CallStack* stack_here = CallStack::Create();
-                stack_here->getStackTrace(m_maxTraceFrames, context);
-                Report(L"Deallocation Call stack.\n");
-                Report(L"---------- Block %Iu at " ADDRESSFORMAT L": %Iu bytes ----------\n", alloc_block->serialNumber, mem, alloc_block->size);
-                Report(L"  Call Stack:\n");
-                stack_here->dump(FALSE);
-                // Now it should be safe to delete our temporary callstack
-                delete stack_here;
-                stack_here = NULL;
-                if (IsDebuggerPresent())
-                    DebugBreak();
+        // The blocks allocated during the period get another one to be freed.
+        if (WaitForSingleObject(wake, period) != WAIT_TIMEOUT) {
+            delete [] modules;
+            return 0;
+        }
+        if (hotCount != 0) {
+            LoaderLock ll;
+            if (vld->m_hotModuleStop) {
+                delete [] modules;
+                return 0;
             }
+            vld->excludeHotModules(modules, hotCount, from, to);
         }
-        return;
+        delete [] modules;
     }
+}
 
-    // Free the blockinfo_t structure and erase it from the block map.
-    blockinfo_t *info = (*blockit).second;
-    m_curAlloc -= info->size;
-    delete info;
-    blockmap->erase(blockit);
+// sampleHotModules - Reads the allocation counters of the loaded modules
+//   which are still included in leak detection.
+//
+//  - count (OUT): Receives the number of modules sampled.
+//
+//  Return Value:
+//
+//    Returns the modules, to be deleted by the caller.
+//
+hotmodule_t* VisualLeakDetector::sampleHotModules (SIZE_T &count)
+{
+    CriticalSectionLocker<> cs(m_modulesLock);
+    SIZE_T capacity = 0;
+    for (ModuleSet::Iterator moduleit = m_loadedModules->begin(); moduleit != m_loadedModules->end(); ++moduleit)
+        capacity++;
+    hotmodule_t *modules = new hotmodule_t [capacity + 1];
+    count = 0;
+    for (ModuleSet::Iterator moduleit = m_loadedModules->begin(); moduleit != m_loadedModules->end(); ++moduleit) {
+        const moduleinfo_t &moduleinfo = *moduleit;
+        if ((moduleinfo.flags & VLD_MODULE_EXCLUDED) || (moduleinfo.image == MODULEIMAGE_NONE) ||
+            (m_moduleCounters[moduleinfo.image / MODULEIMAGES_PAGE_SIZE] == NULL))
+            continue;
+        hotmodule_t &module = modules[count++];
+        module.base = moduleinfo.addrLow;
+        module.image = moduleinfo.image;
+        module.allocations = (UINT64)m_moduleCounters[module.image / MODULEIMAGES_PAGE_SIZE]
+            [module.image % MODULEIMAGES_PAGE_SIZE].allocations;
+        module.implicated = false;
+    }
+    return modules;
 }
 
-// unmapheap - Tracks heap destruction. Unmaps the specified heap from its block
-//   map. The block map is cleared and deleted, relinquishing internally
-//   allocated resources.
+// excludeHotModules - Excludes the hot modules which no block allocated
+//   between two serial numbers, and still allocated, was allocated through:
+//   those on none of the blocks' call stacks. A module is only excluded if
+//   it's still loaded at the same address.
 //
-//  - heap (IN): Handle to the heap which is being destroyed.
+//  - modules (IN/OUT): The hot modules, with their allocation rates.
+//
+//  - count (IN): Number of modules.
+//
+//  - from (IN): Serial number of the first block looked at.
+//
+//  - to (IN): Serial number of the first block left out.
 //
 //  Return Value:
 //
 //    None.
 //
-VOID VisualLeakDetector::unmapHeap (HANDLE heap)
+VOID VisualLeakDetector::excludeHotModules (hotmodule_t *modules, SIZE_T count, SIZE_T from, SIZE_T to)
 {
-    // Find this heap's block map.
-    CriticalSectionLocker<> cs(g_heapMapLock);
-    HeapMap::Iterator heapit = m_heapMap->find(heap);
-    if (heapit == m_heapMap->end()) {
-        // This heap hasn't been mapped. We must not have monitored this heap's
-        // creation (probably happened before VLD was initialized).
-        return;
+    flushAllPendingBlocks();
+    {
+        CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+        ModuleRangesReader reader(*this, getTls());
+        const moduleranges_t *table = reader.Table();
+        HashMap<CallStack*, bool> seen;
+        for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
+            heapinfo_t* heapinfo = (*heapit).second;
+            for (UINT shard = 0; shard < BLOCKMAPSHARDS; shard++) {
+                for (blockinfo_t* info = heapinfo->newest[shard]; (info != NULL) && (info->serialNumber >= from); info = info->older) {
+                    if ((info->serialNumber >= to) || !info->callStack)
+                        continue;
+
+                    // Every frame's module is implicated, not only the
+                    // allocating one, which is enough to spare a module
+                    // whose leaks are allocated on its behalf elsewhere.
+                    bool inserted;
+                    CallStack *callStack = info->callStack.get();
+                    seen.insert(callStack, true, inserted);
+                    if (!inserted)
+                        continue;
+                    for (UINT32 frame = 0; frame < callStack->size(); frame++) {
+                        const modulerange_t *range = FindModuleRange(table, (*callStack)[frame]);
+                        if (range == NULL)
+                            continue;
+                        for (SIZE_T index = 0; index < count; index++) {
+                            if (modules[index].image == range->image)
+                                modules[index].implicated = true;
+                        }
+                    }
+                }
+            }
+        }
     }
 
-    // Free all of the blockinfo_t structures stored in the block map.
-    heapinfo_t *heapinfo = (*heapit).second;
-    BlockMap   *blockmap = &heapinfo->blockMap;
-    for (BlockMap::Iterator blockit = blockmap->begin(); blockit != blockmap->end(); ++blockit) {
-        m_curAlloc -= (*blockit).second->size;
-        delete (*blockit).second;
+    CriticalSectionLocker<> cs(m_modulesLock);
+    bool excluded = false;
+    for (SIZE_T index = 0; index < count; index++) {
+        const hotmodule_t &module = modules[index];
+        if (module.implicated)
+            continue;
+        for (ModuleSet::Iterator moduleit = m_loadedModules->begin(); moduleit != m_loadedModules->end(); ++moduleit) {
+            moduleinfo_t *moduleinfo = (moduleinfo_t*)&(*moduleit);
+            if ((moduleinfo->addrLow != module.base) || (moduleinfo->image != module.image) ||
+                (moduleinfo->flags & VLD_MODULE_EXCLUDED))
+                continue;
+            moduleinfo->flags |= VLD_MODULE_EXCLUDED | VLD_MODULE_AUTOEXCLUDED;
+            excluded = true;
+            Report(L"Visual Leak Detector: Excluding %s, which allocates %llu times a second without leaking.\n",
+                moduleinfo->name, module.allocations);
+            break;
+        }
     }
-    delete heapinfo;
-
-    // Remove this heap's block map from the heap map.
-    m_heapMap->erase(heapit);
+    if (excluded)
+        publishModuleRanges();
 }
 
-// remapblock - Tracks reallocations. Unmaps a block from its previously
-//   collected information and remaps it to updated information.
+// prefetchSymbols - Queues the modules of a set whose symbols are to be
+//   loaded by the prefetch thread: those included in leak detection, since
+//   they are the ones leaks are reported from, and which weren't known yet.
 //
-//  Note: If the block itself remains at the same address, then the block's
-//   information can simply be updated rather than having to actually erase and
-//   reinsert the block.
+//   Note: The caller must hold m_modulesLock.
 //
-//  - heap (IN): Handle to the heap from which the memory is being reallocated.
+//  - modules (IN): The modules.
 //
-//  - mem (IN): Pointer to the memory block being reallocated.
+//  - known (IN): The modules which were already loaded, or NULL.
 //
-//  - newmem (IN): Pointer to the memory block being returned to the caller
-//      that requested the reallocation. This pointer may or may not be the same
-//      as the original memory block (as pointed to by "mem").
+//  Return Value:
 //
-//  - size (IN): Size, in bytes, of the new memory block.
+//    None.
 //
-//  - framepointer (IN): The frame pointer at which this reallocation entered
-//      VLD's code. Used for determining the starting point of the stack trace.
+VOID VisualLeakDetector::prefetchSymbols (const ModuleSet *modules, const ModuleSet *known)
+{
+    if ((m_prefetchThread == NULL) || (modules == NULL))
+        return;
+
+    bool queued = false;
+    {
+        CriticalSectionLocker<> cs(m_prefetchLock);
+        for (ModuleSet::Iterator moduleit = modules->begin(); moduleit != modules->end(); ++moduleit) {
+            if ((*moduleit).flags & (VLD_MODULE_EXCLUDED | VLD_MODULE_SYMBOLSQUERIED))
+                continue;
+            if ((known != NULL) && (known->find(*moduleit) != known->end()))
+                continue;
+            if (m_prefetchCount == VLD_PREFETCH_QUEUE)
+                break;
+            m_prefetchQueue[(m_prefetchHead + m_prefetchCount) % VLD_PREFETCH_QUEUE] = (*moduleit).addrLow;
+            m_prefetchCount++;
+            queued = true;
+        }
+    }
+    if (queued)
+        SetEvent(m_prefetchWake);
+}
+
+// symbolPrefetchProc - Loads the symbols of the queued modules, one module
+//   at a time, until symbol prefetching is stopped. Each module is loaded
+//   under the same locks, taken in the same order, as when its symbols are
+//   loaded on demand (see ResolveCallstacks), so they are only held for as
+//   long as one module takes.
 //
-//  - crtalloc (IN): Should be set to TRUE if this reallocation is for a CRT
-//      memory block. Otherwise should be set to FALSE.
+//  - param (IN): The VisualLeakDetector.
 //
 //  Return Value:
 //
-//    None.
+//    Always returns 0.
 //
-VOID VisualLeakDetector::remapBlock (HANDLE heap, LPCVOID mem, LPCVOID newmem, SIZE_T size,
-    bool debugcrtalloc, bool ucrt, DWORD threadId, blockinfo_t* &pblockInfo, const context_t &context)
+DWORD WINAPI VisualLeakDetector::symbolPrefetchProc (LPVOID param)
 {
-    CriticalSectionLocker<> cs(g_heapMapLock);
-
-    if (newmem != mem) {
-        // The block was not reallocated in-place. Instead the old block was
-        // freed and a new block allocated to satisfy the new size.
-        unmapBlock(heap, mem, context);
-        mapBlock(heap, newmem, size, debugcrtalloc, ucrt, threadId, pblockInfo);
-        return;
-    }
+    VisualLeakDetector *vld = (VisualLeakDetector*)param;
+    HANDLE wake = vld->m_prefetchWake;
+    while (WaitForSingleObject(wake, INFINITE) == WAIT_OBJECT_0) {
+        for (;;) {
+            UINT_PTR modulebase;
+            {
+                CriticalSectionLocker<> cs(vld->m_prefetchLock);
+                if (vld->m_prefetchStop)
+                    return 0;
+                if (vld->m_prefetchCount == 0)
+                    break;
+                modulebase = vld->m_prefetchQueue[vld->m_prefetchHead];
+                vld->m_prefetchHead = (vld->m_prefetchHead + 1) % VLD_PREFETCH_QUEUE;
+                vld->m_prefetchCount--;
+            }
 
-    // The block was reallocated in-place. Find the existing blockinfo_t
-    // entry in the block map and update it with the new callstack and size.
-    HeapMap::Iterator heapit = m_heapMap->find(heap);
-    if (heapit == m_heapMap->end()) {
-        // We haven't mapped this heap to a block map yet. Obviously the
-        // block has also not been mapped to a blockinfo_t entry yet either,
-        // so treat this reallocation as a brand-new allocation (this will
-        // also map the heap to a new block map).
-        mapBlock(heap, newmem, size, debugcrtalloc, ucrt, threadId, pblockInfo);
-        return;
+            LoaderLock ll;
+            CriticalSectionLocker<DbgHelp> locker(g_DbgHelp);
+            if (vld->m_prefetchStop)
+                return 0;
+            vld->loadSymbolsForAddress(modulebase, locker);
+        }
     }
+    return 0;
+}
 
-    // Find the block's blockinfo_t structure so that we can update it.
-    BlockMap           *blockmap = &(*heapit).second->blockMap;
-    BlockMap::Iterator  blockit = blockmap->find(mem);
-    if (blockit == blockmap->end()) {
-        // The block hasn't been mapped to a blockinfo_t entry yet.
-        // Treat this reallocation as a new allocation.
-        mapBlock(heap, newmem, size, debugcrtalloc, ucrt, threadId, pblockInfo);
-        return;
+// loadSymbolServer - Loads symsrv.dll, the symbol server dbghelp uses, and
+//   sets it up for fetching PDBs unattended. The copy next to dbghelp.dll
+//   is preferred, since that is the one dbghelp itself loads.
+//
+//  Return Value:
+//
+//    Returns the address of symsrv's SymbolServerW function, or NULL if it
+//    couldn't be loaded.
+//
+static PSYMBOLSERVERPROCW loadSymbolServer ()
+{
+    HMODULE symsrv = NULL;
+    WCHAR   path [MAX_PATH] = {0};
+    HMODULE dbghelp = GetModuleHandleW(L"dbghelp.dll");
+    if ((dbghelp != NULL) && (GetModuleFileNameW(dbghelp, path, MAX_PATH) != 0)) {
+        LPWSTR name = wcsrchr(path, L'\\');
+        if (name != NULL) {
+            wcsncpy_s(name + 1, MAX_PATH - (name + 1 - path), L"symsrv.dll", _TRUNCATE);
+            symsrv = LoadLibraryW(path);
+        }
     }
+    if (symsrv == NULL)
+        symsrv = LoadLibraryW(L"symsrv.dll");
+    if (symsrv == NULL)
+        return NULL;
 
-    // Found the blockinfo_t entry for this block. Update it with
-    // a new callstack and new size.
-    blockinfo_t* info = (*blockit).second;
-    if (info->callStack)
-    {
-        info->callStack.reset();
+    PSYMBOLSERVERSETOPTIONSPROC setoptions = (PSYMBOLSERVERSETOPTIONSPROC)GetProcAddress(symsrv, "SymbolServerSetOptions");
+    if (setoptions != NULL) {
+        // The ids are passed as a GUID, and no dialog may ever be shown.
+        setoptions(SSRVOPT_GUIDPTR, TRUE);
+        setoptions(SSRVOPT_UNATTENDED, TRUE);
     }
+    return (PSYMBOLSERVERPROCW)GetProcAddress(symsrv, "SymbolServerW");
+}
 
-    if (m_totalAlloc < SIZE_MAX)
-    {
-        m_totalAlloc -= info->size;
-        if (SIZE_MAX - m_totalAlloc > size)
-            m_totalAlloc += size;
-        else
-            m_totalAlloc = SIZE_MAX;
-    }
+// symbolFetchProc - Fetches the queued PDBs from the symbol servers, one at
+//   a time, until symbol fetching is stopped. The downloads are made through
+//   symsrv directly, without the DbgHelp lock: dbghelp is single-threaded,
+//   and holding its lock through a download would stall every thread which
+//   needs a call stack resolved. Only handing the result back takes it.
+//
+//  - param (IN): The VisualLeakDetector.
+//
+//  Return Value:
+//
+//    Always returns 0.
+//
+DWORD WINAPI VisualLeakDetector::symbolFetchProc (LPVOID param)
+{
+    VisualLeakDetector *vld = (VisualLeakDetector*)param;
+    HANDLE wake = vld->m_symbolFetchWake;
+    PSYMBOLSERVERPROCW symbolserver = NULL;
+    BOOL loaded = FALSE;
+    while (WaitForSingleObject(wake, INFINITE) == WAIT_OBJECT_0) {
+        for (;;) {
+            symbolfetch_t fetch;
+            {
+                CriticalSectionLocker<> cs(vld->m_symbolFetchLock);
+                if (vld->m_symbolFetchStop)
+                    return 0;
+                if (vld->m_symbolFetchCount == 0)
+                    break;
+                fetch = vld->m_symbolFetchQueue[vld->m_symbolFetchHead];
+                vld->m_symbolFetchHead = (vld->m_symbolFetchHead + 1) % VLD_SYMBOL_FETCH_QUEUE;
+                vld->m_symbolFetchCount--;
+            }
 
-    m_curAlloc -= info->size;
-    m_curAlloc += size;
+            if (!loaded) {
+                symbolserver = loadSymbolServer();
+                loaded = TRUE;
+            }
 
-    if (m_curAlloc > m_maxAlloc)
-        m_maxAlloc = m_curAlloc;
+            // Try each server in turn, until one has the PDB.
+            BOOL fetched = FALSE;
+            if (symbolserver != NULL) {
+                LPCWSTR servers = vld->m_symbolServers;
+                while (!fetched && (*servers != L'\0') && !vld->m_symbolFetchStop) {
+                    WCHAR server [MAX_PATH * 2] = {0};
+                    LPCWSTR end = wcschr(servers, L';');
+                    SIZE_T length = (end != NULL) ? (SIZE_T)(end - servers) : wcslen(servers);
+                    wcsncpy_s(server, _countof(server), servers, min(length, _countof(server) - 1));
+                    servers += (end != NULL) ? length + 1 : length;
+
+                    WCHAR found [MAX_PATH] = {0};
+                    fetched = symbolserver(server, fetch.pdbName, &fetch.pdbGuid, fetch.pdbAge, 0, found);
+                }
+            }
 
-    info->threadId = threadId;
-    // Update the block's size.
-    info->size = size;
-    pblockInfo = info;
+            LoaderLock ll;
+            CriticalSectionLocker<DbgHelp> locker(g_DbgHelp);
+            if (vld->m_symbolFetchStop)
+                return 0;
+            vld->symbolsFetched(fetch.base, fetched, locker);
+        }
+    }
+    return 0;
 }
 
-// reportconfig - Generates a brief report summarizing Visual Leak Detector's
-//   configuration, as loaded from the vld.ini file.
+// symbolLoadCallback - Called by dbghelp while it loads symbols. When the
+//   SymbolServerTimeout option is set, a deferred symbol load which takes
+//   longer than that is canceled, and left for symbolLoadTimedOut to hand
+//   over to the fetch thread. Called with the DbgHelp lock held, by the
+//   thread which made the dbghelp call.
+//
+//  - process (IN): The process whose symbols are loading.
+//
+//  - actioncode (IN): The event dbghelp reports.
+//
+//  - callbackdata (IN): The data of the event.
+//
+//  - usercontext (IN): The VisualLeakDetector.
 //
 //  Return Value:
 //
-//    None.
+//    Returns TRUE to cancel the load, on CBA_DEFERRED_SYMBOL_LOAD_CANCEL,
+//    and FALSE otherwise.
 //
-VOID VisualLeakDetector::reportConfig ()
+BOOL CALLBACK VisualLeakDetector::symbolLoadCallback (HANDLE /*process*/, ULONG actioncode, ULONG64 callbackdata,
+    ULONG64 usercontext)
 {
-    if (m_options & VLD_OPT_AGGREGATE_DUPLICATES) {
-        Report(L"    Aggregating duplicate leaks.\n");
-    }
-    if (m_forcedModuleList[0] != '\0') {
-        Report(L"    Forcing %s of these modules in leak detection: %s\n",
+    VisualLeakDetector *vld = (VisualLeakDetector*)usercontext;
+    switch (actioncode) {
+    case CBA_DEFERRED_SYMBOL_LOAD_START:
+        vld->m_symbolLoadStart = GetTickCount64();
+        vld->m_symbolLoadBase = ((PIMAGEHLP_DEFERRED_SYMBOL_LOADW64)callbackdata)->BaseOfImage;
+        return FALSE;
+
+    case CBA_DEFERRED_SYMBOL_LOAD_COMPLETE:
+    case CBA_DEFERRED_SYMBOL_LOAD_FAILURE:
+        vld->m_symbolLoadStart = 0;
+        return FALSE;
+
+    case CBA_DEFERRED_SYMBOL_LOAD_CANCEL:
+        // Polled by dbghelp while the load is in progress.
+        if ((vld->m_symbolLoadStart != 0) &&
+            (GetTickCount64() - vld->m_symbolLoadStart >= vld->m_symbolServerTimeout)) {
+            vld->m_symbolLoadStart = 0;
+            vld->m_symbolLoadCanceled = TRUE;
+            return TRUE;
+        }
+        return FALSE;
+
+    default:
+        return FALSE;
+    }
+}
+
+// collectSymbolServers - Collects the symbol servers of a symbol search path:
+//   the parameters of its "srv*" elements, which are what symsrv's
+//   SymbolServer function takes.
+//
+//  - symbolpath (IN): The symbol search path.
+//
+//  Return Value:
+//
+//    Returns the servers, separated by ";", or NULL if the search path has
+//    none. The caller is responsible for freeing the string.
+//
+static LPWSTR collectSymbolServers (LPCWSTR symbolpath)
+{
+    LPWSTR servers = NULL;
+    while (*symbolpath != L'\0') {
+        LPCWSTR end = wcschr(symbolpath, L';');
+        SIZE_T length = (end != NULL) ? (SIZE_T)(end - symbolpath) : wcslen(symbolpath);
+        WCHAR element [MAX_PATH * 2] = {0};
+        wcsncpy_s(element, _countof(element), symbolpath, min(length, _countof(element) - 1));
+        if ((wcslen(element) > 4) && (_wcsnicmp(element, L"srv*", 4) == 0)) {
+            if (servers == NULL) {
+                servers = new WCHAR [1];
+                servers[0] = L'\0';
+            }
+            else {
+                servers = AppendString(servers, L";");
+            }
+            servers = AppendString(servers, element + 4);
+        }
+        symbolpath += (end != NULL) ? length + 1 : length;
+    }
+    return servers;
+}
+
+// initializeSymbolHandler - Initializes the symbol handler, with VLD's symbol
+//   search path. Called by g_DbgHelp, with its lock held, the first time
+//   symbols are needed (see DbgHelp::DeferInitialize).
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::initializeSymbolHandler ()
+{
+    UINT64 start = __rdtsc();
+    LPWSTR symbolpath = g_vld.buildSymbolSearchPath();
+#ifdef NOISY_DBGHELP_DIAGOSTICS
+    // From MSDN docs about SYMOPT_DEBUG:
+    /* To view all attempts to load symbols, call SymSetOptions with SYMOPT_DEBUG.
+    This causes DbgHelp to call the OutputDebugString function with detailed
+    information on symbol searches, such as the directories it is searching and and error messages.
+    In other words, this will really pollute the debug output window with extra messages.
+    To enable this debug output to be displayed to the console without changing your source code,
+    set the DBGHELP_DBGOUT environment variable to a non-NULL value before calling the SymInitialize function.
+    To log the information to a file, set the DBGHELP_LOG environment variable to the name of the log file to be used.
+    */
+    g_DbgHelp.SymSetOptions(SYMOPT_DEBUG | SYMOPT_UNDNAME | SYMOPT_DEFERRED_LOADS | SYMOPT_LOAD_LINES);
+#else
+    g_DbgHelp.SymSetOptions(SYMOPT_UNDNAME | SYMOPT_DEFERRED_LOADS | SYMOPT_LOAD_LINES);
+#endif
+    DbgTrace(L"dbghelp32.dll %i: SymInitializeW\n", GetCurrentThreadId());
+    if (!g_DbgHelp.SymInitializeW(g_currentProcess, symbolpath, FALSE)) {
+        Report(L"WARNING: Visual Leak Detector: The symbol handler failed to initialize (error=%lu).\n"
+            L"    File and function names will probably not be available in call stacks.\n", GetLastError());
+    }
+    if (g_vld.m_symbolServerTimeout != 0) {
+        // Loads which take too long are canceled, and fetched in the
+        // background from the servers instead (see symbolLoadCallback).
+        g_vld.m_symbolServers = collectSymbolServers(symbolpath);
+        g_DbgHelp.SymRegisterCallbackW64(g_currentProcess, symbolLoadCallback, (ULONG64)&g_vld);
+    }
+    delete [] symbolpath;
+    g_vld.m_startupStats.symbolInitTicks = __rdtsc() - start;
+}
+
+// buildsymbolsearchpath - Builds the symbol search path for the symbol handler.
+//   This helps the symbol handler find the symbols for the application being
+//   debugged.
+//
+//  Return Value:
+//
+//    Returns a string containing the search path. The caller is responsible for
+//    freeing the string.
+//
+LPWSTR VisualLeakDetector::buildSymbolSearchPath ()
+{
+    // Oddly, the symbol handler ignores the link to the PDB embedded in the
+    // executable image. So, we'll manually add the location of the executable
+    // to the search path since that is often where the PDB will be located.
+    WCHAR   directory [_MAX_DIR] = {0};
+    WCHAR   drive [_MAX_DRIVE] = {0};
+    LPWSTR  path = new WCHAR [MAX_PATH * 4];
+    path[0] = L'\0';
+
+    HMODULE module = GetModuleHandleW(NULL);
+    GetModuleFileName(module, path, MAX_PATH);
+    _wsplitpath_s(path, drive, _MAX_DRIVE, directory, _MAX_DIR, NULL, 0, NULL, 0);
+    wcsncpy_s(path, MAX_PATH, drive, _TRUNCATE);
+    path = AppendString(path, directory);
+    path = AppendString(path, L";");
+
+    // When the symbol handler is given a custom symbol search path, it will no
+    // longer search the default directories (working directory, _NT_SYMBOL_PATH,
+    // etc...). But we'd like it to still search those directories, so we'll add
+    // them to our custom search path.
+
+    // Append the working directory.
+    path = AppendString(path, L".\\;");
+
+    // Append %_NT_SYMBOL_PATH%.
+    DWORD   envlen = GetEnvironmentVariable(L"_NT_SYMBOL_PATH", NULL, 0);
+    if (envlen != 0) {
+        LPWSTR env = new WCHAR [envlen];
+        if (GetEnvironmentVariable(L"_NT_SYMBOL_PATH", env, envlen) != 0) {
+            path = AppendString(path, env);
+            path = AppendString(path, L";");
+        }
+        delete [] env;
+    }
+
+    // Append %_NT_ALT_SYMBOL_PATH%.
+    envlen = GetEnvironmentVariable(L"_NT_ALT_SYMBOL_PATH", NULL, 0);
+    if (envlen != 0) {
+        LPWSTR env = new WCHAR [envlen];
+        if (GetEnvironmentVariable(L"_NT_ALT_SYMBOL_PATH", env, envlen) != 0) {
+            path = AppendString(path, env);
+            path = AppendString(path, L";");
+        }
+        delete [] env;
+    }
+
+    // Append %_NT_ALTERNATE_SYMBOL_PATH%.
+    envlen = GetEnvironmentVariable(L"_NT_ALTERNATE_SYMBOL_PATH", NULL, 0);
+    if (envlen != 0) {
+        LPWSTR env = new WCHAR [envlen];
+        if (GetEnvironmentVariable(L"_NT_ALTERNATE_SYMBOL_PATH", env, envlen) != 0) {
+            path = AppendString(path, env);
+            path = AppendString(path, L";");
+        }
+        delete [] env;
+    }
+
+#if _MSC_VER > 2000
+#error Not supported VS
+#endif
+    // Append Visual Studio 2015/2013/2012/2010/2008 symbols cache directory.
+    // NOTE: This does not seem to exist for VS 2019 on Windows 10, but leaving it as is for now, updated to 2019 (changed 14->16)
+    for (UINT n = 9; n <= 16; ++n) {
+        WCHAR debuggerpath[MAX_PATH] = { 0 };
+        swprintf(debuggerpath, _countof(debuggerpath), L"Software\\Microsoft\\VisualStudio\\%u.0\\Debugger", n);
+        HKEY debuggerkey;
+        WCHAR symbolCacheDir[MAX_PATH] = { 0 };
+        LSTATUS regstatus = RegOpenKeyExW(HKEY_CURRENT_USER, debuggerpath, 0, KEY_QUERY_VALUE, &debuggerkey);
+
+        if (regstatus == ERROR_SUCCESS) {
+            DWORD valuetype;
+            DWORD dirLength = MAX_PATH * sizeof(WCHAR);
+            regstatus = RegQueryValueExW(debuggerkey, L"SymbolCacheDir", NULL, &valuetype, (LPBYTE)&symbolCacheDir, &dirLength);
+            if (regstatus == ERROR_SUCCESS && valuetype == REG_SZ && symbolCacheDir[0] != NULL && !wcsstr(path, symbolCacheDir)) {
+                path = AppendString(path, symbolCacheDir);
+                path = AppendString(path, L"\\MicrosoftPublicSymbols;");
+                path = AppendString(path, symbolCacheDir);
+                path = AppendString(path, L";");
+            }
+            RegCloseKey(debuggerkey);
+        }
+    }
+
+    // Remove any quotes from the path. The symbol handler doesn't like them.
+    SIZE_T  pos = 0;
+    SIZE_T  length = wcslen(path);
+    while (pos < length) {
+        if (path[pos] == L'\"') {
+            for (SIZE_T  index = pos; index < length; index++) {
+                path[index] = path[index + 1];
+            }
+        }
+        pos++;
+    }
+
+    // Give the symbol servers with no downstream store of their own the
+    // SymbolCacheDir one, so that the PDBs are only ever downloaded once.
+    if (m_symbolCacheDir[0] != L'\0') {
+        LPWSTR  rewritten = new WCHAR [1];
+        rewritten[0] = L'\0';
+        LPCWSTR element = path;
+        while (*element != L'\0') {
+            LPCWSTR end = wcschr(element, L';');
+            SIZE_T  elementlength = (end != NULL) ? (SIZE_T)(end - element) : wcslen(element);
+            WCHAR   buffer [MAX_PATH * 2] = {0};
+            wcsncpy_s(buffer, _countof(buffer), element, min(elementlength, _countof(buffer) - 1));
+            if ((_wcsnicmp(buffer, L"srv*", 4) == 0) && (wcschr(buffer + 4, L'*') == NULL)) {
+                // "srv*server" becomes "srv*store*server".
+                rewritten = AppendString(rewritten, L"srv*");
+                rewritten = AppendString(rewritten, m_symbolCacheDir);
+                rewritten = AppendString(rewritten, L"*");
+                rewritten = AppendString(rewritten, buffer + 4);
+            }
+            else {
+                rewritten = AppendString(rewritten, buffer);
+            }
+            if (end != NULL)
+                rewritten = AppendString(rewritten, L";");
+            element += (end != NULL) ? elementlength + 1 : elementlength;
+        }
+        delete [] path;
+        path = rewritten;
+    }
+
+    return path;
+}
+
+// GetIniFilePath - Obtains vld.ini file path.
+//
+//  Return Value:
+//
+//    Returns true if an actual vld.ini file was found
+//    Otherwise, returns false.
+//
+BOOL VisualLeakDetector::GetIniFilePath(LPTSTR lpPath, SIZE_T cchPath)
+{
+    TCHAR  path[MAX_PATH] = {0};
+    struct _stat s;
+    DWORD written = 0;
+
+    // Get the location of the vld.ini file from current directory path.
+    if (0 < (written = GetCurrentDirectory(MAX_PATH, path))) {
+        _tcsncpy_s(&path[written], MAX_PATH - written, TEXT("\\vld.ini"), _TRUNCATE);
+        if (_tstat(path, &s) == 0) {
+            _tcsncpy_s(lpPath, cchPath, path, _TRUNCATE);
+            return TRUE;
+        }
+    }
+
+    // Get the location of the vld.ini file from VLDDLL file path.
+    HMODULE hModule = GetCallingModule((UINT_PTR)this);
+    if (0 < (written = GetModuleFileName(hModule, path, MAX_PATH))) {
+        LPTSTR p = _tcsrchr(path, TEXT('\\'));
+        written = (DWORD)(p - path);
+        if (p && 0 == _tcsncpy_s(p, MAX_PATH - written, TEXT("\\vld.ini"), _TRUNCATE)) {
+            if (_tstat(path, &s) == 0) {
+                _tcsncpy_s(lpPath, cchPath, path, _TRUNCATE);
+                return TRUE;
+            }
+        }
+    }
+
+    // Get the location of the vld.ini file from executable file path.
+    if (0 < (written = GetModuleFileName(NULL, path, MAX_PATH))) {
+        LPTSTR p = _tcsrchr(path, TEXT('\\'));
+        written = (DWORD)(p - path);
+        if (p && 0 == _tcsncpy_s(p, MAX_PATH - written, TEXT("\\vld.ini"), _TRUNCATE)) {
+            if (_tstat(path, &s) == 0) {
+                _tcsncpy_s(lpPath, cchPath, path, _TRUNCATE);
+                return TRUE;
+            }
+        }
+    }
+
+    HKEY         productkey = 0;
+    DWORD        length = 0;
+    DWORD        valuetype = 0;
+
+    // Get the location of the vld.ini file from the registry.
+    LONG regstatus = RegOpenKeyEx(HKEY_CURRENT_USER, VLDREGKEYPRODUCT, 0, KEY_QUERY_VALUE, &productkey);
+    if (regstatus == ERROR_SUCCESS) {
+        length = MAX_PATH * sizeof(TCHAR);
+        regstatus = RegQueryValueEx(productkey, TEXT("IniFile"), NULL, &valuetype, (LPBYTE)&path, &length);
+        RegCloseKey(productkey);
+        if (regstatus == ERROR_SUCCESS && (_tstat(path, &s) == 0)) {
+            _tcsncpy_s(lpPath, cchPath, path, _TRUNCATE);
+            return TRUE;
+        }
+    }
+
+    // Get the location of the vld.ini file from the registry.
+    regstatus = RegOpenKeyEx(HKEY_LOCAL_MACHINE, VLDREGKEYPRODUCT, 0, KEY_QUERY_VALUE, &productkey);
+    if (regstatus == ERROR_SUCCESS) {
+        length = MAX_PATH * sizeof(TCHAR);
+        regstatus = RegQueryValueEx(productkey, TEXT("IniFile"), NULL, &valuetype, (LPBYTE)&path, &length);
+        RegCloseKey(productkey);
+        if (regstatus == ERROR_SUCCESS && (_tstat(path, &s) == 0)) {
+            _tcsncpy_s(lpPath, cchPath, path, _TRUNCATE);
+            return TRUE;
+        }
+    }
+
+    _tcsncpy_s(lpPath, cchPath, TEXT("vld.ini"), _TRUNCATE);
+    return FALSE;
+}
+
+// parseWalkMethod - Converts the name of a stack walk method, as accepted by
+//   StackWalkMethod, to the method's VLD_OPT_*_STACK_WALK bit.
+//
+//  - name (IN): The name.
+//
+//  Return Value:
+//
+//    Returns the method's bit, 0 for the fast method, or
+//    CALLSTACK_WALK_CONFIGURED if the name isn't known.
+//
+static UINT32 parseWalkMethod (LPCWSTR name)
+{
+    if (_wcsicmp(name, L"fast") == 0)
+        return 0x0;
+    if (_wcsicmp(name, L"safe") == 0)
+        return VLD_OPT_SAFE_STACK_WALK;
+    if (_wcsicmp(name, L"unwind") == 0)
+        return VLD_OPT_UNWIND_STACK_WALK;
+    if (_wcsicmp(name, L"frame") == 0)
+        return VLD_OPT_FRAME_STACK_WALK;
+    if (_wcsicmp(name, L"shadow") == 0)
+        return VLD_OPT_SHADOW_STACK_WALK;
+    if (_wcsicmp(name, L"none") == 0)
+        return VLD_OPT_NO_STACK_WALK;
+    if (_wcsicmp(name, L"caller") == 0)
+        return VLD_OPT_CALLER_STACK_WALK;
+    if (_wcsicmp(name, L"ntdb") == 0)
+        return VLD_OPT_NTDB_STACK_WALK;
+    return CALLSTACK_WALK_CONFIGURED;
+}
+
+// walkMethodName - Names a stack walk method, as parseWalkMethod converts it.
+static LPCWSTR walkMethodName (UINT32 method)
+{
+    switch (method) {
+    case 0x0:                       return L"fast";
+    case VLD_OPT_SAFE_STACK_WALK:   return L"safe";
+    case VLD_OPT_UNWIND_STACK_WALK: return L"unwind";
+    case VLD_OPT_FRAME_STACK_WALK:  return L"frame";
+    case VLD_OPT_SHADOW_STACK_WALK: return L"shadow";
+    case VLD_OPT_NO_STACK_WALK:     return L"no";
+    case VLD_OPT_CALLER_STACK_WALK: return L"caller";
+    case VLD_OPT_NTDB_STACK_WALK:   return L"ntdb";
+    default:                        return L"the configured";
+    }
+}
+
+// loadTracePolicies - Parses the ModuleTracePolicy option: a comma separated
+//   list of "module:frames:method" entries, where either of the frames and
+//   the method may be left out (or the frames given as 0) to keep the
+//   MaxTraceFrames and StackWalkMethod settings. The policies take effect
+//   through the module range table (see publishModuleRanges).
+//
+//  - policies (IN/OUT): The option's value. It's tokenized in place.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::loadTracePolicies (LPWSTR policies)
+{
+    m_tracePolicyCount = 0;
+    LPWSTR context = NULL;
+    for (LPWSTR entry = wcstok_s(policies, L",", &context); entry != NULL; entry = wcstok_s(NULL, L",", &context)) {
+        if (m_tracePolicyCount == VLD_MAX_TRACE_POLICIES) {
+            Report(L"WARNING: Visual Leak Detector: Only the first %u ModuleTracePolicy entries are used.\n",
+                VLD_MAX_TRACE_POLICIES);
+            break;
+        }
+
+        LPWSTR fields [3] = { NULL, NULL, NULL };
+        LPWSTR fieldcontext = NULL;
+        for (UINT index = 0; index < _countof(fields); index++) {
+            fields[index] = wcstok_s((index == 0) ? entry : NULL, L": \t", &fieldcontext);
+            if (fields[index] == NULL)
+                break;
+        }
+        if (fields[0] == NULL)
+            continue;
+
+        tracepolicy_t &policy = m_tracePolicies[m_tracePolicyCount++];
+        wcsncpy_s(policy.moduleName, _countof(policy.moduleName), fields[0], _TRUNCATE);
+        _wcslwr_s(policy.moduleName, _countof(policy.moduleName));
+        policy.maxFrames = (fields[1] != NULL) ? (UINT32)_wtoi(fields[1]) : 0;
+        policy.walkMethod = (fields[2] != NULL) ? parseWalkMethod(fields[2]) : CALLSTACK_WALK_CONFIGURED;
+    }
+}
+
+// loadCapturePolicy - Reads the options a capture policy is made of: the
+//   stack walk method, the stack trace depths and the sampling options.
+//
+//  - inipath (IN): The vld.ini file.
+//
+//  - policy (OUT): Receives the capture policy.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::loadCapturePolicy (LPCWSTR inipath, capturepolicy_t &policy)
+{
+    ZeroMemory(&policy, sizeof(capturepolicy_t));
+    WCHAR method [64] = {0};
+    LoadStringOption(L"StackWalkMethod", method, _countof(method), inipath);
+    policy.walkMethod = parseWalkMethod(method);
+    if (policy.walkMethod == CALLSTACK_WALK_CONFIGURED) {
+        // Unknown methods are "fast".
+        policy.walkMethod = 0x0;
+    }
+    policy.maxTraceFrames = LoadIntOption(L"MaxTraceFrames", VLD_DEFAULT_MAX_TRACE_FRAMES, inipath);
+    if (policy.maxTraceFrames < 1) {
+        policy.maxTraceFrames = VLD_DEFAULT_MAX_TRACE_FRAMES;
+    }
+    policy.adaptiveFrames = min(LoadIntOption(L"AdaptiveTraceFrames", 0, inipath), (UINT)CALLSTACK_MAX_CAPTURE);
+    policy.sampleRate = LoadIntOption(L"SampleRate", 0, inipath);
+    policy.sampleBytes = LoadIntOption(L"SampleBytes", 0, inipath);
+    policy.minTrackedSize = LoadIntOption(L"MinTrackedSize", 0, inipath);
+    policy.maxTrackedSize = LoadIntOption(L"MaxTrackedSize", 0, inipath);
+    policy.smallSampleRate = LoadIntOption(L"SmallSampleRate", 0, inipath);
+}
+
+// configure - Configures VLD using values read from the vld.ini file.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::configure ()
+{
+    TCHAR  inipath [MAX_PATH] = {0};
+    BOOL found = GetIniFilePath(inipath, _countof(inipath));
+
+    Report(L"Visual Leak Detector read settings from: %s\n", found ? inipath : L"(default settings)");
+    if (found) {
+        // Kept for WatchIniFile.
+        wcsncpy_s(m_iniFilePath, _countof(m_iniFilePath), inipath, _TRUNCATE);
+        WIN32_FILE_ATTRIBUTE_DATA attributes;
+        if (GetFileAttributesExW(inipath, GetFileExInfoStandard, &attributes))
+            m_iniWriteTime = attributes.ftLastWriteTime;
+    }
+
+    // Read the boolean options.
+    const UINT buffersize = 64;
+    WCHAR buffer[buffersize] = { 0 };
+
+    if (!GetEnvironmentVariable(L"VLD", buffer, buffersize)) {
+        GetPrivateProfileString(L"Options", L"VLD", L"on", buffer, buffersize, inipath);
+    }
+
+    if (StrToBool(buffer) == FALSE) {
+        m_options |= VLD_OPT_VLDOFF;
+        return;
+    }
+
+    if (LoadBoolOption(L"AggregateDuplicates", L"", inipath)) {
+        m_options |= VLD_OPT_AGGREGATE_DUPLICATES;
+    }
+
+    if (LoadBoolOption(L"SelfTest", L"", inipath)) {
+        m_options |= VLD_OPT_SELF_TEST;
+    }
+
+    if (LoadBoolOption(L"SlowDebuggerDump", L"", inipath)) {
+        m_options |= VLD_OPT_SLOW_DEBUGGER_DUMP;
+    }
+
+    if (LoadBoolOption(L"StartDisabled", L"", inipath)) {
+        m_options |= VLD_OPT_START_DISABLED;
+    }
+
+    if (LoadBoolOption(L"TraceInternalFrames", L"", inipath)) {
+        m_options |= VLD_OPT_TRACE_INTERNAL_FRAMES;
+    }
+
+    if (LoadBoolOption(L"SkipHeapFreeLeaks", L"", inipath)) {
+        m_options |= VLD_OPT_SKIP_HEAPFREE_LEAKS;
+    }
+
+    if (LoadBoolOption(L"SkipCrtStartupLeaks", L"yes", inipath)) {
+        m_options |= VLD_OPT_SKIP_CRTSTARTUP_LEAKS;
+    }
+
+    // Read the integer configuration options.
+    m_maxDataDump = LoadIntOption(L"MaxDataDump", VLD_DEFAULT_MAX_DATA_DUMP, inipath);
+    loadCapturePolicy(inipath, m_initialPolicy);
+    m_options |= m_initialPolicy.walkMethod;
+    m_timeResolution = LoadIntOption(L"AllocationTimeResolution", 0, inipath);
+    if (m_timeResolution != 0) {
+        m_timeRecords = new timerecord_t [VLD_TIME_RECORDS];
+    }
+    if (sampling() || (m_initialPolicy.minTrackedSize != 0) || (m_initialPolicy.maxTrackedSize != 0)) {
+        // Most freed blocks won't be tracked, so it pays to rule them out
+        // before searching for them. This must happen before any block is
+        // tracked.
+        m_trackedAddresses.Enable();
+    }
+    m_metadataReserve = LoadIntOption(L"MetadataReserve", VLD_DEFAULT_METADATA_RESERVE, inipath);
+    m_maxMetadata = (SIZE_T)LoadIntOption(L"MaxMetadataMB", 0, inipath) * 1024 * 1024;
+    if (LoadBoolOption(L"LargePages", L"", inipath)) {
+        m_options |= VLD_OPT_LARGE_PAGES;
+    }
+    if (LoadBoolOption(L"InlineHeapHooks", L"", inipath)) {
+        m_options |= VLD_OPT_INLINE_HEAP_HOOKS;
+    }
+    if (LoadBoolOption(L"EtwHeapTracking", L"", inipath)) {
+        m_options |= VLD_OPT_ETW_HEAP_TRACKING;
+    }
+    m_heapWalkTracking = LoadBoolOption(L"HeapWalkTracking", L"", inipath) != FALSE;
+    m_fastExit = LoadBoolOption(L"FastExit", L"yes", inipath) != FALSE;
+    m_remoteFreeQueue = LoadBoolOption(L"RemoteFreeQueue", L"", inipath) != FALSE;
+    m_recentFreeRing = LoadBoolOption(L"RecentFreeRing", L"", inipath) != FALSE;
+
+    // Read the force-include module list.
+    LoadStringOption(L"ForceIncludeModules", m_forcedModuleList, MAXMODULELISTLENGTH, inipath);
+    _wcslwr_s(m_forcedModuleList, MAXMODULELISTLENGTH);
+    if (wcscmp(m_forcedModuleList, L"*") == 0)
+        m_forcedModuleList[0] = '\0';
+    else
+        m_options |= VLD_OPT_MODULE_LIST_INCLUDE;
+
+    // Read the list of modules whose heaps are ignored.
+    LoadStringOption(L"HeapsToIgnore", m_ignoredHeapModules, MAXMODULELISTLENGTH, inipath);
+    _wcslwr_s(m_ignoredHeapModules, MAXMODULELISTLENGTH);
+
+    // Read the report destination (debugger, file, or both).
+    LoadStringOption(L"ReportTo", buffer, buffersize, inipath);
+    bool binary = (_wcsicmp(buffer, L"binary") == 0);
+    bool pipe = (_wcsnicmp(buffer, L"pipe:", 5) == 0);
+
+    // Read the report format (text, json or csv); the binary report has its
+    // own.
+    WCHAR format [16] = {0};
+    LoadStringOption(L"ReportFormat", format, _countof(format), inipath);
+    LPCWSTR defaultfilename = VLD_DEFAULT_REPORT_FILE_NAME;
+    if (binary) {
+        defaultfilename = VLD_DEFAULT_BINARY_REPORT_FILE_NAME;
+    }
+    else if (_wcsicmp(format, L"json") == 0) {
+        m_options |= VLD_OPT_REPORT_JSON;
+        defaultfilename = VLD_DEFAULT_JSON_REPORT_FILE_NAME;
+    }
+    else if (_wcsicmp(format, L"csv") == 0) {
+        m_options |= VLD_OPT_REPORT_CSV;
+        defaultfilename = VLD_DEFAULT_CSV_REPORT_FILE_NAME;
+    }
+    else if (_wcsicmp(format, L"folded") == 0) {
+        m_options |= VLD_OPT_REPORT_FOLDED;
+        defaultfilename = VLD_DEFAULT_FOLDED_REPORT_FILE_NAME;
+    }
+
+    WCHAR filename [MAX_PATH] = {0};
+    LoadStringOption(L"ReportFile", filename, MAX_PATH, inipath);
+    if (pipe) {
+        // "pipe:name" streams the report to the named pipe; the name may not
+        // fit in the buffer read above.
+        LoadStringOption(L"ReportTo", filename, MAX_PATH, inipath);
+        wmemmove(filename, filename + 5, wcslen(filename + 5) + 1);
+    }
+    if (filename[0] == '\0') {
+        wcsncpy_s(filename, MAX_PATH, defaultfilename, _TRUNCATE);
+    }
+    ExpandProcessId(filename, MAX_PATH);
+    WCHAR* path = m_reportFilePath;
+    if (IsNamedPipePath(filename)) {
+        wcsncpy_s(m_reportFilePath, MAX_PATH, filename, _TRUNCATE);
+    }
+    else {
+        path = _wfullpath(m_reportFilePath, filename, MAX_PATH);
+        assert(path);
+    }
+
+    if (m_options & (VLD_OPT_REPORT_JSON | VLD_OPT_REPORT_CSV)) {
+        // The leaks go to the report file in structured form; any other
+        // messages go to the debugger (or stdout).
+        m_options |= (_wcsicmp(buffer, L"stdout") == 0) ? VLD_OPT_REPORT_TO_STDOUT : VLD_OPT_REPORT_TO_DEBUGGER;
+    }
+    else if (binary) {
+        // The leaks go to the report file in binary form at shutdown; any
+        // other messages still go to the debugger.
+        m_options |= (VLD_OPT_REPORT_TO_BINARY | VLD_OPT_REPORT_TO_DEBUGGER);
+    }
+    else if (pipe) {
+        // The pipe is written like a report file (see setupReporting).
+        m_options |= VLD_OPT_REPORT_TO_FILE;
+    }
+    else if (_wcsicmp(buffer, L"both") == 0) {
+        m_options |= (VLD_OPT_REPORT_TO_DEBUGGER | VLD_OPT_REPORT_TO_FILE);
+    }
+    else if (_wcsicmp(buffer, L"file") == 0) {
+        m_options |= VLD_OPT_REPORT_TO_FILE;
+    }
+    else if (_wcsicmp(buffer, L"stdout") == 0) {
+        m_options |= VLD_OPT_REPORT_TO_STDOUT;
+    }
+    else {
+        m_options |= VLD_OPT_REPORT_TO_DEBUGGER;
+    }
+
+    // Read the report file encoding (ascii, unicode or utf8).
+    LoadStringOption(L"ReportEncoding", buffer, buffersize, inipath);
+    if (_wcsicmp(buffer, L"unicode") == 0) {
+        m_options |= VLD_OPT_UNICODE_REPORT;
+    }
+    else if (_wcsicmp(buffer, L"utf8") == 0) {
+        m_options |= VLD_OPT_UTF8_REPORT;
+    }
+    if ((m_options & VLD_OPT_UNICODE_REPORT) &&
+        !(m_options & (VLD_OPT_REPORT_TO_FILE | VLD_OPT_REPORT_TO_BINARY | VLD_OPT_REPORT_JSON | VLD_OPT_REPORT_CSV))) {
+        // If Unicode report encoding is enabled, then the report needs to be
+        // sent to a file because the debugger will not display Unicode
+        // characters, it will display question marks in their place instead.
+        m_options |= VLD_OPT_REPORT_TO_FILE;
+        m_status |= VLD_STATUS_FORCE_REPORT_TO_FILE;
+    }
+
+    // Read the report mode (full or summary).
+    LoadStringOption(L"ReportMode", buffer, buffersize, inipath);
+    if (_wcsicmp(buffer, L"summary") == 0) {
+        m_options |= VLD_OPT_SUMMARY_REPORT;
+    }
+    m_summaryCount = LoadIntOption(L"SummaryCount", VLD_DEFAULT_SUMMARY_COUNT, inipath);
+    m_reportThreadCount = min(LoadIntOption(L"ReportThreads", 0, inipath), (UINT)VLD_MAX_REPORT_THREADS);
+    LoadStringOption(L"SummaryOrder", buffer, buffersize, inipath);
+    if (_wcsicmp(buffer, L"count") == 0) {
+        m_options |= VLD_OPT_SUMMARY_BY_COUNT;
+    }
+    LoadStringOption(L"SummaryGroupBy", buffer, buffersize, inipath);
+    if (_wcsicmp(buffer, L"function") == 0) {
+        m_summaryGroupBy = VLD_GROUP_BY_FUNCTION;
+    }
+    else if (_wcsicmp(buffer, L"module") == 0) {
+        m_summaryGroupBy = VLD_GROUP_BY_MODULE;
+    }
+    LoadStringOption(L"SymbolLevel", buffer, buffersize, inipath);
+    if (_wcsicmp(buffer, L"none") == 0) {
+        m_symbolLevel = VLD_SYMBOLS_NONE;
+    }
+    else if (_wcsicmp(buffer, L"module") == 0) {
+        m_symbolLevel = VLD_SYMBOLS_MODULE;
+    }
+    else if (_wcsicmp(buffer, L"function") == 0) {
+        m_symbolLevel = VLD_SYMBOLS_FUNCTION;
+    }
+    LoadStringOption(L"Symbolizer", buffer, buffersize, inipath);
+    if (_wcsicmp(buffer, L"dia") == 0) {
+        m_symbolizer = VLD_SYMBOLIZER_DIA;
+    }
+    LoadStringOption(L"ReachabilityScan", buffer, buffersize, inipath);
+    if (_wcsicmp(buffer, L"label") == 0) {
+        m_reachabilityScan = VLD_REACHABILITY_LABEL;
+    }
+    else if (_wcsicmp(buffer, L"unreachable") == 0) {
+        m_reachabilityScan = VLD_REACHABILITY_UNREACHABLE;
+    }
+
+    // Read the per-module stack trace policies.
+    WCHAR policies [MAXMODULELISTLENGTH] = {0};
+    LoadStringOption(L"ModuleTracePolicy", policies, MAXMODULELISTLENGTH, inipath);
+    loadTracePolicies(policies);
+
+    if (LoadBoolOption(L"ValidateHeapAllocs", L"", inipath)) {
+        m_options |= VLD_OPT_VALIDATE_HEAPFREE;
+        m_validateHeapFreeRate = max(LoadIntOption(L"ValidateHeapFreeRate", 1, inipath), 1u);
+        // Frees of blocks that no heap tracked are then ruled out without
+        // searching the heaps. This must happen before any block is tracked.
+        if (!m_trackedAddresses.IsEnabled())
+            m_trackedAddresses.Enable();
+    }
+
+    if (LoadBoolOption(L"SiteStatistics", L"", inipath)) {
+        m_options |= VLD_OPT_SITE_STATISTICS;
+    }
+    m_growthTrigger = (SIZE_T)LoadIntOption(L"GrowthTriggerMB", 0, inipath) * 1024 * 1024;
+    m_autoExcludeHot = LoadBoolOption(L"AutoExcludeHotModules", L"", inipath) != FALSE;
+    m_hotModuleRate = LoadIntOption(L"HotModuleRate", VLD_DEFAULT_HOT_MODULE_RATE, inipath);
+    m_hotModuleWarmup = LoadIntOption(L"HotModuleWarmup", VLD_DEFAULT_HOT_MODULE_WARMUP, inipath);
+    if (m_hotModuleWarmup == 0)
+        m_hotModuleWarmup = VLD_DEFAULT_HOT_MODULE_WARMUP;
+    m_watchIniFile = (LoadBoolOption(L"WatchIniFile", L"", inipath) != FALSE) && found;
+    m_sizeClasses = LoadBoolOption(L"SizeClassHistogram", L"", inipath) != FALSE;
+    m_addressIndex = LoadBoolOption(L"AddressIndex", L"", inipath) != FALSE;
+    m_deferHeapReports = LoadBoolOption(L"DeferHeapDestroyReport", L"", inipath) != FALSE;
+    m_lockProfiling = LoadBoolOption(L"LockProfiling", L"", inipath) != FALSE;
+    m_latencyProfiling = LoadBoolOption(L"LatencyProfiling", L"", inipath) != FALSE;
+    m_packStacks = LoadBoolOption(L"PackCallStacks", L"", inipath) != FALSE;
+    m_trackVirtualMemory = LoadBoolOption(L"TrackVirtualMemory", L"", inipath) != FALSE;
+    LoadStringOption(L"ReallocStackPolicy", buffer, buffersize, inipath);
+    if (_wcsicmp(buffer, L"latest") == 0) {
+        m_reallocStackPolicy = VLD_REALLOC_STACK_LATEST;
+    }
+    else if (_wcsicmp(buffer, L"both") == 0) {
+        m_reallocStackPolicy = VLD_REALLOC_STACK_BOTH;
+    }
+    m_threadExitTimeout = LoadIntOption(L"ThreadExitTimeout", VLD_DEFAULT_THREAD_EXIT_TIMEOUT, inipath);
+    m_peakStep = LoadIntOption(L"PeakSnapshotStep", 0, inipath);
+    if (m_peakStep != 0) {
+        // The snapshots are made of the site statistics.
+        m_options |= VLD_OPT_SITE_STATISTICS;
+        m_nextPeakSnapshot = m_peakStep;
+    }
+
+    if (LoadBoolOption(L"DeferStackCapture", L"", inipath)) {
+        m_options |= VLD_OPT_DEFER_STACK_CAPTURE;
+    }
+
+    if (LoadBoolOption(L"CallingContextTree", L"", inipath)) {
+        m_options |= VLD_OPT_CONTEXT_TREE;
+    }
+
+    if (LoadBoolOption(L"PrefetchSymbols", L"", inipath)) {
+        m_options |= VLD_OPT_PREFETCH_SYMBOLS;
+    }
+
+    m_idleResolveInterval = 0;
+    if (LoadBoolOption(L"IdleResolve", L"", inipath)) {
+        m_idleResolveInterval = LoadIntOption(L"IdleResolveInterval", VLD_DEFAULT_IDLE_RESOLVE_INTERVAL, inipath);
+        if (m_idleResolveInterval < 1) {
+            m_idleResolveInterval = VLD_DEFAULT_IDLE_RESOLVE_INTERVAL;
+        }
+    }
+
+    // Read the metadata scratch file, if any.
+    m_metadataFilePath[0] = '\0';
+    LoadStringOption(L"MetadataFile", filename, MAX_PATH, inipath);
+    if (filename[0] != '\0') {
+        path = _wfullpath(m_metadataFilePath, filename, MAX_PATH);
+        assert(path);
+    }
+
+    // Read the symbol cache file, if any.
+    m_symbolStorePath[0] = '\0';
+    LoadStringOption(L"SymbolCacheFile", filename, MAX_PATH, inipath);
+    if (filename[0] != '\0') {
+        path = _wfullpath(m_symbolStorePath, filename, MAX_PATH);
+        assert(path);
+    }
+
+    // Read the patch plan cache file, if any.
+    m_patchPlanCachePath[0] = L'\0';
+    LoadStringOption(L"PatchPlanCache", filename, MAX_PATH, inipath);
+    if (filename[0] != '\0') {
+        path = _wfullpath(m_patchPlanCachePath, filename, MAX_PATH);
+        assert(path);
+    }
+
+    // Read the sizing profile file, if any.
+    m_sizingProfilePath[0] = L'\0';
+    LoadStringOption(L"SizingProfile", filename, MAX_PATH, inipath);
+    if (filename[0] != '\0') {
+        path = _wfullpath(m_sizingProfilePath, filename, MAX_PATH);
+        assert(path);
+    }
+
+    // Read the symbol server options. The downstream store is a directory.
+    m_symbolServerTimeout = LoadIntOption(L"SymbolServerTimeout", 0, inipath);
+    m_symbolCacheDir[0] = L'\0';
+    LoadStringOption(L"SymbolCacheDir", filename, MAX_PATH, inipath);
+    if (filename[0] != L'\0') {
+        path = _wfullpath(m_symbolCacheDir, filename, MAX_PATH);
+        assert(path);
+    }
+
+    // Read the suppression file, if any.
+    m_suppressionFilePath[0] = L'\0';
+    LoadStringOption(L"SuppressionFile", filename, MAX_PATH, inipath);
+    if (filename[0] != L'\0') {
+        path = _wfullpath(m_suppressionFilePath, filename, MAX_PATH);
+        assert(path);
+    }
+
+    // Read the baseline options.
+    m_baselineFilePath[0] = L'\0';
+    LoadStringOption(L"BaselineFile", filename, MAX_PATH, inipath);
+    if (filename[0] != L'\0') {
+        path = _wfullpath(m_baselineFilePath, filename, MAX_PATH);
+        assert(path);
+    }
+    m_baselineThreshold = LoadIntOption(L"BaselineThreshold", 0, inipath);
+
+    // Read the live view options.
+    m_liveViewInterval = 0;
+    if (LoadBoolOption(L"LiveView", L"", inipath)) {
+        m_liveViewInterval = LoadIntOption(L"LiveViewInterval", VLD_DEFAULT_LIVE_VIEW_INTERVAL, inipath);
+        if (m_liveViewInterval < 1) {
+            m_liveViewInterval = VLD_DEFAULT_LIVE_VIEW_INTERVAL;
+        }
+    }
+
+    // Read the performance counter options.
+    m_perfCounterInterval = 0;
+    if (LoadBoolOption(L"PerfCounters", L"", inipath)) {
+        m_perfCounterInterval = LoadIntOption(L"PerfCounterInterval", VLD_DEFAULT_PERF_COUNTER_INTERVAL, inipath);
+        if (m_perfCounterInterval < 1) {
+            m_perfCounterInterval = VLD_DEFAULT_PERF_COUNTER_INTERVAL;
+        }
+    }
+
+    // Read the telemetry options.
+    LoadStringOption(L"TelemetryFile", filename, MAX_PATH, inipath);
+    if (filename[0] != '\0') {
+        ExpandProcessId(filename, MAX_PATH);
+        path = _wfullpath(m_telemetryFilePath, filename, MAX_PATH);
+        assert(path);
+        m_telemetryInterval = LoadIntOption(L"TelemetryInterval", VLD_DEFAULT_TELEMETRY_INTERVAL, inipath);
+        if (m_telemetryInterval < 1) {
+            m_telemetryInterval = VLD_DEFAULT_TELEMETRY_INTERVAL;
+        }
+        m_telemetrySiteCount = LoadIntOption(L"TelemetrySites", VLD_DEFAULT_TELEMETRY_SITES, inipath);
+        if (m_telemetrySiteCount != 0) {
+            // The growth of each call stack comes from the site statistics.
+            m_options |= VLD_OPT_SITE_STATISTICS;
+        }
+    }
+
+    LoadStringOption(L"RecordTrace", filename, MAX_PATH, inipath);
+    if (filename[0] != '\0') {
+        ExpandProcessId(filename, MAX_PATH);
+        path = _wfullpath(m_allocTraceFilePath, filename, MAX_PATH);
+        assert(path);
+        // Site statistics keep every call stack interned, so the events can
+        // refer to the stacks by address.
+        m_options |= VLD_OPT_SITE_STATISTICS;
+    }
+
+    LoadStringOption(L"CrashSnapshotFile", filename, MAX_PATH, inipath);
+    if (filename[0] != '\0') {
+        ExpandProcessId(filename, MAX_PATH);
+        path = _wfullpath(m_crashSnapshotPath, filename, MAX_PATH);
+        assert(path);
+    }
+}
+
+// enabled - Determines if memory leak detection is enabled for the current
+//   thread.
+//
+//  Return Value:
+//
+//    Returns true if Visual Leak Detector is enabled for the current thread.
+//    Otherwise, returns false.
+//
+BOOL VisualLeakDetector::enabled ()
+{
+    return (enabledTls() != NULL);
+}
+
+// enabledTls - Determines if memory leak detection is enabled for the current
+//   thread, and obtains the thread's TLS if it is. The heap hooks use this so
+//   that the TLS is looked up once per allocation.
+//
+//  Return Value:
+//
+//    Returns a pointer to the thread local storage structure if Visual Leak
+//    Detector is enabled for the current thread. Otherwise, returns NULL.
+//
+tls_t* VisualLeakDetector::enabledTls ()
+{
+    if (!(m_status & VLD_STATUS_INSTALLED)) {
+        // Memory leak detection is not yet enabled because VLD is still
+        // initializing.
+        return NULL;
+    }
+
+    tls_t* tls = getTls();
+    if (!(tls->flags & VLD_TLS_DISABLED) && !(tls->flags & VLD_TLS_ENABLED)) {
+        // The enabled/disabled state for the current thread has not been
+        // initialized yet. Use the default state.
+        if (m_options & VLD_OPT_START_DISABLED) {
+            tls->flags |= VLD_TLS_DISABLED;
+        }
+        else {
+            tls->flags |= VLD_TLS_ENABLED;
+        }
+    }
+
+    return (tls->flags & VLD_TLS_ENABLED) ? tls : NULL;
+}
+
+// ~DuplicateIndex - Frees all of the groups.
+//
+DuplicateIndex::~DuplicateIndex ()
+{
+    for (GroupMap::Iterator it = m_groups.begin(); it != m_groups.end(); ++it) {
+        dupgroup_t *group = (*it).second;
+        while (group != NULL) {
+            dupgroup_t *next = group->next;
+            delete group;
+            group = next;
+        }
+    }
+}
+
+// Build - Groups every block of every heap by size and call stack. Must be
+//   called with the whole heap map lock held.
+//
+//  - heapMap (IN): The heap map whose blocks are to be grouped.
+//
+//  - before (IN): Only blocks with lower serial numbers are grouped.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID DuplicateIndex::Build (HeapMap *heapMap, SIZE_T before)
+{
+    m_built = true;
+    for (HeapMap::Iterator heapit = heapMap->begin(); heapit != heapMap->end(); ++heapit) {
+        BlockMap *blockmap = &(*heapit).second->blockMap;
+        for (BlockMap::Iterator blockit = blockmap->begin(); blockit != blockmap->end(); ++blockit) {
+            blockinfo_t *info = (*blockit).second;
+            CallStack *stack = info->callStack;
+            if ((stack == NULL) || (info->serialNumber >= before))
+                continue;
+
+            dupgroup_t *first = NULL;
+            GroupMap::Iterator it = m_groups.find(stack);
+            if (it != m_groups.end())
+                first = (*it).second;
+
+            dupgroup_t *group = first;
+            while ((group != NULL) && (group->size != info->size))
+                group = group->next;
+            if (group != NULL) {
+                group->count++;
+                continue;
+            }
+
+            group = new dupgroup_t;
+            group->next = NULL;
+            group->size = info->size;
+            group->count = 1;
+            group->reported = false;
+            if (first == NULL) {
+                m_groups.insert(stack, group);
+            }
+            else {
+                // Keep the first group as the map's entry; link the new one
+                // in right behind it.
+                group->next = first->next;
+                first->next = group;
+            }
+        }
+    }
+}
+
+// Find - Finds the group a block belongs to.
+//
+//  - info (IN): The block's information.
+//
+//  Return Value:
+//
+//    Returns the block's group, or NULL if the block has no call stack or
+//    wasn't present when the index was built.
+//
+dupgroup_t* DuplicateIndex::Find (const blockinfo_t *info) const
+{
+    CallStack *stack = info->callStack;
+    if (stack == NULL)
+        return NULL;
+
+    GroupMap::Iterator it = m_groups.find(stack);
+    if (it == m_groups.end())
+        return NULL;
+
+    for (dupgroup_t *group = (*it).second; group != NULL; group = group->next) {
+        if (group->size == info->size)
+            return group;
+    }
+    return NULL;
+}
+
+// gettls - Obtains the thread local storage structure for the calling thread.
+//   This runs several times per allocation, so the common case is a single
+//   read of the TEB; creating the structure is kept out of line in initTls.
+//
+//  Return Value:
+//
+//    Returns a pointer to the thread local storage structure. (This function
+//    always succeeds).
+//
+tls_t* VisualLeakDetector::getTls ()
+{
+    // Get the pointer to this thread's thread local storage structure.
+    tls_t* tls = (tls_t*)readTlsSlot(m_tlsIndex);
+    if (tls != NULL)
+        return tls;
+    return initTls();
+}
+
+// initTls - Obtains the thread local storage structure for a thread which
+//   hasn't used it yet, allocating it unless a previous thread with the same
+//   ID left one behind, and stores it in the thread's TLS slot.
+//
+//  Return Value:
+//
+//    Returns a pointer to the thread local storage structure.
+//
+__declspec(noinline) tls_t* VisualLeakDetector::initTls ()
+{
+    tls_t* tls = (tls_t*)TlsGetValue(m_tlsIndex);
+    assert(GetLastError() == ERROR_SUCCESS);
+
+    if (tls == NULL) {
+        DWORD threadId = GetCurrentThreadId();
+
+        CriticalSectionLocker<> cs(m_tlsLock);
+        TlsMap::Iterator it = m_tlsMap->find(threadId);
+        if ((it == m_tlsMap->end()) && (m_freeTls != NULL)) {
+            // Take over the structure of a thread which has exited. Its
+            // pending buffer was flushed and its caches emptied when the
+            // thread exited.
+            tls = m_freeTls;
+            m_freeTls = tls->nextFree;
+            tls->sampleCountdown = 0;
+            tls->sampleSeed = 0;
+            tls->smallSampleCount = 0;
+            tls->validateCount = 0;
+            tls->excludedEpoch = 0;
+            tls->excludedImage = MODULEIMAGE_NONE;
+            tls->shadowStackLow = 0;
+            tls->shadowStackHigh = 0;
+            tls->rangeEpoch = 0;
+            tls->rangeDepth = 0;
+            tls->traceFrames = 0;
+            tls->traceWalk = CALLSTACK_WALK_CONFIGURED;
+            tls->tagDepth = 0;
+            ZeroMemory(&tls->stats, sizeof(tls->stats));
+            tls->serialNext = 0;
+            tls->serialEnd = 0;
+            tls->serialEpoch = 0;
+            tls->bytesDelta = 0;
+            tls->totalDelta = 0;
+            tls->nextFree = NULL;
+            tls->threadIndex = registerThread(threadId);
+            m_tlsMap->insert(threadId, tls);
+        }
+        else if (it == m_tlsMap->end()) {
+            // This thread's thread local storage structure has not been allocated.
+            tls = new tls_t;
+            tls->blockInfoCache.head = NULL;
+            tls->blockInfoCache.count = 0;
+            tls->sampleCountdown = 0;
+            tls->sampleSeed = 0;
+            tls->smallSampleCount = 0;
+            tls->validateCount = 0;
+            tls->pendingLock.Initialize();
+            tls->pendingCount = 0;
+            tls->deferred = NULL;
+            tls->deferredFreeCount = 0;
+            tls->allocTrace = NULL;
+            tls->latency = NULL;
+            tls->recentFrees = NULL;
+            ZeroMemory(tls->stackCache, sizeof(tls->stackCache));
+            tls->excludedEpoch = 0;
+            tls->excludedImage = MODULEIMAGE_NONE;
+            tls->shadowStackLow = 0;
+            tls->shadowStackHigh = 0;
+            tls->rangeEpoch = 0;
+            tls->rangeDepth = 0;
+            tls->traceFrames = 0;
+            tls->traceWalk = CALLSTACK_WALK_CONFIGURED;
+            tls->tagDepth = 0;
+            ZeroMemory(&tls->stats, sizeof(tls->stats));
+            tls->serialNext = 0;
+            tls->serialEnd = 0;
+            tls->serialEpoch = 0;
+            tls->bytesDelta = 0;
+            tls->totalDelta = 0;
+            tls->nextFree = NULL;
+            tls->threadIndex = registerThread(threadId);
+
+            // Add this thread's TLS to the TlsSet.
+            m_tlsMap->insert(threadId, tls);
+        } else {
+            // Already had a thread with this ID
+            tls = (*it).second;
+        }
+
+        ZeroMemory(&tls->context, sizeof(tls->context));
+        tls->flags = 0x0;
+        tls->oldFlags = 0x0;
+        tls->threadId = threadId;
+        tls->blockWithoutGuard = NULL;
+        TlsSetValue(m_tlsIndex, tls);
+    }
+
+    return tls;
+}
+
+// retireTls - Takes the calling thread's thread local storage structure out
+//   of the TlsSet as the thread exits, so that the set only holds the
+//   threads which are still running. The thread's pending blocks are mapped,
+//   its free blockinfo_t records handed back to the pool, its allocation
+//   trace events drained and its counters kept in m_retiredStats; the structure is then left for initTls to give
+//   to a new thread. The thread's index in the thread table is kept, since
+//   its blocks still refer to it.
+//
+//   Note: Called from DllMain on DLL_THREAD_DETACH.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::retireTls ()
+{
+    if (m_tlsIndex == TLS_OUT_OF_INDEXES)
+        return;
+    tls_t* tls = (tls_t*)TlsGetValue(m_tlsIndex);
+    if (tls == NULL)
+        return;
+
+    // Last chance to learn what the thread was called.
+    nameThread(tls->threadIndex, GetCurrentThread());
+
+    CriticalSectionLocker<> cs(m_tlsLock);
+    if (tls->pendingCount != 0)
+        flushPendingBlocks(tls, tls->blockInfoCache);
+    m_blockInfoPool.FreeBatch(tls->blockInfoCache);
+    g_callStackTable.ReleaseCache(tls->stackCache);
+    if (tls->allocTrace != NULL) {
+        CriticalSectionLocker<> tl(m_allocTraceLock);
+        drainAllocRing(tls->allocTrace);
+    }
+    flushAllocTotals(tls);
+    m_retiredStats.stackCaptures       += tls->stats.stackCaptures;
+    m_retiredStats.stackCaptureTicks   += tls->stats.stackCaptureTicks;
+    m_retiredStats.mapInserts          += tls->stats.mapInserts;
+    m_retiredStats.mapInsertTicks      += tls->stats.mapInsertTicks;
+    m_retiredStats.mapErases           += tls->stats.mapErases;
+    m_retiredStats.mapEraseTicks       += tls->stats.mapEraseTicks;
+    m_retiredStats.lockAcquires        += tls->stats.lockAcquires;
+    m_retiredStats.lockWaitTicks       += tls->stats.lockWaitTicks;
+    m_retiredStats.exclusionChecks     += tls->stats.exclusionChecks;
+    m_retiredStats.exclusionCheckTicks += tls->stats.exclusionCheckTicks;
+    if (tls->latency != NULL) {
+        // The histograms stay with the structure, empty, for the next thread.
+        for (UINT hook = 0; hook < VLD_HOOKS; hook++) {
+            m_retiredLatency.maxTicks[hook] = max(m_retiredLatency.maxTicks[hook], tls->latency->maxTicks[hook]);
+            for (UINT bucket = 0; bucket < VLD_LATENCY_BUCKETS; bucket++)
+                m_retiredLatency.buckets[hook][bucket] += tls->latency->buckets[hook][bucket];
+        }
+        ZeroMemory(tls->latency, sizeof(latencyhist_t));
+    }
+    if (tls->recentFrees != NULL)
+        ZeroMemory(tls->recentFrees, sizeof(recentfrees_t));
+
+    m_tlsMap->erase(tls->threadId);
+    tls->nextFree = m_freeTls;
+    m_freeTls = tls;
+    TlsSetValue(m_tlsIndex, NULL);
+}
+
+// registerThread - Assigns the next thread table index to a thread ID. Each
+//   thread is registered once, along with its TLS structure, by initTls,
+//   which holds the TLS lock. A page of the table is written before any
+//   block refers to an index on it, and never moves afterwards, so getThreadId
+//   reads the table without locking.
+//
+//  - threadId (IN): The thread ID.
+//
+//  Return Value:
+//
+//    Returns the thread table index of the thread ID, or 0 if the table is
+//    full.
+//
+WORD VisualLeakDetector::registerThread (DWORD threadId)
+{
+    if (m_threadCount == VLD_THREAD_TABLE_PAGE * VLD_THREAD_TABLE_PAGES)
+        return 0;
+
+    UINT index = m_threadCount;
+    DWORD* &page = m_threadTable[index / VLD_THREAD_TABLE_PAGE];
+    if (page == NULL) {
+        page = new DWORD [VLD_THREAD_TABLE_PAGE];
+        threadleaks_t* leaks = new threadleaks_t [VLD_THREAD_TABLE_PAGE];
+        ZeroMemory(leaks, VLD_THREAD_TABLE_PAGE * sizeof(threadleaks_t));
+        m_threadLeaks[index / VLD_THREAD_TABLE_PAGE] = leaks;
+        LPWSTR* names = new LPWSTR [VLD_THREAD_TABLE_PAGE];
+        ZeroMemory(names, VLD_THREAD_TABLE_PAGE * sizeof(LPWSTR));
+        m_threadNames[index / VLD_THREAD_TABLE_PAGE] = names;
+    }
+    page[index % VLD_THREAD_TABLE_PAGE] = threadId;
+    m_threadCount = index + 1;
+    return (WORD)index;
+}
+
+// nameThread - Records the description of a thread (see SetThreadDescription)
+//   in the thread table, for the report to show with its thread ID. Threads
+//   are often named after they have started allocating, so threads without
+//   a description are asked again later: by each leak report, and when they
+//   exit. A description is never replaced once recorded, so that reports
+//   can read it without locking.
+//
+//   Note: GetThreadDescription allocates, so the caller mustn't hold the TLS
+//     lock or any lock taken after it.
+//
+//  - threadIndex (IN): Thread table index of the thread.
+//
+//  - thread (IN): Handle to the thread, with THREAD_QUERY_LIMITED_INFORMATION
+//      access.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::nameThread (WORD threadIndex, HANDLE thread)
+{
+    LPWSTR &name = m_threadNames[threadIndex / VLD_THREAD_TABLE_PAGE][threadIndex % VLD_THREAD_TABLE_PAGE];
+    if ((threadIndex == 0) || (name != NULL) || (m_GetThreadDescription == NULL))
+        return;
+
+    PWSTR description = NULL;
+    if (FAILED(m_GetThreadDescription(thread, &description)))
+        return;
+    if (description[0] != L'\0') {
+        size_t length = wcslen(description) + 1;
+        LPWSTR copy = new WCHAR [length];
+        wcsncpy_s(copy, length, description, _TRUNCATE);
+        if (InterlockedCompareExchangePointer((PVOID*)&name, copy, NULL) != NULL)
+            delete [] copy;
+    }
+    LocalFree(description);
+}
+
+// nameRunningThreads - Records the descriptions of the threads which entered
+//   VLD, are still running, and had none when last asked (see nameThread).
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::nameRunningThreads ()
+{
+    if (m_GetThreadDescription == NULL)
+        return;
+
+    // The thread descriptions can't be read under the TLS lock.
+    WORD   *indices;
+    DWORD  *threadIds;
+    size_t  count = 0;
+    {
+        CriticalSectionLocker<> cs(m_tlsLock);
+        size_t capacity = 0;
+        for (TlsMap::Iterator tlsit = m_tlsMap->begin(); tlsit != m_tlsMap->end(); ++tlsit)
+            capacity++;
+        indices = new WORD [capacity + 1];
+        threadIds = new DWORD [capacity + 1];
+        for (TlsMap::Iterator tlsit = m_tlsMap->begin(); tlsit != m_tlsMap->end(); ++tlsit) {
+            const tls_t *tls = (*tlsit).second;
+            if ((tls->threadIndex == 0) || (getThreadName(tls->threadIndex) != NULL))
+                continue;
+            indices[count] = tls->threadIndex;
+            threadIds[count] = tls->threadId;
+            count++;
+        }
+    }
+    for (size_t index = 0; index < count; index++) {
+        HANDLE thread = OpenThread(THREAD_QUERY_LIMITED_INFORMATION, FALSE, threadIds[index]);
+        if (thread == NULL)
+            continue;
+        nameThread(indices[index], thread);
+        CloseHandle(thread);
+    }
+    delete [] threadIds;
+    delete [] indices;
+}
+
+// findThreadIndex - Looks up the thread table index of a thread which has
+//   entered VLD.
+//
+//  - threadId (IN): The thread ID.
+//
+//  Return Value:
+//
+//    Returns the thread table index of the thread, or 0 if the thread never
+//    entered VLD or came after the thread table filled up. Either way, none
+//    of the tracked blocks can be told to be the thread's.
+//
+WORD VisualLeakDetector::findThreadIndex (DWORD threadId)
+{
+    CriticalSectionLocker<> cs(m_tlsLock);
+    TlsMap::Iterator tlsit = m_tlsMap->find(threadId);
+    if (tlsit != m_tlsMap->end())
+        return (*tlsit).second->threadIndex;
+
+    // The thread has exited; its latest index is still in the thread table.
+    for (UINT index = m_threadCount; index > 1; index--) {
+        if (m_threadTable[(index - 1) / VLD_THREAD_TABLE_PAGE][(index - 1) % VLD_THREAD_TABLE_PAGE] == threadId)
+            return (WORD)(index - 1);
+    }
+    return 0;
+}
+
+// floorLog2 - Obtains the index of the most significant bit set in a value
+//   (0 for 0).
+static DWORD floorLog2 (SIZE_T value)
+{
+    DWORD bit = 0;
+#ifdef _WIN64
+    _BitScanReverse64(&bit, value | 1);
+#else
+    _BitScanReverse(&bit, value | 1);
+#endif
+    return bit;
+}
+
+// pow2Class - Obtains the power-of-two size class of a block size: n for
+//   sizes of more than 2^(n-1) and up to 2^n bytes.
+static UINT32 pow2Class (SIZE_T size)
+{
+    if (size <= 1)
+        return 0;
+    return min(floorLog2(size - 1) + 1, (DWORD)(VLD_POW2_CLASSES - 1));
+}
+
+// lfhClass - Obtains the low-fragmentation heap size class of a block size.
+//   The LFH serves blocks of up to 256 bytes from 32 buckets 8 bytes apart,
+//   then each power of two up to 16 KB from 16 buckets, twice as far apart as
+//   the previous 16. Larger blocks are never served by the LFH.
+static UINT32 lfhClass (SIZE_T size)
+{
+    if (size <= 256)
+        return (size == 0) ? 0 : (UINT32)((size - 1) / 8);
+    if (size > 16384)
+        return VLD_LFH_CLASSES - 1;
+    DWORD bit = floorLog2(size - 1);
+    return 32 + (bit - 8) * 16 + (UINT32)(((size - 1) - ((SIZE_T)1 << bit)) >> (bit - 4));
+}
+
+// addSizeClasses - Counts a new block of a shard in the size class
+//   histograms of its heap. The caller must hold the shard lock.
+//
+//  Return Value:
+//
+//    None.
+//
+static VOID addSizeClasses (sizeclasses_t *classes, UINT shard, SIZE_T size)
+{
+    UINT32 pow2 = pow2Class(size);
+    UINT32 lfh = VLD_POW2_CLASSES + lfhClass(size);
+    classes->live[shard][pow2]++;
+    classes->live[shard][lfh]++;
+    classes->total[shard][pow2]++;
+    classes->total[shard][lfh]++;
+}
+
+// removeSizeClasses - Uncounts a freed block of a shard from the live size
+//   class histograms of its heap. The caller must hold the shard lock.
+//
+//  Return Value:
+//
+//    None.
+//
+static VOID removeSizeClasses (sizeclasses_t *classes, UINT shard, SIZE_T size)
+{
+    classes->live[shard][pow2Class(size)]--;
+    classes->live[shard][VLD_POW2_CLASSES + lfhClass(size)]--;
+}
+
+// linkBlock - Inserts a block into its shard's serial number ordered list.
+//   Blocks are mapped in batches from per-thread pending buffers, so a block
+//   can arrive after blocks of other threads with greater serial numbers;
+//   those are always recent, so the walk back from the newest block is short.
+//   The caller must hold the shard lock for "mem".
+//
+//  - heapinfo (IN): The heap from which the block was allocated.
+//
+//  - mem (IN): Address of the block.
+//
+//  - info (IN): The block's information.
+//
+//  Return Value:
+//
+//    None.
+//
+static VOID linkBlock (heapinfo_t *heapinfo, LPCVOID mem, blockinfo_t *info)
+{
+    UINT shard = ShardIndex(mem, BLOCKMAPSHARDS);
+    heapinfo->blocks[shard]++;
+    heapinfo->bytes[shard] += info->size;
+    if (heapinfo->sizeClasses != NULL)
+        addSizeClasses(heapinfo->sizeClasses, shard, info->size);
+    blockinfo_t* &newest = heapinfo->newest[shard];
+    blockinfo_t* newer = NULL;
+    blockinfo_t* older = newest;
+    while ((older != NULL) && (older->serialNumber > info->serialNumber)) {
+        newer = older;
+        older = older->older;
+    }
+    info->older = older;
+    info->newer = newer;
+    if (older != NULL)
+        older->newer = info;
+    if (newer != NULL)
+        newer->older = info;
+    else
+        newest = info;
+}
+
+// unlinkBlock - Removes a block from its shard's serial number ordered list.
+//   The caller must hold the shard lock for "mem".
+//
+//  - heapinfo (IN): The heap from which the block was allocated.
+//
+//  - mem (IN): Address of the block.
+//
+//  - info (IN): The block's information.
+//
+//  Return Value:
+//
+//    None.
+//
+static VOID unlinkBlock (heapinfo_t *heapinfo, LPCVOID mem, blockinfo_t *info)
+{
+    UINT shard = ShardIndex(mem, BLOCKMAPSHARDS);
+    heapinfo->blocks[shard]--;
+    heapinfo->bytes[shard] -= info->size;
+    if (heapinfo->sizeClasses != NULL)
+        removeSizeClasses(heapinfo->sizeClasses, shard, info->size);
+    if (info->newer != NULL)
+        info->newer->older = info->older;
+    else
+        heapinfo->newest[shard] = info->older;
+    if (info->older != NULL)
+        info->older->newer = info->newer;
+    info->older = NULL;
+    info->newer = NULL;
+}
+
+// ShardLocker - Enters the g_heapMapLock shard guarding an address for the
+//   lifetime of the object, like CriticalSectionLocker, and accounts for the
+//   time spent waiting to enter it in the calling thread's statistics.
+class ShardLocker
+{
+public:
+    ShardLocker (LPCVOID mem, vldstats_t &stats)
+        : m_leave(false)
+        , m_shard(g_heapMapLock.Shard(mem))
+    {
+        UINT64 start = __rdtsc();
+        m_shard.Enter();
+        stats.lockAcquires++;
+        stats.lockWaitTicks += __rdtsc() - start;
+    }
+
+    ~ShardLocker ()
+    {
+        Leave();
+    }
+
+    VOID Leave ()
+    {
+        if (!m_leave) {
+            m_shard.Leave();
+            m_leave = true;
+        }
+    }
+
+private:
+    ShardLocker (const ShardLocker &);             // not allowed
+    ShardLocker & operator = (const ShardLocker &); // not allowed
+
+    bool             m_leave;
+    CriticalSection &m_shard;
+};
+
+// TickCounter - Adds the time stamp counter ticks elapsed during the lifetime
+//   of the object to a counter.
+class TickCounter
+{
+public:
+    TickCounter (UINT64 &ticks)
+        : m_ticks(ticks)
+        , m_start(__rdtsc())
+    {
+    }
+
+    ~TickCounter ()
+    {
+        m_ticks += __rdtsc() - m_start;
+    }
+
+private:
+    TickCounter (const TickCounter &);             // not allowed
+    TickCounter & operator = (const TickCounter &); // not allowed
+
+    UINT64 &m_ticks;
+    UINT64  m_start;
+};
+
+// insertBlock - Inserts a block's information into its heap's block map. The
+//   caller must hold the shard lock for "mem".
+//
+//  - heap (IN): Handle to the heap from which the block has been allocated.
+//
+//  - mem (IN): Pointer to the memory block.
+//
+//  - blockinfo (IN): The block's information. It's freed if the heap has
+//      been destroyed in the meantime.
+//
+//  - cache (IN/OUT): The calling thread's cache of free blockinfo_t records.
+//
+//  Return Value:
+//
+//    Returns false if the heap isn't mapped anymore.
+//
+bool VisualLeakDetector::insertBlock (HANDLE heap, LPCVOID mem, blockinfo_t *blockinfo, slabcache_t &cache)
+{
+    HeapMap::Iterator heapit = m_heapMap->find(heap);
+    if (heapit == m_heapMap->end()) {
+        // The heap was destroyed by another thread in the meantime.
+        m_trackedAddresses.Remove(mem);
+        recordFree(blockinfo);
+        m_blockInfoPool.Free(cache, blockinfo);
+        return false;
+    }
+
+    // Insert the block's information into the block map.
+    heapinfo_t* heapinfo = (*heapit).second;
+    BlockMap* blockmap = &heapinfo->blockMap;
+    bool inserted;
+    BlockMap::Iterator blockit = blockmap->insert(mem, blockinfo, inserted);
+    if (!inserted) {
+        // A block with this address has already been allocated. The
+        // previously allocated block must have been freed (probably by some
+        // mechanism unknown to VLD), or the heap wouldn't have allocated it
+        // again. Replace the previously allocated info with the new info.
+        blockinfo_t* info = blockmap->replace(blockit, blockinfo);
+        m_trackedAddresses.Remove(mem);
+        recordFree(info);
+        Report(L"VLD: New allocation at already allocated address: 0x%p with size: %u and new size: %u\n", mem, info->size, blockinfo->size);
+        unlinkBlock(heapinfo, mem, info);
+        m_blockInfoPool.Free(cache, info);
+    }
+    else if (heapinfo->addresses != NULL)
+        heapinfo->addresses->insert(mem);
+    linkBlock(heapinfo, mem, blockinfo);
+    countBlock(mem, blockinfo);
+    return true;
+}
+
+// stackHash - Obtains the hash of a new block's call stack, by which the
+//   TraceLogging events identify it.
+//
+//  - stack (IN): The block's call stack, as captured.
+//
+//  Return Value:
+//
+//    Returns the hash, or 0 if no call stack was captured.
+//
+static DWORD stackHash (const capturedstack_t &stack)
+{
+    if (stack.callStack)
+        return stack.callStack->getHashValue();
+    return stack.skipped ? 0 : stack.frames.hashValue;
+}
+
+// takeSerialBlock - Gives a thread the next VLD_SERIAL_BLOCK serial numbers.
+//   Serial numbers stay unique, and mostly follow the order of allocation:
+//   only the blocks of different threads allocated since they last took
+//   serial numbers may be out of order.
+//
+//  - tls (IN/OUT): The thread's TLS.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::takeSerialBlock (tls_t *tls)
+{
+    tls->serialEpoch = m_serialEpoch;
+    tls->serialNext = (SIZE_T)InterlockedExchangeAddSizeT(&m_requestCurr, VLD_SERIAL_BLOCK);
+    tls->serialEnd = tls->serialNext + VLD_SERIAL_BLOCK;
+}
+
+// serialMark - Obtains a serial number above that of every block allocated
+//   so far, for the marks and snapshots which tell older blocks from newer
+//   ones. The threads give up the serial numbers they hold, so that the
+//   blocks allocated from now on get greater ones.
+//
+//  Return Value:
+//
+//    Returns the serial number.
+//
+SIZE_T VisualLeakDetector::serialMark ()
+{
+    InterlockedIncrement(&m_serialEpoch);
+    return m_requestCurr;
+}
+
+// mapblock - Tracks memory allocations. Information about allocated blocks is
+//   collected and then the block is mapped to this information.
+//
+//  Note: The block is normally only appended to the calling thread's pending
+//   buffer. The buffer is flushed into the block maps when it fills up, or
+//   before anything reads the block maps, and a block which is freed before
+//   then never touches its block map at all.
+//
+//  - heap (IN): Handle to the heap from which the block has been allocated.
+//
+//  - mem (IN): Pointer to the memory block being allocated.
+//
+//  - size (IN): Size, in bytes, of the memory block being allocated.
+//
+//  - crtalloc (IN): Should be set to TRUE if this allocation is a CRT memory
+//      block. Otherwise should be FALSE.
+//
+//  - threadIndex (IN): Thread table index of the allocating thread.
+//
+//  - image (IN): Module image of the allocating code, or MODULEIMAGE_NONE if
+//      it isn't known.
+//
+//  - stack (IN/OUT): The block's call stack, captured beforehand. The block
+//      takes it over.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::mapBlock (HANDLE heap, LPCVOID mem, SIZE_T size, bool debugcrtalloc, bool ucrt, WORD threadIndex,
+    WORD image, capturedstack_t &stack)
+{
+    TraceLoggingWrite(g_vldTraceProvider, "MapBlock",
+        TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+        TraceLoggingKeyword(VLD_TRACE_KEYWORD_BLOCKS),
+        TraceLoggingPointer(heap, "Heap"),
+        TraceLoggingPointer(mem, "Address"),
+        TraceLoggingUInt64(size, "Size"),
+        TraceLoggingHexUInt32(stackHash(stack), "StackHash"));
+
+    tls_t* tls = getTls();
+    m_trackedAddresses.Add(mem);
+    if (!(m_tracking & VLD_TRACKING_BLOCKS))
+        InterlockedOr(&m_tracking, VLD_TRACKING_BLOCKS);
+
+    // If we haven't mapped this heap to a block map yet, do it now. This must
+    // happen before the block's shard is locked, because mapping a heap
+    // enters the whole heap map lock.
+    if (m_heapMap->find(heap) == m_heapMap->end())
+        mapHeapOnce(heap);
+
+    // Record the block's information.
+    blockinfo_t* blockinfo = m_blockInfoPool.Allocate(tls->blockInfoCache);
+    blockinfo->threadIndex = threadIndex;
+    blockinfo->tag = currentTag(tls);
+    blockinfo->image = image;
+    blockinfo->serialNumber = nextSerial(tls);
+    blockinfo->size = size;
+    blockinfo->reported = false;
+    blockinfo->counted = false;
+    blockinfo->unclassified = false;
+    blockinfo->crtHeader = (!debugcrtalloc ? crtheader_unknown : ucrt ? crtheader_ucrt : crtheader_msvcrt);
+    if ((blockinfo->serialNumber & (VLD_BUDGET_CHECK_INTERVAL - 1)) == 0) {
+        if (m_maxMetadata != 0)
+            checkMetadataBudget();
+        checkCompaction();
+    }
+    if (m_timeResolution != 0) {
+        // A torn read of the last record's time on x86 only costs a needless
+        // trip through the lock.
+        ULONGLONG now = GetTickCount64();
+        if (now >= m_lastRecordTime + m_timeResolution)
+            recordTime(now, blockinfo->serialNumber);
+    }
+
+    recordAlloc(0, size);
+
+    if (m_allocTracing) {
+        internCallStack(stack);
+        recordAllocTrace(tls, VLDATRACE_ALLOC, heap, mem, size, stack.callStack.get());
+    }
+
+    if (sampling()) {
+        // Hardly any freed block is tracked when sampling, and each free of
+        // an untracked block would have to search every pending buffer. Map
+        // the block right away instead.
+        internCallStack(stack);
+        blockinfo->callStack.reset(stack.callStack.detach());
+        recordSiteAlloc(blockinfo);
+        ShardLocker cs(mem, tls->stats);
+        TickCounter ticks(tls->stats.mapInsertTicks);
+        tls->stats.mapInserts++;
+        insertBlock(heap, mem, blockinfo, tls->blockInfoCache);
+        return;
+    }
+
+    // Nobody else sees the block's information before it's appended, so the
+    // call stack is attached without any lock held.
+    blockinfo->callStack.reset(stack.callStack.detach());
+    recordSiteAlloc(blockinfo);
+
+    CriticalSectionLocker<> cs(tls->pendingLock);
+    if (tls->pendingCount == VLD_PENDING_BLOCKS) {
+        flushPendingBlocks(tls, tls->blockInfoCache);
+    }
+    pendingblock_t &pending = tls->pending[tls->pendingCount];
+    pending.heap = heap;
+    pending.mem  = mem;
+    pending.info = blockinfo;
+    pending.stack = NULL;
+    if (!blockinfo->callStack && !stack.skipped)
+        deferCallStack(tls, pending, stack.frames);
+    tls->pendingCount++;
+}
+
+// mapBlocks - Tracks blocks allocated at once from a custom allocator's pool
+//   (see CaptureContext::SetBatch). Each block is sampled on its own, as if
+//   it was allocated alone, but the call stack is captured only for the first
+//   block sampled, and interned right away so that the others share it.
+//
+//  - tls (IN/OUT): The calling thread's TLS, which holds the pool's
+//      pseudo-heap, the size of the blocks and the context of the allocation.
+//
+//  - blocks (IN): The blocks allocated. NULL entries are skipped.
+//
+//  - count (IN): Number of entries in "blocks".
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::mapBlocks (tls_t *tls, LPVOID const *blocks, SIZE_T count)
+{
+    capturedstack_t shared;
+    bool captured = false;
+    for (SIZE_T index = 0; index < count; index++) {
+        if ((blocks[index] == NULL) || !sampleAllocation(tls, tls->size))
+            continue;
+        if (!captured) {
+            captureStack(tls, tls->context, shared);
+            internCallStack(shared);
+            captured = true;
+        }
+
+        // Each block takes over a reference of its own.
+        capturedstack_t stack;
+        stack.skipped = shared.skipped;
+        stack.keep = false;
+        if (shared.callStack) {
+            g_callStackTable.AddRef(shared.callStack);
+            stack.callStack.reset(shared.callStack);
+        }
+        mapBlock(tls->heap, blocks[index], tls->size, false, false, tls->threadIndex, (WORD)tls->excludedImage, stack);
+    }
+}
+
+// flushPendingBlocks - Inserts the blocks in a thread's pending buffer into
+//   their block maps. The blocks are inserted a shard at a time, so that each
+//   shard lock is entered at most once per batch.
+//
+//  - tls (IN/OUT): The TLS of the thread whose buffer is flushed. This may be
+//      another thread's TLS.
+//
+//  - cache (IN/OUT): The calling thread's cache of free blockinfo_t records.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::flushPendingBlocks (tls_t *tls, slabcache_t &cache)
+{
+    vldstats_t &stats = getTls()->stats;
+    CriticalSectionLocker<> cs(tls->pendingLock);
+    UINT count = tls->pendingCount;
+    if (count == 0)
+        return;
+
+    // The blocks whose call stacks were deferred have outlived the buffer, so
+    // their CallStacks are due now. They're interned before any shard lock is
+    // entered.
+    for (UINT index = 0; index < count; index++) {
+        pendingblock_t &pending = tls->pending[index];
+        if (pending.stack == NULL)
+            continue;
+        deferredstack_t *stack = pending.stack;
+        pending.info->callStack.reset(g_callStackTable.Intern(
+            CallStack::Create(stack->frames, stack->count, stack->hashValue)));
+        releaseDeferredStack(tls, pending);
+    }
+
+    UINT shards [VLD_PENDING_BLOCKS];
+    for (UINT index = 0; index < count; index++)
+        shards[index] = ShardIndex(tls->pending[index].mem, BLOCKMAPSHARDS);
+
+    for (UINT first = 0; first < count; first++) {
+        if (shards[first] == BLOCKMAPSHARDS)
+            continue; // Already inserted with an earlier block of its shard.
+
+        UINT shard = shards[first];
+        ShardLocker sl(tls->pending[first].mem, stats);
+        TickCounter ticks(stats.mapInsertTicks);
+        for (UINT index = first; index < count; index++) {
+            if (shards[index] != shard)
+                continue;
+            pendingblock_t &pending = tls->pending[index];
+            insertBlock(pending.heap, pending.mem, pending.info, cache);
+            shards[index] = BLOCKMAPSHARDS;
+            stats.mapInserts++;
+        }
+    }
+    tls->pendingCount = 0;
+}
+
+// flushAllPendingBlocks - Flushes every thread's pending buffer, so that the
+//   block maps hold every tracked block, and drains the queued frees. Must be
+//   called before reading the block maps, and without holding any
+//   g_heapMapLock shard.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::flushAllPendingBlocks ()
+{
+    slabcache_t &cache = getTls()->blockInfoCache;
+    CriticalSectionLocker<> cs(m_tlsLock);
+    for (TlsMap::Iterator tlsit = m_tlsMap->begin(); tlsit != m_tlsMap->end(); ++tlsit) {
+        tls_t* tls = (*tlsit).second;
+        if (tls->pendingCount != 0)
+            flushPendingBlocks(tls, cache);
+    }
+    drainRemoteFrees();
+}
+
+// cancelPendingBlock - Removes a freed block from a thread's pending buffer,
+//   if it's still there.
+//
+//  - tls (IN/OUT): The TLS of the thread whose buffer is searched.
+//
+//  - heap (IN): Handle to the heap to which the block is being freed.
+//
+//  - mem (IN): Pointer to the memory block being freed.
+//
+//  - cache (IN/OUT): The calling thread's cache of free blockinfo_t records.
+//
+//  - size (OUT): If not NULL, receives the block's size if it was found.
+//
+//  Return Value:
+//
+//    Returns true if the block was found and its information freed.
+//
+bool VisualLeakDetector::cancelPendingBlock (tls_t *tls, HANDLE heap, LPCVOID mem, slabcache_t &cache, SIZE_T *size)
+{
+    if (tls->pendingCount == 0)
+        return false;
+
+    CriticalSectionLocker<> cs(tls->pendingLock);
+    for (UINT index = tls->pendingCount; index > 0; index--) {
+        pendingblock_t &pending = tls->pending[index - 1];
+        if ((pending.mem != mem) || (pending.heap != heap))
+            continue;
+
+        dropPendingBlock(tls, index - 1, cache, size);
+        return true;
+    }
+    return false;
+}
+
+// dropPendingBlock - Frees a block's information and removes it from a
+//   thread's pending buffer. The caller must hold the thread's pendingLock.
+//
+//  - tls (IN/OUT): The TLS of the thread whose buffer holds the block.
+//
+//  - index (IN): Index of the block in the pending buffer.
+//
+//  - cache (IN/OUT): The calling thread's cache of free blockinfo_t records.
+//
+//  - size (OUT): If not NULL, receives the block's size.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::dropPendingBlock (tls_t *tls, UINT index, slabcache_t &cache, SIZE_T *size)
+{
+    pendingblock_t &pending = tls->pending[index];
+    m_trackedAddresses.Remove(pending.mem);
+    recordFree(pending.info);
+    if (m_sizeClasses)
+        countShortLivedBlock(pending.heap, pending.mem, pending.info->size);
+    if (size != NULL)
+        *size = pending.info->size;
+    m_blockInfoPool.Free(cache, pending.info);
+    releaseDeferredStack(tls, pending);
+    // Keep the buffer in allocation order.
+    memmove(&tls->pending[index], &tls->pending[index + 1],
+        (tls->pendingCount - index - 1) * sizeof(pendingblock_t));
+    tls->pendingCount--;
+}
+
+// countShortLivedBlock - Counts a block freed while still in a pending buffer
+//   in the cumulative size class histograms of its heap. The block was never
+//   linked into the block map, so linkBlock didn't count it.
+//
+//  - heap (IN): Handle to the heap from which the block was allocated.
+//
+//  - mem (IN): Address of the block.
+//
+//  - size (IN): Size, in bytes, of the block.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::countShortLivedBlock (HANDLE heap, LPCVOID mem, SIZE_T size)
+{
+    ShardLocker cs(mem, getTls()->stats);
+    HeapMap::Iterator heapit = m_heapMap->find(heap);
+    if ((heapit == m_heapMap->end()) || ((*heapit).second->sizeClasses == NULL))
+        return;
+    sizeclasses_t *classes = (*heapit).second->sizeClasses;
+    UINT shard = ShardIndex(mem, BLOCKMAPSHARDS);
+    classes->total[shard][pow2Class(size)]++;
+    classes->total[shard][VLD_POW2_CLASSES + lfhClass(size)]++;
+}
+
+// cancelAnyPendingBlock - Removes a freed block from whichever thread's
+//   pending buffer holds it. Used when a block is freed by a thread other
+//   than the one that allocated it, before the allocating thread flushed it.
+//
+//  - heap (IN): Handle to the heap to which the block is being freed.
+//
+//  - mem (IN): Pointer to the memory block being freed.
+//
+//  - cache (IN/OUT): The calling thread's cache of free blockinfo_t records.
+//
+//  - size (OUT): If not NULL, receives the block's size if it was found.
+//
+//  Return Value:
+//
+//    Returns true if the block was found and its information freed.
+//
+bool VisualLeakDetector::cancelAnyPendingBlock (HANDLE heap, LPCVOID mem, slabcache_t &cache, SIZE_T *size)
+{
+    CriticalSectionLocker<> cs(m_tlsLock);
+    for (TlsMap::Iterator tlsit = m_tlsMap->begin(); tlsit != m_tlsMap->end(); ++tlsit) {
+        if (cancelPendingBlock((*tlsit).second, heap, mem, cache, size))
+            return true;
+    }
+    return false;
+}
+
+// queueRemoteFree - Queues the free of a block which is neither in the calling
+//   thread's pending buffer nor in its block map, with RemoteFreeQueue. The
+//   block is probably still pending in the buffer of the thread which
+//   allocated it. The queue is a lock-free list, which only ever has entries
+//   pushed onto it or all of them taken at once, and the freeing thread
+//   drains it once it holds a batch.
+//
+//   Note: Frees are tracked before the heap frees the block, so the block
+//   can't have been allocated again yet, and any block allocated at its
+//   address from now on gets a serial number of at least the bound recorded.
+//
+//  - heap (IN): Handle to the heap to which the block is being freed.
+//
+//  - mem (IN): Pointer to the memory block being freed.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::queueRemoteFree (HANDLE heap, LPCVOID mem)
+{
+    remotefree_t *entry = new remotefree_t;
+    entry->heap  = heap;
+    entry->mem   = mem;
+    entry->bound = serialMark();
+    remotefree_t *head;
+    do {
+        head = m_remoteFrees;
+        entry->next = head;
+    } while (InterlockedCompareExchangePointer((PVOID*)&m_remoteFrees, entry, head) != head);
+
+    if (InterlockedIncrement(&m_remoteFreeCount) >= VLD_REMOTE_FREE_BATCH)
+        drainRemoteFrees();
+}
+
+// drainRemoteFrees - Frees the blocks whose frees were queued (see
+//   queueRemoteFree). Those which were flushed into their block maps are
+//   erased from them; the others are looked for in every thread's pending
+//   buffer, which is searched once for all of them. Must be called without
+//   holding any g_heapMapLock shard or pendingLock.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::drainRemoteFrees ()
+{
+    remotefree_t *entries = (remotefree_t*)InterlockedExchangePointer((PVOID*)&m_remoteFrees, NULL);
+    if (entries == NULL)
+        return;
+
+    tls_t *drainer = getTls();
+    slabcache_t &cache = drainer->blockInfoCache;
+    drainer->flags |= VLD_TLS_REMOTEFREES;
+    HashMap<LPCVOID, remotefree_t*> pending;
+    remotefree_t *retry = NULL;
+    LONG drained = 0;
+    UINT unresolved = 0;
+    while (entries != NULL) {
+        remotefree_t *entry = entries;
+        entries = entry->next;
+        drained++;
+        bool heapMapped;
+        if (eraseBlock(entry->heap, entry->mem, cache, heapMapped, NULL, entry->bound) || !heapMapped) {
+            delete entry;
+            continue;
+        }
+        if (pending.insert(entry->mem, entry) == pending.end()) {
+            // The same address was freed again; its turn comes next time.
+            entry->next = retry;
+            retry = entry;
+            continue;
+        }
+        unresolved++;
+    }
+
+    if (unresolved != 0) {
+        CriticalSectionLocker<> cs(m_tlsLock);
+        for (TlsMap::Iterator tlsit = m_tlsMap->begin(); (tlsit != m_tlsMap->end()) && (unresolved != 0); ++tlsit) {
+            tls_t *tls = (*tlsit).second;
+            if (tls->pendingCount == 0)
+                continue;
+            CriticalSectionLocker<> pl(tls->pendingLock);
+            for (UINT index = tls->pendingCount; index > 0; index--) {
+                pendingblock_t &block = tls->pending[index - 1];
+                HashMap<LPCVOID, remotefree_t*>::Iterator it = pending.find(block.mem);
+                if ((it == pending.end()) || ((*it).second->heap != block.heap) ||
+                    (block.info->serialNumber >= (*it).second->bound))
+                    continue;
+                delete (*it).second;
+                pending.erase(it);
+                dropPendingBlock(tls, index - 1, cache);
+                unresolved--;
+            }
+        }
+    }
+
+    // The blocks flushed since they were looked for are in their block maps
+    // now. The others were never tracked.
+    for (HashMap<LPCVOID, remotefree_t*>::Iterator it = pending.begin(); it != pending.end(); ++it) {
+        remotefree_t *entry = (*it).second;
+        bool heapMapped;
+        eraseBlock(entry->heap, entry->mem, cache, heapMapped, NULL, entry->bound);
+        delete entry;
+    }
+    drainer->flags &= ~VLD_TLS_REMOTEFREES;
+
+    // The frees left for next time go back onto the queue, with their bounds.
+    LONG retried = 0;
+    remotefree_t *last = retry;
+    for (remotefree_t *entry = retry; entry != NULL; entry = entry->next) {
+        last = entry;
+        retried++;
+    }
+    if (retry != NULL) {
+        remotefree_t *head;
+        do {
+            head = m_remoteFrees;
+            last->next = head;
+        } while (InterlockedCompareExchangePointer((PVOID*)&m_remoteFrees, retry, head) != head);
+    }
+    InterlockedExchangeAdd(&m_remoteFreeCount, retried - drained);
+}
+
+// deferStackCapture - Checks whether the CallStacks of new blocks are created
+//   only once the blocks leave the pending buffer (see DeferStackCapture).
+//   The safe stack walk and site statistics need the whole capture right
+//   away, and sampled blocks don't go through the pending buffer.
+//
+//  Return Value:
+//
+//    Returns true if the CallStacks are deferred.
+//
+bool VisualLeakDetector::deferStackCapture () const
+{
+    return ((m_options & (VLD_OPT_DEFER_STACK_CAPTURE | VLD_OPT_SITE_STATISTICS)) == VLD_OPT_DEFER_STACK_CAPTURE) &&
+        (m_capturePolicy->walkMethod != VLD_OPT_SAFE_STACK_WALK) && !sampling();
+}
+
+// deferCallStack - Keeps the frames of a new block's call stack with the
+//   block's pending buffer entry, so that the CallStack is only created (and
+//   interned) when the entry is flushed. A block freed before then costs no
+//   CallStack at all. The caller must hold the thread's pendingLock.
+//
+//  - tls (IN/OUT): The calling thread's TLS.
+//
+//  - pending (IN/OUT): The block's pending buffer entry.
+//
+//  - frames (IN): The frames, as captured by CallStack::CaptureFrames.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::deferCallStack (tls_t *tls, pendingblock_t &pending, const deferredstack_t &frames)
+{
+    if (tls->deferred == NULL) {
+        tls->deferred = new deferredstack_t [VLD_PENDING_BLOCKS];
+        for (UINT slot = 0; slot < VLD_PENDING_BLOCKS; slot++)
+            tls->deferredFree[slot] = (BYTE)slot;
+        tls->deferredFreeCount = VLD_PENDING_BLOCKS;
+    }
+    if (pending.stack == NULL) {
+        // There is an entry for every pending block, so one is free.
+        assert(tls->deferredFreeCount > 0);
+        pending.stack = &tls->deferred[tls->deferredFree[--tls->deferredFreeCount]];
+    }
+    pending.stack->count = frames.count;
+    pending.stack->hashValue = frames.hashValue;
+    memcpy(pending.stack->frames, frames.frames, frames.count * sizeof(UINT_PTR));
+}
+
+// releaseDeferredStack - Returns a pending block's deferred frames, if any,
+//   to its thread's free entries. The caller must hold the thread's
+//   pendingLock.
+//
+//  - tls (IN/OUT): The TLS of the thread whose pending buffer holds the block.
+//
+//  - pending (IN/OUT): The block's pending buffer entry.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::releaseDeferredStack (tls_t *tls, pendingblock_t &pending)
+{
+    if (pending.stack == NULL)
+        return;
+    tls->deferredFree[tls->deferredFreeCount++] = (BYTE)(pending.stack - tls->deferred);
+    pending.stack = NULL;
+}
+
+// eraseBlock - Erases a block from its heap's block map and frees its
+//   information.
+//
+//  - heap (IN): Handle to the heap to which the block is being freed.
+//
+//  - mem (IN): Pointer to the memory block being freed.
+//
+//  - cache (IN/OUT): The calling thread's cache of free blockinfo_t records.
+//
+//  - heapMapped (OUT): Receives false if the heap has no block map.
+//
+//  - size (OUT): If not NULL, receives the block's size if it was found.
+//
+//  - before (IN): Only a block with a lower serial number is erased. A queued
+//      free (see queueRemoteFree) mustn't erase a block allocated since.
+//
+//  Return Value:
+//
+//    Returns true if the block was found in the block map.
+//
+bool VisualLeakDetector::eraseBlock (HANDLE heap, LPCVOID mem, slabcache_t &cache, bool &heapMapped, SIZE_T *size,
+    SIZE_T before)
+{
+    vldstats_t &stats = getTls()->stats;
+    stats.mapErases++;
+
+    // Find this heap's block map.
+    ShardLocker cs(mem, stats);
+    TickCounter ticks(stats.mapEraseTicks);
+    HeapMap::Iterator heapit = m_heapMap->find(heap);
+    heapMapped = (heapit != m_heapMap->end());
+    if (!heapMapped)
+        return false;
+
+    // Find this block in the block map.
+    BlockMap           *blockmap = &(*heapit).second->blockMap;
+    BlockMap::Iterator  blockit = blockmap->find(mem);
+    if ((blockit == blockmap->end()) || ((*blockit).second->serialNumber >= before))
+        return false;
+
+    // Free the blockinfo_t structure and erase it from the block map.
+    blockinfo_t *info = (*blockit).second;
+    m_trackedAddresses.Remove(mem);
+    recordFree(info);
+    if (size != NULL)
+        *size = info->size;
+    unlinkBlock((*heapit).second, mem, info);
+    m_blockInfoPool.Free(cache, info);
+    blockmap->erase(blockit);
+    if ((*heapit).second->addresses != NULL)
+        (*heapit).second->addresses->erase(mem);
+    return true;
+}
+
+// sizedReserve - Picks the reserve of a container: the size recorded in the
+//   sizing profile, if it's bigger than the default.
+//
+//  - profiled (IN): The size recorded in the profile, or 0.
+//
+//  - fallback (IN): The container's default reserve.
+//
+//  Return Value:
+//
+//    Returns the number of entries to reserve.
+//
+static size_t sizedReserve (UINT64 profiled, size_t fallback)
+{
+    return (profiled > fallback) ? (size_t)profiled : fallback;
+}
+
+// newHeapInfo - Creates the information of a heap, with an empty block map.
+//
+//  - reserve (IN): Number of blocks to reserve in the block map, from the
+//      sizing profile, or 0 for the default reserve.
+//
+//  - sizeClasses (IN): Whether the heap keeps size class histograms.
+//
+//  - ordered (IN): Whether the heap's blocks are also kept in address order,
+//      as a pool's always are (see UntrackRange), and every heap's are with
+//      AddressIndex (see FindContainingBlock).
+//
+//  Return Value:
+//
+//    Returns the new heapinfo_t.
+//
+static heapinfo_t* newHeapInfo (SIZE_T reserve, bool sizeClasses, bool ordered)
+{
+    heapinfo_t* heapinfo = new heapinfo_t;
+    heapinfo->blockMap.reserve(sizedReserve(reserve, BLOCK_MAP_RESERVE));
+    heapinfo->ordinal = 0;
+    heapinfo->flags = 0x0;
+    ZeroMemory(heapinfo->newest, sizeof(heapinfo->newest));
+    ZeroMemory(heapinfo->blocks, sizeof(heapinfo->blocks));
+    ZeroMemory(heapinfo->bytes, sizeof(heapinfo->bytes));
+    heapinfo->sizeClasses = NULL;
+    if (sizeClasses) {
+        heapinfo->sizeClasses = new sizeclasses_t;
+        ZeroMemory(heapinfo->sizeClasses, sizeof(sizeclasses_t));
+    }
+    heapinfo->addresses = ordered ? new Set<LPCVOID> : NULL;
+    return heapinfo;
+}
+
+// deleteHeapInfo - Frees the information of a heap created by newHeapInfo.
+//
+//  - heapinfo (IN): The heap's information.
+//
+//  Return Value:
+//
+//    None.
+//
+static VOID deleteHeapInfo (heapinfo_t *heapinfo)
+{
+    delete heapinfo->sizeClasses;
+    delete heapinfo->addresses;
+    delete heapinfo;
+}
+
+// mapheap - Tracks heap creation. Creates a block map for tracking individual
+//   allocations from the newly created heap and then maps the heap to this
+//   block map.
+//
+//  - heap (IN): Handle to the newly created heap.
+//
+//  - flags (IN): Initial heap status flags. With VLD_HEAP_IGNORED, the heap
+//      is also marked in the bitmap of ignored heaps.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::mapHeap (HANDLE heap, UINT32 flags)
+{
+    CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+
+    // Create a new block map for this heap and insert it into the heap map.
+    heapinfo_t* heapinfo = newHeapInfo(blockMapReserve(), m_sizeClasses, m_addressIndex || VLD_IS_POOL_HEAP(heap));
+    heapinfo->flags = flags;
+    heapinfo->ordinal = m_heapsMapped++;
+    bool inserted;
+    m_heapMap->insert(heap, heapinfo, inserted);
+    if (!inserted) {
+        // Somehow this heap has been created twice without being destroyed,
+        // or at least it was destroyed without VLD's knowledge. Unmap the heap
+        // from the existing heapinfo, and remap it to the new one.
+        Report(L"WARNING: Visual Leak Detector detected a duplicate heap (" ADDRESSFORMAT L").\n", heap);
+        unmapHeap(heap);
+        m_heapMap->insert(heap, heapinfo);
+    }
+
+    if (flags & VLD_HEAP_IGNORED) {
+        // The flag is set first, so that a hook which finds the bit set also
+        // finds the flag.
+        UINT32 bit = ignoredHeapBit(heap);
+        InterlockedOr(&m_ignoredHeaps[bit / 32], 1L << (bit % 32));
+    }
+}
+
+// mapHeapOnce - Maps a heap which a block has been seen allocated from (or
+//   GetProcessHeap returned), unless it has been mapped already: by another
+//   thread in the meantime, or when it was created. Unlike mapHeap, a heap
+//   which is mapped already is left alone. Either way, the heap map is only
+//   descended once under the heap map lock.
+//
+//  - heap (IN): Handle to the heap.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::mapHeapOnce (HANDLE heap)
+{
+    CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+
+    heapinfo_t* heapinfo = newHeapInfo(blockMapReserve(), m_sizeClasses, m_addressIndex || VLD_IS_POOL_HEAP(heap));
+    bool inserted;
+    m_heapMap->insert(heap, heapinfo, inserted);
+    if (!inserted)
+        deleteHeapInfo(heapinfo);
+    else
+        heapinfo->ordinal = m_heapsMapped++;
+}
+
+// isIgnoredHeapMapped - Determines if a heap whose bit is set in the bitmap of
+//   ignored heaps really is ignored. The bit may belong to another heap, or to
+//   an ignored heap that has been destroyed since; bits are never cleared.
+//
+//  - heap (IN): Handle to the heap.
+//
+//  Return Value:
+//
+//    Returns true if the heap is mapped with VLD_HEAP_IGNORED.
+//
+bool VisualLeakDetector::isIgnoredHeapMapped (HANDLE heap) const
+{
+    HeapMap::Iterator heapit = m_heapMap->find(heap);
+    return (heapit != m_heapMap->end()) && ((*heapit).second->flags & VLD_HEAP_IGNORED);
+}
+
+// isIgnoredHeapCreator - Determines if HeapCreate was called from one of the
+//   modules listed by HeapsToIgnore. Heaps are seldom created, so the module's
+//   name is simply looked up.
+//
+//  - returnaddress (IN): Address HeapCreate returns to.
+//
+//  Return Value:
+//
+//    Returns true if the heaps created from the calling module are ignored.
+//
+bool VisualLeakDetector::isIgnoredHeapCreator (UINT_PTR returnaddress) const
+{
+    if (m_ignoredHeapModules[0] == '\0')
+        return false;
+
+    HMODULE module = GetCallingModule(returnaddress);
+    WCHAR path [MAX_PATH];
+    if ((module == NULL) || (GetModuleFileNameW(module, path, MAX_PATH) == 0))
+        return false;
+    path[MAX_PATH - 1] = L'\0';
+    LPWSTR modulename = wcsrchr(path, L'\\');
+    modulename = (modulename != NULL) ? modulename + 1 : path;
+    _wcslwr_s(modulename, MAX_PATH - (modulename - path));
+    return wcsstr(m_ignoredHeapModules, modulename) != NULL;
+}
+
+// unmapblock - Tracks memory blocks that are freed. Unmaps the specified block
+//   from the block's information, relinquishing internally allocated resources.
+//
+//  - heap (IN): Handle to the heap to which this block is being freed.
+//
+//  - mem (IN): Pointer to the memory block being freed.
+//
+//  - size (OUT): If not NULL, receives the block's size if it was tracked.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::unmapBlock (HANDLE heap, LPCVOID mem, const context_t &context, SIZE_T *size)
+{
+    if ((NULL == mem) || !m_trackedAddresses.MayContain(mem))
+        return;
+
+    TraceLoggingWrite(g_vldTraceProvider, "UnmapBlock",
+        TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+        TraceLoggingKeyword(VLD_TRACE_KEYWORD_BLOCKS),
+        TraceLoggingPointer(heap, "Heap"),
+        TraceLoggingPointer(mem, "Address"));
+
+    // Most short-lived blocks are freed by the thread that allocated them,
+    // while they are still in that thread's pending buffer.
+    tls_t* tls = getTls();
+    if (m_allocTracing)
+        recordAllocTrace(tls, VLDATRACE_FREE, heap, mem, 0, NULL);
+
+    // With RecentFreeRing, the size of each block freed is remembered.
+    SIZE_T freedsize = 0;
+    SIZE_T *sizeout = ((size == NULL) && m_recentFreeRing) ? &freedsize : size;
+    if (cancelPendingBlock(tls, heap, mem, tls->blockInfoCache, sizeout)) {
+        if (m_recentFreeRing)
+            rememberFree(tls, heap, mem, *sizeout, context);
+        return;
+    }
+
+    bool heapMapped;
+    if (eraseBlock(heap, mem, tls->blockInfoCache, heapMapped, sizeout)) {
+        if (m_recentFreeRing)
+            rememberFree(tls, heap, mem, *sizeout, context);
+        return;
+    }
+    if (!heapMapped) {
+        // We don't have a block map for this heap. We must not have monitored
+        // this allocation (probably happened before VLD was initialized).
+        return;
+    }
+
+    // A block freed already, or remembered freed from another heap.
+    if (m_recentFreeRing && checkRecentFrees(tls, heap, mem, context))
+        return;
+
+    // With ValidateHeapFreeRate, only 1 in so many of the frees which get this
+    // far, counted per thread, is validated. When sampling, most freed blocks
+    // were never tracked, so the search would be both expensive and pointless.
+    bool validate = (m_options & VLD_OPT_VALIDATE_HEAPFREE) && !sampling() &&
+        ((tls->validateCount++ % m_validateHeapFreeRate) == 0);
+
+    // The block may have been allocated by another thread and still be in
+    // that thread's pending buffer. If it isn't there, that thread may have
+    // flushed it in the meantime, so look in the block map once more. With
+    // RemoteFreeQueue, that's left to the next drain of the queue, unless
+    // the caller needs the block's size now or the free is validated.
+    if (!sampling() && m_remoteFreeQueue && (size == NULL) && !validate) {
+        queueRemoteFree(heap, mem);
+        return;
+    }
+    if (!sampling()) {
+        if (cancelAnyPendingBlock(heap, mem, tls->blockInfoCache, sizeout) ||
+            eraseBlock(heap, mem, tls->blockInfoCache, heapMapped, sizeout)) {
+            if (m_recentFreeRing)
+                rememberFree(tls, heap, mem, *sizeout, context);
+            return;
+        }
+    }
+
+    // This memory block is not in the block map. We must not have monitored this
+    // allocation (probably happened before VLD was initialized).
+
+    // This can also result from allocating on one heap, and freeing on another heap.
+    // This is an especially bad way to corrupt the application.
+    // Now we have to look the block up in every other heap to make sure that this is
+    // indeed the case. The deallocation's call stack is only captured once
+    // the block is found in another heap.
+    if (validate)
+    {
+        // Searching every heap needs the whole lock. No shard is held here,
+        // so that we can't deadlock against another thread.
+        flushAllPendingBlocks();
+        CriticalSectionLocker<HeapMapLock> all(g_heapMapLock);
+        HANDLE other_heap = NULL;
+        blockinfo_t* alloc_block = findAllocedBlock(mem, other_heap); // other_heap is an out parameter
+        bool diff = other_heap != heap; // Check indeed if the other heap is different
+        // A pool's blocks lie within a chunk of a heap, which may start at
+        // the same address.
+        if (VLD_IS_POOL_HEAP(heap) || VLD_IS_POOL_HEAP(other_heap))
+            diff = false;
+        if (alloc_block && alloc_block->callStack && diff)
+        {
+            Report(L"CRITICAL ERROR!: VLD reports that memory was allocated in one heap and freed in another.\nThis will result in a corrupted heap.\nAllocation Call stack.\n");
+            Report(L"---------- Block %Iu at " ADDRESSFORMAT L": %Iu bytes ----------\n", alloc_block->serialNumber, mem, alloc_block->size);
+            Report(L"  TID: %u\n", getThreadId(alloc_block));
+            Report(L"  Call Stack:\n");
+            alloc_block->callStack->dump(m_options & VLD_OPT_TRACE_INTERNAL_FRAMES);
+
+            // Now we need a way to print the current callstack at this point:
+            CallStack* stack_here = CallStack::Capture(m_capturePolicy->maxTraceFrames, context);
+            Report(L"Deallocation Call stack.\n");
+            Report(L"---------- Block %Iu at " ADDRESSFORMAT L": %Iu bytes ----------\n", alloc_block->serialNumber, mem, alloc_block->size);
+            Report(L"  Call Stack:\n");
+            stack_here->dump(FALSE);
+            // Now it should be safe to delete our temporary callstack
+            CallStack::Destroy(stack_here);
+            stack_here = NULL;
+            FlushReport();
+            if (IsDebuggerPresent())
+                DebugBreak();
+        }
+    }
+}
+
+// rememberFree - Records a tracked block freed by the calling thread in its
+//   ring of recent frees, overwriting the oldest.
+//
+//  - tls (IN): The calling thread's thread local storage structure.
+//
+//  - heap (IN): Handle to the heap the block is freed to.
+//
+//  - mem (IN): Pointer to the memory block being freed.
+//
+//  - size (IN): Size of the block.
+//
+//  - context (IN): Context of the free.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::rememberFree (tls_t *tls, HANDLE heap, LPCVOID mem, SIZE_T size, const context_t &context)
+{
+    recentfrees_t *ring = tls->recentFrees;
+    if (ring == NULL) {
+        ring = new recentfrees_t;
+        ZeroMemory(ring, sizeof(recentfrees_t));
+        tls->recentFrees = ring;
+    }
+    recentfree_t &entry = ring->frees[ring->next % VLD_RECENT_FREES];
+    entry.mem  = mem;
+    entry.heap = heap;
+    entry.size = size;
+    entry.site = GET_RETURN_ADDRESS(context);
+    ring->next++;
+}
+
+// checkRecentFrees - Looks for a block which was found in no block map among
+//   the recent frees, the calling thread's first, then, unless sampling, the
+//   other threads'. The rings are read without synchronizing with the threads
+//   which own them, so an entry found is only believed if the heap confirms
+//   that the block isn't allocated: the address may since have been reused for
+//   a block VLD didn't track. A pool's blocks (see TrackAlloc) can't be
+//   confirmed, so they're never reported.
+//
+//  - tls (IN): The calling thread's thread local storage structure.
+//
+//  - heap (IN): Handle to the heap the block is being freed to.
+//
+//  - mem (IN): Pointer to the memory block being freed.
+//
+//  - context (IN): Context of the free.
+//
+//  Return Value:
+//
+//    Returns true if the free was reported as a double free or a free to the
+//    wrong heap.
+//
+bool VisualLeakDetector::checkRecentFrees (tls_t *tls, HANDLE heap, LPCVOID mem, const context_t &context)
+{
+    recentfree_t found;
+    DWORD threadId = 0;
+    bool hit = false;
+    if (tls->recentFrees != NULL) {
+        for (UINT32 index = 0; (index < VLD_RECENT_FREES) && !hit; index++) {
+            const recentfree_t &entry = tls->recentFrees->frees[(tls->recentFrees->next - 1 - index) % VLD_RECENT_FREES];
+            if (entry.mem == mem) {
+                found = entry;
+                threadId = tls->threadId;
+                hit = true;
+            }
+        }
+    }
+    if (!hit && !sampling()) {
+        CriticalSectionLocker<> cs(m_tlsLock);
+        for (TlsMap::Iterator tlsit = m_tlsMap->begin(); (tlsit != m_tlsMap->end()) && !hit; ++tlsit) {
+            const recentfrees_t *ring = (*tlsit).second->recentFrees;
+            if ((ring == NULL) || ((*tlsit).second == tls))
+                continue;
+            for (UINT32 index = 0; (index < VLD_RECENT_FREES) && !hit; index++) {
+                if (ring->frees[index].mem == mem) {
+                    found = ring->frees[index];
+                    threadId = (*tlsit).second->threadId;
+                    hit = true;
+                }
+            }
+        }
+    }
+    if (!hit || VLD_IS_POOL_HEAP(heap) || VLD_IS_POOL_HEAP(found.heap) || HeapValidate(heap, 0, mem))
+        return false;
+
+    if (found.heap == heap) {
+        Report(L"CRITICAL ERROR!: VLD reports that the block at " ADDRESSFORMAT L" (%Iu bytes) was freed twice.\n"
+            L"It was freed first by thread %u, returning to " ADDRESSFORMAT L".\n", mem, found.size, threadId, found.site);
+    }
+    else {
+        Report(L"CRITICAL ERROR!: VLD reports that the block at " ADDRESSFORMAT L" (%Iu bytes) is freed to heap " ADDRESSFORMAT
+            L",\nbut it was last freed to heap " ADDRESSFORMAT L" by thread %u, returning to " ADDRESSFORMAT L".\n",
+            mem, found.size, heap, found.heap, threadId, found.site);
+    }
+    CallStack *previous = CallStack::Create(&found.site, 1, CalculateCRC32(&found.site, 1));
+    Report(L"Previous deallocation site.\n");
+    previous->dump(FALSE);
+    CallStack::Destroy(previous);
+    CallStack *stack_here = CallStack::Capture(m_capturePolicy->maxTraceFrames, context);
+    Report(L"Deallocation Call stack.\n");
+    stack_here->dump(FALSE);
+    CallStack::Destroy(stack_here);
+    FlushReport();
+    if (IsDebuggerPresent())
+        DebugBreak();
+    return true;
+}
+
+// unmapheap - Tracks heap destruction. Unmaps the specified heap from its block
+//   map. The block map is cleared and deleted, relinquishing internally
+//   allocated resources.
+//
+//  Note: Blocks of this heap still in pending buffers are only freed with it
+//   if the buffers were flushed (see flushAllPendingBlocks) beforehand.
+//
+//  - heap (IN): Handle to the heap which is being destroyed.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::unmapHeap (HANDLE heap)
+{
+    if (m_allocTracing)
+        recordAllocTrace(getTls(), VLDATRACE_HEAPDESTROY, heap, NULL, 0, NULL);
+
+    // Find this heap's block map.
+    CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+    HeapMap::Iterator heapit = m_heapMap->find(heap);
+    if (heapit == m_heapMap->end()) {
+        // This heap hasn't been mapped. We must not have monitored this heap's
+        // creation (probably happened before VLD was initialized).
+        return;
+    }
+
+    // Free all of the blockinfo_t structures stored in the block map, as
+    // recordFree would, but in bulk: the bytes in use drop once, each call
+    // stack loses all of the heap's references on it at once, and the
+    // structures go back to the pool in one batch.
+    heapinfo_t *heapinfo = (*heapit).second;
+    BlockMap   *blockmap = &heapinfo->blockMap;
+    HashMap<CallStack*, UINT32> refs;
+    slabcache_t batch = { NULL, 0 };
+    SIZE_T bytes = 0;
+    WORD destroyer = getTls()->threadIndex;
+    for (BlockMap::Iterator blockit = blockmap->begin(); blockit != blockmap->end(); ++blockit) {
+        blockinfo_t *info = (*blockit).second;
+        m_trackedAddresses.Remove((*blockit).first);
+        bytes += info->size;
+        if ((m_options & VLD_OPT_SITE_STATISTICS) && info->callStack) {
+            info->callStack->recordLifetime(m_requestCurr - 1 - info->serialNumber);
+            info->callStack->recordFreeThread((info->threadIndex != 0) && (info->threadIndex != destroyer));
+        }
+        recordSiteFree(info);
+        uncountBlock(info);
+        CallStack *stack = info->callStack.detach();
+        if (stack != NULL) {
+            bool inserted;
+            HashMap<CallStack*, UINT32>::Iterator refit = refs.insert(stack, 1, inserted);
+            if (!inserted)
+                refs.replace(refit, (*refit).second + 1);
+        }
+        m_blockInfoPool.Gather(batch, info);
+    }
+    m_blockInfoPool.FreeBatch(batch);
+    InterlockedExchangeAddSizeT(&m_curAlloc, (SIZE_T)0 - bytes);
+    for (HashMap<CallStack*, UINT32>::Iterator refit = refs.begin(); refit != refs.end(); ++refit)
+        g_callStackTable.Release((*refit).first, (*refit).second);
+    noteHeapSizing(heapinfo);
+    deleteHeapInfo(heapinfo);
+
+    // Remove this heap's block map from the heap map.
+    m_heapMap->erase(heapit);
+}
+
+// remapblock - Tracks reallocations. Unmaps a block from its previously
+//   collected information and remaps it to updated information.
+//
+//  Note: If the block itself remains at the same address, then the block's
+//   information can simply be updated rather than having to actually erase and
+//   reinsert the block.
+//
+//  - heap (IN): Handle to the heap from which the memory is being reallocated.
+//
+//  - mem (IN): Pointer to the memory block being reallocated.
+//
+//  - newmem (IN): Pointer to the memory block being returned to the caller
+//      that requested the reallocation. This pointer may or may not be the same
+//      as the original memory block (as pointed to by "mem").
+//
+//  - size (IN): Size, in bytes, of the new memory block.
+//
+//  - framepointer (IN): The frame pointer at which this reallocation entered
+//      VLD's code. Used for determining the starting point of the stack trace.
+//
+//  - crtalloc (IN): Should be set to TRUE if this reallocation is for a CRT
+//      memory block. Otherwise should be set to FALSE.
+//
+//  - threadIndex (IN): Thread table index of the reallocating thread.
+//
+//  - image (IN): Module image of the reallocating code, or MODULEIMAGE_NONE
+//      if it isn't known. Like the thread, it is the block's from now on.
+//
+//  - stack (IN/OUT): The block's new call stack, captured beforehand. The
+//      block takes it over, unless it's reallocated in place and keeps its
+//      own (see ReallocStackPolicy).
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::remapBlock (HANDLE heap, LPCVOID mem, LPCVOID newmem, SIZE_T size,
+    bool debugcrtalloc, bool ucrt, WORD threadIndex, WORD image, capturedstack_t &stack, const context_t &context)
+{
+    if (newmem != mem) {
+        // The block was not reallocated in-place. Instead the old block was
+        // freed and a new block allocated to satisfy the new size.
+        SIZE_T oldsize = 0;
+        unmapBlock(heap, mem, context, &oldsize);
+        recordSiteRealloc(stack.callStack.get(), oldsize, size);
+        mapBlock(heap, newmem, size, debugcrtalloc, ucrt, threadIndex, image, stack);
+        return;
+    }
+
+    // A block which moved shows up as unmapped and mapped again; only one
+    // reallocated in-place has an event of its own.
+    TraceLoggingWrite(g_vldTraceProvider, "RemapBlock",
+        TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+        TraceLoggingKeyword(VLD_TRACE_KEYWORD_BLOCKS),
+        TraceLoggingPointer(heap, "Heap"),
+        TraceLoggingPointer(mem, "Address"),
+        TraceLoggingUInt64(size, "Size"),
+        TraceLoggingHexUInt32(stackHash(stack), "StackHash"));
+
+    // The block was reallocated in-place. If it's still in this thread's
+    // pending buffer, update it right there.
+    tls_t* tls = getTls();
+    if (m_allocTracing) {
+        internCallStack(stack);
+        recordAllocTrace(tls, VLDATRACE_REALLOC, heap, mem, size, stack.callStack.get());
+    }
+    {
+        CriticalSectionLocker<> pl(tls->pendingLock);
+        for (UINT index = tls->pendingCount; index > 0; index--) {
+            pendingblock_t &pending = tls->pending[index - 1];
+            if ((pending.mem == mem) && (pending.heap == heap)) {
+                blockinfo_t* info = pending.info;
+                SIZE_T oldsize = info->size;
+                recordAlloc(info->size, size);
+                info->threadIndex = threadIndex;
+                info->tag = currentTag(tls);
+                info->image = image;
+                if (stack.keep) {
+                    // The block keeps its CallStack, or its deferred frames.
+                    info->size = size;
+                    recordSiteResize(info, oldsize);
+                    recordSiteRealloc(reallocSite(info, stack), oldsize, size);
+                    return;
+                }
+                recordSiteFree(info);
+                info->size = size;
+                info->callStack.reset(stack.callStack.detach());
+                if (info->callStack || stack.skipped) {
+                    releaseDeferredStack(tls, pending);
+                    recordSiteAlloc(info);
+                    recordSiteRealloc(info->callStack.get(), oldsize, size);
+                }
+                else {
+                    deferCallStack(tls, pending, stack.frames);
+                }
+                return;
+            }
+        }
+    }
+
+    // Find the existing blockinfo_t entry in the block map and update it
+    // with the new callstack and size. The shard is released before falling
+    // back to mapBlock, which may need the whole lock to map the heap. A
+    // flushed block's CallStack can't be deferred anymore, so it's created
+    // now, before the shard is entered. The block's previous CallStack is
+    // only released once the shard is left.
+    internCallStack(stack);
+    CallStackRef oldStack;
+    ShardLocker cs(mem, tls->stats);
+    HeapMap::Iterator heapit = m_heapMap->find(heap);
+    if (heapit == m_heapMap->end()) {
+        // We haven't mapped this heap to a block map yet. Obviously the
+        // block has also not been mapped to a blockinfo_t entry yet either,
+        // so treat this reallocation as a brand-new allocation (this will
+        // also map the heap to a new block map).
+        cs.Leave();
+        captureKeptStack(tls, context, stack);
+        mapBlock(heap, newmem, size, debugcrtalloc, ucrt, threadIndex, image, stack);
+        return;
+    }
+
+    // Find the block's blockinfo_t structure so that we can update it.
+    BlockMap           *blockmap = &(*heapit).second->blockMap;
+    BlockMap::Iterator  blockit = blockmap->find(mem);
+    if (blockit == blockmap->end()) {
+        // The block hasn't been mapped to a blockinfo_t entry yet. It may
+        // still be pending in another thread's buffer (or have just been
+        // flushed from it), so drop any such entry first. Then treat this
+        // reallocation as a new allocation.
+        cs.Leave();
+        if (!sampling()) {
+            bool heapMapped;
+            if (!cancelAnyPendingBlock(heap, mem, tls->blockInfoCache))
+                eraseBlock(heap, mem, tls->blockInfoCache, heapMapped);
+        }
+        captureKeptStack(tls, context, stack);
+        mapBlock(heap, newmem, size, debugcrtalloc, ucrt, threadIndex, image, stack);
+        return;
+    }
+
+    // Found the blockinfo_t entry for this block. Update it with
+    // a new callstack and new size.
+    blockinfo_t* info = (*blockit).second;
+    if (!stack.keep)
+        recordSiteFree(info);
+    // The block may be counted as reported by its thread's reported mark,
+    // which no longer applies once another thread owns it.
+    bool reported = isReported(info);
+    uncountBlock(info);
+    info->counted = false;
+    info->unclassified = false;
+    if (!stack.keep)
+        oldStack.reset(info->callStack.detach());
+
+    recordAlloc(info->size, size);
+
+    info->threadIndex = threadIndex;
+    info->tag = currentTag(tls);
+    info->image = image;
+    // Update the block's size. To the size class histograms, the block is
+    // a new one of the new size.
+    UINT shard = ShardIndex(mem, BLOCKMAPSHARDS);
+    (*heapit).second->bytes[shard] += size - info->size;
+    if ((*heapit).second->sizeClasses != NULL) {
+        removeSizeClasses((*heapit).second->sizeClasses, shard, info->size);
+        addSizeClasses((*heapit).second->sizeClasses, shard, size);
+    }
+    SIZE_T oldsize = info->size;
+    info->size = size;
+    if (stack.keep) {
+        recordSiteResize(info, oldsize);
+        recordSiteRealloc(reallocSite(info, stack), oldsize, size);
+    }
+    else {
+        info->callStack.reset(stack.callStack.detach());
+        recordSiteAlloc(info);
+        recordSiteRealloc(info->callStack.get(), oldsize, size);
+    }
+    if (reported)
+        info->reported = true;
+    else
+        countBlock(mem, info);
+}
+
+// captureStack - Captures the call stack of an allocation, following the
+//   allocating module's policy, as IsExcludedModule found it.
+//
+//  - tls (IN/OUT): The allocating thread's TLS.
+//
+//  - context (IN): The context the allocation entered VLD with.
+//
+//  - stack (OUT): Receives the call stack.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::captureStack (tls_t *tls, const context_t &context, capturedstack_t &stack)
+{
+    const capturepolicy_t *policy = m_capturePolicy;
+    UINT32 maxframes = (tls->traceFrames != 0) ? tls->traceFrames : policy->maxTraceFrames;
+    UINT32 method = tls->traceWalk;
+    if (method == CALLSTACK_WALK_CONFIGURED) {
+        // The method is resolved here, so that the whole capture follows the
+        // policy read above even if another one is published meanwhile.
+        method = policy->walkMethod;
+    }
+    stack.skipped = (m_degradation >= VLD_DEGRADED_SIZE_ONLY) || (method == VLD_OPT_NO_STACK_WALK) ||
+        (method == VLD_OPT_NTDB_STACK_WALK);
+    if (stack.skipped)
+        return;
+
+    TickCounter ticks(tls->stats.stackCaptureTicks);
+    tls->stats.stackCaptures++;
+    if (method == VLD_OPT_CALLER_STACK_WALK) {
+        // Only the caller is recorded, and its stack is usually cached.
+        stack.callStack.reset(callerSite(GET_RETURN_ADDRESS(context)));
+    }
+    else if ((policy->adaptiveFrames != 0) && (maxframes > policy->adaptiveFrames)) {
+        // Most stacks are reused without creating a CallStack, so there is
+        // nothing left to defer.
+        stack.callStack.reset(CallStack::CaptureAdaptive(policy->adaptiveFrames, maxframes, context, method,
+            tls->stackCache));
+    }
+    else if (deferStackCapture() && (method != VLD_OPT_SAFE_STACK_WALK)) {
+        // The frames can only be captured now, but the CallStack is left
+        // until the block leaves the pending buffer.
+        stack.frames.hashValue = 0;
+        stack.frames.count = CallStack::CaptureFrames(maxframes, context,
+            stack.frames.frames, stack.frames.hashValue, method);
+    }
+    else {
+        stack.callStack.reset(CallStack::CaptureInterned(maxframes, context, method, tls->stackCache));
+    }
+}
+
+// captureKeptStack - Captures the call stack of an in-place reallocation
+//   whose block was to keep its own call stack, when the block turns out not
+//   to be tracked, so that it's tracked from the reallocation on.
+//
+//  - tls (IN/OUT): The reallocating thread's TLS.
+//
+//  - context (IN): The context the reallocation entered VLD with.
+//
+//  - stack (IN/OUT): The reallocation's call stack.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::captureKeptStack (tls_t *tls, const context_t &context, capturedstack_t &stack)
+{
+    if (!stack.keep)
+        return;
+    stack.keep = false;
+    if (stack.skipped && (m_reallocStackPolicy == VLD_REALLOC_STACK_ORIGINAL))
+        captureStack(tls, context, stack);
+}
+
+// internCallStack - Creates and interns a captured call stack whose creation
+//   was deferred, for a block which doesn't go through the pending buffer.
+//
+//  - stack (IN/OUT): The captured call stack.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::internCallStack (capturedstack_t &stack)
+{
+    if (stack.callStack || stack.skipped)
+        return;
+    stack.callStack.reset(g_callStackTable.Intern(
+        CallStack::Create(stack.frames.frames, stack.frames.count, stack.frames.hashValue)));
+}
+
+// recordAlloc - Updates the allocation totals for a block that has been
+//   allocated or resized. The calling thread's own counts are updated, and
+//   only added to the shared totals now and then (see flushAllocTotals).
+//
+//  - oldsize (IN): Previous size, in bytes, of the block or zero for a new
+//      block.
+//
+//  - newsize (IN): Size, in bytes, of the block.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::recordAlloc (SIZE_T oldsize, SIZE_T newsize)
+{
+    tls_t *tls = getTls();
+    tls->bytesDelta += newsize - oldsize;
+    tls->totalDelta += newsize - oldsize;
+    if ((tls->bytesDelta + VLD_BYTES_FLUSH > 2 * VLD_BYTES_FLUSH) || (tls->totalDelta + VLD_BYTES_FLUSH > 2 * VLD_BYTES_FLUSH))
+        flushAllocTotals(tls);
+}
+
+// flushAllocTotals - Adds the bytes a thread has allocated and freed since the
+//   last time to the allocation totals, and moves the peak up if need be. The
+//   totals are shared by every thread, so each thread keeps its own counts
+//   and only adds them in once they have drifted by VLD_BYTES_FLUSH bytes.
+//   The peak is thus only checked as often, and may miss the true peak by up
+//   to VLD_BYTES_FLUSH bytes per thread.
+//
+//  - tls (IN/OUT): The thread's TLS. Only the thread itself, or the thread
+//      retiring it, adds in its counts.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::flushAllocTotals (tls_t *tls)
+{
+    SIZE_T delta = tls->bytesDelta;
+    SIZE_T totaldelta = tls->totalDelta;
+    tls->bytesDelta = 0;
+    tls->totalDelta = 0;
+
+    // Grand total saturates at SIZE_MAX.
+    SIZE_T total = m_totalAlloc;
+    while ((total < SIZE_MAX) && (totaldelta != 0)) {
+        SIZE_T updated;
+        if ((INT_PTR)totaldelta < 0)
+            updated = total + totaldelta;
+        else
+            updated = (SIZE_MAX - total > totaldelta) ? total + totaldelta : SIZE_MAX;
+        SIZE_T prev = (SIZE_T)InterlockedCompareExchangePointer((PVOID*)&m_totalAlloc, (PVOID)updated, (PVOID)total);
+        if (prev == total)
+            break;
+        total = prev;
+    }
+
+    SIZE_T current = (SIZE_T)InterlockedExchangeAddSizeT(&m_curAlloc, delta) + delta;
+    SIZE_T peak = m_maxAlloc;
+    while (current > peak) {
+        SIZE_T prev = (SIZE_T)InterlockedCompareExchangePointer((PVOID*)&m_maxAlloc, (PVOID)current, (PVOID)peak);
+        if (prev == peak)
+            break;
+        peak = prev;
+    }
+    if ((m_peakStep != 0) && (current >= m_nextPeakSnapshot))
+        snapshotPeak(current);
+    if ((m_growthTrigger != 0) && (current >= m_growthCheckpoint + m_growthTrigger))
+        triggerGrowthReport(current);
+}
+
+// readAllocTotals - Obtains the allocation totals, with the counts the threads
+//   haven't added in yet. A thread adding its counts in meanwhile may have
+//   them counted twice, or not at all.
+//
+//  - allocations (OUT): Receives the number of blocks allocated so far. The
+//      serial numbers the threads hold and haven't used yet aren't counted,
+//      but those given up (see serialMark) are.
+//
+//  - current (OUT): Receives the bytes allocated now.
+//
+//  - peak (OUT): Receives the largest number of bytes ever allocated at once.
+//
+//  - total (OUT): Receives the bytes allocated so far, saturating at SIZE_MAX.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::readAllocTotals (SIZE_T &allocations, SIZE_T &current, SIZE_T &peak, SIZE_T &total)
+{
+    allocations = m_requestCurr - 1;
+    current = m_curAlloc;
+    total = m_totalAlloc;
+    SIZE_T totaldelta = 0;
+    {
+        CriticalSectionLocker<> cs(m_tlsLock);
+        for (TlsMap::Iterator tlsit = m_tlsMap->begin(); tlsit != m_tlsMap->end(); ++tlsit) {
+            const tls_t *tls = (*tlsit).second;
+            allocations -= tls->serialEnd - tls->serialNext;
+            current += tls->bytesDelta;
+            totaldelta += tls->totalDelta;
+        }
+    }
+    if (total < SIZE_MAX)
+        total = (((INT_PTR)totaldelta < 0) || (SIZE_MAX - total > totaldelta)) ? total + totaldelta : SIZE_MAX;
+    peak = max(m_maxAlloc, current);
+}
+
+// triggerGrowthReport - Moves the growth checkpoint up to the memory in use,
+//   once it has grown by GrowthTriggerMB since the last checkpoint, and wakes
+//   the growth watchdog to report what grew.
+//
+//  - current (IN): Bytes in use, as just updated by recordAlloc.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::triggerGrowthReport (SIZE_T current)
+{
+    // Whichever thread moves the checkpoint wakes the watchdog.
+    SIZE_T checkpoint = m_growthCheckpoint;
+    if ((current < checkpoint + m_growthTrigger) ||
+        (InterlockedCompareExchangePointer((PVOID*)&m_growthCheckpoint, (PVOID)current, (PVOID)checkpoint) != (PVOID)checkpoint))
+        return;
+    if (m_growthWake != NULL)
+        SetEvent(m_growthWake);
+}
+
+// snapshotPeak - Records how much memory each allocation site holds, once the
+//   memory in use has grown by PeakSnapshotStep bytes since the last snapshot.
+//   The site statistics are read as they are, without stopping the other
+//   threads, so the shares only add up to roughly the bytes in use.
+//
+//  - current (IN): Bytes in use, as just updated by recordAlloc.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::snapshotPeak (SIZE_T current)
+{
+    // Whichever thread moves the threshold takes the snapshot; the others
+    // carry on allocating.
+    SIZE_T next = m_nextPeakSnapshot;
+    if ((current < next) ||
+        (InterlockedCompareExchangePointer((PVOID*)&m_nextPeakSnapshot, (PVOID)(current + m_peakStep), (PVOID)next) != (PVOID)next))
+        return;
+
+    UINT32 capacity = g_callStackTable.Count();
+    CallStack **stacks = new CallStack* [capacity + 1];
+    UINT32 stackCount = g_callStackTable.Collect(stacks, capacity);
+    peaksite_t *sites = new peaksite_t [stackCount + 1];
+    SIZE_T siteCount = 0;
+    for (UINT32 index = 0; index < stackCount; index++) {
+        CallStack *stack = stacks[index];
+        SIZE_T bytes = stack->getLiveBytes();
+        if ((bytes == 0) || ((INT_PTR)bytes < 0)) {
+            // Holds nothing (or has just freed what it held).
+            g_callStackTable.Release(stack);
+            continue;
+        }
+        peaksite_t &site = sites[siteCount++];
+        site.callStack = stack;
+        site.blocks = stack->getLiveBlocks();
+        site.bytes = bytes;
+    }
+    delete [] stacks;
+
+    peaksite_t *oldSites;
+    SIZE_T oldCount;
+    {
+        CriticalSectionLocker<> cs(m_peakLock);
+        oldSites = m_peakSites;
+        oldCount = m_peakSiteCount;
+        m_peakSites = sites;
+        m_peakSiteCount = siteCount;
+        m_peakBytes = current;
+    }
+    releasePeak(oldSites, oldCount);
+}
+
+// releasePeak - Releases the call stacks of a peak snapshot, and frees it.
+//
+//  - sites (IN): The snapshot's allocation sites, or NULL.
+//
+//  - count (IN): Number of allocation sites.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::releasePeak (peaksite_t *sites, SIZE_T count)
+{
+    for (SIZE_T index = 0; index < count; index++)
+        g_callStackTable.Release(sites[index].callStack);
+    delete [] sites;
+}
+
+// recordFree - Updates the allocation totals, and the statistics of its
+//   allocation site, and the leak counters, for a block that has been freed.
+//
+//   A block freed by another thread than the one which allocated it is
+//   counted as a cross-thread free of its site. The frees queued with
+//   RemoteFreeQueue are all cross-thread: a block is only queued when it's
+//   pending in another thread's buffer.
+//
+//  - info (IN): The freed block's information.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::recordFree (const blockinfo_t *info)
+{
+    tls_t *tls = getTls();
+    tls->bytesDelta -= info->size;
+    if (tls->bytesDelta + VLD_BYTES_FLUSH > 2 * VLD_BYTES_FLUSH)
+        flushAllocTotals(tls);
+    if ((m_options & VLD_OPT_SITE_STATISTICS) && info->callStack) {
+        info->callStack->recordLifetime(m_requestCurr - 1 - info->serialNumber);
+        // Thread index 0 is the unknown thread, such as for blocks found by
+        // a heap walk; those count as freed by their own thread.
+        bool crossThread = (tls->flags & VLD_TLS_REMOTEFREES) ||
+            ((info->threadIndex != 0) && (info->threadIndex != tls->threadIndex));
+        info->callStack->recordFreeThread(crossThread);
+    }
+    recordSiteFree(info);
+    uncountBlock(info);
+}
+
+// recordSiteAlloc - Adds a block to the statistics of its allocation site,
+//   when they are kept, once the block has got its call stack.
+//
+//  - info (IN): The block's information.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::recordSiteAlloc (const blockinfo_t *info)
+{
+    if ((m_options & VLD_OPT_SITE_STATISTICS) && info->callStack)
+        info->callStack->recordAlloc(info->size);
+}
+
+// recordSiteResize - Changes the size of a block in the statistics of its
+//   allocation site, when they are kept, as the block is reallocated in
+//   place and keeps its call stack.
+//
+//  - info (IN): The block's information, with its new size.
+//
+//  - oldsize (IN): Size, in bytes, of the block before the reallocation.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::recordSiteResize (const blockinfo_t *info, SIZE_T oldsize)
+{
+    if ((m_options & VLD_OPT_SITE_STATISTICS) && info->callStack)
+        info->callStack->recordResize(oldsize, info->size);
+}
+
+// recordSiteFree - Removes a block from the statistics of its allocation
+//   site, when they are kept, before the block is freed or gets a new call
+//   stack.
+//
+//  - info (IN): The block's information.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::recordSiteFree (const blockinfo_t *info)
+{
+    if ((m_options & VLD_OPT_SITE_STATISTICS) && info->callStack)
+        info->callStack->recordFree(info->size);
+}
+
+// recordSiteRealloc - Adds a reallocation to the statistics of the call
+//   stack which reallocated the block, when they are kept, so that buffers
+//   grown over and over by small increments can be found.
+//
+//  - callStack (IN): The reallocation's call stack, or NULL if it has none.
+//
+//  - oldsize (IN): Size, in bytes, of the block before the reallocation, or 0
+//      if the block wasn't tracked.
+//
+//  - newsize (IN): Size, in bytes, of the block after the reallocation.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::recordSiteRealloc (CallStack *callStack, SIZE_T oldsize, SIZE_T newsize)
+{
+    if ((m_options & VLD_OPT_SITE_STATISTICS) && (callStack != NULL) && (oldsize != 0) && (newsize > oldsize))
+        callStack->recordRealloc(oldsize, newsize);
+}
+
+// nextSampleInterval - Draws the distance to the next sampled allocation.
+//   With SampleBytes, the distance in bytes is exponentially distributed, as
+//   if every allocated byte were independently sampled with a probability of
+//   1/SampleBytes. With SampleRate, the distance in allocations is uniformly
+//   distributed around SampleRate, so that periodic allocation patterns
+//   can't line up with the sampling.
+//
+//  - tls (IN/OUT): The calling thread's TLS, holding its random state.
+//
+//  Return Value:
+//
+//    Returns the number of bytes or allocations until the next sample.
+//
+SIZE_T VisualLeakDetector::nextSampleInterval (tls_t *tls)
+{
+    const capturepolicy_t *policy = m_capturePolicy;
+    // xorshift32: cheap, and good enough to decorrelate the samples.
+    UINT32 x = tls->sampleSeed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    tls->sampleSeed = x;
+
+    if (policy->sampleBytes != 0) {
+        double u = ((double)x + 1.0) / 4294967296.0; // In (0, 1].
+        return (SIZE_T)(-log(u) * (double)policy->sampleBytes) + 1;
+    }
+    return (SIZE_T)(x % (2 * policy->sampleRate - 1)) + 1;
+}
+
+// sampleAllocation - Decides whether an allocation is tracked, by its size
+//   (MinTrackedSize, MaxTrackedSize) and when sampling is enabled. Untracked
+//   allocations skip the stack capture and the block map entirely.
+//
+//  - tls (IN/OUT): The calling thread's TLS, holding its sampling countdown.
+//
+//  - size (IN): Size, in bytes, of the allocation.
+//
+//  Return Value:
+//
+//    Returns true if the allocation should be tracked.
+//
+bool VisualLeakDetector::sampleAllocation (tls_t *tls, SIZE_T size)
+{
+    const capturepolicy_t *policy = m_capturePolicy;
+    if (size < policy->minTrackedSize) {
+        // Small allocations are sampled on their own, by count, and don't
+        // run down the countdown of the others.
+        return (policy->smallSampleRate != 0) && ((tls->smallSampleCount++ % policy->smallSampleRate) == 0);
+    }
+    if ((policy->maxTrackedSize != 0) && (size > policy->maxTrackedSize))
+        return false;
+    if ((policy->sampleRate <= 1) && (policy->sampleBytes == 0))
+        return true;
+
+    if (tls->sampleSeed == 0) {
+        // First allocation on this thread.
+        tls->sampleSeed = ((tls->threadId * 2654435761u) ^ GetTickCount()) | 1;
+        tls->sampleCountdown = nextSampleInterval(tls);
+    }
+
+    SIZE_T step = (policy->sampleBytes != 0) ? size : 1;
+    if (tls->sampleCountdown > step) {
+        tls->sampleCountdown -= step;
+        return false;
+    }
+    // The exponential distribution is memoryless, so a fresh interval can be
+    // drawn without carrying over the bytes past the sample point.
+    tls->sampleCountdown = nextSampleInterval(tls);
+    return true;
+}
+
+// checkMetadataBudget - Checks how much memory VLD's metadata takes against
+//   the MaxMetadataMB budget, and degrades tracking as the budget runs out:
+//   first only sampled allocations are tracked, then no more call stacks are
+//   recorded. Tracking never recovers, so the report can tell which leaks
+//   were tracked how. Called every VLD_BUDGET_CHECK_INTERVAL allocations.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::checkMetadataBudget ()
+{
+    SIZE_T used = GetVldHeapBytes() + g_metadataRegion.Bytes();
+    LONG level = VLD_DEGRADED_NONE;
+    if (used >= m_maxMetadata / 100 * VLD_BUDGET_SIZE_ONLY_PERCENT)
+        level = VLD_DEGRADED_SIZE_ONLY;
+    else if (used >= m_maxMetadata / 100 * VLD_BUDGET_SAMPLING_PERCENT)
+        level = VLD_DEGRADED_SAMPLING;
+
+    for (;;) {
+        LONG current = m_degradation;
+        if (level <= current)
+            return;
+        if (InterlockedCompareExchange(&m_degradation, current + 1, current) != current)
+            continue;
+
+        // This thread moved tracking one step down.
+        m_degradedSerial[current + 1] = m_requestCurr;
+        if (current + 1 == VLD_DEGRADED_SAMPLING) {
+            // publishCapturePolicy samples the policy, and every later one.
+            if ((m_capturePolicy->sampleRate <= 1) && (m_capturePolicy->sampleBytes == 0))
+                publishCapturePolicy(*m_capturePolicy);
+            Report(L"WARNING: Visual Leak Detector: Metadata has reached %Iu bytes of the %Iu MB budget. "
+                L"Only sampled allocations are tracked from now on.\n", used, m_maxMetadata / (1024 * 1024));
+        }
+        else {
+            Report(L"WARNING: Visual Leak Detector: Metadata has reached %Iu bytes of the %Iu MB budget. "
+                L"Call stacks are no longer recorded.\n", used, m_maxMetadata / (1024 * 1024));
+        }
+    }
+}
+
+// reportDegradation - Notes in the report how tracking was degraded to stay
+//   within the metadata budget, if it was.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::reportDegradation ()
+{
+    if (m_degradation >= VLD_DEGRADED_SAMPLING) {
+        Report(L"WARNING: Visual Leak Detector: To stay within MaxMetadataMB, only sampled allocations were tracked "
+            L"from allocation %Iu on.\n", m_degradedSerial[VLD_DEGRADED_SAMPLING]);
+    }
+    if (m_degradation >= VLD_DEGRADED_SIZE_ONLY) {
+        Report(L"WARNING: Visual Leak Detector: To stay within MaxMetadataMB, no call stacks were recorded "
+            L"from allocation %Iu on.\n", m_degradedSerial[VLD_DEGRADED_SIZE_ONLY]);
+    }
+}
+
+// checkCompaction - Compacts the block maps once the program has freed most of
+//   what it had allocated at its peak, so that the storage a burst of
+//   allocations needed is given back. Called every VLD_BUDGET_CHECK_INTERVAL
+//   allocations, before the new block's shard is entered.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::checkCompaction ()
+{
+    // The peak is only sampled here, and a race on it only shifts when the
+    // maps are compacted.
+    SIZE_T current = m_curAlloc;
+    SIZE_T peak = m_compactPeak;
+    if (current > peak) {
+        m_compactPeak = current;
+        return;
+    }
+    if ((peak < VLD_COMPACT_MIN_PEAK) || (current >= peak / VLD_COMPACT_RATIO))
+        return;
+    if (InterlockedExchange(&m_compacting, 1) != 0)
+        return;
+    compactBlockMaps();
+    m_compacting = 0;
+}
+
+// compactBlockMaps - Frees the spare storage of every heap's block map.
+//   Enters the whole heap map lock, since compacting a map moves its entries.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::compactBlockMaps ()
+{
+    CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+    for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
+        noteHeapSizing((*heapit).second);
+        (*heapit).second->blockMap.compact();
+    }
+    m_compactPeak = m_curAlloc;
+}
+
+// Compact - Frees the spare storage of VLD's own containers: the block maps,
+//   the loaded module set and the thread state map. Storage grows with the
+//   number of entries but, until compacted, never shrinks.
+//
+//  Return Value:
+//
+//    Returns the number of bytes given back to VLD's private heap.
+//
+SIZE_T VisualLeakDetector::Compact ()
+{
+    if (m_options & VLD_OPT_VLDOFF)
+        return 0;
+
+    SIZE_T before = GetVldHeapBytes();
+    compactBlockMaps();
+    {
+        CriticalSectionLocker<> cs(m_modulesLock);
+        m_loadedModules->compact();
+    }
+    {
+        CriticalSectionLocker<> cs(m_tlsLock);
+        m_tlsMap->compact();
+    }
+    SIZE_T after = GetVldHeapBytes();
+    return (before > after) ? before - after : 0;
+}
+
+// lockProfile - Obtains the profile a lock counts its acquisitions into.
+//
+//  - lock (IN): The lock, as a VLD_LOCK_* index.
+//
+//  Return Value:
+//
+//    Returns the profile of the lock, or NULL if LockProfiling is off.
+//
+lockprofile_t* VisualLeakDetector::lockProfile (UINT lock)
+{
+    assert(lock < VLD_LOCKS);
+    return m_lockProfiling ? &m_lockProfiles[lock] : NULL;
+}
+
+// profileTicksPerMs - Works out the rate the time stamp counter has run at
+//   since the lock or latency profiles were attached, to convert their ticks
+//   to time.
+//
+//  Return Value:
+//
+//    Returns the number of ticks per millisecond, or 0 if it isn't known.
+//
+double VisualLeakDetector::profileTicksPerMs () const
+{
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    double elapsed = (double)(counter.QuadPart - m_lockProfileCounter) / (double)frequency.QuadPart;
+    return (elapsed > 0.0) ? (double)(__rdtsc() - m_lockProfileTicks) / (elapsed * 1000.0) : 0.0;
+}
+
+// reportLockProfiles - Shows, after the leak summary, how often each of the
+//   main locks was entered and waited for, with the LockProfiling option.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::reportLockProfiles ()
+{
+    static const LPCWSTR names [VLD_LOCKS] = {
+        L"heap map", L"VLD heap", L"modules", L"thread states", L"dbghelp", L"containers"
+    };
+    if (!m_lockProfiling)
+        return;
+
+    double ticksPerMs = profileTicksPerMs();
+    Report(L"Lock profile:\n");
+    for (UINT lock = 0; lock < VLD_LOCKS; lock++) {
+        const lockprofile_t &profile = m_lockProfiles[lock];
+        double waitms = (ticksPerMs > 0.0) ? (double)profile.waitTicks / ticksPerMs : 0.0;
+        Report(L"    %-14s %12lld acquisitions, %10lld contended (%.2f%%), %.1f ms waiting.\n", names[lock],
+            profile.acquisitions, profile.contentions,
+            (profile.acquisitions != 0) ? 100.0 * (double)profile.contentions / (double)profile.acquisitions : 0.0,
+            waitms);
+    }
+}
+
+// recordLatency - Adds a timed call to the calling thread's histogram of the
+//   hook, allocating the histograms on the thread's first timed call.
+//
+//  - tls (IN): The calling thread's thread local storage structure.
+//
+//  - hook (IN): The hook, as a VLD_HOOK_* index.
+//
+//  - ticks (IN): Time stamp counter ticks the call took.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::recordLatency (tls_t *tls, UINT hook, UINT64 ticks)
+{
+    assert(hook < VLD_HOOKS);
+    if (tls->latency == NULL) {
+        latencyhist_t *latency = new latencyhist_t;
+        ZeroMemory(latency, sizeof(latencyhist_t));
+        tls->latency = latency;
+    }
+    DWORD bucket = (ticks > (SIZE_T)-1) ? VLD_LATENCY_BUCKETS - 1 : floorLog2((SIZE_T)ticks);
+    if (bucket >= VLD_LATENCY_BUCKETS)
+        bucket = VLD_LATENCY_BUCKETS - 1;
+    tls->latency->buckets[hook][bucket]++;
+    if (ticks > tls->latency->maxTicks[hook])
+        tls->latency->maxTicks[hook] = ticks;
+}
+
+// latencyPercentile - Finds the bucket a percentile of a latency histogram
+//   falls in.
+//
+//  - latency (IN): The histogram, with its calls counted.
+//
+//  - percent (IN): The percentile.
+//
+//  Return Value:
+//
+//    Returns the upper bound of the bucket, in ticks, but no more than the
+//    longest call.
+//
+static UINT64 latencyPercentile (const VLD_HOOK_LATENCY &latency, UINT percent)
+{
+    if (latency.calls == 0)
+        return 0;
+    UINT64 rank = (latency.calls * percent + 99) / 100;
+    UINT64 seen = 0;
+    for (UINT bucket = 0; bucket < VLD_LATENCY_BUCKETS - 1; bucket++) {
+        seen += latency.buckets[bucket];
+        if (seen >= rank)
+            return min(((UINT64)2 << bucket) - 1, latency.maxTicks);
+    }
+    return latency.maxTicks;
+}
+
+// reportLatencyProfiles - Shows, after the lock profile, the latency
+//   percentiles of each timed hook, with the LatencyProfiling option.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::reportLatencyProfiles ()
+{
+    static const LPCWSTR names [VLD_HOOKS] = {
+        L"alloc", L"free", L"realloc", L"CRT thunks", L"capture"
+    };
+    if (!m_latencyProfiling)
+        return;
+
+    VLD_STATISTICS statistics;
+    GetStatistics(&statistics);
+    double ticksPerUs = profileTicksPerMs() / 1000.0;
+    if (ticksPerUs <= 0.0)
+        ticksPerUs = 1.0;
+
+    Report(L"Hook latency (microseconds):\n");
+    for (UINT hook = 0; hook < VLD_HOOKS; hook++) {
+        const VLD_HOOK_LATENCY &latency = statistics.hooks[hook];
+        if (latency.calls == 0)
+            continue;
+        Report(L"    %-12s %12llu calls, p50 %.2f, p90 %.2f, p99 %.2f, max %.2f.\n", names[hook], latency.calls,
+            (double)latency.p50Ticks / ticksPerUs, (double)latency.p90Ticks / ticksPerUs,
+            (double)latency.p99Ticks / ticksPerUs, (double)latency.maxTicks / ticksPerUs);
+    }
+}
+
+// reportMemoryUsage - Shows, at the end of the report, how much memory VLD
+//   itself took, and what for (see GetMemoryUsage).
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::reportMemoryUsage ()
+{
+    VLD_MEMORY_USAGE usage;
+    GetMemoryUsage(&usage);
+    Report(L"Visual Leak Detector used %Iu KB (%Iu KB committed): blocks %Iu KB + %Iu KB index, call stacks %Iu KB,\n"
+        L"    resolved text %Iu KB, modules %Iu KB, threads %Iu KB, metadata region %Iu KB.\n",
+        usage.privateHeapBytes / 1024, usage.privateHeapCommitted / 1024, usage.blockInfoBytes / 1024,
+        usage.blockIndexBytes / 1024, usage.callStackBytes / 1024, usage.resolvedTextBytes / 1024,
+        usage.moduleTableBytes / 1024, usage.threadStateBytes / 1024, usage.metadataBytes / 1024);
+}
+
+// sampleWeight - Estimates how many allocations each tracked allocation of
+//   the specified size stands for, when sampling.
+//
+//  - size (IN): Size, in bytes, of the tracked allocation.
+//
+//  Return Value:
+//
+//    Returns the inverse of the probability that such an allocation is
+//    sampled, or 1 if sampling is disabled.
+//
+double VisualLeakDetector::sampleWeight (SIZE_T size) const
+{
+    const capturepolicy_t *policy = m_capturePolicy;
+    if ((size < policy->minTrackedSize) && (policy->smallSampleRate > 1))
+        return (double)policy->smallSampleRate;
+    if (policy->sampleBytes != 0) {
+        // An allocation is sampled if any of its bytes is.
+        double probability = 1.0 - exp(-(double)max(size, (SIZE_T)1) / (double)policy->sampleBytes);
+        return 1.0 / probability;
+    }
+    if (policy->sampleRate > 1)
+        return (double)policy->sampleRate;
+    return 1.0;
+}
+
+// reportconfig - Generates a brief report summarizing Visual Leak Detector's
+//   configuration, as loaded from the vld.ini file.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::reportConfig ()
+{
+    const capturepolicy_t *capture = m_capturePolicy;
+    if (m_options & VLD_OPT_AGGREGATE_DUPLICATES) {
+        Report(L"    Aggregating duplicate leaks.\n");
+    }
+    if (m_forcedModuleList[0] != '\0') {
+        Report(L"    Forcing %s of these modules in leak detection: %s\n",
             (m_options & VLD_OPT_MODULE_LIST_INCLUDE) ? L"inclusion" : L"exclusion", m_forcedModuleList);
     }
-    if (m_maxDataDump != VLD_DEFAULT_MAX_DATA_DUMP) {
-        if (m_maxDataDump == 0) {
-            Report(L"    Suppressing data dumps.\n");
+    if (m_ignoredHeapModules[0] != '\0') {
+        Report(L"    Ignoring the heaps created by these modules: %s\n", m_ignoredHeapModules);
+    }
+    if (m_maxDataDump != VLD_DEFAULT_MAX_DATA_DUMP) {
+        if (m_maxDataDump == 0) {
+            Report(L"    Suppressing data dumps.\n");
+        }
+        else {
+            Report(L"    Limiting data dumps to %Iu bytes.\n", m_maxDataDump);
+        }
+    }
+    if (capture->maxTraceFrames != VLD_DEFAULT_MAX_TRACE_FRAMES) {
+        Report(L"    Limiting stack traces to %u frames.\n", capture->maxTraceFrames);
+    }
+    if (capture->adaptiveFrames != 0) {
+        Report(L"    Tracing stacks %u frames deep, and deeper only where they differ further down.\n",
+            capture->adaptiveFrames);
+    }
+    for (UINT32 index = 0; index < m_tracePolicyCount; index++) {
+        const tracepolicy_t &policy = m_tracePolicies[index];
+        Report(L"    Tracing allocations from %s with %s stack walk, up to %u frames.\n", policy.moduleName,
+            walkMethodName(policy.walkMethod), (policy.maxFrames != 0) ? policy.maxFrames : capture->maxTraceFrames);
+    }
+    if (capture->sampleBytes != 0) {
+        Report(L"    Sampling one allocation per %Iu bytes allocated.\n", capture->sampleBytes);
+    }
+    else if (capture->sampleRate > 1) {
+        Report(L"    Sampling one in %u allocations.\n", capture->sampleRate);
+    }
+    if (capture->minTrackedSize != 0) {
+        if (capture->smallSampleRate == 0)
+            Report(L"    Not tracking allocations under %Iu bytes.\n", capture->minTrackedSize);
+        else if (capture->smallSampleRate > 1)
+            Report(L"    Sampling one in %u allocations under %Iu bytes.\n", capture->smallSampleRate, capture->minTrackedSize);
+    }
+    if (capture->maxTrackedSize != 0) {
+        Report(L"    Not tracking allocations over %Iu bytes.\n", capture->maxTrackedSize);
+    }
+    if (m_timeResolution != 0) {
+        Report(L"    Recording allocation times to within %u ms.\n", m_timeResolution);
+    }
+    if (m_options & VLD_OPT_SUMMARY_REPORT) {
+        Report(L"    Reporting the top %u call stacks by leaked %s, and a tally of the others.\n",
+            m_summaryCount, (m_options & VLD_OPT_SUMMARY_BY_COUNT) ? L"blocks" : L"bytes");
+        if (m_summaryGroupBy != VLD_GROUP_BY_STACK) {
+            Report(L"    Rolling up the call stacks by the %s they enter the heap from.\n",
+                (m_summaryGroupBy == VLD_GROUP_BY_MODULE) ? L"module" : L"function");
+        }
+    }
+    if (m_reportThreadCount != 0) {
+        Report(L"    Formatting text reports on %u more threads.\n", m_reportThreadCount);
+        if (m_symbolizer == VLD_SYMBOLIZER_DIA) {
+            Report(L"    Resolving their call stacks with DIA on those threads.\n");
+        }
+    }
+    if (m_reachabilityScan == VLD_REACHABILITY_LABEL) {
+        Report(L"    Labelling each leak as reachable or unreachable.\n");
+    }
+    else if (m_reachabilityScan == VLD_REACHABILITY_UNREACHABLE) {
+        Report(L"    Only reporting the leaks which are unreachable.\n");
+    }
+    if (m_options & VLD_OPT_UNICODE_REPORT) {
+        Report(L"    Generating a Unicode (UTF-16) encoded report.\n");
+    }
+    else if (m_options & VLD_OPT_UTF8_REPORT) {
+        Report(L"    Generating a UTF-8 encoded report.\n");
+    }
+    if (m_options & VLD_OPT_REPORT_TO_FILE) {
+        if (m_options & VLD_OPT_REPORT_TO_DEBUGGER) {
+            Report(L"    Outputting the report to the debugger and to %s\n", m_reportFilePath);
+        }
+        else {
+            Report(L"    Outputting the report to %s\n", m_reportFilePath);
+        }
+    }
+    if (m_options & VLD_OPT_REPORT_TO_BINARY) {
+        Report(L"    Writing the leaks, unsymbolized, to the binary report %s\n", m_reportFilePath);
+    }
+    if (m_options & (VLD_OPT_REPORT_JSON | VLD_OPT_REPORT_CSV)) {
+        LPCWSTR format = (m_options & VLD_OPT_REPORT_JSON) ? L"JSON" : L"CSV";
+        if ((m_options & VLD_OPT_REPORT_FOLDED) == VLD_OPT_REPORT_FOLDED)
+            format = L"folded stacks";
+        Report(L"    Writing the leak report as %s to %s\n", format, m_reportFilePath);
+    }
+    if (m_options & VLD_OPT_SITE_STATISTICS) {
+        Report(L"    Keeping allocation statistics for every call stack.\n");
+    }
+    if (m_sizeClasses) {
+        Report(L"    Counting the blocks of every heap by size class.\n");
+    }
+    if (m_addressIndex) {
+        Report(L"    Keeping the blocks of every heap in address order.\n");
+    }
+    if (m_deferHeapReports) {
+        Report(L"    Reporting the leaks of destroyed heaps at the next leak report.\n");
+    }
+    if (m_lockProfiling) {
+        Report(L"    Counting the acquisitions and contention of the main locks.\n");
+    }
+    if (m_latencyProfiling) {
+        Report(L"    Timing the heap hooks.\n");
+    }
+    if (m_threadExitTimeout != VLD_DEFAULT_THREAD_EXIT_TIMEOUT) {
+        Report(L"    Waiting up to %u seconds for the running threads to exit at shutdown.\n", m_threadExitTimeout);
+    }
+    if (m_peakStep != 0) {
+        Report(L"    Taking a snapshot of the allocation sites whenever the peak grows by %Iu bytes.\n", m_peakStep);
+    }
+    if (m_growthThread != NULL) {
+        Report(L"    Reporting the growth since the last report whenever the memory in use grows by %Iu MB.\n",
+            m_growthTrigger / (1024 * 1024));
+    }
+    if (m_hotModuleThread != NULL) {
+        Report(L"    Excluding the modules which allocate %u times a second or more without leaking, after %u ms.\n",
+            m_hotModuleRate, m_hotModuleWarmup);
+    }
+    if (m_iniWatchThread != NULL) {
+        Report(L"    Reloading the capture options whenever %s changes.\n", m_iniFilePath);
+    }
+    if (m_options & VLD_OPT_DEFER_STACK_CAPTURE) {
+        Report(L"    Creating call stacks only for blocks that outlive the pending buffer.\n");
+    }
+    if (m_options & VLD_OPT_CONTEXT_TREE) {
+        Report(L"    Storing call stacks in a calling context tree.\n");
+    }
+    if (m_packStacks) {
+        Report(L"    Storing call stacks as varint deltas.\n");
+    }
+    if (m_reallocStackPolicy == VLD_REALLOC_STACK_LATEST) {
+        Report(L"    Giving blocks reallocated in place the call stack of the reallocation.\n");
+    }
+    else if (m_reallocStackPolicy == VLD_REALLOC_STACK_BOTH) {
+        Report(L"    Counting in-place reallocations at their own call stacks.\n");
+    }
+    if (m_virtualRegions != NULL) {
+        Report(L"    Tracking reserved virtual memory regions and mapped views.\n");
+    }
+    if (m_liveView != NULL) {
+        Report(L"    Publishing a live view to %s every %u ms.\n", m_liveViewName, m_liveViewInterval);
+    }
+    if (m_perfInstance != NULL) {
+        Report(L"    Updating the performance counters every %u ms.\n", m_perfCounterInterval);
+    }
+    if (m_telemetryFile != NULL) {
+        Report(L"    Writing memory telemetry to %s every %u ms.\n", m_telemetryFilePath, m_telemetryInterval);
+    }
+    if (m_allocTraceFile != INVALID_HANDLE_VALUE) {
+        Report(L"    Recording allocation events to %s.\n", m_allocTraceFilePath);
+    }
+    if (m_crashFile != INVALID_HANDLE_VALUE) {
+        Report(L"    Writing a heap snapshot to %s if the process crashes.\n", m_crashSnapshotPath);
+    }
+    if (m_prefetchThread != NULL) {
+        Report(L"    Loading the symbols of modules in the background as they are loaded.\n");
+    }
+    if (m_idleResolveThread != NULL) {
+        Report(L"    Resolving the call stacks of long-lived blocks in the background every %u ms.\n",
+            m_idleResolveInterval);
+    }
+    if (m_maxMetadata != 0) {
+        Report(L"    Degrading tracking to keep metadata within %Iu MB.\n", m_maxMetadata / (1024 * 1024));
+    }
+    if (g_metadataRegion.IsMapped()) {
+        Report(L"    Keeping metadata in a view of %s.\n", m_metadataFilePath);
+    }
+    else if (m_metadataFilePath[0] != '\0') {
+        Report(L"    The metadata file %s couldn't be mapped; keeping metadata in memory.\n", m_metadataFilePath);
+    }
+    if (g_metadataRegion.UsesLargePages()) {
+        Report(L"    Allocating metadata from large pages.\n");
+    }
+    else if (m_options & VLD_OPT_LARGE_PAGES) {
+        Report(L"    Large pages are unavailable; allocating metadata from normal pages.\n");
+    }
+    if (g_symbolStore.IsOpen()) {
+        Report(L"    Caching resolved symbols in %s.\n", m_symbolStorePath);
+    }
+    if (g_importPlans.IsOpen()) {
+        Report(L"    Caching import patch plans in %s.\n", m_patchPlanCachePath);
+    }
+    if (m_sizingProfilePath[0] != L'\0') {
+        Report(L"    Sizing containers from, and recording their sizes to, %s.\n", m_sizingProfilePath);
+    }
+    if (m_symbolLevel == VLD_SYMBOLS_NONE) {
+        Report(L"    Not resolving call stack frames; they show their addresses.\n");
+    }
+    else if (m_symbolLevel == VLD_SYMBOLS_MODULE) {
+        Report(L"    Resolving call stack frames to their module and offset only.\n");
+    }
+    else if (m_symbolLevel == VLD_SYMBOLS_FUNCTION) {
+        Report(L"    Resolving call stack frames to their function, without source lines.\n");
+    }
+    if (m_symbolServerTimeout != 0) {
+        Report(L"    Fetching symbols in the background when loading them takes over %u ms.\n", m_symbolServerTimeout);
+    }
+    if (m_symbolCacheDir[0] != L'\0') {
+        Report(L"    Storing the symbols downloaded from symbol servers in %s.\n", m_symbolCacheDir);
+    }
+    if (m_suppressionCount != 0) {
+        Report(L"    Suppressing the leaks matching the %u rules of %s.\n", m_suppressionCount, m_suppressionFilePath);
+    }
+    if (m_baselineSites != NULL) {
+        Report(L"    Only reporting the leak sites which grew by more than %u bytes since the baseline %s.\n",
+            m_baselineThreshold, m_baselineFilePath);
+    }
+    else if (m_baselineFilePath[0] != L'\0') {
+        Report(L"    Writing a baseline of the leaks to %s at exit.\n", m_baselineFilePath);
+    }
+    if (m_heapWalkTracking) {
+        Report(L"    Finding the heap blocks by walking the heaps; nothing is hooked, and leaks have no call stacks.\n");
+    }
+    if (!m_fastExit) {
+        Report(L"    Freeing every piece of metadata at exit, even when the process is exiting.\n");
+    }
+    if (m_remoteFreeQueue) {
+        Report(L"    Queueing the frees of blocks pending in other threads' buffers, and draining them in batches.\n");
+    }
+    if (m_recentFreeRing) {
+        Report(L"    Remembering each thread's last %u frees, to attribute double frees.\n", VLD_RECENT_FREES);
+    }
+    if ((m_options & VLD_OPT_VALIDATE_HEAPFREE) && (m_validateHeapFreeRate > 1)) {
+        Report(L"    Validating 1 in %u frees of blocks missing from the heap they're freed to.\n", m_validateHeapFreeRate);
+    }
+    if (g_etwSession.IsActive()) {
+        Report(L"    Tracking heap blocks from the heap ETW provider's events; no imports are patched.\n");
+    }
+    else if (m_options & VLD_OPT_ETW_HEAP_TRACKING) {
+        Report(L"    The heap ETW session couldn't be started (error=%lu); the imports are patched instead.\n",
+            g_etwSession.LastError());
+    }
+    if (m_heapHooks[0].IsInstalled()) {
+        Report(L"    Hooking the ntdll heap functions themselves.\n");
+    }
+    else if (m_options & VLD_OPT_INLINE_HEAP_HOOKS) {
+        Report(L"    The ntdll heap functions couldn't be hooked; only their imports are patched.\n");
+    }
+    if (m_options & VLD_OPT_SLOW_DEBUGGER_DUMP) {
+        Report(L"    Outputting the report to the debugger at a slower rate.\n");
+    }
+    if (capture->walkMethod == VLD_OPT_NO_STACK_WALK) {
+        Report(L"    Not capturing call stacks; leaks are told apart by their allocation tags.\n");
+    }
+    else if (capture->walkMethod == VLD_OPT_CALLER_STACK_WALK) {
+        Report(L"    Recording only the caller of each allocating function.\n");
+    }
+    else if (capture->walkMethod == VLD_OPT_NTDB_STACK_WALK) {
+        Report(L"    Reading the call stacks of leaks from the NT stack trace database when they are reported.\n");
+    }
+    else if (capture->walkMethod == VLD_OPT_SAFE_STACK_WALK) {
+        Report(L"    Using the \"safe\" (but slow) stack walking method.\n");
+    }
+    else if (capture->walkMethod == VLD_OPT_SHADOW_STACK_WALK) {
+#if defined(_M_X64)
+        if (_rdsspq() != 0)
+            Report(L"    Using the \"shadow\" stack walking method.\n");
+        else
+            Report(L"    The process has no CET shadow stack; using the \"fast\" stack walking method.\n");
+#else
+        Report(L"    The \"shadow\" stack walking method is only available on x64; using \"fast\".\n");
+#endif
+    }
+    else if (capture->walkMethod == VLD_OPT_UNWIND_STACK_WALK) {
+#if defined(_M_X64) || defined(_M_ARM64)
+        Report(L"    Using the \"unwind\" stack walking method.\n");
+#else
+        Report(L"    The \"unwind\" stack walking method is only available on x64 and ARM64; using \"fast\".\n");
+#endif
+    }
+    else if (capture->walkMethod == VLD_OPT_FRAME_STACK_WALK) {
+#if defined(_M_IX86) || defined(_M_ARM64)
+        Report(L"    Using the \"frame\" stack walking method.\n");
+#else
+        Report(L"    The \"frame\" stack walking method is only available on x86 and ARM64; using \"fast\".\n");
+#endif
+    }
+    if (m_options & VLD_OPT_SELF_TEST) {
+        Report(L"    Performing a memory leak self-test.\n");
+    }
+    if (m_options & VLD_OPT_START_DISABLED) {
+        Report(L"    Starting with memory leak detection disabled.\n");
+    }
+    if (m_options & VLD_OPT_TRACE_INTERNAL_FRAMES) {
+        Report(L"    Including heap and VLD internal frames in stack traces.\n");
+    }
+}
+
+// isCrtHeader - Determines whether a block looks like it starts with a CRT
+//   debug header of the given layout: the header's size must account for the
+//   rest of the block, and its use type must be valid.
+//
+//  - block (IN): Address of the block.
+//
+//  - size (IN): Size of the block, as allocated from the heap.
+//
+//  Return Value:
+//
+//    Returns true if the block has a Header.
+//
+template <typename Header>
+static bool isCrtHeader (LPCVOID block, SIZE_T size)
+{
+    if (size < sizeof(Header) + GAPSIZE)
+        return false;
+    const Header* crtheader = (const Header*)block;
+    SIZE_T nSize = sizeof(Header) + crtheader->size + GAPSIZE;
+    return (nSize == size) && _BLOCK_TYPE_IS_VALID(crtheader->use) &&
+        _CrtIsValidPointer(block, (unsigned int)size, TRUE);
+}
+
+// isDebugCrtAlloc - Determines whether a block starts with a CRT debug header.
+//   Blocks allocated from a statically linked CRT aren't tagged when they are
+//   captured, so their header is autodetected here the first time, and the
+//   result is recorded in the block's information.
+//
+//   Note: A block which is probed right after it was allocated, before the CRT
+//     wrote its header, is taken to have none.
+//
+//  - block (IN): Address of the block.
+//
+//  - info (IN/OUT): The block's information.
+//
+//  Return Value:
+//
+//    Returns true if the block starts with a CRT debug header.
+//
+bool VisualLeakDetector::isDebugCrtAlloc( LPCVOID block, blockinfo_t* info )
+{
+    if (info->crtHeader == crtheader_unknown) {
+        if (isCrtHeader<crtdbgblockheader_t>(block, info->size))
+            info->crtHeader = crtheader_msvcrt;
+        else if (isCrtHeader<crtdbgblockheaderucrt_t>(block, info->size))
+            info->crtHeader = crtheader_ucrt;
+        else
+            info->crtHeader = crtheader_none;
+    }
+
+    return (info->crtHeader != crtheader_none);
+}
+
+// countBlock - Adds a block which has just been mapped, or remapped, to the
+//   leak counters, so that the leak counts can be returned without walking
+//   the blocks. Blocks used internally by the CRT aren't counted; the CRT
+//   frees them after VLD is destroyed. Whether a block was allocated by CRT
+//   startup code can only be told by resolving its call stack's symbols, so
+//   unless its call stack is already known not to be, the block is also
+//   counted as unclassified, for classifyLeaks to check later on.
+//
+//   Note: The caller must hold the block's g_heapMapLock shard. The block's
+//     CRT block type is read once, here.
+//
+//  - block (IN): Address of the block.
+//
+//  - info (IN/OUT): The block's information.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::countBlock (LPCVOID block, blockinfo_t* info)
+{
+    info->counted = false;
+    info->unclassified = false;
+    if (isReported(info)) {
+        // Allocated before the leaks were last marked as reported, but only
+        // mapped now.
+        return;
+    }
+    if (isDebugCrtAlloc(block, info)) {
+        // This block is allocated to a CRT heap, so the block has a CRT
+        // memory block header pretended to it.
+        int blockUse = getCrtBlockUse(block, info);
+        // Leaks identified as CRT_USE_IGNORE should not be ignored here otherwise
+        // DynamicLoader/Thread test will randomly fail with less leaks being reported.
+        if (CRT_USE_TYPE(blockUse) == CRT_USE_FREE ||
+            CRT_USE_TYPE(blockUse) == CRT_USE_INTERNAL) {
+            // This block is marked as being used internally by the CRT.
+            // The CRT will free the block after VLD is destroyed.
+            return;
+        }
+    }
+
+    info->counted = true;
+    InterlockedIncrementSizeT(&m_leakCount);
+    InterlockedIncrement(&getThreadLeaks(info->threadIndex).count);
+    if (info->image != MODULEIMAGE_NONE)
+        InterlockedIncrement(&getModuleCounters(info->image).leaks);
+    if (info->callStack && !info->callStack->isNotCrtStartupAlloc()) {
+        info->unclassified = true;
+        InterlockedIncrement(&m_unclassifiedLeaks);
+    }
+}
+
+// uncountBlock - Removes a block from the leak counters, if it's counted,
+//   before it's freed, reported or remapped. Blocks below a reported mark
+//   were taken off the counters when the mark was set: all of them for the
+//   global mark, all but the unclassified and module counts for a thread's
+//   mark. The caller must hold the block's g_heapMapLock shard.
+//
+//  - info (IN): The block's information.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::uncountBlock (const blockinfo_t* info)
+{
+    if (!info->counted || (info->serialNumber < m_reportedMark))
+        return;
+    if (info->unclassified)
+        InterlockedDecrement(&m_unclassifiedLeaks);
+    if (info->image != MODULEIMAGE_NONE)
+        InterlockedDecrement(&getModuleCounters(info->image).leaks);
+    threadleaks_t &leaks = getThreadLeaks(info->threadIndex);
+    if (info->serialNumber < leaks.reportedMark)
+        return;
+    InterlockedDecrementSizeT(&m_leakCount);
+    InterlockedDecrement(&leaks.count);
+}
+
+// markReported - Marks a block as reported, so that it is no longer counted
+//   nor reported as a leak. The caller must hold the block's g_heapMapLock
+//   shard.
+//
+//  - info (IN/OUT): The block's information.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::markReported (blockinfo_t* info)
+{
+    if (info->reported)
+        return;
+    uncountBlock(info);
+    info->counted = false;
+    info->unclassified = false;
+    info->reported = true;
+}
+
+// classifyLeaks - Resolves the call stacks of the unclassified blocks, and
+//   marks the ones allocated by CRT startup code as reported. The heap map is
+//   walked a shard at a time, and only until no unclassified block is left.
+//   Once a call stack is known not to be CRT startup code, its later blocks
+//   are counted as classified right away, so this is only needed when new
+//   call stacks show up.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::classifyLeaks ()
+{
+    for (UINT shard = 0; (shard < BLOCKMAPSHARDS) && (m_unclassifiedLeaks > 0); shard++) {
+        CriticalSectionLocker<> cs(g_heapMapLock.ShardAt(shard));
+        for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
+            for (blockinfo_t *info = (*heapit).second->newest[shard]; info != NULL; info = info->older) {
+                if (!info->unclassified)
+                    continue;
+                if (info->serialNumber < m_reportedMark) {
+                    // Already taken off the unclassified count (see uncountBlock).
+                    info->unclassified = false;
+                }
+                else if (isReported(info) || (info->callStack && info->callStack->isCrtStartupAlloc())) {
+                    markReported(info);
+                }
+                else {
+                    info->unclassified = false;
+                    InterlockedDecrement(&m_unclassifiedLeaks);
+                }
+            }
+        }
+    }
+}
+
+// isSuppressed - Checks whether a leaked block matches a rule of the
+//   SuppressionFile. Only the block's leak hash and the frames of its call
+//   stack as they were captured are looked at, so nothing is resolved.
+//
+//  - info (IN): The block's information.
+//
+//  Return Value:
+//
+//    Returns true if the block is to be left out of the report.
+//
+bool VisualLeakDetector::isSuppressed (const blockinfo_t* info) const
+{
+    if (g_suppressions.IsEmpty())
+        return false;
+
+    DWORD leakHash = 0;
+    if (info->callStack)
+        leakHash = CalculateCRC32(info->size, info->callStack->getHashValue());
+    return g_suppressions.IsSuppressed(leakHash, info->callStack.get());
+}
+
+// reportleaks - Generates a memory leak report for the specified heap.
+//
+//  - heap (IN): Handle to the heap for which to generate a memory leak
+//      report.
+//
+//  Return Value:
+//
+//    None.
+//
+SIZE_T VisualLeakDetector::reportHeapLeaks (HANDLE heap)
+{
+    assert(heap != NULL);
+
+    // Find the heap's information (blockmap, etc).
+    CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+    HeapMap::Iterator heapit = m_heapMap->find(heap);
+    if (heapit == m_heapMap->end()) {
+        // Nothing is allocated from this heap. No leaks.
+        return 0;
+    }
+
+    DuplicateIndex duplicates;
+    heapinfo_t* heapinfo = (*heapit).second;
+    m_reportStats.reports++;
+    // Generate a memory leak report for heap.
+    bool firstLeak = true;
+    SIZE_T leaks_count = reportLeaks(heapinfo, firstLeak, duplicates);
+
+    // Show a summary.
+    if (leaks_count != 0) {
+        Report(L"Visual Leak Detector detected %Iu memory leak%s in heap " ADDRESSFORMAT L"\n",
+            leaks_count, (leaks_count > 1) ? L"s" : L"", heap);
+     }
+    return leaks_count;
+}
+
+// CrtHeader - Selects the CRT debug header layout of a crtheader_e kind at
+//   compile time.
+template <crtheader_e Kind> struct CrtHeader;
+template <> struct CrtHeader<crtheader_msvcrt> { typedef crtdbgblockheader_t header_t; };
+template <> struct CrtHeader<crtheader_ucrt>   { typedef crtdbgblockheaderucrt_t header_t; };
+
+// crtHeader - Obtains the CRT debug header of a block known to start with a
+//   header of the given kind.
+template <crtheader_e Kind>
+static __forceinline const typename CrtHeader<Kind>::header_t* crtHeader (LPCVOID block)
+{
+    return (const typename CrtHeader<Kind>::header_t*)block;
+}
+
+// The getCrtBlock* accessors - Read a field of a block's CRT debug header.
+//   isDebugCrtAlloc must have returned true for the block.
+int VisualLeakDetector::getCrtBlockUse(LPCVOID block, const blockinfo_t* info)
+{
+    assert((info->crtHeader == crtheader_msvcrt) || (info->crtHeader == crtheader_ucrt));
+    if (info->crtHeader == crtheader_ucrt)
+        return crtHeader<crtheader_ucrt>(block)->use;
+    return crtHeader<crtheader_msvcrt>(block)->use;
+}
+
+size_t VisualLeakDetector::getCrtBlockSize(LPCVOID block, const blockinfo_t* info)
+{
+    assert((info->crtHeader == crtheader_msvcrt) || (info->crtHeader == crtheader_ucrt));
+    if (info->crtHeader == crtheader_ucrt)
+        return crtHeader<crtheader_ucrt>(block)->size;
+    return crtHeader<crtheader_msvcrt>(block)->size;
+}
+
+long VisualLeakDetector::getCrtBlockRequest(LPCVOID block, const blockinfo_t* info)
+{
+    assert((info->crtHeader == crtheader_msvcrt) || (info->crtHeader == crtheader_ucrt));
+    if (info->crtHeader == crtheader_ucrt)
+        return crtHeader<crtheader_ucrt>(block)->request;
+    return crtHeader<crtheader_msvcrt>(block)->request;
+}
+
+SIZE_T VisualLeakDetector::reportLeaks (heapinfo_t* heapinfo, bool &firstLeak, DuplicateIndex &duplicates, DWORD threadId, SIZE_T limit, LeakSink *sink)
+{
+    BlockMap* blockmap   = &heapinfo->blockMap;
+    SIZE_T leaksFound = 0;
+    TickCounter reportTicks(m_reportStats.reportTicks);
+
+    if ((m_options & VLD_OPT_AGGREGATE_DUPLICATES) && !duplicates.IsBuilt()) {
+        // Group the blocks of all heaps once, up front, instead of searching
+        // every heap for the duplicates of each leak.
+        TickCounter ticks(m_reportStats.aggregationTicks);
+        duplicates.Build(m_heapMap, m_reportBefore);
+    }
+
+    for (BlockMap::Iterator blockit = blockmap->begin(); (blockit != blockmap->end()) && (leaksFound < limit); ++blockit)
+    {
+        // Found a block which is still in the BlockMap. We've identified a
+        // potential memory leak.
+        LPCVOID block = (*blockit).first;
+        blockinfo_t* info = (*blockit).second;
+        if (isReported(info) || (info->serialNumber >= m_reportBefore))
+            continue;
+
+        if (threadId != ((DWORD)-1) && getThreadId(info) != threadId)
+            continue;
+
+        dupgroup_t* duplicate = NULL;
+        if (m_options & VLD_OPT_AGGREGATE_DUPLICATES) {
+            TickCounter ticks(m_reportStats.aggregationTicks);
+            duplicate = duplicates.Find(info);
+            if ((duplicate != NULL) && duplicate->reported)
+                continue;
+        }
+
+        LPCVOID address = block;
+        SIZE_T size = info->size;
+
+        if (isDebugCrtAlloc( block, info )) {
+            // This block is allocated to a CRT heap, so the block has a CRT
+            // memory block header pretended to it.
+            int blockUse = getCrtBlockUse(block, info);
+            // Leaks identified as CRT_USE_IGNORE should not be ignored here otherwise
+            // DynamicLoader/Thread test will randomly fail with less leaks being reported.
+            if (CRT_USE_TYPE(blockUse) == CRT_USE_FREE ||
+                CRT_USE_TYPE(blockUse) == CRT_USE_INTERNAL)
+            {
+                // This block is marked as being used internally by the CRT.
+                // The CRT will free the block after VLD is destroyed.
+                continue;
+            }
+
+            // The CRT header is more or less transparent to the user, so
+            // the information about the contained block will probably be
+            // more useful to the user. Accordingly, that's the information
+            // we'll include in the report.
+            address = CRTDBGBLOCKDATA(block);
+            size = getCrtBlockSize(block, info);
+        }
+
+        if (isSuppressed(info)) {
+            markReported(info);
+            continue;
+        }
+
+        if (m_options & VLD_OPT_SKIP_CRTSTARTUP_LEAKS) {
+            // Check for crt startup allocations
+            if (info->callStack && info->callStack->isCrtStartupAlloc()) {
+                markReported(info);
+                continue;
+            }
+        }
+
+        // It looks like a real memory leak.
+        leakentry_t leak;
+        leak.serialNumber = info->serialNumber;
+        leak.address = address;
+        leak.size = size;
+        leak.blockSize = info->size;
+        leak.crtRequest = -1;
+#ifdef _DEBUG
+        if (info->crtHeader != crtheader_none)
+        {
+            leak.crtRequest = getCrtBlockRequest(block, info);
+            assert(size == getCrtBlockSize(block, info));
+        }
+#endif
+        leak.callStack = info->callStack.get();
+        leak.threadId = getThreadId(info);
+        leak.threadIndex = info->threadIndex;
+        leak.tag = info->tag;
+        leak.count = 1;
+        if (duplicate != NULL) {
+            // Aggregate all other leaks which are duplicates of this one
+            // under this same heading, to cut down on clutter.
+            leak.count = duplicate->count;
+            duplicate->reported = true;
+        }
+        leak.estimate = 0;
+        if (sampling()) {
+            // Scale the sampled blocks up to the number of blocks they stand for.
+            leak.estimate = sampleWeight(info->size) * leak.count;
+            m_estimatedLeakBytes += (SIZE_T)(leak.estimate * size);
+        }
+        leak.data = address;
+        leak.dataSize = (m_maxDataDump < size) ? m_maxDataDump : size;
+        leak.reachability = (BYTE)reachabilityOf(address);
+        leaksFound += leak.count;
+
+        if (sink != NULL) {
+            // Leave the formatting to the sink.
+            sink->Leak(leak);
+            continue;
+        }
+        printLeak(leak, firstLeak, m_reportStats);
+    }
+
+    return leaksFound;
+}
+
+// printLeak - Prints the entry of a leak found by reportLeaks to the text
+//   report.
+//
+//  - leak (IN): The leak.
+//
+//  - firstLeak (IN/OUT): Set if no leak has been printed yet, in which case
+//      the warning heading the list of leaks is printed first, and cleared.
+//
+//  - stats (IN/OUT): Receives the time spent dumping call stacks and data.
+//      The report threads keep their own, so as not to race with each other.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::printLeak (const leakentry_t &leak, bool &firstLeak, reportstats_t &stats)
+{
+    if (firstLeak) { // A confusing way to only display this message once
+        Report(L"WARNING: Visual Leak Detector detected memory leaks!\n");
+        firstLeak = false;
+    }
+    FormatReport(L"---------- Block {} at " ADDRESSCPPFORMAT L": {} bytes ----------\n", leak.serialNumber,
+        (UINT_PTR)leak.address, leak.size);
+    if (leak.crtRequest != -1)
+        FormatReport(L"  CRT Alloc ID: {}\n", leak.crtRequest);
+
+    DWORD callstackCRC = 0;
+    if (leak.callStack)
+        callstackCRC = CalculateCRC32(leak.blockSize, leak.callStack->getHashValue());
+    FormatReport(L"  Leak Hash: 0x{:08X}, Count: {}, Total {} bytes\n", callstackCRC, leak.count, leak.size * leak.count);
+    if (sampling())
+        FormatReport(L"  Sampled, estimated Count: {:.0f}, Total {:.0f} bytes\n", leak.estimate, leak.estimate * leak.size);
+    if (leak.tag != 0)
+        FormatReport(L"  Tag: {}\n", m_tagNames[leak.tag]);
+    if (leak.reachability != reachability_unknown)
+        FormatReport(L"  Reachability: {}\n", (leak.reachability == reachability_reachable) ? L"reachable" : L"unreachable");
+
+    // Dump the call stack.
+    if ((leak.count == 1) && (getThreadName(leak.threadIndex) != NULL))
+        FormatReport(L"  Call Stack (TID {}, \"{}\"):\n", leak.threadId, getThreadName(leak.threadIndex));
+    else if (leak.count == 1)
+        FormatReport(L"  Call Stack (TID {}):\n", leak.threadId);
+    else
+        FormatReport(L"  Call Stack:\n");
+    if (leak.callStack) {
+        TickCounter ticks(stats.stackDumpTicks);
+        leak.callStack->dump(m_options & VLD_OPT_TRACE_INTERNAL_FRAMES);
+    }
+
+    // Dump the data in the user data section of the memory block.
+    if (m_maxDataDump != 0) {
+        TickCounter ticks(stats.dataDumpTicks);
+        FormatReport(L"  Data:\n");
+        if (m_options & VLD_OPT_UNICODE_REPORT) {
+            DumpMemoryW(leak.data, leak.dataSize);
+        }
+        else {
+            DumpMemoryA(leak.data, leak.dataSize);
+        }
+    }
+    FormatReport(L"\n\n");
+}
+
+// Summary reports count the leaked blocks allocated from the same call stack
+// together in one of these. Blocks without call stacks (StackWalkMethod =
+// none) are counted by their allocation tag instead. With SummaryGroupBy, the
+// sites whose call stacks enter the heap through the same function or module
+// are then rolled up into one (see rollUpSites).
+struct leaksite_t {
+    ~leaksite_t () { delete [] name; }
+
+    CallStack *callStack;      // The call stack shared by the blocks, or NULL. Once rolled up, the one which leaked the most.
+    UINT32     tag;            // The allocation tag shared by the blocks, if they have no call stack.
+    SIZE_T     count;          // Number of leaked blocks.
+    SIZE_T     total;          // Total size of those blocks, in bytes.
+    double     estimatedCount; // Number of blocks they stand for, when sampling.
+    double     estimatedTotal; // Total size of the blocks they stand for, when sampling.
+    SIZE_T     stacks;         // Number of call stacks rolled up into the site.
+    SIZE_T     stackTotal;     // Bytes leaked from "callStack" alone, once rolled up.
+    LPWSTR     name;           // The function or module the site was rolled up by, or NULL.
+};
+
+// rollUpSites - Rolls up the leak sites of a summary report whose call stacks
+//   enter the heap through the same function or, with VLD_GROUP_BY_MODULE,
+//   from the same module: the innermost frame of each call stack which isn't
+//   internal (see CallStack::userFrame). Only the frames up to that one are
+//   looked up, and only one call stack per rolled-up site is dumped, so the
+//   symbols resolved scale with the number of functions rather than with the
+//   number of call stacks. Sites without a call stack, or without a frame of
+//   the program's own, are left alone.
+//
+//  - sites (IN/OUT): The sites. The ones rolled up into another are deleted,
+//      and the others moved to the front.
+//
+//  - count (IN): Number of sites.
+//
+//  - groupBy (IN): VLD_GROUP_BY_FUNCTION or VLD_GROUP_BY_MODULE.
+//
+//  Return Value:
+//
+//    Returns the number of sites left.
+//
+static size_t rollUpSites (leaksite_t **sites, size_t count, UINT32 groupBy)
+{
+    HashMap<UINT_PTR, leaksite_t*> groups;
+    size_t groupCount = 0;
+    CriticalSectionLocker<DbgHelp> locker(g_DbgHelp);
+    for (size_t index = 0; index < count; index++) {
+        leaksite_t *site = sites[index];
+        UINT32 frame;
+        if ((site->callStack == NULL) || !site->callStack->userFrame(frame, locker)) {
+            sites[groupCount++] = site;
+            continue;
+        }
+
+        // Functions are told apart by their start address, modules by their
+        // image. Frames outside of every known module are still rolled up by
+        // function.
+        SIZE_T programCounter = site->callStack->symbolAddress(frame, locker);
+        const symbolinfo_t *symbol = g_symbolCache.Lookup(programCounter, locker);
+        UINT_PTR key = (UINT_PTR)(programCounter - (SIZE_T)symbol->displacement);
+        LPCWSTR name = symbol->functionName;
+        LPCWSTR path;
+        UINT32 rva;
+        if ((groupBy == VLD_GROUP_BY_MODULE) && site->callStack->frameLocation(frame, path, rva)) {
+            key = (UINT_PTR)path;
+            name = wcsrchr(path, L'\\');
+            name = (name != NULL) ? name + 1 : path;
+        }
+
+        HashMap<UINT_PTR, leaksite_t*>::Iterator groupit = groups.find(key);
+        if (groupit == groups.end()) {
+            size_t length = wcslen(name) + 1;
+            site->name = new WCHAR [length];
+            wcscpy_s(site->name, length, name);
+            site->stackTotal = site->total;
+            groups.insert(key, site);
+            sites[groupCount++] = site;
+            continue;
+        }
+        leaksite_t *group = (*groupit).second;
+        group->count += site->count;
+        group->total += site->total;
+        group->estimatedCount += site->estimatedCount;
+        group->estimatedTotal += site->estimatedTotal;
+        group->stacks += site->stacks;
+        if (site->total > group->stackTotal) {
+            group->callStack = site->callStack;
+            group->stackTotal = site->total;
+        }
+        delete site;
+    }
+    return groupCount;
+}
+
+// compareSiteBytes - qsort callback ordering leak sites by decreasing total
+//   size, then by decreasing number of blocks.
+static int __cdecl compareSiteBytes (const void *first, const void *second)
+{
+    const leaksite_t *a = *(const leaksite_t* const*)first;
+    const leaksite_t *b = *(const leaksite_t* const*)second;
+    if (a->total != b->total)
+        return (a->total > b->total) ? -1 : 1;
+    return (a->count > b->count) ? -1 : (a->count < b->count) ? 1 : 0;
+}
+
+// compareSiteCount - qsort callback ordering leak sites by decreasing number
+//   of blocks, then by decreasing total size.
+static int __cdecl compareSiteCount (const void *first, const void *second)
+{
+    const leaksite_t *a = *(const leaksite_t* const*)first;
+    const leaksite_t *b = *(const leaksite_t* const*)second;
+    if (a->count != b->count)
+        return (a->count > b->count) ? -1 : 1;
+    return (a->total > b->total) ? -1 : (a->total < b->total) ? 1 : 0;
+}
+
+// siteKey - Obtains the key of a block's leak site: its call stack or, for
+//   a block without one, its allocation tag. The tags' keys are never aligned
+//   like CallStack addresses are, and never the hash map's reserved keys.
+static UINT_PTR siteKey (CallStack *callStack, UINT32 tag)
+{
+    return (callStack != NULL) ? (UINT_PTR)callStack : (((UINT_PTR)tag << 2) | 2);
+}
+
+// The brackets of the summary report's leak age histogram (see
+// AllocationTimeResolution): the ages under which each one ends, in
+// milliseconds. One more bracket holds the blocks older than every time record.
+#define VLD_AGE_BRACKETS 6
+static const ULONGLONG g_ageLimits [VLD_AGE_BRACKETS] = { 1000, 10000, 60000, 600000, 3600000, (ULONGLONG)-1 };
+static LPCWSTR const g_ageNames [VLD_AGE_BRACKETS + 1] = { L"Under 1 s", L"1 s to 10 s", L"10 s to 1 min",
+    L"1 min to 10 min", L"10 min to 1 h", L"Over 1 h", L"Older than the time records" };
+
+// reportLeakSummary - Generates a summary leak report for every heap. The
+//   leaks are grouped by call stack (or allocation tag), and only the top m_summaryCount call
+//   stacks are resolved and reported in full; every other call stack gets a
+//   one-line tally. No block data is dumped. Must be called with the whole
+//   heap map lock held.
+//
+//  - threadId (IN): Only report the leaks of this thread, or of all threads
+//      if -1.
+//
+//  Return Value:
+//
+//    Returns the number of leaks found.
+//
+SIZE_T VisualLeakDetector::reportLeakSummary (DWORD threadId)
+{
+    TickCounter reportTicks(m_reportStats.reportTicks);
+    HashMap<UINT_PTR, leaksite_t*> sites;
+    SIZE_T leakCount = 0;
+    SIZE_T leakTotal = 0;
+    SIZE_T ageCount [VLD_AGE_BRACKETS + 1] = { 0 };
+    SIZE_T ageTotal [VLD_AGE_BRACKETS + 1] = { 0 };
+    ULONGLONG now = GetTickCount64();
+    {
+        TickCounter ticks(m_reportStats.aggregationTicks);
+        for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
+            BlockMap *blockmap = &(*heapit).second->blockMap;
+            for (BlockMap::Iterator blockit = blockmap->begin(); blockit != blockmap->end(); ++blockit) {
+                LPCVOID address;
+                SIZE_T  size;
+                blockinfo_t *info = (*blockit).second;
+                if (!getLeakedBlock((*blockit).first, info, address, size))
+                    continue;
+                if ((threadId != ((DWORD)-1)) && (getThreadId(info) != threadId))
+                    continue;
+                if (!info->callStack && (info->tag == 0))
+                    continue;
+                if (isSuppressed(info)) {
+                    markReported(info);
+                    continue;
+                }
+                if ((m_options & VLD_OPT_SKIP_CRTSTARTUP_LEAKS) && info->callStack && info->callStack->isCrtStartupAlloc()) {
+                    markReported(info);
+                    continue;
+                }
+
+                CallStack *callStack = info->callStack.get();
+                UINT_PTR key = siteKey(callStack, info->tag);
+                HashMap<UINT_PTR, leaksite_t*>::Iterator siteit = sites.find(key);
+                leaksite_t *site;
+                if (siteit == sites.end()) {
+                    site = new leaksite_t;
+                    site->callStack = callStack;
+                    site->tag = info->tag;
+                    site->count = 0;
+                    site->total = 0;
+                    site->estimatedCount = 0;
+                    site->estimatedTotal = 0;
+                    site->stacks = 1;
+                    site->stackTotal = 0;
+                    site->name = NULL;
+                    sites.insert(key, site);
+                }
+                else {
+                    site = (*siteit).second;
+                }
+                site->count++;
+                site->total += size;
+                if (sampling()) {
+                    double weight = sampleWeight(info->size);
+                    site->estimatedCount += weight;
+                    site->estimatedTotal += weight * size;
+                }
+                if (m_timeResolution != 0) {
+                    ULONGLONG time = allocationTime(info->serialNumber);
+                    UINT32 bracket = VLD_AGE_BRACKETS;
+                    if (time != 0) {
+                        ULONGLONG age = (now > time) ? now - time : 0;
+                        for (bracket = 0; age >= g_ageLimits[bracket]; bracket++);
+                    }
+                    ageCount[bracket]++;
+                    ageTotal[bracket] += size;
+                }
+                leakCount++;
+                leakTotal += size;
+            }
+        }
+    }
+
+    leaksite_t **sorted = new leaksite_t* [sites.size() + 1];
+    size_t siteCount = 0;
+    for (HashMap<UINT_PTR, leaksite_t*>::Iterator siteit = sites.begin(); siteit != sites.end(); ++siteit)
+        sorted[siteCount++] = (*siteit).second;
+    size_t stackCount = siteCount;
+    LPCWSTR groupName = (m_summaryGroupBy == VLD_GROUP_BY_MODULE) ? L"Module" : L"Function";
+    if (m_summaryGroupBy != VLD_GROUP_BY_STACK) {
+        TickCounter ticks(m_reportStats.aggregationTicks);
+        siteCount = rollUpSites(sorted, siteCount, m_summaryGroupBy);
+    }
+    bool byCount = (m_options & VLD_OPT_SUMMARY_BY_COUNT) != 0;
+    qsort(sorted, siteCount, sizeof(leaksite_t*), byCount ? compareSiteCount : compareSiteBytes);
+
+    if (leakCount != 0) {
+        Report(L"WARNING: Visual Leak Detector detected memory leaks!\n");
+        if (m_summaryGroupBy == VLD_GROUP_BY_STACK) {
+            Report(L"Visual Leak Detector: %Iu leaks totalling %Iu bytes were allocated from %Iu call stacks. "
+                L"The top %u by leaked %s follow.\n", leakCount, leakTotal, siteCount, m_summaryCount,
+                byCount ? L"blocks" : L"bytes");
+        }
+        else {
+            Report(L"Visual Leak Detector: %Iu leaks totalling %Iu bytes were allocated from %Iu call stacks, "
+                L"rolled up into %Iu sites by %s. The top %u by leaked %s follow.\n", leakCount, leakTotal,
+                stackCount, siteCount, (m_summaryGroupBy == VLD_GROUP_BY_MODULE) ? L"module" : L"function",
+                m_summaryCount, byCount ? L"blocks" : L"bytes");
+        }
+    }
+    for (size_t index = 0; index < siteCount; index++) {
+        leaksite_t *site = sorted[index];
+        m_estimatedLeakBytes += (SIZE_T)site->estimatedTotal;
+        if (site->callStack == NULL) {
+            // Tagged blocks without call stacks have nothing more to show.
+            if (index < m_summaryCount) {
+                FormatReport(L"---------- Tag {}: {} blocks, {} bytes ----------\n", m_tagNames[site->tag],
+                    site->count, site->total);
+                if (sampling()) {
+                    FormatReport(L"  Sampled, estimated Count: {:.0f}, Total {:.0f} bytes\n", site->estimatedCount,
+                        site->estimatedTotal);
+                }
+                FormatReport(L"\n");
+            }
+            else {
+                if (index == m_summaryCount)
+                    FormatReport(L"---------- Other call stacks ----------\n");
+                FormatReport(L"  Tag {}: {} blocks, {} bytes\n", m_tagNames[site->tag], site->count, site->total);
+            }
+            delete site;
+            continue;
+        }
+
+        DWORD hash = site->callStack->getHashValue();
+        if (index < m_summaryCount) {
+            if (site->name != NULL) {
+                FormatReport(L"---------- {} {}: {} blocks, {} bytes from {} call stacks ----------\n", groupName,
+                    site->name, site->count, site->total, site->stacks);
+            }
+            else {
+                FormatReport(L"---------- Call Stack 0x{:08X}: {} blocks, {} bytes ----------\n", hash, site->count,
+                    site->total);
+            }
+            if (sampling()) {
+                FormatReport(L"  Sampled, estimated Count: {:.0f}, Total {:.0f} bytes\n", site->estimatedCount,
+                    site->estimatedTotal);
+            }
+            if ((site->name != NULL) && (site->stacks > 1))
+                FormatReport(L"  Call Stack 0x{:08X}, which leaked the most ({} bytes):\n", hash, site->stackTotal);
+            else
+                FormatReport(L"  Call Stack:\n");
+            {
+                TickCounter ticks(m_reportStats.stackDumpTicks);
+                site->callStack->dump(m_options & VLD_OPT_TRACE_INTERNAL_FRAMES);
+            }
+            FormatReport(L"\n\n");
+        }
+        else {
+            if (index == m_summaryCount)
+                FormatReport(L"---------- Other call stacks ----------\n");
+            if (site->name != NULL) {
+                FormatReport(L"  {} {}: {} blocks, {} bytes from {} call stacks\n", groupName, site->name, site->count,
+                    site->total, site->stacks);
+            }
+            else {
+                FormatReport(L"  Call Stack 0x{:08X}: {} blocks, {} bytes\n", hash, site->count, site->total);
+            }
+        }
+        delete site;
+    }
+    if (siteCount > m_summaryCount)
+        Report(L"\n");
+    if ((m_timeResolution != 0) && (leakCount != 0)) {
+        Report(L"Leaks by age:\n");
+        for (UINT32 bracket = 0; bracket <= VLD_AGE_BRACKETS; bracket++) {
+            if (ageCount[bracket] != 0)
+                FormatReport(L"  {}: {} blocks, {} bytes\n", g_ageNames[bracket], ageCount[bracket], ageTotal[bracket]);
+        }
+        Report(L"\n");
+    }
+    delete [] sorted;
+    return leakCount;
+}
+
+// FindAllocedBlock - Find if a particular memory allocation is tracked inside of VLD.
+//     Every heap's BlockMap is keyed by block address, so this is one hash
+//     probe per heap rather than a walk over every tracked block.
+// Pre Condition: Be VERY sure that this is only called within a block that already has
+// acquired the whole g_heapMapLock.
+//
+// mem - The particular memory address to search for.
+//
+// heap (OUT) - Receives the heap the block was allocated from, or NULL.
+//
+//  Return Value:
+//   If mem is found, it will return the blockinfo_t pointer, otherwise NULL
+//
+blockinfo_t* VisualLeakDetector::findAllocedBlock(LPCVOID mem, __out HANDLE& heap)
+{
+    heap = NULL;
+    CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+    for (HeapMap::Iterator it = m_heapMap->begin(); it != m_heapMap->end(); ++it)
+    {
+        BlockMap& blockmap = (*it).second->blockMap;
+        BlockMap::Iterator blockit = blockmap.find(mem);
+        if (blockit != blockmap.end())
+        {
+            // Found the block.
+            heap = (*it).first;
+            return (*blockit).second;
+        }
+    }
+
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Static Leak Detection Functions (Callbacks)
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// addloadedmodule - Callback function for EnumerateLoadedModules64. This
+//   function records information about every module loaded in the process,
+//   each time adding the module's information to the provided ModuleSet (the
+//   "context" parameter).
+//
+//   When EnumerateLoadedModules64 has finished calling this function for each
+//   loaded module, then the resulting ModuleSet can be used at any time to get
+//   information about any modules loaded into the process.
+//
+//   - modulepath (IN): The fully qualified path from where the module was
+//       loaded.
+//
+//   - modulebase (IN): The base address at which the module has been loaded.
+//
+//   - modulesize (IN): The size, in bytes, of the loaded module.
+//
+//   - context (IN): Pointer to the ModuleSet to which information about each
+//       module is to be added.
+//
+//  Return Value:
+//
+//    Always returns TRUE, which tells EnumerateLoadedModules64 to continue
+//    enumerating.
+//
+BOOL VisualLeakDetector::addLoadedModule (PCWSTR modulepath, DWORD64 modulebase, ULONG modulesize, PVOID context)
+{
+    // Modules are enumerated again on every refresh; their path and name are
+    // only copied the first time.
+    const modulepath_t *interned = g_modulePaths.Intern(modulepath);
+    LPCWSTR modulename = interned->name;
+
+    if (_wcsicmp(modulename, TEXT(VLDDLL)) == 0) {
+        // Record Visual Leak Detector's own base address, and the extent of
+        // its image for isVldAddress.
+        g_vld.m_vldBase = (HMODULE)modulebase;
+        g_vld.m_vldSize = modulesize;
+    }
+    else {
+        LPSTR modulenamea;
+        ConvertModulePathToAscii(modulename, &modulenamea);
+
+        // See if this is a module listed in the patch table. If it is, update
+        // the corresponding patch table entries' module base address.
+        UINT          tablesize = _countof(m_patchTable);
+        for (UINT index = 0; index < tablesize; index++) {
+            moduleentry_t *entry = &m_patchTable[index];
+            if (_stricmp(entry->exportModuleName, modulenamea) == 0) {
+                entry->moduleBase = (UINT_PTR)modulebase;
+            }
+        }
+
+        delete [] modulenamea;
+    }
+
+    // Record the module's information and store it in the set.
+    moduleinfo_t  moduleinfo;
+    moduleinfo.addrLow  = (UINT_PTR)modulebase;
+    moduleinfo.addrHigh = (UINT_PTR)(modulebase + modulesize) - 1;
+    moduleinfo.flags    = 0x0;
+    moduleinfo.name     = modulename;
+    moduleinfo.path     = interned->path;
+    moduleinfo.pathLength = interned->length;
+    GetModulePdbInfo((HMODULE)modulebase, moduleinfo.pdbGuid, moduleinfo.pdbAge);
+    moduleinfo.image    = g_moduleImages.Register(moduleinfo.addrLow, modulesize, moduleinfo.path,
+        moduleinfo.pdbGuid, moduleinfo.pdbAge);
+
+    ModuleSet*    newmodules = (ModuleSet*)context;
+    newmodules->insert(moduleinfo);
+
+    return TRUE;
+}
+
+// dllNotification - Loader notification callback. Attaches Visual Leak
+//   Detector to each DLL as it's loaded, before its initialization routine
+//   runs, and forgets about each DLL as it's unloaded. Only the module
+//   concerned is examined; the rest of the ModuleSet is left alone.
+//
+//  - reason (IN): LDR_DLL_NOTIFICATION_REASON_LOADED or
+//      LDR_DLL_NOTIFICATION_REASON_UNLOADED.
+//
+//  - data (IN): Describes the DLL being loaded or unloaded.
+//
+//  - context (IN): User-supplied context (ignored).
+//
+//  Return Value:
+//
+//    None.
+//
+VOID NTAPI VisualLeakDetector::dllNotification (ULONG reason, const ldrdllnotificationdata_t *data, PVOID /*context*/)
+{
+    if (g_vld.m_options & VLD_OPT_VLDOFF)
+        return;
+
+    if (reason == LDR_DLL_NOTIFICATION_REASON_LOADED) {
+        const unicodestring_t *fullname = data->fullDllName;
+        vldstring modulepath(fullname->buffer, fullname->length / sizeof(WCHAR));
+        g_vld.attachModule(modulepath.c_str(), (UINT_PTR)data->dllBase, data->sizeOfImage);
+    }
+    else if (reason == LDR_DLL_NOTIFICATION_REASON_UNLOADED) {
+        g_vld.forgetModule((UINT_PTR)data->dllBase);
+    }
+}
+
+// detachfrommodule - Callback function for EnumerateLoadedModules64 that
+//   detaches Visual Leak Detector from the specified module. If the specified
+//   module has not previously been attached to, then calling this function will
+//   not actually result in any changes.
+//
+//  - modulepath (IN): String containing the name, which may include a path, of
+//      the module to detach from (ignored).
+//
+//  - modulebase (IN): Base address of the module.
+//
+//  - modulesize (IN): Total size of the module (ignored).
+//
+//  - context (IN): User-supplied context (ignored).
+//
+//  Return Value:
+//
+//    Always returns TRUE.
+//
+BOOL VisualLeakDetector::detachFromModule (PCWSTR /*modulepath*/, DWORD64 modulebase, ULONG /*modulesize*/,
+    PVOID /*context*/)
+{
+    UINT tablesize = _countof(m_patchTable);
+
+    // The module's plan says which IAT entries were patched. Without one,
+    // its imports are searched for the replacements instead.
+    if (!g_importPlans.Restore((HMODULE)modulebase))
+        RestoreModule((HMODULE)modulebase, m_patchTable, tablesize);
+
+    return TRUE;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Win32 IAT Replacement Functions
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// _GetProcAddress - Calls to GetProcAddress are patched through to this
+//   function. If the requested function is a function that has been patched
+//   through to one of VLD's handlers, then the address of VLD's handler
+//   function is returned instead of the real address. Otherwise, this
+//   function is just a wrapper around the real GetProcAddress.
+//
+//  - module (IN): Handle (base address) of the module from which to retrieve
+//      the address of an exported function.
+//
+//  - procname (IN): ANSI string containing the name of the exported function
+//      whose address is to be retrieved.
+//
+//  Return Value:
+//
+//    Returns a pointer to the requested function, or VLD's replacement for
+//    the function, if there is a replacement function.
+//
+FARPROC VisualLeakDetector::_GetProcAddress (HMODULE module, LPCSTR procname)
+{
+    FARPROC original = g_vld._RGetProcAddress(module, procname);
+    return patchedProcAddress(module, procname, original);
+}
+
+FARPROC VisualLeakDetector::_RGetProcAddress(HMODULE module, LPCSTR procname)
+{
+    return m_GetProcAddress(module, procname);
+}
+
+// _GetProcAddress - Calls to GetProcAddress are patched through to this
+//   function. If the requested function is a function that has been patched
+//   through to one of VLD's handlers, then the address of VLD's handler
+//   function is returned instead of the real address. Otherwise, this
+//   function is just a wrapper around the real GetProcAddress.
+//
+//  - module (IN): Handle (base address) of the module from which to retrieve
+//      the address of an exported function.
+//
+//  - procname (IN): ANSI string containing the name of the exported function
+//      whose address is to be retrieved.
+//
+//  - caller (IN)
+//
+//  Return Value:
+//
+//    Returns a pointer to the requested function, or VLD's replacement for
+//    the function, if there is a replacement function.
+//
+FARPROC VisualLeakDetector::_GetProcAddressForCaller(HMODULE module, LPCSTR procname, LPVOID caller)
+{
+    FARPROC original = g_vld._RGetProcAddressForCaller(module, procname, caller);
+    return patchedProcAddress(module, procname, original);
+}
+
+FARPROC VisualLeakDetector::_RGetProcAddressForCaller(HMODULE module, LPCSTR procname, LPVOID caller)
+{
+    return m_GetProcAddressForCaller(module, procname, caller);
+}
+
+// patchedProcAddress - Looks up the function returned by one of the patched
+//   GetProcAddress functions in the patch table index.
+//
+//  - module (IN): Handle (base address) of the module the function was
+//      retrieved from.
+//
+//  - procname (IN): ANSI string containing the name (or the ordinal) of the
+//      function.
+//
+//  - original (IN): The real address of the function, or NULL if it wasn't
+//      found.
+//
+//  Return Value:
+//
+//    Returns the address of VLD's replacement for the function, if there is
+//    one. Otherwise the real address is returned.
+//
+FARPROC VisualLeakDetector::patchedProcAddress (HMODULE module, LPCSTR procname, FARPROC original)
+{
+    if (original == NULL)
+        return NULL;
+
+    const patchentry_t *patchentry = FindPatchEntry(g_vld.m_patchIndex, module, procname);
+    if (patchentry == NULL) {
+        // The requested function is not a patched function. Just return the
+        // real address of the requested function.
+        return original;
+    }
+
+    if (patchentry->original != NULL)
+        *patchentry->original = original;
+    return (FARPROC)patchentry->replacement;
+}
+
+// _LdrLoadDll - Calls to LdrLoadDll are patched through to this function. This
+//   function invokes the real LdrLoadDll and then re-attaches VLD to all
+//   modules loaded in the process after loading of the new DLL is complete.
+//   All modules must be re-enumerated because the explicit load of the
+//   specified module may result in the implicit load of one or more additional
+//   modules which are dependencies of the specified module.
+//
+//  - searchpath (IN): The path to use for searching for the specified module to
+//      be loaded.
+//
+//  - flags (IN): Pointer to action flags.
+//
+//  - modulename (IN): Pointer to a unicodestring_t structure specifying the
+//      name of the module to be loaded.
+//
+//  - modulehandle (OUT): Address of a HANDLE to receive the newly loaded
+//      module's handle.
+//
+//  Return Value:
+//
+//    Returns the value returned by LdrLoadDll.
+//
+NTSTATUS VisualLeakDetector::_LdrLoadDll (LPWSTR searchpath, PULONG flags, unicodestring_t *modulename,
+    PHANDLE modulehandle)
+{
+    // Load the DLL
+    NTSTATUS status = LdrLoadDll(searchpath, flags, modulename, modulehandle);
+    return status;
+}
+
+NTSTATUS VisualLeakDetector::_LdrLoadDllWin8 (DWORD_PTR reserved, PULONG flags, unicodestring_t *modulename,
+                                          PHANDLE modulehandle)
+{
+    // Load the DLL
+    NTSTATUS status = LdrLoadDllWin8(reserved, flags, modulename, modulehandle);
+    return status;
+}
+
+NTSTATUS VisualLeakDetector::_LdrGetDllHandle(IN PWSTR DllPath OPTIONAL, IN PULONG DllCharacteristics OPTIONAL, IN PUNICODE_STRING DllName, OUT PVOID *DllHandle OPTIONAL)
+{
+    LoaderLock ll;
+
+    NTSTATUS status = LdrGetDllHandle(DllPath, DllCharacteristics, DllName, DllHandle);
+    return status;
+}
+NTSTATUS VisualLeakDetector::_LdrGetProcedureAddress(IN PVOID BaseAddress, IN PANSI_STRING Name, IN ULONG Ordinal, OUT PVOID * ProcedureAddress)
+{
+    LoaderLock ll;
+
+    NTSTATUS status = LdrGetProcedureAddress(BaseAddress, Name, Ordinal, ProcedureAddress);
+    return status;
+}
+
+NTSTATUS VisualLeakDetector::_LdrLockLoaderLock(IN ULONG Flags, OUT PULONG Disposition OPTIONAL, OUT PULONG_PTR Cookie OPTIONAL)
+{
+    return LdrLockLoaderLock(Flags, Disposition, Cookie);
+}
+
+NTSTATUS VisualLeakDetector::_LdrUnlockLoaderLock(IN ULONG Flags, IN ULONG_PTR Cookie OPTIONAL)
+{
+    return LdrUnlockLoaderLock(Flags, Cookie);
+}
+
+NTSTATUS VisualLeakDetector::_LdrUnloadDll(IN PVOID BaseAddress)
+{
+    return LdrUnloadDll(BaseAddress);
+}
+
+VOID VisualLeakDetector::RefreshModules()
+{
+    LoaderLock ll;
+
+    if (m_options & VLD_OPT_VLDOFF)
+        return;
+
+    TickCounter ticks(m_moduleStats.attachTicks);
+    m_moduleStats.attaches++;
+    ModuleSet* newmodules = new ModuleSet();
+    newmodules->reserve(sizedReserve(m_sizingReserve.modules, MODULE_SET_RESERVE));
+    {
+        // Duplicate code here in this method. Consider refactoring out to another method.
+        // Create a new set of all loaded modules, including any newly loaded
+        // modules.
+        DbgTrace(L"dbghelp32.dll %i: EnumerateLoadedModulesW64\n", GetCurrentThreadId());
+        g_LoadedModules.EnumerateLoadedModulesW64(g_currentProcess, addLoadedModule, newmodules);
+        noteModuleSizing(newmodules);
+
+        // Attach to all modules included in the set.
+        attachToLoadedModules(newmodules);
+    }
+
+    // Modules which have been unloaded drop out of the set. Their images
+    // stay in the ModuleImages table, which loads their symbols if leaks
+    // from them are ever resolved.
+    CriticalSectionLocker<DbgHelp> locker(g_DbgHelp);
+    CriticalSectionLocker<> cs(m_modulesLock);
+    for (ModuleSet::Iterator oldit = m_loadedModules->begin(); oldit != m_loadedModules->end(); ++oldit)
+    {
+        if (newmodules->find(*oldit) != newmodules->end())
+            continue;
+        g_moduleImages.Unload((*oldit).image, ((*oldit).flags & VLD_MODULE_SYMBOLSLOADED) != 0, locker);
+    }
+
+    // Start using the new set of loaded modules.
+    ModuleSet* oldmodules = m_loadedModules;
+    m_loadedModules = newmodules;
+    publishModuleRanges();
+    publishPatchIndex();
+    prefetchSymbols(newmodules, oldmodules);
+
+    // Free resources used by the old module list.
+    delete oldmodules;
+}
+
+// attachModule - Attaches Visual Leak Detector to a single, newly loaded
+//   module and adds it to the set of loaded modules.
+//
+//  - modulepath (IN): The fully qualified path of the module.
+//
+//  - modulebase (IN): The base address of the module.
+//
+//  - modulesize (IN): The size, in bytes, of the module.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::attachModule (PCWSTR modulepath, UINT_PTR modulebase, ULONG modulesize)
+{
+    LoaderLock ll;
+
+    TickCounter ticks(m_moduleStats.attachTicks);
+    m_moduleStats.attaches++;
+    ModuleSet* newmodules = new ModuleSet();
+    addLoadedModule(modulepath, modulebase, modulesize, newmodules);
+    attachToLoadedModules(newmodules);
+
+    CriticalSectionLocker<> cs(m_modulesLock);
+    for (ModuleSet::Iterator newit = newmodules->begin(); newit != newmodules->end(); ++newit)
+    {
+        // Drop anything still recorded at this address range; it belonged to
+        // a module which is gone.
+        ModuleSet::Iterator oldit;
+        while ((oldit = m_loadedModules->find(*newit)) != m_loadedModules->end())
+            m_loadedModules->erase(oldit);
+        m_loadedModules->insert(*newit);
+    }
+    publishModuleRanges();
+    publishPatchIndex();
+    prefetchSymbols(newmodules, NULL);
+
+    delete newmodules;
+}
+
+// forgetModule - Removes a module which is being unloaded from the set of
+//   loaded modules. Nothing else is done: its image stays in the ModuleImages
+//   table, which loads its symbols only if leaks from it are ever resolved.
+//
+//  - modulebase (IN): The base address of the module.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::forgetModule (UINT_PTR modulebase)
+{
+    moduleinfo_t         moduleinfo;
+    ModuleSet::Iterator  moduleit;
+    moduleinfo.addrLow  = modulebase;
+    moduleinfo.addrHigh = modulebase;
+    moduleinfo.flags    = 0;
+
+    TickCounter ticks(m_moduleStats.detachTicks);
+    m_moduleStats.detaches++;
+    g_importPlans.Forget((HMODULE)modulebase);
+
+    CriticalSectionLocker<DbgHelp> locker(g_DbgHelp);
+    CriticalSectionLocker<> cs(m_modulesLock);
+    moduleit = m_loadedModules->find(moduleinfo);
+    if (moduleit == m_loadedModules->end())
+        return;
+    g_moduleImages.Unload((*moduleit).image, ((*moduleit).flags & VLD_MODULE_SYMBOLSLOADED) != 0, locker);
+    m_loadedModules->erase(moduleit);
+    publishModuleRanges();
+}
+
+// Find the information for the module that initiated this reallocation.
+//   This is the slow path of CaptureContext::IsExcludedModule, used for
+//   addresses which aren't in the module range table.
+BOOL VisualLeakDetector::isModuleExcluded(HMODULE hModule)
+{
+    if (hModule == g_vld.m_dbghlpBase)
+        return TRUE;
+
+    UINT tablesize = _countof(g_vld.m_patchTable);
+    for (UINT index = 0; index < tablesize; index++) {
+        if (((HMODULE)g_vld.m_patchTable[index].moduleBase == hModule)) {
+            return !g_vld.m_patchTable[index].reportLeaks;
+        }
+    }
+
+    // The range table mirrors m_loadedModules, and is read without the lock.
+    ModuleRangesReader reader(g_vld, g_vld.getTls());
+    const modulerange_t *range = FindModuleRange(reader.Table(), (UINT_PTR)hModule);
+    if (range != NULL)
+        return range->excluded;
+    return FALSE;
+}
+
+// publishModuleRanges - Rebuilds the module range table from the loaded
+//   modules and publishes it for IsExcludedModule. Must be called, with
+//   m_modulesLock held, whenever m_loadedModules or a module's flags change.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::publishModuleRanges ()
+{
+    SIZE_T count = 0;
+    for (ModuleSet::Iterator moduleit = m_loadedModules->begin(); moduleit != m_loadedModules->end(); ++moduleit)
+        count++;
+
+    moduleranges_t *table = (moduleranges_t*)new BYTE [sizeof(moduleranges_t) + (max(count, (SIZE_T)1) - 1) * sizeof(modulerange_t)];
+    table->count = 0;
+    UINT tablesize = _countof(m_patchTable);
+    for (ModuleSet::Iterator moduleit = m_loadedModules->begin(); moduleit != m_loadedModules->end(); ++moduleit) {
+        // Same decision as isModuleExcluded, made once per module.
+        const moduleinfo_t &moduleinfo = *moduleit;
+        modulerange_t &range = table->ranges[table->count++];
+        range.addrLow  = moduleinfo.addrLow;
+        range.addrHigh = moduleinfo.addrHigh;
+        range.excluded = (moduleinfo.flags & VLD_MODULE_EXCLUDED) ? TRUE : FALSE;
+        range.image    = moduleinfo.image;
+        if ((range.image != MODULEIMAGE_NONE) && (m_moduleCounters[range.image / MODULEIMAGES_PAGE_SIZE] == NULL)) {
+            // The counters are there before any reader can find the image.
+            modulecounters_t *page = new modulecounters_t [MODULEIMAGES_PAGE_SIZE];
+            ZeroMemory(page, MODULEIMAGES_PAGE_SIZE * sizeof(modulecounters_t));
+            m_moduleCounters[range.image / MODULEIMAGES_PAGE_SIZE] = page;
+        }
+        range.allocator = (ntdllPatch[0].moduleBase == moduleinfo.addrLow);
+        range.maxFrames = 0;
+        range.walkMethod = CALLSTACK_WALK_CONFIGURED;
+        for (UINT32 index = 0; index < m_tracePolicyCount; index++) {
+            if (_wcsicmp(m_tracePolicies[index].moduleName, moduleinfo.name) == 0) {
+                range.maxFrames = m_tracePolicies[index].maxFrames;
+                range.walkMethod = m_tracePolicies[index].walkMethod;
+                break;
+            }
+        }
+        for (UINT index = 0; index < tablesize; index++) {
+            if (m_patchTable[index].moduleBase == moduleinfo.addrLow) {
+                range.excluded = !m_patchTable[index].reportLeaks;
+                range.allocator = TRUE;
+                break;
+            }
+        }
+        if ((HMODULE)moduleinfo.addrLow == m_dbghlpBase)
+            range.excluded = TRUE;
+    }
+
+    // Readers may still be using the previous table, so it's only retired.
+    // The epoch moves on once the new table is published: a reader which
+    // announces the new epoch can only obtain the new table.
+    table->epoch = m_rangeEpoch + 1;
+    table->retired = m_moduleRanges;
+    InterlockedExchangePointer((PVOID volatile*)&m_moduleRanges, table);
+    InterlockedIncrement(&m_rangeEpoch);
+    reclaimModuleRanges();
+}
+
+// reclaimModuleRanges - Frees the retired module range tables which no thread
+//   can be reading any more. A thread which announced epoch e may be reading
+//   any table published from epoch e on, so a retired table is freed once its
+//   epoch is older than that of every thread which is reading. Must be called
+//   with m_modulesLock held.
+//
+//   Note: The threads are only looked at if m_tlsLock can be entered without
+//     waiting, since module loads come with the loader lock held. Otherwise
+//     the retired tables wait for the next module load, or for VLD to be
+//     destroyed.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::reclaimModuleRanges ()
+{
+    moduleranges_t *current = m_moduleRanges;
+    if ((current == NULL) || (current->retired == NULL) || !m_tlsLock.TryEnter())
+        return;
+
+    LONG oldest = m_rangeEpoch;
+    for (TlsMap::Iterator tlsit = m_tlsMap->begin(); tlsit != m_tlsMap->end(); ++tlsit) {
+        LONG epoch = (*tlsit).second->rangeEpoch;
+        if ((epoch != 0) && ((LONG)(epoch - oldest) < 0))
+            oldest = epoch;
+    }
+    m_tlsLock.Leave();
+
+    moduleranges_t **link = &current->retired;
+    while (*link != NULL) {
+        moduleranges_t *table = *link;
+        if ((LONG)(table->epoch - oldest) < 0) {
+            *link = table->retired;
+            delete [] (BYTE*)table;
         }
         else {
-            Report(L"    Limiting data dumps to %Iu bytes.\n", m_maxDataDump);
+            link = &table->retired;
         }
     }
-    if (m_maxTraceFrames != VLD_DEFAULT_MAX_TRACE_FRAMES) {
-        Report(L"    Limiting stack traces to %u frames.\n", m_maxTraceFrames);
+}
+
+// hashPatchKey - Hashes an export module's base address together with an
+//   import name, or ordinal, for the patch table index.
+static UINT32 hashPatchKey (UINT_PTR modulebase, LPCSTR importname)
+{
+    UINT32 hash;
+    if (HIWORD(importname) == 0) {
+        hash = (UINT32)(UINT_PTR)importname;
     }
-    if (m_options & VLD_OPT_UNICODE_REPORT) {
-        Report(L"    Generating a Unicode (UTF-16) encoded report.\n");
+    else {
+        // FNV-1a
+        hash = 2166136261U;
+        for (LPCSTR c = importname; *c != '\0'; c++)
+            hash = (hash ^ (BYTE)*c) * 16777619U;
+    }
+
+    // Module bases are 64 KB aligned, so their low bits carry nothing.
+    hash ^= (UINT32)(modulebase >> 16);
+    hash *= 0x9E3779B1U;
+    return hash ^ (hash >> 15);
+}
+
+// matchesPatchKey - Compares an import name, or ordinal, from the patch table
+//   with the one being looked up.
+static BOOL matchesPatchKey (LPCSTR importname, LPCSTR procname)
+{
+    if (HIWORD(importname) == 0 || HIWORD(procname) == 0)
+        return importname == procname;
+    return strcmp(importname, procname) == 0;
+}
+
+// publishPatchIndex - Rebuilds the patch table index from the patch table's
+//   module base addresses and publishes it for _GetProcAddress. Must be
+//   called, with m_modulesLock held, whenever addLoadedModule may have
+//   recorded a module base address.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::publishPatchIndex ()
+{
+    UINT tablesize = _countof(m_patchTable);
+    SIZE_T count = 0;
+    for (UINT index = 0; index < tablesize; index++) {
+        if (m_patchTable[index].moduleBase == 0x0)
+            continue;
+        for (patchentry_t *patchentry = m_patchTable[index].patchTable; patchentry->importName; patchentry++)
+            count++;
+    }
+
+    // At most a quarter full, so that most misses hit an empty slot at once.
+    SIZE_T slots = 16;
+    while (slots < count * 4)
+        slots *= 2;
+    patchindex_t *patchindex = (patchindex_t*)new BYTE [sizeof(patchindex_t) + (slots - 1) * sizeof(patchindexentry_t)];
+    patchindex->mask = slots - 1;
+    memset(patchindex->slots, 0, slots * sizeof(patchindexentry_t));
+
+    for (UINT index = 0; index < tablesize; index++) {
+        moduleentry_t *entry = &m_patchTable[index];
+        if (entry->moduleBase == 0x0)
+            continue;
+        for (patchentry_t *patchentry = entry->patchTable; patchentry->importName; patchentry++) {
+            UINT32 hash = hashPatchKey(entry->moduleBase, patchentry->importName);
+            SIZE_T slot = hash & patchindex->mask;
+            for (;;) {
+                patchindexentry_t &candidate = patchindex->slots[slot];
+                if (candidate.moduleBase == 0x0) {
+                    candidate.moduleBase = entry->moduleBase;
+                    candidate.hash       = hash;
+                    candidate.importName = patchentry->importName;
+                    candidate.patch      = patchentry;
+                    break;
+                }
+                // The first entry in patch table order wins, as it always has.
+                if ((candidate.moduleBase == entry->moduleBase) && (candidate.hash == hash) &&
+                    matchesPatchKey(candidate.importName, patchentry->importName))
+                    break;
+                slot = (slot + 1) & patchindex->mask;
+            }
+        }
+    }
+
+    // Readers may still be using the previous index, so it's only retired.
+    patchindex->retired = m_patchIndex;
+    InterlockedExchangePointer((PVOID volatile*)&m_patchIndex, patchindex);
+}
+
+// installHeapHooks - With InlineHeapHooks, hooks RtlAllocateHeap, RtlFreeHeap
+//   and RtlReAllocateHeap themselves, so that allocations are seen no matter
+//   how the heap is called. The imports of the heap functions stay patched as
+//   well: the CRT hooks, which see allocations with more context, rely on
+//   them. VLD calls the real functions through the hooks' trampolines from
+//   then on.
+//
+//   Either all three functions are hooked or none is, since a block has to be
+//   seen both when it is allocated and when it is freed. Each function is
+//   called through its trampoline as soon as it is hooked, since the detour
+//   calls it; the trampolines stay valid if the hooks are removed again.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::installHeapHooks ()
+{
+    if (!m_heapHooks[0].Install(RtlAllocateHeap, _RtlAllocateHeapInline)) {
+        return;
+    }
+    RtlAllocateHeap = (RtlAllocateHeap_t)m_heapHooks[0].Trampoline();
+
+    if (!m_heapHooks[1].Install(RtlFreeHeap, _RtlFreeHeapInline)) {
+        removeHeapHooks();
+        return;
+    }
+    RtlFreeHeap = (RtlFreeHeap_t)m_heapHooks[1].Trampoline();
+
+    if (!m_heapHooks[2].Install(RtlReAllocateHeap, _RtlReAllocateHeapInline)) {
+        removeHeapHooks();
+        return;
+    }
+    RtlReAllocateHeap = (RtlReAllocateHeap_t)m_heapHooks[2].Trampoline();
+}
+
+// removeHeapHooks - Removes the hooks of the ntdll heap functions, if any.
+//   VLD keeps calling the trampolines, which remain valid.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::removeHeapHooks ()
+{
+    for (UINT index = 0; index < _countof(m_heapHooks); index++)
+        m_heapHooks[index].Remove();
+}
+
+// countLeaks - Obtains the number of leaks from the leak counters (see
+//   countBlock). With SkipCrtStartupLeaks, any blocks whose call stacks
+//   haven't been classified yet are checked first.
+//
+//  - threadId (IN): Only blocks allocated by this thread are counted, unless
+//      it is (DWORD)-1.
+//
+//  Return Value:
+//
+//    Returns the number of leaks.
+//
+SIZE_T VisualLeakDetector::countLeaks (DWORD threadId)
+{
+    flushAllPendingBlocks();
+    if ((m_options & VLD_OPT_SKIP_CRTSTARTUP_LEAKS) && (m_unclassifiedLeaks > 0))
+        classifyLeaks();
+    if (threadId == (DWORD)-1)
+        return m_leakCount;
+
+    WORD index = findThreadIndex(threadId);
+    if (index == 0)
+        return 0;
+    return (SIZE_T)getThreadLeaks(index).count;
+}
+
+SIZE_T VisualLeakDetector::GetLeaksCount()
+{
+    if (m_options & VLD_OPT_VLDOFF) {
+        // VLD has been turned off.
+        return 0;
     }
-    if (m_options & VLD_OPT_REPORT_TO_FILE) {
-        if (m_options & VLD_OPT_REPORT_TO_DEBUGGER) {
-            Report(L"    Outputting the report to the debugger and to %s\n", m_reportFilePath);
-        }
-        else {
-            Report(L"    Outputting the report to %s\n", m_reportFilePath);
-        }
+
+    return countLeaks((DWORD)-1);
+}
+
+// GetModuleLeaksCount - Obtains the number of leaks allocated from a module's
+//   code, from the counter kept for the module's image as blocks are mapped
+//   and freed: the blocks it has allocated, or last reallocated, and which
+//   haven't been reported or marked as reported since. Blocks marked by
+//   MarkThreadLeaksAsReported still count for their module.
+//
+//  - module (IN): Handle (base address) of a loaded module.
+//
+//  Return Value:
+//
+//    Returns the number of leaks, or 0 if the module isn't known.
+//
+SIZE_T VisualLeakDetector::GetModuleLeaksCount (HMODULE module)
+{
+    if (m_options & VLD_OPT_VLDOFF) {
+        // VLD has been turned off.
+        return 0;
     }
-    if (m_options & VLD_OPT_SLOW_DEBUGGER_DUMP) {
-        Report(L"    Outputting the report to the debugger at a slower rate.\n");
+
+    UINT32 image = MODULEIMAGE_NONE;
+    {
+        ModuleRangesReader reader(*this, getTls());
+        const modulerange_t *range = FindModuleRange(reader.Table(), (UINT_PTR)module);
+        if (range != NULL)
+            image = range->image;
     }
-    if (m_options & VLD_OPT_SAFE_STACK_WALK) {
-        Report(L"    Using the \"safe\" (but slow) stack walking method.\n");
+    if (image == MODULEIMAGE_NONE)
+        return 0;
+
+    countLeaks((DWORD)-1);
+    return (SIZE_T)getModuleCounters(image).leaks;
+}
+
+SIZE_T VisualLeakDetector::GetThreadLeaksCount(DWORD threadId)
+{
+    if (m_options & VLD_OPT_VLDOFF) {
+        // VLD has been turned off.
+        return 0;
     }
-    if (m_options & VLD_OPT_SELF_TEST) {
-        Report(L"    Performing a memory leak self-test.\n");
+
+    return countLeaks(threadId);
+}
+
+SIZE_T VisualLeakDetector::ReportLeaks( )
+{
+    if (m_options & VLD_OPT_VLDOFF) {
+        // VLD has been turned off.
+        return 0;
     }
-    if (m_options & VLD_OPT_START_DISABLED) {
-        Report(L"    Starting with memory leak detection disabled.\n");
+
+    if (m_heapWalkTracking)
+        walkHeaps();
+    if (m_capturePolicy->walkMethod == VLD_OPT_NTDB_STACK_WALK)
+        attachTraceDatabaseStacks();
+    reportDeferredHeapLeaks();
+    return reportLeaksBefore((SIZE_T)-1);
+}
+
+// ReportLeaksOlderThan - Reports the leaks like ReportLeaks, but only those
+//   allocated at least "age" milliseconds ago, to within the
+//   AllocationTimeResolution. Blocks allocated before the oldest allocation
+//   time record still kept count as old enough.
+//
+//  - age (IN): Minimum age of the blocks to report, in milliseconds.
+//
+//  Return Value:
+//
+//    Returns the number of leaks found.
+//
+SIZE_T VisualLeakDetector::ReportLeaksOlderThan (UINT32 age)
+{
+    if (m_options & VLD_OPT_VLDOFF) {
+        // VLD has been turned off.
+        return 0;
     }
-    if (m_options & VLD_OPT_TRACE_INTERNAL_FRAMES) {
-        Report(L"    Including heap and VLD internal frames in stack traces.\n");
+    if (m_timeResolution == 0) {
+        Report(L"WARNING: Visual Leak Detector: Allocation times aren't recorded; "
+            L"set AllocationTimeResolution to report leaks by age.\n");
+        return 0;
     }
+
+    ULONGLONG now = GetTickCount64();
+    return reportLeaksBefore(serialAllocatedBefore((now > age) ? now - age : 0));
 }
 
-bool VisualLeakDetector::isDebugCrtAlloc( LPCVOID block, blockinfo_t* info )
+// reportLeaksBefore - Generates a memory leak report for each heap in the
+//   process, in the configured format, leaving out the blocks allocated from
+//   a serial number on.
+//
+//  - serial (IN): Serial number of the first block left out, or -1 to report
+//      every block.
+//
+//  Return Value:
+//
+//    Returns the number of leaks found.
+//
+SIZE_T VisualLeakDetector::reportLeaksBefore (SIZE_T serial)
 {
-    // Autodetection allocations from statically linked CRT
-    if (!info->debugCrtAlloc) {
-        crtdbgblockheader_t* crtheader = (crtdbgblockheader_t*)block;
-        SIZE_T nSize = sizeof(crtdbgblockheader_t) + crtheader->size + GAPSIZE;
-        int nValid = _CrtIsValidPointer(block, (unsigned int)info->size, TRUE);
-        if (_BLOCK_TYPE_IS_VALID(crtheader->use) && nValid && (nSize == info->size)) {
-            info->debugCrtAlloc = true;
-            info->ucrt = false;
+    TraceLoggingWrite(g_vldTraceProvider, "Report",
+        TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+        TraceLoggingKeyword(VLD_TRACE_KEYWORD_REPORT),
+        TraceLoggingOpcode(WINEVENT_OPCODE_START));
+
+    // Generate a memory leak report for each heap in the process.
+    SIZE_T leaksCount = 0;
+    nameRunningThreads();
+    flushAllPendingBlocks();
+    CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+    m_reportBefore = serial;
+    m_estimatedLeakBytes = 0;
+    m_reportStats.reports++;
+    if (m_baselineSites != NULL)
+        compareWithBaseline();
+    if (m_reachabilityScan != VLD_REACHABILITY_OFF)
+        scanReachability();
+    if (m_options & (VLD_OPT_REPORT_JSON | VLD_OPT_REPORT_CSV)) {
+        leaksCount = writeStructuredReport((DWORD)-1);
+    }
+    else if (m_options & VLD_OPT_SUMMARY_REPORT) {
+        leaksCount = reportLeakSummary();
+    }
+    else if (m_reportThreadCount != 0) {
+        leaksCount = reportLeaksInParallel();
+    }
+    else {
+        bool firstLeak = true;
+        DuplicateIndex duplicates;
+        for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
+            HANDLE heap = (*heapit).first;
+            UNREFERENCED_PARAMETER(heap);
+            heapinfo_t* heapinfo = (*heapit).second;
+            leaksCount += reportLeaks(heapinfo, firstLeak, duplicates);
         }
     }
+    releaseReachability();
+    m_reportBefore = (SIZE_T)-1;
+    FlushReport();
 
-    if (!info->debugCrtAlloc) {
-        crtdbgblockheaderucrt_t* crtheader = (crtdbgblockheaderucrt_t*)block;
-        SIZE_T nSize = sizeof(crtdbgblockheaderucrt_t) + crtheader->size + GAPSIZE;
-        int nValid = _CrtIsValidPointer(block, (unsigned int)info->size, TRUE);
-        if (_BLOCK_TYPE_IS_VALID(crtheader->use) && nValid && (nSize == info->size)) {
-            info->debugCrtAlloc = true;
-            info->ucrt = true;
-        }
+    TraceLoggingWrite(g_vldTraceProvider, "Report",
+        TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+        TraceLoggingKeyword(VLD_TRACE_KEYWORD_REPORT),
+        TraceLoggingOpcode(WINEVENT_OPCODE_STOP),
+        TraceLoggingUInt64(leaksCount, "Leaks"));
+    return leaksCount;
+}
+
+// The LeakSink of an asynchronous report. Copies the leaks, with the data to
+// be dumped, so that they can be printed once the heap maps are unlocked and
+// the blocks may have been freed. Holds a reference on each call stack.
+class LeakSnapshot : public LeakSink
+{
+public:
+    LeakSnapshot (VLD_REPORT_CALLBACK callback, LPVOID context) : m_callback(callback), m_context(context),
+        m_leaks(NULL), m_count(0), m_capacity(0), m_leakCount(0) {}
+    ~LeakSnapshot ();
+
+    virtual VOID Leak (const leakentry_t &leak);
+    SIZE_T Count () const { return m_count; }
+    const leakentry_t& Entry (SIZE_T index) const { return m_leaks[index]; }
+    SIZE_T LeakCount () const { return m_leakCount; }
+    VLD_REPORT_CALLBACK Callback () const { return m_callback; }
+    LPVOID Context () const { return m_context; }
+
+private:
+    // Don't allow this!!
+    LeakSnapshot (const LeakSnapshot &other);
+    LeakSnapshot& operator = (const LeakSnapshot &other);
+
+    VLD_REPORT_CALLBACK m_callback;  // Called once the report has been written, or NULL.
+    LPVOID              m_context;   // Passed to the callback.
+    leakentry_t        *m_leaks;     // The leaks, in report order.
+    SIZE_T              m_count;
+    SIZE_T              m_capacity;
+    SIZE_T              m_leakCount; // Number of leaks, counting aggregated duplicates.
+};
+
+LeakSnapshot::~LeakSnapshot ()
+{
+    for (SIZE_T index = 0; index < m_count; index++) {
+        if (m_leaks[index].callStack != NULL)
+            g_callStackTable.Release(m_leaks[index].callStack);
+        delete [] (BYTE*)m_leaks[index].data;
     }
+    delete [] m_leaks;
+}
 
-    return info->debugCrtAlloc;
+VOID LeakSnapshot::Leak (const leakentry_t &leak)
+{
+    if (m_count == m_capacity) {
+        m_capacity = (m_capacity == 0) ? 256 : m_capacity * 2;
+        leakentry_t *leaks = new leakentry_t [m_capacity];
+        if (m_count != 0)
+            memcpy(leaks, m_leaks, m_count * sizeof(leakentry_t));
+        delete [] m_leaks;
+        m_leaks = leaks;
+    }
+    leakentry_t &entry = m_leaks[m_count++];
+    entry = leak;
+    if (entry.callStack != NULL)
+        g_callStackTable.AddRef(entry.callStack);
+    entry.data = NULL;
+    if (leak.dataSize != 0) {
+        BYTE *data = new BYTE [leak.dataSize];
+        memcpy(data, leak.data, leak.dataSize);
+        entry.data = data;
+    }
+    m_leakCount += leak.count;
 }
 
-// getleakscount - Calculate number of memory leaks.
+// The leaks of a heap destroyed with DeferHeapDestroyReport, waiting for the
+// next leak report.
+struct deferredheap_t {
+    HANDLE          heap;
+    LeakSnapshot   *leaks;
+    deferredheap_t *next;
+};
+
+// deferHeapLeaks - Copies the leaks of a heap about to be destroyed, with
+//   the data their report dumps, so that the heap can go right away. They
+//   are reported, in the layout of reportHeapLeaks, by the next
+//   reportDeferredHeapLeaks. The caller must have flushed the pending
+//   blocks.
 //
-//  - heap (IN): Handle to the heap for which to generate a memory leak
-//      report.
+//  - heap (IN): Handle to the heap being destroyed.
 //
 //  Return Value:
 //
 //    None.
 //
-SIZE_T VisualLeakDetector::getLeaksCount (heapinfo_t* heapinfo, DWORD threadId)
+VOID VisualLeakDetector::deferHeapLeaks (HANDLE heap)
 {
-    BlockMap* blockmap   = &heapinfo->blockMap;
-    SIZE_T memoryleaks = 0;
+    LeakSnapshot *snapshot = new LeakSnapshot(NULL, NULL);
+    {
+        CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+        HeapMap::Iterator heapit = m_heapMap->find(heap);
+        if (heapit != m_heapMap->end()) {
+            bool firstLeak = true;
+            DuplicateIndex duplicates;
+            reportLeaks((*heapit).second, firstLeak, duplicates, (DWORD)-1, (SIZE_T)-1, snapshot);
+        }
+    }
+    if (snapshot->Count() == 0) {
+        delete snapshot;
+        return;
+    }
+
+    deferredheap_t *deferred = new deferredheap_t;
+    deferred->heap = heap;
+    deferred->leaks = snapshot;
+    CriticalSectionLocker<> cs(m_deferredHeapLock);
+    deferred->next = m_deferredHeaps;
+    m_deferredHeaps = deferred;
+}
 
-    for (BlockMap::Iterator blockit = blockmap->begin(); blockit != blockmap->end(); ++blockit)
+// reportDeferredHeapLeaks - Reports the leaks of the heaps destroyed since
+//   the last call, in the order they were destroyed, as reportHeapLeaks would
+//   have when they were destroyed.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::reportDeferredHeapLeaks ()
+{
+    deferredheap_t *deferred;
     {
-        // Found a block which is still in the BlockMap. We've identified a
-        // potential memory leak.
-        LPCVOID block = (*blockit).first;
-        blockinfo_t* info = (*blockit).second;
-        if (info->reported)
-            continue;
+        CriticalSectionLocker<> cs(m_deferredHeapLock);
+        deferred = m_deferredHeaps;
+        m_deferredHeaps = NULL;
+    }
+    // Put the heaps back in the order they were destroyed in.
+    deferredheap_t *ordered = NULL;
+    while (deferred != NULL) {
+        deferredheap_t *next = deferred->next;
+        deferred->next = ordered;
+        ordered = deferred;
+        deferred = next;
+    }
+
+    while (ordered != NULL) {
+        LeakSnapshot *snapshot = ordered->leaks;
+        m_reportStats.reports++;
+        bool firstLeak = true;
+        for (SIZE_T index = 0; index < snapshot->Count(); index++)
+            printLeak(snapshot->Entry(index), firstLeak, m_reportStats);
+        SIZE_T leaks_count = snapshot->LeakCount();
+        Report(L"Visual Leak Detector detected %Iu memory leak%s in heap " ADDRESSFORMAT L"\n",
+            leaks_count, (leaks_count > 1) ? L"s" : L"", ordered->heap);
 
-        if (threadId != ((DWORD)-1) && info->threadId != threadId)
-            continue;
+        deferredheap_t *next = ordered->next;
+        delete snapshot;
+        delete ordered;
+        ordered = next;
+    }
+}
 
-        if (isDebugCrtAlloc(block, info)) {
-            // This block is allocated to a CRT heap, so the block has a CRT
-            // memory block header pretended to it.
-            int blockUse = getCrtBlockUse(block, info->ucrt);
-            // Leaks identified as CRT_USE_IGNORE should not be ignored here otherwise
-            // DynamicLoader/Thread test will randomly fail with less leaks being reported.
-            if (CRT_USE_TYPE(blockUse) == CRT_USE_FREE ||
-                CRT_USE_TYPE(blockUse) == CRT_USE_INTERNAL) {
-                // This block is marked as being used internally by the CRT.
-                // The CRT will free the block after VLD is destroyed.
-                continue;
-            }
-        }
+// ReportLeaksAsync - Reports the leaks like ReportLeaks, in the layout of the
+//   full text report, but only finds them (and copies what the report shows
+//   of them) while the heap maps are locked. Resolving the call stacks and
+//   writing the report is left to a background thread; see asyncReportProc.
+//   If the thread can't be started, the report is written right away.
+//
+//  - callback (IN): Called by the thread once the report has been written,
+//      or NULL.
+//
+//  - context (IN): Passed to the callback.
+//
+//  Return Value:
+//
+//    Returns the number of leaks to be reported, or -1 if the previous
+//    asynchronous report is still being written.
+//
+SIZE_T VisualLeakDetector::ReportLeaksAsync (VLD_REPORT_CALLBACK callback, LPVOID context)
+{
+    LoaderLock ll;
 
-        if (m_options & VLD_OPT_SKIP_CRTSTARTUP_LEAKS) {
-            // Check for crt startup allocations
-            if (info->callStack && info->callStack->isCrtStartupAlloc()) {
-                info->reported = true;
-                continue;
-            }
-        }
+    if (m_options & VLD_OPT_VLDOFF) {
+        // VLD has been turned off.
+        return 0;
+    }
+
+    if (m_asyncReportThread != NULL) {
+        if (WaitForSingleObject(m_asyncReportThread, 0) != WAIT_OBJECT_0)
+            return (SIZE_T)-1;
+        CloseHandle(m_asyncReportThread);
+        m_asyncReportThread = NULL;
+        m_asyncReportThreadId = 0;
+    }
 
-        memoryleaks ++;
+    LeakSnapshot *snapshot = new LeakSnapshot(callback, context);
+    flushAllPendingBlocks();
+    {
+        CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+        m_estimatedLeakBytes = 0;
+        m_reportStats.reports++;
+        bool firstLeak = true;
+        DuplicateIndex duplicates;
+        for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
+            heapinfo_t* heapinfo = (*heapit).second;
+            reportLeaks(heapinfo, firstLeak, duplicates, (DWORD)-1, (SIZE_T)-1, snapshot);
+        }
     }
 
-    return memoryleaks;
+    SIZE_T leaksCount = snapshot->LeakCount();
+    m_asyncReport = snapshot;
+    m_asyncReportStop = FALSE;
+    m_asyncReportThread = CreateThread(NULL, 0, asyncReportProc, this, CREATE_SUSPENDED, &m_asyncReportThreadId);
+    if (m_asyncReportThread == NULL) {
+        m_asyncReportThreadId = 0;
+        asyncReportProc(this);
+        return leaksCount;
+    }
+    // Symbolizing is what takes long; the program comes first.
+    SetThreadPriority(m_asyncReportThread, THREAD_PRIORITY_BELOW_NORMAL);
+    ResumeThread(m_asyncReportThread);
+    return leaksCount;
 }
 
-// reportleaks - Generates a memory leak report for the specified heap.
+// stopAsyncReport - Abandons the asynchronous report being written, if any,
+//   and frees its snapshot. Like stopSymbolPrefetch, this never waits for the
+//   thread, which may be waiting for the loader lock held by the caller; it
+//   exits as soon as it sees that it has been stopped, without touching the
+//   snapshot again.
 //
-//  - heap (IN): Handle to the heap for which to generate a memory leak
-//      report.
+//   Note: The caller must hold the loader lock.
 //
 //  Return Value:
 //
 //    None.
 //
-SIZE_T VisualLeakDetector::reportHeapLeaks (HANDLE heap)
+VOID VisualLeakDetector::stopAsyncReport ()
 {
-    assert(heap != NULL);
+    m_asyncReportStop = TRUE;
+    delete m_asyncReport;
+    m_asyncReport = NULL;
+    if (m_asyncReportThread == NULL)
+        return;
 
-    // Find the heap's information (blockmap, etc).
-    CriticalSectionLocker<> cs(g_heapMapLock);
-    HeapMap::Iterator heapit = m_heapMap->find(heap);
-    if (heapit == m_heapMap->end()) {
-        // Nothing is allocated from this heap. No leaks.
+    CloseHandle(m_asyncReportThread);
+    m_asyncReportThread = NULL;
+    m_asyncReportThreadId = 0;
+}
+
+// asyncReportProc - Prints the leaks of the asynchronous report, then calls
+//   its callback. Each leak is printed under the loader lock, as a report
+//   from the program would be, so the lock is only held for as long as one
+//   leak takes to resolve and print.
+//
+//  - param (IN): The VisualLeakDetector.
+//
+//  Return Value:
+//
+//    Always returns 0.
+//
+DWORD WINAPI VisualLeakDetector::asyncReportProc (LPVOID param)
+{
+    VisualLeakDetector *vld = (VisualLeakDetector*)param;
+    VLD_REPORT_CALLBACK callback;
+    LPVOID context;
+    SIZE_T leaksCount;
+    bool firstLeak = true;
+    for (SIZE_T index = 0; ; index++) {
+        LoaderLock ll;
+        if (vld->m_asyncReportStop)
+            return 0;
+        LeakSnapshot *snapshot = vld->m_asyncReport;
+        if (index < snapshot->Count()) {
+            vld->printLeak(snapshot->Entry(index), firstLeak, vld->m_reportStats);
+            continue;
+        }
+
+        FlushReport();
+        callback = snapshot->Callback();
+        context = snapshot->Context();
+        leaksCount = snapshot->LeakCount();
+        vld->m_asyncReport = NULL;
+        delete snapshot;
+        break;
+    }
+
+    // The callback may call back into VLD, so it isn't called under the
+    // loader lock.
+    if (callback != NULL)
+        callback((UINT)leaksCount, context);
+    return 0;
+}
+
+SIZE_T VisualLeakDetector::ReportThreadLeaks( DWORD threadId )
+{
+    if (m_options & VLD_OPT_VLDOFF) {
+        // VLD has been turned off.
+        return 0;
+    }
+
+    // The thread's leak count tells whether there is anything to report,
+    // without walking the blocks of every thread (see countLeaks).
+    if (countLeaks(threadId) == 0) {
+        m_estimatedLeakBytes = 0;
         return 0;
     }
+    WORD index = findThreadIndex(threadId);
+
+    TraceLoggingWrite(g_vldTraceProvider, "Report",
+        TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+        TraceLoggingKeyword(VLD_TRACE_KEYWORD_REPORT),
+        TraceLoggingOpcode(WINEVENT_OPCODE_START),
+        TraceLoggingUInt32(threadId, "ThreadId"));
+
+    // Generate a memory leak report for each heap in the process.
+    SIZE_T leaksCount = 0;
+    nameRunningThreads();
+    CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+    m_estimatedLeakBytes = 0;
+    m_reportStats.reports++;
+    if (m_options & (VLD_OPT_REPORT_JSON | VLD_OPT_REPORT_CSV)) {
+        leaksCount = writeStructuredReport(threadId);
+    }
+    else if (m_options & VLD_OPT_SUMMARY_REPORT) {
+        leaksCount = reportLeakSummary(threadId);
+    }
+    else {
+        // Every block reported is counted as one of the thread's leaks, so
+        // the walk can stop once that many have been reported. Aggregated
+        // duplicates may belong to other threads, so they can't be told
+        // apart.
+        SIZE_T remaining = (SIZE_T)-1;
+        if (!(m_options & VLD_OPT_AGGREGATE_DUPLICATES))
+            remaining = (SIZE_T)getThreadLeaks(index).count;
+        bool firstLeak = true;
+        DuplicateIndex duplicates;
+        for (HeapMap::Iterator heapit = m_heapMap->begin(); (heapit != m_heapMap->end()) && (remaining > 0); ++heapit) {
+            HANDLE heap = (*heapit).first;
+            UNREFERENCED_PARAMETER(heap);
+            heapinfo_t* heapinfo = (*heapit).second;
+            SIZE_T found = reportLeaks(heapinfo, firstLeak, duplicates, threadId, remaining);
+            leaksCount += found;
+            if (remaining != (SIZE_T)-1)
+                remaining -= found;
+        }
+    }
+    FlushReport();
+
+    TraceLoggingWrite(g_vldTraceProvider, "Report",
+        TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+        TraceLoggingKeyword(VLD_TRACE_KEYWORD_REPORT),
+        TraceLoggingOpcode(WINEVENT_OPCODE_STOP),
+        TraceLoggingUInt64(leaksCount, "Leaks"));
+    return leaksCount;
+}
+
+VOID VisualLeakDetector::MarkAllLeaksAsReported( )
+{
+    if (m_options & VLD_OPT_VLDOFF) {
+        // VLD has been turned off.
+        return;
+    }
+
+    // Every block allocated so far counts as reported from now on, including
+    // any still pending. Holding every shard keeps the leak counters from
+    // changing while they are reset.
+    CriticalSectionLocker<> tlscs(m_tlsLock);
+    CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+    m_reportedMark = serialMark();
+    m_leakCount = 0;
+    m_unclassifiedLeaks = 0;
+    for (UINT index = 0; index < m_threadCount; index++)
+        getThreadLeaks((WORD)index).count = 0;
+    for (UINT page = 0; page < MODULEIMAGES_PAGES; page++) {
+        if (m_moduleCounters[page] == NULL)
+            continue;
+        for (UINT index = 0; index < MODULEIMAGES_PAGE_SIZE; index++)
+            m_moduleCounters[page][index].leaks = 0;
+    }
+}
+
+VOID VisualLeakDetector::MarkThreadLeaksAsReported( DWORD threadId )
+{
+    if (m_options & VLD_OPT_VLDOFF) {
+        // VLD has been turned off.
+        return;
+    }
+
+    WORD index = findThreadIndex(threadId);
+    if (index == 0)
+        return;
+
+    // Every block the thread has allocated so far counts as reported from
+    // now on (see MarkAllLeaksAsReported).
+    CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+    threadleaks_t &leaks = getThreadLeaks(index);
+    leaks.reportedMark = serialMark();
+    InterlockedExchangeAddSizeT(&m_leakCount, (SIZE_T)0 - (SIZE_T)leaks.count);
+    leaks.count = 0;
+}
+
+void VisualLeakDetector::ChangeModuleState(HMODULE module, bool on)
+{
+    ModuleSet::Iterator  moduleit;
+
+    CriticalSectionLocker<> cs(m_modulesLock);
+    moduleit = m_loadedModules->begin();
+    while( moduleit != m_loadedModules->end() )
+    {
+        if ( (*moduleit).addrLow == (UINT_PTR)module)
+        {
+            moduleinfo_t *mod = (moduleinfo_t *)&(*moduleit);
+            if ( on )
+                mod->flags &= ~(VLD_MODULE_EXCLUDED | VLD_MODULE_AUTOEXCLUDED);
+            else
+                mod->flags |= VLD_MODULE_EXCLUDED;
+
+            publishModuleRanges();
+            break;
+        }
+        ++moduleit;
+    }
+}
+
+void VisualLeakDetector::EnableModule(HMODULE module)
+{
+    if (m_options & VLD_OPT_VLDOFF) {
+        // VLD has been turned off.
+        return;
+    }
 
-    Set<blockinfo_t*> aggregatedLeaks;
-    heapinfo_t* heapinfo = (*heapit).second;
-    // Generate a memory leak report for heap.
-    bool firstLeak = true;
-    SIZE_T leaks_count = reportLeaks(heapinfo, firstLeak, aggregatedLeaks);
-
-    // Show a summary.
-    if (leaks_count != 0) {
-        Report(L"Visual Leak Detector detected %Iu memory leak%s in heap " ADDRESSFORMAT L"\n",
-            leaks_count, (leaks_count > 1) ? L"s" : L"", heap);
-     }
-    return leaks_count;
+    ChangeModuleState(module,true);
 }
 
-int VisualLeakDetector::getCrtBlockUse(LPCVOID block, bool ucrt)
+void VisualLeakDetector::DisableModule(HMODULE module)
 {
-    if (!ucrt)
-    {
-        crtdbgblockheader_t* crtheader = (crtdbgblockheader_t*)block;
-        return crtheader->use;
-    }
-    else
-    {
-        crtdbgblockheaderucrt_t* crtheader = (crtdbgblockheaderucrt_t*)block;
-        return crtheader->use;
+    if (m_options & VLD_OPT_VLDOFF) {
+        // VLD has been turned off.
+        return;
     }
+
+    ChangeModuleState(module,false);
 }
 
-size_t VisualLeakDetector::getCrtBlockSize(LPCVOID block, bool ucrt)
+void VisualLeakDetector::DisableLeakDetection ()
 {
-    if (!ucrt)
-    {
-        crtdbgblockheader_t* crtheader = (crtdbgblockheader_t*)block;
-        return crtheader->size;
-    }
-    else
-    {
-        crtdbgblockheaderucrt_t* crtheader = (crtdbgblockheaderucrt_t*)block;
-        return crtheader->size;
+    tls_t *tls;
+
+    if (m_options & VLD_OPT_VLDOFF) {
+        // VLD has been turned off.
+        return;
     }
+
+    // Disable memory leak detection for the current thread. There are two flags
+    // because if neither flag is set, it means that we are in the default or
+    // "starting" state, which could be either enabled or disabled depending on
+    // the configuration.
+    tls = getTls();
+    tls->oldFlags = tls->flags;
+    tls->flags &= ~VLD_TLS_ENABLED;
+    tls->flags |= VLD_TLS_DISABLED;
 }
 
-SIZE_T VisualLeakDetector::reportLeaks (heapinfo_t* heapinfo, bool &firstLeak, Set<blockinfo_t*> &aggregatedLeaks, DWORD threadId)
+void VisualLeakDetector::EnableLeakDetection ()
 {
-    BlockMap* blockmap   = &heapinfo->blockMap;
-    SIZE_T leaksFound = 0;
+    if (m_options & VLD_OPT_VLDOFF) {
+        // VLD has been turned off.
+        return;
+    }
 
-    for (BlockMap::Iterator blockit = blockmap->begin(); blockit != blockmap->end(); ++blockit)
-    {
-        // Found a block which is still in the BlockMap. We've identified a
-        // potential memory leak.
-        LPCVOID block = (*blockit).first;
-        blockinfo_t* info = (*blockit).second;
-        if (info->reported)
-            continue;
+    tls_t *tls;
 
-        if (threadId != ((DWORD)-1) && info->threadId != threadId)
-            continue;
+    // Enable memory leak detection for the current thread.
+    tls = getTls();
+    tls->oldFlags = tls->flags;
+    tls->flags &= ~VLD_TLS_DISABLED;
+    tls->flags |= VLD_TLS_ENABLED;
+    m_status &= ~VLD_STATUS_NEVER_ENABLED;
+    InterlockedOr(&m_tracking, VLD_TRACKING_ALLOCS);
+}
 
-        Set<blockinfo_t*>::Iterator it = aggregatedLeaks.find(info);
-        if (it != aggregatedLeaks.end())
-            continue;
+void VisualLeakDetector::RestoreLeakDetectionState ()
+{
+    tls_t *tls;
 
-        LPCVOID address = block;
-        SIZE_T size = info->size;
+    if (m_options & VLD_OPT_VLDOFF) {
+        // VLD has been turned off.
+        return;
+    }
 
-        if (isDebugCrtAlloc( block, info )) {
-            // This block is allocated to a CRT heap, so the block has a CRT
-            // memory block header pretended to it.
-            int blockUse = getCrtBlockUse( block, info->ucrt );
-            // Leaks identified as CRT_USE_IGNORE should not be ignored here otherwise
-            // DynamicLoader/Thread test will randomly fail with less leaks being reported.
-            if (CRT_USE_TYPE(blockUse) == CRT_USE_FREE ||
-                CRT_USE_TYPE(blockUse) == CRT_USE_INTERNAL)
-            {
-                // This block is marked as being used internally by the CRT.
-                // The CRT will free the block after VLD is destroyed.
-                continue;
-            }
+    // Restore state memory leak detection for the current thread.
+    tls = getTls();
+    tls->flags &= ~(VLD_TLS_DISABLED | VLD_TLS_ENABLED);
+    tls->flags |= tls->oldFlags & (VLD_TLS_DISABLED | VLD_TLS_ENABLED);
+    if (!(tls->flags & VLD_TLS_DISABLED))
+        InterlockedOr(&m_tracking, VLD_TRACKING_ALLOCS);
+}
 
-            // The CRT header is more or less transparent to the user, so
-            // the information about the contained block will probably be
-            // more useful to the user. Accordingly, that's the information
-            // we'll include in the report.
-            address = CRTDBGBLOCKDATA(block);
-            size = getCrtBlockSize(block, info->ucrt);
-        }
+void VisualLeakDetector::GlobalDisableLeakDetection ()
+{
+    if (m_options & VLD_OPT_VLDOFF) {
+        // VLD has been turned off.
+        return;
+    }
 
-        if (m_options & VLD_OPT_SKIP_CRTSTARTUP_LEAKS) {
-            // Check for crt startup allocations
-            if (info->callStack && info->callStack->isCrtStartupAlloc()) {
-                info->reported = true;
-                continue;
-            }
-        }
+    CriticalSectionLocker<> cs(m_optionsLock);
+    m_options |= VLD_OPT_START_DISABLED;
 
-        // It looks like a real memory leak.
-        if (firstLeak) { // A confusing way to only display this message once
-            Report(L"WARNING: Visual Leak Detector detected memory leaks!\n");
-            firstLeak = false;
-        }
-        SIZE_T blockLeaksCount = 1;
-        Report(L"---------- Block %Iu at " ADDRESSFORMAT L": %Iu bytes ----------\n", info->serialNumber, address, size);
-#ifdef _DEBUG
-        if (info->debugCrtAlloc)
-        {
-            crtdbgblockheader_t* crtheader = (crtdbgblockheader_t*)block;
-            Report(L"  CRT Alloc ID: %Iu\n", crtheader->request);
-            assert(size == getCrtBlockSize(block, info->ucrt));
-        }
-#endif
-        assert(info->callStack);
-        if (m_options & VLD_OPT_AGGREGATE_DUPLICATES) {
-            // Aggregate all other leaks which are duplicates of this one
-            // under this same heading, to cut down on clutter.
-            SIZE_T erased = eraseDuplicates(blockit, aggregatedLeaks);
+    // Disable memory leak detection for all threads.
+    CriticalSectionLocker<> cstls(m_tlsLock);
+    TlsMap::Iterator     tlsit;
+    for (tlsit = m_tlsMap->begin(); tlsit != m_tlsMap->end(); ++tlsit) {
+        (*tlsit).second->oldFlags = (*tlsit).second->flags;
+        (*tlsit).second->flags &= ~VLD_TLS_ENABLED;
+        (*tlsit).second->flags |= VLD_TLS_DISABLED;
+    }
 
-            // add only the number that were erased, since the 'one left over'
-            // is already recorded as a leak
-            blockLeaksCount += erased;
-        }
+    // Until a thread is enabled again, the allocation hooks return at once.
+    InterlockedAnd(&m_tracking, ~VLD_TRACKING_ALLOCS);
+}
 
-        DWORD callstackCRC = 0;
-        if (info->callStack)
-            callstackCRC = CalculateCRC32(info->size, info->callStack->getHashValue());
-        Report(L"  Leak Hash: 0x%08X, Count: %Iu, Total %Iu bytes\n", callstackCRC, blockLeaksCount, size * blockLeaksCount);
-        leaksFound += blockLeaksCount;
+void VisualLeakDetector::GlobalEnableLeakDetection ()
+{
+    if (m_options & VLD_OPT_VLDOFF) {
+        // VLD has been turned off.
+        return;
+    }
 
-        // Dump the call stack.
-        if (blockLeaksCount == 1)
-            Report(L"  Call Stack (TID %u):\n", info->threadId);
-        else
-            Report(L"  Call Stack:\n");
-        if (info->callStack)
-            info->callStack->dump(m_options & VLD_OPT_TRACE_INTERNAL_FRAMES);
+    CriticalSectionLocker<> cs(m_optionsLock);
+    m_options &= ~VLD_OPT_START_DISABLED;
+    m_status &= ~VLD_STATUS_NEVER_ENABLED;
+    InterlockedOr(&m_tracking, VLD_TRACKING_ALLOCS);
 
-        // Dump the data in the user data section of the memory block.
-        if (m_maxDataDump != 0) {
-            Report(L"  Data:\n");
-            if (m_options & VLD_OPT_UNICODE_REPORT) {
-                DumpMemoryW(address, (m_maxDataDump < size) ? m_maxDataDump : size);
-            }
-            else {
-                DumpMemoryA(address, (m_maxDataDump < size) ? m_maxDataDump : size);
-            }
-        }
-        Report(L"\n\n");
+    // Enable memory leak detection for all threads.
+    CriticalSectionLocker<> cstls(m_tlsLock);
+    TlsMap::Iterator     tlsit;
+    for (tlsit = m_tlsMap->begin(); tlsit != m_tlsMap->end(); ++tlsit) {
+        (*tlsit).second->oldFlags = (*tlsit).second->flags;
+        (*tlsit).second->flags &= ~VLD_TLS_DISABLED;
+        (*tlsit).second->flags |= VLD_TLS_ENABLED;
     }
+}
 
-    return leaksFound;
+CONST UINT32 OptionsMask = VLD_OPT_AGGREGATE_DUPLICATES | VLD_OPT_MODULE_LIST_INCLUDE |
+    VLD_OPT_SAFE_STACK_WALK | VLD_OPT_UNWIND_STACK_WALK | VLD_OPT_FRAME_STACK_WALK |
+    VLD_OPT_SLOW_DEBUGGER_DUMP | VLD_OPT_START_DISABLED |
+    VLD_OPT_TRACE_INTERNAL_FRAMES | VLD_OPT_SKIP_HEAPFREE_LEAKS | VLD_OPT_VALIDATE_HEAPFREE |
+    VLD_OPT_SKIP_CRTSTARTUP_LEAKS | VLD_OPT_SUMMARY_REPORT | VLD_OPT_SUMMARY_BY_COUNT;
+
+UINT32 VisualLeakDetector::GetOptions()
+{
+    CriticalSectionLocker<> cs(m_optionsLock);
+    return m_options & OptionsMask;
 }
 
-VOID VisualLeakDetector::markAllLeaksAsReported (heapinfo_t* heapinfo, DWORD threadId)
+void VisualLeakDetector::SetOptions(UINT32 option_mask, SIZE_T maxDataDump, UINT32 maxTraceFrames)
 {
-    BlockMap* blockmap   = &heapinfo->blockMap;
+    if (m_options & VLD_OPT_VLDOFF) {
+        // VLD has been turned off.
+        return;
+    }
 
-    for (BlockMap::Iterator blockit = blockmap->begin(); blockit != blockmap->end(); ++blockit)
     {
-        blockinfo_t* info = (*blockit).second;
-        if (threadId == ((DWORD)-1) || info->threadId == threadId)
-            info->reported = true;
-    }
+        CriticalSectionLocker<> cs(m_optionsLock);
+        m_options &= ~OptionsMask; // clear used bits
+        m_options |= option_mask & OptionsMask;
+
+        m_maxDataDump = maxDataDump;
+
+        m_options |= option_mask & VLD_OPT_START_DISABLED;
+        if (m_options & VLD_OPT_START_DISABLED)
+            GlobalDisableLeakDetection();
+        else if (m_status & VLD_STATUS_INSTALLED)
+            InterlockedOr(&m_tracking, VLD_TRACKING_ALLOCS);
+    }
+
+    // The stack walk method and depth are part of the capture policy, which
+    // also updates the options' stack walk bits.
+    // As before, "none" and "caller" beat the methods which walk the stack.
+    capturepolicy_t policy = *m_capturePolicy;
+    const UINT32 nowalk = VLD_OPT_NO_STACK_WALK | VLD_OPT_CALLER_STACK_WALK;
+    policy.walkMethod = (m_options & nowalk) ? (m_options & nowalk) : (m_options & VLD_STACK_WALK_OPTIONS);
+    policy.maxTraceFrames = (maxTraceFrames < 1) ? VLD_DEFAULT_MAX_TRACE_FRAMES : maxTraceFrames;
+    publishCapturePolicy(policy);
 }
 
-// FindAllocedBlock - Find if a particular memory allocation is tracked inside of VLD.
-//     This is a really good example of how to iterate through the data structures
-//     that represent heaps and their associated memory blocks.
-// Pre Condition: Be VERY sure that this is only called within a block that already has
-// acquired a critical section for m_maplock.
-//
-// mem - The particular memory address to search for.
-//
-//  Return Value:
-//   If mem is found, it will return the blockinfo_t pointer, otherwise NULL
-//
-blockinfo_t* VisualLeakDetector::findAllocedBlock(LPCVOID mem, __out HANDLE& heap)
+void VisualLeakDetector::SetModulesList(CONST WCHAR *modules, BOOL includeModules)
 {
-    heap = NULL;
-    blockinfo_t* result = NULL;
-    // Iterate through all heaps
-    CriticalSectionLocker<> cs(g_heapMapLock);
-    for (HeapMap::Iterator it = m_heapMap->begin();
-        it != m_heapMap->end();
-        ++it)
-    {
-        HANDLE heap_handle  = (*it).first;
-        (heap_handle); // unused
-        heapinfo_t* heapPtr = (*it).second;
-
-        // Iterate through all memory blocks in each heap
-        BlockMap& p_block_map = heapPtr->blockMap;
-        for (BlockMap::Iterator iter = p_block_map.begin();
-            iter != p_block_map.end();
-            ++iter)
-        {
-            if ((*iter).first == mem)
-            {
-                // Found the block.
-                blockinfo_t* alloc_block = (*iter).second;
-                heap = heap_handle;
-                result = alloc_block;
-                break;
-            }
-        }
+    if (m_options & VLD_OPT_VLDOFF) {
+        // VLD has been turned off.
+        return;
+    }
 
-        if (result)
-        {
-            break;
-        }
+    CriticalSectionLocker<> cs(m_optionsLock);
+    wcsncpy_s(m_forcedModuleList, MAXMODULELISTLENGTH, modules, _TRUNCATE);
+    _wcslwr_s(m_forcedModuleList, MAXMODULELISTLENGTH);
+    if (includeModules)
+        m_options |= VLD_OPT_MODULE_LIST_INCLUDE;
+    else
+        m_options &= ~VLD_OPT_MODULE_LIST_INCLUDE;
+}
+
+bool VisualLeakDetector::GetModulesList(WCHAR *modules, UINT size)
+{
+    if (m_options & VLD_OPT_VLDOFF) {
+        // VLD has been turned off.
+        modules[0] = '\0';
+        return true;
     }
 
-    return result;
+    CriticalSectionLocker<> cs(m_optionsLock);
+    wcsncpy_s(modules, size, m_forcedModuleList, _TRUNCATE);
+    return (m_options & VLD_OPT_MODULE_LIST_INCLUDE) > 0;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-//
-// Static Leak Detection Functions (Callbacks)
-//
-////////////////////////////////////////////////////////////////////////////////
+void VisualLeakDetector::GetReportFilename(WCHAR *filename)
+{
+    if (m_options & VLD_OPT_VLDOFF) {
+        // VLD has been turned off.
+        m_reportFilePath[0] = '\0';
+        return;
+    }
 
-// addloadedmodule - Callback function for EnumerateLoadedModules64. This
-//   function records information about every module loaded in the process,
-//   each time adding the module's information to the provided ModuleSet (the
-//   "context" parameter).
-//
-//   When EnumerateLoadedModules64 has finished calling this function for each
-//   loaded module, then the resulting ModuleSet can be used at any time to get
-//   information about any modules loaded into the process.
-//
-//   - modulepath (IN): The fully qualified path from where the module was
-//       loaded.
-//
-//   - modulebase (IN): The base address at which the module has been loaded.
-//
-//   - modulesize (IN): The size, in bytes, of the loaded module.
-//
-//   - context (IN): Pointer to the ModuleSet to which information about each
-//       module is to be added.
-//
-//  Return Value:
-//
-//    Always returns TRUE, which tells EnumerateLoadedModules64 to continue
-//    enumerating.
-//
-BOOL VisualLeakDetector::addLoadedModule (PCWSTR modulepath, DWORD64 modulebase, ULONG modulesize, PVOID context)
+    CriticalSectionLocker<> cs(m_optionsLock);
+    wcsncpy_s(filename, MAX_PATH, m_reportFilePath, _TRUNCATE);
+}
+
+void VisualLeakDetector::SetReportOptions(UINT32 option_mask, CONST WCHAR *filename)
 {
-    vldstring modulepathw(modulepath);
+    if (m_options & VLD_OPT_VLDOFF) {
+        // VLD has been turned off.
+        return;
+    }
 
-    // Extract just the filename and extension from the module path.
-    WCHAR filename [_MAX_FNAME];
-    WCHAR extension [_MAX_EXT];
-    _wsplitpath_s(modulepathw.c_str(), NULL, 0, NULL, 0, filename, _MAX_FNAME, extension, _MAX_EXT);
+    CriticalSectionLocker<> cs(m_optionsLock);
+    m_options &= ~(VLD_OPT_REPORT_TO_DEBUGGER | VLD_OPT_REPORT_TO_FILE | VLD_OPT_REPORT_TO_STDOUT |
+        VLD_OPT_UNICODE_REPORT | VLD_OPT_UTF8_REPORT | VLD_OPT_REPORT_TO_BINARY | VLD_OPT_REPORT_JSON |
+        VLD_OPT_REPORT_CSV); // clear used bits
+
+    m_options |= option_mask & VLD_OPT_REPORT_TO_DEBUGGER;
+    if ( (option_mask & VLD_OPT_REPORT_TO_FILE) && ( filename != NULL ))
+    {
+        wcsncpy_s(m_reportFilePath, MAX_PATH, filename, _TRUNCATE);
+        m_options |= option_mask & VLD_OPT_REPORT_TO_FILE;
+    }
+    else if ( (option_mask & VLD_OPT_REPORT_TO_BINARY) && ( filename != NULL ))
+    {
+        wcsncpy_s(m_reportFilePath, MAX_PATH, filename, _TRUNCATE);
+        m_options |= VLD_OPT_REPORT_TO_BINARY;
+    }
+    else if ( (option_mask & (VLD_OPT_REPORT_JSON | VLD_OPT_REPORT_CSV)) && ( filename != NULL ))
+    {
+        wcsncpy_s(m_reportFilePath, MAX_PATH, filename, _TRUNCATE);
+        m_options |= option_mask & VLD_OPT_REPORT_FOLDED;
+    }
+    m_options |= option_mask & VLD_OPT_REPORT_TO_STDOUT;
+    m_options |= option_mask & VLD_OPT_UNICODE_REPORT;
+    if (!(m_options & VLD_OPT_UNICODE_REPORT))
+        m_options |= option_mask & VLD_OPT_UTF8_REPORT;
 
-    vldstring modulename(filename);
-    modulename.append(extension);
-    _wcslwr_s(&modulename[0], modulename.size() + 1);
+    if ((m_options & VLD_OPT_UNICODE_REPORT) &&
+        !(m_options & (VLD_OPT_REPORT_TO_FILE | VLD_OPT_REPORT_TO_BINARY | VLD_OPT_REPORT_JSON | VLD_OPT_REPORT_CSV))) {
+        // If Unicode report encoding is enabled, then the report needs to be
+        // sent to a file because the debugger will not display Unicode
+        // characters, it will display question marks in their place instead.
+        m_options |= VLD_OPT_REPORT_TO_FILE;
+        m_status |= VLD_STATUS_FORCE_REPORT_TO_FILE;
+    }
 
-    if (_wcsicmp(modulename.c_str(), TEXT(VLDDLL)) == 0) {
-        // Record Visual Leak Detector's own base address.
-        g_vld.m_vldBase = (HMODULE)modulebase;
+    if (m_options & VLD_OPT_REPORT_TO_FILE) {
+        setupReporting();
+    }
+    else if (m_reportFile.IsOpen()) { //Close the previous report file if needed.
+        FinishReportFile();
+        SetReportFile(NULL, TRUE, m_options & VLD_OPT_REPORT_TO_STDOUT, FALSE);
+        m_reportFile.Close();
     }
     else {
-        LPSTR modulenamea;
-        ConvertModulePathToAscii(modulename.c_str(), &modulenamea);
+        closeReportPipe();
+    }
+}
 
-        // See if this is a module listed in the patch table. If it is, update
-        // the corresponding patch table entries' module base address.
-        UINT          tablesize = _countof(m_patchTable);
-        for (UINT index = 0; index < tablesize; index++) {
-            moduleentry_t *entry = &m_patchTable[index];
-            if (_stricmp(entry->exportModuleName, modulenamea) == 0) {
-                entry->moduleBase = (UINT_PTR)modulebase;
-            }
-        }
+int VisualLeakDetector::SetReportHook(int mode, VLD_REPORT_HOOK pfnNewHook)
+{
+    if (m_options & VLD_OPT_VLDOFF || pfnNewHook == NULL) {
+        // VLD has been turned off.
+        return -1;
+    }
+    CriticalSectionLocker<> cs(m_optionsLock);
+    if (mode == VLD_RPTHOOK_INSTALL)
+    {
+        ReportHookSet::Iterator it = g_pReportHooks->insert(pfnNewHook);
+        return (it != g_pReportHooks->end()) ? 0 : -1;
+    }
+    else if (mode == VLD_RPTHOOK_REMOVE)
+    {
+        g_pReportHooks->erase(pfnNewHook);
+        return 0;
+    }
+    return -1;
+}
 
-        delete [] modulenamea;
+void VisualLeakDetector::setupReporting()
+{
+    //Close the previous report file if needed.
+    if (m_reportFile.IsOpen()) {
+        FinishReportFile();
+        SetReportFile(NULL, TRUE, m_options & VLD_OPT_REPORT_TO_STDOUT, FALSE);
+        m_reportFile.Close();
     }
+    closeReportPipe();
 
-    // Record the module's information and store it in the set.
-    moduleinfo_t  moduleinfo;
-    moduleinfo.addrLow  = (UINT_PTR)modulebase;
-    moduleinfo.addrHigh = (UINT_PTR)(modulebase + modulesize) - 1;
-    moduleinfo.flags    = 0x0;
-    moduleinfo.name     = modulename;
-    moduleinfo.path     = modulepathw;
+    // A report file naming a pipe streams the report to the pipe instead.
+    if (IsNamedPipePath(m_reportFilePath)) {
+        setupReportPipe();
+        return;
+    }
 
-    ModuleSet*    newmodules = (ModuleSet*)context;
-    newmodules->insert(moduleinfo);
+    // A report file named *.gz is written gzip compressed.
+    size_t pathLength = wcslen(m_reportFilePath);
+    BOOL compress = (pathLength > 3) && (_wcsicmp(m_reportFilePath + pathLength - 3, L".gz") == 0);
 
-    return TRUE;
+    // Reporting to file enabled.
+    if (m_options & VLD_OPT_UNICODE_REPORT) {
+        // Unicode data encoding has been enabled. Open the file for binary
+        // writing; SetReportFile writes the byte-order mark before anything
+        // else gets written to the file.
+        if (m_reportFile.Open(m_reportFilePath, FALSE)) {
+            SetReportEncoding(unicode);
+        }
+    }
+    else {
+        // Open the file in text mode for ASCII (or UTF-8) output, or in
+        // binary mode if it is compressed.
+        if (m_reportFile.Open(m_reportFilePath, !compress)) {
+            SetReportEncoding((m_options & VLD_OPT_UTF8_REPORT) ? utf8 : ascii);
+        }
+    }
+    if (!m_reportFile.IsOpen()) {
+        Report(L"WARNING: Visual Leak Detector: Couldn't open report file for writing: %s\n"
+            L"  The report will be sent to the debugger instead.\n", m_reportFilePath);
+    }
+    else {
+        // Set the "report" function to write to the file.
+        if (!SetReportFile(&m_reportFile, m_options & VLD_OPT_REPORT_TO_DEBUGGER, m_options & VLD_OPT_REPORT_TO_STDOUT,
+            compress)) {
+            Report(L"WARNING: Visual Leak Detector: Couldn't compress the report file; it is written uncompressed.\n");
+        }
+    }
 }
 
-// detachfrommodule - Callback function for EnumerateLoadedModules64 that
-//   detaches Visual Leak Detector from the specified module. If the specified
-//   module has not previously been attached to, then calling this function will
-//   not actually result in any changes.
-//
-//  - modulepath (IN): String containing the name, which may include a path, of
-//      the module to detach from (ignored).
-//
-//  - modulebase (IN): Base address of the module.
-//
-//  - modulesize (IN): Total size of the module (ignored).
-//
-//  - context (IN): User-supplied context (ignored).
+// setupReportPipe - Connects to the named pipe the report file path names, as
+//   the client, and streams the report to it. Text the pipe's reader doesn't
+//   take in time is dropped rather than holding the program up (see
+//   SetReportPipe). If the pipe can't be connected to, the report is sent to
+//   the debugger instead.
 //
 //  Return Value:
 //
-//    Always returns TRUE.
+//    None.
 //
-BOOL VisualLeakDetector::detachFromModule (PCWSTR /*modulepath*/, DWORD64 modulebase, ULONG /*modulesize*/,
-    PVOID /*context*/)
+void VisualLeakDetector::setupReportPipe()
 {
-    UINT tablesize = _countof(m_patchTable);
-
-    RestoreModule((HMODULE)modulebase, m_patchTable, tablesize);
+    if (m_options & VLD_OPT_UNICODE_REPORT)
+        SetReportEncoding(unicode);
+    else
+        SetReportEncoding((m_options & VLD_OPT_UTF8_REPORT) ? utf8 : ascii);
 
-    return TRUE;
+    HANDLE pipe = CreateFileW(m_reportFilePath, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+    if ((pipe == INVALID_HANDLE_VALUE) && (GetLastError() == ERROR_PIPE_BUSY) &&
+        WaitNamedPipeW(m_reportFilePath, VLD_REPORT_PIPE_WAIT)) {
+        // The collector was busy connecting another process.
+        pipe = CreateFileW(m_reportFilePath, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+    }
+    if (pipe == INVALID_HANDLE_VALUE) {
+        Report(L"WARNING: Visual Leak Detector: Couldn't connect to the report pipe: %s\n"
+            L"  The report will be sent to the debugger instead.\n", m_reportFilePath);
+        return;
+    }
+    if (!SetReportPipe(pipe, m_options & VLD_OPT_REPORT_TO_DEBUGGER, m_options & VLD_OPT_REPORT_TO_STDOUT)) {
+        CloseHandle(pipe);
+        Report(L"WARNING: Visual Leak Detector: Couldn't write to the report pipe: %s\n"
+            L"  The report will be sent to the debugger instead.\n", m_reportFilePath);
+        return;
+    }
+    m_reportPipe = pipe;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-//
-// Win32 IAT Replacement Functions
-//
-////////////////////////////////////////////////////////////////////////////////
-
-// _GetProcAddress - Calls to GetProcAddress are patched through to this
-//   function. If the requested function is a function that has been patched
-//   through to one of VLD's handlers, then the address of VLD's handler
-//   function is returned instead of the real address. Otherwise, this
-//   function is just a wrapper around the real GetProcAddress.
-//
-//  - module (IN): Handle (base address) of the module from which to retrieve
-//      the address of an exported function.
-//
-//  - procname (IN): ANSI string containing the name of the exported function
-//      whose address is to be retrieved.
+// closeReportPipe - Writes out what is left of the report for the report
+//   pipe and disconnects from it. Further messages go to the debugger.
 //
 //  Return Value:
 //
-//    Returns a pointer to the requested function, or VLD's replacement for
-//    the function, if there is a replacement function.
+//    None.
 //
-FARPROC VisualLeakDetector::_GetProcAddress (HMODULE module, LPCSTR procname)
+void VisualLeakDetector::closeReportPipe()
 {
-    FARPROC original = g_vld._RGetProcAddress(module, procname);
-    if (original) {
-        // See if there is an entry in the patch table that matches the requested
-        // function.
-        UINT tablesize = _countof(g_vld.m_patchTable);
-        for (UINT index = 0; index < tablesize; index++) {
-            moduleentry_t *entry = &g_vld.m_patchTable[index];
-            if ((entry->moduleBase == 0x0) || ((HMODULE)entry->moduleBase != module)) {
-                // This patch table entry is for a different module.
-                continue;
-            }
+    if (m_reportPipe == NULL)
+        return;
 
-            patchentry_t *patchentry = entry->patchTable;
-            while (patchentry->importName) {
-                // This patch table entry is for the specified module. If the requested
-                // imports name matches the entry's import name (or ordinal), then
-                // return the address of the replacement instead of the address of the
-                // actual import.
-                if (HIWORD(patchentry->importName) == 0) {
-                    // Import name is a function ordinal value.
-                    if ((UINT_PTR)patchentry->importName == (UINT_PTR)procname) {
-                        if (patchentry->original != NULL)
-                            *patchentry->original = original;
-                        return (FARPROC)patchentry->replacement;
-                    }
-                } else {
-                    // Import name is a function name value.
-                    if (strcmp(patchentry->importName, procname) == 0) {
-                        if (patchentry->original != NULL)
-                            *patchentry->original = original;
-                        return (FARPROC)patchentry->replacement;
-                    }
-                }
-                patchentry++;
-            }
-        }
+    FinishReportFile();
+    UINT64 dropped = GetReportPipeDropped();
+    SetReportFile(NULL, TRUE, m_options & VLD_OPT_REPORT_TO_STDOUT, FALSE);
+    CloseHandle(m_reportPipe);
+    m_reportPipe = NULL;
+    if (dropped != 0) {
+        Report(L"WARNING: Visual Leak Detector: %llu bytes of the report were dropped, as the report pipe\n"
+            L"  wasn't read in time.\n", dropped);
     }
-    // The requested function is not a patched function. Just return the real
-    // address of the requested function.
-    return original;
 }
 
-FARPROC VisualLeakDetector::_RGetProcAddress(HMODULE module, LPCSTR procname)
-{
-    return m_GetProcAddress(module, procname);
-}
-
-// _GetProcAddress - Calls to GetProcAddress are patched through to this
-//   function. If the requested function is a function that has been patched
-//   through to one of VLD's handlers, then the address of VLD's handler
-//   function is returned instead of the real address. Otherwise, this
-//   function is just a wrapper around the real GetProcAddress.
-//
-//  - module (IN): Handle (base address) of the module from which to retrieve
-//      the address of an exported function.
-//
-//  - procname (IN): ANSI string containing the name of the exported function
-//      whose address is to be retrieved.
+// getAllocationCallStack - Obtains the call stack of an allocated block. The
+//   block is either at "alloc" itself or, for a CRT debug allocation, right
+//   before it, behind the CRT's header. Only the shards of those two
+//   addresses are entered, one at a time.
 //
-//  - caller (IN)
+//  - alloc (IN): Address of the block, as returned to the program.
 //
 //  Return Value:
 //
-//    Returns a pointer to the requested function, or VLD's replacement for
-//    the function, if there is a replacement function.
+//    Returns the block's call stack, with a reference held on it, or NULL if
+//    the block isn't tracked. Release the reference with
+//    CallStackTable::Release.
 //
-FARPROC VisualLeakDetector::_GetProcAddressForCaller(HMODULE module, LPCSTR procname, LPVOID caller)
+CallStack* VisualLeakDetector::getAllocationCallStack(void* alloc)
 {
-    FARPROC original = g_vld._RGetProcAddressForCaller(module, procname, caller);
-    if (original) {
-        // See if there is an entry in the patch table that matches the requested
-        // function.
-        UINT tablesize = _countof(g_vld.m_patchTable);
-        for (UINT index = 0; index < tablesize; index++) {
-            moduleentry_t *entry = &g_vld.m_patchTable[index];
-            if ((entry->moduleBase == 0x0) || ((HMODULE)entry->moduleBase != module)) {
-                // This patch table entry is for a different module.
+    LPCVOID blocks [2] = { alloc, (LPCVOID)((PBYTE)alloc - sizeof(crtdbgblockheader_t)) };
+    for (UINT index = 0; index < _countof(blocks); index++) {
+        LPCVOID block = blocks[index];
+        CriticalSectionLocker<> cs(g_heapMapLock.Shard(block));
+        for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
+            BlockMap& blockmap = (*heapit).second->blockMap;
+            BlockMap::Iterator blockit = blockmap.find(block);
+            if (blockit == blockmap.end())
                 continue;
-            }
 
-            patchentry_t *patchentry = entry->patchTable;
-            while (patchentry->importName) {
-                // This patch table entry is for the specified module. If the requested
-                // imports name matches the entry's import name (or ordinal), then
-                // return the address of the replacement instead of the address of the
-                // actual import.
-                if (HIWORD(patchentry->importName) == 0) {
-                    // Import name is a function ordinal value.
-                    if ((UINT_PTR)patchentry->importName == (UINT_PTR)procname) {
-                        if (patchentry->original != NULL)
-                            *patchentry->original = original;
-                        return (FARPROC)patchentry->replacement;
-                    }
-                } else {
-                    // Import name is a function name value.
-                    if (strcmp(patchentry->importName, procname) == 0) {
-                        if (patchentry->original != NULL)
-                            *patchentry->original = original;
-                        return (FARPROC)patchentry->replacement;
-                    }
-                }
-                patchentry++;
-            }
+            // The CRT header is more or less transparent to the user, so the
+            // contained block's information is what the user asks about.
+            blockinfo_t* info = (*blockit).second;
+            if ((block != alloc) && !isDebugCrtAlloc(block, info))
+                continue;
+            if (!info->callStack)
+                return NULL;
+            g_callStackTable.AddRef(info->callStack.get());
+            return info->callStack.get();
         }
     }
-
-    // The requested function is not a patched function. Just return the real
-    // address of the requested function.
-    return original;
+    return NULL;
 }
 
-FARPROC VisualLeakDetector::_RGetProcAddressForCaller(HMODULE module, LPCSTR procname, LPVOID caller)
+const wchar_t* VisualLeakDetector::GetAllocationResolveResults(void* alloc, BOOL showInternalFrames)
 {
-    return m_GetProcAddressForCaller(module, procname, caller);
+    LoaderLock ll;
+
+    if (m_options & VLD_OPT_VLDOFF)
+        return NULL;
+
+    flushAllPendingBlocks();
+    CallStack* callStack = getAllocationCallStack(alloc);
+    if (callStack == NULL)
+        return NULL;
+
+    // The symbols are resolved without any part of the heap map held; the
+    // reference keeps the call stack alive in the meantime.
+    int unresolvedFunctionsCount = callStack->resolve(showInternalFrames);
+    _ASSERT(unresolvedFunctionsCount == 0);
+    const wchar_t* resolved = callStack->getResolvedCallstack(showInternalFrames);
+    g_callStackTable.Release(callStack);
+    return resolved;
 }
 
-// _LdrLoadDll - Calls to LdrLoadDll are patched through to this function. This
-//   function invokes the real LdrLoadDll and then re-attaches VLD to all
-//   modules loaded in the process after loading of the new DLL is complete.
-//   All modules must be re-enumerated because the explicit load of the
-//   specified module may result in the implicit load of one or more additional
-//   modules which are dependencies of the specified module.
-//
-//  - searchpath (IN): The path to use for searching for the specified module to
-//      be loaded.
+// collectStacks - Gathers the distinct call stacks of the blocks in a heap
+//   that are going to be reported and haven't been resolved yet. A reference
+//   is taken on each stack gathered, so that it outlives its blocks once the
+//   heap map lock is released.
 //
-//  - flags (IN): Pointer to action flags.
+//   Note: The caller must hold the whole g_heapMapLock.
 //
-//  - modulename (IN): Pointer to a unicodestring_t structure specifying the
-//      name of the module to be loaded.
+//  - heapinfo (IN): The heap whose blocks are examined.
 //
-//  - modulehandle (OUT): Address of a HANDLE to receive the newly loaded
-//      module's handle.
+//  - stacks (IN/OUT): Receives the call stacks.
 //
 //  Return Value:
 //
-//    Returns the value returned by LdrLoadDll.
+//    None.
 //
-NTSTATUS VisualLeakDetector::_LdrLoadDll (LPWSTR searchpath, PULONG flags, unicodestring_t *modulename,
-    PHANDLE modulehandle)
-{
-    // Load the DLL
-    NTSTATUS status = LdrLoadDll(searchpath, flags, modulename, modulehandle);
-    return status;
-}
-
-NTSTATUS VisualLeakDetector::_LdrLoadDllWin8 (DWORD_PTR reserved, PULONG flags, unicodestring_t *modulename,
-                                          PHANDLE modulehandle)
-{
-    // Load the DLL
-    NTSTATUS status = LdrLoadDllWin8(reserved, flags, modulename, modulehandle);
-    return status;
-}
-
-NTSTATUS VisualLeakDetector::_LdrGetDllHandle(IN PWSTR DllPath OPTIONAL, IN PULONG DllCharacteristics OPTIONAL, IN PUNICODE_STRING DllName, OUT PVOID *DllHandle OPTIONAL)
-{
-    LoaderLock ll;
-
-    NTSTATUS status = LdrGetDllHandle(DllPath, DllCharacteristics, DllName, DllHandle);
-    return status;
-}
-NTSTATUS VisualLeakDetector::_LdrGetProcedureAddress(IN PVOID BaseAddress, IN PANSI_STRING Name, IN ULONG Ordinal, OUT PVOID * ProcedureAddress)
+VOID VisualLeakDetector::collectStacks (heapinfo_t* heapinfo, StackSet &stacks)
 {
-    LoaderLock ll;
+    BlockMap& blockmap = heapinfo->blockMap;
 
-    NTSTATUS status = LdrGetProcedureAddress(BaseAddress, Name, Ordinal, ProcedureAddress);
-    return status;
-}
+    for (BlockMap::Iterator blockit = blockmap.begin(); blockit != blockmap.end(); ++blockit) {
+        // Found a block which is still in the BlockMap. We've identified a
+        // potential memory leak.
+        const void* block   = (*blockit).first;
+        blockinfo_t* info   = (*blockit).second;
+        assert(info);
+        if (info == NULL)
+        {
+            continue;
+        }
 
-NTSTATUS VisualLeakDetector::_LdrLockLoaderLock(IN ULONG Flags, OUT PULONG Disposition OPTIONAL, OUT PULONG_PTR Cookie OPTIONAL)
-{
-    return LdrLockLoaderLock(Flags, Disposition, Cookie);
-}
+        if (isReported(info) || !info->callStack || info->callStack->isResolved()) {
+            continue;
+        }
 
-NTSTATUS VisualLeakDetector::_LdrUnlockLoaderLock(IN ULONG Flags, IN ULONG_PTR Cookie OPTIONAL)
-{
-    return LdrUnlockLoaderLock(Flags, Cookie);
-}
+        if (isDebugCrtAlloc(block, info)) {
+            // This block is allocated to a CRT heap, so the block has a CRT
+            // memory block header prepended to it.
+            crtdbgblockheader_t* crtheader = (crtdbgblockheader_t*)block;
+            if (!crtheader)
+                continue;
 
-NTSTATUS VisualLeakDetector::_LdrUnloadDll(IN PVOID BaseAddress)
-{
-    return LdrUnloadDll(BaseAddress);
+            // Leaks identified as CRT_USE_IGNORE should not be ignored here otherwise
+            // DynamicLoader/Thread test will randomly fail with less leaks being reported.
+            if (CRT_USE_TYPE(crtheader->use) == CRT_USE_FREE ||
+                CRT_USE_TYPE(crtheader->use) == CRT_USE_INTERNAL)
+            {
+                // This block is marked as being used internally by the CRT.
+                // The CRT will free the block after VLD is destroyed.
+                continue;
+            }
+        }
+
+        CallStack* stack = info->callStack.get();
+        if (stacks.insert(stack, true) == stacks.end()) {
+            // Another block shares this interned stack.
+            continue;
+        }
+        g_callStackTable.AddRef(stack);
+    }
 }
 
-VOID VisualLeakDetector::RefreshModules()
+int VisualLeakDetector::ResolveCallstacks()
 {
     LoaderLock ll;
 
     if (m_options & VLD_OPT_VLDOFF)
-        return;
+        return 0;
 
-    ModuleSet* newmodules = new ModuleSet();
-    newmodules->reserve(MODULE_SET_RESERVE);
+    UINT64 start = __rdtsc();
+    TraceLoggingWrite(g_vldTraceProvider, "Resolve",
+        TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+        TraceLoggingKeyword(VLD_TRACE_KEYWORD_REPORT),
+        TraceLoggingOpcode(WINEVENT_OPCODE_START));
+
+    // Snapshot the stacks to resolve. The heap map lock is only held while
+    // they are gathered, so allocating threads aren't stalled while dbghelp
+    // loads symbols.
+    StackSet stacks;
+    ProgramCounterSet programCounters;
+    flushAllPendingBlocks();
     {
-        // Duplicate code here in this method. Consider refactoring out to another method.
-        // Create a new set of all loaded modules, including any newly loaded
-        // modules.
-        DbgTrace(L"dbghelp32.dll %i: EnumerateLoadedModulesW64\n", GetCurrentThreadId());
-        g_LoadedModules.EnumerateLoadedModulesW64(g_currentProcess, addLoadedModule, newmodules);
+        CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+        for (HeapMap::Iterator heapiter = m_heapMap->begin(); heapiter != m_heapMap->end(); ++heapiter)
+        {
+            heapinfo_t* heapinfo = (*heapiter).second;
+            collectStacks(heapinfo, stacks);
+        }
+    }
 
-        // Attach to all modules included in the set.
-        attachToLoadedModules(newmodules);
+    // Look up each distinct program counter once. Frames shared by many
+    // stacks are then formatted straight from the symbol cache. Frames of
+    // unloaded modules are looked up wherever their symbols get loaded.
+    {
+        CriticalSectionLocker<DbgHelp> locker(g_DbgHelp);
+        for (StackSet::Iterator stackit = stacks.begin(); stackit != stacks.end(); ++stackit) {
+            CallStack* stack = (*stackit).first;
+            for (UINT32 frame = 0; frame < stack->size(); frame++) {
+                SIZE_T programCounter = stack->symbolAddress(frame, locker);
+                if (programCounter > 1) {
+                    programCounters.insert(programCounter, true);
+                }
+            }
+        }
+    }
+    for (ProgramCounterSet::Iterator pcit = programCounters.begin(); pcit != programCounters.end(); ++pcit)
+    {
+        SIZE_T programCounter = (*pcit).first;
+        if (isVldAddress(programCounter))
+            continue;
+        CriticalSectionLocker<DbgHelp> locker(g_DbgHelp);
+        g_symbolCache.Lookup(programCounter, locker);
     }
 
-    // Start using the new set of loaded modules.
-    CriticalSectionLocker<> cs(m_modulesLock);
-    ModuleSet* oldmodules = m_loadedModules;
-    m_loadedModules = newmodules;
+    int unresolvedFunctionsCount = 0;
+    for (StackSet::Iterator stackit = stacks.begin(); stackit != stacks.end(); ++stackit)
+    {
+        CallStack* stack = (*stackit).first;
+        unresolvedFunctionsCount += stack->resolve(m_options & VLD_OPT_TRACE_INTERNAL_FRAMES);
+    }
 
-    // Free resources used by the old module list.
-    delete oldmodules;
-}
+    if (m_options & VLD_OPT_SKIP_CRTSTARTUP_LEAKS) {
+        // Blocks allocated by the CRT startup code are not leaks; don't report
+        // them later on.
+        CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+        for (HeapMap::Iterator heapiter = m_heapMap->begin(); heapiter != m_heapMap->end(); ++heapiter)
+        {
+            BlockMap& blockmap = (*heapiter).second->blockMap;
+            for (BlockMap::Iterator blockit = blockmap.begin(); blockit != blockmap.end(); ++blockit) {
+                blockinfo_t* info = (*blockit).second;
+                if ((info == NULL) || isReported(info) || !info->callStack)
+                    continue;
+                if ((stacks.find(info->callStack.get()) != stacks.end()) && info->callStack->isCrtStartupAlloc())
+                    markReported(info);
+            }
+        }
+    }
 
-// Find the information for the module that initiated this reallocation.
-bool VisualLeakDetector::isModuleExcluded(UINT_PTR address)
-{
-    moduleinfo_t         moduleinfo;
-    ModuleSet::Iterator  moduleit;
-    moduleinfo.addrLow  = address;
-    moduleinfo.addrHigh = address + 1024;
-    moduleinfo.flags = 0;
+    for (StackSet::Iterator stackit = stacks.begin(); stackit != stacks.end(); ++stackit)
+    {
+        g_callStackTable.Release((*stackit).first);
+    }
 
-    CriticalSectionLocker<> cs(g_vld.m_modulesLock);
-    moduleit = g_vld.m_loadedModules->find(moduleinfo);
-    if (moduleit != g_vld.m_loadedModules->end())
-        return (*moduleit).flags & VLD_MODULE_EXCLUDED ? true : false;
-    return false;
+    CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+    m_reportStats.resolves++;
+    m_reportStats.resolveTicks += __rdtsc() - start;
+
+    TraceLoggingWrite(g_vldTraceProvider, "Resolve",
+        TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+        TraceLoggingKeyword(VLD_TRACE_KEYWORD_REPORT),
+        TraceLoggingOpcode(WINEVENT_OPCODE_STOP),
+        TraceLoggingInt32(unresolvedFunctionsCount, "UnresolvedFunctions"));
+    return unresolvedFunctionsCount;
 }
 
-SIZE_T VisualLeakDetector::GetLeaksCount()
-{
-    if (m_options & VLD_OPT_VLDOFF) {
-        // VLD has been turned off.
-        return 0;
-    }
+// Blocks allocated between two snapshots from the same call stack are
+// counted together in one of these.
+struct growthgroup_t {
+    CallStack *callStack; // The call stack shared by the blocks.
+    SIZE_T     count;     // Number of blocks still allocated.
+    SIZE_T     total;     // Total size of those blocks, in bytes.
+};
 
-    SIZE_T leaksCount = 0;
-    // Generate a memory leak report for each heap in the process.
-    CriticalSectionLocker<> cs(g_heapMapLock);
-    for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
-        HANDLE heap = (*heapit).first;
-        UNREFERENCED_PARAMETER(heap);
-        heapinfo_t* heapinfo = (*heapit).second;
-        leaksCount += getLeaksCount(heapinfo);
-    }
-    return leaksCount;
+// compareGrowth - qsort callback ordering growth groups by decreasing total
+//   size, so that the biggest growth is reported first.
+static int __cdecl compareGrowth (const void *first, const void *second)
+{
+    const growthgroup_t *a = *(const growthgroup_t* const*)first;
+    const growthgroup_t *b = *(const growthgroup_t* const*)second;
+    if (a->total != b->total)
+        return (a->total > b->total) ? -1 : 1;
+    return (a->count > b->count) ? -1 : (a->count < b->count) ? 1 : 0;
 }
 
-SIZE_T VisualLeakDetector::GetThreadLeaksCount(DWORD threadId)
+// PushTag - Makes a tag the current allocation tag of the calling thread,
+//   until it's popped. Every block the thread allocates meanwhile is stamped
+//   with the tag. Tags nest; only the innermost one is stamped.
+//
+//  - tag (IN): The tag's name. Tags are told apart by the address of the name
+//      first, so the name must not change while it's in use (string literals
+//      suit best). NULL pushes "no tag".
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::PushTag (LPCSTR tag)
 {
-    if (m_options & VLD_OPT_VLDOFF) {
-        // VLD has been turned off.
-        return 0;
-    }
-
-    SIZE_T leaksCount = 0;
-    // Generate a memory leak report for each heap in the process.
-    CriticalSectionLocker<> cs(g_heapMapLock);
-    for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
-        HANDLE heap = (*heapit).first;
-        UNREFERENCED_PARAMETER(heap);
-        heapinfo_t* heapinfo = (*heapit).second;
-        leaksCount += getLeaksCount(heapinfo, threadId);
-    }
-    return leaksCount;
+    tls_t* tls = getTls();
+    if (tls->tagDepth < VLD_TAG_DEPTH)
+        tls->tags[tls->tagDepth] = (tag != NULL) ? internTag(tag) : 0;
+    tls->tagDepth++;
 }
 
-SIZE_T VisualLeakDetector::ReportLeaks( )
+// PopTag - Restores the calling thread's allocation tag from before the
+//   matching PushTag.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::PopTag ()
 {
-    if (m_options & VLD_OPT_VLDOFF) {
-        // VLD has been turned off.
-        return 0;
-    }
-
-    // Generate a memory leak report for each heap in the process.
-    SIZE_T leaksCount = 0;
-    CriticalSectionLocker<> cs(g_heapMapLock);
-    bool firstLeak = true;
-    Set<blockinfo_t*> aggregatedLeaks;
-    for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
-        HANDLE heap = (*heapit).first;
-        UNREFERENCED_PARAMETER(heap);
-        heapinfo_t* heapinfo = (*heapit).second;
-        leaksCount += reportLeaks(heapinfo, firstLeak, aggregatedLeaks);
-    }
-    return leaksCount;
+    tls_t* tls = getTls();
+    if (tls->tagDepth > 0)
+        tls->tagDepth--;
 }
 
-SIZE_T VisualLeakDetector::ReportThreadLeaks( DWORD threadId )
+// TrackAlloc - Tracks blocks carved out of a custom allocator's pool, which
+//   VLD would otherwise only see as part of the chunk the pool got from the
+//   heap (see VLDTrackAlloc and VLDTrackAllocN). The pool is mapped as a
+//   pseudo-heap, and its blocks are tracked, sampled and reported like heap
+//   blocks.
+//
+//  - pool (IN): Identifies the pool, usually its address.
+//
+//  - blocks (IN): The blocks allocated. NULL entries are skipped.
+//
+//  - count (IN): Number of entries in "blocks".
+//
+//  - size (IN): Size, in bytes, of each block.
+//
+//  - context (IN): Context of the caller, with the exported function.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::TrackAlloc (LPCVOID pool, LPVOID const *blocks, SIZE_T count, SIZE_T size, context_t &context)
 {
-    if (m_options & VLD_OPT_VLDOFF) {
-        // VLD has been turned off.
-        return 0;
+    if ((blocks == NULL) || !trackingAllocs() || untrackedSize(size))
+        return;
+    while ((count > 0) && (*blocks == NULL)) {
+        blocks++;
+        count--;
     }
+    if (count == 0)
+        return;
+    tls_t* tls = enabledTls();
+    if (tls == NULL)
+        return;
 
-    // Generate a memory leak report for each heap in the process.
-    SIZE_T leaksCount = 0;
-    CriticalSectionLocker<> cs(g_heapMapLock);
-    bool firstLeak = true;
-    Set<blockinfo_t*> aggregatedLeaks;
-    for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
-        HANDLE heap = (*heapit).first;
-        UNREFERENCED_PARAMETER(heap);
-        heapinfo_t* heapinfo = (*heapit).second;
-        leaksCount += reportLeaks(heapinfo, firstLeak, aggregatedLeaks, threadId);
-    }
-    return leaksCount;
+    CaptureContext cc(reinterpret_cast<void*>(context.func), context, tls);
+    cc.SetBatch(VLD_POOL_HEAP(pool), blocks, count, size);
 }
 
-VOID VisualLeakDetector::MarkAllLeaksAsReported( )
+// TrackFree - Stops tracking blocks returned to a custom allocator's pool
+//   (see VLDTrackFree and VLDTrackFreeN).
+//
+//  - pool (IN): Identifies the pool, as passed to TrackAlloc.
+//
+//  - blocks (IN): The blocks freed. NULL entries are skipped.
+//
+//  - count (IN): Number of entries in "blocks".
+//
+//  - context (IN): Context of the caller, with the exported function.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::TrackFree (LPCVOID pool, LPVOID const *blocks, SIZE_T count, context_t &context)
 {
-    if (m_options & VLD_OPT_VLDOFF) {
-        // VLD has been turned off.
+    if (blocks == NULL)
         return;
-    }
-
-    // Generate a memory leak report for each heap in the process.
-    CriticalSectionLocker<> cs(g_heapMapLock);
-    for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
-        HANDLE heap = (*heapit).first;
-        UNREFERENCED_PARAMETER(heap);
-        heapinfo_t* heapinfo = (*heapit).second;
-        markAllLeaksAsReported(heapinfo);
-    }
+    HANDLE heap = VLD_POOL_HEAP(pool);
+    for (SIZE_T index = 0; index < count; index++)
+        unmapBlock(heap, blocks[index], context);
 }
 
-VOID VisualLeakDetector::MarkThreadLeaksAsReported( DWORD threadId )
+// UntrackRange - Stops tracking every block of a custom allocator's pool
+//   within a range of addresses, as when an arena is reset (see
+//   VLDUntrackRange). A pool's blocks are kept in address order besides its
+//   block map, so the first block in the range is found with one descent of
+//   the ordered index, and each block dropped costs no more than a free.
+//
+//  - pool (IN): Identifies the pool, as passed to TrackAlloc.
+//
+//  - base (IN): Start of the range.
+//
+//  - size (IN): Size, in bytes, of the range.
+//
+//  Return Value:
+//
+//    Returns the number of blocks no longer tracked.
+//
+SIZE_T VisualLeakDetector::UntrackRange (LPCVOID pool, LPCVOID base, SIZE_T size)
 {
-    if (m_options & VLD_OPT_VLDOFF) {
-        // VLD has been turned off.
-        return;
-    }
+    HANDLE heap = VLD_POOL_HEAP(pool);
+    if ((size == 0) || (m_heapMap->find(heap) == m_heapMap->end()))
+        return 0;
 
-    // Generate a memory leak report for each heap in the process.
-    CriticalSectionLocker<> cs(g_heapMapLock);
-    for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
-        HANDLE heap = (*heapit).first;
-        UNREFERENCED_PARAMETER(heap);
-        heapinfo_t* heapinfo = (*heapit).second;
-        markAllLeaksAsReported(heapinfo, threadId);
-    }
+    // The blocks still in pending buffers aren't in the index yet. The whole
+    // heap map lock keeps the pool from changing meanwhile; each block's
+    // shard is entered once more as it's erased.
+    flushAllPendingBlocks();
+    slabcache_t &cache = getTls()->blockInfoCache;
+    CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+    HeapMap::Iterator heapit = m_heapMap->find(heap);
+    if (heapit == m_heapMap->end())
+        return 0;
+    Set<LPCVOID> *addresses = (*heapit).second->addresses;
+    Set<LPCVOID>::Iterator it = addresses->floor(base);
+    if (it == addresses->end())
+        it = addresses->begin();
+    else if (*it < base)
+        ++it;
+
+    SIZE_T dropped = 0;
+    while ((it != addresses->end()) && (((UINT_PTR)*it - (UINT_PTR)base) < size)) {
+        // Erasing a key may move its successor's into its node, so the walk
+        // resumes from the successor's key.
+        LPCVOID mem = *it;
+        ++it;
+        LPCVOID next = (it != addresses->end()) ? *it : NULL;
+        bool heapMapped;
+        if (eraseBlock(heap, mem, cache, heapMapped))
+            dropped++;
+        it = (next != NULL) ? addresses->find(next) : addresses->end();
+    }
+    return dropped;
 }
 
-void VisualLeakDetector::ChangeModuleState(HMODULE module, bool on)
+// internTag - Obtains the ID of an allocation tag, adding the tag to the tag
+//   table the first time its name is seen. The name is only compared with
+//   the others the first time it's pushed from a given address.
+//
+//  - tag (IN): The tag's name.
+//
+//  Return Value:
+//
+//    Returns the tag's ID, or 0 if the tag table is full.
+//
+WORD VisualLeakDetector::internTag (LPCSTR tag)
 {
-    ModuleSet::Iterator  moduleit;
-
-    CriticalSectionLocker<> cs(m_modulesLock);
-    moduleit = m_loadedModules->begin();
-    while( moduleit != m_loadedModules->end() )
-    {
-        if ( (*moduleit).addrLow == (UINT_PTR)module)
-        {
-            moduleinfo_t *mod = (moduleinfo_t *)&(*moduleit);
-            if ( on )
-                mod->flags &= ~VLD_MODULE_EXCLUDED;
-            else
-                mod->flags |= VLD_MODULE_EXCLUDED;
+    CriticalSectionLocker<> cs(m_tagLock);
+    HashMap<UINT_PTR, WORD>::Iterator tagit = m_tagIds->find((UINT_PTR)tag);
+    if (tagit != m_tagIds->end())
+        return (*tagit).second;
 
+    WCHAR name [128];
+    size_t count;
+    mbstowcs_s(&count, name, _countof(name), tag, _TRUNCATE);
+    WORD id = 0;
+    for (UINT32 index = 1; index < m_tagCount; index++) {
+        if (wcscmp(m_tagNames[index], name) == 0) {
+            id = (WORD)index;
             break;
         }
-        ++moduleit;
     }
+    if ((id == 0) && (m_tagCount < VLD_MAX_TAGS)) {
+        size_t length = wcslen(name) + 1;
+        m_tagNames[m_tagCount] = new WCHAR [length];
+        wcscpy_s(m_tagNames[m_tagCount], length, name);
+        id = (WORD)m_tagCount++;
+    }
+    m_tagIds->insert((UINT_PTR)tag, id);
+    return id;
 }
 
-void VisualLeakDetector::EnableModule(HMODULE module)
+// callerSite - Obtains the interned one-frame call stack of a caller, for
+//   StackWalkMethod = caller. Each caller's stack is created once and then
+//   kept in the caller site cache, so that allocations made from a known call
+//   site cost a lookup instead of a CallStack.
+//
+//  - caller (IN): The return address of the call to the allocating function.
+//
+//  Return Value:
+//
+//    Returns the interned CallStack, with a reference for the caller.
+//
+CallStack* VisualLeakDetector::callerSite (UINT_PTR caller)
 {
-    if (m_options & VLD_OPT_VLDOFF) {
-        // VLD has been turned off.
-        return;
+    {
+        CriticalSectionLocker<> cs(m_callerSiteLock);
+        HashMap<UINT_PTR, CallStack*>::Iterator siteit = m_callerSites->find(caller);
+        if (siteit != m_callerSites->end()) {
+            g_callStackTable.AddRef((*siteit).second);
+            return (*siteit).second;
+        }
     }
 
-    ChangeModuleState(module,true);
+    // Create the stack without the lock held; if another thread cached the
+    // same caller meanwhile, interning makes both the same stack anyway.
+    context_t context = { 0 };
+    GET_RETURN_ADDRESS(context) = caller;
+    CallStack* stack = g_callStackTable.Intern(CallStack::CaptureCaller(context));
+    CriticalSectionLocker<> cs(m_callerSiteLock);
+    bool inserted;
+    m_callerSites->insert(caller, stack, inserted);
+    if (inserted)
+        g_callStackTable.AddRef(stack);
+    return stack;
 }
 
-void VisualLeakDetector::DisableModule(HMODULE module)
+// recordTime - Records the time of an allocation made a resolution or more
+//   after the last allocation time record (see timerecord_t).
+//
+//  - now (IN): The time of the allocation, from GetTickCount64.
+//
+//  - serial (IN): The allocation's serial number.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::recordTime (ULONGLONG now, SIZE_T serial)
 {
-    if (m_options & VLD_OPT_VLDOFF) {
-        // VLD has been turned off.
+    CriticalSectionLocker<> cs(m_timeLock);
+    if (now < m_lastRecordTime + m_timeResolution) {
+        // Another thread recorded the time meanwhile.
         return;
     }
-
-    ChangeModuleState(module,false);
+    if (m_timeRecordCount != 0) {
+        // Threads may record out of serial order; the records must be sorted.
+        serial = max(serial, m_timeRecords[(m_timeRecordCount - 1) % VLD_TIME_RECORDS].serial);
+    }
+    timerecord_t &record = m_timeRecords[m_timeRecordCount % VLD_TIME_RECORDS];
+    record.time = now;
+    record.serial = serial;
+    m_timeRecordCount++;
+    m_lastRecordTime = now;
 }
 
-void VisualLeakDetector::DisableLeakDetection ()
+// allocationTime - Looks up when a block was allocated, to within the
+//   AllocationTimeResolution: the time of the latest allocation time record
+//   made no later than the block's allocation.
+//
+//  - serial (IN): The block's serial number.
+//
+//  Return Value:
+//
+//    Returns the allocation time, from GetTickCount64, or 0 if the block is
+//    older than every record still kept.
+//
+ULONGLONG VisualLeakDetector::allocationTime (SIZE_T serial)
 {
-    tls_t *tls;
-
-    if (m_options & VLD_OPT_VLDOFF) {
-        // VLD has been turned off.
-        return;
+    CriticalSectionLocker<> cs(m_timeLock);
+    SIZE_T first = (m_timeRecordCount > VLD_TIME_RECORDS) ? m_timeRecordCount - VLD_TIME_RECORDS : 0;
+    SIZE_T low = first;
+    SIZE_T high = m_timeRecordCount;
+    while (low < high) {
+        SIZE_T middle = low + (high - low) / 2;
+        if (m_timeRecords[middle % VLD_TIME_RECORDS].serial <= serial)
+            low = middle + 1;
+        else
+            high = middle;
     }
+    return (low == first) ? 0 : m_timeRecords[(low - 1) % VLD_TIME_RECORDS].time;
+}
 
-    // Disable memory leak detection for the current thread. There are two flags
-    // because if neither flag is set, it means that we are in the default or
-    // "starting" state, which could be either enabled or disabled depending on
-    // the configuration.
-    tls = getTls();
-    tls->oldFlags = tls->flags;
-    tls->flags &= ~VLD_TLS_ENABLED;
-    tls->flags |= VLD_TLS_DISABLED;
+// serialAllocatedBefore - Finds the first serial number allocated after a
+//   point in time, to within the AllocationTimeResolution.
+//
+//  - time (IN): The point in time, from GetTickCount64.
+//
+//  Return Value:
+//
+//    Returns the serial number. Every block with a lower one was allocated
+//    before "time".
+//
+SIZE_T VisualLeakDetector::serialAllocatedBefore (ULONGLONG time)
+{
+    CriticalSectionLocker<> cs(m_timeLock);
+    SIZE_T low = (m_timeRecordCount > VLD_TIME_RECORDS) ? m_timeRecordCount - VLD_TIME_RECORDS : 0;
+    SIZE_T high = m_timeRecordCount;
+    while (low < high) {
+        SIZE_T middle = low + (high - low) / 2;
+        if (m_timeRecords[middle % VLD_TIME_RECORDS].time <= time)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return (low == m_timeRecordCount) ? m_requestCurr : m_timeRecords[low % VLD_TIME_RECORDS].serial;
 }
 
-void VisualLeakDetector::EnableLeakDetection ()
+// TakeSnapshot - Records the current point in the allocation history. Every
+//   block allocated before the snapshot has a smaller serial number than the
+//   value returned, and every block allocated after it a greater or equal
+//   one.
+//
+//  Return Value:
+//
+//    Returns the snapshot, to be passed to DiffSnapshots.
+//
+SIZE_T VisualLeakDetector::TakeSnapshot ()
+{
+    // With HeapWalkTracking, the blocks allocated up to now are only known
+    // once the heaps are walked.
+    if (m_heapWalkTracking)
+        walkHeaps();
+
+    // A snapshot is just a serial number. Blocks which are still in pending
+    // buffers now are flushed by DiffSnapshots before it walks the lists.
+    return serialMark();
+}
+
+// DiffSnapshots - Reports the blocks which were allocated between two
+//   snapshots and are still allocated, grouped by the call stack that
+//   allocated them. Only the blocks newer than "from" are visited: each
+//   shard's list is walked back from its newest block until a block older
+//   than the first snapshot is reached.
+//
+//  - from (IN): The earlier snapshot.
+//
+//  - to (IN): The later snapshot, or 0 to compare against the present.
+//
+//  - limit (IN): The number of call stacks reported in full, largest first.
+//      The others get a one-line tally.
+//
+//  Return Value:
+//
+//    Returns the number of blocks allocated between the snapshots which have
+//    not been freed.
+//
+SIZE_T VisualLeakDetector::DiffSnapshots (SIZE_T from, SIZE_T to, UINT32 limit)
 {
     if (m_options & VLD_OPT_VLDOFF) {
         // VLD has been turned off.
-        return;
+        return 0;
     }
 
-    tls_t *tls;
+    flushAllPendingBlocks();
+    CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+    if (to == 0)
+        to = serialMark();
 
-    // Enable memory leak detection for the current thread.
-    tls = getTls();
-    tls->oldFlags = tls->flags;
-    tls->flags &= ~VLD_TLS_DISABLED;
-    tls->flags |= VLD_TLS_ENABLED;
-    m_status &= ~VLD_STATUS_NEVER_ENABLED;
-}
+    HashMap<CallStack*, growthgroup_t*> groups;
+    SIZE_T blockCount = 0;
+    SIZE_T totalSize = 0;
+    for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
+        heapinfo_t* heapinfo = (*heapit).second;
+        for (UINT shard = 0; shard < BLOCKMAPSHARDS; shard++) {
+            for (blockinfo_t* info = heapinfo->newest[shard]; (info != NULL) && (info->serialNumber >= from); info = info->older) {
+                if ((info->serialNumber >= to) || !info->callStack)
+                    continue;
+
+                CallStack* callStack = info->callStack.get();
+                HashMap<CallStack*, growthgroup_t*>::Iterator groupit = groups.find(callStack);
+                growthgroup_t* group;
+                if (groupit == groups.end()) {
+                    group = new growthgroup_t;
+                    group->callStack = callStack;
+                    group->count = 0;
+                    group->total = 0;
+                    groups.insert(callStack, group);
+                }
+                else {
+                    group = (*groupit).second;
+                }
+                group->count++;
+                group->total += info->size;
+                blockCount++;
+                totalSize += info->size;
+            }
+        }
+    }
 
-void VisualLeakDetector::RestoreLeakDetectionState ()
-{
-    tls_t *tls;
+    growthgroup_t** sorted = new growthgroup_t* [groups.size() + 1];
+    size_t groupCount = 0;
+    for (HashMap<CallStack*, growthgroup_t*>::Iterator groupit = groups.begin(); groupit != groups.end(); ++groupit)
+        sorted[groupCount++] = (*groupit).second;
+    qsort(sorted, groupCount, sizeof(growthgroup_t*), compareGrowth);
 
-    if (m_options & VLD_OPT_VLDOFF) {
-        // VLD has been turned off.
-        return;
+    Report(L"Visual Leak Detector: %Iu blocks totalling %Iu bytes allocated from %Iu call stacks between snapshots %Iu and %Iu are still allocated.\n",
+        blockCount, totalSize, groupCount, from, to);
+    for (size_t index = 0; index < groupCount; index++) {
+        growthgroup_t* group = sorted[index];
+        if (index < limit) {
+            Report(L"---------- Growth: %Iu blocks, %Iu bytes ----------\n", group->count, group->total);
+            Report(L"  Call Stack:\n");
+            group->callStack->dump(m_options & VLD_OPT_TRACE_INTERNAL_FRAMES);
+            Report(L"\n");
+        }
+        else {
+            if (index == limit)
+                Report(L"---------- Other call stacks ----------\n");
+            Report(L"  Call Stack 0x%08X: %Iu blocks, %Iu bytes\n", group->callStack->getHashValue(), group->count,
+                group->total);
+        }
+        delete group;
     }
+    delete [] sorted;
+    FlushReport();
+    return blockCount;
+}
 
-    // Restore state memory leak detection for the current thread.
-    tls = getTls();
-    tls->flags &= ~(VLD_TLS_DISABLED | VLD_TLS_ENABLED);
-    tls->flags |= tls->oldFlags & (VLD_TLS_DISABLED | VLD_TLS_ENABLED);
+// comparePeakSites - qsort callback ordering the allocation sites of a peak
+//   snapshot by decreasing size.
+static int __cdecl comparePeakSites (const void *first, const void *second)
+{
+    const peaksite_t *a = (const peaksite_t*)first;
+    const peaksite_t *b = (const peaksite_t*)second;
+    if (a->bytes != b->bytes)
+        return (a->bytes > b->bytes) ? -1 : 1;
+    return (a->blocks > b->blocks) ? -1 : (a->blocks < b->blocks) ? 1 : 0;
 }
 
-void VisualLeakDetector::GlobalDisableLeakDetection ()
+// ReportPeak - Reports the allocation sites which made up the memory in use
+//   at the last peak snapshot (see PeakSnapshotStep), largest first. The top
+//   m_summaryCount call stacks are reported in full, every other one gets a
+//   one-line tally. The snapshot is copied first, so that new snapshots can
+//   be taken while the call stacks are resolved.
+//
+//  Return Value:
+//
+//    Returns the number of allocation sites in the snapshot.
+//
+SIZE_T VisualLeakDetector::ReportPeak ()
 {
     if (m_options & VLD_OPT_VLDOFF) {
         // VLD has been turned off.
-        return;
+        return 0;
+    }
+    if (m_peakStep == 0) {
+        Report(L"WARNING: Visual Leak Detector: No peak snapshots are taken; set PeakSnapshotStep to report the peak.\n");
+        return 0;
     }
 
-    CriticalSectionLocker<> cs(m_optionsLock);
-    m_options |= VLD_OPT_START_DISABLED;
+    peaksite_t *sites;
+    SIZE_T siteCount;
+    SIZE_T peakBytes;
+    {
+        CriticalSectionLocker<> cs(m_peakLock);
+        siteCount = m_peakSiteCount;
+        peakBytes = m_peakBytes;
+        sites = new peaksite_t [siteCount + 1];
+        for (SIZE_T index = 0; index < siteCount; index++) {
+            sites[index] = m_peakSites[index];
+            g_callStackTable.AddRef(sites[index].callStack);
+        }
+    }
+    qsort(sites, siteCount, sizeof(peaksite_t), comparePeakSites);
 
-    // Disable memory leak detection for all threads.
-    CriticalSectionLocker<> cstls(m_tlsLock);
-    TlsMap::Iterator     tlsit;
-    for (tlsit = m_tlsMap->begin(); tlsit != m_tlsMap->end(); ++tlsit) {
-        (*tlsit).second->oldFlags = (*tlsit).second->flags;
-        (*tlsit).second->flags &= ~VLD_TLS_ENABLED;
-        (*tlsit).second->flags |= VLD_TLS_DISABLED;
+    if (siteCount == 0) {
+        Report(L"Visual Leak Detector: The memory in use hasn't reached a peak snapshot yet.\n");
+    }
+    else {
+        Report(L"Visual Leak Detector: %Iu bytes were in use at the last peak snapshot, allocated from %Iu call stacks. "
+            L"The top %u by size follow.\n", peakBytes, siteCount, m_summaryCount);
+    }
+    for (SIZE_T index = 0; index < siteCount; index++) {
+        const peaksite_t &site = sites[index];
+        if (index < m_summaryCount) {
+            Report(L"---------- Peak: %Iu blocks, %Iu bytes ----------\n", site.blocks, site.bytes);
+            Report(L"  Call Stack:\n");
+            site.callStack->dump(m_options & VLD_OPT_TRACE_INTERNAL_FRAMES);
+            Report(L"\n");
+        }
+        else {
+            if (index == m_summaryCount)
+                Report(L"---------- Other call stacks ----------\n");
+            Report(L"  Call Stack 0x%08X: %Iu blocks, %Iu bytes\n", site.callStack->getHashValue(), site.blocks,
+                site.bytes);
+        }
     }
+    releasePeak(sites, siteCount);
+    FlushReport();
+    return siteCount;
 }
 
-void VisualLeakDetector::GlobalEnableLeakDetection ()
+// GetStatistics - Adds up the hot path counters of every thread, and collects
+//   the report timing, the allocation totals and the size of VLD's private
+//   heap.
+//
+//  - statistics (OUT): Receives the statistics.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::GetStatistics (VLD_STATISTICS *statistics)
 {
-    if (m_options & VLD_OPT_VLDOFF) {
-        // VLD has been turned off.
+    ZeroMemory(statistics, sizeof(VLD_STATISTICS));
+    if (m_options & VLD_OPT_VLDOFF)
         return;
-    }
 
-    CriticalSectionLocker<> cs(m_optionsLock);
-    m_options &= ~VLD_OPT_START_DISABLED;
-    m_status &= ~VLD_STATUS_NEVER_ENABLED;
+    {
+        CriticalSectionLocker<> cs(m_tlsLock);
+        statistics->stackCaptures       = m_retiredStats.stackCaptures;
+        statistics->stackCaptureTicks   = m_retiredStats.stackCaptureTicks;
+        statistics->mapInserts          = m_retiredStats.mapInserts;
+        statistics->mapInsertTicks      = m_retiredStats.mapInsertTicks;
+        statistics->mapErases           = m_retiredStats.mapErases;
+        statistics->mapEraseTicks       = m_retiredStats.mapEraseTicks;
+        statistics->lockAcquires        = m_retiredStats.lockAcquires;
+        statistics->lockWaitTicks       = m_retiredStats.lockWaitTicks;
+        statistics->exclusionChecks     = m_retiredStats.exclusionChecks;
+        statistics->exclusionCheckTicks = m_retiredStats.exclusionCheckTicks;
+        for (TlsMap::Iterator tlsit = m_tlsMap->begin(); tlsit != m_tlsMap->end(); ++tlsit) {
+            const vldstats_t &stats = (*tlsit).second->stats;
+            statistics->stackCaptures       += stats.stackCaptures;
+            statistics->stackCaptureTicks   += stats.stackCaptureTicks;
+            statistics->mapInserts          += stats.mapInserts;
+            statistics->mapInsertTicks      += stats.mapInsertTicks;
+            statistics->mapErases           += stats.mapErases;
+            statistics->mapEraseTicks       += stats.mapEraseTicks;
+            statistics->lockAcquires        += stats.lockAcquires;
+            statistics->lockWaitTicks       += stats.lockWaitTicks;
+            statistics->exclusionChecks     += stats.exclusionChecks;
+            statistics->exclusionCheckTicks += stats.exclusionCheckTicks;
+        }
 
-    // Enable memory leak detection for all threads.
-    CriticalSectionLocker<> cstls(m_tlsLock);
-    TlsMap::Iterator     tlsit;
-    for (tlsit = m_tlsMap->begin(); tlsit != m_tlsMap->end(); ++tlsit) {
-        (*tlsit).second->oldFlags = (*tlsit).second->flags;
-        (*tlsit).second->flags &= ~VLD_TLS_DISABLED;
-        (*tlsit).second->flags |= VLD_TLS_ENABLED;
+        // Merge every thread's latency histograms.
+        for (UINT hook = 0; hook < VLD_HOOKS; hook++) {
+            VLD_HOOK_LATENCY &latency = statistics->hooks[hook];
+            latency.maxTicks = m_retiredLatency.maxTicks[hook];
+            for (UINT bucket = 0; bucket < VLD_LATENCY_BUCKETS; bucket++)
+                latency.buckets[bucket] = m_retiredLatency.buckets[hook][bucket];
+            for (TlsMap::Iterator tlsit = m_tlsMap->begin(); tlsit != m_tlsMap->end(); ++tlsit) {
+                const latencyhist_t *threadlatency = (*tlsit).second->latency;
+                if (threadlatency == NULL)
+                    continue;
+                latency.maxTicks = max(latency.maxTicks, threadlatency->maxTicks[hook]);
+                for (UINT bucket = 0; bucket < VLD_LATENCY_BUCKETS; bucket++)
+                    latency.buckets[bucket] += threadlatency->buckets[hook][bucket];
+            }
+            for (UINT bucket = 0; bucket < VLD_LATENCY_BUCKETS; bucket++)
+                latency.calls += latency.buckets[bucket];
+            latency.p50Ticks = latencyPercentile(latency, 50);
+            latency.p90Ticks = latencyPercentile(latency, 90);
+            latency.p99Ticks = latencyPercentile(latency, 99);
+        }
     }
-}
 
-CONST UINT32 OptionsMask = VLD_OPT_AGGREGATE_DUPLICATES | VLD_OPT_MODULE_LIST_INCLUDE |
-    VLD_OPT_SAFE_STACK_WALK | VLD_OPT_SLOW_DEBUGGER_DUMP | VLD_OPT_START_DISABLED |
-    VLD_OPT_TRACE_INTERNAL_FRAMES | VLD_OPT_SKIP_HEAPFREE_LEAKS | VLD_OPT_VALIDATE_HEAPFREE |
-    VLD_OPT_SKIP_CRTSTARTUP_LEAKS;
+    {
+        CriticalSectionLocker<DbgHelp> locker(g_DbgHelp);
+        UINT64 lookups, ticks;
+        g_symbolCache.GetStatistics(lookups, ticks, locker);
+        statistics->symbolLookups     = lookups;
+        statistics->symbolLookupTicks = ticks;
+    }
 
-UINT32 VisualLeakDetector::GetOptions()
-{
-    CriticalSectionLocker<> cs(m_optionsLock);
-    return m_options & OptionsMask;
+    {
+        CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+        statistics->reports          = m_reportStats.reports;
+        statistics->reportTicks      = m_reportStats.reportTicks;
+        statistics->aggregationTicks = m_reportStats.aggregationTicks;
+        statistics->stackDumpTicks   = m_reportStats.stackDumpTicks;
+        statistics->dataDumpTicks    = m_reportStats.dataDumpTicks;
+        statistics->resolves         = m_reportStats.resolves;
+        statistics->resolveTicks     = m_reportStats.resolveTicks;
+    }
+
+    UINT64 prints, printTicks;
+    GetPrintStatistics(prints, printTicks);
+    statistics->prints     = prints;
+    statistics->printTicks = printTicks;
+
+    SIZE_T allocations, current, peak, total;
+    readAllocTotals(allocations, current, peak, total);
+    statistics->currentBytes = current;
+    statistics->peakBytes    = peak;
+    statistics->totalBytes   = total;
+
+    statistics->privateHeapBytes = GetVldHeapBytes();
+    statistics->metadataBytes    = g_metadataRegion.Bytes();
+
+    statistics->moduleAttaches    = m_moduleStats.attaches;
+    statistics->moduleAttachTicks = m_moduleStats.attachTicks;
+    statistics->moduleDetaches    = m_moduleStats.detaches;
+    statistics->moduleDetachTicks = m_moduleStats.detachTicks;
+
+    statistics->startupModules    = m_startupStats.modules;
+    statistics->startupTicks      = m_startupStats.startupTicks;
+    statistics->configureTicks    = m_startupStats.configureTicks;
+    statistics->symbolInitTicks   = m_startupStats.symbolInitTicks;
+    statistics->moduleEnumTicks   = m_startupStats.moduleEnumTicks;
+    statistics->modulePatchTicks  = m_startupStats.modulePatchTicks;
+
+    statistics->virtualRegions   = m_virtualRegionCount;
+    statistics->virtualReserved  = m_virtualReserved;
+    statistics->virtualCommitted = m_virtualCommitted;
+
+    for (UINT lock = 0; lock < VLD_LOCKS; lock++) {
+        statistics->locks[lock].acquisitions = m_lockProfiles[lock].acquisitions;
+        statistics->locks[lock].contentions  = m_lockProfiles[lock].contentions;
+        statistics->locks[lock].waitTicks    = m_lockProfiles[lock].waitTicks;
+    }
 }
 
-void VisualLeakDetector::SetOptions(UINT32 option_mask, SIZE_T maxDataDump, UINT32 maxTraceFrames)
+// GetMemoryUsage - Measures the memory VLD itself takes, by what it holds.
+//   Each part is measured under its own lock, so the parts may not add up
+//   exactly while the program is running.
+//
+//  - usage (OUT): Receives the memory usage.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::GetMemoryUsage (VLD_MEMORY_USAGE *usage)
 {
-    if (m_options & VLD_OPT_VLDOFF) {
-        // VLD has been turned off.
+    ZeroMemory(usage, sizeof(VLD_MEMORY_USAGE));
+    if (m_options & VLD_OPT_VLDOFF)
         return;
+
+    {
+        CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+        usage->blockIndexBytes = m_heapMap->bytes();
+        for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit)
+            usage->blockIndexBytes += sizeof(heapinfo_t) + (*heapit).second->blockMap.bytes();
     }
+    usage->blockInfoBytes    = m_blockInfoPool.Bytes();
+    usage->callStackBytes    = g_callStackTable.Bytes();
+    usage->resolvedTextBytes = g_resolvedText.Bytes();
 
-    CriticalSectionLocker<> cs(m_optionsLock);
-    m_options &= ~OptionsMask; // clear used bits
-    m_options |= option_mask & OptionsMask;
+    {
+        CriticalSectionLocker<> cs(m_modulesLock);
+        usage->moduleTableBytes = m_loadedModules->bytes() + g_moduleImages.Bytes() + g_modulePaths.Bytes();
+        const moduleranges_t *table = m_moduleRanges;
+        if (table != NULL)
+            usage->moduleTableBytes += offsetof(moduleranges_t, ranges) + table->count * sizeof(modulerange_t);
+    }
 
-    m_maxDataDump = maxDataDump;
-    m_maxTraceFrames = maxTraceFrames;
-    if (m_maxTraceFrames < 1) {
-        m_maxTraceFrames = VLD_DEFAULT_MAX_TRACE_FRAMES;
+    {
+        CriticalSectionLocker<> cs(m_tlsLock);
+        SIZE_T records = m_tlsMap->size();
+        for (tls_t *tls = m_freeTls; tls != NULL; tls = tls->nextFree)
+            records++;
+        usage->threadStateBytes = m_tlsMap->bytes() + records * sizeof(tls_t);
+        for (TlsMap::Iterator tlsit = m_tlsMap->begin(); tlsit != m_tlsMap->end(); ++tlsit) {
+            const tls_t *tls = (*tlsit).second;
+            if (tls->deferred != NULL)
+                usage->threadStateBytes += VLD_PENDING_BLOCKS * sizeof(deferredstack_t);
+            if (tls->allocTrace != NULL)
+                usage->threadStateBytes += sizeof(allocring_t);
+            if (tls->latency != NULL)
+                usage->threadStateBytes += sizeof(latencyhist_t);
+            if (tls->recentFrees != NULL)
+                usage->threadStateBytes += sizeof(recentfrees_t);
+        }
     }
 
-    m_options |= option_mask & VLD_OPT_START_DISABLED;
-    if (m_options & VLD_OPT_START_DISABLED)
-        GlobalDisableLeakDetection();
+    usage->privateHeapBytes     = GetVldHeapBytes();
+    usage->privateHeapCommitted = GetVldHeapCommitted();
+    usage->metadataBytes        = g_metadataRegion.Bytes();
 }
 
-void VisualLeakDetector::SetModulesList(CONST WCHAR *modules, BOOL includeModules)
+// compareSiteLiveBytes - qsort callback ordering site statistics by
+//   decreasing live bytes, then by decreasing allocations.
+static int __cdecl compareSiteLiveBytes (const void *first, const void *second)
 {
-    if (m_options & VLD_OPT_VLDOFF) {
-        // VLD has been turned off.
-        return;
-    }
+    const VLD_SITE_STATISTICS *a = (const VLD_SITE_STATISTICS*)first;
+    const VLD_SITE_STATISTICS *b = (const VLD_SITE_STATISTICS*)second;
+    if (a->liveBytes != b->liveBytes)
+        return (a->liveBytes > b->liveBytes) ? -1 : 1;
+    return (a->allocations > b->allocations) ? -1 : (a->allocations < b->allocations) ? 1 : 0;
+}
 
-    CriticalSectionLocker<> cs(m_optionsLock);
-    wcsncpy_s(m_forcedModuleList, MAXMODULELISTLENGTH, modules, _TRUNCATE);
-    _wcslwr_s(m_forcedModuleList, MAXMODULELISTLENGTH);
-    if (includeModules)
-        m_options |= VLD_OPT_MODULE_LIST_INCLUDE;
-    else
-        m_options &= ~VLD_OPT_MODULE_LIST_INCLUDE;
+// compareSiteAllocations - qsort callback ordering site statistics by
+//   decreasing allocations, then by decreasing live bytes.
+static int __cdecl compareSiteAllocations (const void *first, const void *second)
+{
+    const VLD_SITE_STATISTICS *a = (const VLD_SITE_STATISTICS*)first;
+    const VLD_SITE_STATISTICS *b = (const VLD_SITE_STATISTICS*)second;
+    if (a->allocations != b->allocations)
+        return (a->allocations > b->allocations) ? -1 : 1;
+    return (a->liveBytes > b->liveBytes) ? -1 : (a->liveBytes < b->liveBytes) ? 1 : 0;
 }
 
-bool VisualLeakDetector::GetModulesList(WCHAR *modules, UINT size)
+// GetSiteStatistics - Obtains the statistics of the allocation sites with the
+//   most live bytes, or with the most allocations. Only available with the
+//   SiteStatistics option. The counters are read without stopping the other
+//   threads, so those of a site which is being allocated from may be slightly
+//   out of step with each other.
+//
+//  - sites (OUT): Receives the statistics of up to "count" sites.
+//
+//  - count (IN): Size of the "sites" array.
+//
+//  - byAllocations (IN): If TRUE, the sites are ranked by allocations instead
+//      of by live bytes.
+//
+//  Return Value:
+//
+//    Returns the number of sites, which may be more than "count".
+//
+SIZE_T VisualLeakDetector::GetSiteStatistics (VLD_SITE_STATISTICS *sites, SIZE_T count, BOOL byAllocations)
 {
-    if (m_options & VLD_OPT_VLDOFF) {
-        // VLD has been turned off.
-        modules[0] = '\0';
-        return true;
-    }
+    if (!(m_options & VLD_OPT_SITE_STATISTICS))
+        return 0;
 
-    CriticalSectionLocker<> cs(m_optionsLock);
-    wcsncpy_s(modules, size, m_forcedModuleList, _TRUNCATE);
-    return (m_options & VLD_OPT_MODULE_LIST_INCLUDE) > 0;
+    UINT32 capacity = g_callStackTable.Count();
+    CallStack **stacks = new CallStack* [capacity + 1];
+    UINT32 stackCount = g_callStackTable.Collect(stacks, capacity);
+    VLD_SITE_STATISTICS *all = new VLD_SITE_STATISTICS [stackCount + 1];
+    for (UINT32 index = 0; index < stackCount; index++) {
+        stacks[index]->getSiteStatistics(all[index]);
+        g_callStackTable.Release(stacks[index]);
+    }
+    delete [] stacks;
+
+    qsort(all, stackCount, sizeof(VLD_SITE_STATISTICS), byAllocations ? compareSiteAllocations : compareSiteLiveBytes);
+    if ((sites != NULL) && (count != 0))
+        memcpy(sites, all, min(count, (SIZE_T)stackCount) * sizeof(VLD_SITE_STATISTICS));
+    delete [] all;
+    return stackCount;
 }
 
-void VisualLeakDetector::GetReportFilename(WCHAR *filename)
+// An allocation site's statistics and its call stack, sorted by ReportChurn
+// and ReportReallocStorms.
+struct churnsite_t {
+    CallStack          *callStack;
+    VLD_SITE_STATISTICS statistics;
+};
+
+// compareChurnSites - qsort callback ordering allocation sites like
+//   compareSiteAllocations.
+static int __cdecl compareChurnSites (const void *first, const void *second)
 {
-    if (m_options & VLD_OPT_VLDOFF) {
-        // VLD has been turned off.
-        m_reportFilePath[0] = '\0';
+    return compareSiteAllocations(&((const churnsite_t*)first)->statistics, &((const churnsite_t*)second)->statistics);
+}
+
+// reportLifetimes - Reports the lifetime histogram of an allocation site, one
+//   line per bucket which counts any freed block. Lifetimes are measured in
+//   allocations made while the block was allocated; a site whose blocks are
+//   all short-lived makes allocations that could go to a per-request arena.
+//
+//  - site (IN): The site's statistics.
+//
+//  Return Value:
+//
+//    None.
+//
+static VOID reportLifetimes (const VLD_SITE_STATISTICS &site)
+{
+    if (site.frees == 0)
         return;
+    Report(L"  Lifetimes, in allocations made before the block was freed:\n");
+    for (UINT32 bucket = 0; bucket < VLD_LIFETIME_BUCKETS; bucket++) {
+        if (site.lifetimes[bucket] == 0)
+            continue;
+        ULONGLONG low = (bucket == 0) ? 0 : (1ULL << bucket);
+        if (bucket == VLD_LIFETIME_BUCKETS - 1)
+            Report(L"    %llu or more: %u blocks\n", low, site.lifetimes[bucket]);
+        else
+            Report(L"    %llu to %llu: %u blocks\n", low, (2ULL << bucket) - 1, site.lifetimes[bucket]);
     }
-
-    CriticalSectionLocker<> cs(m_optionsLock);
-    wcsncpy_s(filename, MAX_PATH, m_reportFilePath, _TRUNCATE);
 }
 
-void VisualLeakDetector::SetReportOptions(UINT32 option_mask, CONST WCHAR *filename)
+// ReportChurn - Reports the allocation sites which allocated the most blocks
+//   so far, whether they were freed or not. The top m_summaryCount call
+//   stacks are reported in full, with the lifetimes of their freed blocks,
+//   every other one gets a one-line tally. Only available with the
+//   SiteStatistics option.
+//
+//  Return Value:
+//
+//    Returns the number of allocation sites with statistics.
+//
+SIZE_T VisualLeakDetector::ReportChurn ()
 {
     if (m_options & VLD_OPT_VLDOFF) {
         // VLD has been turned off.
-        return;
+        return 0;
     }
-
-    CriticalSectionLocker<> cs(m_optionsLock);
-    m_options &= ~(VLD_OPT_REPORT_TO_DEBUGGER | VLD_OPT_REPORT_TO_FILE |
-        VLD_OPT_REPORT_TO_STDOUT | VLD_OPT_UNICODE_REPORT); // clear used bits
-
-    m_options |= option_mask & VLD_OPT_REPORT_TO_DEBUGGER;
-    if ( (option_mask & VLD_OPT_REPORT_TO_FILE) && ( filename != NULL ))
-    {
-        wcsncpy_s(m_reportFilePath, MAX_PATH, filename, _TRUNCATE);
-        m_options |= option_mask & VLD_OPT_REPORT_TO_FILE;
+    if (!(m_options & VLD_OPT_SITE_STATISTICS)) {
+        Report(L"WARNING: Visual Leak Detector: No site statistics are kept; set SiteStatistics to report the churn.\n");
+        return 0;
     }
-    m_options |= option_mask & VLD_OPT_REPORT_TO_STDOUT;
-    m_options |= option_mask & VLD_OPT_UNICODE_REPORT;
 
-    if ((m_options & VLD_OPT_UNICODE_REPORT) && !(m_options & VLD_OPT_REPORT_TO_FILE)) {
-        // If Unicode report encoding is enabled, then the report needs to be
-        // sent to a file because the debugger will not display Unicode
-        // characters, it will display question marks in their place instead.
-        m_options |= VLD_OPT_REPORT_TO_FILE;
-        m_status |= VLD_STATUS_FORCE_REPORT_TO_FILE;
+    UINT32 capacity = g_callStackTable.Count();
+    CallStack **stacks = new CallStack* [capacity + 1];
+    UINT32 stackCount = g_callStackTable.Collect(stacks, capacity);
+    churnsite_t *sites = new churnsite_t [stackCount + 1];
+    ULONGLONG allocations = 0;
+    for (UINT32 index = 0; index < stackCount; index++) {
+        sites[index].callStack = stacks[index];
+        stacks[index]->getSiteStatistics(sites[index].statistics);
+        allocations += sites[index].statistics.allocations;
+    }
+    delete [] stacks;
+    qsort(sites, stackCount, sizeof(churnsite_t), compareChurnSites);
+
+    Report(L"Visual Leak Detector: %llu blocks were allocated from %u call stacks so far. "
+        L"The top %u by allocations follow.\n", allocations, stackCount, m_summaryCount);
+    for (UINT32 index = 0; index < stackCount; index++) {
+        const VLD_SITE_STATISTICS &site = sites[index].statistics;
+        if (index < m_summaryCount) {
+            ULONGLONG average = (site.allocations != 0) ? site.allocatedBytes / site.allocations : 0;
+            Report(L"---------- Churn: %llu allocations, %llu frees, %llu bytes (%llu on average) ----------\n",
+                site.allocations, site.frees, site.allocatedBytes, average);
+            if (site.crossThreadFrees != 0) {
+                Report(L"  Freed by the allocating thread: %llu blocks, by other threads: %llu blocks\n",
+                    site.sameThreadFrees, site.crossThreadFrees);
+            }
+            reportLifetimes(site);
+            Report(L"  Call Stack:\n");
+            sites[index].callStack->dump(m_options & VLD_OPT_TRACE_INTERNAL_FRAMES);
+            Report(L"\n");
+        }
+        else {
+            if (index == m_summaryCount)
+                Report(L"---------- Other call stacks ----------\n");
+            Report(L"  Call Stack 0x%08X: %llu allocations, %llu frees (%llu by other threads), %llu bytes\n",
+                site.hash, site.allocations, site.frees, site.crossThreadFrees, site.allocatedBytes);
+        }
+        g_callStackTable.Release(sites[index].callStack);
     }
+    delete [] sites;
+    FlushReport();
+    return stackCount;
+}
 
-    if (m_options & VLD_OPT_REPORT_TO_FILE) {
-        setupReporting();
-    }
-    else if ( m_reportFile ) { //Close the previous report file if needed.
-        fclose(m_reportFile);
-        m_reportFile = NULL;
-    }
+// compareReallocSites - qsort callback ordering allocation sites by
+//   decreasing bytes their reallocations may have copied.
+static int __cdecl compareReallocSites (const void *first, const void *second)
+{
+    const VLD_SITE_STATISTICS *a = &((const churnsite_t*)first)->statistics;
+    const VLD_SITE_STATISTICS *b = &((const churnsite_t*)second)->statistics;
+    return (a->reallocFromBytes > b->reallocFromBytes) ? -1 : (a->reallocFromBytes < b->reallocFromBytes) ? 1 : 0;
 }
 
-int VisualLeakDetector::SetReportHook(int mode, VLD_REPORT_HOOK pfnNewHook)
+// ReportReallocStorms - Reports the allocation sites which grew blocks by
+//   small increments at least "minReallocs" times, ranked by the bytes their
+//   reallocations may have copied. The top m_summaryCount call stacks are
+//   reported in full, every other one gets a one-line tally. Only available
+//   with the SiteStatistics option.
+//
+//  - minReallocs (IN): The number of small reallocations a site needs to be
+//      reported.
+//
+//  Return Value:
+//
+//    Returns the number of allocation sites reported.
+//
+SIZE_T VisualLeakDetector::ReportReallocStorms (SIZE_T minReallocs)
 {
-    if (m_options & VLD_OPT_VLDOFF || pfnNewHook == NULL) {
+    if (m_options & VLD_OPT_VLDOFF) {
         // VLD has been turned off.
-        return -1;
-    }
-    CriticalSectionLocker<> cs(m_optionsLock);
-    if (mode == VLD_RPTHOOK_INSTALL)
-    {
-        ReportHookSet::Iterator it = g_pReportHooks->insert(pfnNewHook);
-        return (it != g_pReportHooks->end()) ? 0 : -1;
-    }
-    else if (mode == VLD_RPTHOOK_REMOVE)
-    {
-        g_pReportHooks->erase(pfnNewHook);
         return 0;
     }
-    return -1;
-}
-
-void VisualLeakDetector::setupReporting()
-{
-    WCHAR      bom = BOM; // Unicode byte-order mark.
-
-    //Close the previous report file if needed.
-    if (m_reportFile) {
-        fclose(m_reportFile);
-        m_reportFile = NULL;
+    if (!(m_options & VLD_OPT_SITE_STATISTICS)) {
+        Report(L"WARNING: Visual Leak Detector: No site statistics are kept; set SiteStatistics to report reallocation storms.\n");
+        return 0;
     }
 
-    // Reporting to file enabled.
-    if (m_options & VLD_OPT_UNICODE_REPORT) {
-        // Unicode data encoding has been enabled. Write the byte-order
-        // mark before anything else gets written to the file. Open the
-        // file for binary writing.
-        if (_wfopen_s(&m_reportFile, m_reportFilePath, L"wb") == EINVAL) {
-            // Couldn't open the file.
-            m_reportFile = NULL;
-        }
-        else if (m_reportFile) {
-            fwrite(&bom, sizeof(WCHAR), 1, m_reportFile);
-            SetReportEncoding(unicode);
-        }
-    }
-    else {
-        // Open the file in text mode for ASCII output.
-        if (_wfopen_s(&m_reportFile, m_reportFilePath, L"w") == EINVAL) {
-            // Couldn't open the file.
-            m_reportFile = NULL;
+    UINT32 capacity = g_callStackTable.Count();
+    CallStack **stacks = new CallStack* [capacity + 1];
+    UINT32 stackCount = g_callStackTable.Collect(stacks, capacity);
+    churnsite_t *sites = new churnsite_t [stackCount + 1];
+    UINT32 siteCount = 0;
+    for (UINT32 index = 0; index < stackCount; index++) {
+        churnsite_t &site = sites[siteCount];
+        stacks[index]->getSiteStatistics(site.statistics);
+        if ((site.statistics.smallReallocs != 0) && (site.statistics.smallReallocs >= minReallocs)) {
+            site.callStack = stacks[index];
+            siteCount++;
         }
-        else if (m_reportFile) {
-            SetReportEncoding(ascii);
+        else {
+            g_callStackTable.Release(stacks[index]);
         }
     }
-    if (m_reportFile == NULL) {
-        Report(L"WARNING: Visual Leak Detector: Couldn't open report file for writing: %s\n"
-            L"  The report will be sent to the debugger instead.\n", m_reportFilePath);
+    delete [] stacks;
+    qsort(sites, siteCount, sizeof(churnsite_t), compareReallocSites);
+
+    if (siteCount == 0) {
+        Report(L"Visual Leak Detector: No call stack grew blocks by small increments %Iu times or more.\n", minReallocs);
     }
     else {
-        // Set the "report" function to write to the file.
-        SetReportFile(m_reportFile, m_options & VLD_OPT_REPORT_TO_DEBUGGER, m_options & VLD_OPT_REPORT_TO_STDOUT);
+        Report(L"Visual Leak Detector: %u call stacks grew blocks by small increments %Iu times or more. "
+            L"The top %u by bytes copied follow.\n", siteCount, minReallocs, m_summaryCount);
+    }
+    for (UINT32 index = 0; index < siteCount; index++) {
+        const VLD_SITE_STATISTICS &site = sites[index].statistics;
+        if (index < m_summaryCount) {
+            // The average growth factor, in hundredths.
+            ULONGLONG factor = site.reallocToBytes * 100 / site.reallocFromBytes;
+            Report(L"---------- Reallocations: %llu (%llu small), growth %llu.%02llux, %llu bytes copied ----------\n",
+                site.reallocs, site.smallReallocs, factor / 100, factor % 100, site.reallocFromBytes);
+            Report(L"  Call Stack:\n");
+            sites[index].callStack->dump(m_options & VLD_OPT_TRACE_INTERNAL_FRAMES);
+            Report(L"\n");
+        }
+        else {
+            if (index == m_summaryCount)
+                Report(L"---------- Other call stacks ----------\n");
+            Report(L"  Call Stack 0x%08X: %llu reallocations (%llu small), %llu bytes copied\n", site.hash,
+                site.reallocs, site.smallReallocs, site.reallocFromBytes);
+        }
+        g_callStackTable.Release(sites[index].callStack);
     }
+    delete [] sites;
+    FlushReport();
+    return siteCount;
 }
 
-blockinfo_t* VisualLeakDetector::getAllocationBlockInfo(void* alloc)
+// GetHeapSizeClasses - Obtains the size class histograms of the heaps, with
+//   the SizeClassHistogram option. Like the telemetry, the counters of the
+//   shards other than the one held are read without stopping the threads
+//   which update them.
+//
+//  - heaps (OUT): Receives the histograms of up to "count" heaps.
+//
+//  - count (IN): Size of the "heaps" array.
+//
+//  Return Value:
+//
+//    Returns the number of heaps with histograms, which may be more than
+//    "count".
+//
+SIZE_T VisualLeakDetector::GetHeapSizeClasses (VLD_HEAP_SIZE_CLASSES *heaps, SIZE_T count)
 {
-    // should be called under g_heapMapLock
-    for (HeapMap::Iterator heapiter = m_heapMap->begin(); heapiter != m_heapMap->end(); ++heapiter)
-    {
-        HANDLE heap = (*heapiter).first;
-        UNREFERENCED_PARAMETER(heap);
-        heapinfo_t* heapinfo = (*heapiter).second;
-        BlockMap& blockmap = heapinfo->blockMap;
-
-        for (BlockMap::Iterator blockit = blockmap.begin(); blockit != blockmap.end(); ++blockit) {
-            // Found a block which is still in the BlockMap. We've identified a
-            // potential memory leak.
-            LPCVOID block = (*blockit).first;
-            blockinfo_t* info = (*blockit).second;
-            if (block == alloc)
-                return info;
+    if (!m_sizeClasses)
+        return 0;
 
-            if (isDebugCrtAlloc(block, info)) {
-                // The CRT header is more or less transparent to the user, so
-                // the information about the contained block will probably be
-                // more useful to the user. Accordingly, that's the information
-                // we'll include in the report.
-                if (CRTDBGBLOCKDATA(block) == alloc)
-                    return info;
+    // Blocks are only counted once they leave the pending buffers. The heap
+    // map can't change while any one shard is held.
+    flushAllPendingBlocks();
+    CriticalSectionLocker<> cs(g_heapMapLock.ShardAt(0));
+    SIZE_T heapCount = 0;
+    for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
+        const sizeclasses_t *classes = (*heapit).second->sizeClasses;
+        if (classes == NULL)
+            continue;
+        if ((heaps != NULL) && (heapCount < count)) {
+            VLD_HEAP_SIZE_CLASSES &heap = heaps[heapCount];
+            ZeroMemory(&heap, sizeof(VLD_HEAP_SIZE_CLASSES));
+            heap.heap = (*heapit).first;
+            for (UINT shard = 0; shard < BLOCKMAPSHARDS; shard++) {
+                for (UINT32 index = 0; index < VLD_POW2_CLASSES; index++) {
+                    heap.pow2Live[index] += classes->live[shard][index];
+                    heap.pow2Total[index] += classes->total[shard][index];
+                }
+                for (UINT32 index = 0; index < VLD_LFH_CLASSES; index++) {
+                    heap.lfhLive[index] += classes->live[shard][VLD_POW2_CLASSES + index];
+                    heap.lfhTotal[index] += classes->total[shard][VLD_POW2_CLASSES + index];
+                }
             }
         }
+        heapCount++;
     }
-    return NULL;
+    return heapCount;
 }
 
-const wchar_t* VisualLeakDetector::GetAllocationResolveResults(void* alloc, BOOL showInternalFrames)
+// GetModuleStatistics - Obtains the allocation counters of the loaded
+//   modules. The counters are read while they are updated, so they may be a
+//   few allocations behind.
+//
+//  - modules (OUT): Receives the counters of up to "count" modules.
+//
+//  - count (IN): Size of the "modules" array.
+//
+//  Return Value:
+//
+//    Returns the number of loaded modules, which may be more than "count".
+//
+SIZE_T VisualLeakDetector::GetModuleStatistics (VLD_MODULE_STATISTICS *modules, SIZE_T count)
+{
+    CriticalSectionLocker<> cs(m_modulesLock);
+    SIZE_T moduleCount = 0;
+    for (ModuleSet::Iterator moduleit = m_loadedModules->begin(); moduleit != m_loadedModules->end(); ++moduleit) {
+        const moduleinfo_t &moduleinfo = *moduleit;
+        if ((modules != NULL) && (moduleCount < count)) {
+            VLD_MODULE_STATISTICS &module = modules[moduleCount];
+            ZeroMemory(&module, sizeof(VLD_MODULE_STATISTICS));
+            wcsncpy_s(module.name, _countof(module.name), moduleinfo.name, _TRUNCATE);
+            module.base = (const void*)moduleinfo.addrLow;
+            const modulecounters_t *page = (moduleinfo.image != MODULEIMAGE_NONE) ?
+                m_moduleCounters[moduleinfo.image / MODULEIMAGES_PAGE_SIZE] : NULL;
+            if (page != NULL) {
+                module.allocations = page[moduleinfo.image % MODULEIMAGES_PAGE_SIZE].allocations;
+                module.bytes = page[moduleinfo.image % MODULEIMAGES_PAGE_SIZE].bytes;
+            }
+            module.excluded = (moduleinfo.flags & VLD_MODULE_EXCLUDED) ? 1 : 0;
+            module.autoExcluded = (moduleinfo.flags & VLD_MODULE_AUTOEXCLUDED) ? 1 : 0;
+        }
+        moduleCount++;
+    }
+    return moduleCount;
+}
+
+// EnumerateLeaks - Passes each block which would be reported as a leak to a
+//   callback, in the form of a VLD_LEAK. Like the binary report, nothing is
+//   formatted or symbolized, so the cost is a pass over the block maps plus
+//   whatever the callback does.
+//
+//  - callback (IN): Called with each leak, until it returns 0.
+//
+//  - context (IN): Passed to the callback.
+//
+//  - flags (IN): VLD_ENUM_NO_FRAMES not to copy out the frames.
+//
+//  Return Value:
+//
+//    Returns the number of leaks passed to the callback.
+//
+SIZE_T VisualLeakDetector::EnumerateLeaks (VLD_LEAK_CALLBACK callback, LPVOID context, UINT flags)
 {
     LoaderLock ll;
 
-    if (m_options & VLD_OPT_VLDOFF)
-        return NULL;
+    if ((m_options & VLD_OPT_VLDOFF) || (callback == NULL))
+        return 0;
 
-    CriticalSectionLocker<> cs(g_heapMapLock);
-    blockinfo_t* info = getAllocationBlockInfo(alloc);
-    if (info != NULL)
-    {
-        int unresolvedFunctionsCount = info->callStack->resolve(showInternalFrames);
-        _ASSERT(unresolvedFunctionsCount == 0);
-        return info->callStack->getResolvedCallstack(showInternalFrames);
+    flushAllPendingBlocks();
+    CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+
+    // The frames are decoded into a buffer only as large as the deepest stack.
+    UINT32 capacity = 0;
+    UINT_PTR *frames = NULL;
+    SIZE_T leaks = 0;
+    bool stop = false;
+    for (HeapMap::Iterator heapit = m_heapMap->begin(); !stop && (heapit != m_heapMap->end()); ++heapit) {
+        BlockMap *blockmap = &(*heapit).second->blockMap;
+        for (BlockMap::Iterator blockit = blockmap->begin(); blockit != blockmap->end(); ++blockit) {
+            LPCVOID address;
+            SIZE_T  size;
+            blockinfo_t *info = (*blockit).second;
+            if (!getLeakedBlock((*blockit).first, info, address, size))
+                continue;
+
+            VLD_LEAK leak = { 0 };
+            leak.serialNumber = info->serialNumber;
+            leak.address      = address;
+            leak.size         = size;
+            leak.heap         = (*heapit).first;
+            leak.threadId     = getThreadId(info);
+            if (info->crtHeader != crtheader_none)
+                leak.flags |= VLD_LEAK_CRT;
+            if (info->crtHeader == crtheader_ucrt)
+                leak.flags |= VLD_LEAK_UCRT;
+            const CallStack *stack = info->callStack;
+            if (stack != NULL) {
+                leak.hash       = stack->getHashValue();
+                leak.frameCount = stack->size();
+                leak.stack      = stack;
+                if (!(flags & VLD_ENUM_NO_FRAMES)) {
+                    if (leak.frameCount > capacity) {
+                        delete [] frames;
+                        capacity = leak.frameCount;
+                        frames = new UINT_PTR [capacity];
+                    }
+                    for (UINT32 frame = 0; frame < leak.frameCount; frame++)
+                        frames[frame] = (*stack)[frame];
+                    leak.frames = (const void* const*)frames;
+                }
+            }
+
+            leaks++;
+            if (callback(&leak, context) == 0) {
+                stop = true;
+                break;
+            }
+        }
     }
-    return NULL;
+    delete [] frames;
+    return leaks;
 }
 
-int VisualLeakDetector::resolveStacks(heapinfo_t* heapinfo)
+// EnumLeaksBegin - Sets up a cursor for a paged enumeration of the leaks (see
+//   EnumLeaksNext). Only the blocks allocated so far are enumerated, so the
+//   enumeration comes to an end however busy the program is.
+//
+//  - cursor (OUT): Receives the start of the enumeration.
+//
+//  - flags (IN): VLD_ENUM_NO_FRAMES not to copy out the frames.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::EnumLeaksBegin (VLD_LEAK_CURSOR *cursor, UINT flags)
 {
-    int unresolvedFunctionsCount = 0;
-    BlockMap& blockmap = heapinfo->blockMap;
+    if (cursor == NULL)
+        return;
 
-    for (BlockMap::Iterator blockit = blockmap.begin(); blockit != blockmap.end(); ++blockit) {
-        // Found a block which is still in the BlockMap. We've identified a
-        // potential memory leak.
-        const void* block   = (*blockit).first;
-        blockinfo_t* info   = (*blockit).second;
-        assert(info);
-        if (info == NULL)
-        {
-            continue;
-        }
+    ZeroMemory(cursor, sizeof(VLD_LEAK_CURSOR));
+    cursor->before = serialMark();
+    cursor->flags  = flags;
+}
 
-        if (info->reported) {
-            continue;
+// copyLeakRecord - Copies a block out to a VLD_LEAK_RECORD.
+//
+//  - heap (IN): The block's heap.
+//
+//  - address (IN): Address of the block's user data.
+//
+//  - size (IN): Size of the block's user data.
+//
+//  - info (IN): The block's information.
+//
+//  - frames (IN): Whether the frames of the block's call stack are copied.
+//
+//  - record (OUT): Receives the block.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID VisualLeakDetector::copyLeakRecord (HANDLE heap, LPCVOID address, SIZE_T size, const blockinfo_t *info, bool frames,
+    VLD_LEAK_RECORD &record)
+{
+    ZeroMemory(&record, sizeof(VLD_LEAK_RECORD));
+    record.serialNumber = info->serialNumber;
+    record.address      = address;
+    record.size         = size;
+    record.heap         = heap;
+    record.threadId     = getThreadId(info);
+    if (info->crtHeader != crtheader_none)
+        record.flags |= VLD_LEAK_CRT;
+    if (info->crtHeader == crtheader_ucrt)
+        record.flags |= VLD_LEAK_UCRT;
+    const CallStack *stack = info->callStack;
+    if (stack != NULL) {
+        record.hash       = stack->getHashValue();
+        record.frameCount = stack->size();
+        if (frames) {
+            UINT32 count = min(record.frameCount, (UINT32)VLD_SITE_FRAMES);
+            for (UINT32 frame = 0; frame < count; frame++)
+                record.frames[frame] = (const void*)(*stack)[frame];
         }
+    }
+}
 
-        // The actual memory address
-        const void* address = block;
-        assert(address != NULL);
+// EnumLeaksNext - Fills a batch with the next leaks of a paged enumeration.
+//   The block maps are walked a shard at a time, heap by heap, and only the
+//   shard being walked is locked, for no longer than it takes to fill the
+//   batch. Between batches, the cursor keeps the block the walk stopped at,
+//   and the walk resumes after it (see HashMap::resume and Map::resume).
+//
+//  - cursor (IN/OUT): The enumeration. It's moved past the leaks returned.
+//
+//  - batch (OUT): Receives the leaks.
+//
+//  - count (IN): Size of the batch, in leaks.
+//
+//  Return Value:
+//
+//    Returns the number of leaks put in the batch; fewer than "count" once
+//    the enumeration is over.
+//
+SIZE_T VisualLeakDetector::EnumLeaksNext (VLD_LEAK_CURSOR *cursor, VLD_LEAK_RECORD *batch, SIZE_T count)
+{
+    LoaderLock ll;
 
-        if (isDebugCrtAlloc(block, info)) {
-            // This block is allocated to a CRT heap, so the block has a CRT
-            // memory block header prepended to it.
-            crtdbgblockheader_t* crtheader = (crtdbgblockheader_t*)block;
-            if (!crtheader)
-                continue;
+    if ((m_options & VLD_OPT_VLDOFF) || (cursor == NULL) || (batch == NULL))
+        return 0;
 
-            // Leaks identified as CRT_USE_IGNORE should not be ignored here otherwise
-            // DynamicLoader/Thread test will randomly fail with less leaks being reported.
-            if (CRT_USE_TYPE(crtheader->use) == CRT_USE_FREE ||
-                CRT_USE_TYPE(crtheader->use) == CRT_USE_INTERNAL)
-            {
-                // This block is marked as being used internally by the CRT.
-                // The CRT will free the block after VLD is destroyed.
-                continue;
+    flushAllPendingBlocks();
+    SIZE_T leaks = 0;
+    while ((leaks < count) && (cursor->shard < BLOCKMAPSHARDS)) {
+        // The heap map can't change while a shard is held, but the heap the
+        // walk stopped at may have been destroyed since the last batch.
+        CriticalSectionLocker<> cs(g_heapMapLock.ShardAt(cursor->shard));
+        HeapMap::Iterator heapit = m_heapMap->begin();
+        if (cursor->heap != NULL) {
+            heapit = m_heapMap->find((HANDLE)cursor->heap);
+            if (heapit == m_heapMap->end()) {
+                heapit = m_heapMap->resume((HANDLE)cursor->heap, 0);
+                cursor->block = NULL;
             }
         }
 
-        // Dump the call stack.
-        if (info->callStack)
-        {
-            unresolvedFunctionsCount += info->callStack->resolve(m_options & VLD_OPT_TRACE_INTERNAL_FRAMES);
-            if ((m_options & VLD_OPT_SKIP_CRTSTARTUP_LEAKS) && info->callStack->isCrtStartupAlloc()) {
-                info->reported = true;
-                continue;
+        while (heapit != m_heapMap->end()) {
+            if ((*heapit).first != cursor->heap) {
+                cursor->heap  = (*heapit).first;
+                cursor->block = NULL;
             }
+            const BlockMap::ShardType &blocks = (*heapit).second->blockMap.ShardAt(cursor->shard);
+            BlockMap::ShardType::Iterator blockit = (cursor->block == NULL) ? blocks.begin() :
+                blocks.resume(cursor->block, cursor->position);
+            for (; (leaks < count) && (blockit != blocks.end()); ++blockit) {
+                cursor->block    = (*blockit).first;
+                cursor->position = blocks.position(blockit);
+
+                LPCVOID address;
+                SIZE_T  size;
+                blockinfo_t *info = (*blockit).second;
+                if ((info->serialNumber >= cursor->before) || !getLeakedBlock((*blockit).first, info, address, size))
+                    continue;
+
+                copyLeakRecord((*heapit).first, address, size, info, !(cursor->flags & VLD_ENUM_NO_FRAMES),
+                    batch[leaks++]);
+            }
+            if (leaks == count)
+                break;
+            ++heapit;
+        }
+
+        if (heapit == m_heapMap->end()) {
+            // This shard is done with; the next batch starts on the next one.
+            cursor->shard++;
+            cursor->heap  = NULL;
+            cursor->block = NULL;
         }
     }
-    return unresolvedFunctionsCount;
+    return leaks;
 }
 
-int VisualLeakDetector::ResolveCallstacks()
+// FindContainingBlock - Finds the tracked block which contains an address.
+//   With AddressIndex, each heap's candidate is the block with the greatest
+//   address not above "address", found in its ordered index; pools always
+//   have one. The blocks of the other heaps are searched one by one. A pool's
+//   block lies within a heap's block, so the innermost block found is kept.
+//
+//  - address (IN): The address.
+//
+//  - block (OUT): Receives the block.
+//
+//  Return Value:
+//
+//    Returns TRUE if a block contains the address, or FALSE otherwise.
+//
+BOOL VisualLeakDetector::FindContainingBlock (LPCVOID address, VLD_LEAK_RECORD *block)
 {
     LoaderLock ll;
 
-    if (m_options & VLD_OPT_VLDOFF)
-        return 0;
+    if ((m_options & VLD_OPT_VLDOFF) || (block == NULL))
+        return FALSE;
 
-    int unresolvedFunctionsCount = 0;
-    // Generate the Callstacks early
-    CriticalSectionLocker<> cs(g_heapMapLock);
-    for (HeapMap::Iterator heapiter = m_heapMap->begin(); heapiter != m_heapMap->end(); ++heapiter)
-    {
-        HANDLE heap = (*heapiter).first;
-        UNREFERENCED_PARAMETER(heap);
-        heapinfo_t* heapinfo = (*heapiter).second;
-        unresolvedFunctionsCount += resolveStacks(heapinfo);
+    flushAllPendingBlocks();
+    CriticalSectionLocker<HeapMapLock> cs(g_heapMapLock);
+    HANDLE       foundheap = NULL;
+    LPCVOID      foundmem = NULL;
+    blockinfo_t *found = NULL;
+    for (HeapMap::Iterator heapit = m_heapMap->begin(); heapit != m_heapMap->end(); ++heapit) {
+        heapinfo_t *heapinfo = (*heapit).second;
+        BlockMap   *blockmap = &heapinfo->blockMap;
+        LPCVOID      mem = NULL;
+        blockinfo_t *info = NULL;
+        if (heapinfo->addresses != NULL) {
+            Set<LPCVOID>::Iterator it = heapinfo->addresses->floor(address);
+            if (it == heapinfo->addresses->end())
+                continue;
+            BlockMap::Iterator blockit = blockmap->find(*it);
+            if (blockit == blockmap->end())
+                continue;
+            mem  = (*blockit).first;
+            info = (*blockit).second;
+            if (((UINT_PTR)address - (UINT_PTR)mem) >= max(info->size, (SIZE_T)1))
+                continue;
+        }
+        else {
+            for (BlockMap::Iterator blockit = blockmap->begin(); blockit != blockmap->end(); ++blockit) {
+                if (((UINT_PTR)address - (UINT_PTR)(*blockit).first) < max((*blockit).second->size, (SIZE_T)1)) {
+                    mem  = (*blockit).first;
+                    info = (*blockit).second;
+                    break;
+                }
+            }
+            if (info == NULL)
+                continue;
+        }
+        if ((found == NULL) || (mem > foundmem) || ((mem == foundmem) && (info->size < found->size))) {
+            foundheap = (*heapit).first;
+            foundmem  = mem;
+            found     = info;
+        }
     }
-    return unresolvedFunctionsCount;
+    if (found == NULL)
+        return FALSE;
+
+    LPCVOID data = foundmem;
+    SIZE_T  size = found->size;
+    if (isDebugCrtAlloc(foundmem, found)) {
+        data = CRTDBGBLOCKDATA(foundmem);
+        size = getCrtBlockSize(foundmem, found);
+    }
+    copyLeakRecord(foundheap, data, size, found, true, *block);
+    return TRUE;
+}
+
+// ResolveLeakFrame - Resolves a frame of a leak passed to the callback of
+//   EnumerateLeaks, through the SymbolCache. The frame's module may have been
+//   unloaded since; its symbols are then loaded again (see symbolAddress).
+//
+//  - leak (IN): The leak.
+//
+//  - frame (IN): Index of the frame, 0 being the innermost one.
+//
+//  - info (OUT): Receives the frame's symbolic information.
+//
+//  Return Value:
+//
+//    Returns TRUE if the leak has such a frame, FALSE otherwise.
+//
+BOOL VisualLeakDetector::ResolveLeakFrame (const VLD_LEAK *leak, UINT frame, VLD_FRAME_INFO *info)
+{
+    if ((leak == NULL) || (info == NULL) || (leak->stack == NULL) || (frame >= leak->frameCount))
+        return FALSE;
+
+    LoaderLock ll;
+    const CallStack *stack = (const CallStack*)leak->stack;
+    CriticalSectionLocker<DbgHelp> locker(g_DbgHelp);
+    const symbolinfo_t *symbol = g_symbolCache.Lookup(stack->symbolAddress(frame, locker), locker);
+    info->programCounter   = (const void*)(*stack)[frame];
+    info->displacement     = symbol->displacement;
+    info->lineNumber       = symbol->lineNumber;
+    info->lineDisplacement = symbol->lineDisplacement;
+    wcsncpy_s(info->functionName, VLD_FRAME_NAME_LENGTH, symbol->functionName, _TRUNCATE);
+    info->fileName[0] = L'\0';
+    if (symbol->fileName != NULL)
+        wcsncpy_s(info->fileName, VLD_FRAME_FILE_LENGTH, symbol->fileName, _TRUNCATE);
+    return TRUE;
+}
+
+CaptureContext::CaptureContext(void* func, context_t& context, BOOL debug, BOOL ucrt)
+    : CaptureContext(func, context, g_vld.getTls(), debug, ucrt) {
+    // Only the CRT and MFC thunks create their contexts this way.
+    m_crt = TRUE;
 }
 
-CaptureContext::CaptureContext(void* func, context_t& context, BOOL debug, BOOL ucrt) : m_context(context) {
+CaptureContext::CaptureContext(void* func, context_t& context, tls_t* tls, BOOL debug, BOOL ucrt) : m_context(context) {
     context.func = reinterpret_cast<UINT_PTR>(func);
-    m_tls = g_vld.getTls();
+    m_tls = tls;
+    m_crt = FALSE;
+    m_startTicks = g_vld.m_latencyProfiling ? __rdtsc() : 0;
+    m_batch = NULL;
+    m_batchCount = 0;
 
     if (debug) {
         m_tls->flags |= VLD_TLS_DEBUGCRTALLOC;
@@ -2924,16 +10372,52 @@ CaptureContext::~CaptureContext() {
     if (!m_bFirst)
         return;
 
-    if ((m_tls->blockWithoutGuard) && (!IsExcludedModule())) {
-        blockinfo_t* pblockInfo = NULL;
+    UINT64 tracking = (m_startTicks != 0) ? __rdtsc() : 0;
+    bool allocated = (m_tls->blockWithoutGuard != NULL);
+
+    if ((m_tls->blockWithoutGuard == NULL) || IsExcludedModule()) {
+        // Nothing was allocated, or it's not to be tracked.
+    }
+    else if (m_tls->flags & VLD_TLS_CRTBLOCK) {
+        // The CRT uses the block internally and frees it after VLD is gone;
+        // it would never be reported, so it isn't tracked at all. A block
+        // reallocated as one stops being tracked.
+        if (m_tls->newBlockWithoutGuard != NULL)
+            g_vld.unmapBlock(m_tls->heap, m_tls->blockWithoutGuard, m_tls->context);
+    }
+    else if (m_batch != NULL) {
+        // Blocks allocated at once from a pool: each one is sampled on its
+        // own, but they share one call stack.
+        g_vld.mapBlocks(m_tls, m_batch, m_batchCount);
+    }
+    else if (!g_vld.sampleAllocation(m_tls, m_tls->size)) {
+        // This allocation isn't sampled. A reallocated block stops being
+        // tracked, as if it was freed and its replacement not sampled.
+        if (m_tls->newBlockWithoutGuard != NULL)
+            g_vld.unmapBlock(m_tls->heap, m_tls->blockWithoutGuard, m_tls->context);
+    }
+    else {
+        // Capture the call stack before the block is mapped, so that no lock
+        // is held while the stack is walked and the CallStack allocated. A
+        // block reallocated in place may keep the one it has, in which case
+        // nothing needs to be captured.
+        capturedstack_t stack;
+        stack.keep = (m_tls->newBlockWithoutGuard == m_tls->blockWithoutGuard) &&
+            (g_vld.m_reallocStackPolicy != VLD_REALLOC_STACK_LATEST);
+        if (stack.keep && (g_vld.m_reallocStackPolicy == VLD_REALLOC_STACK_ORIGINAL))
+            stack.skipped = true;
+        else
+            g_vld.captureStack(m_tls, m_tls->context, stack);
+
         if (m_tls->newBlockWithoutGuard == NULL) {
             g_vld.mapBlock(m_tls->heap,
                 m_tls->blockWithoutGuard,
                 m_tls->size,
                 (m_tls->flags & VLD_TLS_DEBUGCRTALLOC) != 0,
                 (m_tls->flags & VLD_TLS_UCRT) != 0,
-                m_tls->threadId,
-                pblockInfo);
+                m_tls->threadIndex,
+                (WORD)m_tls->excludedImage,
+                stack);
         }
         else {
             g_vld.remapBlock(m_tls->heap,
@@ -2942,17 +10426,22 @@ CaptureContext::~CaptureContext() {
                 m_tls->size,
                 (m_tls->flags & VLD_TLS_DEBUGCRTALLOC) != 0,
                 (m_tls->flags & VLD_TLS_UCRT) != 0,
-                m_tls->threadId,
-                pblockInfo, m_tls->context);
+                m_tls->threadIndex,
+                (WORD)m_tls->excludedImage,
+                stack, m_tls->context);
         }
-
-        CallStack* callstack = CallStack::Create();
-        callstack->getStackTrace(g_vld.m_maxTraceFrames, m_tls->context);
-        pblockInfo->callStack.reset(callstack);
     }
 
     // Reset thread local flags and variables for the next allocation.
     Reset();
+
+    if (m_startTicks != 0) {
+        UINT64 now = __rdtsc();
+        if (allocated)
+            g_vld.recordLatency(m_tls, VLD_HOOK_CAPTURE, now - tracking);
+        if (m_crt)
+            g_vld.recordLatency(m_tls, VLD_HOOK_CRT, now - m_startTicks);
+    }
 }
 
 void CaptureContext::Set(HANDLE heap, LPVOID mem, LPVOID newmem, SIZE_T size) {
@@ -2968,29 +10457,186 @@ void CaptureContext::Set(HANDLE heap, LPVOID mem, LPVOID newmem, SIZE_T size) {
     }
 }
 
+// SetBatch - Hands several blocks of the same size, allocated at once from a
+//   custom allocator's pool, over to the context (see VLDTrackAllocN). They're
+//   tracked as separate blocks, but their call stack is only captured once.
+//   Blocks set from within another context are left untracked, as the outer
+//   context's own block would be overwritten.
+//
+//  - heap (IN): The pool's pseudo-heap (see VLD_POOL_HEAP).
+//
+//  - blocks (IN): The blocks allocated. The first one must not be NULL; the
+//      array must stay valid until the context is destroyed.
+//
+//  - count (IN): Number of entries in "blocks".
+//
+//  - size (IN): Size, in bytes, of each block.
+//
+//  Return Value:
+//
+//    None.
+//
+void CaptureContext::SetBatch(HANDLE heap, LPVOID const *blocks, SIZE_T count, SIZE_T size) {
+    if (!m_bFirst)
+        return;
+    m_batch = blocks;
+    m_batchCount = count;
+    Set(heap, blocks[0], NULL, size);
+}
+
+// SetBlockType - Notes the CRT "use type" a debug CRT function was asked to
+//   allocate the block with. Blocks used internally by the CRT (_CRT_BLOCK)
+//   are then left untracked, with no call stack captured, rather than being
+//   tracked for their whole lifetime only to be skipped by every report.
+//
+//  - type (IN): The use type, as passed to _malloc_dbg and the like.
+//
+//  Return Value:
+//
+//    None.
+//
+void CaptureContext::SetBlockType(int type) {
+    if (m_bFirst && (CRT_USE_TYPE(type) == CRT_USE_INTERNAL))
+        m_tls->flags |= VLD_TLS_CRTBLOCK;
+}
+
+// RecordNested - Records an allocation made by a heap function called from
+//   within a patched CRT (or other outer) function on the same thread. The
+//   outer function's CaptureContext already holds the context from which the
+//   call stack will be captured, so the heap hook doesn't need to capture a
+//   context or construct a CaptureContext of its own; it just hands the block
+//   over to the outer one.
+//
+//  - tls (IN): The calling thread's TLS.
+//
+//  - heap (IN): Handle to the heap the block was allocated from.
+//
+//  - mem (IN): The allocated block, or the original block if reallocating.
+//
+//  - newmem (IN): The reallocated block, or NULL.
+//
+//  - size (IN): Size, in bytes, of the (re)allocated block.
+//
+//  Return Value:
+//
+//    Returns true if the allocation was handed over to an outer
+//    CaptureContext. Returns false if the caller must capture it itself.
+//
+bool CaptureContext::RecordNested(tls_t* tls, HANDLE heap, LPVOID mem, LPVOID newmem, SIZE_T size) {
+    if ((GET_RETURN_ADDRESS(tls->context) == NULL) || (g_vld.m_options & VLD_OPT_TRACE_INTERNAL_FRAMES)) {
+        // There's no outer context, or the context is to be captured down to
+        // the heap function.
+        return false;
+    }
+
+    tls->heap = heap;
+    tls->blockWithoutGuard = mem;
+    tls->newBlockWithoutGuard = newmem;
+    tls->size = size;
+    return true;
+}
+
 void CaptureContext::Reset() {
     m_tls->context.func = NULL;
     m_tls->context.fp = NULL;
-#if defined(_M_IX86)
-    m_tls->context.Ebp = m_tls->context.Esp = m_tls->context.Eip = NULL;
-#elif defined(_M_X64)
-    m_tls->context.Rbp = m_tls->context.Rsp = m_tls->context.Rip = NULL;
-#endif
-    m_tls->flags &= ~(VLD_TLS_DEBUGCRTALLOC | VLD_TLS_UCRT);
+    m_tls->context.stack = NULL;
+    m_tls->flags &= ~(VLD_TLS_DEBUGCRTALLOC | VLD_TLS_UCRT | VLD_TLS_CRTBLOCK);
     Set(NULL, NULL, NULL, NULL);
 }
 
-BOOL CaptureContext::IsExcludedModule() {
-    HMODULE hModule = GetCallingModule(m_context.fp);
-    if (hModule == g_vld.m_dbghlpBase)
-        return TRUE;
+// FindModuleRange - Binary searches a module range table.
+//
+//  - table (IN): The module range table, or NULL.
+//
+//  - address (IN): The address to look up.
+//
+//  Return Value:
+//
+//    Returns the range containing the address, or NULL if the address isn't
+//    within any module in the table.
+//
+const modulerange_t* FindModuleRange (const moduleranges_t *table, UINT_PTR address)
+{
+    if (table == NULL)
+        return NULL;
 
-    UINT tablesize = _countof(g_vld.m_patchTable);
-    for (UINT index = 0; index < tablesize; index++) {
-        if (((HMODULE)g_vld.m_patchTable[index].moduleBase == hModule)) {
-            return !g_vld.m_patchTable[index].reportLeaks;
+    SIZE_T low = 0;
+    SIZE_T high = table->count;
+    while (low < high) {
+        SIZE_T middle = low + (high - low) / 2;
+        const modulerange_t &range = table->ranges[middle];
+        if (address < range.addrLow)
+            high = middle;
+        else if (address > range.addrHigh)
+            low = middle + 1;
+        else
+            return &range;
+    }
+    return NULL;
+}
+
+// FindPatchEntry - Looks up a function in the patch table index.
+//
+//  - index (IN): The patch table index, or NULL.
+//
+//  - module (IN): Handle (base address) of the module exporting the function.
+//
+//  - procname (IN): The name (or ordinal) of the function.
+//
+//  Return Value:
+//
+//    Returns the patch entry for the function, or NULL if it isn't patched.
+//
+const patchentry_t* FindPatchEntry (const patchindex_t *index, HMODULE module, LPCSTR procname)
+{
+    if ((index == NULL) || (module == NULL) || (procname == NULL))
+        return NULL;
+
+    UINT32 hash = hashPatchKey((UINT_PTR)module, procname);
+    for (SIZE_T slot = hash & index->mask; ; slot = (slot + 1) & index->mask) {
+        const patchindexentry_t &candidate = index->slots[slot];
+        if (candidate.moduleBase == 0x0)
+            return NULL;
+        if ((candidate.moduleBase == (UINT_PTR)module) && (candidate.hash == hash) &&
+            matchesPatchKey(candidate.importName, procname))
+            return candidate.patch;
+    }
+}
+
+BOOL CaptureContext::IsExcludedModule() {
+    TickCounter ticks(m_tls->stats.exclusionCheckTicks);
+    m_tls->stats.exclusionChecks++;
+
+    // A page never spans two modules, so the last answer holds for every
+    // return address on the same page, until the module table changes.
+    UINT_PTR address = m_context.fp;
+    UINT_PTR page = address & ~VLD_EXCLUSION_PAGE_MASK;
+    ModuleRangesReader reader(g_vld, m_tls);
+    const moduleranges_t *table = reader.Table();
+    if ((table == NULL) || (m_tls->excludedEpoch != table->epoch) || (m_tls->excludedPage != page)) {
+        BOOL excluded;
+        const modulerange_t *range = FindModuleRange(table, address);
+        if (range != NULL) {
+            excluded = range->excluded;
+            m_tls->excludedImage = range->image;
+            m_tls->traceFrames = range->maxFrames;
+            m_tls->traceWalk = range->walkMethod;
+        }
+        else {
+            // Not a module VLD knows about (yet): ask the memory manager.
+            HMODULE hModule = GetCallingModule(address);
+            excluded = g_vld.isModuleExcluded(hModule);
+            m_tls->excludedImage = MODULEIMAGE_NONE;
+            m_tls->traceFrames = 0;
+            m_tls->traceWalk = CALLSTACK_WALK_CONFIGURED;
         }
+
+        m_tls->excludedEpoch = (table != NULL) ? table->epoch : 0;
+        m_tls->excludedPage = page;
+        m_tls->excluded = excluded;
     }
 
-    return g_vld.isModuleExcluded((UINT_PTR)hModule);
+    if (m_tls->excludedImage != MODULEIMAGE_NONE)
+        g_vld.countModuleAllocation(m_tls->excludedImage, m_tls->size);
+    return m_tls->excluded;
 }
\ No newline at end of file
@@ -160,6 +160,22 @@ __declspec(dllimport) VLD_UINT VLDGetLeaksCount ();
 //
 __declspec(dllimport) VLD_UINT VLDGetThreadLeaksCount (VLD_UINT threadId);
 
+// VLDGetModuleLeaksCount - Return the number of leaks allocated from a module's
+//   code to the execution point. Each block is counted for the module which
+//   called the allocator, or last reallocated it, as the ExcludeModules check
+//   sees it. The count is kept up to date as blocks are allocated and freed,
+//   so calling this doesn't walk the heaps. The module must still be loaded.
+//   Leaks marked with VLDMarkThreadLeaksAsReported still count for their
+//   module; VLDMarkAllLeaksAsReported clears every module's count.
+//
+// module: handle (base address) of the module.
+//
+//  Return Value:
+//
+//    The number of leaks, or 0 if the module isn't known.
+//
+__declspec(dllimport) VLD_UINT VLDGetModuleLeaksCount (VLD_HMODULE module);
+
 // VLDMarkAllLeaksAsReported - Mark all leaks as reported.
 //
 //  Return Value:
@@ -234,11 +250,17 @@ __declspec(dllimport) void VLDGetReportFilename(wchar_t *filename);
 // VLD_OPT_AGGREGATE_DUPLICATES
 // VLD_OPT_MODULE_LIST_INCLUDE
 // VLD_OPT_SAFE_STACK_WALK
+// VLD_OPT_UNWIND_STACK_WALK
+// VLD_OPT_FRAME_STACK_WALK
+// VLD_OPT_SHADOW_STACK_WALK (both of the above)
 // VLD_OPT_SLOW_DEBUGGER_DUMP
 // VLD_OPT_TRACE_INTERNAL_FRAMES
 // VLD_OPT_START_DISABLED
 // VLD_OPT_SKIP_HEAPFREE_LEAKS
 // VLD_OPT_VALIDATE_HEAPFREE
+// VLD_OPT_SKIP_CRTSTARTUP_LEAKS
+// VLD_OPT_SUMMARY_REPORT
+// VLD_OPT_SUMMARY_BY_COUNT
 //
 // maxDataDump: maximum number of user-data bytes to dump for each leaked block.
 //
@@ -283,6 +305,11 @@ __declspec(dllimport) VLD_BOOL VLDGetModulesList(wchar_t *modules, VLD_UINT size
 // VLD_OPT_REPORT_TO_FILE
 // VLD_OPT_REPORT_TO_STDOUT
 // VLD_OPT_UNICODE_REPORT
+// VLD_OPT_UTF8_REPORT
+// VLD_OPT_REPORT_TO_BINARY (requires filename)
+// VLD_OPT_REPORT_JSON (requires filename, instead of VLD_OPT_REPORT_TO_FILE)
+// VLD_OPT_REPORT_CSV (requires filename, instead of VLD_OPT_REPORT_TO_FILE)
+// VLD_OPT_REPORT_FOLDED (requires filename, instead of VLD_OPT_REPORT_TO_FILE)
 //
 // filename is optional and can be NULL.
 //
@@ -306,11 +333,10 @@ __declspec(dllimport) void VLDSetReportOptions(VLD_UINT option_mask, const wchar
 __declspec(dllimport) int VLDSetReportHook(int mode,  VLD_REPORT_HOOK pfnNewHook);
 
 // VLDResolveCallstacks - Performs symbol resolution for all saved extent CallStack's that have
-// been tracked by Visual Leak Detector. This function is necessary for applications that
-// dynamically load and unload modules, and through which memory leaks might be included.
-// If this is NOT called, stack traces may have stack frames with no symbol information. This
-// happens because the symbol API's cannot look up symbols for a binary / module that has been unloaded
-// from the process.
+// been tracked by Visual Leak Detector. Calling it before unloading a module is no longer
+// necessary: VLD remembers every module it has seen loaded, and loads the symbols of an
+// unloaded module from its file if leaks from it are resolved later on. It is still useful
+// if that file may be gone by then.
 //
 //  Return Value:
 //
@@ -318,6 +344,485 @@ __declspec(dllimport) int VLDSetReportHook(int mode,  VLD_REPORT_HOOK pfnNewHook
 //
 __declspec(dllexport) int VLDResolveCallstacks();
 
+// VLDTakeSnapshot - Records the current point in the program's allocation
+// history. Pass two snapshots to VLDDiffSnapshots to find out which memory
+// allocated in between is still allocated, e.g. once per request or cycle
+// of a long-running service.
+//
+//  Return Value:
+//
+//    VLD_SIZET: The snapshot.
+//
+__declspec(dllimport) VLD_SIZET VLDTakeSnapshot();
+
+// VLDDiffSnapshots - Reports the memory which was allocated between two
+// snapshots and has not been freed yet, grouped by the call stack that
+// allocated it, largest growth first. The cost depends on the number of
+// blocks allocated since the first snapshot, not on the total number of
+// blocks tracked.
+//
+// from: The earlier snapshot, as returned by VLDTakeSnapshot.
+//
+// to: The later snapshot, or 0 to include everything allocated since "from".
+//
+//  Return Value:
+//
+//    VLD_UINT: The number of blocks allocated between the snapshots which are
+//    still allocated.
+//
+__declspec(dllimport) VLD_UINT VLDDiffSnapshots(VLD_SIZET from, VLD_SIZET to);
+
+// VLDGetStatistics - Returns how often VLD did its work on each allocation and
+// free, and how long it took, how long leak reports took to generate, plus the
+// program's and VLD's own memory usage. Times are in time stamp counter ticks.
+// The hot path counters are kept per thread and added up when this is called, so they
+// may be slightly behind for threads which are busy allocating. With the
+// LockProfiling option, the acquisitions and contention of VLD's main locks
+// are returned too, and with the LatencyProfiling option, the latency
+// percentiles of the heap hooks, merged from every thread's histograms.
+//
+// statistics: Receives the statistics.
+//
+//  Return Value:
+//
+//    None.
+//
+__declspec(dllimport) void VLDGetStatistics(VLD_STATISTICS *statistics);
+
+// VLDGetMemoryUsage - Returns how much memory VLD itself takes, broken down by
+// what it holds: the block index, the block records, the call stacks, their
+// resolved text, the module tables and the per-thread state, plus what VLD's
+// private heap and metadata region have allocated and committed in all.
+//
+// usage: Receives the memory usage.
+//
+//  Return Value:
+//
+//    None.
+//
+__declspec(dllimport) void VLDGetMemoryUsage(VLD_MEMORY_USAGE *usage);
+
+// VLDGetSiteStatistics - Returns the allocation statistics of the call stacks
+// that currently hold the most memory, or that allocated the most blocks:
+// what each of them holds now, how much it allocated so far, and the most it
+// ever held at once. Requires the SiteStatistics option in vld.ini; call
+// stacks are then kept for the lifetime of the process.
+//
+// sites: Receives the statistics of up to "count" call stacks, ranked.
+//
+// count: Number of entries in "sites".
+//
+// byAllocations: If TRUE, the call stacks are ranked by the number of blocks
+//   they allocated, instead of by the number of bytes they currently hold.
+//
+//  Return Value:
+//
+//    VLD_UINT: The number of call stacks with statistics, which may be more
+//    than "count". 0 if SiteStatistics is off.
+//
+__declspec(dllimport) VLD_UINT VLDGetSiteStatistics(VLD_SITE_STATISTICS *sites, VLD_UINT count, VLD_BOOL byAllocations);
+
+// VLDGetHeapSizeClasses - Returns how many blocks of each size class every
+// heap holds now, and has been asked for so far, both in power-of-two classes
+// and in the size classes of the low-fragmentation heap. They show which
+// heaps would benefit from a pool, and how many blocks are too large for the
+// LFH. Requires the SizeClassHistogram option in vld.ini.
+//
+// heaps: Receives the histograms of up to "count" heaps.
+//
+// count: Number of entries in "heaps".
+//
+//  Return Value:
+//
+//    VLD_UINT: The number of heaps with histograms, which may be more than
+//    "count". 0 if SizeClassHistogram is off.
+//
+__declspec(dllimport) VLD_UINT VLDGetHeapSizeClasses(VLD_HEAP_SIZE_CLASSES *heaps, VLD_UINT count);
+
+// VLDGetModuleStatistics - Returns how many blocks, and bytes, each loaded
+// module has allocated so far, counted by the module which called the heap
+// function. They show which modules VLD spends its time on, and which ones
+// AutoExcludeHotModules has excluded.
+//
+// modules: Receives the counters of up to "count" modules, in address order.
+//
+// count: Number of entries in "modules".
+//
+//  Return Value:
+//
+//    VLD_UINT: The number of loaded modules, which may be more than "count".
+//
+__declspec(dllimport) VLD_UINT VLDGetModuleStatistics(VLD_MODULE_STATISTICS *modules, VLD_UINT count);
+
+// VLDGetCapturePolicy - Returns how allocations are sampled and their call
+// stacks traced right now. The moduleTracePolicy field is set to NULL.
+//
+// policy: Receives the capture policy.
+//
+//  Return Value:
+//
+//    None.
+//
+__declspec(dllimport) void VLDGetCapturePolicy(VLD_CAPTURE_POLICY *policy);
+
+// VLDSetCapturePolicy - Changes how allocations are sampled and their call
+// stacks traced, while the program runs. The new policy applies to every
+// allocation from then on, as a whole; allocations in progress complete
+// with the old one. Sampled leaks are estimated with the policy in effect
+// when they are reported.
+//
+// policy: The new capture policy.
+//
+//  Return Value:
+//
+//    None.
+//
+__declspec(dllimport) void VLDSetCapturePolicy(const VLD_CAPTURE_POLICY *policy);
+
+// VLDGetMiniDumpStream - Copies VLD's module table, call stacks and live
+// blocks into a minidump user stream, for programs which write their own
+// minidumps. Nothing is symbolized: a tool reading the dump later finds the
+// stream by its type and resolves the frames with the dump's symbols. Free
+// the stream with VLDFreeMiniDumpStream once the minidump is written.
+//
+// stream: Receives the stream.
+//
+//  Return Value:
+//
+//    VLD_BOOL: TRUE if the stream was built, FALSE if it couldn't be.
+//
+__declspec(dllimport) VLD_BOOL VLDGetMiniDumpStream(VLD_MINIDUMP_STREAM *stream);
+
+// VLDFreeMiniDumpStream - Frees a stream returned by VLDGetMiniDumpStream.
+//
+// stream: The stream.
+//
+//  Return Value:
+//
+//    None.
+//
+__declspec(dllimport) void VLDFreeMiniDumpStream(VLD_MINIDUMP_STREAM *stream);
+
+// VLDWriteMiniDump - Writes a minidump of the process with VLD's state added
+// as a user stream. Like any minidump written from within the process, it's
+// best written from a thread which doesn't hold any heap lock.
+//
+// file: Handle of the file to write the minidump to (a HANDLE).
+//
+// dumpType: The MINIDUMP_TYPE flags of the minidump.
+//
+// exceptionPointers: The EXCEPTION_POINTERS of the exception the calling
+//   thread is handling, or NULL if there is none.
+//
+//  Return Value:
+//
+//    VLD_BOOL: TRUE if the minidump was written, FALSE otherwise.
+//
+__declspec(dllimport) VLD_BOOL VLDWriteMiniDump(void *file, VLD_UINT dumpType, void *exceptionPointers);
+
+// VLDWriteHeapProfile - Writes the live blocks to a file as a pprof heap
+// profile: a gzip'd profile.proto message with the blocks and bytes of each
+// call stack, its frames as locations and the loaded modules as mappings, so
+// that "pprof" and the tools which read its format can show it.
+//
+// path: The file to write the profile to (e.g. "heap.pb.gz").
+//
+// symbolize: If TRUE, the function names and source lines of the frames are
+//   written too. Otherwise only the addresses and modules are, which is
+//   quicker, and pprof resolves them later from the modules' PDBs.
+//
+//  Return Value:
+//
+//    VLD_BOOL: TRUE if the profile was written, FALSE otherwise.
+//
+__declspec(dllimport) VLD_BOOL VLDWriteHeapProfile(const wchar_t *path, VLD_BOOL symbolize);
+
+// VLDEnumerateLeaks - Calls a function for each block that would be reported
+// as a leak right now, with its numbers and raw call stack instead of report
+// text. Nothing is formatted or symbolized; frames of interest can be
+// resolved from within the callback with VLDResolveLeakFrame. The heap maps
+// are locked during the enumeration, so other threads allocating or freeing
+// memory wait until it's over.
+//
+// callback: Called with each leak, until it returns 0.
+//
+// context: Passed to the callback.
+//
+// flags: VLD_ENUM_NO_FRAMES not to copy out the program counters, for callers
+//   which only need the numbers.
+//
+//  Return Value:
+//
+//    VLD_UINT: The number of leaks the callback was called with.
+//
+__declspec(dllimport) VLD_UINT VLDEnumerateLeaks(VLD_LEAK_CALLBACK callback, void *context, VLD_UINT flags);
+
+// VLDResolveLeakFrame - Resolves one frame of a leak's call stack to its
+// function, source file and line. Only valid from within the callback of
+// VLDEnumerateLeaks.
+//
+// leak: The leak, as passed to the callback.
+//
+// frame: Index of the frame, 0 being the innermost one.
+//
+// info: Receives the frame's symbolic information.
+//
+//  Return Value:
+//
+//    VLD_BOOL: TRUE if the leak has such a frame, FALSE otherwise.
+//
+__declspec(dllimport) VLD_BOOL VLDResolveLeakFrame(const VLD_LEAK *leak, VLD_UINT frame, VLD_FRAME_INFO *info);
+
+// VLDEnumLeaksBegin - Begins a paged enumeration of the leaks: each call to
+// VLDEnumLeaksNext then returns the next batch of them. Only one shard of the
+// heap maps is locked at a time, and only while a batch is filled, so even
+// millions of leaks can be paged through without other threads ever waiting
+// long. The price is that the enumeration isn't a snapshot: blocks freed
+// between batches may still be returned, and blocks allocated since it began
+// never are.
+//
+// cursor: Receives the start of the enumeration.
+//
+// flags: VLD_ENUM_NO_FRAMES not to copy out the program counters.
+//
+//  Return Value:
+//
+//    None.
+//
+__declspec(dllimport) void VLDEnumLeaksBegin(VLD_LEAK_CURSOR *cursor, VLD_UINT flags);
+
+// VLDEnumLeaksNext - Returns the next batch of a paged leak enumeration (see
+// VLDEnumLeaksBegin).
+//
+// cursor: The enumeration, as set up by VLDEnumLeaksBegin. It's moved past
+//   the leaks returned.
+//
+// batch: Receives the leaks.
+//
+// count: Size of the batch, in leaks.
+//
+//  Return Value:
+//
+//    VLD_UINT: The number of leaks returned. Fewer than "count" are only
+//      returned once the enumeration is over.
+//
+__declspec(dllimport) VLD_UINT VLDEnumLeaksNext(VLD_LEAK_CURSOR *cursor, VLD_LEAK_RECORD *batch, VLD_UINT count);
+
+// VLDFindContainingBlock - Finds the tracked block an address points into,
+// whether to its start or anywhere within it, as when a crash handler or a
+// debugger extension wants to know where the memory behind a pointer was
+// allocated. A block carved out of a pool (see VLDTrackAlloc) is found rather
+// than the heap chunk it lies in. With AddressIndex (see vld.ini), each heap
+// is searched in logarithmic time; otherwise its blocks are searched one by
+// one. Blocks are found whether or not they'd be reported.
+//
+// address: The address.
+//
+// block: Receives the block, as a leak would be returned by VLDEnumLeaksNext.
+//
+//  Return Value:
+//
+//    VLD_BOOL: TRUE if a tracked block contains the address, FALSE otherwise.
+//
+__declspec(dllimport) VLD_BOOL VLDFindContainingBlock(const void *address, VLD_LEAK_RECORD *block);
+
+// VLDReportLeaksAsync - Reports the leaks like VLDReportLeaks, but only holds
+// up the program while they are found. The leaks are copied (with the data
+// that would be dumped) while the heap maps are locked, and are then
+// symbolized and written out by a background thread. The report always has
+// the layout of the full text report.
+//
+// callback: Called from the background thread once the report has been
+//   written. May be NULL.
+//
+// context: Passed to the callback.
+//
+//  Return Value:
+//
+//    VLD_UINT: The number of leaks that will be reported, or (VLD_UINT)-1 if
+//    the previous asynchronous report is still being written; no report is
+//    started then, and the callback isn't called.
+//
+__declspec(dllimport) VLD_UINT VLDReportLeaksAsync(VLD_REPORT_CALLBACK callback, void *context);
+
+// VLDReportLeaksOlderThan - Reports the leaks like VLDReportLeaks, but only
+// those allocated at least "age" milliseconds ago, so that periodic checks can
+// leave out the blocks a program is still working with. Allocation times are
+// only known to within AllocationTimeResolution, which must be set; nothing is
+// reported otherwise.
+//
+// age: The minimum age of the leaks to report, in milliseconds.
+//
+//  Return Value:
+//
+//    VLD_UINT: The number of leaks found.
+//
+__declspec(dllimport) VLD_UINT VLDReportLeaksOlderThan(VLD_UINT age);
+
+// VLDReportPeak - Reports which allocation sites made up the memory in use at
+// the last peak snapshot, largest first. A snapshot is taken whenever the
+// memory in use grows PeakSnapshotStep bytes past the previous one, which must
+// be set; nothing is reported otherwise.
+//
+//  Return Value:
+//
+//    VLD_UINT: The number of allocation sites in the snapshot.
+//
+__declspec(dllimport) VLD_UINT VLDReportPeak();
+
+// VLDReportChurn - Reports the allocation sites which allocated the most
+// blocks so far, freed or not: how many blocks and bytes each allocated, how
+// many it freed, their average size, how many of the frees were made by other
+// threads than the allocating one, and a histogram of how many allocations
+// were made while the freed blocks were allocated. Short-lived blocks are
+// counted too, so this shows where the allocation rate comes from, which
+// allocations are worth pooling, and which are request-scoped and could go to
+// an arena. Requires the SiteStatistics option in vld.ini; nothing is reported
+// otherwise.
+//
+//  Return Value:
+//
+//    VLD_UINT: The number of allocation sites with statistics.
+//
+__declspec(dllimport) VLD_UINT VLDReportChurn();
+
+// VLDReportReallocStorms - Reports the allocation sites which grew blocks by
+// reallocating them over and over by small increments, as a buffer appended
+// to one piece at a time is: each reallocation may copy the whole buffer, so
+// the cost grows with the square of its size. Sites are ranked by the bytes
+// their reallocations may have copied. Requires the SiteStatistics option in
+// vld.ini; nothing is reported otherwise.
+//
+// minReallocs: The number of reallocations growing a block by less than half
+//   a site needs to be reported.
+//
+//  Return Value:
+//
+//    VLD_UINT: The number of allocation sites reported.
+//
+__declspec(dllimport) VLD_UINT VLDReportReallocStorms(VLD_UINT minReallocs);
+
+// VLDPushTag - Makes "tag" the calling thread's allocation tag until the
+// matching VLDPopTag. Every block the thread allocates meanwhile is stamped
+// with it, and the leak report shows each leak's tag. Tags nest; only the
+// innermost one is stamped. A tag costs far less than a call stack, so with
+// StackWalkMethod = none it can stand in for call stacks altogether.
+//
+// tag: The tag's name. Tags are told apart by the address of the name first,
+//   so the name should be a string literal, or at least not change while it's
+//   in use. Up to 2047 distinct tags are kept; further ones are ignored.
+//
+//  Return Value:
+//
+//    None.
+//
+__declspec(dllimport) void VLDPushTag(const char *tag);
+
+// VLDPopTag - Restores the calling thread's allocation tag from before the
+// matching VLDPushTag.
+//
+//  Return Value:
+//
+//    None.
+//
+__declspec(dllimport) void VLDPopTag();
+
+// VLDCompact - Gives back the storage VLD's own containers hold beyond what
+// their entries need. The containers grow with the number of tracked blocks,
+// modules and threads, but don't shrink on their own, except for the block
+// maps once most of the memory allocated at the peak has been freed. Call it
+// after a burst of allocations has been freed.
+//
+//  Return Value:
+//
+//    VLD_SIZET: The number of bytes freed.
+//
+__declspec(dllimport) VLD_SIZET VLDCompact();
+
+// VLDTrackAlloc - Tracks a block carved out of a custom allocator's pool.
+// VLD only sees the chunks a pool allocates from the heap, not the blocks the
+// pool hands out of them. A block tracked this way is treated like a heap
+// block: its call stack is captured, it's sampled, and it's reported as a leak
+// unless it's freed with VLDTrackFree. Where a leak's heap is given, a pool's
+// block is given the pool's address with the low bit set.
+//
+// pool: Identifies the pool, usually its address. Two pools mustn't hand out
+//   the same block.
+//
+// ptr: The block. It must stay readable until it's freed with VLDTrackFree.
+//
+// size: Size, in bytes, of the block.
+//
+//  Return Value:
+//
+//    None.
+//
+__declspec(dllimport) void VLDTrackAlloc(const void *pool, const void *ptr, VLD_SIZET size);
+
+// VLDTrackFree - Stops tracking a block returned to a custom allocator's pool.
+//
+// pool: Identifies the pool, as passed to VLDTrackAlloc.
+//
+// ptr: The block.
+//
+//  Return Value:
+//
+//    None.
+//
+__declspec(dllimport) void VLDTrackFree(const void *pool, const void *ptr);
+
+// VLDTrackAllocN - Tracks blocks of the same size carved out of a custom
+// allocator's pool at once, as VLDTrackAlloc would, one by one. Their call
+// stack is captured only once, which makes a batch far cheaper to track than
+// as many calls to VLDTrackAlloc.
+//
+// pool: Identifies the pool, usually its address.
+//
+// ptrs: The blocks. NULL entries are skipped.
+//
+// size: Size, in bytes, of each block.
+//
+// count: Number of entries in "ptrs".
+//
+//  Return Value:
+//
+//    None.
+//
+__declspec(dllimport) void VLDTrackAllocN(const void *pool, void * const *ptrs, VLD_SIZET size, VLD_UINT count);
+
+// VLDTrackFreeN - Stops tracking blocks returned to a custom allocator's pool
+// at once, as VLDTrackFree would, one by one.
+//
+// pool: Identifies the pool, as passed to VLDTrackAllocN.
+//
+// ptrs: The blocks. NULL entries are skipped.
+//
+// count: Number of entries in "ptrs".
+//
+//  Return Value:
+//
+//    None.
+//
+__declspec(dllimport) void VLDTrackFreeN(const void *pool, void * const *ptrs, VLD_UINT count);
+
+// VLDUntrackRange - Stops tracking every block of a custom allocator's pool
+// within a range of addresses, as if each one was freed with VLDTrackFree.
+// Call it when an arena or frame allocator releases its blocks all at once.
+// Its cost grows with the number of blocks in the range, not with the number
+// of blocks tracked.
+//
+// pool: Identifies the pool, as passed to VLDTrackAlloc.
+//
+// base: Start of the range.
+//
+// size: Size, in bytes, of the range.
+//
+//  Return Value:
+//
+//    VLD_SIZET: The number of blocks no longer tracked.
+//
+__declspec(dllimport) VLD_SIZET VLDUntrackRange(const void *pool, const void *base, VLD_SIZET size);
+
 #ifdef __cplusplus
 }
 #endif // __cplusplus
@@ -333,6 +838,7 @@ __declspec(dllexport) int VLDResolveCallstacks();
 #define VLDReportThreadLeaks() (0)
 #define VLDGetLeaksCount() (0)
 #define VLDGetThreadLeaksCount() (0)
+#define VLDGetModuleLeaksCount(m) (0)
 #define VLDMarkAllLeaksAsReported()
 #define VLDMarkThreadLeaksAsReported(a)
 #define VLDRefreshModules()
@@ -346,5 +852,55 @@ __declspec(dllexport) int VLDResolveCallstacks();
 #define VLDGetModulesList(a, b) (FALSE)
 #define VLDSetReportOptions(a, b)
 #define VLDResolveCallstacks() (0)
+#define VLDTakeSnapshot() (0)
+#define VLDDiffSnapshots(a, b) (0)
+#define VLDGetStatistics(a)
+#define VLDGetMemoryUsage(a)
+#define VLDGetSiteStatistics(a, b, c) (0)
+#define VLDGetHeapSizeClasses(a, b) (0)
+#define VLDGetModuleStatistics(a, b) (0)
+#define VLDGetCapturePolicy(a)
+#define VLDSetCapturePolicy(a)
+#define VLDGetMiniDumpStream(a) (FALSE)
+#define VLDFreeMiniDumpStream(a)
+#define VLDWriteMiniDump(a, b, c) (FALSE)
+#define VLDWriteHeapProfile(a, b) (FALSE)
+#define VLDEnumerateLeaks(a, b, c) (0)
+#define VLDResolveLeakFrame(a, b, c) (FALSE)
+#define VLDEnumLeaksBegin(a, b)
+#define VLDEnumLeaksNext(a, b, c) (0)
+#define VLDFindContainingBlock(a, b) (FALSE)
+#define VLDReportLeaksAsync(a, b) (0)
+#define VLDReportLeaksOlderThan(a) (0)
+#define VLDReportPeak() (0)
+#define VLDReportChurn() (0)
+#define VLDReportReallocStorms(m) (0)
+#define VLDPushTag(a)
+#define VLDPopTag()
+#define VLDCompact() (0)
+#define VLDTrackAlloc(p, a, s)
+#define VLDTrackFree(p, a)
+#define VLDTrackAllocN(p, a, s, c)
+#define VLDTrackFreeN(p, a, c)
+#define VLDUntrackRange(p, b, s) (0)
 
 #endif // _DEBUG
+
+#ifdef __cplusplus
+
+// VLDTagScope - Pushes an allocation tag for as long as the object lives:
+//
+//   VLDTagScope tag("request parser");
+//
+class VLDTagScope
+{
+public:
+    explicit VLDTagScope(const char *tag) { (void)tag; VLDPushTag(tag); }
+    ~VLDTagScope() { VLDPopTag(); }
+
+private:
+    VLDTagScope(const VLDTagScope &);
+    VLDTagScope& operator=(const VLDTagScope &);
+};
+
+#endif // __cplusplus
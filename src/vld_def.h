@@ -42,8 +42,283 @@
 #define VLD_OPT_SKIP_HEAPFREE_LEAKS     0x1000 //   If set, VLD skip HeapFree memory leaks.
 #define VLD_OPT_VALIDATE_HEAPFREE       0x2000 //   If set, VLD verifies and reports heap consistency for HeapFree calls.
 #define VLD_OPT_SKIP_CRTSTARTUP_LEAKS   0x4000 //   If set, VLD skip crt srtartup memory leaks.
+#define VLD_OPT_REPORT_TO_BINARY        0x8000 //   If set, the shutdown leak report is written unsymbolized, in binary form, to the report file.
+#define VLD_OPT_SUMMARY_REPORT          0x10000 //  If set, leaks are grouped by call stack, and only the top call stacks are reported in full.
+#define VLD_OPT_SUMMARY_BY_COUNT        0x20000 //  If set, summary reports rank call stacks by leaked blocks instead of leaked bytes.
+#define VLD_OPT_SITE_STATISTICS         0x40000 //  If set, allocation statistics are kept for every call stack (see VLDGetSiteStatistics).
+#define VLD_OPT_DEFER_STACK_CAPTURE     0x80000 //  If set, call stacks of blocks freed before they leave the pending buffer are never created.
+#define VLD_OPT_UNWIND_STACK_WALK       0x100000 // If set, the stack is walked using the "unwind" method (x64 unwind data, without dbghelp).
+#define VLD_OPT_FRAME_STACK_WALK        0x200000 // If set, the stack is walked using the "frame" method (x86 frame pointer chain).
+#define VLD_OPT_SHADOW_STACK_WALK       (VLD_OPT_UNWIND_STACK_WALK | VLD_OPT_FRAME_STACK_WALK) // If both set, the frames are read off the CET shadow stack ("shadow" method, x64).
+#define VLD_OPT_CONTEXT_TREE            0x400000 // If set, call stacks share their common frames in a calling context tree.
+#define VLD_OPT_PREFETCH_SYMBOLS        0x800000 // If set, a background thread loads the symbols of modules as they are loaded.
+#define VLD_OPT_REPORT_JSON             0x1000000 // If set, the leak report is written to the report file as JSON.
+#define VLD_OPT_REPORT_CSV              0x2000000 // If set, the leak report is written to the report file (and a frames file) as CSV.
+#define VLD_OPT_REPORT_FOLDED           (VLD_OPT_REPORT_JSON | VLD_OPT_REPORT_CSV) // If both set, the leaks are written to the report file as folded stacks, for flame graphs.
+#define VLD_OPT_UTF8_REPORT             0x4000000 // If set, the leak report file will be encoded UTF-8 instead of ASCII.
+#define VLD_OPT_LARGE_PAGES             0x8000000 // If set, the metadata region is made of large pages, if the process may use them.
+#define VLD_OPT_INLINE_HEAP_HOOKS       0x10000000 // If set, the ntdll heap functions themselves are hooked, besides the imports of them.
+#define VLD_OPT_ETW_HEAP_TRACKING       0x20000000 // If set, heap blocks are tracked from the heap ETW provider's events instead of by patching imports.
+#define VLD_OPT_NO_STACK_WALK           0x40000000 // If set, no call stacks are captured; leaks are told apart by their allocation tags (see VLDPushTag).
+#define VLD_OPT_CALLER_STACK_WALK       0x80000000 // If set, only the allocating function's caller is recorded, as a one-frame call stack.
+#define VLD_OPT_NTDB_STACK_WALK         (VLD_OPT_NO_STACK_WALK | VLD_OPT_CALLER_STACK_WALK) // If both set, call stacks are read from the NT stack trace database at report time.
 
 #define VLD_RPTHOOK_INSTALL  0
 #define VLD_RPTHOOK_REMOVE   1
 
 typedef int (__cdecl * VLD_REPORT_HOOK)(int reportType, wchar_t *message, int *returnValue);
+
+// The locks profiled with the LockProfiling option, indexing
+// VLD_STATISTICS::locks.
+#define VLD_LOCK_HEAP_MAP    0 // The shards of the heap and block maps' lock.
+#define VLD_LOCK_VLD_HEAP    1 // The list of VLD's private heap arenas.
+#define VLD_LOCK_MODULES     2 // The set of loaded modules.
+#define VLD_LOCK_TLS         3 // The set of per-thread states.
+#define VLD_LOCK_DBGHELP     4 // The serialization of dbghelp.dll calls.
+#define VLD_LOCK_TREES       5 // The locks of VLD's internal containers, all together.
+#define VLD_LOCKS            6
+
+// Acquisition counters of one of the profiled locks.
+typedef struct VLD_LOCK_STATISTICS {
+    unsigned long long acquisitions;        // Times the lock was entered.
+    unsigned long long contentions;         // Times it was held by another thread, and had to be waited for.
+    unsigned long long waitTicks;           //   Time spent waiting for it.
+} VLD_LOCK_STATISTICS;
+
+// The hooks timed with the LatencyProfiling option, indexing
+// VLD_STATISTICS::hooks. Each time includes the calls the hook makes,
+// including to the function it stands in for.
+#define VLD_HOOK_ALLOC       0 // The RtlAllocateHeap and HeapAlloc hooks.
+#define VLD_HOOK_FREE        1 // The RtlFreeHeap and HeapFree hooks.
+#define VLD_HOOK_REALLOC     2 // The RtlReAllocateHeap and HeapReAlloc hooks.
+#define VLD_HOOK_CRT         3 // The CRT and MFC allocation function thunks.
+#define VLD_HOOK_CAPTURE     4 // The tracking of a new block: its call stack captured and the block mapped.
+#define VLD_HOOKS            5
+
+#define VLD_LATENCY_BUCKETS 32 // Log2 buckets of each hook's latency histogram.
+
+// Latency distribution of one of the timed hooks, over all threads. The
+// percentiles are the upper bounds of the buckets they fall in, so they are
+// accurate to a factor of two.
+typedef struct VLD_HOOK_LATENCY {
+    unsigned long long calls;               // Calls timed.
+    unsigned long long p50Ticks;            // Median latency.
+    unsigned long long p90Ticks;
+    unsigned long long p99Ticks;
+    unsigned long long maxTicks;            // Longest call.
+    unsigned long long buckets [VLD_LATENCY_BUCKETS]; // Calls by latency: bucket 0 counts latencies under 2 ticks,
+                                            // bucket n latencies from 2^n to 2^(n+1)-1, and the last one anything longer.
+} VLD_HOOK_LATENCY;
+
+// Counters returned by VLDGetStatistics. Each count is paired with the time
+// spent, in processor time stamp counter ticks, summed over all threads.
+typedef struct VLD_STATISTICS {
+    unsigned long long stackCaptures;       // Call stacks captured for new blocks.
+    unsigned long long stackCaptureTicks;
+    unsigned long long mapInserts;          // Blocks inserted into the block maps.
+    unsigned long long mapInsertTicks;
+    unsigned long long mapErases;           // Freed blocks looked up in, and erased from, the block maps.
+    unsigned long long mapEraseTicks;
+    unsigned long long lockAcquires;        // Heap map lock shards entered while mapping and unmapping blocks.
+    unsigned long long lockWaitTicks;       //   Time spent waiting to enter them.
+    unsigned long long exclusionChecks;     // Checks whether an allocation comes from an excluded module.
+    unsigned long long exclusionCheckTicks;
+    unsigned long long symbolLookups;       // Program counters resolved by the symbol handler.
+    unsigned long long symbolLookupTicks;
+    unsigned long long reports;             // Leak reports generated.
+    unsigned long long reportTicks;         //   Time spent generating them, including the phases below.
+    unsigned long long aggregationTicks;    //   Time spent grouping duplicate leaks.
+    unsigned long long stackDumpTicks;      //   Time spent dumping call stacks, resolving any symbols not yet resolved.
+    unsigned long long dataDumpTicks;       //   Time spent dumping the data of the leaked blocks.
+    unsigned long long resolves;            // Calls to VLDResolveCallstacks.
+    unsigned long long resolveTicks;
+    unsigned long long prints;              // Messages printed by VLD, report lines included.
+    unsigned long long printTicks;          //   Time spent passing them to the report hooks and the output.
+    size_t             currentBytes;        // Bytes currently allocated by the program.
+    size_t             peakBytes;           // Largest number of bytes allocated at once.
+    size_t             totalBytes;          // Sum of all allocations.
+    size_t             privateHeapBytes;    // Bytes VLD itself has allocated from its private heap.
+    size_t             metadataBytes;       // Bytes VLD has committed for its metadata region.
+    unsigned long long moduleAttaches;      // Module loads VLD attached to the new modules for.
+    unsigned long long moduleAttachTicks;   //   Time spent enumerating and patching the modules.
+    unsigned long long moduleDetaches;      // Module unloads VLD forgot the modules for.
+    unsigned long long moduleDetachTicks;
+    unsigned long long startupModules;      // Modules loaded when VLD was installed.
+    unsigned long long startupTicks;        // Time spent installing VLD, including the phases below.
+    unsigned long long configureTicks;      //   Time spent reading the options.
+    unsigned long long symbolInitTicks;     // Time spent initializing the symbol handler, once symbols were first needed.
+    unsigned long long moduleEnumTicks;     //   Time spent enumerating the loaded modules.
+    unsigned long long modulePatchTicks;    //   Time spent attaching to (patching) them.
+    size_t             virtualRegions;      // Virtual memory regions and views tracked, with the TrackVirtualMemory option.
+    size_t             virtualReserved;     //   Bytes reserved or mapped by them.
+    size_t             virtualCommitted;    //   Bytes committed within them.
+    VLD_LOCK_STATISTICS locks [VLD_LOCKS];  // Counters of each profiled lock, with the LockProfiling option (see VLD_LOCK_*).
+    VLD_HOOK_LATENCY   hooks [VLD_HOOKS];   // Latency of each timed hook, with the LatencyProfiling option (see VLD_HOOK_*).
+} VLD_STATISTICS;
+
+// VLD's own memory, by what it holds (see VLDGetMemoryUsage). The first fields
+// are carved from the private heap or the metadata region, whose totals follow.
+typedef struct VLD_MEMORY_USAGE {
+    size_t blockIndexBytes;      // Storage of the block maps, which index the blocks by address.
+    size_t blockInfoBytes;       // Slabs of the records of the tracked blocks.
+    size_t callStackBytes;       // Interned call stacks, and the table which interns them.
+    size_t resolvedTextBytes;    // Resolved text of the call stacks already reported or resolved.
+    size_t moduleTableBytes;     // Loaded module set, module images and the module range table.
+    size_t threadStateBytes;     // Per-thread state: pending blocks, deferred frames and trace rings.
+    size_t privateHeapBytes;     // Bytes allocated from VLD's private heap, not counting headers.
+    size_t privateHeapCommitted; // Bytes the private heap has committed.
+    size_t metadataBytes;        // Bytes committed for the metadata region.
+} VLD_MEMORY_USAGE;
+
+#define VLD_SITE_FRAMES 16 // Program counters returned per allocation site.
+#define VLD_LIFETIME_BUCKETS 24 // Lifetime histogram buckets per allocation site.
+
+// Statistics of one allocation site, returned by VLDGetSiteStatistics. A site
+// is a distinct call stack; it is identified by the hash shown as "Leak Hash"
+// in the leak report.
+typedef struct VLD_SITE_STATISTICS {
+    unsigned int       hash;                // Hash of the call stack's frames.
+    unsigned int       frameCount;          // Number of frames of the call stack (at most VLD_SITE_FRAMES are returned).
+    unsigned long long liveBlocks;          // Blocks allocated from the site which are still allocated.
+    unsigned long long liveBytes;           // Total size of those blocks, in bytes.
+    unsigned long long allocations;         // Blocks allocated from the site so far.
+    unsigned long long peakBytes;           // Largest number of bytes the site had allocated at once.
+    unsigned long long frees;               // Blocks allocated from the site which have been freed (or reallocated).
+    unsigned long long allocatedBytes;      // Total size of every block allocated from the site so far, in bytes.
+    unsigned long long reallocs;            // Blocks the site grew by reallocating them.
+    unsigned long long smallReallocs;       // Those of the reallocations which grew the block by less than half.
+    unsigned long long reallocFromBytes;    // Total size of the blocks before those reallocations, in bytes.
+    unsigned long long reallocToBytes;      // Total size of the blocks after those reallocations, in bytes.
+    unsigned long long sameThreadFrees;     // Blocks freed by the thread which allocated them (or by an unknown thread).
+    unsigned long long crossThreadFrees;    // Blocks freed by another thread than the one which allocated them.
+    unsigned int       lifetimes [VLD_LIFETIME_BUCKETS]; // Freed blocks by lifetime, in allocations made while they were allocated:
+                                            // bucket 0 counts lifetimes under 2, bucket n lifetimes from 2^n to 2^(n+1)-1,
+                                            // and the last bucket every longer one.
+    const void        *frames [VLD_SITE_FRAMES]; // Program counters, innermost first.
+} VLD_SITE_STATISTICS;
+
+#define VLD_POW2_CLASSES 41  // Power-of-two size classes per heap.
+#define VLD_LFH_CLASSES  129 // Low-fragmentation heap size classes per heap.
+
+// Size class histograms of one heap, returned by VLDGetHeapSizeClasses. Each
+// class counts the blocks which are allocated now ("live") and every block
+// allocated so far ("total"). Power-of-two class n counts the blocks of more
+// than 2^(n-1) and up to 2^n bytes (class 0 those of 0 or 1 byte, and the last
+// class every larger block). Low-fragmentation heap class n < 128 counts the
+// blocks the LFH serves from its bucket n + 1: 8-byte granularity up to 256
+// bytes, which doubles with every power of two up to 16 KB; the last class
+// counts the blocks larger than that, which the LFH never serves.
+typedef struct VLD_HEAP_SIZE_CLASSES {
+    const void        *heap;                // Handle to the heap.
+    unsigned long long pow2Live [VLD_POW2_CLASSES];
+    unsigned long long pow2Total [VLD_POW2_CLASSES];
+    unsigned long long lfhLive [VLD_LFH_CLASSES];
+    unsigned long long lfhTotal [VLD_LFH_CLASSES];
+} VLD_HEAP_SIZE_CLASSES;
+
+// Allocation counters of one loaded module, returned by VLDGetModuleStatistics.
+// An allocation counts for the module which called the heap (or CRT) function,
+// whether or not the module is excluded from leak detection.
+typedef struct VLD_MODULE_STATISTICS {
+    wchar_t            name [64];           // File name of the module, truncated if need be.
+    const void        *base;                // Base address of the module.
+    unsigned long long allocations;         // Blocks allocated, or reallocated, from the module so far.
+    unsigned long long bytes;               // Total size of those blocks, in bytes.
+    int                excluded;            // Nonzero if allocations made from the module aren't tracked.
+    int                autoExcluded;        // Nonzero if AutoExcludeHotModules excluded it.
+} VLD_MODULE_STATISTICS;
+
+// How allocations are sampled and their call stacks traced, as set by
+// VLDSetCapturePolicy. The fields have the meaning of the vld.ini options of
+// the same names.
+typedef struct VLD_CAPTURE_POLICY {
+    unsigned int       stackWalkMethod;     // VLD_OPT_SAFE_STACK_WALK, VLD_OPT_UNWIND_STACK_WALK, VLD_OPT_FRAME_STACK_WALK,
+                                            // VLD_OPT_SHADOW_STACK_WALK, VLD_OPT_NO_STACK_WALK, VLD_OPT_CALLER_STACK_WALK,
+                                            // VLD_OPT_NTDB_STACK_WALK,
+                                            // or 0 for the "fast" method.
+    unsigned int       maxTraceFrames;      // 0 for the default.
+    unsigned int       adaptiveTraceFrames;
+    unsigned int       sampleRate;
+    size_t             sampleBytes;
+    size_t             minTrackedSize;
+    size_t             maxTrackedSize;
+    unsigned int       smallSampleRate;
+    const wchar_t     *moduleTracePolicy;   // As in vld.ini, or NULL to keep the module policies as they are.
+} VLD_CAPTURE_POLICY;
+
+#define VLD_MINIDUMP_STREAM_TYPE 0x564C4401 // Type of the minidump user stream holding VLD's state.
+
+// A minidump user stream holding VLD's state, returned by VLDGetMiniDumpStream.
+// It's laid out like dbghelp's MINIDUMP_USER_STREAM, so it can be added to the
+// UserStreamArray given to MiniDumpWriteDump. The buffer holds a binary report
+// (see binreport.h) of every live block, without data bytes.
+typedef struct VLD_MINIDUMP_STREAM {
+    unsigned int        type;               // VLD_MINIDUMP_STREAM_TYPE.
+    unsigned int        bufferSize;         // Size of the buffer, in bytes.
+    void               *buffer;             // The stream's contents.
+} VLD_MINIDUMP_STREAM;
+
+#define VLD_ENUM_NO_FRAMES   0x1 // VLDEnumerateLeaks flag: don't copy out the call stack frames.
+
+#define VLD_LEAK_CRT         0x1 // The block was allocated by the debug CRT.
+#define VLD_LEAK_UCRT        0x2 // The block was allocated by the Universal CRT.
+
+// A leaked block, as passed to the callback of VLDEnumerateLeaks. Pointers to
+// VLD's memory (frames, stack) are only valid until the callback returns.
+typedef struct VLD_LEAK {
+    unsigned long long  serialNumber;       // Allocation serial number.
+    const void         *address;            // Address of the block (of the user data, for CRT blocks).
+    size_t              size;               // Size of the block, in bytes.
+    const void         *heap;               // Heap the block was allocated from.
+    unsigned int        threadId;           // Thread that allocated the block.
+    unsigned int        flags;              // VLD_LEAK_CRT, VLD_LEAK_UCRT.
+    unsigned int        hash;               // Hash of the call stack, as shown as "Leak Hash" (0 if there is none).
+    unsigned int        frameCount;         // Number of frames of the call stack (0 if there is none).
+    const void * const *frames;             // Program counters, innermost first (NULL with VLD_ENUM_NO_FRAMES).
+    const void         *stack;              // The call stack, for VLDResolveLeakFrame (NULL if there is none).
+} VLD_LEAK;
+
+// Called by VLDEnumerateLeaks for each leak. Returns 0 to stop the enumeration.
+typedef int (__cdecl * VLD_LEAK_CALLBACK)(const VLD_LEAK *leak, void *context);
+
+// A leaked block, as returned in batches by VLDEnumLeaksNext. Unlike VLD_LEAK,
+// it holds copies only, so it stays valid after the batch is returned.
+typedef struct VLD_LEAK_RECORD {
+    unsigned long long  serialNumber;       // Allocation serial number.
+    const void         *address;            // Address of the block (of the user data, for CRT blocks).
+    size_t              size;               // Size of the block, in bytes.
+    const void         *heap;               // Heap the block was allocated from.
+    unsigned int        threadId;           // Thread that allocated the block.
+    unsigned int        flags;              // VLD_LEAK_CRT, VLD_LEAK_UCRT.
+    unsigned int        hash;               // Hash of the call stack, as shown as "Leak Hash" (0 if there is none).
+    unsigned int        frameCount;         // Number of frames of the call stack (at most VLD_SITE_FRAMES are returned).
+    const void         *frames [VLD_SITE_FRAMES]; // Program counters, innermost first.
+} VLD_LEAK_RECORD;
+
+// Where a paged leak enumeration is at. Set up by VLDEnumLeaksBegin and moved
+// on by each VLDEnumLeaksNext; its fields are VLD's business.
+typedef struct VLD_LEAK_CURSOR {
+    unsigned long long  before;             // Only blocks allocated before the enumeration began are returned.
+    const void         *heap;               // Heap being walked (NULL before the first one).
+    const void         *block;              // Block the walk stopped at in that heap (NULL before the first one).
+    size_t              position;           // Where the block was, to resume from if it's been freed since.
+    unsigned int        shard;              // Block map shard being walked.
+    unsigned int        flags;              // VLD_ENUM_NO_FRAMES.
+} VLD_LEAK_CURSOR;
+
+// Called by VLDReportLeaksAsync once the report has been written, with the
+// number of leaks it reported.
+typedef void (__cdecl * VLD_REPORT_CALLBACK)(unsigned int leaks, void *context);
+
+#define VLD_FRAME_NAME_LENGTH 256 // Characters kept of a frame's function name (truncated if longer).
+#define VLD_FRAME_FILE_LENGTH 260 // Characters kept of a frame's source file name (truncated if longer).
+
+// Symbolic information of one frame of a leak, returned by VLDResolveLeakFrame.
+typedef struct VLD_FRAME_INFO {
+    const void         *programCounter;     // The frame's program counter.
+    unsigned long long  displacement;       // Offset of the program counter from the start of the function.
+    unsigned int        lineNumber;         // Source line containing the program counter (0 if unknown).
+    unsigned int        lineDisplacement;   // Offset of the program counter from the start of the source line.
+    wchar_t             functionName [VLD_FRAME_NAME_LENGTH]; // Function name, or the address itself if unknown.
+    wchar_t             fileName [VLD_FRAME_FILE_LENGTH];     // Source file name (empty if unknown).
+} VLD_FRAME_INFO;
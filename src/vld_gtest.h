@@ -0,0 +1,89 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Visual Leak Detector - Google Test Leak Check Listener
+//  Copyright (c) 2005-2014 VLD Team
+//
+//  This library is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU Lesser General Public
+//  License as published by the Free Software Foundation; either
+//  version 2.1 of the License, or (at your option) any later version.
+//
+//  This library is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  Lesser General Public License for more details.
+//
+//  You should have received a copy of the GNU Lesser General Public
+//  License along with this library; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+//  See COPYING.txt for the full terms of the GNU Lesser General Public License.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// This header is optional: it provides a Google Test event listener which
+// fails each test that leaks memory. Include it after gtest.h and register the
+// listener before running the tests:
+//
+//   ::testing::InitGoogleTest(&argc, argv);
+//   ::testing::UnitTest::GetInstance()->listeners().Append(new VLDLeakCheckListener);
+//   return RUN_ALL_TESTS();
+//
+// Checking a test costs about as much as a call to VLDGetLeaksCount, however
+// many blocks are tracked. When a test starts, every block allocated so far is
+// marked as reported, which only moves a serial number watermark and resets
+// the leak counters. VLD keeps the counters up to date as blocks are mapped
+// and freed, so once the test is over they hold the leaks it made. The heap
+// maps are only walked, and call stacks only resolved, for the tests which
+// leak, and the report then holds the blocks of that test alone.
+//
+// Only the tests which passed are checked: Google Test keeps the results of
+// failed assertions and the properties recorded with RecordProperty until the
+// end of the run, and they would count as leaks. Blocks allocated outside the
+// tests, such as by global test environments, are marked as reported when the
+// next test starts, as VLDMarkAllLeaksAsReported does.
+
+#include "vld.h"
+
+class VLDLeakCheckListener : public ::testing::EmptyTestEventListener
+{
+public:
+    // Constructor
+    //
+    //  - report (IN): If true, the leaks of each leaking test are reported
+    //      with VLDReportLeaks, call stacks included. Otherwise the test only
+    //      fails with the number of leaks.
+    //
+    explicit VLDLeakCheckListener (bool report = true)
+        : m_report(report)
+    {
+    }
+
+    // OnTestStart - Sets the watermark: only the blocks allocated from now on
+    //   count as leaks of the test.
+    virtual void OnTestStart (const ::testing::TestInfo & /*testInfo*/)
+    {
+        VLDMarkAllLeaksAsReported();
+    }
+
+    // OnTestEnd - Fails the test if any block it allocated is still
+    //   allocated, and reports those blocks.
+    virtual void OnTestEnd (const ::testing::TestInfo &testInfo)
+    {
+        if (!testInfo.result()->Passed())
+            return;
+
+        VLD_UINT leaks = VLDGetLeaksCount();
+        if (leaks == 0)
+            return;
+        if (m_report)
+            leaks = VLDReportLeaks();
+        EXPECT_EQ(0u, leaks) << "Visual Leak Detector: " << testInfo.test_case_name() << "." << testInfo.name()
+            << " leaked " << leaks << " block(s).";
+    }
+
+private:
+    bool m_report; // Report the leaks of leaking tests.
+};
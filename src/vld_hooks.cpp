@@ -38,10 +38,48 @@
 #include "vldint.h"      // Provides access to the Visual Leak Detector internals.
 #include "loaderlock.h"
 
+extern "C" IMAGE_DOS_HEADER __ImageBase; // VLD's own module.
 extern HANDLE           g_currentProcess;
-extern CriticalSection  g_heapMapLock;
+extern HANDLE           g_processHeap;
+extern HeapMapLock      g_heapMapLock;
 extern DbgHelp g_DbgHelp;
 
+// LatencyTimer - Times a heap hook, with the LatencyProfiling option, from the
+//   construction of the object to its destruction. Calls made while leak
+//   detection is disabled for the thread aren't counted.
+class LatencyTimer
+{
+public:
+    LatencyTimer (UINT hook)
+        : m_hook(hook)
+        , m_start(g_vld.m_latencyProfiling ? __rdtsc() : 0)
+    {
+    }
+
+    ~LatencyTimer ()
+    {
+        if (m_start == 0)
+            return;
+        UINT64 ticks = __rdtsc() - m_start;
+        tls_t *tls = g_vld.enabledTls();
+        if (tls != NULL)
+            g_vld.recordLatency(tls, m_hook, ticks);
+    }
+
+private:
+    LatencyTimer (const LatencyTimer &);             // not allowed
+    LatencyTimer & operator = (const LatencyTimer &); // not allowed
+
+    UINT    m_hook;
+    UINT64  m_start;
+};
+
+// What _CoGetMalloc hands to initIMalloc, and gets back from it.
+struct imallocinit_t {
+    DWORD   context; // The memory context CoGetMalloc was called for.
+    HRESULT hr;      // What the real CoGetMalloc returned.
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Debug CRT and MFC IAT Replacement Functions
@@ -65,13 +103,10 @@ HANDLE VisualLeakDetector::_GetProcessHeap()
     // Get the process heap.
     HANDLE heap = m_GetProcessHeap();
 
-    CriticalSectionLocker<> cs(g_heapMapLock);
-    HeapMap::Iterator heapit = g_vld.m_heapMap->find(heap);
-    if (heapit == g_vld.m_heapMap->end())
-    {
-        g_vld.mapHeap(heap);
-        heapit = g_vld.m_heapMap->find(heap);
-    }
+    // The process heap was mapped when VLD was installed, so the heap map
+    // is only consulted should GetProcessHeap ever return another heap.
+    if (heap != g_processHeap)
+        g_vld.mapHeapOnce(heap);
 
     return heap;
 }
@@ -96,13 +131,11 @@ HANDLE VisualLeakDetector::_HeapCreate (DWORD options, SIZE_T initsize, SIZE_T m
     // Create the heap.
     HANDLE heap = m_HeapCreate(options, initsize, maxsize);
 
-    CriticalSectionLocker<> cs(g_heapMapLock);
-
-    // Map the created heap handle to a new block map.
-    g_vld.mapHeap(heap);
-
-    HeapMap::Iterator heapit = g_vld.m_heapMap->find(heap);
-    assert(heapit != g_vld.m_heapMap->end());
+    // Map the created heap handle to a new block map. mapHeap takes the heap
+    // map lock itself. Heaps created by the modules listed by HeapsToIgnore
+    // are mapped as ignored, so that their blocks are never tracked.
+    if (heap != NULL)
+        g_vld.mapHeap(heap, g_vld.isIgnoredHeapCreator((UINT_PTR)_ReturnAddress()) ? VLD_HEAP_IGNORED : 0x0);
 
     return heap;
 }
@@ -123,9 +156,15 @@ BOOL VisualLeakDetector::_HeapDestroy (HANDLE heap)
     // After this heap is destroyed, the heap's address space will be unmapped
     // from the process's address space. So, we'd better generate a leak report
     // for this heap now, while we can still read from the memory blocks
-    // allocated to it.
-    if (!(g_vld.m_options & VLD_OPT_SKIP_HEAPFREE_LEAKS))
-        g_vld.reportHeapLeaks(heap);
+    // allocated to it. With DeferHeapDestroyReport, only what the report
+    // shows of the blocks is copied now, and the report written later.
+    g_vld.flushAllPendingBlocks();
+    if (!(g_vld.m_options & VLD_OPT_SKIP_HEAPFREE_LEAKS)) {
+        if (g_vld.m_deferHeapReports)
+            g_vld.deferHeapLeaks(heap);
+        else
+            g_vld.reportHeapLeaks(heap);
+    }
 
     g_vld.unmapHeap(heap);
 
@@ -151,15 +190,20 @@ BOOL VisualLeakDetector::_HeapDestroy (HANDLE heap)
 LPVOID VisualLeakDetector::_RtlAllocateHeap (HANDLE heap, DWORD flags, SIZE_T size)
 {
     PRINT_HOOKED_FUNCTION2();
+    LatencyTimer timer(VLD_HOOK_ALLOC);
     // Allocate the block.
     LPVOID block = RtlAllocateHeap(heap, flags, size);
 
-    if ((block == NULL) || !g_vld.enabled())
+    if ((block == NULL) || !g_vld.trackingAllocs() || g_vld.untrackedSize(size) || g_vld.isIgnoredHeap(heap))
+        return block;
+    tls_t* tls = g_vld.enabledTls();
+    if (tls == NULL)
         return block;
 
-    if (!g_DbgHelp.IsLockedByCurrentThread()) { // skip dbghelp.dll calls
+    if (!g_DbgHelp.IsLockedByCurrentThread() && // skip dbghelp.dll calls
+        !CaptureContext::RecordNested(tls, heap, block, NULL, size)) {
         CAPTURE_CONTEXT();
-        CaptureContext cc(RtlAllocateHeap, context_);
+        CaptureContext cc(RtlAllocateHeap, context_, tls);
         cc.Set(heap, block, NULL, size);
     }
 
@@ -170,15 +214,20 @@ LPVOID VisualLeakDetector::_RtlAllocateHeap (HANDLE heap, DWORD flags, SIZE_T si
 LPVOID VisualLeakDetector::_HeapAlloc (HANDLE heap, DWORD flags, SIZE_T size)
 {
     PRINT_HOOKED_FUNCTION2();
+    LatencyTimer timer(VLD_HOOK_ALLOC);
     // Allocate the block.
     LPVOID block = HeapAlloc(heap, flags, size);
 
-    if ((block == NULL) || !g_vld.enabled())
+    if ((block == NULL) || !g_vld.trackingAllocs() || g_vld.untrackedSize(size) || g_vld.isIgnoredHeap(heap))
+        return block;
+    tls_t* tls = g_vld.enabledTls();
+    if (tls == NULL)
         return block;
 
-    if (!g_DbgHelp.IsLockedByCurrentThread()) { // skip dbghelp.dll calls
+    if (!g_DbgHelp.IsLockedByCurrentThread() && // skip dbghelp.dll calls
+        !CaptureContext::RecordNested(tls, heap, block, NULL, size)) {
         CAPTURE_CONTEXT();
-        CaptureContext cc(HeapAlloc, context_);
+        CaptureContext cc(HeapAlloc, context_, tls);
         cc.Set(heap, block, NULL, size);
     }
 
@@ -203,9 +252,12 @@ LPVOID VisualLeakDetector::_HeapAlloc (HANDLE heap, DWORD flags, SIZE_T size)
 BYTE VisualLeakDetector::_RtlFreeHeap (HANDLE heap, DWORD flags, LPVOID mem)
 {
     PRINT_HOOKED_FUNCTION2();
+    LatencyTimer timer(VLD_HOOK_FREE);
     BYTE status;
 
-    if (!g_DbgHelp.IsLockedByCurrentThread()) // skip dbghelp.dll calls
+    if (g_vld.trackingFrees() &&
+        !g_DbgHelp.IsLockedByCurrentThread() && // skip dbghelp.dll calls
+        !g_vld.isIgnoredHeap(heap)) // nothing from ignored heaps is mapped
     {
         // Record the current frame pointer.
         CAPTURE_CONTEXT();
@@ -224,9 +276,12 @@ BYTE VisualLeakDetector::_RtlFreeHeap (HANDLE heap, DWORD flags, LPVOID mem)
 BOOL VisualLeakDetector::_HeapFree (HANDLE heap, DWORD flags, LPVOID mem)
 {
     PRINT_HOOKED_FUNCTION2();
+    LatencyTimer timer(VLD_HOOK_FREE);
     BOOL status;
 
-    if (!g_DbgHelp.IsLockedByCurrentThread()) // skip dbghelp.dll calls
+    if (g_vld.trackingFrees() &&
+        !g_DbgHelp.IsLockedByCurrentThread() && // skip dbghelp.dll calls
+        !g_vld.isIgnoredHeap(heap)) // nothing from ignored heaps is mapped
     {
         // Record the current frame pointer.
         CAPTURE_CONTEXT();
@@ -264,15 +319,20 @@ BOOL VisualLeakDetector::_HeapFree (HANDLE heap, DWORD flags, LPVOID mem)
 LPVOID VisualLeakDetector::_RtlReAllocateHeap (HANDLE heap, DWORD flags, LPVOID mem, SIZE_T size)
 {
     PRINT_HOOKED_FUNCTION();
+    LatencyTimer timer(VLD_HOOK_REALLOC);
 
     // Reallocate the block.
     LPVOID newmem = RtlReAllocateHeap(heap, flags, mem, size);
-    if ((newmem == NULL) || !g_vld.enabled())
+    if ((newmem == NULL) || !g_vld.trackingAllocs() || g_vld.isIgnoredHeap(heap))
+        return newmem;
+    tls_t* tls = g_vld.enabledTls();
+    if (tls == NULL)
         return newmem;
 
-    if (!g_DbgHelp.IsLockedByCurrentThread()) { // skip dbghelp.dll calls
+    if (!g_DbgHelp.IsLockedByCurrentThread() && // skip dbghelp.dll calls
+        !CaptureContext::RecordNested(tls, heap, mem, newmem, size)) {
         CAPTURE_CONTEXT();
-        CaptureContext cc(RtlReAllocateHeap, context_);
+        CaptureContext cc(RtlReAllocateHeap, context_, tls);
         cc.Set(heap, mem, newmem, size);
     }
 
@@ -283,21 +343,180 @@ LPVOID VisualLeakDetector::_RtlReAllocateHeap (HANDLE heap, DWORD flags, LPVOID
 LPVOID VisualLeakDetector::_HeapReAlloc (HANDLE heap, DWORD flags, LPVOID mem, SIZE_T size)
 {
     PRINT_HOOKED_FUNCTION();
+    LatencyTimer timer(VLD_HOOK_REALLOC);
 
     // Reallocate the block.
     LPVOID newmem = HeapReAlloc(heap, flags, mem, size);
-    if ((newmem == NULL) || !g_vld.enabled())
+    if ((newmem == NULL) || !g_vld.trackingAllocs() || g_vld.isIgnoredHeap(heap))
+        return newmem;
+    tls_t* tls = g_vld.enabledTls();
+    if (tls == NULL)
         return newmem;
 
-    if (!g_DbgHelp.IsLockedByCurrentThread()) { // skip dbghelp.dll calls
+    if (!g_DbgHelp.IsLockedByCurrentThread() && // skip dbghelp.dll calls
+        !CaptureContext::RecordNested(tls, heap, mem, newmem, size)) {
         CAPTURE_CONTEXT();
-        CaptureContext cc(HeapReAlloc, context_);
+        CaptureContext cc(HeapReAlloc, context_, tls);
         cc.Set(heap, mem, newmem, size);
     }
 
     return newmem;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// ntdll Heap Function Detours
+//
+// With InlineHeapHooks, RtlAllocateHeap, RtlFreeHeap and RtlReAllocateHeap
+// themselves jump to these functions, and RtlAllocateHeap, RtlFreeHeap and
+// RtlReAllocateHeap (see ntapi.h) are their trampolines. That way allocations
+// are seen even from modules VLD hasn't attached to, or which call ntdll
+// directly.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// calledByVld - Determines if a heap function was called from VLD's own
+//   module: VLD's other hooks, which have accounted for the call already, or
+//   VLD's own CRT, whose allocations were never tracked.
+//
+//  - returnaddress (IN): Return address of the heap function.
+//
+//  Return Value:
+//
+//    Returns TRUE if the return address is within VLD.
+//
+static BOOL calledByVld (UINT_PTR returnaddress)
+{
+    UINT_PTR base = (UINT_PTR)&__ImageBase;
+    PIMAGE_NT_HEADERS headers = (PIMAGE_NT_HEADERS)(base + __ImageBase.e_lfanew);
+    return (returnaddress - base) < headers->OptionalHeader.SizeOfImage;
+}
+
+// _RtlAllocateHeapInline - RtlAllocateHeap jumps to this function. Like
+//   _RtlAllocateHeap, it invokes the real RtlAllocateHeap and then calls VLD's
+//   allocation tracking function.
+//
+//  - heap (IN): Handle to the heap from which to allocate memory.
+//
+//  - flags (IN): Heap allocation control flags.
+//
+//  - size (IN): Size, in bytes, of the block to allocate.
+//
+//  Return Value:
+//
+//    Returns the return value from RtlAllocateHeap.
+//
+LPVOID VisualLeakDetector::_RtlAllocateHeapInline (HANDLE heap, DWORD flags, SIZE_T size)
+{
+    PRINT_HOOKED_FUNCTION2();
+    // Allocate the block.
+    LPVOID block = RtlAllocateHeap(heap, flags, size);
+
+    if ((block == NULL) || !g_vld.trackingAllocs() || g_vld.untrackedSize(size) || calledByVld((UINT_PTR)_ReturnAddress()) ||
+        g_vld.isIgnoredHeap(heap))
+        return block;
+    tls_t* tls = g_vld.enabledTls();
+    if ((tls == NULL) || (tls->flags & VLD_TLS_INLINEHOOK))
+        return block;
+
+    if (!g_DbgHelp.IsLockedByCurrentThread() && // skip dbghelp.dll calls
+        !CaptureContext::RecordNested(tls, heap, block, NULL, size)) {
+        tls->flags |= VLD_TLS_INLINEHOOK;
+        {
+            CAPTURE_CONTEXT();
+            CaptureContext cc(RtlAllocateHeap, context_, tls);
+            cc.Set(heap, block, NULL, size);
+        }
+        tls->flags &= ~VLD_TLS_INLINEHOOK;
+    }
+
+    return block;
+}
+
+// _RtlFreeHeapInline - RtlFreeHeap jumps to this function. Like _RtlFreeHeap,
+//   it calls VLD's free tracking function and then invokes the real
+//   RtlFreeHeap.
+//
+//  - heap (IN): Handle to the heap to which the block being freed belongs.
+//
+//  - flags (IN): Heap control flags.
+//
+//  - mem (IN): Pointer to the memory block being freed.
+//
+//  Return Value:
+//
+//    Returns the value returned by RtlFreeHeap.
+//
+BYTE VisualLeakDetector::_RtlFreeHeapInline (HANDLE heap, DWORD flags, LPVOID mem)
+{
+    PRINT_HOOKED_FUNCTION2();
+
+    if (g_vld.trackingFrees() &&
+        !calledByVld((UINT_PTR)_ReturnAddress()) &&
+        (g_vld.m_status & VLD_STATUS_INSTALLED) &&
+        !g_DbgHelp.IsLockedByCurrentThread() && // skip dbghelp.dll calls
+        !g_vld.isIgnoredHeap(heap)) // nothing from ignored heaps is mapped
+    {
+        tls_t* tls = g_vld.getTls();
+        if (!(tls->flags & VLD_TLS_INLINEHOOK)) {
+            tls->flags |= VLD_TLS_INLINEHOOK;
+
+            // Record the current frame pointer.
+            CAPTURE_CONTEXT();
+            context_.func = reinterpret_cast<UINT_PTR>(RtlFreeHeap);
+
+            // Unmap the block from the specified heap.
+            g_vld.unmapBlock(heap, mem, context_);
+            tls->flags &= ~VLD_TLS_INLINEHOOK;
+        }
+    }
+
+    return RtlFreeHeap(heap, flags, mem);
+}
+
+// _RtlReAllocateHeapInline - RtlReAllocateHeap jumps to this function. Like
+//   _RtlReAllocateHeap, it invokes the real RtlReAllocateHeap and then calls
+//   VLD's reallocation tracking function.
+//
+//  - heap (IN): Handle to the heap to reallocate memory from.
+//
+//  - flags (IN): Heap control flags.
+//
+//  - mem (IN): Pointer to the currently allocated block which is to be
+//      reallocated.
+//
+//  - size (IN): Size, in bytes, of the block to reallocate.
+//
+//  Return Value:
+//
+//    Returns the value returned by RtlReAllocateHeap.
+//
+LPVOID VisualLeakDetector::_RtlReAllocateHeapInline (HANDLE heap, DWORD flags, LPVOID mem, SIZE_T size)
+{
+    PRINT_HOOKED_FUNCTION();
+
+    // Reallocate the block.
+    LPVOID newmem = RtlReAllocateHeap(heap, flags, mem, size);
+    if ((newmem == NULL) || !g_vld.trackingAllocs() || calledByVld((UINT_PTR)_ReturnAddress()) || g_vld.isIgnoredHeap(heap))
+        return newmem;
+    tls_t* tls = g_vld.enabledTls();
+    if ((tls == NULL) || (tls->flags & VLD_TLS_INLINEHOOK))
+        return newmem;
+
+    if (!g_DbgHelp.IsLockedByCurrentThread() && // skip dbghelp.dll calls
+        !CaptureContext::RecordNested(tls, heap, mem, newmem, size)) {
+        tls->flags |= VLD_TLS_INLINEHOOK;
+        {
+            CAPTURE_CONTEXT();
+            CaptureContext cc(RtlReAllocateHeap, context_, tls);
+            cc.Set(heap, mem, newmem, size);
+        }
+        tls->flags &= ~VLD_TLS_INLINEHOOK;
+    }
+
+    return newmem;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // COM IAT Replacement Functions
@@ -318,49 +537,63 @@ LPVOID VisualLeakDetector::_HeapReAlloc (HANDLE heap, DWORD flags, LPVOID mem, S
 //
 //  Return Value:
 //
-//    Always returns S_OK.
+//    Returns S_OK, or what the real CoGetMalloc returned if it failed.
 //
 HRESULT VisualLeakDetector::_CoGetMalloc (DWORD context, LPMALLOC *imalloc)
 {
     PRINT_HOOKED_FUNCTION();
-    static CoGetMalloc_t pCoGetMalloc = NULL;
-
-    HRESULT hr = S_OK;
-
-    HMODULE ole32;
+    static INIT_ONCE initonce = INIT_ONCE_STATIC_INIT;
+
+    // The system implementation of IMalloc is obtained by the first call.
+    // Any other thread calling meanwhile waits for it, and once it's done,
+    // checking for it takes no lock. If it fails, the next call tries again.
+    imallocinit_t init = { context, S_OK };
+    if (!InitOnceExecuteOnce(&initonce, initIMalloc, &init, NULL)) {
+        *imalloc = NULL;
+        return FAILED(init.hr) ? init.hr : E_UNEXPECTED;
+    }
 
     *imalloc = (LPMALLOC)&g_vld;
+    g_vld.AddRef();
+    return S_OK;
+}
 
+// initIMalloc - Links to the real CoGetMalloc and gets a pointer to the system
+//   implementation of the IMalloc interface. Called by InitOnceExecuteOnce,
+//   on behalf of the first call to _CoGetMalloc.
+//
+//  - initonce (IN): The one-time initialization.
+//
+//  - param (IN/OUT): The imallocinit_t of the call; receives what the real
+//      CoGetMalloc returned.
+//
+//  - context (OUT): Unused.
+//
+//  Return Value:
+//
+//    Returns TRUE if the system implementation has been obtained; otherwise
+//    FALSE.
+//
+BOOL CALLBACK VisualLeakDetector::initIMalloc (PINIT_ONCE /*initonce*/, PVOID param, PVOID* /*context*/)
+{
+    imallocinit_t *init = (imallocinit_t*)param;
+    HMODULE ole32 = GetModuleHandleW(L"ole32.dll");
+    CoGetMalloc_t pCoGetMalloc = (CoGetMalloc_t)g_vld._RGetProcAddress(ole32, "CoGetMalloc");
     if (pCoGetMalloc == NULL) {
-        // This is the first call to this function. Link to the real
-        // CoGetMalloc and get a pointer to the system implementation of the
-        // IMalloc interface.
-        ole32 = GetModuleHandleW(L"ole32.dll");
-        pCoGetMalloc = (CoGetMalloc_t)g_vld._RGetProcAddress(ole32, "CoGetMalloc");
-        hr = pCoGetMalloc(context, &g_vld.m_iMalloc);
-
-        // Increment the library reference count to defer unloading the library,
-        // since a call to CoGetMalloc returns the global pointer to the VisualLeakDetector object.
-        HMODULE module = NULL;
-        GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCTSTR)g_vld.m_vldBase, &module);
+        init->hr = E_UNEXPECTED;
+        return FALSE;
     }
-    else
-    {
-        // wait for different thread initialization
-        int c = 0;
-        while(g_vld.m_iMalloc == NULL && c < 10)
-        {
-            Sleep(1);
-            c++;
-        }
-        if (g_vld.m_iMalloc == NULL)
-            hr = E_INVALIDARG;
+    init->hr = pCoGetMalloc(init->context, &g_vld.m_iMalloc);
+    if (FAILED(init->hr)) {
+        g_vld.m_iMalloc = NULL;
+        return FALSE;
     }
 
-    if (SUCCEEDED(hr)) {
-        g_vld.AddRef();
-    }
-    return hr;
+    // Increment the library reference count to defer unloading the library,
+    // since a call to CoGetMalloc returns the global pointer to the VisualLeakDetector object.
+    HMODULE module = NULL;
+    GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCTSTR)g_vld.m_vldBase, &module);
+    return TRUE;
 }
 
 // _CoTaskMemAlloc - Calls to CoTaskMemAlloc are patched through to this
@@ -386,6 +619,9 @@ LPVOID VisualLeakDetector::_CoTaskMemAlloc (SIZE_T size)
         pCoTaskMemAlloc = (CoTaskMemAlloc_t)g_vld._RGetProcAddress(ole32, "CoTaskMemAlloc");
     }
 
+    if (!g_vld.trackingAllocs())
+        return pCoTaskMemAlloc(size);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pCoTaskMemAlloc, context_);
 
@@ -418,6 +654,9 @@ LPVOID VisualLeakDetector::_CoTaskMemRealloc (LPVOID mem, SIZE_T size)
         pCoTaskMemRealloc = (CoTaskMemRealloc_t)g_vld._RGetProcAddress(ole32, "CoTaskMemRealloc");
     }
 
+    if (!g_vld.trackingAllocs())
+        return pCoTaskMemRealloc(mem, size);
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)pCoTaskMemRealloc, context_);
 
@@ -468,6 +707,9 @@ LPVOID VisualLeakDetector::Alloc (_In_ SIZE_T size)
     PRINT_HOOKED_FUNCTION();
     UINT_PTR* cVtablePtr = (UINT_PTR*)((UINT_PTR*)m_iMalloc)[0];
     UINT_PTR iMallocAlloc = cVtablePtr[3];
+    if (!g_vld.trackingAllocs())
+        return (m_iMalloc) ? m_iMalloc->Alloc(size) : NULL;
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)iMallocAlloc, context_);
 
@@ -580,6 +822,9 @@ LPVOID VisualLeakDetector::Realloc (_In_opt_ LPVOID mem, _In_ SIZE_T size)
     PRINT_HOOKED_FUNCTION();
     UINT_PTR* cVtablePtr = (UINT_PTR*)((UINT_PTR*)m_iMalloc)[0];
     UINT_PTR iMallocRealloc = cVtablePtr[4];
+    if (!g_vld.trackingAllocs())
+        return (m_iMalloc) ? m_iMalloc->Realloc(mem, size) : NULL;
+
     CAPTURE_CONTEXT();
     CaptureContext cc((void*)iMallocRealloc, context_);
 
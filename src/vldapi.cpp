@@ -82,6 +82,11 @@ __declspec(dllexport) UINT VLDGetThreadLeaksCount (UINT threadId)
     return (UINT)g_vld.GetThreadLeaksCount(threadId);
 }
 
+__declspec(dllexport) UINT VLDGetModuleLeaksCount (HMODULE module)
+{
+    return (UINT)g_vld.GetModuleLeaksCount(module);
+}
+
 __declspec(dllexport) void VLDMarkAllLeaksAsReported ()
 {
     g_vld.MarkAllLeaksAsReported();
@@ -147,6 +152,171 @@ __declspec(dllexport) int VLDResolveCallstacks()
     return g_vld.ResolveCallstacks();
 }
 
+__declspec(dllexport) SIZE_T VLDTakeSnapshot()
+{
+    return g_vld.TakeSnapshot();
+}
+
+__declspec(dllexport) UINT VLDDiffSnapshots(SIZE_T from, SIZE_T to)
+{
+    return (UINT)g_vld.DiffSnapshots(from, to);
+}
+
+__declspec(dllexport) void VLDGetStatistics(VLD_STATISTICS *statistics)
+{
+    g_vld.GetStatistics(statistics);
+}
+
+__declspec(dllexport) void VLDGetMemoryUsage(VLD_MEMORY_USAGE *usage)
+{
+    g_vld.GetMemoryUsage(usage);
+}
+
+__declspec(dllexport) UINT VLDGetSiteStatistics(VLD_SITE_STATISTICS *sites, UINT count, BOOL byAllocations)
+{
+    return (UINT)g_vld.GetSiteStatistics(sites, count, byAllocations);
+}
+
+__declspec(dllexport) UINT VLDGetHeapSizeClasses(VLD_HEAP_SIZE_CLASSES *heaps, UINT count)
+{
+    return (UINT)g_vld.GetHeapSizeClasses(heaps, count);
+}
+
+__declspec(dllexport) UINT VLDGetModuleStatistics(VLD_MODULE_STATISTICS *modules, UINT count)
+{
+    return (UINT)g_vld.GetModuleStatistics(modules, count);
+}
+
+__declspec(dllexport) void VLDGetCapturePolicy(VLD_CAPTURE_POLICY *policy)
+{
+    g_vld.GetCapturePolicy(policy);
+}
+
+__declspec(dllexport) void VLDSetCapturePolicy(const VLD_CAPTURE_POLICY *policy)
+{
+    g_vld.SetCapturePolicy(policy);
+}
+
+__declspec(dllexport) BOOL VLDGetMiniDumpStream(VLD_MINIDUMP_STREAM *stream)
+{
+    return g_vld.GetMiniDumpStream(stream);
+}
+
+__declspec(dllexport) void VLDFreeMiniDumpStream(VLD_MINIDUMP_STREAM *stream)
+{
+    g_vld.FreeMiniDumpStream(stream);
+}
+
+__declspec(dllexport) BOOL VLDWriteMiniDump(HANDLE file, UINT dumpType, PEXCEPTION_POINTERS exceptionPointers)
+{
+    return g_vld.WriteMiniDump(file, dumpType, exceptionPointers);
+}
+
+__declspec(dllexport) BOOL VLDWriteHeapProfile(const wchar_t *path, BOOL symbolize)
+{
+    return g_vld.WriteHeapProfile(path, symbolize);
+}
+
+__declspec(dllexport) UINT VLDEnumerateLeaks(VLD_LEAK_CALLBACK callback, void *context, UINT flags)
+{
+    return (UINT)g_vld.EnumerateLeaks(callback, context, flags);
+}
+
+__declspec(dllexport) void VLDEnumLeaksBegin(VLD_LEAK_CURSOR *cursor, UINT flags)
+{
+    g_vld.EnumLeaksBegin(cursor, flags);
+}
+
+__declspec(dllexport) UINT VLDEnumLeaksNext(VLD_LEAK_CURSOR *cursor, VLD_LEAK_RECORD *batch, UINT count)
+{
+    return (UINT)g_vld.EnumLeaksNext(cursor, batch, count);
+}
+
+__declspec(dllexport) BOOL VLDFindContainingBlock(const void *address, VLD_LEAK_RECORD *block)
+{
+    return g_vld.FindContainingBlock(address, block);
+}
+
+__declspec(dllexport) BOOL VLDResolveLeakFrame(const VLD_LEAK *leak, UINT frame, VLD_FRAME_INFO *info)
+{
+    return g_vld.ResolveLeakFrame(leak, frame, info);
+}
+
+__declspec(dllexport) UINT VLDReportLeaksAsync(VLD_REPORT_CALLBACK callback, void *context)
+{
+    return (UINT)g_vld.ReportLeaksAsync(callback, context);
+}
+
+__declspec(dllexport) UINT VLDReportLeaksOlderThan(UINT age)
+{
+    return (UINT)g_vld.ReportLeaksOlderThan(age);
+}
+
+__declspec(dllexport) UINT VLDReportPeak()
+{
+    return (UINT)g_vld.ReportPeak();
+}
+
+__declspec(dllexport) UINT VLDReportChurn()
+{
+    return (UINT)g_vld.ReportChurn();
+}
+
+__declspec(dllexport) UINT VLDReportReallocStorms(UINT minReallocs)
+{
+    return (UINT)g_vld.ReportReallocStorms(minReallocs);
+}
+
+__declspec(dllexport) void VLDPushTag(const char *tag)
+{
+    g_vld.PushTag(tag);
+}
+
+__declspec(dllexport) void VLDPopTag()
+{
+    g_vld.PopTag();
+}
+
+__declspec(dllexport) SIZE_T VLDCompact()
+{
+    return g_vld.Compact();
+}
+
+__declspec(dllexport) void VLDTrackAlloc(const void *pool, const void *ptr, SIZE_T size)
+{
+    CAPTURE_CONTEXT();
+    context_.func = reinterpret_cast<UINT_PTR>(VLDTrackAlloc);
+    LPVOID block = const_cast<LPVOID>(ptr);
+    g_vld.TrackAlloc(pool, &block, 1, size, context_);
+}
+
+__declspec(dllexport) void VLDTrackFree(const void *pool, const void *ptr)
+{
+    CAPTURE_CONTEXT();
+    context_.func = reinterpret_cast<UINT_PTR>(VLDTrackFree);
+    LPVOID block = const_cast<LPVOID>(ptr);
+    g_vld.TrackFree(pool, &block, 1, context_);
+}
+
+__declspec(dllexport) void VLDTrackAllocN(const void *pool, void * const *ptrs, SIZE_T size, UINT count)
+{
+    CAPTURE_CONTEXT();
+    context_.func = reinterpret_cast<UINT_PTR>(VLDTrackAllocN);
+    g_vld.TrackAlloc(pool, ptrs, count, size, context_);
+}
+
+__declspec(dllexport) void VLDTrackFreeN(const void *pool, void * const *ptrs, UINT count)
+{
+    CAPTURE_CONTEXT();
+    context_.func = reinterpret_cast<UINT_PTR>(VLDTrackFreeN);
+    g_vld.TrackFree(pool, ptrs, count, context_);
+}
+
+__declspec(dllexport) SIZE_T VLDUntrackRange(const void *pool, const void *base, SIZE_T size)
+{
+    return g_vld.UntrackRange(pool, base, size);
+}
+
 /// Internal function for tests. Not safe to use because Vld own returned string
 __declspec(dllexport) const wchar_t* VldInternalGetAllocationCallstack(void* alloc, BOOL showInternalFrames)
 {
@@ -30,14 +30,151 @@
 #undef new           // Do not map "new" to VLD's new operator in this file
 
 // Global variables.
-vldblockheader_t *g_vldBlockList = NULL; // List of internally allocated blocks on VLD's private heap.
+vldarena_t       *g_vldArenas = NULL;    // List of the arenas of all threads that allocated from VLD's private heap.
 HANDLE            g_vldHeap;             // VLD's private heap.
-CriticalSection   g_vldHeapLock;         // Serializes access to VLD's private heap.
+CriticalSection   g_vldHeapLock;         // Serializes changes to the list of arenas.
+
+static DWORD        s_arenaTls = TLS_OUT_OF_INDEXES; // TLS slot holding each thread's arena.
+static vldarena_t   s_sharedArena;                   // Arena of all threads if there is no TLS slot.
+static SLIST_HEADER s_sharedBlocks [VLDHEAP_CLASSES]; // Free blocks of each size class given up by their thread.
+static volatile LONG64 s_serialNumber = 0;
 
 // Local helper functions.
 static inline void* vldnew (size_t size, const char *file, int line);
 static inline void vlddelete (void *block);
 
+// CreateVldHeap - Creates VLD's private heap. Must be called before anything
+//   is allocated from it.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID CreateVldHeap ()
+{
+    g_vldHeap = HeapCreate(0x0, 0, 0);
+    g_vldHeapLock.Initialize();
+    s_sharedArena.lock.Initialize();
+    for (UINT sizeclass = 0; sizeclass < VLDHEAP_CLASSES; sizeclass++)
+        InitializeSListHead(&s_sharedBlocks[sizeclass]);
+    s_arenaTls = TlsAlloc();
+    if (s_arenaTls == TLS_OUT_OF_INDEXES)
+        g_vldArenas = &s_sharedArena;
+}
+
+// DestroyVldHeap - Destroys VLD's private heap, freeing whatever is left on
+//   it, arenas included.
+//
+//  Return Value:
+//
+//    None.
+//
+VOID DestroyVldHeap ()
+{
+    for (vldarena_t *arena = g_vldArenas; arena != NULL; arena = arena->next) {
+        if (arena != &s_sharedArena)
+            arena->lock.Delete();
+    }
+    g_vldArenas = NULL;
+    HeapDestroy(g_vldHeap);
+    g_vldHeapLock.Delete();
+    s_sharedArena.lock.Delete();
+    if (s_arenaTls != TLS_OUT_OF_INDEXES) {
+        TlsFree(s_arenaTls);
+        s_arenaTls = TLS_OUT_OF_INDEXES;
+    }
+}
+
+// GetVldHeapBytes - Adds up the bytes currently allocated from VLD's private
+//   heap by every thread.
+//
+//  Return Value:
+//
+//    Returns the number of bytes allocated, not counting block headers or
+//    the rounding up to size classes.
+//
+SIZE_T GetVldHeapBytes ()
+{
+    SIZE_T bytes = 0;
+    CriticalSectionLocker<> cs(g_vldHeapLock);
+    for (vldarena_t *arena = g_vldArenas; arena != NULL; arena = arena->next)
+        bytes += arena->bytes;
+    return bytes;
+}
+
+// GetVldHeapCommitted - Adds up the memory VLD's private heap has committed
+//   in its regions. Blocks so large that the heap allocated them from virtual
+//   memory directly aren't in any region, and aren't counted.
+//
+//  Return Value:
+//
+//    Returns the number of bytes committed.
+//
+SIZE_T GetVldHeapCommitted ()
+{
+    SIZE_T committed = 0;
+    if (!HeapLock(g_vldHeap))
+        return 0;
+    PROCESS_HEAP_ENTRY entry;
+    entry.lpData = NULL;
+    while (HeapWalk(g_vldHeap, &entry)) {
+        if (entry.wFlags & PROCESS_HEAP_REGION)
+            committed += entry.Region.dwCommittedSize;
+    }
+    HeapUnlock(g_vldHeap);
+    return committed;
+}
+
+// getArena - Obtains the calling thread's arena, creating it on the thread's
+//   first allocation. Threads share one arena, whose caches aren't used, if
+//   there is no TLS slot for them.
+//
+//  Return Value:
+//
+//    Returns the arena, or NULL if it couldn't be allocated.
+//
+static vldarena_t* getArena ()
+{
+    if (s_arenaTls == TLS_OUT_OF_INDEXES)
+        return &s_sharedArena;
+
+    vldarena_t *arena = (vldarena_t*)TlsGetValue(s_arenaTls);
+    if (arena != NULL)
+        return arena;
+
+    arena = (vldarena_t*)RtlAllocateHeap(g_vldHeap, HEAP_ZERO_MEMORY, sizeof(vldarena_t));
+    if (arena == NULL)
+        return NULL;
+    arena->lock.Initialize();
+    {
+        CriticalSectionLocker<> cs(g_vldHeapLock);
+        arena->next = g_vldArenas;
+        g_vldArenas = arena;
+    }
+    TlsSetValue(s_arenaTls, arena);
+    return arena;
+}
+
+// getSizeClass - Finds the size class of a block.
+//
+//  - size (IN): Size of the block, not including its header.
+//
+//  Return Value:
+//
+//    Returns the index of the smallest size class the block fits in, or
+//    VLDHEAP_CLASSES if the block is too large for all of them.
+//
+static inline UINT getSizeClass (size_t size)
+{
+    UINT sizeclass = 0;
+    size_t classsize = VLDHEAP_MINCLASS;
+    while ((sizeclass < VLDHEAP_CLASSES) && (size > classsize)) {
+        sizeclass++;
+        classsize <<= 1;
+    }
+    return sizeclass;
+}
+
 // scalar new operator - New operator used to allocate a scalar memory block
 //   from VLD's private heap.
 //
@@ -152,28 +289,52 @@ void operator delete [] (void *block, const char *, int)
 //
 void* vldnew (size_t size, const char *file, int line)
 {
-    vldblockheader_t *header = (vldblockheader_t*)RtlAllocateHeap(g_vldHeap, 0x0, size + sizeof(vldblockheader_t));
-    static SIZE_T     serialnumber = 0;
-
-    if (header == NULL) {
+    vldarena_t *arena = getArena();
+    if (arena == NULL) {
         // Out of memory.
         return NULL;
     }
 
+    // Small blocks are recycled: first from the thread's own cache, then
+    // from the blocks other threads gave up.
+    vldblockheader_t *header = NULL;
+    UINT sizeclass = getSizeClass(size);
+    if (sizeclass < VLDHEAP_CLASSES) {
+        if (arena != &s_sharedArena)
+            header = arena->cache[sizeclass];
+        if (header != NULL) {
+            arena->cache[sizeclass] = header->next;
+            arena->cacheCount[sizeclass]--;
+        }
+        else {
+            header = (vldblockheader_t*)InterlockedPopEntrySList(&s_sharedBlocks[sizeclass]);
+        }
+    }
+    if (header == NULL) {
+        size_t blocksize = (sizeclass < VLDHEAP_CLASSES) ? ((size_t)VLDHEAP_MINCLASS << sizeclass) : size;
+        header = (vldblockheader_t*)RtlAllocateHeap(g_vldHeap, 0x0, blocksize + sizeof(vldblockheader_t));
+        if (header == NULL) {
+            // Out of memory.
+            return NULL;
+        }
+    }
+
     // Fill in the block's header information.
+    header->arena        = arena;
     header->file         = file;
     header->line         = line;
-    header->serialNumber = serialnumber++;
+    header->serialNumber = (size_t)(InterlockedIncrement64(&s_serialNumber) - 1);
     header->size         = size;
 
-    // Link the block into the block list.
-    CriticalSectionLocker<> cs(g_vldHeapLock);
-    header->next         = g_vldBlockList;
+    // Link the block into the arena's block list.
+    CriticalSectionLocker<> cs(arena->lock);
+    header->next         = arena->blocks;
     if (header->next != NULL) {
         header->next->prev = header;
     }
     header->prev         = NULL;
-    g_vldBlockList       = header;
+    arena->blocks        = header;
+    arena->bytes        += size;
 
     // Return a pointer to the beginning of the data section of the block.
     return (void*)VLDBLOCKDATA(header);
@@ -193,23 +354,42 @@ void vlddelete (void *block)
     if (block == NULL)
         return;
 
-    BOOL              freed;
     vldblockheader_t *header = VLDBLOCKHEADER((LPVOID)block);
+    vldarena_t       *owner = header->arena;
 
-    // Unlink the block from the block list.
-    CriticalSectionLocker<> cs(g_vldHeapLock);
-    if (header->prev) {
-        header->prev->next = header->next;
-    }
-    else {
-        g_vldBlockList = header->next;
+    // Unlink the block from the block list of the arena it was allocated
+    // from, which may belong to another thread.
+    {
+        CriticalSectionLocker<> cs(owner->lock);
+        if (header->prev) {
+            header->prev->next = header->next;
+        }
+        else {
+            owner->blocks = header->next;
+        }
+
+        if (header->next) {
+            header->next->prev = header->prev;
+        }
+        owner->bytes -= header->size;
     }
 
-    if (header->next) {
-        header->next->prev = header->prev;
+    // Keep small blocks for reuse, in this thread's cache unless it is full.
+    UINT sizeclass = getSizeClass(header->size);
+    if (sizeclass < VLDHEAP_CLASSES) {
+        vldarena_t *arena = getArena();
+        if ((arena != NULL) && (arena != &s_sharedArena) && (arena->cacheCount[sizeclass] < VLDHEAP_CACHE_BLOCKS)) {
+            header->next = arena->cache[sizeclass];
+            arena->cache[sizeclass] = header;
+            arena->cacheCount[sizeclass]++;
+        }
+        else {
+            InterlockedPushEntrySList(&s_sharedBlocks[sizeclass], (PSLIST_ENTRY)header);
+        }
+        return;
     }
 
     // Free the block.
-    freed = RtlFreeHeap(g_vldHeap, 0x0, header);
+    BOOL freed = RtlFreeHeap(g_vldHeap, 0x0, header);
     assert(freed);
 }
@@ -30,6 +30,7 @@ Applications should never include this header."
 #endif
 
 #include <windows.h>
+#include "criticalsection.h"
 
 #define GAPSIZE 4
 
@@ -85,19 +86,46 @@ typedef char checkDebugHeapBlockSize[
 #define CRT_USE_TYPE(use) (use & 0xFFFF)
 #define _BLOCK_TYPE_IS_VALID(use) (_BLOCK_TYPE(use) == _CLIENT_BLOCK || (use) == _NORMAL_BLOCK || _BLOCK_TYPE(use) == _CRT_BLOCK || (use) == _IGNORE_BLOCK)
 
+#define VLDHEAP_CLASSES      6   // Size classes of small blocks: 16, 32, 64, 128, 256 and 512 bytes.
+#define VLDHEAP_MINCLASS     16  // Size of the smallest class, in bytes.
+#define VLDHEAP_CACHE_BLOCKS 16  // Free blocks of each class kept by a thread before sharing them.
+
 // Memory block header structure used internally by VLD. All internally
 // allocated blocks are allocated from VLD's private heap and have this header
 // pretended to them.
-struct vldblockheader_t
+struct __declspec(align(MEMORY_ALLOCATION_ALIGNMENT)) vldblockheader_t
 {
-    struct vldblockheader_t *next;          // Pointer to the next block in the list of internally allocated blocks.
-    struct vldblockheader_t *prev;          // Pointer to the preceding block in the list of internally allocated blocks.
+    struct vldblockheader_t *next;          // Pointer to the next block in the arena's list of internally allocated blocks.
+    struct vldblockheader_t *prev;          // Pointer to the preceding block in the arena's list of internally allocated blocks.
+    struct vldarena_t       *arena;         // The arena of the thread which allocated this block.
     const char              *file;          // Name of the file where this block was allocated.
     int                      line;          // Line number within the above file where this block was allocated.
     size_t                   size;          // The size of this memory block, not including this header.
     size_t                   serialNumber;  // Each block is assigned a unique serial number, starting from zero.
 };
 
+// Each thread that allocates from VLD's private heap gets an arena, so that
+// internal allocations don't all serialize on one lock. Small blocks are
+// rounded up to a size class and recycled through the arena's caches; a
+// thread which frees blocks of a class faster than it allocates them passes
+// the surplus on to the other threads through a lock-free list per class.
+// Arenas are never freed before the heap is destroyed.
+struct vldarena_t
+{
+    vldarena_t       *next;       // Next arena in the list of all arenas.
+    CriticalSection   lock;       // Protects "blocks". Only contended when another thread frees one of them.
+    vldblockheader_t *blocks;     // The blocks allocated by this arena's thread which haven't been freed.
+    SIZE_T            bytes;      // Total size of "blocks", not counting headers. Protected by "lock".
+    vldblockheader_t *cache [VLDHEAP_CLASSES]; // Free blocks of each size class, linked through "next".
+    UINT              cacheCount [VLDHEAP_CLASSES];
+};
+
+// Creation and destruction of VLD's private heap, and what it holds.
+VOID   CreateVldHeap ();
+VOID   DestroyVldHeap ();
+SIZE_T GetVldHeapBytes ();
+SIZE_T GetVldHeapCommitted ();
+
 // Data-to-Header and Header-to-Data conversion
 #define VLDBLOCKHEADER(d) (vldblockheader_t*)(((PBYTE)d) - sizeof(vldblockheader_t))
 #define VLDBLOCKDATA(h) (LPVOID)(((PBYTE)h) + sizeof(vldblockheader_t))
@@ -38,18 +38,36 @@
 #include <windows.h>
 #include "vld_def.h"
 #include "version.h"
+#include "addressfilter.h" // Provides a lock-free filter of tracked block addresses.
+#include "alloctrace.h"  // Provides the allocation trace file format.
 #include "callstack.h"  // Provides a custom class for handling call stacks.
 #include "map.h"        // Provides a custom STL-like map template.
 #include "ntapi.h"      // Provides access to NT APIs.
 #include "set.h"        // Provides a custom STL-like set template.
+#include "shardmap.h"   // Provides the address-sharded map and lock templates.
+#include "sizingprofile.h" // Provides the sizing profile file format.
+#include "hashmap.h"    // Provides an open-addressing hash map template.
+#include "inlinehook.h" // Provides hooks of functions themselves.
+#include "slab.h"       // Provides a fixed-size slab allocator template.
 #include "utility.h"    // Provides miscellaneous utility functions.
 #include "vldallocator.h"   // Provides internal allocator.
 
 #define MAXMODULELISTLENGTH 512     // Maximum module list length, in characters.
+#ifndef BLOCKMAPSHARDS              // May be raised (to 64, say) for programs allocating on many threads at once.
+#define BLOCKMAPSHARDS      16      // Number of address shards in block maps and in g_heapMapLock (power of two).
+#endif
+#define VLD_MAX_REPORT_THREADS 8    // Maximum value of the ReportThreads option.
+#define IGNOREDHEAPBITS     256     // Number of bits in the bitmap of ignored heaps (power of two).
+#define VLD_MAX_TRACE_POLICIES 16   // Maximum number of modules with a ModuleTracePolicy of their own.
+#define VLD_MAX_TAGS        2048    // Number of allocation tag IDs (see VLDPushTag), including 0 for no tag.
+#define VLD_TAG_DEPTH       16      // Allocation tags remembered per thread; deeper ones count as the deepest remembered.
+#define VLD_TIME_RECORDS    65536   // Allocation time records kept (see AllocationTimeResolution); older ones are overwritten.
 #define SELFTESTTEXTA       "Memory Leak Self-Test"
 #define SELFTESTTEXTW       L"Memory Leak Self-Test"
 #define VLDREGKEYPRODUCT    L"Software\\Visual Leak Detector"
-#ifndef WIN64
+#if defined(_M_ARM64)
+#define VLDDLL				"vld_arm64.dll"
+#elif !defined(WIN64)
 #define VLDDLL				"vld_x86.dll"
 #else
 #define VLDDLL				"vld_x64.dll"
@@ -67,6 +85,7 @@ typedef HANDLE(__stdcall *HeapCreate_t) (DWORD, SIZE_T, SIZE_T);
 typedef BOOL(__stdcall *HeapFree_t) (HANDLE, DWORD, LPVOID);
 typedef FARPROC(__stdcall *GetProcAddress_t) (HMODULE, LPCSTR);
 typedef FARPROC(__stdcall *GetProcAddressForCaller_t) (HMODULE, LPCSTR, LPVOID);
+typedef HRESULT(__stdcall *GetThreadDescription_t) (HANDLE, PWSTR*);
 
 typedef void* (__cdecl *_calloc_dbg_t) (size_t, size_t, int, const char*, int);
 typedef void* (__cdecl *_malloc_dbg_t) (size_t, int, const char *, int);
@@ -81,6 +100,9 @@ typedef void* (__cdecl *new_t) (size_t);
 typedef void* (__cdecl *new_dbg_crt_t) (size_t, int, const char *, int);
 typedef void* (__cdecl *new_dbg_mfc_t) (size_t, const char *, int);
 typedef void* (__cdecl *realloc_t) (void *, size_t);
+typedef void (__cdecl *free_t) (void *);
+typedef intptr_t (__cdecl *_get_heap_handle_t) ();
+typedef void (__cdecl *_dosmaperr_t) (unsigned long);
 typedef void* (__cdecl *_recalloc_t) (void *, size_t, size_t);
 typedef char* (__cdecl *_strdup_t) (const char*);
 typedef char* (__cdecl *_strdup_dbg_t) (const char*, int, const char* ,int);
@@ -99,33 +121,250 @@ typedef void* (__cdecl *_aligned_offset_realloc_dbg_t) (void *, size_t, size_t,
 typedef void* (__cdecl *_aligned_recalloc_dbg_t) (void *, size_t, size_t, size_t, int, const char *, int);
 typedef void* (__cdecl *_aligned_offset_recalloc_dbg_t) (void *, size_t, size_t, size_t, size_t, int, const char *, int);
 
+// Kinds of CRT debug header a block can start with. Blocks allocated through
+// the patched debug CRT functions are tagged when they are captured; the
+// others are probed once, when first asked about, and the result is kept.
+enum crtheader_e {
+    crtheader_unknown = 0, // Not determined yet.
+    crtheader_none,        // The block has no CRT debug header.
+    crtheader_msvcrt,      // The block starts with a crtdbgblockheader_t (debug CRTs before the UCRT).
+    crtheader_ucrt         // The block starts with a crtdbgblockheaderucrt_t (the debug UCRT).
+};
+
 // Data is collected for every block allocated from any heap in the process.
 // The data is stored in this structure and these structures are stored in
 // a BlockMap which maps each of these structures to its corresponding memory
 // block.
+//
+// One of these is kept for every tracked block, so the fields are packed: on
+// x64 the serial number and size are limited to 48 bits (the serial number
+// wraps after 2^48 allocations, user mode addresses only have 47 bits) and
+// share two quadwords with the flags and the allocating thread, which is
+// stored as an index into VLD's thread table (see getThreadId).
+//
+// The fields aren't split into a hot part for frees and a cold one for
+// reports: freeing a block reads every one of them. The size and call stack
+// go to the statistics, the links unlink the block from its shard's list, and
+// the serial number, thread and flags uncount it if it was counted as a leak.
 struct blockinfo_t {
-    std::unique_ptr<CallStack> callStack;
-    DWORD      threadId;
+    CallStackRef callStack;   // Interned call stack at the time of allocation.
+    blockinfo_t *older;       // Previously mapped block of the same heap and shard.
+    blockinfo_t *newer;       // Next mapped block of the same heap and shard.
+#ifdef _WIN64
+    UINT64     serialNumber : 48;
+    UINT64     threadIndex  : 16; // Thread table index of the thread that allocated the block.
+    UINT64     size         : 48;
+    UINT64     reported     : 1;
+    UINT64     crtHeader    : 2;  // The kind of CRT debug header the block starts with (a crtheader_e).
+    UINT64     counted      : 1;  // Counted as a leak (see countBlock).
+    UINT64     unclassified : 1;  // Counted, but its call stack may still turn out to be CRT startup code.
+    UINT64     tag          : 11; // Allocation tag ID of the allocating thread (see VLDPushTag), 0 if none.
+    WORD       image;             // Module image of the allocating code (see IsExcludedModule), or MODULEIMAGE_NONE.
+#else
     SIZE_T     serialNumber;
     SIZE_T     size;
-    bool       reported;
-    bool       debugCrtAlloc;
-    bool       ucrt;
+    WORD       threadIndex;       // Thread table index of the thread that allocated the block.
+    WORD       reported     : 1;
+    WORD       crtHeader    : 2;  // The kind of CRT debug header the block starts with (a crtheader_e).
+    WORD       counted      : 1;  // Counted as a leak (see countBlock).
+    WORD       unclassified : 1;  // Counted, but its call stack may still turn out to be CRT startup code.
+    WORD       tag          : 11; // Allocation tag ID of the allocating thread (see VLDPushTag), 0 if none.
+    WORD       image;             // Module image of the allocating code (see IsExcludedModule), or MODULEIMAGE_NONE.
+#endif
+};
+
+// The thread table maps the thread indices kept in blockinfo_t to thread IDs.
+// It is made of pages allocated as threads first enter VLD, and which never
+// move, so it can be read without a lock. Index 0 stands for any thread that
+// entered VLD after the table filled up; its thread ID is reported as 0.
+#define VLD_THREAD_TABLE_PAGE  256 // Thread IDs per page.
+#define VLD_THREAD_TABLE_PAGES 256 // Pages, for the 65536 indices a blockinfo_t can hold.
+
+// Leak accounting of one thread table index, kept in pages alongside the
+// thread table (see countBlock and MarkThreadLeaksAsReported).
+struct threadleaks_t {
+    LONG       count;        // Blocks allocated by the thread counted as leaks.
+    SIZE_T     reportedMark; // Blocks allocated by the thread with lower serial numbers count as reported.
+};
+
+// Blocks carry no allocation time. With AllocationTimeResolution, the time is
+// recorded instead whenever an allocation is made a resolution or more after
+// the last record, with that allocation's serial number. Every block up to the
+// next record's serial number was then allocated within a resolution of the
+// record's time (see allocationTime).
+struct timerecord_t {
+    ULONGLONG  time;         // GetTickCount64 at the allocation, in milliseconds.
+    SIZE_T     serial;       // Serial number of the allocation.
 };
 
 // BlockMaps map memory blocks (via their addresses) to blockinfo_t structures.
-typedef Map<LPCVOID, blockinfo_t*> BlockMap;
+// They are sharded by address so that threads allocating from the same heap
+// don't all serialize on a single tree. Each shard is an open-addressing hash
+// map; define VLD_TREE_BLOCKMAP to use the red-black tree Map instead. Either
+// way a shard is only accessed under its g_heapMapLock shard, so the shards
+// don't lock themselves.
+#ifdef VLD_TREE_BLOCKMAP
+typedef ShardedMap<LPCVOID, blockinfo_t*, BLOCKMAPSHARDS, Map<LPCVOID, blockinfo_t*, NoLock> > BlockMap;
+#else
+typedef ShardedMap<LPCVOID, blockinfo_t*, BLOCKMAPSHARDS, HashMap<LPCVOID, blockinfo_t*> > BlockMap;
+#endif
+
+// The heap map lock. Each shard guards the blocks whose addresses hash to it;
+// entering the whole lock guards the HeapMap itself and every block.
+typedef ShardedLock<BLOCKMAPSHARDS> HeapMapLock;
 
 // Information about each heap in the process is kept in this map. Primarily
 // this is used for mapping heaps to all of the blocks allocated from those
 // heaps.
+//
+// The blocks of each shard are also linked in serial number order, from
+// oldest to newest, so the blocks allocated after a given serial number can
+// be found by walking back from the newest one. Blocks reach the block maps
+// from pending buffers in batches, so they are inserted in order rather than
+// appended.
+// With SizeClassHistogram, the blocks of each heap are counted by size class,
+// per shard like the heap's block and byte counts. The power-of-two classes
+// come first, then the LFH classes (see VLD_HEAP_SIZE_CLASSES).
+#define VLD_SIZE_CLASSES (VLD_POW2_CLASSES + VLD_LFH_CLASSES)
+struct sizeclasses_t {
+    SIZE_T       live [BLOCKMAPSHARDS][VLD_SIZE_CLASSES];  // Blocks in each shard's list, by size class.
+    SIZE_T       total [BLOCKMAPSHARDS][VLD_SIZE_CLASSES]; // Blocks allocated so far, by the shard of their address.
+};
+
 struct heapinfo_t {
-    BlockMap blockMap;   // Map of all blocks allocated from this heap.
-    UINT32   flags;      // Heap status flags
+    BlockMap     blockMap;                // Map of all blocks allocated from this heap.
+    UINT32       flags;                   // Heap status flags:
+#define VLD_HEAP_IGNORED 0x1              //   If set, blocks allocated from this heap aren't tracked (see HeapsToIgnore).
+    blockinfo_t *newest [BLOCKMAPSHARDS]; // Block with the greatest serial number in each shard.
+    SIZE_T       blocks [BLOCKMAPSHARDS]; // Blocks in each shard's list, kept with the list.
+    SIZE_T       bytes [BLOCKMAPSHARDS];  // Total size of those blocks.
+    sizeclasses_t *sizeClasses;           // Size class histograms, with SizeClassHistogram (or NULL).
+    Set<LPCVOID> *addresses;              // A pool's blocks in address order, for UntrackRange (NULL for heaps).
+    UINT32       ordinal;                 // Number of heaps mapped before this one (see SizingProfile).
 };
 
 // HeapMaps map heaps (via their handles) to BlockMaps.
 typedef Map<HANDLE, heapinfo_t*> HeapMap;
+
+// The blocks of a custom allocator's pools, tracked with VLDTrackAlloc, are
+// mapped as if each pool was a heap, keyed by the pool's address with the low
+// bit set. Heap handles are 64K aligned, so a pool's key is never a heap's,
+// and such a "heap" is never handed to the heap functions.
+#define VLD_POOL_HEAP(pool)    ((HANDLE)((UINT_PTR)(pool) | 0x1))
+#define VLD_IS_POOL_HEAP(heap) (((UINT_PTR)(heap) & 0x1) != 0)
+
+// The committed pages of a reservation, as disjoint ranges which never touch,
+// each mapped from its start to its end.
+typedef Map<UINT_PTR, UINT_PTR, NoLock> CommitMap;
+
+// A region of the address space reserved with NtAllocateVirtualMemory, or a
+// view mapped with NtMapViewOfSection (see TrackVirtualMemory).
+struct vregion_t {
+    SIZE_T       size;      // Bytes reserved, or mapped.
+    SIZE_T       committed; // Bytes committed; all of them, for a view.
+    CommitMap   *commits;   // The committed ranges of a reservation, or NULL for a view.
+    CallStack   *callStack; // Call stack which reserved or mapped the region (holds a reference), or NULL.
+    DWORD        threadId;  // Thread which reserved or mapped it.
+};
+
+// VirtualRegionMaps map the tracked regions by their base address. A region
+// is found from any address within it with floor.
+typedef Map<UINT_PTR, vregion_t*, NoLock> VirtualRegionMap;
+
+// Blocks of the same size allocated from the same call stack are duplicates
+// of each other. With AggregateDuplicates on, each such group is reported
+// once, under the first block of the group that is found to be a leak.
+struct dupgroup_t {
+    dupgroup_t *next;     // Next group sharing the same call stack (with a different size).
+    SIZE_T      size;     // Size of each block in the group.
+    SIZE_T      count;    // Number of blocks in the group.
+    bool        reported; // Set once the group has been reported.
+};
+
+// The DuplicateIndex groups all blocks in all heaps by size and call stack in
+// a single pass. Call stacks are interned, so blocks allocated from identical
+// stacks share the same CallStack and the stack pointer identifies the frames
+// exactly.
+class DuplicateIndex
+{
+public:
+    DuplicateIndex () : m_built(false) {}
+    ~DuplicateIndex ();
+
+    VOID Build (HeapMap *heapMap, SIZE_T before = (SIZE_T)-1);
+    dupgroup_t* Find (const blockinfo_t *info) const;
+    bool IsBuilt () const { return m_built; }
+
+private:
+    // Don't allow this!!
+    DuplicateIndex (const DuplicateIndex &other);
+    DuplicateIndex& operator = (const DuplicateIndex &other);
+
+    typedef HashMap<CallStack*, dupgroup_t*> GroupMap;
+
+    GroupMap m_groups; // Maps each call stack to its list of groups.
+    bool     m_built;  // Set once Build has been called.
+};
+
+// What the reachability scan (see ReachabilityScan) found out about a block.
+enum reachability_e {
+    reachability_unknown = 0, // No scan was made.
+    reachability_reachable,   // A pointer to the block was found.
+    reachability_unreachable  // No pointer to the block was found.
+};
+
+// A leak (or group of aggregated duplicates) found by reportLeaks: what its
+// entry in the report shows. The address and size are those of the block's
+// user data.
+struct leakentry_t {
+    SIZE_T     serialNumber;
+    LPCVOID    address;
+    SIZE_T     size;
+    SIZE_T     blockSize;  // Size of the block as tracked, which the leak hash is computed from.
+    long       crtRequest; // CRT allocation request number (debug builds only), or -1.
+    CallStack *callStack;
+    DWORD      threadId;
+    WORD       threadIndex; // Thread table index of the allocating thread (see getThreadName).
+    UINT32     tag;        // Allocation tag ID, or 0.
+    SIZE_T     count;      // Number of blocks in the group (1 unless aggregating).
+    double     estimate;   // Number of blocks the group stands for when sampling, or 0.
+    LPCVOID    data;       // The data to dump: the block itself, or a copy of its first bytes.
+    SIZE_T     dataSize;   // Size of the data to dump, at most MaxDataDump.
+    BYTE       reachability; // What the reachability scan found (a reachability_e).
+};
+
+// The text report is printed as reportLeaks goes. The structured reports
+// (ReportFormat = json or csv) and the asynchronous report are given the same
+// leaks, picked and aggregated the same way, through a LeakSink instead.
+class LeakSink
+{
+public:
+    virtual ~LeakSink () {}
+
+    // Leak - Called for each leak (or group of aggregated duplicates).
+    virtual VOID Leak (const leakentry_t &leak) = 0;
+};
+
+class LeakSnapshot;
+struct deferredheap_t;
+struct reportjob_t;
+struct reachscan_t;
+struct symboljob_t;
+struct crashwriter_t;
+struct vldbin_header_t;
+
+// An allocation site's share of the memory in use at the last peak snapshot
+// (see PeakSnapshotStep). Holds a reference on the call stack.
+struct peaksite_t {
+    CallStack *callStack;
+    SIZE_T     blocks;    // Blocks allocated from the call stack which were still allocated.
+    SIZE_T     bytes;     // Total size of those blocks.
+};
+
+// ResolveCallstacks gathers the distinct call stacks it has to resolve, and
+// the distinct program counters in them, into these sets.
+typedef HashMap<CallStack*, bool> StackSet;
+typedef HashMap<SIZE_T, bool>     ProgramCounterSet;
 typedef std::basic_string<wchar_t, std::char_traits<wchar_t>, vldallocator<wchar_t> > vldstring;
 
 // This structure stores information, primarily the virtual address range, about
@@ -147,8 +386,15 @@ struct moduleinfo_t {
     UINT32 flags;                    // Module flags:
 #define VLD_MODULE_EXCLUDED      0x1 //   If set, this module is excluded from leak detection.
 #define VLD_MODULE_SYMBOLSLOADED 0x2 //   If set, this module's debug symbols have been loaded.
-    vldstring name;                  // The module's name (e.g. "kernel32.dll").
-    vldstring path;                  // The fully qualified path from where the module was loaded.
+#define VLD_MODULE_SYMBOLSQUERIED 0x4 //  If set, loading this module's debug symbols has been attempted.
+#define VLD_MODULE_AUTOEXCLUDED  0x8 //   If set, this module was excluded by AutoExcludeHotModules.
+#define VLD_MODULE_SYMBOLSPENDING 0x10 // If set, loading this module's symbols timed out, and they are fetched in the background.
+    LPCWSTR   name;                  // The module's name (e.g. "kernel32.dll"), interned by ModulePaths.
+    LPCWSTR   path;                  // The fully qualified path from where the module was loaded, interned by ModulePaths.
+    UINT32    pathLength;            // Length of the path, in characters.
+    GUID      pdbGuid;               // Signature of the module's PDB (zero if unknown).
+    DWORD     pdbAge;                // Age of the module's PDB (zero if unknown).
+    UINT32    image;                 // Index of the module's image in the ModuleImages table.
 };
 
 // ModuleSets store information about modules loaded in the process.
@@ -156,6 +402,255 @@ typedef Set<moduleinfo_t> ModuleSet;
 
 typedef Set<VLD_REPORT_HOOK> ReportHookSet;
 
+// A read-only copy of the loaded modules' address ranges, sorted by address,
+// holding the decision whether allocations made from each module are tracked.
+// A new table is published whenever the modules or their flags change, so the
+// check made on each allocation needs neither a lock nor a system call. Old
+// tables may still be in use by other threads and are only freed when VLD is
+// destroyed.
+struct modulerange_t {
+    UINT_PTR addrLow;  // Lowest address within the module.
+    UINT_PTR addrHigh; // Highest address within the module.
+    BOOL     excluded; // TRUE if allocations made from this module aren't tracked.
+    BOOL     allocator; // TRUE if the module is one whose heap functions VLD patches (or ntdll).
+    UINT32   image;    // Index of the module's image in the ModuleImages table.
+    UINT32   maxFrames; // Frames to trace for allocations made from this module (0 for MaxTraceFrames).
+    UINT32   walkMethod; // Stack walk method for them (see CALLSTACK_WALK_CONFIGURED).
+};
+
+// The allocations made from one module image, counted as the allocating
+// module is looked up (see CaptureContext::IsExcludedModule), whether or not
+// the module is excluded. The counters are kept in pages which are allocated
+// as the images are published in the module range table, and never freed
+// until VLD is destroyed, so they are updated without a lock.
+struct modulecounters_t {
+    volatile LONG64 allocations; // Blocks allocated, or reallocated, from the image.
+    volatile LONG64 bytes;       // Total size of those blocks.
+    volatile LONG   leaks;       // Blocks allocated from the image which count as leaks (see countBlock).
+};
+
+// A module watched by AutoExcludeHotModules, sampled by sampleHotModules.
+struct hotmodule_t {
+    UINT_PTR base;        // The module's base address.
+    UINT32   image;       // Its image, whose counters are sampled.
+    UINT64   allocations; // The image's allocation counter when it was sampled.
+    bool     implicated;  // Set if a block it allocated outlived the grace period.
+};
+
+// A module's own stack trace depth and walk method (see ModuleTracePolicy).
+struct tracepolicy_t {
+    WCHAR  moduleName [64]; // Lower case name of the module, with its extension.
+    UINT32 maxFrames;       // Frames to trace (0 for MaxTraceFrames).
+    UINT32 walkMethod;      // Stack walk method (see CALLSTACK_WALK_CONFIGURED).
+};
+
+// How allocations are sampled, and how their call stacks are traced: the
+// options VLDSetCapturePolicy and WatchIniFile may change while the program
+// runs. A policy is immutable once published; a new one replaces it as a
+// whole (see publishCapturePolicy), so the hooks read one without any lock.
+// Policies are replaced rarely, so the retired ones are only freed when VLD
+// is destroyed.
+struct capturepolicy_t {
+    UINT32 walkMethod;      // Stack walk method: one of VLD_STACK_WALK_OPTIONS (0 for "fast").
+    UINT32 maxTraceFrames;  // Maximum number of frames per stack trace for each leaked block.
+    UINT32 adaptiveFrames;  // Frames traced before the rest of a stack (see AdaptiveTraceFrames), or 0.
+    UINT32 sampleRate;      // Track one in this many allocations (0 or 1 tracks every allocation).
+    SIZE_T sampleBytes;     // Track one allocation per this many bytes on average (0 disables byte sampling).
+    SIZE_T minTrackedSize;  // Allocations smaller than this are tracked one in smallSampleRate.
+    SIZE_T maxTrackedSize;  // Allocations larger than this aren't tracked (0 for no limit).
+    UINT32 smallSampleRate; // Track one in this many allocations under minTrackedSize (0 tracks none).
+    const capturepolicy_t *retired; // The policy this one replaced, or NULL.
+};
+
+// The StackWalkMethod bits of the options.
+#define VLD_STACK_WALK_OPTIONS (VLD_OPT_SAFE_STACK_WALK | VLD_OPT_UNWIND_STACK_WALK | VLD_OPT_FRAME_STACK_WALK | \
+    VLD_OPT_NO_STACK_WALK | VLD_OPT_CALLER_STACK_WALK)
+
+// The module range table is immutable once published. A new one replaces it
+// whenever a module is loaded or unloaded, and the old one is retired until
+// no thread can be reading it any more (see ModuleRangesReader).
+struct moduleranges_t {
+    moduleranges_t *retired;   // Previously published tables which haven't been reclaimed yet, latest first.
+    LONG            epoch;     // Publication number of the table; readers announce the one they started from.
+    SIZE_T          count;     // Number of ranges in the table.
+    modulerange_t   ranges [1]; // The ranges ("count" of them, allocated as needed).
+};
+
+const modulerange_t* FindModuleRange (const moduleranges_t *table, UINT_PTR address);
+
+// A read-only index of the patch table, from an export module's base address
+// and an import name (or ordinal) to the patch entry, consulted by every call
+// to GetProcAddress. It's an open-addressing hash table kept at most a quarter
+// full, so a function which isn't patched is usually decided by one probe. It
+// is published, and retired, the same way as the module range table.
+struct patchindexentry_t {
+    UINT_PTR      moduleBase; // Base address of the export module, or 0 if the slot is empty.
+    UINT32        hash;       // Hash of the module base and import name.
+    LPCSTR        importName; // The name (or ordinal) of the patched import.
+    patchentry_t *patch;      // The patch entry.
+};
+
+struct patchindex_t {
+    patchindex_t      *retired;    // Previously published index, kept until VLD is destroyed.
+    SIZE_T             mask;       // Number of slots, minus one (the number of slots is a power of two).
+    patchindexentry_t  slots [1];  // The slots ("mask" + 1 of them, allocated as needed).
+};
+
+const patchentry_t* FindPatchEntry (const patchindex_t *index, HMODULE module, LPCSTR procname);
+
+// With PrefetchSymbols, the modules whose symbols are to be loaded in the
+// background are queued by base address. Modules which don't fit are left to
+// be loaded on demand.
+#define VLD_PREFETCH_QUEUE 256 // Number of modules which can be queued at once.
+
+// With SymbolServerTimeout, the modules whose symbols took too long to load
+// are queued to be fetched from the symbol servers in the background, with
+// what identifies their PDB there. Modules which don't fit keep their frames
+// shown as offsets.
+#define VLD_SYMBOL_FETCH_QUEUE 32 // Number of modules which can be queued at once.
+
+struct symbolfetch_t {
+    UINT_PTR base;                  // Base address of the module.
+    GUID     pdbGuid;               // Signature of the module's PDB.
+    DWORD    pdbAge;                // Age of the module's PDB.
+    WCHAR    pdbName [MAX_PATH];    // File name of the module's PDB.
+};
+
+#define VLD_EXCLUSION_PAGE_MASK ((UINT_PTR)0xFFF) // Return addresses within a page share the per-thread exclusion cache.
+
+// Blocks allocated by a thread are first collected in the thread's pending
+// buffer, and only inserted into their block maps in batches. A block freed
+// while it's still pending never touches its block map.
+#define VLD_PENDING_BLOCKS 64 // Number of blocks buffered per thread before they are flushed into the block maps.
+
+// With DeferStackCapture, a pending block's frames are kept raw, and only
+// made into an interned CallStack when the block is flushed.
+struct deferredstack_t {
+    UINT32   count;                              // Number of frames.
+    DWORD    hashValue;                          // Hash of the frames.
+    UINT_PTR frames [CALLSTACK_MAX_CAPTURE + 1]; // The frames.
+};
+
+struct pendingblock_t {
+    HANDLE       heap; // Heap from which the block was allocated.
+    LPCVOID      mem;  // Address of the block.
+    blockinfo_t *info; // The block's information, to be inserted into the heap's block map.
+    deferredstack_t *stack; // The block's call stack frames, if its CallStack isn't created yet (or NULL).
+};
+
+// With RemoteFreeQueue, a block freed by another thread than the one which
+// allocated it, and which the freeing thread can't find in its own pending
+// buffer or in the block map, is pushed onto a lock-free queue instead of
+// having every thread's pending buffer searched for it. The queue is drained
+// in batches (see drainRemoteFrees), which search the pending buffers once
+// for all of the blocks.
+#define VLD_REMOTE_FREE_BATCH 256 // Number of queued frees at which the freeing thread drains the queue.
+
+struct remotefree_t {
+    remotefree_t *next;  // Next free in the queue (pushed earlier).
+    HANDLE        heap;  // Heap to which the block was freed.
+    LPCVOID       mem;   // Address of the block.
+    SIZE_T        bound; // Serial number of the next allocation at the time of the free.
+};
+
+// With RecordTrace, each thread appends its allocation events to a ring of its
+// own, without any lock. The trace thread (or the thread itself, if its ring
+// fills up) drains the rings into the trace file under m_allocTraceLock.
+#define VLD_ALLOCTRACE_RING 1024 // Number of events in each thread's ring. A power of two.
+
+struct allocring_t {
+    volatile UINT32   head; // Number of events appended by the owning thread.
+    volatile UINT32   tail; // Number of events drained into the trace file.
+    vldatrace_event_t events [VLD_ALLOCTRACE_RING];
+};
+
+// An entry of the crash snapshot's stack index, which numbers the call stacks
+// written to the snapshot (see startCrashSnapshot).
+struct crashstack_t {
+    const CallStack *stack; // The interned CallStack, or NULL if the entry is free.
+    UINT32           index; // Index of its record in the snapshot.
+};
+
+#define VLD_RECENT_FREES 64 // Frees remembered per thread with RecentFreeRing. A power of two.
+
+// A block a thread freed, remembered so that a later free of the same address
+// can be attributed to it (see checkRecentFrees).
+struct recentfree_t {
+    LPCVOID  mem;
+    HANDLE   heap;
+    SIZE_T   size;
+    UINT_PTR site; // Return address of the heap function which freed it.
+};
+
+struct recentfrees_t {
+    UINT32       next; // Number of frees recorded; entry next % VLD_RECENT_FREES is the oldest.
+    recentfree_t frees [VLD_RECENT_FREES];
+};
+
+// A new block's call stack. It's captured before the block is mapped, so that
+// no lock is held while the stack is walked, and mapBlock or remapBlock then
+// attaches it to the block's information.
+struct capturedstack_t {
+    CallStackRef    callStack; // The interned CallStack, or NULL if its creation is deferred.
+    deferredstack_t frames;    // The frames, if the CallStack's creation is deferred.
+    bool            skipped;   // No call stack was captured (the metadata budget is exhausted).
+    bool            keep;      // A block reallocated in place keeps its own call stack (see ReallocStackPolicy).
+};
+
+// Hot path counters (see VLD_STATISTICS). Each thread keeps its own in its TLS,
+// so counting needs no synchronization; GetStatistics adds them up. Times are
+// in time stamp counter ticks.
+struct vldstats_t {
+    UINT64 stackCaptures;
+    UINT64 stackCaptureTicks;
+    UINT64 mapInserts;
+    UINT64 mapInsertTicks;
+    UINT64 mapErases;
+    UINT64 mapEraseTicks;
+    UINT64 lockAcquires;
+    UINT64 lockWaitTicks;
+    UINT64 exclusionChecks;
+    UINT64 exclusionCheckTicks;
+};
+
+// Latency histograms of the timed hooks (see VLD_HOOK_LATENCY), with the
+// LatencyProfiling option. Like the hot path counters, each thread keeps its
+// own, allocated the first time one of its calls is timed.
+struct latencyhist_t {
+    UINT64 maxTicks [VLD_HOOKS];
+    UINT64 buckets [VLD_HOOKS][VLD_LATENCY_BUCKETS];
+};
+
+// Report generation timing (see VLD_STATISTICS). Reports are generated with the
+// whole heap map lock held, and it is also held to update these counters.
+struct reportstats_t {
+    UINT64 reports;
+    UINT64 reportTicks;
+    UINT64 aggregationTicks;
+    UINT64 stackDumpTicks;
+    UINT64 dataDumpTicks;
+    UINT64 resolves;
+    UINT64 resolveTicks;
+};
+
+// Module load and unload timing. Updated under the loader lock.
+struct modulestats_t {
+    UINT64 attaches;
+    UINT64 attachTicks;
+    UINT64 detaches;
+    UINT64 detachTicks;
+};
+
+// Installation timing, by phase of the constructor.
+struct startupstats_t {
+    UINT64 modules;
+    UINT64 startupTicks;
+    UINT64 configureTicks;
+    UINT64 symbolInitTicks;
+    UINT64 moduleEnumTicks;
+    UINT64 modulePatchTicks;
+};
+
 // Thread local storage structure. Every thread in the process gets its own copy
 // of this structure. Thread specific information, such as the current leak
 // detection status (enabled or disabled) and the address that initiated the
@@ -167,12 +662,50 @@ struct tls_t {
 #define VLD_TLS_DISABLED 0x2 	  //   If set, memory leak detection is disabled for the current thread.
 #define VLD_TLS_ENABLED  0x4 	  //   If set, memory leak detection is enabled for the current thread.
 #define VLD_TLS_UCRT     0x8      //   If set, the current allocation is a UCRT allocation.
+#define VLD_TLS_INLINEHOOK 0x10   //   If set, an inline heap hook is recording a call; heap calls made meanwhile go straight through.
+#define VLD_TLS_CRTBLOCK 0x20     //   If set, the current allocation is a _CRT_BLOCK, used internally by the CRT.
+#define VLD_TLS_REMOTEFREES 0x40  //   If set, the thread is draining the queued remote frees (see drainRemoteFrees).
     UINT32	    oldFlags;         // Thread-local status old flags
     DWORD 	    threadId;         // Thread ID of the thread that owns this TLS structure.
+    WORD        threadIndex;      // Thread table index of the thread ID.
     HANDLE      heap;
     LPVOID      blockWithoutGuard; // Store pointer to block.
     LPVOID      newBlockWithoutGuard;
     SIZE_T      size;
+    slabcache_t blockInfoCache;   // This thread's free blockinfo_t records.
+    SIZE_T      sampleCountdown;  // Allocations (SampleRate) or bytes (SampleBytes) left before the next sampled allocation.
+    UINT32      sampleSeed;       // State of this thread's sampling random number generator.
+    UINT32      smallSampleCount; // Allocations under MinTrackedSize made by this thread (see SmallSampleRate).
+    UINT32      validateCount;    // Frees by this thread which missed the block maps, with ValidateHeapAllocs (see ValidateHeapFreeRate).
+    CriticalSection pendingLock;  // Protects the pending buffer, which other threads flush or search.
+    UINT        pendingCount;     // Number of blocks in the pending buffer.
+    pendingblock_t pending [VLD_PENDING_BLOCKS]; // Blocks allocated by this thread and not mapped yet, oldest first.
+    deferredstack_t *deferred;    // Frames of the pending blocks (VLD_PENDING_BLOCKS of them, allocated on first use).
+    BYTE        deferredFree [VLD_PENDING_BLOCKS]; // Indices of the unused entries of "deferred".
+    UINT        deferredFreeCount; // Number of unused entries.
+    UINT_PTR    excludedPage;     // Page of the last return address checked by IsExcludedModule.
+    UINT32      excludedImage;    // Module image of that address, or MODULEIMAGE_NONE if it isn't known.
+    LONG        excludedEpoch;    // Epoch of the module range table the last check was made with (0 if none).
+    BOOL        excluded;         // Result of the last check.
+    UINT32      traceFrames;      // Stack trace policy of the module of the last check (see modulerange_t).
+    UINT32      traceWalk;
+    WORD        tags [VLD_TAG_DEPTH]; // IDs of the allocation tags pushed by this thread, innermost last.
+    UINT        tagDepth;         // Number of tags pushed and not popped yet (may exceed VLD_TAG_DEPTH).
+    vldstats_t  stats;            // This thread's hot path counters.
+    SIZE_T      serialNext;       // Next serial number of the block of them this thread took (see nextSerial).
+    SIZE_T      serialEnd;        // End of that block.
+    LONG        serialEpoch;      // m_serialEpoch when the block was taken.
+    SIZE_T      bytesDelta;       // Bytes this thread allocated less those it freed, not added to m_curAlloc yet (two's complement).
+    SIZE_T      totalDelta;       // Bytes this thread allocated, not added to m_totalAlloc yet (two's complement).
+    allocring_t *allocTrace;      // This thread's allocation trace events (allocated on first use, see RecordTrace).
+    latencyhist_t *latency;       // This thread's hook latencies (allocated on first use, see recordLatency).
+    recentfrees_t *recentFrees;   // The blocks this thread freed last, with RecentFreeRing (allocated on first use).
+    stackcacheslot_t stackCache [CALLSTACK_CACHE_SLOTS]; // The call stacks this thread interned last (see CallStackTable::InternFrames).
+    UINT_PTR    shadowStackLow;   // This thread's CET shadow stack region, as last found by captureShadow (0 if not yet).
+    UINT_PTR    shadowStackHigh;
+    volatile LONG rangeEpoch;     // Epoch of the oldest module range table this thread may be reading (0 if none).
+    UINT        rangeDepth;       // Nesting depth of this thread's ModuleRangesReaders.
+    tls_t      *nextFree;         // Next structure in the list of those left by exited threads (see retireTls).
 };
 
 // Allocation state:
@@ -180,15 +713,44 @@ struct tls_t {
 // 2. HeapAlloc set tls->heap, tls->blockWithoutGuard, tls->newBlockWithoutGuard and tls->size
 // 3. Allocation function reset tls data, map block and capture callstack to tls->blockWithoutGuard
 
+// readTlsSlot - Reads a TLS slot straight out of the calling thread's TEB.
+//   This is what TlsGetValue does, without the call and the SetLastError.
+//   Only the first TLS_MINIMUM_AVAILABLE slots are stored in the TEB itself;
+//   the expansion slots are left to TlsGetValue.
+//
+//  - index (IN): The TLS index, as returned by TlsAlloc.
+//
+//  Return Value:
+//
+//    Returns the value stored in the slot.
+//
+static __forceinline LPVOID readTlsSlot (DWORD index)
+{
+    if (index < TLS_MINIMUM_AVAILABLE) {
+#if defined(_M_X64)
+        return (LPVOID)__readgsqword(0x1480 + index * sizeof(LPVOID)); // TEB.TlsSlots
+#elif defined(_M_IX86)
+        return (LPVOID)__readfsdword(0xE10 + index * sizeof(LPVOID));  // TEB.TlsSlots
+#elif defined(_M_ARM64)
+        return (LPVOID)__readx18qword(0x1480 + index * sizeof(LPVOID)); // TEB.TlsSlots
+#endif
+    }
+    return TlsGetValue(index);
+}
+
 // The TlsSet allows VLD to keep track of all thread local storage structures
-// allocated in the process.
-typedef Map<DWORD,tls_t*> TlsMap;
+// allocated in the process. It's only accessed under m_tlsLock.
+typedef Map<DWORD,tls_t*,NoLock> TlsMap;
 
 class CaptureContext {
 public:
     CaptureContext(void* func, context_t& context, BOOL debug = FALSE, BOOL ucrt = FALSE);
+    CaptureContext(void* func, context_t& context, tls_t* tls, BOOL debug = FALSE, BOOL ucrt = FALSE);
     ~CaptureContext();
     __forceinline void Set(HANDLE heap, LPVOID mem, LPVOID newmem, SIZE_T size);
+    void SetBatch(HANDLE heap, LPVOID const *blocks, SIZE_T count, SIZE_T size);
+    void SetBlockType(int type);
+    static bool RecordNested(tls_t* tls, HANDLE heap, LPVOID mem, LPVOID newmem, SIZE_T size);
 private:
     // Disallow certain operations
     CaptureContext();
@@ -200,6 +762,10 @@ private:
 private:
     tls_t *m_tls;
     BOOL m_bFirst;
+    BOOL m_crt;          // Whether the context was created by a CRT thunk (timed as VLD_HOOK_CRT).
+    UINT64 m_startTicks; // Time stamp counter when the context was created, with LatencyProfiling (or 0).
+    LPVOID const *m_batch; // Blocks allocated at once, sharing one call stack (see SetBatch), or NULL.
+    SIZE_T m_batchCount;   // Number of blocks in m_batch.
     const context_t& m_context;
 };
 
@@ -235,6 +801,13 @@ class VisualLeakDetector : public IMalloc
 {
     friend class CallStack;
     friend class CaptureContext;
+    friend class LatencyTimer;
+    friend class SymbolCache;
+    friend class CrtStartupRanges;
+    friend class EtwHeapSession;
+    friend class ModuleRangesReader;
+    template<int CRTVersion, bool debug> friend class CrtPatch;
+    template<int CRTVersion, bool debug> friend class MfcPatch;
 public:
     VisualLeakDetector();
     ~VisualLeakDetector();
@@ -259,9 +832,17 @@ public:
     void GlobalEnableLeakDetection ();
 
     VOID RefreshModules();
+    BOOL ModuleLoadsNotified() const { return m_dllNotificationCookie != NULL; }
+    UINT32 GetSymbolLevel() const { return m_symbolLevel; }
     SIZE_T GetLeaksCount();
     SIZE_T GetThreadLeaksCount(DWORD threadId);
+    SIZE_T GetModuleLeaksCount(HMODULE module);
     SIZE_T ReportLeaks();
+    SIZE_T ReportLeaksAsync(VLD_REPORT_CALLBACK callback, LPVOID context);
+    SIZE_T ReportLeaksOlderThan(UINT32 age);
+    SIZE_T ReportPeak();
+    SIZE_T ReportChurn();
+    SIZE_T ReportReallocStorms(SIZE_T minReallocs);
     SIZE_T ReportThreadLeaks(DWORD threadId);
     VOID MarkAllLeaksAsReported();
     VOID MarkThreadLeaksAsReported(DWORD threadId);
@@ -275,6 +856,30 @@ public:
     VOID SetModulesList(CONST WCHAR *modules, BOOL includeModules);
     bool GetModulesList(WCHAR *modules, UINT size);
     int ResolveCallstacks();
+    SIZE_T TakeSnapshot();
+    SIZE_T DiffSnapshots(SIZE_T from, SIZE_T to, UINT32 limit = (UINT32)-1);
+    VOID PushTag(LPCSTR tag);
+    VOID PopTag();
+    SIZE_T Compact();
+    VOID TrackAlloc(LPCVOID pool, LPVOID const *blocks, SIZE_T count, SIZE_T size, context_t &context);
+    VOID TrackFree(LPCVOID pool, LPVOID const *blocks, SIZE_T count, context_t &context);
+    SIZE_T UntrackRange(LPCVOID pool, LPCVOID base, SIZE_T size);
+    VOID GetStatistics(VLD_STATISTICS *statistics);
+    VOID GetMemoryUsage(VLD_MEMORY_USAGE *usage);
+    SIZE_T GetSiteStatistics(VLD_SITE_STATISTICS *sites, SIZE_T count, BOOL byAllocations);
+    SIZE_T GetHeapSizeClasses(VLD_HEAP_SIZE_CLASSES *heaps, SIZE_T count);
+    SIZE_T GetModuleStatistics(VLD_MODULE_STATISTICS *modules, SIZE_T count);
+    VOID GetCapturePolicy(VLD_CAPTURE_POLICY *policy);
+    VOID SetCapturePolicy(const VLD_CAPTURE_POLICY *policy);
+    BOOL GetMiniDumpStream(VLD_MINIDUMP_STREAM *stream);
+    VOID FreeMiniDumpStream(VLD_MINIDUMP_STREAM *stream);
+    BOOL WriteMiniDump(HANDLE file, UINT dumpType, PEXCEPTION_POINTERS exceptionPointers);
+    BOOL WriteHeapProfile(LPCWSTR path, BOOL symbolize);
+    SIZE_T EnumerateLeaks(VLD_LEAK_CALLBACK callback, LPVOID context, UINT flags);
+    BOOL ResolveLeakFrame(const VLD_LEAK *leak, UINT frame, VLD_FRAME_INFO *info);
+    VOID EnumLeaksBegin(VLD_LEAK_CURSOR *cursor, UINT flags);
+    SIZE_T EnumLeaksNext(VLD_LEAK_CURSOR *cursor, VLD_LEAK_RECORD *batch, SIZE_T count);
+    BOOL FindContainingBlock(LPCVOID address, VLD_LEAK_RECORD *block);
     const wchar_t* GetAllocationResolveResults(void* alloc, BOOL showInternalFrames);
 
     static NTSTATUS __stdcall _LdrLoadDll (LPWSTR searchpath, PULONG flags, unicodestring_t *modulename,
@@ -283,6 +888,7 @@ public:
         PHANDLE modulehandle);
     static FARPROC __stdcall _RGetProcAddress(HMODULE module, LPCSTR procname);
     static FARPROC __stdcall _RGetProcAddressForCaller(HMODULE module, LPCSTR procname, LPVOID caller);
+    static FARPROC patchedProcAddress (HMODULE module, LPCSTR procname, FARPROC original);
 
     static NTSTATUS NTAPI _LdrGetDllHandle(IN PWSTR DllPath OPTIONAL, IN PULONG DllCharacteristics OPTIONAL, IN PUNICODE_STRING DllName, OUT PVOID *DllHandle OPTIONAL);
     static NTSTATUS NTAPI _LdrGetProcedureAddress(IN PVOID BaseAddress, IN PANSI_STRING Name, IN ULONG Ordinal, OUT PVOID * ProcedureAddress);
@@ -295,39 +901,331 @@ private:
     // Private leak detection functions - see each function definition for details.
     ////////////////////////////////////////////////////////////////////////////////
     VOID   attachToLoadedModules (ModuleSet *newmodules);
+    VOID   attachModule (PCWSTR modulepath, UINT_PTR modulebase, ULONG modulesize);
+    VOID   forgetModule (UINT_PTR modulebase);
+    VOID   loadModuleSymbols (const moduleinfo_t &moduleinfo, CriticalSectionLocker<DbgHelp> &locker);
+    bool   loadSymbolsForAddress (SIZE_T address, CriticalSectionLocker<DbgHelp> &locker);
+    bool   symbolLoadTimedOut (CriticalSectionLocker<DbgHelp> &locker);
+    VOID   symbolsFetched (UINT_PTR modulebase, BOOL fetched, CriticalSectionLocker<DbgHelp> &locker);
     UINT32 getModuleState(ModuleSet::Iterator& it, UINT32 &moduleFlags);
     LPWSTR buildSymbolSearchPath();
+    static VOID initializeSymbolHandler ();
     BOOL GetIniFilePath(LPTSTR lpPath, SIZE_T cchPath);
     VOID   configure ();
+    VOID   loadTracePolicies (LPWSTR policies);
+    VOID   loadCapturePolicy (LPCWSTR inipath, capturepolicy_t &policy);
+    VOID   publishCapturePolicy (const capturepolicy_t &policy);
+    VOID   releaseCapturePolicies ();
+    VOID   applyTracePolicies (LPWSTR policies);
+    VOID   reloadCapturePolicy ();
+    WORD   internTag (LPCSTR tag);
+    CallStack* callerSite (UINT_PTR caller);
+    // The innermost allocation tag pushed by a thread, or 0.
+    static WORD currentTag (const tls_t *tls)
+    {
+        return (tls->tagDepth == 0) ? 0 : tls->tags[min(tls->tagDepth, (UINT)VLD_TAG_DEPTH) - 1];
+    }
     BOOL   enabled ();
-    SIZE_T eraseDuplicates (const BlockMap::Iterator &element, Set<blockinfo_t*> &aggregatedLeak);
+    tls_t* enabledTls ();
+    // Whether the calling thread may be tracking allocations. The allocation
+    // hooks test this before anything else, so that while detection is
+    // disabled, for every thread or for the caller, allocating costs a read
+    // of m_tracking and of the TLS flags. Threads which haven't settled on
+    // a state yet are left to enabledTls.
+    bool   trackingAllocs () const
+    {
+        if (!(m_tracking & VLD_TRACKING_ALLOCS))
+            return false;
+        const tls_t *tls = (const tls_t*)readTlsSlot(m_tlsIndex);
+        return (tls == NULL) || !(tls->flags & VLD_TLS_DISABLED);
+    }
+    // Whether frees are to be looked up: nothing is until a block is tracked.
+    bool   trackingFrees () const
+    {
+        return (m_tracking & VLD_TRACKING_BLOCKS) != 0;
+    }
     tls_t* getTls ();
-    VOID   mapBlock (HANDLE heap, LPCVOID mem, SIZE_T size, bool crtalloc, bool ucrt, DWORD threadId, blockinfo_t* &pblockInfo);
-    VOID   mapHeap (HANDLE heap);
+    tls_t* initTls ();
+    VOID   retireTls ();
+    WORD   registerThread (DWORD threadId);
+    WORD   findThreadIndex (DWORD threadId);
+    DWORD  getThreadId (const blockinfo_t *info) const
+    {
+        return m_threadTable[info->threadIndex / VLD_THREAD_TABLE_PAGE][info->threadIndex % VLD_THREAD_TABLE_PAGE];
+    }
+    // getThreadName - Obtains the description of a thread, as set with
+    //   SetThreadDescription, or NULL if it has none (see nameThread).
+    LPCWSTR getThreadName (WORD threadIndex) const
+    {
+        return m_threadNames[threadIndex / VLD_THREAD_TABLE_PAGE][threadIndex % VLD_THREAD_TABLE_PAGE];
+    }
+    VOID   nameThread (WORD threadIndex, HANDLE thread);
+    VOID   nameRunningThreads ();
+    threadleaks_t& getThreadLeaks (WORD threadIndex) const
+    {
+        return m_threadLeaks[threadIndex / VLD_THREAD_TABLE_PAGE][threadIndex % VLD_THREAD_TABLE_PAGE];
+    }
+    // Whether a block has been reported, or marked as reported, individually
+    // or by one of the reported marks. The caller must hold its shard.
+    bool   isReported (const blockinfo_t *info) const
+    {
+        return info->reported || (info->serialNumber < m_reportedMark) ||
+            (info->serialNumber < getThreadLeaks(info->threadIndex).reportedMark);
+    }
+    VOID   mapBlock (HANDLE heap, LPCVOID mem, SIZE_T size, bool crtalloc, bool ucrt, WORD threadIndex, WORD image,
+        capturedstack_t &stack);
+    VOID   mapBlocks (tls_t *tls, LPVOID const *blocks, SIZE_T count);
+    VOID   mapHeap (HANDLE heap, UINT32 flags = 0x0);
+    VOID   mapHeapOnce (HANDLE heap);
+    // Whether blocks allocated from a heap go untracked (see HeapsToIgnore).
+    // Heaps whose bit in m_ignoredHeaps is clear can't be ignored, so this
+    // rules out almost every heap without touching the heap map.
+    bool   isIgnoredHeap (HANDLE heap) const
+    {
+        UINT32 bit = ignoredHeapBit(heap);
+        if (!(m_ignoredHeaps[bit / 32] & (1L << (bit % 32))))
+            return false;
+        return isIgnoredHeapMapped(heap);
+    }
+    bool   isIgnoredHeapMapped (HANDLE heap) const;
+    bool   isIgnoredHeapCreator (UINT_PTR returnaddress) const;
+    static UINT32 ignoredHeapBit (HANDLE heap)
+    {
+        // Heap handles are 64K aligned, so the low bits carry nothing.
+        return (((UINT32)((UINT_PTR)heap >> 16) * 2654435761U) >> 24) & (IGNOREDHEAPBITS - 1);
+    }
+    bool   insertBlock (HANDLE heap, LPCVOID mem, blockinfo_t *blockinfo, slabcache_t &cache);
+    VOID   flushPendingBlocks (tls_t *tls, slabcache_t &cache);
+    VOID   flushAllPendingBlocks ();
+    bool   cancelPendingBlock (tls_t *tls, HANDLE heap, LPCVOID mem, slabcache_t &cache, SIZE_T *size = NULL);
+    VOID   dropPendingBlock (tls_t *tls, UINT index, slabcache_t &cache, SIZE_T *size = NULL);
+    bool   cancelAnyPendingBlock (HANDLE heap, LPCVOID mem, slabcache_t &cache, SIZE_T *size = NULL);
+    VOID   queueRemoteFree (HANDLE heap, LPCVOID mem);
+    VOID   rememberFree (tls_t *tls, HANDLE heap, LPCVOID mem, SIZE_T size, const context_t &context);
+    bool   checkRecentFrees (tls_t *tls, HANDLE heap, LPCVOID mem, const context_t &context);
+    VOID   drainRemoteFrees ();
+    bool   deferStackCapture () const;
+    VOID   deferCallStack (tls_t *tls, pendingblock_t &pending, const deferredstack_t &frames);
+    VOID   releaseDeferredStack (tls_t *tls, pendingblock_t &pending);
+    bool   eraseBlock (HANDLE heap, LPCVOID mem, slabcache_t &cache, bool &heapMapped, SIZE_T *size = NULL,
+        SIZE_T before = (SIZE_T)-1);
     VOID   remapBlock (HANDLE heap, LPCVOID mem, LPCVOID newmem, SIZE_T size,
-        bool crtalloc, bool ucrt, DWORD threadId, blockinfo_t* &pblockInfo, const context_t &context);
+        bool crtalloc, bool ucrt, WORD threadIndex, WORD image, capturedstack_t &stack, const context_t &context);
+    VOID   captureStack (tls_t *tls, const context_t &context, capturedstack_t &stack);
+    VOID   captureKeptStack (tls_t *tls, const context_t &context, capturedstack_t &stack);
+    VOID   internCallStack (capturedstack_t &stack);
+    // The serial number of a new block. Each thread takes VLD_SERIAL_BLOCK of
+    // them at once, so that allocating seldom touches m_requestCurr; what's
+    // left of a block taken before the last serialMark is given up.
+    SIZE_T nextSerial (tls_t *tls)
+    {
+        if ((tls->serialNext == tls->serialEnd) || (tls->serialEpoch != m_serialEpoch))
+            takeSerialBlock(tls);
+        return tls->serialNext++;
+    }
+    VOID   takeSerialBlock (tls_t *tls);
+    SIZE_T serialMark ();
+    VOID   recordAlloc (SIZE_T oldsize, SIZE_T newsize);
+    VOID   recordFree (const blockinfo_t *info);
+    VOID   flushAllocTotals (tls_t *tls);
+    VOID   readAllocTotals (SIZE_T &allocations, SIZE_T &current, SIZE_T &peak, SIZE_T &total);
+    VOID   recordSiteAlloc (const blockinfo_t *info);
+    VOID   recordSiteFree (const blockinfo_t *info);
+    VOID   recordSiteRealloc (CallStack *callStack, SIZE_T oldsize, SIZE_T newsize);
+    VOID   recordSiteResize (const blockinfo_t *info, SIZE_T oldsize);
+    // The call stack a block which keeps its own is counted as reallocated at.
+    CallStack* reallocSite (const blockinfo_t *info, const capturedstack_t &stack) const
+    {
+        if ((m_reallocStackPolicy == VLD_REALLOC_STACK_BOTH) && stack.callStack)
+            return stack.callStack.get();
+        return info->callStack.get();
+    }
+    VOID   countShortLivedBlock (HANDLE heap, LPCVOID mem, SIZE_T size);
     VOID   reportConfig ();
+    VOID   checkMetadataBudget ();
+    VOID   reportDegradation ();
+    VOID   checkCompaction ();
+    VOID   compactBlockMaps ();
+    lockprofile_t* lockProfile (UINT lock);
+    double profileTicksPerMs () const;
+    VOID   reportLockProfiles ();
+    VOID   recordLatency (tls_t *tls, UINT hook, UINT64 ticks);
+    VOID   reportLatencyProfiles ();
+    VOID   reportMemoryUsage ();
+    // Whether an address is within VLD's own image. Unlike GetCallingModule,
+    // this makes no system call.
+    bool   isVldAddress (UINT_PTR address) const
+    {
+        return (address - (UINT_PTR)m_vldBase) < m_vldSize;
+    }
+    bool   sampling () const
+    {
+        const capturepolicy_t *policy = m_capturePolicy;
+        return (policy->sampleRate > 1) || (policy->sampleBytes != 0) ||
+            ((policy->minTrackedSize != 0) && (policy->smallSampleRate > 1));
+    }
+    // Whether no allocation of this size is ever tracked (MinTrackedSize,
+    // MaxTrackedSize). The allocation hooks test this before anything else.
+    bool   untrackedSize (SIZE_T size) const
+    {
+        const capturepolicy_t *policy = m_capturePolicy;
+        return ((size < policy->minTrackedSize) && (policy->smallSampleRate == 0)) ||
+            ((policy->maxTrackedSize != 0) && (size > policy->maxTrackedSize));
+    }
+    bool   sampleAllocation (tls_t *tls, SIZE_T size);
+    SIZE_T nextSampleInterval (tls_t *tls);
+    double sampleWeight (SIZE_T size) const;
     static bool   isDebugCrtAlloc(LPCVOID block, blockinfo_t* info);
+    bool   isSuppressed (const blockinfo_t* info) const;
     SIZE_T reportHeapLeaks (HANDLE heap);
-    static int    getCrtBlockUse (LPCVOID block, bool ucrt);
-    static size_t getCrtBlockSize(LPCVOID block, bool ucrt);
-    SIZE_T getLeaksCount (heapinfo_t* heapinfo, DWORD threadId = (DWORD)-1);
-    SIZE_T reportLeaks(heapinfo_t* heapinfo, bool &firstLeak, Set<blockinfo_t*> &aggregatedLeaks, DWORD threadId = (DWORD)-1);
-    VOID   markAllLeaksAsReported (heapinfo_t* heapinfo, DWORD threadId = (DWORD)-1);
-    VOID   unmapBlock (HANDLE heap, LPCVOID mem, const context_t &context);
+    VOID   deferHeapLeaks (HANDLE heap);
+    VOID   reportDeferredHeapLeaks ();
+    VOID   loadBaseline ();
+    VOID   tallyBaselineSites (class BaselineTally &tally);
+    VOID   compareWithBaseline ();
+    VOID   writeBaseline ();
+    VOID   loadSizingProfile ();
+    VOID   writeSizingProfile ();
+    SIZE_T blockMapReserve () const;
+    VOID   noteHeapSizing (const heapinfo_t *heapinfo);
+    VOID   noteModuleSizing (const ModuleSet *modules);
+    static int    getCrtBlockUse (LPCVOID block, const blockinfo_t* info);
+    static size_t getCrtBlockSize(LPCVOID block, const blockinfo_t* info);
+    static long   getCrtBlockRequest(LPCVOID block, const blockinfo_t* info);
+    VOID   countBlock (LPCVOID block, blockinfo_t* info);
+    VOID   uncountBlock (const blockinfo_t* info);
+    VOID   markReported (blockinfo_t* info);
+    VOID   classifyLeaks ();
+    SIZE_T countLeaks (DWORD threadId);
+    SIZE_T reportLeaks(heapinfo_t* heapinfo, bool &firstLeak, DuplicateIndex &duplicates, DWORD threadId = (DWORD)-1, SIZE_T limit = (SIZE_T)-1, LeakSink *sink = NULL);
+    SIZE_T reportLeakSummary (DWORD threadId = (DWORD)-1);
+    SIZE_T reportLeaksBefore (SIZE_T serial);
+    VOID   recordTime (ULONGLONG now, SIZE_T serial);
+    ULONGLONG allocationTime (SIZE_T serial);
+    SIZE_T serialAllocatedBefore (ULONGLONG time);
+    VOID   snapshotPeak (SIZE_T current);
+    VOID   releasePeak (peaksite_t *sites, SIZE_T count);
+    VOID   printLeak (const leakentry_t &leak, bool &firstLeak, reportstats_t &stats);
+    SIZE_T reportLeaksInParallel ();
+    VOID   formatReportChunks (reportjob_t *job);
+    VOID   symbolizeInParallel (const leakentry_t *leaks, SIZE_T leakCount);
+    VOID   resolveSymbolChunks (symboljob_t *job);
+    VOID   startReportThreads ();
+    VOID   stopReportThreads ();
+    bool   isReportThread (DWORD threadId) const;
+    bool   isVLDThread (DWORD threadId) const;
+    VOID   scanReachability ();
+    VOID   gatherScanRoots (reachscan_t *scan);
+    VOID   joinScan (reachscan_t *scan);
+    VOID   markScan (reachscan_t *scan);
+    reachability_e reachabilityOf (LPCVOID address) const;
+    VOID   releaseReachability ();
+    VOID   stopAsyncReport ();
+    VOID   unmapBlock (HANDLE heap, LPCVOID mem, const context_t &context, SIZE_T *size = NULL);
     VOID   unmapHeap (HANDLE heap);
-    int    resolveStacks(heapinfo_t* heapinfo);
+    VOID   walkHeap (HANDLE heap);
+    VOID   attachTraceDatabaseStacks ();
+    VOID   walkHeaps ();
+    bool   getLeakedBlock (LPCVOID block, blockinfo_t* info, LPCVOID &address, SIZE_T &size);
+    VOID   copyLeakRecord (HANDLE heap, LPCVOID address, SIZE_T size, const blockinfo_t *info, bool frames,
+        VLD_LEAK_RECORD &record);
+    SIZE_T writeBinaryReport ();
+    SIZE_T writeStructuredReport (DWORD threadId);
+    VOID   writeStructuredStack (class StructuredWriter &writer, UINT32 id, CallStack *stack);
+    VOID   writeFoldedStack (class StructuredWriter &writer, CallStack *stack, double bytes);
+    UINT32 selectStructuredFrames (CallStack *stack, CriticalSectionLocker<DbgHelp> &locker, UINT32 *frames,
+        const symbolinfo_t **symbols);
+    VOID   startLiveView ();
+    VOID   stopLiveView ();
+    VOID   publishLiveView ();
+    VOID   startPerfCounters ();
+    VOID   stopPerfCounters ();
+    VOID   publishPerfCounters ();
+    VOID   trackVirtualRegion (UINT_PTR base, SIZE_T size, SIZE_T committed, bool view, const context_t &context);
+    VOID   trackVirtualAlloc (HANDLE process, LPCVOID requested, LPCVOID base, SIZE_T size, ULONG type,
+        const context_t &context);
+    VOID   untrackVirtualFree (HANDLE process, LPCVOID base, SIZE_T size, ULONG type);
+    VOID   untrackVirtualView (HANDLE process, LPCVOID address);
+    VOID   forgetVirtualRegion (vregion_t *region);
+    SIZE_T reportVirtualRegions ();
+    VOID   releaseVirtualRegions ();
+    VOID   startTelemetry ();
+    VOID   stopTelemetry ();
+    VOID   sampleTelemetry ();
+    VOID   startAllocTrace ();
+    VOID   stopAllocTrace ();
+    VOID   recordAllocTrace (tls_t *tls, UINT8 op, HANDLE heap, LPCVOID mem, SIZE_T size, const CallStack *stack);
+    VOID   drainAllocRing (allocring_t *ring);
+    VOID   drainAllocRings ();
+    bool   appendAllocTrace (const VOID *data, SIZE_T size);
+    bool   mapAllocTraceWindow (UINT64 offset);
+    VOID   startSymbolPrefetch ();
+    VOID   stopSymbolPrefetch ();
+    VOID   startSymbolFetch ();
+    VOID   stopSymbolFetch ();
+    VOID   startIdleResolve ();
+    VOID   stopIdleResolve ();
+    StackSet* resolveIdleStacks (StackSet *seen);
+    VOID   startGrowthWatchdog ();
+    VOID   stopGrowthWatchdog ();
+    VOID   startHotModuleWatch ();
+    VOID   stopHotModuleWatch ();
+    VOID   startIniWatch ();
+    VOID   stopIniWatch ();
+    VOID   startCrashSnapshot ();
+    VOID   stopCrashSnapshot ();
+    VOID   writeCrashSnapshot ();
+    VOID   collectCrashSnapshot (crashwriter_t &writer, vldbin_header_t &header);
+    UINT32 crashStackIndex (const CallStack *stack, UINT32 stackCount, bool add, bool &added);
+    hotmodule_t* sampleHotModules (SIZE_T &count);
+    VOID   excludeHotModules (hotmodule_t *modules, SIZE_T count, SIZE_T from, SIZE_T to);
+    // getModuleCounters - The counters of a module image which is, or was, in
+    //   the module range table.
+    modulecounters_t& getModuleCounters (UINT32 image) const
+    {
+        return m_moduleCounters[image / MODULEIMAGES_PAGE_SIZE][image % MODULEIMAGES_PAGE_SIZE];
+    }
+    // countModuleAllocation - Counts an allocation made from a module image.
+    VOID   countModuleAllocation (UINT32 image, SIZE_T size)
+    {
+        modulecounters_t &counters = getModuleCounters(image);
+        InterlockedIncrement64(&counters.allocations);
+        InterlockedExchangeAdd64(&counters.bytes, (LONG64)size);
+    }
+    VOID   triggerGrowthReport (SIZE_T current);
+    VOID   prefetchSymbols (const ModuleSet *modules, const ModuleSet *known);
+    VOID   collectStacks (heapinfo_t* heapinfo, StackSet &stacks);
 
     // Static functions (callbacks)
     static BOOL __stdcall addLoadedModule (PCWSTR modulepath, DWORD64 modulebase, ULONG modulesize, PVOID context);
     static BOOL __stdcall detachFromModule (PCWSTR modulepath, DWORD64 modulebase, ULONG modulesize, PVOID context);
+    static VOID NTAPI dllNotification (ULONG reason, const ldrdllnotificationdata_t *data, PVOID context);
+    static DWORD WINAPI liveViewProc (LPVOID param);
+    static DWORD WINAPI perfCountersProc (LPVOID param);
+    static DWORD WINAPI telemetryProc (LPVOID param);
+    static DWORD WINAPI allocTraceProc (LPVOID param);
+    static DWORD WINAPI symbolPrefetchProc (LPVOID param);
+    static DWORD WINAPI symbolFetchProc (LPVOID param);
+    static DWORD WINAPI idleResolveProc (LPVOID param);
+    static BOOL CALLBACK symbolLoadCallback (HANDLE process, ULONG action, ULONG64 data, ULONG64 context);
+    static DWORD WINAPI growthWatchdogProc (LPVOID param);
+    static DWORD WINAPI hotModuleProc (LPVOID param);
+    static DWORD WINAPI iniWatchProc (LPVOID param);
+    static LONG CALLBACK crashVectoredHandler (PEXCEPTION_POINTERS exceptioninfo);
+    static LONG WINAPI crashUnhandledFilter (PEXCEPTION_POINTERS exceptioninfo);
+    static DWORD WINAPI reportThreadProc (LPVOID param);
+    static DWORD WINAPI asyncReportProc (LPVOID param);
+    static BOOL CALLBACK initIMalloc (PINIT_ONCE initonce, PVOID param, PVOID *context);
 
     // Utils
-    static bool isModuleExcluded (UINT_PTR returnaddress);
+    static BOOL isModuleExcluded (HMODULE module);
     blockinfo_t* findAllocedBlock(LPCVOID, __out HANDLE& heap);
-    blockinfo_t* getAllocationBlockInfo(void* alloc);
+    CallStack* getAllocationCallStack(void* alloc);
     void setupReporting();
+    void setupReportPipe();
+    void closeReportPipe();
     void checkInternalMemoryLeaks();
+    VOID releaseMetadata ();
     bool waitForAllVLDThreads();
 
     ////////////////////////////////////////////////////////////////////////////////
@@ -353,6 +1251,24 @@ private:
     static BYTE     __stdcall _RtlFreeHeap (HANDLE heap, DWORD flags, LPVOID mem);
     static LPVOID   __stdcall _RtlReAllocateHeap (HANDLE heap, DWORD flags, LPVOID mem, SIZE_T size);
 
+    // ntdll heap function detours, with InlineHeapHooks
+    static LPVOID   __stdcall _RtlAllocateHeapInline (HANDLE heap, DWORD flags, SIZE_T size);
+    static BYTE     __stdcall _RtlFreeHeapInline (HANDLE heap, DWORD flags, LPVOID mem);
+    static LPVOID   __stdcall _RtlReAllocateHeapInline (HANDLE heap, DWORD flags, LPVOID mem, SIZE_T size);
+
+    // Virtual memory replacement functions, with TrackVirtualMemory
+    static NTSTATUS NTAPI _NtAllocateVirtualMemory (HANDLE process, PVOID *base, ULONG_PTR zerobits, PSIZE_T size,
+        ULONG type, ULONG protect);
+    static NTSTATUS NTAPI _NtAllocateVirtualMemoryEx (HANDLE process, PVOID *base, PSIZE_T size, ULONG type,
+        ULONG protect, PVOID parameters, ULONG parametercount);
+    static NTSTATUS NTAPI _NtFreeVirtualMemory (HANDLE process, PVOID *base, PSIZE_T size, ULONG type);
+    static NTSTATUS NTAPI _NtMapViewOfSection (HANDLE section, HANDLE process, PVOID *base, ULONG_PTR zerobits,
+        SIZE_T commitsize, PLARGE_INTEGER offset, PSIZE_T viewsize, ULONG inherit, ULONG type, ULONG protect);
+    static NTSTATUS NTAPI _NtMapViewOfSectionEx (HANDLE section, HANDLE process, PVOID *base, PLARGE_INTEGER offset,
+        PSIZE_T viewsize, ULONG type, ULONG protect, PVOID parameters, ULONG parametercount);
+    static NTSTATUS NTAPI _NtUnmapViewOfSection (HANDLE process, PVOID base);
+    static NTSTATUS NTAPI _NtUnmapViewOfSectionEx (HANDLE process, PVOID base, ULONG flags);
+
     // COM IAT replacement functions
     static HRESULT __stdcall _CoGetMalloc (DWORD context, LPMALLOC *imalloc);
     static LPVOID  __stdcall _CoTaskMemAlloc (SIZE_T size);
@@ -362,16 +1278,101 @@ private:
     // Private data
     ////////////////////////////////////////////////////////////////////////////////
     WCHAR                m_forcedModuleList [MAXMODULELISTLENGTH]; // List of modules to be forcefully included in leak detection.
+    WCHAR                m_ignoredHeapModules [MAXMODULELISTLENGTH]; // List of modules whose own heaps aren't tracked.
+    tracepolicy_t        m_tracePolicies [VLD_MAX_TRACE_POLICIES]; // Per-module stack trace policies (see ModuleTracePolicy).
+    UINT32               m_tracePolicyCount;
+    CriticalSection      m_tagLock;           // Protects the allocation tag table.
+    LPWSTR               m_tagNames [VLD_MAX_TAGS]; // Names of the allocation tags, by ID (ID 0 is no tag).
+    UINT32               m_tagCount;          // Tag IDs in use, including 0.
+    HashMap<UINT_PTR, WORD> *m_tagIds;        // Tag IDs by the address of the name they were pushed with.
+    CriticalSection      m_callerSiteLock;    // Protects the caller site cache.
+    HashMap<UINT_PTR, CallStack*> *m_callerSites; // One-frame call stacks by caller, for StackWalkMethod = caller. Each holds a reference.
+    bool                 m_sizeClasses;       // Whether heaps keep size class histograms (see SizeClassHistogram).
+    bool                 m_addressIndex;      // Whether heaps keep their blocks in address order too (see AddressIndex).
+    bool                 m_deferHeapReports;  // Whether the leaks of destroyed heaps are copied, and reported later (see DeferHeapDestroyReport).
+    CriticalSection      m_deferredHeapLock;  // Protects the leaks of destroyed heaps.
+    deferredheap_t      *m_deferredHeaps;     // The leaks of heaps destroyed since the last report, latest first.
+    SIZE_T               m_peakStep;          // Bytes the high-water mark must grow by between peak snapshots (0 takes none).
+    SIZE_T volatile      m_nextPeakSnapshot;  // Bytes in use at which the next peak snapshot is taken.
+    CriticalSection      m_peakLock;          // Protects the last peak snapshot.
+    peaksite_t          *m_peakSites;         // The allocation sites of the last peak snapshot, or NULL.
+    SIZE_T               m_peakSiteCount;
+    SIZE_T               m_peakBytes;         // Bytes in use when the last peak snapshot was taken.
+    volatile LONG        m_ignoredHeaps [IGNOREDHEAPBITS / 32]; // Bits of the ignored heaps, by ignoredHeapBit. Never cleared.
     HeapMap             *m_heapMap;           // Map of all active heaps in the process.
+    SlabAllocator<blockinfo_t> m_blockInfoPool; // Allocates the blockinfo_t records stored in the block maps.
     IMalloc             *m_iMalloc;           // Pointer to the system implementation of IMalloc.
 
-    SIZE_T               m_requestCurr;       // Current request number.
+    SIZE_T               m_requestCurr;       // Current request number: the serial numbers below it have been taken by the threads.
+    volatile LONG        m_serialEpoch;       // Incremented by serialMark, to make the threads give up the serial numbers they hold.
     SIZE_T               m_totalAlloc;        // Grand total - sum of all allocations.
     SIZE_T               m_curAlloc;          // Total amount currently allocated.
-    SIZE_T               m_maxAlloc;          // Largest ever allocated at once.
+    SIZE_T               m_leakCount;         // Mapped blocks counted as leaks (see countBlock).
+    LONG                 m_unclassifiedLeaks; // Counted blocks whose call stacks may still be CRT startup code.
+    SIZE_T               m_reportedMark;      // Blocks with lower serial numbers count as reported.
+    SIZE_T               m_maxAlloc;          // Largest ever allocated at once, give or take VLD_BYTES_FLUSH per thread.
     ModuleSet           *m_loadedModules;     // Contains information about all modules loaded in the process.
+    PVOID                m_dllNotificationCookie; // Loader notification registration, or NULL if not registered.
+    moduleranges_t * volatile m_moduleRanges; // Lock-free copy of the module ranges, consulted by IsExcludedModule.
+    volatile LONG        m_rangeEpoch;        // Epoch of the published module range table.
+    modulecounters_t    *m_moduleCounters [MODULEIMAGES_PAGES]; // Allocation counters of the module images, by image index.
+    patchindex_t * volatile m_patchIndex; // Lock-free index of the patch table, consulted by _GetProcAddress.
     SIZE_T               m_maxDataDump;       // Maximum number of user-data bytes to dump for each leaked block.
-    UINT32               m_maxTraceFrames;    // Maximum number of frames per stack trace for each leaked block.
+    capturepolicy_t      m_initialPolicy;     // The capture policy read from vld.ini, published first.
+    const capturepolicy_t * volatile m_capturePolicy; // The published capture policy, consulted by the hooks.
+    CriticalSection      m_policyLock;        // Serializes publishCapturePolicy.
+    UINT32               m_summaryCount;      // Number of call stacks reported in full by summary reports.
+    UINT32               m_summaryGroupBy;    // What summary reports roll the call stacks up by (see SummaryGroupBy):
+#define VLD_GROUP_BY_STACK    0x0 //   Nothing: each call stack is a site of its own.
+#define VLD_GROUP_BY_FUNCTION 0x1 //   The function they enter the heap from.
+#define VLD_GROUP_BY_MODULE   0x2 //   The module of that function.
+    UINT32               m_threadExitTimeout; // Seconds VLD waits in all for the running threads to exit at shutdown.
+    UINT32               m_metadataReserve;   // Megabytes of address space set aside for metadata (0 to use the private heap).
+    WCHAR                m_metadataFilePath [MAX_PATH]; // Scratch file backing the metadata region, or empty.
+    AddressFilter        m_trackedAddresses;  // Tracked blocks by address, so that frees of untracked ones return early.
+    SIZE_T               m_maxMetadata;       // Bytes of metadata VLD may use before degrading its tracking (0 for no limit).
+    volatile LONG        m_degradation;       // How far tracking has been degraded to stay within m_maxMetadata:
+#define VLD_DEGRADED_NONE      0              //   Not at all.
+#define VLD_DEGRADED_SAMPLING  1              //   Only sampled allocations are tracked.
+#define VLD_DEGRADED_SIZE_ONLY 2              //   Allocations are tracked without call stacks.
+    SIZE_T               m_degradedSerial [3]; // Serial number of the first allocation tracked at each degradation.
+    SIZE_T volatile      m_compactPeak;       // Most bytes in use seen since the block maps were last compacted.
+    volatile LONG        m_compacting;        // Set while a thread compacts the block maps.
+    reportstats_t        m_reportStats;        // Report generation timing.
+    modulestats_t        m_moduleStats;        // Module attach and detach timing.
+    startupstats_t       m_startupStats;       // Installation timing.
+    bool                 m_lockProfiling;      // Whether the main locks count their acquisitions (see LockProfiling).
+    bool                 m_packStacks;         // Whether call stacks are stored as varint deltas (see PackCallStacks).
+    UINT32               m_reallocStackPolicy; // The call stack of a block reallocated in place (see ReallocStackPolicy):
+#define VLD_REALLOC_STACK_ORIGINAL 0x0 //   The allocation's; the reallocation's isn't captured.
+#define VLD_REALLOC_STACK_LATEST   0x1 //   The reallocation's.
+#define VLD_REALLOC_STACK_BOTH     0x2 //   The allocation's; the reallocation's only counts in the site statistics.
+    bool                 m_trackVirtualMemory; // Whether reserved regions and mapped views are tracked (see TrackVirtualMemory).
+    bool                 m_heapWalkTracking;   // Whether blocks are found by walking the heaps instead of hooking (see HeapWalkTracking).
+    bool                 m_fastExit;           // Whether the metadata is left to VLD's heap at process exit (see FastExit).
+    bool                 m_remoteFreeQueue;    // Whether frees of other threads' pending blocks are queued (see RemoteFreeQueue).
+    bool                 m_recentFreeRing;     // Whether each thread remembers the blocks it freed last (see RecentFreeRing).
+    UINT32               m_validateHeapFreeRate; // Frees missing the block maps per validated one, with ValidateHeapAllocs (see ValidateHeapFreeRate).
+    remotefree_t * volatile m_remoteFrees;     // The queued frees, latest first.
+    volatile LONG        m_remoteFreeCount;    // Number of them.
+    bool                 m_traceDatabaseWarned; // Whether the missing stack trace database was reported (see StackWalkMethod = ntdb).
+    CriticalSection      m_virtualLock;        // Protects the tracked regions.
+    VirtualRegionMap    *m_virtualRegions;     // Reserved regions and mapped views, or NULL if they aren't tracked.
+    SIZE_T               m_virtualRegionCount;
+    SIZE_T               m_virtualReserved;    // Bytes reserved or mapped by the tracked regions.
+    SIZE_T               m_virtualCommitted;   //   Bytes committed within them.
+    lockprofile_t        m_lockProfiles [VLD_LOCKS]; // Their counters, by VLD_LOCK_* index.
+    bool                 m_latencyProfiling;   // Whether the heap hooks are timed (see LatencyProfiling).
+    latencyhist_t        m_retiredLatency;     // Latencies of threads which have exited. Protected by m_tlsLock.
+    UINT64               m_lockProfileTicks;   // Time stamp counter when the lock or latency profiles were attached.
+    LONGLONG             m_lockProfileCounter; //   Performance counter at the same time, to convert ticks to time.
+    SIZE_T               m_estimatedLeakBytes; // Estimated total size of the leaks found by the last report, when sampling.
+    UINT32               m_timeResolution;    // Milliseconds between allocation time records (0 records none).
+    CriticalSection      m_timeLock;          // Protects the allocation time records.
+    timerecord_t        *m_timeRecords;       // Ring of the latest VLD_TIME_RECORDS allocation time records, oldest first.
+    SIZE_T               m_timeRecordCount;   // Allocation time records made so far, including overwritten ones.
+    volatile ULONGLONG   m_lastRecordTime;    // Time of the latest allocation time record.
+    SIZE_T               m_reportBefore;      // Reports only cover blocks with lower serial numbers (see ReportLeaksOlderThan).
     CriticalSection      m_modulesLock;       // Protects accesses to the "loaded modules" ModuleSet.
     CriticalSection      m_optionsLock;       // Serializes access to the heap and block maps.
     UINT32               m_options;           // Configuration options.
@@ -381,7 +1382,8 @@ private:
     static patchentry_t  m_ntdllPatch [];
     static patchentry_t  m_ole32Patch [];
     static moduleentry_t m_patchTable [58];   // Table of imports patched for attaching VLD to other modules.
-    FILE                *m_reportFile;        // File where the memory leak report may be sent to.
+    FileStream           m_reportFile;        // File where the memory leak report may be sent to.
+    HANDLE               m_reportPipe;        // Named pipe the report is streamed to instead, if the report file is one.
     WCHAR                m_reportFilePath [MAX_PATH]; // Full path and name of file to send memory leak report to.
     const char          *m_selfTestFile;      // Filename where the memory leak self-test block is leaked.
     int                  m_selfTestLine;      // Line number where the memory leak self-test block is leaked.
@@ -390,22 +1392,268 @@ private:
 #define VLD_STATUS_INSTALLED            0x2   //   If set, VLD was successfully installed.
 #define VLD_STATUS_NEVER_ENABLED        0x4   //   If set, VLD started disabled, and has not yet been manually enabled.
 #define VLD_STATUS_FORCE_REPORT_TO_FILE 0x8   //   If set, the leak report is being forced to a file.
+    volatile LONG        m_tracking;          // What the hooks must look at (see trackingAllocs):
+#define VLD_TRACKING_ALLOCS             0x1   //   If set, some thread may be tracking allocations.
+#define VLD_TRACKING_BLOCKS             0x2   //   If set, blocks have been tracked, so frees are looked up.
     DWORD                m_tlsIndex;          // Thread-local storage index.
     CriticalSection      m_tlsLock;           // Protects accesses to the Set of TLS structures.
     TlsMap              *m_tlsMap;            // Set of all thread-local storage structures for the process.
+    tls_t               *m_freeTls;           // Structures left by exited threads, for new threads to reuse. Protected by m_tlsLock.
+    vldstats_t           m_retiredStats;      // Hot path counters of the exited threads. Protected by m_tlsLock.
+    DWORD               *m_threadTable [VLD_THREAD_TABLE_PAGES]; // Thread IDs by thread table index (see blockinfo_t).
+    UINT                 m_threadCount;       // Thread table indices in use. Protected by m_tlsLock.
+    threadleaks_t       *m_threadLeaks [VLD_THREAD_TABLE_PAGES]; // Leak accounting, by thread table index.
+    LPWSTR              *m_threadNames [VLD_THREAD_TABLE_PAGES]; // Thread descriptions by thread table index, NULL until known.
+    UINT32               m_liveViewInterval;  // Milliseconds between live view updates (0 if the live view is off).
+    WCHAR                m_liveViewName [64]; // Name of the live view's shared memory section.
+    WCHAR                m_symbolStorePath [MAX_PATH]; // Full path of the symbol cache file, or empty if there is none.
+    WCHAR                m_patchPlanCachePath [MAX_PATH]; // Full path of the patch plan cache file, or empty if there is none.
+    WCHAR                m_sizingProfilePath [MAX_PATH]; // Full path of the sizing profile, or empty if there is none.
+    vldsizing_t          m_sizingReserve;     // Sizes read from the sizing profile, all zero without one.
+    vldsizing_t          m_sizingPeak;        // Sizes reached so far by this run, written to the sizing profile.
+    UINT32               m_heapsMapped;       // Number of heaps mapped so far (guarded by g_heapMapLock).
+    WCHAR                m_suppressionFilePath [MAX_PATH]; // Full path of the suppression file, or empty if there is none.
+    UINT32               m_suppressionCount;  // Number of rules read from the suppression file.
+    WCHAR                m_baselineFilePath [MAX_PATH]; // Full path of the baseline file, or empty if there is none.
+    UINT32               m_baselineThreshold; // Bytes a leak site may grow by before it is reported again.
+    HashMap<SIZE_T, UINT32> *m_baselineSites; // Indices in m_baselineRecords by leak site key plus 2, or NULL if the baseline is to be written.
+    struct vldbase_site_t *m_baselineRecords; // The leak sites read from the baseline file.
+    HANDLE               m_liveViewMapping;   // The live view's shared memory section.
+    struct vldlive_t    *m_liveView;          // The live view, mapped into this process.
+    HANDLE               m_liveViewThread;    // Thread which updates the live view.
+    DWORD                m_liveViewThreadId;
+    HANDLE               m_liveViewWake;      // Signaled to stop the live view thread.
+    CriticalSection      m_liveViewLock;      // Held by the live view thread while it updates the live view.
+    volatile BOOL        m_liveViewStop;      // Set (under m_liveViewLock) once the live view is stopped.
+    UINT32               m_perfCounterInterval; // Milliseconds between performance counter updates (0 if they are off).
+    HANDLE               m_perfProvider;      // The perflib provider, or NULL if it isn't registered.
+    struct _PERF_COUNTERSET_INSTANCE *m_perfInstance; // This process's instance of the counter set.
+    HANDLE               m_perfThread;        // Thread which updates the performance counters.
+    DWORD                m_perfThreadId;
+    HANDLE               m_perfWake;          // Signaled to stop the performance counter thread.
+    CriticalSection      m_perfLock;          // Held by the performance counter thread while it updates the counters.
+    volatile BOOL        m_perfStop;          // Set (under m_perfLock) once the performance counters are stopped.
+    WCHAR                m_telemetryFilePath [MAX_PATH]; // Full path of the telemetry file, or empty if there is none.
+    UINT32               m_telemetryInterval; // Milliseconds between telemetry samples.
+    UINT32               m_telemetrySiteCount; // Call stacks with the most growth written per telemetry sample.
+    FILE                *m_telemetryFile;     // The telemetry file, or NULL if telemetry is off.
+    ULONGLONG            m_telemetryStart;    // GetTickCount64 when telemetry started.
+    HashMap<CallStack*, SIZE_T> *m_telemetrySites; // Live bytes of each call stack at the last telemetry sample. Each holds a reference.
+    HANDLE               m_telemetryThread;   // Thread which writes the telemetry samples.
+    DWORD                m_telemetryThreadId;
+    HANDLE               m_telemetryWake;     // Signaled to stop the telemetry thread.
+    CriticalSection      m_telemetryLock;     // Held by the telemetry thread while it writes a sample.
+    volatile BOOL        m_telemetryStop;     // Set (under m_telemetryLock) once telemetry is stopped.
+    WCHAR                m_allocTraceFilePath [MAX_PATH]; // Full path of the allocation trace file, or empty if there is none.
+    volatile BOOL        m_allocTracing;      // Set while allocation events are being recorded.
+    HANDLE               m_allocTraceFile;    // The allocation trace file, or INVALID_HANDLE_VALUE.
+    HANDLE               m_allocTraceMapping; // Mapping of the file up to the end of the current window.
+    BYTE                *m_allocTraceView;    // The current window of the file, or NULL if it couldn't be mapped.
+    UINT64               m_allocTraceWindow;  // File offset of the current window.
+    UINT64               m_allocTraceOffset;  // File offset at which the next bytes are written.
+    UINT64               m_allocTraceEvents;  // Number of events written to the file.
+    vldatrace_header_t   m_allocTraceHeader;  // The file's header, written when the trace is stopped.
+    HANDLE               m_allocTraceThread;  // Thread which drains the threads' event rings.
+    DWORD                m_allocTraceThreadId;
+    HANDLE               m_allocTraceWake;    // Signaled to stop the trace thread.
+    CriticalSection      m_allocTraceLock;    // Protects the trace file; held while any ring is drained.
+    HANDLE               m_prefetchThread;    // Thread which loads the symbols of newly loaded modules.
+    DWORD                m_prefetchThreadId;
+    HANDLE               m_prefetchWake;      // Signaled when modules are queued, or to stop the prefetch thread.
+    CriticalSection      m_prefetchLock;      // Protects the prefetch queue.
+    UINT_PTR             m_prefetchQueue [VLD_PREFETCH_QUEUE]; // Base addresses of the modules to load symbols for.
+    UINT32               m_prefetchHead;      // Index of the first queued module.
+    UINT32               m_prefetchCount;     // Number of queued modules.
+    volatile BOOL        m_prefetchStop;      // Set once the prefetch thread should exit.
+    UINT32               m_symbolServerTimeout; // Milliseconds a module's symbols may take to load before they are fetched in the background (0 for no limit).
+    WCHAR                m_symbolCacheDir [MAX_PATH]; // Downstream store given to the symbol servers of the search path which have none, or empty.
+    LPWSTR               m_symbolServers;     // Symbol servers of the search path, as ";"-separated SymbolServer parameters, or NULL.
+    ULONGLONG            m_symbolLoadStart;   // Tick count when dbghelp started loading the symbols of a module, or 0 (guarded by g_DbgHelp).
+    DWORD64              m_symbolLoadBase;    // Base address of that module.
+    BOOL                 m_symbolLoadCanceled; // Set once that load has been canceled for taking too long.
+    HANDLE               m_symbolFetchThread; // Thread which fetches the symbols of modules from the symbol servers.
+    DWORD                m_symbolFetchThreadId;
+    HANDLE               m_symbolFetchWake;   // Signaled when modules are queued, or to stop the fetch thread.
+    CriticalSection      m_symbolFetchLock;   // Protects the fetch queue.
+    symbolfetch_t        m_symbolFetchQueue [VLD_SYMBOL_FETCH_QUEUE]; // The modules to fetch symbols for.
+    UINT32               m_symbolFetchHead;   // Index of the first queued module.
+    UINT32               m_symbolFetchCount;  // Number of queued modules.
+    volatile BOOL        m_symbolFetchStop;   // Set once the fetch thread should exit.
+    UINT32               m_idleResolveInterval; // Milliseconds between passes of the idle-time resolver (0 if it is off).
+    HANDLE               m_idleResolveThread; // Thread which resolves the call stacks of long-lived blocks.
+    DWORD                m_idleResolveThreadId;
+    HANDLE               m_idleResolveWake;   // Signaled to stop the idle-time resolver.
+    volatile BOOL        m_idleResolveStop;   // Set once the idle-time resolver should exit.
+    UINT32               m_reportThreadCount; // Threads formatting the leaks of text reports besides the reporting thread (see ReportThreads).
+    HANDLE               m_reportThreads [VLD_MAX_REPORT_THREADS];
+    DWORD                m_reportThreadIds [VLD_MAX_REPORT_THREADS];
+    HANDLE               m_reportWork;        // Semaphore released once per report thread when a report is to be formatted.
+    HANDLE               m_reportDone;        // Signaled when the last report thread leaves a report.
+    CriticalSection      m_reportJobLock;     // Protects m_reportJob, m_scanJob and m_symbolJob.
+    reportjob_t         *m_reportJob;         // The report being formatted, or NULL.
+    reachscan_t         *m_scanJob;           // The reachability scan being marked, or NULL.
+    symboljob_t         *m_symbolJob;         // The program counters being resolved with DIA, or NULL.
+    UINT32               m_symbolizer;        // What resolves the call stacks of parallel reports (see Symbolizer):
+#define VLD_SYMBOLIZER_DBGHELP 0x0 //   dbghelp, on the reporting thread.
+#define VLD_SYMBOLIZER_DIA     0x1 //   DIA, on the report threads, ahead of dbghelp.
+    UINT32               m_symbolLevel;       // How far frames are resolved (see SymbolLevel):
+#define VLD_SYMBOLS_NONE     0x0 //   Not at all: frames show their address.
+#define VLD_SYMBOLS_MODULE   0x1 //   To their module and offset within it.
+#define VLD_SYMBOLS_FUNCTION 0x2 //   To their function, without the line.
+#define VLD_SYMBOLS_LINE     0x3 //   To their function and source line.
+    UINT32               m_reachabilityScan;  // The scan made before each report (see ReachabilityScan):
+#define VLD_REACHABILITY_OFF         0x0 //   No scan is made.
+#define VLD_REACHABILITY_LABEL       0x1 //   Each leak is labelled reachable or unreachable.
+#define VLD_REACHABILITY_UNREACHABLE 0x2 //   Only the unreachable leaks are reported.
+    reachscan_t         *m_reachScan;         // The result of the scan made for the current report, or NULL.
+    volatile BOOL        m_reportStop;        // Set once the report threads should exit.
+    SIZE_T               m_growthTrigger;     // Bytes the memory in use must grow by to trigger a growth report (0 for none).
+    SIZE_T volatile      m_growthCheckpoint;  // Bytes in use when the last growth report was triggered.
+    SIZE_T               m_growthSnapshot;    // Snapshot the next growth report is diffed against.
+    HANDLE               m_growthThread;      // Thread which writes the growth reports.
+    DWORD                m_growthThreadId;
+    HANDLE               m_growthWake;        // Signaled when a growth report is triggered, or to stop the thread.
+    volatile BOOL        m_growthStop;        // Set once the growth watchdog thread should exit.
+    bool                 m_autoExcludeHot;    // Whether hot modules which don't leak get excluded (see AutoExcludeHotModules).
+    UINT32               m_hotModuleRate;     // Allocations per second which make a module hot.
+    UINT32               m_hotModuleWarmup;   // Milliseconds before modules are first watched, and of each watch period.
+    HANDLE               m_hotModuleThread;   // Thread which watches the hot modules.
+    DWORD                m_hotModuleThreadId;
+    HANDLE               m_hotModuleWake;     // Signaled to stop the thread.
+    volatile BOOL        m_hotModuleStop;     // Set once the hot module thread should exit.
+    bool                 m_watchIniFile;      // Whether the capture policy is reloaded as vld.ini changes (see WatchIniFile).
+    WCHAR                m_iniFilePath [MAX_PATH]; // The vld.ini file the settings were read from.
+    FILETIME             m_iniWriteTime;      // Last write time of that file, when it was last read.
+    HANDLE               m_iniWatchThread;    // Thread which reloads the capture policy.
+    DWORD                m_iniWatchThreadId;
+    HANDLE               m_iniWatchWake;      // Signaled to stop the thread.
+    HANDLE               m_iniWatchChange;    // Change notification of the file's directory (closed by the thread).
+    volatile BOOL        m_iniWatchStop;      // Set once the ini watch thread should exit.
+    WCHAR                m_crashSnapshotPath [MAX_PATH]; // Full path of the crash snapshot file, or empty if there is none.
+    HANDLE               m_crashFile;         // The crash snapshot file, created ahead of any crash, or INVALID_HANDLE_VALUE.
+    BYTE                *m_crashBuffer;       // The snapshot's write buffer, VLD_CRASH_SNAPSHOT_BUFFER bytes.
+    crashstack_t        *m_crashStacks;       // The snapshot's stack index, VLD_CRASH_SNAPSHOT_STACKS entries.
+    PVOID                m_crashHandler;      // The vectored exception handler which writes the snapshot.
+    LPTOP_LEVEL_EXCEPTION_FILTER m_crashPrevFilter; // The unhandled exception filter VLD's replaced.
+    volatile LONG        m_crashState;        // Whether the snapshot is being or has been written:
+#define VLD_CRASH_IDLE    0 //   Not written yet.
+#define VLD_CRASH_WRITING 1 //   Being written by a crashing thread.
+#define VLD_CRASH_WRITTEN 2 //   Written, or no longer to be written.
+    HANDLE               m_asyncReportThread; // Thread which prints the last asynchronous report.
+    DWORD                m_asyncReportThreadId;
+    LeakSnapshot        *m_asyncReport;       // The leaks it prints.
+    volatile BOOL        m_asyncReportStop;   // Set once the asynchronous report should be abandoned.
     HMODULE              m_vldBase;           // Visual Leak Detector's own module handle (base address).
+    SIZE_T               m_vldSize;           // Size of Visual Leak Detector's own image, or 0 until it is known.
+    InlineHook           m_heapHooks [3];     // Hooks of RtlAllocateHeap, RtlFreeHeap and RtlReAllocateHeap, with InlineHeapHooks.
     HMODULE              m_dbghlpBase;
 
     VOID __stdcall ChangeModuleState(HMODULE module, bool on);
+    VOID   publishModuleRanges ();
+    VOID   reclaimModuleRanges ();
+    // Announces that the calling thread is about to read the module range
+    // table, and obtains it. Every call must be paired with leaveModuleRanges.
+    const moduleranges_t* enterModuleRanges (tls_t *tls)
+    {
+        if (tls->rangeDepth++ == 0) {
+            tls->rangeEpoch = m_rangeEpoch;
+            // The announcement must be visible before the table is read.
+            MemoryBarrier();
+        }
+        return m_moduleRanges;
+    }
+    VOID   leaveModuleRanges (tls_t *tls)
+    {
+        if (--tls->rangeDepth == 0)
+            tls->rangeEpoch = 0;
+    }
+    VOID   publishPatchIndex ();
+    VOID   installHeapHooks ();
+    VOID   removeHeapHooks ();
     static GetProcAddress_t m_GetProcAddress;
     static GetProcAddressForCaller_t m_GetProcAddressForCaller;
+    static GetThreadDescription_t m_GetThreadDescription;
+    static NtQueryInformationThread_t m_NtQueryInformationThread;
     static GetProcessHeap_t m_GetProcessHeap;
     static HeapCreate_t m_HeapCreate;
     static HeapFree_t m_HeapFree;
 };
 
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The ModuleRangesReader Class
+//
+//  Reads the module range table without taking m_modulesLock. For as long as
+//  the reader exists, the table it obtained, and any table published after
+//  it, stays allocated: publishModuleRanges only frees a retired table once
+//  every thread which may have read it has left (epoch-based reclamation).
+//  Readers may be nested.
+//
+class ModuleRangesReader
+{
+public:
+    ModuleRangesReader (VisualLeakDetector &vld, tls_t *tls)
+        : m_vld(vld)
+        , m_tls(tls)
+    {
+        m_table = vld.enterModuleRanges(tls);
+    }
+
+    ~ModuleRangesReader ()
+    {
+        m_vld.leaveModuleRanges(m_tls);
+    }
+
+    // Table - Obtains the module range table, or NULL if none was published.
+    const moduleranges_t* Table () const
+    {
+        return m_table;
+    }
+
+private:
+    ModuleRangesReader (const ModuleRangesReader&); // not allowed
+    ModuleRangesReader& operator = (const ModuleRangesReader&); // not allowed
+    VisualLeakDetector   &m_vld;
+    tls_t                *m_tls;
+    const moduleranges_t *m_table;
+};
+
 
 // Configuration option default values
 #define VLD_DEFAULT_MAX_DATA_DUMP    256
 #define VLD_DEFAULT_MAX_TRACE_FRAMES 64
+#define VLD_DEFAULT_SUMMARY_COUNT    20
+#define VLD_DEFAULT_LIVE_VIEW_INTERVAL 1000
+#define VLD_DEFAULT_PERF_COUNTER_INTERVAL 1000
+#define VLD_DEFAULT_TELEMETRY_INTERVAL 1000
+#define VLD_DEFAULT_TELEMETRY_SITES 10
+#define VLD_DEFAULT_IDLE_RESOLVE_INTERVAL 2000
+#define VLD_IDLE_RESOLVE_SLICE   10       // Milliseconds the idle-time resolver works at a stretch.
+#define VLD_IDLE_RESOLVE_PAUSE   50       // Milliseconds it then leaves dbghelp to the program.
+#define VLD_DEFAULT_HOT_MODULE_RATE   10000 // Allocations per second
+#define VLD_DEFAULT_HOT_MODULE_WARMUP 10000 // Milliseconds
+#define VLD_ALLOCTRACE_WINDOW    0x400000 // Bytes of the allocation trace file mapped at once. A multiple of the allocation granularity.
+#define VLD_ALLOCTRACE_INTERVAL  50       // Milliseconds between drains of the threads' event rings.
+#define VLD_REPORT_PIPE_WAIT     2000     // Milliseconds to wait for a busy report pipe to accept the connection.
+#define VLD_INI_WATCH_SETTLE     200      // Milliseconds vld.ini must be left alone before it's reloaded.
+#define VLD_CRASH_SNAPSHOT_BUFFER 0x10000 // Bytes of the crash snapshot buffered per write.
+#define VLD_CRASH_SNAPSHOT_STACKS 16384   // Entries of the crash snapshot's stack index. A power of two.
+#define VLD_DEFAULT_THREAD_EXIT_TIMEOUT 90 // Seconds
+#define VLD_BUDGET_CHECK_INTERVAL    4096  // Allocations between checks of the metadata budget (a power of two).
+#define VLD_SERIAL_BLOCK             4096  // Serial numbers a thread takes at once (see nextSerial).
+#define VLD_BYTES_FLUSH           0x10000  // Bytes a thread's allocation totals may drift by before they're added in (see recordAlloc).
+#define VLD_COMPACT_MIN_PEAK   (64 * 1024 * 1024) // Bytes in use the program must have peaked at for the block maps to be compacted.
+#define VLD_COMPACT_RATIO      4     // The block maps are compacted once the bytes in use drop below 1/4 of that peak.
+#define VLD_BUDGET_SAMPLING_PERCENT  75    // Share of the budget at which sampling starts.
+#define VLD_BUDGET_SIZE_ONLY_PERCENT 90    // Share of the budget at which call stacks stop being recorded.
+#define VLD_DEGRADED_SAMPLE_BYTES    16384 // Bytes per sample once the budget forces sampling.
+#ifdef _WIN64
+#define VLD_DEFAULT_METADATA_RESERVE 1024
+#else
+#define VLD_DEFAULT_METADATA_RESERVE 64
+#endif
 #define VLD_DEFAULT_REPORT_FILE_NAME L".\\memory_leak_report.txt"
+#define VLD_DEFAULT_BINARY_REPORT_FILE_NAME L".\\memory_leak_report.vldb"
+#define VLD_DEFAULT_JSON_REPORT_FILE_NAME L".\\memory_leak_report.json"
+#define VLD_DEFAULT_CSV_REPORT_FILE_NAME L".\\memory_leak_report.csv"
+#define VLD_DEFAULT_FOLDED_REPORT_FILE_NAME L".\\memory_leak_report.folded"